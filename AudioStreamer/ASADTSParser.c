@@ -0,0 +1,211 @@
+//
+//  ASADTSParser.c
+//  AudioStreamer
+//
+
+#include "ASADTSParser.h"
+#include "ASFrameScanner.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Enough to decide on any frame: a whole frame plus the following header */
+#define kCarrySize (kADTSMaxFrameLength + 16)
+
+/* A frame can hold at most four raw data blocks */
+#define kMaxRawBlocks 4
+
+struct adts_parser {
+  adts_format_callback formatCallback;
+  void                *context;
+  as_frame_scanner_t  *scanner;
+
+  bool          formatReported;
+  adts_header_t format;
+  adts_header_t header;        /* of the frame being scanned */
+  uint64_t      droppedFrames;
+};
+
+static const uint32_t kSampleRates[13] = {
+  96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050, 16000, 12000,
+  11025, 8000, 7350
+};
+
+static const uint8_t kChannels[8] = {0, 1, 2, 3, 4, 5, 6, 8};
+
+bool ASADTSParseHeader(const uint8_t *p, adts_header_t *header) {
+  /* Sync word, then layer 0 */
+  if (p[0] != 0xFF || (p[1] & 0xF6) != 0xF0) return false;
+  uint8_t rateIndex = (p[2] >> 2) & 0xF;
+  uint8_t channelConfig = (uint8_t)(((p[2] & 0x1) << 2) | (p[3] >> 6));
+  if (rateIndex >= 13 || channelConfig == 0) return false;
+
+  header->objectType = (p[2] >> 6) + 1;
+  header->sampleRateIndex = rateIndex;
+  header->channelConfig = channelConfig;
+  header->channels = kChannels[channelConfig];
+  header->crc = (p[1] & 0x1) == 0;
+  header->rawBlocks = (p[6] & 0x3) + 1;
+  header->sampleRate = kSampleRates[rateIndex];
+  header->frameLength = ((uint32_t)(p[3] & 0x3) << 11) | ((uint32_t)p[4] << 3) |
+                        (p[5] >> 5);
+  header->headerLength = 7;
+  if (header->crc) {
+    /* Positions of all but the first block, then the header's CRC */
+    header->headerLength += 2u * (header->rawBlocks - 1) + 2;
+  }
+  return header->frameLength > header->headerLength;
+}
+
+size_t ASADTSMagicCookie(const adts_header_t *format, uint8_t *cookie,
+                         size_t size) {
+  /* AudioSpecificConfig: object type, sample rate index, channels */
+  uint16_t config = (uint16_t)((format->objectType << 11) |
+                               (format->sampleRateIndex << 7) |
+                               (format->channelConfig << 3));
+  const uint8_t descriptor[] = {
+    0x03, 25,                   /* ES_Descriptor */
+      0x00, 0x00,               /* ES_ID */
+      0x00,                     /* flags */
+      0x04, 17,                 /* DecoderConfigDescriptor */
+        0x40,                   /* MPEG-4 audio */
+        0x15,                   /* audio stream */
+        0x00, 0x00, 0x00,       /* buffer size */
+        0x00, 0x00, 0x00, 0x00, /* maximum bitrate */
+        0x00, 0x00, 0x00, 0x00, /* average bitrate */
+        0x05, 2,                /* DecoderSpecificInfo */
+          (uint8_t)(config >> 8), (uint8_t)config,
+      0x06, 1,                  /* SLConfigDescriptor */
+        0x02
+  };
+  if (size < sizeof(descriptor)) return 0;
+  memcpy(cookie, descriptor, sizeof(descriptor));
+  return sizeof(descriptor);
+}
+
+/* Header bytes which stay the same from frame to frame: version, layer, CRC
+   flag, profile, sample rate and channel configuration */
+static void lock_bytes(const uint8_t *p, uint8_t bytes[3]) {
+  bytes[0] = p[1];
+  bytes[1] = p[2] & 0xFD;
+  bytes[2] = p[3] & 0xC0;
+}
+
+static bool is_header(const uint8_t *p) {
+  adts_header_t header;
+  return ASADTSParseHeader(p, &header);
+}
+
+static size_t frame_length(void *context, const uint8_t *p, size_t available,
+                           bool locked) {
+  (void)available;
+  (void)locked;
+  adts_parser_t *parser = context;
+  if (!ASADTSParseHeader(p, &parser->header)) return 0;
+  return parser->header.frameLength;
+}
+
+static void synced(void *context, const uint8_t *p, uint64_t offset) {
+  (void)p;
+  adts_parser_t *parser = context;
+  const adts_header_t *header = &parser->header;
+  if (!parser->formatReported ||
+      parser->format.objectType != header->objectType ||
+      parser->format.sampleRate != header->sampleRate ||
+      parser->format.channelConfig != header->channelConfig) {
+    ASFrameScannerFlush(parser->scanner);
+    parser->format = *header;
+    parser->formatReported = true;
+    parser->formatCallback(parser->context, header, offset);
+  }
+}
+
+/* Hands back the raw data blocks of a complete frame */
+static void emit_frame(void *context, const uint8_t *frame, size_t length) {
+  (void)length;
+  adts_parser_t *parser = context;
+  const adts_header_t *header = &parser->header;
+  const uint8_t *data = frame + header->headerLength;
+  uint32_t dataLength = header->frameLength - header->headerLength;
+  if (header->rawBlocks == 1) {
+    /* With a CRC, each block is followed by a CRC of its own */
+    if (header->crc) {
+      if (dataLength <= 2) return;
+      dataLength -= 2;
+    }
+    ASFrameScannerEmit(parser->scanner, data, dataLength);
+    return;
+  }
+  if (!header->crc) {
+    /* Nothing says where one block ends and the next begins */
+    parser->droppedFrames++;
+    return;
+  }
+
+  uint32_t starts[kMaxRawBlocks + 1];
+  starts[0] = 0;
+  for (uint8_t b = 1; b < header->rawBlocks; b++) {
+    starts[b] = ((uint32_t)frame[7 + 2 * (b - 1)] << 8) | frame[8 + 2 * (b - 1)];
+  }
+  starts[header->rawBlocks] = dataLength;
+  for (uint8_t b = 0; b < header->rawBlocks; b++) {
+    if (starts[b + 1] < starts[b] + 2 + 1 || starts[b + 1] > dataLength) {
+      parser->droppedFrames++;
+      return;
+    }
+  }
+  for (uint8_t b = 0; b < header->rawBlocks; b++) {
+    ASFrameScannerEmit(parser->scanner, data + starts[b], starts[b + 1] - starts[b] - 2);
+  }
+}
+
+static const as_frame_codec_t kADTSCodec = {
+  .headerLength = 7,
+  .isHeader = is_header,
+  .lockBytes = lock_bytes,
+  .frameLength = frame_length,
+  .synced = synced,
+  .frame = emit_frame
+};
+
+adts_parser_t *ASADTSParserCreate(adts_format_callback formatCallback,
+                                  as_packets_callback packetsCallback,
+                                  void *context) {
+  adts_parser_t *parser = calloc(1, sizeof(adts_parser_t));
+  if (parser == NULL) return NULL;
+  parser->scanner = ASFrameScannerCreate(&kADTSCodec, parser, kCarrySize,
+                                         packetsCallback, context);
+  if (parser->scanner == NULL) {
+    free(parser);
+    return NULL;
+  }
+  parser->formatCallback = formatCallback;
+  parser->context = context;
+  ASADTSParserReset(parser);
+  return parser;
+}
+
+void ASADTSParserDestroy(adts_parser_t *parser) {
+  if (parser == NULL) return;
+  ASFrameScannerDestroy(parser->scanner);
+  free(parser);
+}
+
+void ASADTSParserReset(adts_parser_t *parser) {
+  ASFrameScannerReset(parser->scanner);
+  parser->formatReported = false;
+}
+
+void ASADTSParserGetStats(const adts_parser_t *parser, adts_stats_t *stats) {
+  as_frame_stats_t frames;
+  ASFrameScannerGetStats(parser->scanner, &frames);
+  stats->frames = frames.packets;
+  stats->droppedFrames = parser->droppedFrames;
+  stats->skippedBytes = frames.skippedBytes;
+  stats->syncLosses = frames.syncLosses;
+}
+
+void ASADTSParserParse(adts_parser_t *parser, const uint8_t *bytes,
+                       size_t length) {
+  ASFrameScannerParse(parser->scanner, bytes, length);
+}
@@ -0,0 +1,93 @@
+//
+//  ASADTSParser.h
+//  AudioStreamer
+//
+
+#ifndef AS_ADTS_PARSER_H
+#define AS_ADTS_PARSER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ASPacketDesc.h"
+
+/*
+ * AAC ADTS frame scanner.
+ *
+ * Splits a stream of ADTS framed AAC (as sent by Shoutcast and Icecast
+ * servers) into raw AAC packets without the help of AudioFileStream. It works
+ * in the same way as the MP3 scanner: bytes can be fed in chunks of any size,
+ * and packets are handed back a run at a time pointing into the caller's
+ * buffer, with the ADTS header and CRC left out.
+ *
+ * A header is only trusted once the next header follows it with the same
+ * fixed fields (profile, sample rate and channel configuration). If sync is
+ * lost the scanner hunts for the next pair of matching headers. ID3v2 tags in
+ * the stream are skipped. Frames holding several raw data blocks are split
+ * when the header gives their positions, and dropped otherwise. Channel
+ * configuration 0, where the layout is given in the audio data itself, isn't
+ * supported.
+ */
+
+typedef struct adts_parser adts_parser_t;
+
+typedef struct adts_header {
+  uint8_t  objectType;      /* MPEG-4 audio object type, 2 for AAC LC */
+  uint8_t  sampleRateIndex;
+  uint8_t  channelConfig;
+  uint8_t  channels;
+  bool     crc;             /* a CRC follows the header */
+  uint8_t  rawBlocks;       /* raw data blocks in the frame */
+  uint32_t sampleRate;
+  uint32_t frameLength;     /* bytes including the header */
+  uint32_t headerLength;    /* 7, or 9 with a CRC */
+} adts_header_t;
+
+typedef struct adts_stats {
+  uint64_t frames;          /* packets handed back */
+  uint64_t droppedFrames;   /* frames which couldn't be split into packets */
+  uint64_t skippedBytes;    /* bytes discarded while looking for sync */
+  uint64_t syncLosses;      /* times the expected next frame wasn't there */
+} adts_stats_t;
+
+/* Invoked when the first frame is found, and again if the format changes.
+   offset is where that frame starts, counted from the first byte fed since
+   the parser was created or reset */
+typedef void (*adts_format_callback)(void *context, const adts_header_t *format,
+                                     uint64_t offset);
+
+/* Largest frame an ADTS header can describe */
+#define kADTSMaxFrameLength 8191
+
+/* Samples in each packet */
+#define kADTSFramesPerPacket 1024
+
+/* Decodes the header at p, which must have at least 7 bytes. Returns false if
+   it isn't a valid ADTS header */
+bool ASADTSParseHeader(const uint8_t *p, adts_header_t *header);
+
+/* Writes the MPEG-4 elementary stream descriptor for the format into cookie,
+   which is what CoreAudio takes as the magic cookie for AAC. Returns the
+   number of bytes written, or 0 if size is too small */
+size_t ASADTSMagicCookie(const adts_header_t *format, uint8_t *cookie,
+                         size_t size);
+
+/* Creates a parser. Returns NULL if allocation fails */
+adts_parser_t *ASADTSParserCreate(adts_format_callback formatCallback,
+                                  as_packets_callback packetsCallback,
+                                  void *context);
+
+void ASADTSParserDestroy(adts_parser_t *parser);
+
+/* Forgets any partial frame and the current sync, for example after a seek.
+   The format is reported again with the next frame */
+void ASADTSParserReset(adts_parser_t *parser);
+
+/* Scans the next chunk of data, invoking the callbacks as frames are found */
+void ASADTSParserParse(adts_parser_t *parser, const uint8_t *bytes,
+                       size_t length);
+
+void ASADTSParserGetStats(const adts_parser_t *parser, adts_stats_t *stats);
+
+#endif
@@ -0,0 +1,152 @@
+//
+//  ASBufferController.c
+//  AudioStreamer
+//
+
+#include "ASBufferController.h"
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+/* Throughput is sampled over at least this many seconds of reading */
+#define kSampleInterval   0.5
+/* Weight in the mean and variance of a sample kSampleInterval long. Longer
+   samples (such as one spanning a network outage) weigh more */
+#define kSampleWeight     0.2
+
+/* Watermarks, in seconds of audio */
+#define kMinLow           1.5
+#define kMaxLow           30.0
+#define kMinHigh          6.0
+#define kMaxHigh          60.0
+/* Playback should last this long on a network slower than the stream */
+#define kSlowRunLength    60.0
+/* Added to the low watermark by each stall, and how much of it remains
+   after each sample */
+#define kStallBoost       3.0
+#define kStallDecay       0.98
+/* How much of the longest gap between reads is remembered after each
+   sample */
+#define kGapDecay         0.995
+
+struct buffer_controller {
+  double bitrate;
+
+  /* Sample being gathered */
+  bool   reading;
+  double windowStart;
+  double lastRead;
+  size_t windowBytes;
+
+  /* Estimate */
+  unsigned samples;
+  double   mean;
+  double   variance;
+  double   stallBoost;
+  double   longestGap; /* seconds without any bytes while reading */
+};
+
+buffer_controller_t *ASBufferControllerCreate(void) {
+  return calloc(1, sizeof(buffer_controller_t));
+}
+
+void ASBufferControllerDestroy(buffer_controller_t *controller) {
+  free(controller);
+}
+
+void ASBufferControllerSetBitrate(buffer_controller_t *controller,
+                                  double bitrate) {
+  controller->bitrate = bitrate;
+}
+
+static void add_sample(buffer_controller_t *controller, double rate,
+                       double elapsed) {
+  if (controller->samples++ == 0) {
+    controller->mean = rate;
+    controller->variance = 0;
+  } else {
+    double weight = 1 - pow(1 - kSampleWeight, elapsed / kSampleInterval);
+    double diff = rate - controller->mean;
+    controller->mean += weight * diff;
+    controller->variance = (1 - weight) *
+                           (controller->variance + weight * diff * diff);
+  }
+  controller->stallBoost *= kStallDecay;
+  controller->longestGap *= kGapDecay;
+}
+
+void ASBufferControllerAddBytes(buffer_controller_t *controller, size_t bytes,
+                                double now) {
+  if (!controller->reading) {
+    /* The bytes are what arrived since reading started; the time they took
+       is unknown, so they only mark the start */
+    controller->reading = true;
+    controller->windowStart = now;
+    controller->windowBytes = 0;
+    controller->lastRead = now;
+    return;
+  }
+  controller->longestGap = fmax(controller->longestGap, now - controller->lastRead);
+  controller->lastRead = now;
+  controller->windowBytes += bytes;
+  double elapsed = now - controller->windowStart;
+  if (elapsed < kSampleInterval) return;
+
+  add_sample(controller, controller->windowBytes * 8.0 / elapsed, elapsed);
+  controller->windowStart = now;
+  controller->windowBytes = 0;
+}
+
+void ASBufferControllerIdle(buffer_controller_t *controller) {
+  controller->reading = false;
+}
+
+void ASBufferControllerStall(buffer_controller_t *controller) {
+  controller->stallBoost += kStallBoost;
+}
+
+double ASBufferControllerThroughput(const buffer_controller_t *controller,
+                                    double *deviation) {
+  if (controller->samples == 0) {
+    if (deviation != NULL) *deviation = 0;
+    return 0;
+  }
+  if (deviation != NULL) *deviation = sqrt(controller->variance);
+  return controller->mean;
+}
+
+static double clamp(double value, double low, double high) {
+  return value < low ? low : value > high ? high : value;
+}
+
+void ASBufferControllerGetWatermarks(const buffer_controller_t *controller,
+                                     buffer_watermarks_t *watermarks) {
+  double deviation;
+  double mean = ASBufferControllerThroughput(controller, &deviation);
+  if (mean <= 0 || controller->bitrate <= 0) {
+    watermarks->low = clamp(kMinLow + controller->stallBoost, kMinLow, kMaxLow);
+    watermarks->high = clamp(fmax(kMinHigh, watermarks->low) * 2, kMinHigh, kMaxHigh);
+    return;
+  }
+
+  /* How fast audio arrives compared to how fast it plays, in a bad moment,
+     and how erratic the network is */
+  double ratio = (mean - deviation) / controller->bitrate;
+  double spread = deviation / mean;
+
+  /* Enough to ride out the network going quiet for as long as it has been
+     seen to */
+  double gap = controller->longestGap;
+  double low = kMinLow * (1 + spread) + controller->stallBoost + gap / 2;
+  if (ratio < 1) {
+    /* The buffer drains by (1 - ratio) seconds each second */
+    low += (1 - fmax(ratio, 0)) * kSlowRunLength;
+  }
+  watermarks->low = clamp(low, kMinLow, kMaxLow);
+
+  double high = kMinHigh * (1 + 2 * spread);
+  if (ratio < 1.5) high += (1.5 - fmax(ratio, 0)) * kMaxHigh;
+  high = fmax(high, fmax(watermarks->low * 2, gap * 2));
+  watermarks->high = clamp(high, kMinHigh, kMaxHigh);
+}
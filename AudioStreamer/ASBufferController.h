@@ -0,0 +1,69 @@
+//
+//  ASBufferController.h
+//  AudioStreamer
+//
+
+#ifndef AS_BUFFER_CONTROLLER_H
+#define AS_BUFFER_CONTROLLER_H
+
+#include <stddef.h>
+
+/*
+ * Decides how much audio to keep buffered, from how fast it downloads.
+ *
+ * Download throughput is sampled over short stretches of time in which the
+ * stream was actually being read (stretches where reading was held back
+ * because the buffers were full don't say anything about the network). The
+ * samples feed an exponentially weighted mean and variance.
+ *
+ * The throughput, less one standard deviation, is compared with the stream's
+ * bitrate to give two watermarks in seconds of audio:
+ *
+ *  - the low watermark is how much to buffer before playback starts again
+ *    after running dry. It grows as the network gets slower relative to the
+ *    stream or less steady, and after each stall.
+ *  - the high watermark is how much to buffer at most. A fast, steady network
+ *    only needs a few seconds in hand; a slow or erratic one needs more.
+ *
+ * This is plain C without any CoreFoundation dependency.
+ */
+
+typedef struct buffer_controller buffer_controller_t;
+
+typedef struct buffer_watermarks {
+  double low;    /* seconds of audio to buffer before (re)starting */
+  double high;   /* seconds of audio to buffer at most */
+} buffer_watermarks_t;
+
+/* Creates a controller with no throughput samples yet. Returns NULL if
+   allocation fails */
+buffer_controller_t *ASBufferControllerCreate(void);
+
+void ASBufferControllerDestroy(buffer_controller_t *controller);
+
+/* Gives the stream's bitrate, in bits per second */
+void ASBufferControllerSetBitrate(buffer_controller_t *controller,
+                                  double bitrate);
+
+/* Records bytes downloaded at the given time (in seconds, from any fixed
+   point) */
+void ASBufferControllerAddBytes(buffer_controller_t *controller, size_t bytes,
+                                double now);
+
+/* Marks that downloading stopped on purpose (the buffers were full, or the
+   connection is being changed), so the time until the next bytes isn't
+   counted */
+void ASBufferControllerIdle(buffer_controller_t *controller);
+
+/* Records that playback ran out of audio */
+void ASBufferControllerStall(buffer_controller_t *controller);
+
+void ASBufferControllerGetWatermarks(const buffer_controller_t *controller,
+                                     buffer_watermarks_t *watermarks);
+
+/* Estimated throughput in bits per second and its standard deviation, if
+   deviation isn't NULL. Returns 0 if there are no samples yet */
+double ASBufferControllerThroughput(const buffer_controller_t *controller,
+                                    double *deviation);
+
+#endif
@@ -0,0 +1,208 @@
+//
+//  ASCFTransport.c
+//  AudioStreamer
+//
+
+#include "ASCFTransport.h"
+
+#include <CFNetwork/CFNetwork.h>
+#include <stdlib.h>
+
+typedef struct cf_transport {
+  transport_t     transport;    /* must be first */
+  CFReadStreamRef stream;
+  CFRunLoopRef    runLoop;
+
+  /* The HTTP response, copied once the stream has one */
+  bool            responseCopied;
+  int             statusCode;
+  char          **headerNames;
+  char          **headerValues;
+  size_t          headerCount;
+
+  char           *error;
+} cf_transport_t;
+
+static char *copy_c_string(CFStringRef string) {
+  CFIndex size = CFStringGetMaximumSizeForEncoding(CFStringGetLength(string),
+                                                   kCFStringEncodingUTF8) + 1;
+  char *result = malloc((size_t)size);
+  if (result != NULL &&
+      !CFStringGetCString(string, result, size, kCFStringEncodingUTF8)) {
+    result[0] = '\0';
+  }
+  return result;
+}
+
+static void copy_response(cf_transport_t *cf) {
+  if (cf->responseCopied) return;
+  CFHTTPMessageRef message = (CFHTTPMessageRef)
+    CFReadStreamCopyProperty(cf->stream, kCFStreamPropertyHTTPResponseHeader);
+  if (message == NULL) return;
+  if (!CFHTTPMessageIsHeaderComplete(message)) {
+    CFRelease(message);
+    return;
+  }
+  cf->responseCopied = true;
+  cf->statusCode = (int)CFHTTPMessageGetResponseStatusCode(message);
+
+  CFDictionaryRef headers = CFHTTPMessageCopyAllHeaderFields(message);
+  CFRelease(message);
+  if (headers == NULL) return;
+  CFIndex count = CFDictionaryGetCount(headers);
+  const void **keys = malloc((size_t)count * sizeof(void*));
+  const void **values = malloc((size_t)count * sizeof(void*));
+  cf->headerNames = calloc((size_t)count, sizeof(char*));
+  cf->headerValues = calloc((size_t)count, sizeof(char*));
+  if (keys != NULL && values != NULL && cf->headerNames != NULL &&
+      cf->headerValues != NULL) {
+    CFDictionaryGetKeysAndValues(headers, keys, values);
+    for (CFIndex i = 0; i < count; i++) {
+      char *name = copy_c_string(keys[i]);
+      char *value = copy_c_string(values[i]);
+      if (name == NULL || value == NULL) {
+        free(name);
+        free(value);
+        continue;
+      }
+      cf->headerNames[cf->headerCount] = name;
+      cf->headerValues[cf->headerCount] = value;
+      cf->headerCount++;
+    }
+  }
+  free(keys);
+  free(values);
+  CFRelease(headers);
+}
+
+static void cf_callback(CFReadStreamRef stream, CFStreamEventType eventType,
+                        void *info) {
+  (void)stream;
+  transport_t *transport = info;
+  switch (eventType) {
+    case kCFStreamEventHasBytesAvailable:
+      ASTransportNotify(transport, TRANSPORT_EVENT_READABLE);
+      break;
+    case kCFStreamEventEndEncountered:
+      ASTransportNotify(transport, TRANSPORT_EVENT_END);
+      break;
+    case kCFStreamEventErrorOccurred:
+      ASTransportNotify(transport, TRANSPORT_EVENT_ERROR);
+      break;
+    default:
+      break;
+  }
+}
+
+static ssize_t cf_read(transport_t *transport, void *buffer, size_t length) {
+  cf_transport_t *cf = (cf_transport_t *)transport;
+  return CFReadStreamRead(cf->stream, buffer, (CFIndex)length);
+}
+
+static bool cf_has_bytes(transport_t *transport) {
+  return CFReadStreamHasBytesAvailable(((cf_transport_t *)transport)->stream);
+}
+
+static bool cf_at_end(transport_t *transport) {
+  return CFReadStreamGetStatus(((cf_transport_t *)transport)->stream) ==
+         kCFStreamStatusAtEnd;
+}
+
+static void cf_set_paused(transport_t *transport, bool paused) {
+  cf_transport_t *cf = (cf_transport_t *)transport;
+  if (paused) {
+    CFReadStreamUnscheduleFromRunLoop(cf->stream, cf->runLoop,
+                                      kCFRunLoopCommonModes);
+  } else {
+    CFReadStreamScheduleWithRunLoop(cf->stream, cf->runLoop,
+                                    kCFRunLoopCommonModes);
+  }
+}
+
+static int cf_status(transport_t *transport) {
+  cf_transport_t *cf = (cf_transport_t *)transport;
+  copy_response(cf);
+  return cf->statusCode;
+}
+
+static size_t cf_header_count(transport_t *transport) {
+  cf_transport_t *cf = (cf_transport_t *)transport;
+  copy_response(cf);
+  return cf->headerCount;
+}
+
+static bool cf_header(transport_t *transport, size_t index, const char **name,
+                      const char **value) {
+  cf_transport_t *cf = (cf_transport_t *)transport;
+  copy_response(cf);
+  if (index >= cf->headerCount) return false;
+  *name = cf->headerNames[index];
+  *value = cf->headerValues[index];
+  return true;
+}
+
+static const char *cf_error(transport_t *transport) {
+  cf_transport_t *cf = (cf_transport_t *)transport;
+  if (cf->error != NULL) return cf->error;
+  CFErrorRef error = CFReadStreamCopyError(cf->stream);
+  if (error == NULL) return NULL;
+  CFStringRef description = CFErrorCopyDescription(error);
+  CFRelease(error);
+  if (description == NULL) return NULL;
+  cf->error = copy_c_string(description);
+  CFRelease(description);
+  return cf->error;
+}
+
+static void cf_close(transport_t *transport) {
+  cf_transport_t *cf = (cf_transport_t *)transport;
+  CFReadStreamSetClient(cf->stream, kCFStreamEventNone, NULL, NULL);
+  if (!ASTransportIsPaused(transport)) {
+    CFReadStreamUnscheduleFromRunLoop(cf->stream, cf->runLoop,
+                                      kCFRunLoopCommonModes);
+  }
+  CFReadStreamClose(cf->stream);
+  CFRelease(cf->stream);
+  for (size_t i = 0; i < cf->headerCount; i++) {
+    free(cf->headerNames[i]);
+    free(cf->headerValues[i]);
+  }
+  free(cf->headerNames);
+  free(cf->headerValues);
+  free(cf->error);
+  free(cf);
+}
+
+static const transport_ops_t cf_ops = {
+  .read = cf_read,
+  .hasBytesAvailable = cf_has_bytes,
+  .atEnd = cf_at_end,
+  .setPaused = cf_set_paused,
+  .statusCode = cf_status,
+  .headerCount = cf_header_count,
+  .header = cf_header,
+  .error = cf_error,
+  .close = cf_close,
+};
+
+transport_t *ASCFTransportCreate(CFReadStreamRef stream,
+                                 transport_event_proc proc, void *context) {
+  cf_transport_t *cf = calloc(1, sizeof(cf_transport_t));
+  if (cf == NULL) return NULL;
+  ASTransportInit(&cf->transport, &cf_ops, proc, context);
+  if (!CFReadStreamOpen(stream)) {
+    free(cf);
+    return NULL;
+  }
+  cf->stream = (CFReadStreamRef)CFRetain(stream);
+  cf->runLoop = CFRunLoopGetCurrent();
+
+  CFStreamClientContext clientContext = {0, cf, NULL, NULL, NULL};
+  CFReadStreamSetClient(stream,
+                        kCFStreamEventHasBytesAvailable |
+                          kCFStreamEventErrorOccurred |
+                          kCFStreamEventEndEncountered,
+                        cf_callback, &clientContext);
+  CFReadStreamScheduleWithRunLoop(stream, cf->runLoop, kCFRunLoopCommonModes);
+  return &cf->transport;
+}
@@ -0,0 +1,29 @@
+//
+//  ASCFTransport.h
+//  AudioStreamer
+//
+
+#ifndef AS_CF_TRANSPORT_H
+#define AS_CF_TRANSPORT_H
+
+#include <CoreFoundation/CoreFoundation.h>
+
+#include "ASTransport.h"
+
+/*
+ * Transport reading a CFReadStream.
+ *
+ * This is how bytes are read from the disk cache, and from servers the HTTP
+ * client can't talk to (https ones, or ones only a proxy auto-configuration
+ * script knows the way to). The stream is scheduled on the run loop of the
+ * thread the transport is created on, and taken off it while the transport is
+ * paused. If the stream is an HTTP one, its response gives the status code and
+ * headers.
+ */
+
+/* Opens the stream, which the transport keeps a reference to. Returns NULL if
+   it can't be opened or allocation fails */
+transport_t *ASCFTransportCreate(CFReadStreamRef stream,
+                                 transport_event_proc proc, void *context);
+
+#endif
@@ -0,0 +1,145 @@
+//
+//  ASCrossfade.c
+//  AudioStreamer
+//
+
+#include "ASCrossfade.h"
+
+#include <math.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Gains are computed this many frames at a time */
+#define kGainBlockFrames 256
+
+struct crossfade {
+  /* Request from the starting thread, guarded by a sequence number which is
+     odd while the fields are being written */
+  atomic_uint      sequence;
+  atomic_int       requestDirection;
+  atomic_uint_fast64_t requestFrames;
+
+  /* Time spent applying the fade, read from any thread */
+  atomic_uint_fast64_t cpuTime;
+
+  /* The fade being applied, touched only by the processing thread */
+  unsigned         latched;    /* sequence of the request taken up */
+  crossfade_direction_t direction;
+  uint64_t         length;
+  uint64_t         position;   /* frames of the fade already processed */
+};
+
+crossfade_t *ASCrossfadeCreate(void) {
+  crossfade_t *fade = calloc(1, sizeof(crossfade_t));
+  if (fade == NULL) return NULL;
+  atomic_init(&fade->sequence, 0);
+  atomic_init(&fade->requestDirection, CROSSFADE_NONE);
+  atomic_init(&fade->requestFrames, 0);
+  atomic_init(&fade->cpuTime, 0);
+  return fade;
+}
+
+void ASCrossfadeDestroy(crossfade_t *fade) {
+  free(fade);
+}
+
+void ASCrossfadeStart(crossfade_t *fade, crossfade_direction_t direction,
+                      uint64_t frames) {
+  unsigned seq = atomic_load_explicit(&fade->sequence, memory_order_relaxed);
+  atomic_store_explicit(&fade->sequence, seq + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  atomic_store_explicit(&fade->requestDirection, direction, memory_order_relaxed);
+  atomic_store_explicit(&fade->requestFrames, frames, memory_order_relaxed);
+  atomic_store_explicit(&fade->sequence, seq + 2, memory_order_release);
+}
+
+uint64_t ASCrossfadeCPUTime(const crossfade_t *fade) {
+  return atomic_load_explicit(&fade->cpuTime, memory_order_relaxed);
+}
+
+/* Takes up a new request, unless one is half written (it's then taken up on
+   the next block) */
+static void latch_request(crossfade_t *fade) {
+  unsigned seq = atomic_load_explicit(&fade->sequence, memory_order_acquire);
+  if (seq == fade->latched || (seq & 1)) return;
+  int direction = atomic_load_explicit(&fade->requestDirection, memory_order_relaxed);
+  uint64_t frames = atomic_load_explicit(&fade->requestFrames, memory_order_relaxed);
+  atomic_thread_fence(memory_order_acquire);
+  if (atomic_load_explicit(&fade->sequence, memory_order_relaxed) != seq) return;
+
+  fade->latched = seq;
+  fade->direction = frames > 0 ? (crossfade_direction_t)direction : CROSSFADE_NONE;
+  fade->length = frames;
+  fade->position = 0;
+  atomic_store_explicit(&fade->cpuTime, 0, memory_order_relaxed);
+}
+
+/* Fills in the gains for the next count frames of the ramp, which must all
+   lie within it. The angle is worked out once and then stepped by rotation */
+static void ramp_gains(const crossfade_t *fade, float *gains, uint32_t count) {
+  double step = M_PI_2 / (double)fade->length;
+  double angle = step * (double)fade->position;
+  double s = sin(angle), c = cos(angle);
+  double ds = sin(step), dc = cos(step);
+  bool in = fade->direction == CROSSFADE_IN;
+  for (uint32_t i = 0; i < count; i++) {
+    gains[i] = (float)(in ? s : c);
+    double ns = s * dc + c * ds;
+    c = c * dc - s * ds;
+    s = ns;
+  }
+}
+
+static void scale(float *restrict samples, const float *restrict gains,
+                  uint32_t count) {
+  for (uint32_t i = 0; i < count; i++) {
+    samples[i] *= gains[i];
+  }
+}
+
+static uint64_t cpu_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+void ASCrossfadeProcess(crossfade_t *fade, float *const *channels,
+                        uint32_t channelCount, uint32_t frames) {
+  latch_request(fade);
+  if (fade->direction == CROSSFADE_NONE) return;
+  uint64_t start = cpu_now();
+
+  float gains[kGainBlockFrames];
+  uint32_t done = 0;
+  while (done < frames) {
+    uint32_t count = frames - done;
+    if (fade->position >= fade->length) {
+      /* Past the end of the ramp */
+      if (fade->direction == CROSSFADE_OUT) {
+        for (uint32_t ch = 0; ch < channelCount; ch++) {
+          memset(channels[ch] + done, 0, count * sizeof(float));
+        }
+      } else {
+        fade->direction = CROSSFADE_NONE;
+      }
+      fade->position += count;
+      break;
+    }
+    if (count > kGainBlockFrames) count = kGainBlockFrames;
+    if (count > fade->length - fade->position) {
+      count = (uint32_t)(fade->length - fade->position);
+    }
+    ramp_gains(fade, gains, count);
+    for (uint32_t ch = 0; ch < channelCount; ch++) {
+      scale(channels[ch] + done, gains, count);
+    }
+    fade->position += count;
+    done += count;
+  }
+
+  atomic_fetch_add_explicit(&fade->cpuTime, cpu_now() - start,
+                            memory_order_relaxed);
+}
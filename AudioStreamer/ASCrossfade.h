@@ -0,0 +1,59 @@
+//
+//  ASCrossfade.h
+//  AudioStreamer
+//
+
+#ifndef AS_CROSSFADE_H
+#define AS_CROSSFADE_H
+
+#include <stdint.h>
+
+/*
+ * Equal-power fades applied to decoded PCM.
+ *
+ * In a crossfade one stream fades out while another fades in over the same
+ * frames. The outgoing stream is scaled by cos(x * pi/2) and the incoming one
+ * by sin(x * pi/2) as x goes from 0 to 1, so the summed power stays constant
+ * instead of dipping halfway through as it does with linear ramps.
+ *
+ * A fade is started from one thread (the main thread) and applied to blocks
+ * of audio on another (the audio thread). Starting one only posts a request
+ * which the audio thread takes up at the start of its next block, so neither
+ * side ever waits on the other.
+ *
+ * Gains are worked out for a run of frames at a time and then multiplied into
+ * each channel in a tight loop which the compiler vectorizes.
+ *
+ * This is plain C without any CoreFoundation dependency.
+ */
+
+typedef struct crossfade crossfade_t;
+
+typedef enum crossfade_direction {
+  CROSSFADE_NONE = 0,   /* audio passes through untouched */
+  CROSSFADE_IN,         /* from silence up to full level */
+  CROSSFADE_OUT         /* from full level down to silence, and silent after */
+} crossfade_direction_t;
+
+/* Creates a fader which leaves audio untouched. Returns NULL if allocation
+   fails */
+crossfade_t *ASCrossfadeCreate(void);
+
+void ASCrossfadeDestroy(crossfade_t *fade);
+
+/* Starts a fade lasting the given number of frames, replacing any other. It
+   begins with the next block processed. CROSSFADE_NONE cancels a fade */
+void ASCrossfadeStart(crossfade_t *fade, crossfade_direction_t direction,
+                      uint64_t frames);
+
+/* Applies the fade to a block of non-interleaved float samples, one pointer
+   per channel, and moves on by that many frames. Only to be called from one
+   thread at a time */
+void ASCrossfadeProcess(crossfade_t *fade, float *const *channels,
+                        uint32_t channelCount, uint32_t frames);
+
+/* CPU time in nanoseconds spent by ASCrossfadeProcess on the current (or
+   last) fade */
+uint64_t ASCrossfadeCPUTime(const crossfade_t *fade);
+
+#endif
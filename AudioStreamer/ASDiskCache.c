@@ -0,0 +1,589 @@
+//
+//  ASDiskCache.c
+//  AudioStreamer
+//
+
+#include "ASDiskCache.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Index files start with this, followed by the format version */
+#define kIndexMagic   0x43445341 /* "ASDC" */
+#define kIndexVersion 1
+
+/* Entry files are named after a 64 bit hash of the key in hex */
+#define kNameLength 16
+
+typedef struct byte_range {
+  uint64_t start;
+  uint64_t end;             /* exclusive */
+} byte_range_t;
+
+struct disk_cache {
+  char              *directory;
+  uint64_t           sizeLimit;
+  disk_cache_entry_t *openEntries;
+  disk_cache_stats_t stats;
+  bool               destroyed;   /* waiting for its entries to be closed */
+};
+
+struct disk_cache_entry {
+  disk_cache_t       *cache;
+  disk_cache_entry_t *next;         /* in the cache's list of open entries */
+  char                name[kNameLength + 1];
+  char               *key;
+
+  uint64_t length;
+  char    *validator;
+  uint8_t *metadata;
+  size_t   metadataLength;
+
+  /* Cached ranges, sorted and never touching each other */
+  byte_range_t *ranges;
+  size_t        rangeCount;
+  size_t        rangeCapacity;
+
+  int      fd;
+  uint8_t *map;
+};
+
+/* FNV-1a */
+static uint64_t hash_key(const char *key) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (const char *c = key; *c != '\0'; c++) {
+    hash ^= (uint8_t)*c;
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+static char *entry_path(const disk_cache_t *cache, const char *name,
+                        const char *extension) {
+  size_t size = strlen(cache->directory) + 1 + kNameLength + 1 +
+                strlen(extension) + 1;
+  char *path = malloc(size);
+  if (path == NULL) return NULL;
+  snprintf(path, size, "%s/%s.%s", cache->directory, name, extension);
+  return path;
+}
+
+/* Index I/O */
+
+static bool write_field(FILE *file, const void *data, uint32_t length) {
+  return fwrite(&length, sizeof(length), 1, file) == 1 &&
+         (length == 0 || fwrite(data, length, 1, file) == 1);
+}
+
+static void *read_field(FILE *file, uint32_t *length) {
+  if (fread(length, sizeof(*length), 1, file) != 1) return NULL;
+  /* One extra byte so that strings come back terminated */
+  uint8_t *data = malloc((size_t)*length + 1);
+  if (data == NULL) return NULL;
+  if (*length > 0 && fread(data, *length, 1, file) != 1) {
+    free(data);
+    return NULL;
+  }
+  data[*length] = '\0';
+  return data;
+}
+
+/* Writes the index to a temporary file and moves it into place, so that an
+   index on disk is always whole */
+static void save_index(const disk_cache_entry_t *entry) {
+  char *path = entry_path(entry->cache, entry->name, "index");
+  char *temp = entry_path(entry->cache, entry->name, "index.tmp");
+  if (path == NULL || temp == NULL) goto out;
+
+  FILE *file = fopen(temp, "wb");
+  if (file == NULL) goto out;
+  uint32_t header[2] = {kIndexMagic, kIndexVersion};
+  uint64_t lastUsed = (uint64_t)time(NULL);
+  uint32_t rangeCount = (uint32_t)entry->rangeCount;
+  const char *validator = entry->validator ? entry->validator : "";
+  bool ok = fwrite(header, sizeof(header), 1, file) == 1 &&
+            fwrite(&lastUsed, sizeof(lastUsed), 1, file) == 1 &&
+            fwrite(&entry->length, sizeof(entry->length), 1, file) == 1 &&
+            write_field(file, entry->key, (uint32_t)strlen(entry->key)) &&
+            write_field(file, validator, (uint32_t)strlen(validator)) &&
+            write_field(file, entry->metadata, (uint32_t)entry->metadataLength) &&
+            fwrite(&rangeCount, sizeof(rangeCount), 1, file) == 1 &&
+            (rangeCount == 0 ||
+             fwrite(entry->ranges, sizeof(byte_range_t), rangeCount, file) == rangeCount);
+  if (fclose(file) != 0) ok = false;
+  if (!ok || rename(temp, path) != 0) unlink(temp);
+
+out:
+  free(path);
+  free(temp);
+}
+
+/* Reads just the time an index was last used. Returns false if the file
+   isn't an index */
+static bool read_last_used(const char *path, uint64_t *lastUsed) {
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) return false;
+  uint32_t header[2];
+  bool ok = fread(header, sizeof(header), 1, file) == 1 &&
+            header[0] == kIndexMagic && header[1] == kIndexVersion &&
+            fread(lastUsed, sizeof(*lastUsed), 1, file) == 1;
+  fclose(file);
+  return ok;
+}
+
+static void load_index(disk_cache_entry_t *entry) {
+  char *path = entry_path(entry->cache, entry->name, "index");
+  if (path == NULL) return;
+  FILE *file = fopen(path, "rb");
+  free(path);
+  if (file == NULL) return;
+
+  uint32_t header[2];
+  uint64_t lastUsed, length;
+  uint32_t keyLength, validatorLength, metadataLength, rangeCount;
+  char *key = NULL, *validator = NULL;
+  uint8_t *metadata = NULL;
+  byte_range_t *ranges = NULL;
+  if (fread(header, sizeof(header), 1, file) != 1 ||
+      header[0] != kIndexMagic || header[1] != kIndexVersion ||
+      fread(&lastUsed, sizeof(lastUsed), 1, file) != 1 ||
+      fread(&length, sizeof(length), 1, file) != 1 ||
+      (key = read_field(file, &keyLength)) == NULL ||
+      strcmp(key, entry->key) != 0 ||  /* a different key with the same hash */
+      (validator = read_field(file, &validatorLength)) == NULL ||
+      (metadata = read_field(file, &metadataLength)) == NULL ||
+      fread(&rangeCount, sizeof(rangeCount), 1, file) != 1) {
+    goto fail;
+  }
+  if (rangeCount > 0) {
+    ranges = malloc(rangeCount * sizeof(byte_range_t));
+    if (ranges == NULL ||
+        fread(ranges, sizeof(byte_range_t), rangeCount, file) != rangeCount) {
+      goto fail;
+    }
+    /* Don't trust ranges which are out of order or past the end */
+    for (uint32_t i = 0; i < rangeCount; i++) {
+      if (ranges[i].start >= ranges[i].end || ranges[i].end > length ||
+          (i > 0 && ranges[i].start <= ranges[i - 1].end)) {
+        goto fail;
+      }
+    }
+  }
+  fclose(file);
+
+  entry->length = length;
+  entry->validator = validator;
+  entry->metadata = metadata;
+  entry->metadataLength = metadataLength;
+  entry->ranges = ranges;
+  entry->rangeCount = entry->rangeCapacity = rangeCount;
+  free(key);
+  return;
+
+fail:
+  fclose(file);
+  free(key);
+  free(validator);
+  free(metadata);
+  free(ranges);
+}
+
+/* Data file */
+
+static void unmap(disk_cache_entry_t *entry) {
+  if (entry->map != NULL) {
+    munmap(entry->map, (size_t)entry->length);
+    entry->map = NULL;
+  }
+  if (entry->fd >= 0) {
+    close(entry->fd);
+    entry->fd = -1;
+  }
+}
+
+/* Opens the data file and maps the whole of it. If discard is set anything
+   already in the file is thrown away */
+static bool map_data(disk_cache_entry_t *entry, bool discard) {
+  char *path = entry_path(entry->cache, entry->name, "data");
+  if (path == NULL) return false;
+  entry->fd = open(path, O_RDWR | O_CREAT, 0644);
+  free(path);
+  if (entry->fd < 0) return false;
+
+  struct stat st;
+  if (fstat(entry->fd, &st) != 0) goto fail;
+  if (!discard && (uint64_t)st.st_size != entry->length) {
+    /* The index doesn't describe this file */
+    entry->rangeCount = 0;
+    discard = true;
+  }
+  /* Truncating to nothing first frees whatever blocks the file had, so the
+     new file starts out sparse */
+  if (discard && ftruncate(entry->fd, 0) != 0) goto fail;
+  if (ftruncate(entry->fd, (off_t)entry->length) != 0) goto fail;
+
+  void *map = mmap(NULL, (size_t)entry->length, PROT_READ | PROT_WRITE,
+                   MAP_SHARED, entry->fd, 0);
+  if (map == MAP_FAILED) goto fail;
+  entry->map = map;
+  return true;
+
+fail:
+  close(entry->fd);
+  entry->fd = -1;
+  return false;
+}
+
+static void clear_info(disk_cache_entry_t *entry) {
+  unmap(entry);
+  entry->length = 0;
+  free(entry->validator);
+  entry->validator = NULL;
+  free(entry->metadata);
+  entry->metadata = NULL;
+  entry->metadataLength = 0;
+  entry->rangeCount = 0;
+}
+
+static void remove_files(const disk_cache_t *cache, const char *name) {
+  const char *extensions[] = {"index", "data"};
+  for (size_t i = 0; i < sizeof(extensions) / sizeof(extensions[0]); i++) {
+    char *path = entry_path(cache, name, extensions[i]);
+    if (path == NULL) continue;
+    unlink(path);
+    free(path);
+  }
+}
+
+/* Eviction */
+
+typedef struct stored_entry {
+  char     name[kNameLength + 1];
+  uint64_t lastUsed;
+  uint64_t size;
+} stored_entry_t;
+
+static int compare_last_used(const void *a, const void *b) {
+  uint64_t x = ((const stored_entry_t *)a)->lastUsed;
+  uint64_t y = ((const stored_entry_t *)b)->lastUsed;
+  return x < y ? -1 : x > y;
+}
+
+static bool is_open(const disk_cache_t *cache, const char *name) {
+  for (const disk_cache_entry_t *e = cache->openEntries; e != NULL; e = e->next) {
+    if (strcmp(e->name, name) == 0) return true;
+  }
+  return false;
+}
+
+/* Space taken on disk by an entry, counting only the blocks actually used by
+   its sparse data file */
+static uint64_t stored_size(const disk_cache_t *cache, const char *name) {
+  uint64_t size = 0;
+  const char *extensions[] = {"index", "data"};
+  for (size_t i = 0; i < sizeof(extensions) / sizeof(extensions[0]); i++) {
+    char *path = entry_path(cache, name, extensions[i]);
+    if (path == NULL) continue;
+    struct stat st;
+    if (stat(path, &st) == 0) size += (uint64_t)st.st_blocks * 512;
+    free(path);
+  }
+  return size;
+}
+
+/* Evicts least recently used entries until everything fits under the limit.
+   Open entries are counted at the size they will have once complete, so that
+   they have room to finish */
+static void evict(disk_cache_t *cache) {
+  uint64_t total = 0;
+  for (const disk_cache_entry_t *e = cache->openEntries; e != NULL; e = e->next) {
+    total += e->length;
+  }
+
+  DIR *dir = opendir(cache->directory);
+  if (dir == NULL) return;
+  stored_entry_t *stored = NULL;
+  size_t count = 0, capacity = 0;
+  struct dirent *d;
+  while ((d = readdir(dir)) != NULL) {
+    const char *dot = strrchr(d->d_name, '.');
+    if (dot == NULL || dot - d->d_name != kNameLength ||
+        strcmp(dot, ".index") != 0) {
+      continue;
+    }
+    char name[kNameLength + 1];
+    memcpy(name, d->d_name, kNameLength);
+    name[kNameLength] = '\0';
+    if (is_open(cache, name)) continue;
+
+    char *path = entry_path(cache, name, "index");
+    uint64_t lastUsed = 0;
+    bool valid = path != NULL && read_last_used(path, &lastUsed);
+    free(path);
+    if (!valid) {
+      remove_files(cache, name);
+      continue;
+    }
+    if (count == capacity) {
+      size_t newCapacity = capacity == 0 ? 32 : capacity * 2;
+      stored_entry_t *grown = realloc(stored, newCapacity * sizeof(stored_entry_t));
+      if (grown == NULL) break;
+      stored = grown;
+      capacity = newCapacity;
+    }
+    memcpy(stored[count].name, name, sizeof(name));
+    stored[count].lastUsed = lastUsed;
+    stored[count].size = stored_size(cache, name);
+    total += stored[count].size;
+    count++;
+  }
+  closedir(dir);
+
+  qsort(stored, count, sizeof(stored_entry_t), compare_last_used);
+  for (size_t i = 0; i < count && total > cache->sizeLimit; i++) {
+    remove_files(cache, stored[i].name);
+    total -= stored[i].size;
+    cache->stats.evictions++;
+  }
+  free(stored);
+}
+
+/* Cache */
+
+disk_cache_t *ASDiskCacheCreate(const char *directory, uint64_t sizeLimit) {
+  if (mkdir(directory, 0755) != 0 && errno != EEXIST) return NULL;
+  struct stat st;
+  if (stat(directory, &st) != 0 || !S_ISDIR(st.st_mode)) return NULL;
+
+  disk_cache_t *cache = calloc(1, sizeof(disk_cache_t));
+  if (cache == NULL) return NULL;
+  cache->directory = strdup(directory);
+  if (cache->directory == NULL) {
+    free(cache);
+    return NULL;
+  }
+  cache->sizeLimit = sizeLimit;
+  evict(cache);
+  return cache;
+}
+
+static void free_cache(disk_cache_t *cache) {
+  free(cache->directory);
+  free(cache);
+}
+
+void ASDiskCacheDestroy(disk_cache_t *cache) {
+  if (cache == NULL) return;
+  if (cache->openEntries != NULL) {
+    cache->destroyed = true;
+  } else {
+    free_cache(cache);
+  }
+}
+
+void ASDiskCacheSetSizeLimit(disk_cache_t *cache, uint64_t sizeLimit) {
+  cache->sizeLimit = sizeLimit;
+  evict(cache);
+}
+
+void ASDiskCacheGetStats(const disk_cache_t *cache, disk_cache_stats_t *stats) {
+  *stats = cache->stats;
+}
+
+double ASDiskCacheHitRate(const disk_cache_t *cache) {
+  uint64_t total = cache->stats.hitBytes + cache->stats.missBytes;
+  if (total == 0) return 0;
+  return (double)cache->stats.hitBytes / (double)total;
+}
+
+/* Entries */
+
+disk_cache_entry_t *ASDiskCacheOpenEntry(disk_cache_t *cache, const char *key) {
+  char name[kNameLength + 1];
+  snprintf(name, sizeof(name), "%016llx", (unsigned long long)hash_key(key));
+  if (is_open(cache, name)) return NULL;
+
+  disk_cache_entry_t *entry = calloc(1, sizeof(disk_cache_entry_t));
+  if (entry == NULL) return NULL;
+  entry->key = strdup(key);
+  if (entry->key == NULL) {
+    free(entry);
+    return NULL;
+  }
+  entry->cache = cache;
+  memcpy(entry->name, name, sizeof(name));
+  entry->fd = -1;
+
+  load_index(entry);
+  if (entry->length > 0 && !map_data(entry, false)) clear_info(entry);
+
+  entry->next = cache->openEntries;
+  cache->openEntries = entry;
+  return entry;
+}
+
+void ASDiskCacheCloseEntry(disk_cache_entry_t *entry) {
+  if (entry == NULL) return;
+  disk_cache_t *cache = entry->cache;
+  if (entry->length > 0) save_index(entry);
+  unmap(entry);
+
+  for (disk_cache_entry_t **e = &cache->openEntries; *e != NULL; e = &(*e)->next) {
+    if (*e == entry) {
+      *e = entry->next;
+      break;
+    }
+  }
+  free(entry->key);
+  free(entry->validator);
+  free(entry->metadata);
+  free(entry->ranges);
+  free(entry);
+
+  evict(cache);
+  if (cache->destroyed && cache->openEntries == NULL) free_cache(cache);
+}
+
+bool ASDiskCacheEntrySetInfo(disk_cache_entry_t *entry, uint64_t length,
+                             const char *validator, const void *metadata,
+                             size_t metadataLength) {
+  bool same = entry->length == length && entry->validator != NULL &&
+              strcmp(entry->validator, validator) == 0;
+  if (!same) {
+    clear_info(entry);
+    if (length == 0 || length > entry->cache->sizeLimit ||
+        (size_t)length != length) {
+      remove_files(entry->cache, entry->name);
+      return false;
+    }
+    entry->length = length;
+    entry->validator = strdup(validator);
+    if (entry->validator == NULL || !map_data(entry, true)) {
+      clear_info(entry);
+      remove_files(entry->cache, entry->name);
+      return false;
+    }
+  }
+
+  free(entry->metadata);
+  entry->metadata = NULL;
+  entry->metadataLength = 0;
+  if (metadataLength > 0 && (entry->metadata = malloc(metadataLength)) != NULL) {
+    memcpy(entry->metadata, metadata, metadataLength);
+    entry->metadataLength = metadataLength;
+  }
+
+  if (!same) {
+    /* Record straight away that the old contents are gone, so that a crash
+       can't leave the old index describing new data */
+    save_index(entry);
+    evict(entry->cache);
+  }
+  return true;
+}
+
+uint64_t ASDiskCacheEntryLength(const disk_cache_entry_t *entry) {
+  return entry->length;
+}
+
+const char *ASDiskCacheEntryValidator(const disk_cache_entry_t *entry) {
+  return entry->validator;
+}
+
+const void *ASDiskCacheEntryMetadata(const disk_cache_entry_t *entry,
+                                     size_t *length) {
+  *length = entry->metadataLength;
+  return entry->metadata;
+}
+
+/* Index of the first range ending after offset, or rangeCount */
+static size_t find_range(const disk_cache_entry_t *entry, uint64_t offset) {
+  size_t lo = 0, hi = entry->rangeCount;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (entry->ranges[mid].end <= offset) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+uint64_t ASDiskCacheEntryRead(const disk_cache_entry_t *entry, uint64_t offset,
+                              const uint8_t **bytes) {
+  size_t i = find_range(entry, offset);
+  if (entry->map == NULL || i == entry->rangeCount ||
+      entry->ranges[i].start > offset) {
+    return 0;
+  }
+  *bytes = entry->map + offset;
+  return entry->ranges[i].end - offset;
+}
+
+void ASDiskCacheEntryCountHit(disk_cache_entry_t *entry, uint64_t bytes) {
+  entry->cache->stats.hitBytes += bytes;
+}
+
+uint64_t ASDiskCacheEntryNextCached(const disk_cache_entry_t *entry,
+                                    uint64_t offset) {
+  size_t i = find_range(entry, offset);
+  if (i == entry->rangeCount) return entry->length;
+  return entry->ranges[i].start > offset ? entry->ranges[i].start : offset;
+}
+
+/* Adds [start, end) to the cached ranges, merging it with any it touches */
+static bool add_range(disk_cache_entry_t *entry, uint64_t start, uint64_t end) {
+  /* First range which ends at or after start, and so might merge */
+  size_t i = 0;
+  while (i < entry->rangeCount && entry->ranges[i].end < start) i++;
+  size_t j = i;
+  while (j < entry->rangeCount && entry->ranges[j].start <= end) {
+    if (entry->ranges[j].start < start) start = entry->ranges[j].start;
+    if (entry->ranges[j].end > end) end = entry->ranges[j].end;
+    j++;
+  }
+
+  if (i == j) {
+    if (entry->rangeCount == entry->rangeCapacity) {
+      size_t capacity = entry->rangeCapacity == 0 ? 8 : entry->rangeCapacity * 2;
+      byte_range_t *grown = realloc(entry->ranges, capacity * sizeof(byte_range_t));
+      if (grown == NULL) return false;
+      entry->ranges = grown;
+      entry->rangeCapacity = capacity;
+    }
+    memmove(&entry->ranges[i + 1], &entry->ranges[i],
+            (entry->rangeCount - i) * sizeof(byte_range_t));
+    entry->rangeCount++;
+  } else if (j > i + 1) {
+    memmove(&entry->ranges[i + 1], &entry->ranges[j],
+            (entry->rangeCount - j) * sizeof(byte_range_t));
+    entry->rangeCount -= j - i - 1;
+  }
+  entry->ranges[i].start = start;
+  entry->ranges[i].end = end;
+  return true;
+}
+
+bool ASDiskCacheEntryWrite(disk_cache_entry_t *entry, uint64_t offset,
+                           const void *bytes, size_t length) {
+  if (entry->map == NULL) return false;
+  if (offset >= entry->length || length == 0) return true;
+  if (length > entry->length - offset) length = (size_t)(entry->length - offset);
+  memcpy(entry->map + offset, bytes, length);
+  entry->cache->stats.missBytes += length;
+  return add_range(entry, offset, offset + length);
+}
+
+bool ASDiskCacheEntryComplete(const disk_cache_entry_t *entry) {
+  return entry->length > 0 && entry->rangeCount == 1 &&
+         entry->ranges[0].start == 0 && entry->ranges[0].end == entry->length;
+}
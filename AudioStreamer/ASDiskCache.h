@@ -0,0 +1,104 @@
+//
+//  ASDiskCache.h
+//  AudioStreamer
+//
+
+#ifndef AS_DISK_CACHE_H
+#define AS_DISK_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Persistent byte-range cache of remote files.
+ *
+ * Each entry is keyed by its URL and holds a sparse data file the size of the
+ * whole remote file, memory mapped, plus an index recording which byte ranges
+ * of it have been filled in. Entries also remember the remote file's length
+ * and validator (its ETag or Last-Modified header); if either changes the
+ * cached ranges are thrown away.
+ *
+ * The cache is kept under a size limit by evicting whole entries, least
+ * recently used first. Entries which are open are never evicted.
+ *
+ * Nothing here is thread safe; a cache and its entries must be used from one
+ * thread at a time.
+ */
+
+typedef struct disk_cache disk_cache_t;
+typedef struct disk_cache_entry disk_cache_entry_t;
+
+typedef struct disk_cache_stats {
+  uint64_t hitBytes;        /* bytes counted with ASDiskCacheEntryCountHit */
+  uint64_t missBytes;       /* bytes which had to be fetched and were stored */
+  uint64_t evictions;       /* entries evicted to stay under the limit */
+} disk_cache_stats_t;
+
+/* Opens the cache in the given directory, which is created if need be.
+   Returns NULL if the directory can't be used or allocation fails */
+disk_cache_t *ASDiskCacheCreate(const char *directory, uint64_t sizeLimit);
+
+/* Closes the cache. If any of its entries are still open it lingers until
+   the last of them is closed */
+void ASDiskCacheDestroy(disk_cache_t *cache);
+
+/* Changes the size limit, evicting entries if the cache is now over it */
+void ASDiskCacheSetSizeLimit(disk_cache_t *cache, uint64_t sizeLimit);
+
+void ASDiskCacheGetStats(const disk_cache_t *cache, disk_cache_stats_t *stats);
+
+/* Fraction of bytes served from the cache rather than fetched, or 0 if
+   nothing has been requested yet */
+double ASDiskCacheHitRate(const disk_cache_t *cache);
+
+/* Opens the entry for a key (the URL), loading what was cached by earlier
+   sessions. Returns NULL if the entry is already open or allocation fails */
+disk_cache_entry_t *ASDiskCacheOpenEntry(disk_cache_t *cache, const char *key);
+
+/* Saves the entry's index and closes it */
+void ASDiskCacheCloseEntry(disk_cache_entry_t *entry);
+
+/* Gives the length and validator of the remote file, along with any data the
+   caller wants kept alongside (such as response headers). If they don't
+   match what is cached, the cached ranges are dropped. Returns false if the
+   file can't be cached (it is larger than the cache, or the data file can't
+   be created), in which case the entry holds nothing */
+bool ASDiskCacheEntrySetInfo(disk_cache_entry_t *entry, uint64_t length,
+                             const char *validator, const void *metadata,
+                             size_t metadataLength);
+
+/* Length of the remote file, or 0 if nothing is known about it yet */
+uint64_t ASDiskCacheEntryLength(const disk_cache_entry_t *entry);
+
+/* The remote file's validator, or NULL if nothing is known about it yet */
+const char *ASDiskCacheEntryValidator(const disk_cache_entry_t *entry);
+
+/* The data given along with the info, or NULL */
+const void *ASDiskCacheEntryMetadata(const disk_cache_entry_t *entry,
+                                     size_t *length);
+
+/* Finds the cached bytes starting at offset. Returns how many there are in a
+   row (0 if offset isn't cached) and points bytes at them. The pointer stays
+   valid until the entry's info changes or it is closed */
+uint64_t ASDiskCacheEntryRead(const disk_cache_entry_t *entry, uint64_t offset,
+                              const uint8_t **bytes);
+
+/* Records that bytes found with ASDiskCacheEntryRead were actually used, for
+   the hit rate */
+void ASDiskCacheEntryCountHit(disk_cache_entry_t *entry, uint64_t bytes);
+
+/* Offset of the first cached byte at or after offset, or the file's length
+   if there are none */
+uint64_t ASDiskCacheEntryNextCached(const disk_cache_entry_t *entry,
+                                    uint64_t offset);
+
+/* Stores bytes of the file fetched from the remote. Bytes past the end of
+   the file are ignored. Returns false if there's no info for the entry */
+bool ASDiskCacheEntryWrite(disk_cache_entry_t *entry, uint64_t offset,
+                           const void *bytes, size_t length);
+
+/* Whether every byte of the file is cached */
+bool ASDiskCacheEntryComplete(const disk_cache_entry_t *entry);
+
+#endif
@@ -0,0 +1,435 @@
+//
+//  ASFMP4Demuxer.c
+//  AudioStreamer
+//
+
+#include "ASFMP4Demuxer.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define BOX(a, b, c, d) \
+  (((uint32_t)(a) << 24) | ((uint32_t)(b) << 16) | ((uint32_t)(c) << 8) | (uint32_t)(d))
+
+#define kADTSHeaderSize 7
+#define kMaxADTSFrame 8191
+
+/* Object type indications of MPEG audio in a decoder configuration */
+#define kObjectMPEG2Audio 0x69
+#define kObjectMPEG1Audio 0x6B
+#define kObjectAAC 0x40
+#define kObjectMPEG2AACMain 0x66
+#define kObjectMPEG2AACLC 0x67
+#define kObjectMPEG2AACSSR 0x68
+
+/* tfhd and trun flags */
+#define kBaseDataOffset 0x000001
+#define kDescriptionIndex 0x000002
+#define kDefaultDuration 0x000008
+#define kDefaultSize 0x000010
+#define kDataOffset 0x000001
+#define kFirstSampleFlags 0x000004
+#define kSampleDuration 0x000100
+#define kSampleSize 0x000200
+#define kSampleFlags 0x000400
+#define kSampleTimeOffset 0x000800
+
+struct fmp4_demuxer {
+  fmp4_codec_t codec;
+  uint32_t trackID;
+  uint32_t defaultSize;         /* from the trex */
+  /* The fixed part of each ADTS header */
+  uint8_t  profile;
+  uint8_t  sampleRateIndex;
+  uint8_t  channelConfig;
+};
+
+typedef struct box {
+  uint32_t       type;
+  const uint8_t *data;          /* the payload */
+  size_t         size;
+} box_t;
+
+static uint32_t read32(const uint8_t *p) {
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+         ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static uint64_t read64(const uint8_t *p) {
+  return ((uint64_t)read32(p) << 32) | read32(p + 4);
+}
+
+/* Reads the header of the box at the start of the bytes, returning the size
+   of the whole box, or 0 if it doesn't fit */
+static size_t read_box(const uint8_t *bytes, size_t length, box_t *box) {
+  if (length < 8) return 0;
+  uint64_t size = read32(bytes);
+  size_t header = 8;
+  if (size == 1) {
+    if (length < 16) return 0;
+    size = read64(bytes + 8);
+    header = 16;
+  } else if (size == 0) {
+    size = length;
+  }
+  if (size < header || size > length) return 0;
+  box->type = read32(bytes + 4);
+  box->data = bytes + header;
+  box->size = (size_t)size - header;
+  return (size_t)size;
+}
+
+/* Finds the first child box of a type among the bytes */
+static bool find_box(const uint8_t *bytes, size_t length, uint32_t type,
+                     box_t *box) {
+  size_t size;
+  while ((size = read_box(bytes, length, box)) > 0) {
+    if (box->type == type) return true;
+    bytes += size;
+    length -= size;
+  }
+  return false;
+}
+
+/* Finds a box by the types of the boxes it's nested in */
+static bool find_path(const box_t *parent, const uint32_t *path, size_t depth,
+                      box_t *box) {
+  box_t current = *parent;
+  for (size_t i = 0; i < depth; i++) {
+    if (!find_box(current.data, current.size, path[i], &current)) return false;
+  }
+  *box = current;
+  return true;
+}
+
+/* Descriptors, as in the esds */
+
+/* Reads a descriptor's tag and length, returning the size of its header, or
+   0 if it doesn't fit */
+static size_t read_descriptor(const uint8_t *bytes, size_t length, uint8_t *tag,
+                              size_t *size) {
+  if (length < 2) return 0;
+  *tag = bytes[0];
+  size_t value = 0;
+  size_t i = 1;
+  /* Up to four bytes of seven bits each */
+  for (; i < 5 && i < length; i++) {
+    value = (value << 7) | (bytes[i] & 0x7F);
+    if (!(bytes[i] & 0x80)) break;
+  }
+  if (i == 5 || i == length) return 0;
+  i++;
+  if (value > length - i) return 0;
+  *size = value;
+  return i;
+}
+
+typedef struct bit_reader {
+  const uint8_t *bytes;
+  size_t length;
+  size_t pos;                   /* in bits */
+} bit_reader_t;
+
+static uint32_t read_bits(bit_reader_t *br, unsigned count) {
+  uint32_t value = 0;
+  for (unsigned i = 0; i < count; i++) {
+    size_t byte = br->pos / 8;
+    uint32_t bit = byte < br->length ? (br->bytes[byte] >> (7 - br->pos % 8)) & 1 : 0;
+    value = (value << 1) | bit;
+    br->pos++;
+  }
+  return value;
+}
+
+static uint32_t read_object_type(bit_reader_t *br) {
+  uint32_t type = read_bits(br, 5);
+  return type == 31 ? 32 + read_bits(br, 6) : type;
+}
+
+/* Works out the ADTS header fields from an AudioSpecificConfig */
+static bool parse_audio_config(fmp4_demuxer_t *d, const uint8_t *config,
+                               size_t length) {
+  bit_reader_t br = {config, length, 0};
+  if (length < 2) return false;
+  uint32_t objectType = read_object_type(&br);
+  uint32_t rateIndex = read_bits(&br, 4);
+  if (rateIndex == 15) return false;
+  uint32_t channels = read_bits(&br, 4);
+  /* SBR and PS are signalled on top of the core, which is what ADTS has */
+  if (objectType == 5 || objectType == 29) {
+    if (read_bits(&br, 4) == 15) read_bits(&br, 24);
+    objectType = read_object_type(&br);
+  }
+  if (objectType < 1 || objectType > 4 || rateIndex > 12 || channels == 0 ||
+      channels > 7) {
+    return false;
+  }
+  d->profile = (uint8_t)(objectType - 1);
+  d->sampleRateIndex = (uint8_t)rateIndex;
+  d->channelConfig = (uint8_t)channels;
+  return true;
+}
+
+/* Reads the decoder configuration from an esds box */
+static fmp4_codec_t parse_esds(fmp4_demuxer_t *d, const box_t *esds) {
+  /* Version and flags */
+  if (esds->size < 4) return FMP4_CODEC_NONE;
+  const uint8_t *p = esds->data + 4;
+  size_t length = esds->size - 4;
+  uint8_t tag;
+  size_t size;
+  size_t header = read_descriptor(p, length, &tag, &size);
+  if (header == 0 || tag != 0x03 || size < 3) return FMP4_CODEC_NONE;
+  p += header;
+  length = size;
+
+  /* The ES descriptor: its ID, flags, and whatever the flags say follows */
+  uint8_t flags = p[2];
+  size_t skip = 3;
+  if (flags & 0x80) skip += 2;
+  if ((flags & 0x40) && skip < length) skip += 1 + (size_t)p[skip];
+  if (flags & 0x20) skip += 2;
+  if (skip > length) return FMP4_CODEC_NONE;
+  p += skip;
+  length -= skip;
+
+  header = read_descriptor(p, length, &tag, &size);
+  if (header == 0 || tag != 0x04 || size < 13) return FMP4_CODEC_NONE;
+  uint8_t objectType = p[header];
+  switch (objectType) {
+    case kObjectMPEG1Audio:
+    case kObjectMPEG2Audio:
+      return FMP4_CODEC_MPEG;
+    case kObjectAAC:
+    case kObjectMPEG2AACMain:
+    case kObjectMPEG2AACLC:
+    case kObjectMPEG2AACSSR:
+      break;
+    default:
+      return FMP4_CODEC_NONE;
+  }
+  p += header + 13;
+  length = size - 13;
+  header = read_descriptor(p, length, &tag, &size);
+  if (header == 0 || tag != 0x05) return FMP4_CODEC_NONE;
+  return parse_audio_config(d, p + header, size) ? FMP4_CODEC_AAC : FMP4_CODEC_NONE;
+}
+
+/* Reads a trak, returning its codec if it's a sound track which can be
+   played */
+static fmp4_codec_t parse_trak(fmp4_demuxer_t *d, const box_t *trak) {
+  box_t tkhd, hdlr, stsd;
+  static const uint32_t hdlrPath[] = {BOX('m', 'd', 'i', 'a'), BOX('h', 'd', 'l', 'r')};
+  static const uint32_t stsdPath[] = {
+    BOX('m', 'd', 'i', 'a'), BOX('m', 'i', 'n', 'f'), BOX('s', 't', 'b', 'l'),
+    BOX('s', 't', 's', 'd'),
+  };
+  if (!find_box(trak->data, trak->size, BOX('t', 'k', 'h', 'd'), &tkhd) ||
+      !find_path(trak, hdlrPath, 2, &hdlr) || !find_path(trak, stsdPath, 4, &stsd)) {
+    return FMP4_CODEC_NONE;
+  }
+  if (hdlr.size < 12 || read32(hdlr.data + 8) != BOX('s', 'o', 'u', 'n')) {
+    return FMP4_CODEC_NONE;
+  }
+  /* The track ID comes after the times, which are 64 bits in version 1 */
+  size_t idOffset = tkhd.size > 0 && tkhd.data[0] == 1 ? 20 : 12;
+  if (tkhd.size < idOffset + 4) return FMP4_CODEC_NONE;
+  d->trackID = read32(tkhd.data + idOffset);
+
+  /* The first sample entry, after the version, flags and entry count */
+  box_t entry;
+  if (stsd.size < 8 || read_box(stsd.data + 8, stsd.size - 8, &entry) == 0 ||
+      entry.type != BOX('m', 'p', '4', 'a') || entry.size < 28) {
+    return FMP4_CODEC_NONE;
+  }
+  /* The audio sample entry's fields come before its child boxes */
+  box_t esds;
+  if (!find_box(entry.data + 28, entry.size - 28, BOX('e', 's', 'd', 's'), &esds)) {
+    return FMP4_CODEC_NONE;
+  }
+  return parse_esds(d, &esds);
+}
+
+fmp4_demuxer_t *ASFMP4DemuxerCreate(void) {
+  return calloc(1, sizeof(fmp4_demuxer_t));
+}
+
+void ASFMP4DemuxerDestroy(fmp4_demuxer_t *demuxer) {
+  free(demuxer);
+}
+
+bool ASFMP4DemuxerProbe(const uint8_t *bytes, size_t length) {
+  if (length < 8) return false;
+  uint32_t type = read32(bytes + 4);
+  return type == BOX('f', 't', 'y', 'p') || type == BOX('s', 't', 'y', 'p') ||
+         type == BOX('m', 'o', 'o', 'f') || type == BOX('m', 'o', 'o', 'v') ||
+         type == BOX('s', 'i', 'd', 'x');
+}
+
+fmp4_codec_t ASFMP4DemuxerInit(fmp4_demuxer_t *d, const uint8_t *bytes,
+                               size_t length) {
+  d->codec = FMP4_CODEC_NONE;
+  box_t moov;
+  if (!find_box(bytes, length, BOX('m', 'o', 'o', 'v'), &moov)) {
+    return FMP4_CODEC_NONE;
+  }
+  const uint8_t *p = moov.data;
+  size_t left = moov.size;
+  box_t trak;
+  size_t size;
+  while ((size = read_box(p, left, &trak)) > 0) {
+    p += size;
+    left -= size;
+    if (trak.type != BOX('t', 'r', 'a', 'k')) continue;
+    d->codec = parse_trak(d, &trak);
+    if (d->codec != FMP4_CODEC_NONE) break;
+  }
+  if (d->codec == FMP4_CODEC_NONE) return FMP4_CODEC_NONE;
+
+  /* The track's fragment defaults */
+  d->defaultSize = 0;
+  box_t mvex, trex;
+  if (find_box(moov.data, moov.size, BOX('m', 'v', 'e', 'x'), &mvex)) {
+    p = mvex.data;
+    left = mvex.size;
+    while ((size = read_box(p, left, &trex)) > 0) {
+      p += size;
+      left -= size;
+      if (trex.type == BOX('t', 'r', 'e', 'x') && trex.size >= 24 &&
+          read32(trex.data + 4) == d->trackID) {
+        d->defaultSize = read32(trex.data + 16);
+      }
+    }
+  }
+  return d->codec;
+}
+
+/* Hands back one sample */
+static void emit_sample(fmp4_demuxer_t *d, const uint8_t *sample, size_t size,
+                        fmp4_sample_proc proc, void *context) {
+  if (d->codec == FMP4_CODEC_MPEG) {
+    proc(context, sample, size);
+    return;
+  }
+  size_t frame = size + kADTSHeaderSize;
+  if (frame > kMaxADTSFrame) return;
+  uint8_t header[kADTSHeaderSize] = {
+    0xFF,
+    0xF1,                       /* MPEG-4, no CRC */
+    (uint8_t)((d->profile << 6) | (d->sampleRateIndex << 2) | (d->channelConfig >> 2)),
+    (uint8_t)(((d->channelConfig & 3) << 6) | (frame >> 11)),
+    (uint8_t)(frame >> 3),
+    (uint8_t)(((frame & 7) << 5) | 0x1F),
+    0xFC,                       /* one raw data block */
+  };
+  proc(context, header, sizeof(header));
+  proc(context, sample, size);
+}
+
+/* Reads a traf, handing back its samples. The moof is where data offsets
+   count from by default */
+static bool parse_traf(fmp4_demuxer_t *d, const box_t *traf,
+                       const uint8_t *bytes, size_t length, size_t moofStart,
+                       uint64_t fileOffset, fmp4_sample_proc proc,
+                       void *context) {
+  box_t tfhd;
+  if (!find_box(traf->data, traf->size, BOX('t', 'f', 'h', 'd'), &tfhd) ||
+      tfhd.size < 8) {
+    return false;
+  }
+  if (read32(tfhd.data + 4) != d->trackID) return true;
+  uint32_t flags = read32(tfhd.data) & 0xFFFFFF;
+  size_t field = 8;
+  uint64_t base = moofStart;
+  uint32_t defaultSize = d->defaultSize;
+  if (flags & kBaseDataOffset) {
+    if (tfhd.size < field + 8) return false;
+    uint64_t offset = read64(tfhd.data + field);
+    if (offset < fileOffset) return false;
+    base = offset - fileOffset;
+    field += 8;
+  }
+  if (flags & kDescriptionIndex) field += 4;
+  if (flags & kDefaultDuration) field += 4;
+  if (flags & kDefaultSize) {
+    if (tfhd.size < field + 4) return false;
+    defaultSize = read32(tfhd.data + field);
+  }
+
+  /* Each run's data follows on from the last one's unless it says where */
+  uint64_t next = base;
+  const uint8_t *q = traf->data;
+  size_t remaining = traf->size;
+  box_t trun;
+  size_t size;
+  while ((size = read_box(q, remaining, &trun)) > 0) {
+    q += size;
+    remaining -= size;
+    if (trun.type != BOX('t', 'r', 'u', 'n')) continue;
+    if (trun.size < 8) return false;
+    uint32_t runFlags = read32(trun.data) & 0xFFFFFF;
+    uint32_t count = read32(trun.data + 4);
+    const uint8_t *r = trun.data + 8;
+    size_t runLeft = trun.size - 8;
+    if (runFlags & kDataOffset) {
+      if (runLeft < 4) return false;
+      int32_t offset = (int32_t)read32(r);
+      if (offset < 0 && (uint64_t)-(int64_t)offset > base) return false;
+      next = base + (uint64_t)(int64_t)offset;
+      r += 4;
+      runLeft -= 4;
+    }
+    if (runFlags & kFirstSampleFlags) {
+      if (runLeft < 4) return false;
+      r += 4;
+      runLeft -= 4;
+    }
+    size_t fields = 0;
+    if (runFlags & kSampleDuration) fields++;
+    size_t sizeField = fields;
+    if (runFlags & kSampleSize) fields++;
+    if (runFlags & kSampleFlags) fields++;
+    if (runFlags & kSampleTimeOffset) fields++;
+    if (fields > 0 && count > runLeft / (4 * fields)) return false;
+
+    for (uint32_t i = 0; i < count; i++) {
+      uint32_t sampleSize = defaultSize;
+      if (runFlags & kSampleSize) sampleSize = read32(r + 4 * (i * fields + sizeField));
+      if (sampleSize == 0) return false;
+      if (next > length || sampleSize > length - next) return false;
+      emit_sample(d, bytes + next, sampleSize, proc, context);
+      next += sampleSize;
+    }
+  }
+  return true;
+}
+
+bool ASFMP4DemuxSegment(fmp4_demuxer_t *d, const uint8_t *bytes, size_t length,
+                        uint64_t fileOffset, fmp4_sample_proc proc,
+                        void *context) {
+  if (d->codec == FMP4_CODEC_NONE) return false;
+  size_t pos = 0;
+  size_t size;
+  box_t moof;
+  bool found = false;
+  while ((size = read_box(bytes + pos, length - pos, &moof)) > 0) {
+    size_t moofStart = pos;
+    pos += size;
+    if (moof.type != BOX('m', 'o', 'o', 'f')) continue;
+    found = true;
+    const uint8_t *p = moof.data;
+    size_t left = moof.size;
+    box_t traf;
+    size_t trafSize;
+    while ((trafSize = read_box(p, left, &traf)) > 0) {
+      p += trafSize;
+      left -= trafSize;
+      if (traf.type != BOX('t', 'r', 'a', 'f')) continue;
+      if (!parse_traf(d, &traf, bytes, length, moofStart, fileOffset, proc,
+                      context)) {
+        return false;
+      }
+    }
+  }
+  return found;
+}
@@ -0,0 +1,64 @@
+//
+//  ASFMP4Demuxer.h
+//  AudioStreamer
+//
+
+#ifndef AS_FMP4_DEMUXER_H
+#define AS_FMP4_DEMUXER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Takes the audio out of fragmented MP4, as HLS segments can be.
+ *
+ * The initialization section's moov gives the first sound track, its
+ * decoder configuration (from the esds of its mp4a sample entry) and the
+ * defaults its fragments fall back on (from the trex). Each media segment is
+ * then one or more moof boxes with their mdat, the moof's track run (trun)
+ * saying where each sample is and how big. Samples are handed back in order,
+ * which for MP3 is the MP3 stream itself. AAC samples have an ADTS header
+ * made up for each, from the AudioSpecificConfig, so that either way what
+ * comes out can be read like a progressive stream.
+ *
+ * AAC is limited to what ADTS can describe: object types 1-4 (with SBR or PS
+ * signalled on top), a sample rate from the standard table, and a channel
+ * configuration. Encrypted tracks (enca) aren't supported.
+ *
+ * This is plain C without any CoreFoundation dependency.
+ */
+
+typedef struct fmp4_demuxer fmp4_demuxer_t;
+
+typedef enum fmp4_codec {
+  FMP4_CODEC_NONE,
+  FMP4_CODEC_AAC,               /* handed back in ADTS frames */
+  FMP4_CODEC_MPEG,
+} fmp4_codec_t;
+
+typedef void (*fmp4_sample_proc)(void *context, const uint8_t *bytes,
+                                 size_t length);
+
+/* Returns NULL if allocation fails */
+fmp4_demuxer_t *ASFMP4DemuxerCreate(void);
+
+void ASFMP4DemuxerDestroy(fmp4_demuxer_t *demuxer);
+
+/* Whether the bytes look like the start of an MP4 file or fragment */
+bool ASFMP4DemuxerProbe(const uint8_t *bytes, size_t length);
+
+/* Reads an initialization section, returning the codec of its sound track,
+   or FMP4_CODEC_NONE if it has none which can be played */
+fmp4_codec_t ASFMP4DemuxerInit(fmp4_demuxer_t *demuxer, const uint8_t *bytes,
+                               size_t length);
+
+/* Hands the samples of a whole media segment to proc, one at a time. The
+   offset is where the bytes are in the file they came from, for fragments
+   which give their data's position in the file. Returns false if the
+   segment can't be read, or no initialization section has been */
+bool ASFMP4DemuxSegment(fmp4_demuxer_t *demuxer, const uint8_t *bytes,
+                        size_t length, uint64_t fileOffset,
+                        fmp4_sample_proc proc, void *context);
+
+#endif
@@ -0,0 +1,216 @@
+//
+//  ASFrameScanner.c
+//  AudioStreamer
+//
+
+#include "ASFrameScanner.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Packet descriptions handed back per callback at most */
+#define kMaxBatch 512
+
+struct as_frame_scanner {
+  const as_frame_codec_t *codec;
+  void                   *codecContext;
+  as_packets_callback     packetsCallback;
+  void                   *packetsContext;
+
+  /* Sync state. Once locked, frames are trusted as long as each one matches
+     the format of the first */
+  bool    locked;
+  uint8_t lockBytes[3];       /* header bytes that must match while locked */
+
+  uint64_t position;          /* stream offset of the start of 'carry' or the
+                                 buffer being scanned */
+  uint64_t skipRemaining;     /* bytes of an ID3 tag still to be skipped */
+
+  /* Packets found but not yet handed back */
+  const uint8_t   *batchData;
+  uint32_t         batchCount;
+  as_packet_desc_t batch[kMaxBatch];
+
+  as_frame_stats_t stats;
+
+  size_t  carrySize;
+  size_t  carryLength;
+  uint8_t carry[];
+};
+
+as_frame_scanner_t *ASFrameScannerCreate(const as_frame_codec_t *codec,
+                                         void *codecContext, size_t carrySize,
+                                         as_packets_callback packetsCallback,
+                                         void *packetsContext) {
+  as_frame_scanner_t *scanner = calloc(1, sizeof(as_frame_scanner_t) + carrySize);
+  if (scanner == NULL) return NULL;
+  scanner->codec = codec;
+  scanner->codecContext = codecContext;
+  scanner->packetsCallback = packetsCallback;
+  scanner->packetsContext = packetsContext;
+  scanner->carrySize = carrySize;
+  ASFrameScannerReset(scanner);
+  return scanner;
+}
+
+void ASFrameScannerDestroy(as_frame_scanner_t *scanner) {
+  free(scanner);
+}
+
+void ASFrameScannerReset(as_frame_scanner_t *scanner) {
+  scanner->locked = false;
+  scanner->position = 0;
+  scanner->skipRemaining = 0;
+  scanner->batchData = NULL;
+  scanner->batchCount = 0;
+  scanner->carryLength = 0;
+}
+
+void ASFrameScannerGetStats(const as_frame_scanner_t *scanner,
+                            as_frame_stats_t *stats) {
+  *stats = scanner->stats;
+}
+
+void ASFrameScannerFlush(as_frame_scanner_t *scanner) {
+  if (scanner->batchCount == 0) return;
+  const as_packet_desc_t *last = &scanner->batch[scanner->batchCount - 1];
+  uint32_t byteCount = (uint32_t)(last->startOffset + last->byteSize);
+  scanner->packetsCallback(scanner->packetsContext, scanner->batchData,
+                           byteCount, scanner->batchCount, scanner->batch);
+  scanner->stats.packets += scanner->batchCount;
+  scanner->batchCount = 0;
+  scanner->batchData = NULL;
+}
+
+void ASFrameScannerEmit(as_frame_scanner_t *scanner, const uint8_t *packet,
+                        uint32_t length) {
+  if (scanner->batchCount == kMaxBatch) ASFrameScannerFlush(scanner);
+  if (scanner->batchCount == 0) scanner->batchData = packet;
+  as_packet_desc_t *desc = &scanner->batch[scanner->batchCount++];
+  desc->startOffset = packet - scanner->batchData;
+  desc->variableFrames = 0;
+  desc->byteSize = length;
+}
+
+static bool matches_lock(const as_frame_scanner_t *scanner, const uint8_t *p,
+                         const uint8_t bytes[3]) {
+  uint8_t other[3];
+  scanner->codec->lockBytes(p, other);
+  return memcmp(other, bytes, 3) == 0;
+}
+
+/* Scans buf for frames. Returns the number of bytes dealt with; whatever is
+   left over is needed to make a decision and must be fed again with more
+   data behind it */
+static size_t scan(as_frame_scanner_t *scanner, const uint8_t *buf, size_t n) {
+  const as_frame_codec_t *codec = scanner->codec;
+  size_t i = 0;
+  while (i < n) {
+    if (scanner->skipRemaining > 0) {
+      size_t s = n - i < scanner->skipRemaining ? n - i : (size_t)scanner->skipRemaining;
+      i += s;
+      scanner->skipRemaining -= s;
+      scanner->stats.skippedBytes += s;
+      continue;
+    }
+    if (n - i < codec->headerLength) break;
+    const uint8_t *p = buf + i;
+
+    /* ID3v2 tag, possibly in the middle of the stream */
+    if (p[0] == 'I' && p[1] == 'D' && p[2] == '3') {
+      if (n - i < 10) break;
+      if (p[3] != 0xFF && p[4] != 0xFF &&
+          ((p[6] | p[7] | p[8] | p[9]) & 0x80) == 0) {
+        scanner->skipRemaining = 10 + (((uint64_t)p[6] << 21) | ((uint64_t)p[7] << 14) |
+                                       ((uint64_t)p[8] << 7) | p[9]);
+        if (p[5] & 0x10) scanner->skipRemaining += 10;  /* footer */
+        scanner->locked = false;
+        continue;
+      }
+    }
+
+    size_t length = 0;
+    if (!scanner->locked || matches_lock(scanner, p, scanner->lockBytes)) {
+      length = codec->frameLength(scanner->codecContext, p, n - i,
+                                  scanner->locked);
+    }
+    if (length == kASFrameNeedMore) break;
+    if (length == 0) {
+      if (scanner->locked) {
+        /* Maybe a new format, so look again without the lock */
+        scanner->locked = false;
+        scanner->stats.syncLosses++;
+        continue;
+      }
+      /* Hunt for the next byte that could start a header. memchr() is the
+         fastest way to find 0xFF that the C library has */
+      const uint8_t *ff = memchr(p + 1, 0xFF, n - i - 1);
+      size_t next = ff == NULL ? n : (size_t)(ff - buf);
+      scanner->stats.skippedBytes += next - i;
+      i = next;
+      continue;
+    }
+    if (n - i < length) break;
+
+    /* Not in sync yet, so only believe the header if the next one follows */
+    if (!scanner->locked) {
+      if (n - i < length + codec->headerLength) break;
+      uint8_t bytes[3];
+      codec->lockBytes(p, bytes);
+      if (!codec->isHeader(p + length) || !matches_lock(scanner, p + length, bytes)) {
+        i++;
+        scanner->stats.skippedBytes++;
+        continue;
+      }
+      scanner->locked = true;
+      memcpy(scanner->lockBytes, bytes, sizeof(bytes));
+      codec->synced(scanner->codecContext, p, scanner->position + i);
+    }
+
+    codec->frame(scanner->codecContext, p, length);
+    i += length;
+  }
+  ASFrameScannerFlush(scanner);
+  return i;
+}
+
+void ASFrameScannerParse(as_frame_scanner_t *scanner, const uint8_t *bytes,
+                         size_t length) {
+  /* Finish off whatever was left over from last time, using just enough of
+     the new data */
+  while (scanner->carryLength > 0 && length > 0) {
+    size_t oldLength = scanner->carryLength;
+    size_t take = scanner->carrySize - oldLength;
+    if (take > length) take = length;
+    memcpy(scanner->carry + oldLength, bytes, take);
+    scanner->carryLength += take;
+
+    size_t used = scan(scanner, scanner->carry, scanner->carryLength);
+    if (used >= oldLength) {
+      /* Everything carried over is dealt with, carry on in the new data */
+      used -= oldLength;
+      scanner->position += oldLength + used;
+      scanner->carryLength = 0;
+      bytes += used;
+      length -= used;
+      break;
+    }
+    scanner->position += used;
+    if (take == length) {
+      /* All of the input went into the carry buffer, wait for more */
+      memmove(scanner->carry, scanner->carry + used, scanner->carryLength - used);
+      scanner->carryLength -= used;
+      return;
+    }
+    /* Still undecided with a full buffer. Keep what's left of the old data
+       and go round again with the next piece of the input */
+    memmove(scanner->carry, scanner->carry + used, oldLength - used);
+    scanner->carryLength = oldLength - used;
+  }
+
+  if (length == 0) return;
+  size_t used = scan(scanner, bytes, length);
+  scanner->position += used;
+  scanner->carryLength = length - used;
+  memcpy(scanner->carry, bytes + used, scanner->carryLength);
+}
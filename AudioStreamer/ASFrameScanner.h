@@ -0,0 +1,94 @@
+//
+//  ASFrameScanner.h
+//  AudioStreamer
+//
+
+#ifndef AS_FRAME_SCANNER_H
+#define AS_FRAME_SCANNER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ASPacketDesc.h"
+
+/*
+ * Framing shared by the MP3 and ADTS scanners.
+ *
+ * Both formats are a run of frames which each start with a sync word and a
+ * header giving the frame's length. The scanner does everything that doesn't
+ * depend on the header layout: carrying a frame split across two chunks over
+ * to the next one, skipping ID3v2 tags, locking on to a header only once the
+ * next header follows it, hunting for a new sync word when the lock is lost,
+ * and batching packets up for the packets callback. A codec supplies the rest
+ * through the callbacks in as_frame_codec_t.
+ */
+
+typedef struct as_frame_scanner as_frame_scanner_t;
+
+/* Returned by a codec's frameLength when more bytes are needed to tell */
+#define kASFrameNeedMore SIZE_MAX
+
+typedef struct as_frame_codec {
+  /* Bytes needed to decode a header */
+  size_t headerLength;
+
+  /* Whether p starts a header at all. Used to check the header following a
+     frame before the scanner locks on */
+  bool (*isHeader)(const uint8_t *p);
+
+  /* Header bytes which stay the same from frame to frame, for as long as the
+     scanner is locked on */
+  void (*lockBytes)(const uint8_t *p, uint8_t bytes[3]);
+
+  /* Decodes the header at p, with available bytes from p on. Returns the
+     length of the frame, 0 if p doesn't start a usable frame, or
+     kASFrameNeedMore */
+  size_t (*frameLength)(void *context, const uint8_t *p, size_t available,
+                        bool locked);
+
+  /* Invoked when the scanner locks on to the frame at p, which starts offset
+     bytes in from the first byte fed since the scanner was created or reset */
+  void (*synced)(void *context, const uint8_t *p, uint64_t offset);
+
+  /* Invoked with each complete frame, straight after frameLength decoded it.
+     The codec hands its packets back with ASFrameScannerEmit */
+  void (*frame)(void *context, const uint8_t *p, size_t length);
+} as_frame_codec_t;
+
+typedef struct as_frame_stats {
+  uint64_t packets;         /* packets handed back */
+  uint64_t skippedBytes;    /* bytes discarded while looking for sync */
+  uint64_t syncLosses;      /* times the expected next frame wasn't there */
+} as_frame_stats_t;
+
+/* Creates a scanner which can carry carrySize bytes over between chunks,
+   which must be enough to decide on any frame. The codec's callbacks get
+   codecContext. Returns NULL if allocation fails */
+as_frame_scanner_t *ASFrameScannerCreate(const as_frame_codec_t *codec,
+                                         void *codecContext, size_t carrySize,
+                                         as_packets_callback packetsCallback,
+                                         void *packetsContext);
+
+void ASFrameScannerDestroy(as_frame_scanner_t *scanner);
+
+/* Forgets any partial frame, the current sync and the stream position */
+void ASFrameScannerReset(as_frame_scanner_t *scanner);
+
+/* Scans the next chunk of data, invoking the callbacks as frames are found */
+void ASFrameScannerParse(as_frame_scanner_t *scanner, const uint8_t *bytes,
+                         size_t length);
+
+/* Adds a packet to the batch being built. It must lie in the frame being
+   handed to the codec */
+void ASFrameScannerEmit(as_frame_scanner_t *scanner, const uint8_t *packet,
+                        uint32_t length);
+
+/* Hands back the packets batched so far, for example before the format
+   they're in is replaced */
+void ASFrameScannerFlush(as_frame_scanner_t *scanner);
+
+void ASFrameScannerGetStats(const as_frame_scanner_t *scanner,
+                            as_frame_stats_t *stats);
+
+#endif
@@ -0,0 +1,56 @@
+//
+//  ASGapless.c
+//  AudioStreamer
+//
+
+#include "ASGapless.h"
+
+#include <stdlib.h>
+
+bool ASGaplessIsKnown(const gapless_info_t *info) {
+  return info->priming > 0 || info->validFrames > 0;
+}
+
+void ASGaplessFromLAME(gapless_info_t *info, uint32_t delay, uint32_t padding,
+                       uint64_t totalFrames) {
+  info->priming = (uint64_t)delay + kMP3DecoderDelay;
+  info->validFrames = totalFrames > (uint64_t)delay + padding ?
+                      totalFrames - delay - padding : 0;
+}
+
+bool ASGaplessParseITunSMPB(const char *text, gapless_info_t *info) {
+  uint64_t fields[4];
+  const char *p = text;
+  for (int i = 0; i < 4; i++) {
+    char *end;
+    while (*p == ' ') p++;
+    fields[i] = strtoull(p, &end, 16);
+    if (end == p) return false;
+    p = end;
+  }
+  /* Nothing at all to trim is as good as no info */
+  if (fields[1] == 0 && fields[3] == 0) return false;
+  info->priming = fields[1];
+  info->validFrames = fields[3];
+  return true;
+}
+
+void ASGaplessTrim(const gapless_info_t *info, uint64_t firstFrame,
+                   uint64_t frameCount, uint32_t *trimStart,
+                   uint32_t *trimEnd) {
+  uint64_t start = 0, end = 0;
+  uint64_t lastFrame = firstFrame + frameCount;
+  if (firstFrame < info->priming) {
+    start = info->priming - firstFrame;
+    if (start > frameCount) start = frameCount;
+  }
+  if (info->validFrames > 0) {
+    uint64_t audioEnd = info->priming + info->validFrames;
+    if (lastFrame > audioEnd) {
+      end = lastFrame - audioEnd;
+      if (end > frameCount - start) end = frameCount - start;
+    }
+  }
+  *trimStart = (uint32_t)start;
+  *trimEnd = (uint32_t)end;
+}
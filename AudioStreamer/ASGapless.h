@@ -0,0 +1,56 @@
+//
+//  ASGapless.h
+//  AudioStreamer
+//
+
+#ifndef AS_GAPLESS_H
+#define AS_GAPLESS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Encoder delay and padding, for gapless playback.
+ *
+ * Encoders put silence (priming frames) before the audio and pad the end out
+ * to a whole packet (remainder frames). Decoders add some delay of their own.
+ * Knowing how many frames of the decoded stream are real audio, each buffer
+ * of packets can be trimmed so that only those frames are played, and one
+ * track can follow another with no gap.
+ *
+ * The information comes from a LAME tag (MP3), an iTunSMPB comment (MP3 or
+ * AAC from iTunes), an MPEG-4 file's packet table or an Opus header. Frame
+ * numbers count from the first frame of the first packet of the stream.
+ */
+
+typedef struct gapless_info {
+  uint64_t priming;         /* frames to drop from the start */
+  uint64_t validFrames;     /* frames of audio after those, 0 if unknown */
+} gapless_info_t;
+
+/* Delay of the MP3 decoders LAME's figures are written for, which is added
+   to the encoder delay */
+#define kMP3DecoderDelay 529
+
+/* Whether anything is known, that is whether there is anything to trim */
+bool ASGaplessIsKnown(const gapless_info_t *info);
+
+/* Fills in the info from a LAME tag's encoder delay and padding, given the
+   total number of frames the encoder produced (packets times frames per
+   packet, from the Xing header). The total may be 0 if it isn't known */
+void ASGaplessFromLAME(gapless_info_t *info, uint32_t delay, uint32_t padding,
+                       uint64_t totalFrames);
+
+/* Parses the text of an iTunSMPB comment, which is a list of hex numbers of
+   which the second is the priming, the third the remainder and the fourth
+   the number of valid frames. Returns false if the text isn't one */
+bool ASGaplessParseITunSMPB(const char *text, gapless_info_t *info);
+
+/* Works out how many frames to trim from the start and end of a run of
+   frameCount decoded frames starting at firstFrame. Both may be the whole
+   run, in which case none of it should be played */
+void ASGaplessTrim(const gapless_info_t *info, uint64_t firstFrame,
+                   uint64_t frameCount, uint32_t *trimStart,
+                   uint32_t *trimEnd);
+
+#endif
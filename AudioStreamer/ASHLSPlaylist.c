@@ -0,0 +1,407 @@
+//
+//  ASHLSPlaylist.c
+//  AudioStreamer
+//
+
+#include "ASHLSPlaylist.h"
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+static bool has_prefix(const char *string, const char *prefix) {
+  return strncmp(string, prefix, strlen(prefix)) == 0;
+}
+
+/* URLs */
+
+/* Length of the scheme and colon the URL starts with, or 0 if it's relative */
+static size_t scheme_length(const char *url) {
+  if (!isalpha((unsigned char)url[0])) return 0;
+  size_t i = 1;
+  while (isalnum((unsigned char)url[i]) || url[i] == '+' || url[i] == '-' ||
+         url[i] == '.') {
+    i++;
+  }
+  return url[i] == ':' ? i + 1 : 0;
+}
+
+/* Takes out the "." and ".." segments of the path at the start of the
+   string, in place, up to any query or fragment */
+static void remove_dots(char *path) {
+  size_t end = strcspn(path, "?#");
+  char *out = path;
+  const char *in = path;
+  const char *stop = path + end;
+  while (in < stop) {
+    const char *next = memchr(in + 1, '/', (size_t)(stop - in - 1));
+    if (next == NULL) next = stop;
+    size_t length = (size_t)(next - in);
+    /* A segment, with the slash before it */
+    if (length == 2 && in[1] == '.') {
+      if (next == stop) *out++ = '/';
+    } else if (length == 3 && in[1] == '.' && in[2] == '.') {
+      while (out > path && *--out != '/') {}
+      if (next == stop) *out++ = '/';
+    } else {
+      memmove(out, in, length);
+      out += length;
+    }
+    in = next;
+  }
+  memmove(out, stop, strlen(stop) + 1);
+}
+
+char *ASHLSResolveURL(const char *base, const char *url) {
+  if (scheme_length(url) > 0) return strdup(url);
+  size_t scheme = scheme_length(base);
+  if (scheme == 0 || strncmp(base + scheme, "//", 2) != 0) return NULL;
+  const char *authority = base + scheme + 2;
+  const char *path = authority + strcspn(authority, "/?#");
+  size_t pathLength = strcspn(path, "?#");
+
+  /* How much of the base to keep */
+  size_t keep;
+  if (url[0] == '/' && url[1] == '/') {
+    keep = scheme;
+  } else if (url[0] == '/') {
+    keep = (size_t)(path - base);
+  } else if (url[0] == '?') {
+    keep = (size_t)(path - base) + pathLength;
+  } else if (url[0] == '#' || url[0] == '\0') {
+    keep = strcspn(base, "#");
+  } else {
+    /* Up to the last slash of the path, adding one if it has none */
+    keep = (size_t)(path - base);
+    for (size_t i = pathLength; i > 0; i--) {
+      if (path[i - 1] == '/') {
+        keep += i;
+        break;
+      }
+    }
+  }
+
+  bool slash = keep == (size_t)(path - base) && url[0] != '/' && url[0] != '?' &&
+               url[0] != '#' && url[0] != '\0';
+  size_t length = keep + (slash ? 1 : 0) + strlen(url);
+  char *resolved = malloc(length + 1);
+  if (resolved == NULL) return NULL;
+  memcpy(resolved, base, keep);
+  if (slash) resolved[keep++] = '/';
+  strcpy(resolved + keep, url);
+  if (url[0] != '/' || url[1] != '/') {
+    remove_dots(resolved + (path - base));
+  }
+  return resolved;
+}
+
+/* Attribute lists */
+
+/* Copies the value of the named attribute in a list of NAME=VALUE pairs,
+   without any quotes. Returns NULL if it isn't there */
+static char *attribute(const char *list, const char *name) {
+  size_t nameLength = strlen(name);
+  const char *p = list;
+  while (*p != '\0') {
+    const char *eq = strchr(p, '=');
+    if (eq == NULL) return NULL;
+    const char *value = eq + 1;
+    const char *end;
+    if (*value == '"') {
+      value++;
+      end = strchr(value, '"');
+      if (end == NULL) end = value + strlen(value);
+    } else {
+      end = value + strcspn(value, ",");
+    }
+    if ((size_t)(eq - p) == nameLength && strncmp(p, name, nameLength) == 0) {
+      return strndup(value, (size_t)(end - value));
+    }
+    p = end;
+    if (*p == '"') p++;
+    p += strcspn(p, ",");
+    if (*p == ',') p++;
+    while (*p == ' ') p++;
+  }
+  return NULL;
+}
+
+/* Parses "<length>[@<offset>]", leaving the offset alone if it isn't there */
+static bool parse_byte_range(const char *value, uint64_t *length,
+                             uint64_t *offset) {
+  char *end;
+  unsigned long long parsed = strtoull(value, &end, 10);
+  if (end == value || parsed == 0) return false;
+  *length = parsed;
+  if (*end == '@') *offset = strtoull(end + 1, NULL, 10);
+  return true;
+}
+
+/* Whether every codec in a CODECS attribute is one an audio segment of an
+   HLS stream can be decoded with here */
+static bool codecs_audio_only(const char *codecs) {
+  if (codecs == NULL) return false;
+  const char *p = codecs;
+  while (*p != '\0') {
+    while (*p == ' ') p++;
+    if (strncmp(p, "mp4a", 4) != 0) return false;
+    p += strcspn(p, ",");
+    if (*p == ',') p++;
+  }
+  return true;
+}
+
+/* Playlists */
+
+typedef struct parse_state {
+  hls_playlist_t *playlist;
+  const char *base;
+  size_t variantCapacity;
+  size_t segmentCapacity;
+
+  /* What the tags so far say of the next URI line */
+  bool      streamInf;
+  uint64_t  bandwidth;
+  bool      audioOnly;
+  bool      extinf;
+  double    duration;
+  bool      discontinuity;
+  bool      ranged;
+  uint64_t  rangeLength;
+  uint64_t  rangeOffset;
+  uint64_t  lastRangeEnd;       /* where a range without an offset starts */
+  char     *lastURL;
+  bool      keyed;              /* segments from here on are encrypted */
+  char     *mapURL;
+  uint64_t  mapOffset;
+  uint64_t  mapLength;
+  bool      defaultAudio;       /* the audio URL is the default rendition */
+} parse_state_t;
+
+static bool add_variant(parse_state_t *ps, const char *uri) {
+  hls_playlist_t *pl = ps->playlist;
+  if (pl->variantCount == ps->variantCapacity) {
+    size_t capacity = ps->variantCapacity > 0 ? 2 * ps->variantCapacity : 4;
+    hls_variant_t *variants = realloc(pl->variants, capacity * sizeof(hls_variant_t));
+    if (variants == NULL) return false;
+    pl->variants = variants;
+    ps->variantCapacity = capacity;
+  }
+  char *url = ASHLSResolveURL(ps->base, uri);
+  if (url == NULL) return false;
+  hls_variant_t *variant = &pl->variants[pl->variantCount++];
+  variant->url = url;
+  variant->bandwidth = ps->bandwidth;
+  variant->audioOnly = ps->audioOnly;
+  return true;
+}
+
+static bool add_segment(parse_state_t *ps, const char *uri) {
+  hls_playlist_t *pl = ps->playlist;
+  if (pl->segmentCount == ps->segmentCapacity) {
+    size_t capacity = ps->segmentCapacity > 0 ? 2 * ps->segmentCapacity : 16;
+    hls_segment_t *segments = realloc(pl->segments, capacity * sizeof(hls_segment_t));
+    if (segments == NULL) return false;
+    pl->segments = segments;
+    ps->segmentCapacity = capacity;
+  }
+  hls_segment_t *seg = &pl->segments[pl->segmentCount];
+  memset(seg, 0, sizeof(hls_segment_t));
+  seg->url = ASHLSResolveURL(ps->base, uri);
+  if (seg->url == NULL) return false;
+  if (ps->mapURL != NULL) {
+    seg->mapURL = strdup(ps->mapURL);
+    if (seg->mapURL == NULL) {
+      free(seg->url);
+      return false;
+    }
+    seg->mapOffset = ps->mapOffset;
+    seg->mapLength = ps->mapLength;
+  }
+  seg->duration = ps->duration;
+  seg->sequence = pl->mediaSequence + pl->segmentCount;
+  seg->discontinuity = ps->discontinuity;
+  if (ps->ranged) {
+    /* Without an offset, the range follows on from the last one, which must
+       have been of the same file */
+    if (ps->rangeOffset == UINT64_MAX) {
+      ps->rangeOffset = ps->lastURL != NULL && strcmp(ps->lastURL, seg->url) == 0 ?
+                          ps->lastRangeEnd : 0;
+    }
+    seg->offset = ps->rangeOffset;
+    seg->length = ps->rangeLength;
+    ps->lastRangeEnd = seg->offset + seg->length;
+  }
+  free(ps->lastURL);
+  ps->lastURL = strdup(seg->url);
+  if (ps->keyed) pl->encrypted = true;
+  pl->segmentCount++;
+  return true;
+}
+
+/* Handles one line of the playlist. Returns false if allocation fails */
+static bool parse_line(parse_state_t *ps, const char *line) {
+  hls_playlist_t *pl = ps->playlist;
+  if (line[0] == '\0') return true;
+
+  if (line[0] != '#') {
+    bool added = true;
+    if (ps->streamInf) {
+      pl->master = true;
+      added = add_variant(ps, line);
+    } else if (ps->extinf) {
+      added = add_segment(ps, line);
+    }
+    ps->streamInf = false;
+    ps->extinf = false;
+    ps->discontinuity = false;
+    ps->ranged = false;
+    return added;
+  }
+
+  if (has_prefix(line, "#EXT-X-STREAM-INF:")) {
+    const char *attrs = line + strlen("#EXT-X-STREAM-INF:");
+    char *bandwidth = attribute(attrs, "BANDWIDTH");
+    char *codecs = attribute(attrs, "CODECS");
+    ps->streamInf = true;
+    ps->bandwidth = bandwidth != NULL ? strtoull(bandwidth, NULL, 10) : 0;
+    ps->audioOnly = codecs_audio_only(codecs);
+    free(bandwidth);
+    free(codecs);
+  } else if (has_prefix(line, "#EXT-X-MEDIA:")) {
+    const char *attrs = line + strlen("#EXT-X-MEDIA:");
+    char *type = attribute(attrs, "TYPE");
+    char *uri = attribute(attrs, "URI");
+    char *isDefault = attribute(attrs, "DEFAULT");
+    bool audio = type != NULL && strcmp(type, "AUDIO") == 0 && uri != NULL;
+    bool preferred = isDefault != NULL && strcmp(isDefault, "YES") == 0;
+    bool ok = true;
+    if (audio && (pl->audioURL == NULL || (preferred && !ps->defaultAudio))) {
+      char *url = ASHLSResolveURL(ps->base, uri);
+      if (url != NULL) {
+        free(pl->audioURL);
+        pl->audioURL = url;
+        ps->defaultAudio = preferred;
+      } else {
+        ok = false;
+      }
+    }
+    free(type);
+    free(uri);
+    free(isDefault);
+    pl->master = true;
+    return ok;
+  } else if (has_prefix(line, "#EXT-X-TARGETDURATION:")) {
+    pl->targetDuration = strtod(line + strlen("#EXT-X-TARGETDURATION:"), NULL);
+  } else if (has_prefix(line, "#EXT-X-MEDIA-SEQUENCE:")) {
+    pl->mediaSequence = strtoull(line + strlen("#EXT-X-MEDIA-SEQUENCE:"), NULL, 10);
+  } else if (has_prefix(line, "#EXTINF:")) {
+    ps->extinf = true;
+    ps->duration = strtod(line + strlen("#EXTINF:"), NULL);
+    if (!(ps->duration >= 0)) ps->duration = 0;
+  } else if (has_prefix(line, "#EXT-X-BYTERANGE:")) {
+    ps->rangeOffset = UINT64_MAX;
+    ps->ranged = parse_byte_range(line + strlen("#EXT-X-BYTERANGE:"),
+                                  &ps->rangeLength, &ps->rangeOffset);
+  } else if (strcmp(line, "#EXT-X-DISCONTINUITY") == 0) {
+    ps->discontinuity = true;
+  } else if (strcmp(line, "#EXT-X-ENDLIST") == 0) {
+    pl->ended = true;
+  } else if (has_prefix(line, "#EXT-X-KEY:")) {
+    char *method = attribute(line + strlen("#EXT-X-KEY:"), "METHOD");
+    ps->keyed = method == NULL || strcmp(method, "NONE") != 0;
+    free(method);
+  } else if (has_prefix(line, "#EXT-X-MAP:")) {
+    const char *attrs = line + strlen("#EXT-X-MAP:");
+    char *uri = attribute(attrs, "URI");
+    char *range = attribute(attrs, "BYTERANGE");
+    free(ps->mapURL);
+    ps->mapURL = uri != NULL ? ASHLSResolveURL(ps->base, uri) : NULL;
+    ps->mapOffset = 0;
+    ps->mapLength = 0;
+    if (range != NULL) parse_byte_range(range, &ps->mapLength, &ps->mapOffset);
+    bool ok = uri == NULL || ps->mapURL != NULL;
+    free(uri);
+    free(range);
+    return ok;
+  }
+  return true;
+}
+
+hls_playlist_t *ASHLSPlaylistParse(const char *text, size_t length,
+                                   const char *baseURL) {
+  /* A byte order mark is allowed before the header */
+  if (length >= 3 && memcmp(text, "\xEF\xBB\xBF", 3) == 0) {
+    text += 3;
+    length -= 3;
+  }
+  if (length < 7 || memcmp(text, "#EXTM3U", 7) != 0) return NULL;
+
+  parse_state_t ps = {.base = baseURL};
+  ps.playlist = calloc(1, sizeof(hls_playlist_t));
+  if (ps.playlist == NULL) return NULL;
+  bool ok = true;
+  char *line = NULL;
+  size_t pos = 0;
+  while (ok && pos < length) {
+    const char *start = text + pos;
+    const char *newline = memchr(start, '\n', length - pos);
+    size_t lineLength = newline != NULL ? (size_t)(newline - start) : length - pos;
+    pos += lineLength + 1;
+    while (lineLength > 0 && isspace((unsigned char)start[lineLength - 1])) {
+      lineLength--;
+    }
+    while (lineLength > 0 && isspace((unsigned char)*start)) {
+      start++;
+      lineLength--;
+    }
+    line = strndup(start, lineLength);
+    ok = line != NULL && parse_line(&ps, line);
+    free(line);
+  }
+  free(ps.lastURL);
+  free(ps.mapURL);
+  if (!ok) {
+    ASHLSPlaylistFree(ps.playlist);
+    return NULL;
+  }
+  return ps.playlist;
+}
+
+void ASHLSPlaylistFree(hls_playlist_t *playlist) {
+  if (playlist == NULL) return;
+  for (size_t i = 0; i < playlist->variantCount; i++) {
+    free(playlist->variants[i].url);
+  }
+  for (size_t i = 0; i < playlist->segmentCount; i++) {
+    free(playlist->segments[i].url);
+    free(playlist->segments[i].mapURL);
+  }
+  free(playlist->variants);
+  free(playlist->segments);
+  free(playlist->audioURL);
+  free(playlist);
+}
+
+const char *ASHLSPlaylistMediaURL(const hls_playlist_t *playlist) {
+  if (playlist->audioURL != NULL) return playlist->audioURL;
+  const hls_variant_t *audio = NULL;
+  const hls_variant_t *smallest = NULL;
+  for (size_t i = 0; i < playlist->variantCount; i++) {
+    const hls_variant_t *v = &playlist->variants[i];
+    if (v->audioOnly && (audio == NULL || v->bandwidth > audio->bandwidth)) {
+      audio = v;
+    }
+    if (smallest == NULL || v->bandwidth < smallest->bandwidth) smallest = v;
+  }
+  if (audio != NULL) return audio->url;
+  return smallest != NULL ? smallest->url : NULL;
+}
+
+double ASHLSPlaylistDuration(const hls_playlist_t *playlist) {
+  double total = 0;
+  for (size_t i = 0; i < playlist->segmentCount; i++) {
+    total += playlist->segments[i].duration;
+  }
+  return total;
+}
@@ -0,0 +1,90 @@
+//
+//  ASHLSPlaylist.h
+//  AudioStreamer
+//
+
+#ifndef AS_HLS_PLAYLIST_H
+#define AS_HLS_PLAYLIST_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * HTTP Live Streaming (RFC 8216) playlists.
+ *
+ * A master playlist lists the variants of a stream, and the audio renditions
+ * they can be played with; a media playlist the segments of one of them, each
+ * a few seconds of audio in its own file. Parsing either gives a playlist with
+ * every URL in it made absolute against the playlist's own.
+ *
+ * Of a media playlist's tags, those which say where the segments are and how
+ * long they last are read: the target duration, the media sequence number of
+ * the first segment, segment durations, byte ranges, initialization sections
+ * (EXT-X-MAP), discontinuities and whether the playlist has ended. Segments
+ * encrypted with EXT-X-KEY can't be played, which is noted rather than failing
+ * the parse, so that the caller can say why. The rest are skipped.
+ *
+ * Only http and https URLs, and paths relative to them, are resolved.
+ *
+ * This is plain C without any CoreFoundation dependency.
+ */
+
+typedef struct hls_segment {
+  char    *url;
+  double   duration;            /* seconds, from its EXTINF */
+  uint64_t sequence;            /* media sequence number */
+  uint64_t offset;              /* of its byte range, if it has one */
+  uint64_t length;              /* of its byte range, 0 for the whole file */
+  bool     discontinuity;       /* the encoding may change from here on */
+  /* Initialization section, NULL if there is none */
+  char    *mapURL;
+  uint64_t mapOffset;
+  uint64_t mapLength;
+} hls_segment_t;
+
+typedef struct hls_variant {
+  char    *url;
+  uint64_t bandwidth;           /* bits per second, 0 if not given */
+  bool     audioOnly;           /* its CODECS are all AAC or MP3 (mp4a) */
+} hls_variant_t;
+
+typedef struct hls_playlist {
+  bool           master;
+
+  /* Master playlists. The audio URL is of the audio rendition to play, if
+     the variants' audio comes separately */
+  hls_variant_t *variants;
+  size_t         variantCount;
+  char          *audioURL;
+
+  /* Media playlists */
+  double         targetDuration;
+  uint64_t       mediaSequence;
+  bool           ended;         /* no more segments will be added */
+  bool           encrypted;     /* some segments can't be played */
+  hls_segment_t *segments;
+  size_t         segmentCount;
+} hls_playlist_t;
+
+/* Parses a playlist downloaded from the base URL. Returns NULL if the text
+   isn't a playlist or allocation fails */
+hls_playlist_t *ASHLSPlaylistParse(const char *text, size_t length,
+                                   const char *baseURL);
+
+void ASHLSPlaylistFree(hls_playlist_t *playlist);
+
+/* The media playlist to play from a master playlist: the audio rendition if
+   there is one, otherwise the audio-only variant with the highest bandwidth,
+   otherwise the variant with the lowest (as there's only its audio to keep).
+   Returns NULL if the master playlist lists nothing */
+const char *ASHLSPlaylistMediaURL(const hls_playlist_t *playlist);
+
+/* Sum of the segments' durations */
+double ASHLSPlaylistDuration(const hls_playlist_t *playlist);
+
+/* Makes a URL absolute against a base URL. Returns NULL if it can't be, or
+   allocation fails; otherwise the string is the caller's to free */
+char *ASHLSResolveURL(const char *base, const char *url);
+
+#endif
@@ -0,0 +1,696 @@
+//
+//  ASHLSTransport.c
+//  AudioStreamer
+//
+
+#include "ASHLSTransport.h"
+#include "ASFMP4Demuxer.h"
+#include "ASHLSPlaylist.h"
+#include "ASTSDemuxer.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+/* Segments back from the end of a live playlist to start at */
+#define kLiveEdgeSegments 3
+#define kMaxReloadFailures 3
+/* Target duration to assume if a playlist doesn't give one */
+#define kDefaultTargetDuration 10.0
+#define kID3HeaderSize 10
+
+typedef struct hls hls_t;
+typedef struct fetch fetch_t;
+
+/* A download of a segment, or of an initialization section */
+struct fetch {
+  hls_t       *owner;
+  fetch_t     *next;
+  transport_t *request;         /* NULL once the response has ended */
+  bool         init;
+  uint64_t     offset;          /* of its byte range */
+  uint64_t     length;          /* of its byte range, 0 for the whole file */
+  uint8_t     *data;
+  size_t       received;
+  size_t       capacity;
+  bool         checked;         /* has its response been looked at? */
+  bool         whole;           /* the server sent the whole file, not the range */
+};
+
+struct hls {
+  transport_t  transport;       /* must be first */
+  http_client_t *client;
+  http_client_task_t task;      /* sends events */
+  http_client_task_t reload;    /* reloads a live playlist */
+
+  /* The request, copied. The URL is the media playlist's once it's known */
+  char        *url;
+  char       **headers;
+  size_t       headerCount;
+  http_proxy_type_t proxyType;
+  char        *proxyHost;
+  uint16_t     proxyPort;
+
+  transport_t *playlistRequest;
+  uint8_t     *playlistData;
+  size_t       playlistLength;
+  size_t       playlistCapacity;
+  bool         followedMaster;
+  hls_playlist_t *playlist;     /* the latest of the media playlist */
+  unsigned     failures;        /* reloads in a row which failed */
+
+  double       startTime;       /* asked for */
+  double       startedAt;       /* start of the first segment */
+  bool         started;         /* has the first segment been chosen? */
+  uint64_t     nextSequence;    /* of the next segment to fetch */
+  unsigned     prefetch;
+  fetch_t     *head;            /* in the order they're to be read */
+  fetch_t     *tail;
+  unsigned     segments;        /* media segments among them */
+
+  /* The initialization section last fetched */
+  char        *mapURL;
+  uint64_t     mapOffset;
+  uint64_t     mapLength;
+  fmp4_demuxer_t *fmp4;
+  fmp4_codec_t codec;           /* of its sound track */
+
+  /* Demuxed audio of the segment being read */
+  uint8_t     *out;
+  size_t       outLength;
+  size_t       outCapacity;
+  size_t       outRead;
+  bool         outOfMemory;
+  const char  *contentType;     /* NULL until the first segment is demuxed */
+
+  char        *error;
+  bool         endSent;
+  bool         errorSent;
+};
+
+static char *copy_string(const char *string) {
+  return string != NULL ? strdup(string) : NULL;
+}
+
+static bool append(uint8_t **data, size_t *length, size_t *capacity,
+                   const uint8_t *bytes, size_t count) {
+  if (count > *capacity - *length) {
+    size_t size = *capacity > 0 ? *capacity : 4096;
+    while (count > size - *length) size *= 2;
+    uint8_t *grown = realloc(*data, size);
+    if (grown == NULL) return false;
+    *data = grown;
+    *capacity = size;
+  }
+  memcpy(*data + *length, bytes, count);
+  *length += count;
+  return true;
+}
+
+static void hls_poke(hls_t *h) {
+  ASHTTPClientSchedule(h->client, &h->task);
+}
+
+static void fetch_free(fetch_t *f) {
+  if (f->request != NULL) ASTransportClose(f->request);
+  free(f->data);
+  free(f);
+}
+
+static void hls_fail(hls_t *h, const char *error) {
+  if (h->error != NULL) return;
+  h->error = strdup(error != NULL ? error : "");
+  /* Nothing more will arrive, but what has been demuxed can still be read */
+  while (h->head != NULL) {
+    fetch_t *f = h->head;
+    h->head = f->next;
+    fetch_free(f);
+  }
+  h->tail = NULL;
+  h->segments = 0;
+  if (h->playlistRequest != NULL) {
+    ASTransportClose(h->playlistRequest);
+    h->playlistRequest = NULL;
+  }
+  ASHTTPClientUnschedule(h->client, &h->reload);
+  hls_poke(h);
+}
+
+static transport_t *hls_open(hls_t *h, const char *url, const char *range,
+                             transport_event_proc proc, void *context) {
+  size_t count = h->headerCount;
+  const char *fields[2 * (count + 1)];
+  for (size_t i = 0; i < 2 * count; i++) {
+    fields[i] = h->headers[i];
+  }
+  if (range != NULL) {
+    fields[2 * count] = "Range";
+    fields[2 * count + 1] = range;
+    count++;
+  }
+  http_request_info_t info = {
+    .url = url,
+    .headers = fields,
+    .headerCount = count,
+    .proxyType = h->proxyType,
+    .proxyHost = h->proxyHost,
+    .proxyPort = h->proxyPort,
+  };
+  return ASHTTPClientOpen(h->client, &info, proc, context);
+}
+
+/* Segments */
+
+static void fetch_event(void *context, transport_t *transport,
+                        transport_event_t event);
+static void hls_next_segment(hls_t *h);
+
+static bool fetch_add(hls_t *h, const char *url, uint64_t offset,
+                      uint64_t length, bool init) {
+  fetch_t *f = calloc(1, sizeof(fetch_t));
+  if (f == NULL) return false;
+  f->owner = h;
+  f->init = init;
+  f->offset = offset;
+  f->length = length;
+  char range[64];
+  if (length > 0) {
+    snprintf(range, sizeof(range), "bytes=%" PRIu64 "-%" PRIu64, offset,
+             offset + length - 1);
+  }
+  f->request = hls_open(h, url, length > 0 ? range : NULL, fetch_event, f);
+  if (f->request == NULL) {
+    free(f);
+    return false;
+  }
+  if (h->tail != NULL) {
+    h->tail->next = f;
+  } else {
+    h->head = f;
+  }
+  h->tail = f;
+  if (!init) h->segments++;
+  return true;
+}
+
+static const hls_segment_t *find_segment(const hls_playlist_t *pl,
+                                         uint64_t sequence) {
+  if (pl == NULL || pl->segmentCount == 0 || sequence < pl->mediaSequence ||
+      sequence - pl->mediaSequence >= pl->segmentCount) {
+    return NULL;
+  }
+  return &pl->segments[sequence - pl->mediaSequence];
+}
+
+/* Starts downloads until enough segments are on their way */
+static void hls_fill(hls_t *h) {
+  const hls_playlist_t *pl = h->playlist;
+  unsigned ahead = h->prefetch > 0 ? h->prefetch : 1;
+  while (h->error == NULL && pl != NULL && h->segments < ahead) {
+    /* Too far behind a live playlist: carry on from its oldest segment */
+    if (pl->segmentCount > 0 && h->nextSequence < pl->mediaSequence) {
+      h->nextSequence = pl->mediaSequence;
+    }
+    const hls_segment_t *seg = find_segment(pl, h->nextSequence);
+    if (seg == NULL) return;
+
+    bool newMap = seg->mapURL != NULL &&
+      (h->mapURL == NULL || strcmp(h->mapURL, seg->mapURL) != 0 ||
+       h->mapOffset != seg->mapOffset || h->mapLength != seg->mapLength);
+    if (newMap) {
+      free(h->mapURL);
+      h->mapURL = strdup(seg->mapURL);
+      h->mapOffset = seg->mapOffset;
+      h->mapLength = seg->mapLength;
+      if (h->mapURL == NULL ||
+          !fetch_add(h, seg->mapURL, seg->mapOffset, seg->mapLength, true)) {
+        hls_fail(h, "could not start a request");
+        return;
+      }
+    }
+    if (!fetch_add(h, seg->url, seg->offset, seg->length, false)) {
+      hls_fail(h, "could not start a request");
+      return;
+    }
+    h->nextSequence++;
+  }
+}
+
+static void demux_output(void *context, const uint8_t *bytes, size_t length) {
+  hls_t *h = context;
+  if (!append(&h->out, &h->outLength, &h->outCapacity, bytes, length)) {
+    h->outOfMemory = true;
+  }
+}
+
+/* Size of the ID3v2 tag at the start of the bytes, or 0 if there isn't one */
+static size_t id3_size(const uint8_t *bytes, size_t length) {
+  if (length < kID3HeaderSize || memcmp(bytes, "ID3", 3) != 0) return 0;
+  size_t size = ((size_t)(bytes[6] & 0x7F) << 21) | ((size_t)(bytes[7] & 0x7F) << 14) |
+                ((size_t)(bytes[8] & 0x7F) << 7) | (size_t)(bytes[9] & 0x7F);
+  size += kID3HeaderSize;
+  /* A footer repeats the header at the end */
+  if (bytes[5] & 0x10) size += kID3HeaderSize;
+  return size < length ? size : length;
+}
+
+/* Demuxes a media segment into the output. Returns the Content-Type of what
+   came out, or NULL if nothing which can be played did */
+static const char *demux_segment(hls_t *h, const uint8_t *bytes, size_t length,
+                                 uint64_t fileOffset) {
+  if (ASTSDemuxerProbe(bytes, length)) {
+    switch (ASTSDemuxSegment(bytes, length, demux_output, h)) {
+      case TS_AUDIO_ADTS: return "audio/aac";
+      case TS_AUDIO_MPEG: return "audio/mpeg";
+      default: return NULL;
+    }
+  }
+  if (ASFMP4DemuxerProbe(bytes, length)) {
+    /* Without an EXT-X-MAP, the segment has to start with its own moov */
+    if (h->codec == FMP4_CODEC_NONE) {
+      h->codec = ASFMP4DemuxerInit(h->fmp4, bytes, length);
+    }
+    if (!ASFMP4DemuxSegment(h->fmp4, bytes, length, fileOffset, demux_output, h)) {
+      return NULL;
+    }
+    return h->codec == FMP4_CODEC_AAC ? "audio/aac" : "audio/mpeg";
+  }
+
+  /* Packed audio, after the ID3 tag with its timestamp */
+  size_t skip = 0;
+  size_t tag;
+  while ((tag = id3_size(bytes + skip, length - skip)) > 0) skip += tag;
+  bytes += skip;
+  length -= skip;
+  if (length < 2 || bytes[0] != 0xFF || (bytes[1] & 0xE0) != 0xE0) return NULL;
+  demux_output(h, bytes, length);
+  /* ADTS has the layer bits clear */
+  return (bytes[1] & 0x06) == 0 ? "audio/aac" : "audio/mpeg";
+}
+
+/* Moves on to the next segment once the last has been read, demuxing it if
+   it has arrived */
+static void hls_next_segment(hls_t *h) {
+  while (h->error == NULL && h->outRead == h->outLength && h->head != NULL &&
+         h->head->request == NULL) {
+    fetch_t *f = h->head;
+    h->head = f->next;
+    if (h->head == NULL) h->tail = NULL;
+    if (!f->init) h->segments--;
+    h->outLength = 0;
+    h->outRead = 0;
+
+    /* Of a whole file sent in place of a range, only the range is wanted */
+    const uint8_t *bytes = f->data;
+    size_t length = f->received;
+    uint64_t fileOffset = f->offset;
+    if (f->whole) {
+      if (f->offset >= length || f->length > length - f->offset) {
+        fetch_free(f);
+        hls_fail(h, "a segment's byte range is past its end");
+        return;
+      }
+      bytes += f->offset;
+      length = (size_t)f->length;
+    }
+
+    const char *error = NULL;
+    if (f->init) {
+      h->codec = ASFMP4DemuxerInit(h->fmp4, bytes, length);
+      if (h->codec == FMP4_CODEC_NONE) {
+        error = "the stream has no audio which can be played";
+      }
+    } else {
+      const char *type = demux_segment(h, bytes, length, fileOffset);
+      if (type == NULL) {
+        error = "a segment has no audio which can be played";
+      } else if (h->contentType != NULL && strcmp(type, h->contentType) != 0) {
+        error = "the stream's audio format changed";
+      }
+      h->contentType = type;
+    }
+    fetch_free(f);
+    if (h->outOfMemory) error = "out of memory";
+    if (error != NULL) {
+      h->outLength = 0;
+      hls_fail(h, error);
+      return;
+    }
+    hls_fill(h);
+  }
+}
+
+/* Looks at a download's response once it has arrived */
+static bool fetch_check(fetch_t *f) {
+  f->checked = true;
+  int status = ASTransportStatusCode(f->request);
+  if (status == 200 && f->length > 0) {
+    f->whole = true;
+  } else if (status != 200 && status != 206) {
+    char error[64];
+    snprintf(error, sizeof(error), "Server returned HTTP %d for a segment", status);
+    hls_fail(f->owner, error);
+    return false;
+  }
+  return true;
+}
+
+static void fetch_event(void *context, transport_t *transport,
+                        transport_event_t event) {
+  fetch_t *f = context;
+  hls_t *h = f->owner;
+  if (event == TRANSPORT_EVENT_ERROR) {
+    hls_fail(h, ASTransportError(transport));
+    return;
+  }
+  if (!f->checked && !fetch_check(f)) return;
+
+  uint8_t buffer[16384];
+  ssize_t length;
+  while ((length = ASTransportRead(transport, buffer, sizeof(buffer))) > 0) {
+    if (!append(&f->data, &f->received, &f->capacity, buffer, (size_t)length)) {
+      hls_fail(h, "out of memory");
+      return;
+    }
+  }
+  if (event == TRANSPORT_EVENT_END || ASTransportAtEnd(transport)) {
+    ASTransportClose(transport);
+    f->request = NULL;
+    if (f == h->head) {
+      hls_next_segment(h);
+      hls_poke(h);
+    }
+  }
+}
+
+/* Playlists */
+
+static void playlist_event(void *context, transport_t *transport,
+                           transport_event_t event);
+
+static void playlist_request(hls_t *h) {
+  if (h->error != NULL || h->playlistRequest != NULL) return;
+  h->playlistLength = 0;
+  h->playlistRequest = hls_open(h, h->url, NULL, playlist_event, h);
+  if (h->playlistRequest == NULL) hls_fail(h, "could not start a request");
+}
+
+static void playlist_reload(void *context) {
+  playlist_request(context);
+}
+
+/* Picks the segment to start at */
+static void hls_start(hls_t *h) {
+  const hls_playlist_t *pl = h->playlist;
+  if (pl->segmentCount == 0) return;
+  size_t index = 0;
+  if (pl->ended) {
+    double time = 0;
+    while (index + 1 < pl->segmentCount &&
+           time + pl->segments[index].duration <= h->startTime) {
+      time += pl->segments[index].duration;
+      index++;
+    }
+    h->startedAt = time;
+  } else if (pl->segmentCount > kLiveEdgeSegments) {
+    index = pl->segmentCount - kLiveEdgeSegments;
+  }
+  h->nextSequence = pl->segments[index].sequence;
+  h->started = true;
+}
+
+static double target_duration(const hls_playlist_t *pl) {
+  return pl != NULL && pl->targetDuration > 0 ? pl->targetDuration :
+                                                kDefaultTargetDuration;
+}
+
+static void playlist_failed(hls_t *h, const char *error) {
+  /* A live playlist which has been loaded before can miss a reload or two */
+  if (h->playlist == NULL || ++h->failures >= kMaxReloadFailures) {
+    hls_fail(h, error);
+    return;
+  }
+  ASHTTPClientScheduleAfter(h->client, &h->reload,
+                            target_duration(h->playlist) / 2);
+}
+
+static void playlist_loaded(hls_t *h) {
+  char *text = (char *)h->playlistData;
+  hls_playlist_t *pl = ASHLSPlaylistParse(text, h->playlistLength, h->url);
+  if (pl == NULL) {
+    playlist_failed(h, "the playlist couldn't be read");
+    return;
+  }
+
+  if (pl->master) {
+    const char *media = ASHLSPlaylistMediaURL(pl);
+    if (h->followedMaster || media == NULL) {
+      ASHLSPlaylistFree(pl);
+      hls_fail(h, "the master playlist has no media playlist to play");
+      return;
+    }
+    char *url = strdup(media);
+    ASHLSPlaylistFree(pl);
+    if (url == NULL) {
+      hls_fail(h, "out of memory");
+      return;
+    }
+    free(h->url);
+    h->url = url;
+    h->followedMaster = true;
+    playlist_request(h);
+    return;
+  }
+  if (pl->encrypted) {
+    ASHLSPlaylistFree(pl);
+    hls_fail(h, "encrypted streams aren't supported");
+    return;
+  }
+
+  /* Reloads come sooner while nothing new is turning up */
+  bool changed = h->playlist == NULL ||
+    pl->mediaSequence + pl->segmentCount >
+      h->playlist->mediaSequence + h->playlist->segmentCount;
+  ASHLSPlaylistFree(h->playlist);
+  h->playlist = pl;
+  h->failures = 0;
+  if (!h->started) hls_start(h);
+  hls_fill(h);
+  if (!pl->ended) {
+    double delay = target_duration(pl);
+    ASHTTPClientScheduleAfter(h->client, &h->reload, changed ? delay : delay / 2);
+  }
+  /* An empty playlist which has ended is the end */
+  hls_poke(h);
+}
+
+static void playlist_event(void *context, transport_t *transport,
+                           transport_event_t event) {
+  hls_t *h = context;
+  if (event == TRANSPORT_EVENT_ERROR) {
+    char *error = copy_string(ASTransportError(transport));
+    ASTransportClose(transport);
+    h->playlistRequest = NULL;
+    playlist_failed(h, error);
+    free(error);
+    return;
+  }
+  int status = ASTransportStatusCode(transport);
+  if (status != 200) {
+    ASTransportClose(transport);
+    h->playlistRequest = NULL;
+    char error[64];
+    snprintf(error, sizeof(error), "Server returned HTTP %d for the playlist", status);
+    playlist_failed(h, error);
+    return;
+  }
+
+  uint8_t buffer[16384];
+  ssize_t length;
+  while ((length = ASTransportRead(transport, buffer, sizeof(buffer))) > 0) {
+    if (!append(&h->playlistData, &h->playlistLength, &h->playlistCapacity,
+                buffer, (size_t)length)) {
+      hls_fail(h, "out of memory");
+      return;
+    }
+  }
+  if (event == TRANSPORT_EVENT_END || ASTransportAtEnd(transport)) {
+    ASTransportClose(transport);
+    h->playlistRequest = NULL;
+    playlist_loaded(h);
+  }
+}
+
+/* Transport */
+
+static ssize_t hls_read(transport_t *transport, void *buffer, size_t length) {
+  hls_t *h = (hls_t *)transport;
+  size_t available = h->outLength - h->outRead;
+  if (available > length) available = length;
+  memcpy(buffer, h->out + h->outRead, available);
+  h->outRead += available;
+  if (h->outRead == h->outLength) hls_next_segment(h);
+  if (available == 0 && h->error != NULL) return -1;
+
+  /* Whatever's left, or the end, is the next event */
+  if (ASTransportHasBytesAvailable(transport) || ASTransportAtEnd(transport) ||
+      h->error != NULL) {
+    hls_poke(h);
+  }
+  return (ssize_t)available;
+}
+
+static bool hls_has_bytes(transport_t *transport) {
+  hls_t *h = (hls_t *)transport;
+  return h->outRead < h->outLength;
+}
+
+static bool hls_at_end(transport_t *transport) {
+  hls_t *h = (hls_t *)transport;
+  return h->error == NULL && h->playlist != NULL && h->playlist->ended &&
+         h->head == NULL && h->outRead == h->outLength &&
+         find_segment(h->playlist, h->nextSequence) == NULL;
+}
+
+static void hls_set_paused(transport_t *transport, bool paused) {
+  hls_t *h = (hls_t *)transport;
+  if (!paused) hls_poke(h);
+}
+
+static int hls_status(transport_t *transport) {
+  hls_t *h = (hls_t *)transport;
+  return h->contentType != NULL ? 200 : 0;
+}
+
+static size_t hls_header_count(transport_t *transport) {
+  hls_t *h = (hls_t *)transport;
+  return h->contentType != NULL ? 1 : 0;
+}
+
+static bool hls_header(transport_t *transport, size_t index, const char **name,
+                       const char **value) {
+  hls_t *h = (hls_t *)transport;
+  if (h->contentType == NULL || index > 0) return false;
+  *name = "Content-Type";
+  *value = h->contentType;
+  return true;
+}
+
+static const char *hls_error(transport_t *transport) {
+  return ((hls_t *)transport)->error;
+}
+
+/* Sends the event the transport has waiting, if any */
+static void hls_deliver(void *context) {
+  hls_t *h = context;
+  transport_t *transport = &h->transport;
+  if (ASTransportIsPaused(transport)) return;
+  bool hasBytes = ASTransportHasBytesAvailable(transport);
+  if (h->error != NULL && !hasBytes) {
+    if (h->errorSent) return;
+    h->errorSent = true;
+    ASTransportNotify(transport, TRANSPORT_EVENT_ERROR);
+  } else if (hasBytes) {
+    ASTransportNotify(transport, TRANSPORT_EVENT_READABLE);
+  } else if (ASTransportAtEnd(transport) && !h->endSent) {
+    h->endSent = true;
+    ASTransportNotify(transport, TRANSPORT_EVENT_END);
+  }
+}
+
+static void hls_close(transport_t *transport) {
+  hls_t *h = (hls_t *)transport;
+  ASHTTPClientUnschedule(h->client, &h->task);
+  ASHTTPClientUnschedule(h->client, &h->reload);
+  while (h->head != NULL) {
+    fetch_t *f = h->head;
+    h->head = f->next;
+    fetch_free(f);
+  }
+  if (h->playlistRequest != NULL) ASTransportClose(h->playlistRequest);
+  for (size_t i = 0; i < 2 * h->headerCount; i++) {
+    free(h->headers[i]);
+  }
+  free(h->headers);
+  free(h->url);
+  free(h->proxyHost);
+  free(h->playlistData);
+  ASHLSPlaylistFree(h->playlist);
+  free(h->mapURL);
+  ASFMP4DemuxerDestroy(h->fmp4);
+  free(h->out);
+  free(h->error);
+  free(h);
+}
+
+static const transport_ops_t hls_ops = {
+  .read = hls_read,
+  .hasBytesAvailable = hls_has_bytes,
+  .atEnd = hls_at_end,
+  .setPaused = hls_set_paused,
+  .statusCode = hls_status,
+  .headerCount = hls_header_count,
+  .header = hls_header,
+  .error = hls_error,
+  .close = hls_close,
+};
+
+transport_t *ASHLSTransportCreate(http_client_t *client, const hls_info_t *info,
+                                  transport_event_proc proc, void *context) {
+  if (!ASHTTPClientHandlesURL(info->request.url)) return NULL;
+  hls_t *h = calloc(1, sizeof(hls_t));
+  if (h == NULL) return NULL;
+  ASTransportInit(&h->transport, &hls_ops, proc, context);
+  h->client = client;
+  h->task.run = hls_deliver;
+  h->task.context = h;
+  h->reload.run = playlist_reload;
+  h->reload.context = h;
+  h->startTime = info->startTime > 0 ? info->startTime : 0;
+  h->prefetch = info->prefetch;
+
+  h->url = copy_string(info->request.url);
+  h->proxyType = info->request.proxyType;
+  h->proxyHost = copy_string(info->request.proxyHost);
+  h->proxyPort = info->request.proxyPort;
+  h->fmp4 = ASFMP4DemuxerCreate();
+  bool copied = h->url != NULL && h->fmp4 != NULL &&
+                (info->request.proxyHost == NULL || h->proxyHost != NULL);
+  h->headers = calloc(2 * info->request.headerCount + 1, sizeof(char *));
+  if (h->headers == NULL) copied = false;
+  for (size_t i = 0; copied && i < info->request.headerCount; i++) {
+    /* Ranges are asked for per segment */
+    const char *name = info->request.headers[2 * i];
+    if (strcasecmp(name, "Range") == 0 || strcasecmp(name, "If-Range") == 0) {
+      continue;
+    }
+    h->headers[2 * h->headerCount] = strdup(name);
+    h->headers[2 * h->headerCount + 1] = strdup(info->request.headers[2 * i + 1]);
+    h->headerCount++;
+    copied = h->headers[2 * h->headerCount - 2] != NULL &&
+             h->headers[2 * h->headerCount - 1] != NULL;
+  }
+  if (!copied) {
+    hls_close(&h->transport);
+    return NULL;
+  }
+  h->playlistRequest = hls_open(h, h->url, NULL, playlist_event, h);
+  if (h->playlistRequest == NULL) {
+    hls_close(&h->transport);
+    return NULL;
+  }
+  return &h->transport;
+}
+
+double ASHLSTransportStartTime(transport_t *transport) {
+  return ((hls_t *)transport)->startedAt;
+}
+
+bool ASHLSTransportDuration(transport_t *transport, double *duration) {
+  hls_t *h = (hls_t *)transport;
+  if (h->playlist == NULL || !h->playlist->ended) return false;
+  *duration = ASHLSPlaylistDuration(h->playlist);
+  return true;
+}
@@ -0,0 +1,63 @@
+//
+//  ASHLSTransport.h
+//  AudioStreamer
+//
+
+#ifndef AS_HLS_TRANSPORT_H
+#define AS_HLS_TRANSPORT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "ASHTTPClient.h"
+#include "ASTransport.h"
+
+/*
+ * Plays an HTTP Live Streaming stream as if it were one progressive download.
+ *
+ * The playlist is fetched first; a master playlist leads on to the media
+ * playlist of its audio (see ASHLSPlaylist.h for which). Segments are then
+ * downloaded in order, each with a request of its own on the HTTP client,
+ * and up to a set number of them ahead of the one being read, so that the
+ * next is usually there by the time it's needed. A segment is demuxed once
+ * it's complete and its turn comes: transport stream segments with
+ * ASTSDemuxer.h, fragmented MP4 with ASFMP4Demuxer.h, and packed audio (raw
+ * ADTS or MP3, after its ID3 timestamp) as it is. Whichever it was, what's
+ * read is an ADTS or MP3 stream, and the response says which with a made up
+ * Content-Type of audio/aac or audio/mpeg.
+ *
+ * A playlist with an end (VOD) is started from the segment holding the start
+ * time asked for, which is how seeking works. A live playlist is started three
+ * segments from its end, as RFC 8216 recommends, and reloaded every target
+ * duration while it's being played, or every half of one when a reload found
+ * nothing new. If reading falls so far behind that the next segment has left
+ * the playlist, it carries on from the oldest one there is. A few reloads in a
+ * row can fail before the transport does.
+ *
+ * Encrypted streams aren't supported, and neither are https URLs, as nothing
+ * but the HTTP client fetches anything.
+ *
+ * This is plain C without any CoreFoundation dependency.
+ */
+
+typedef struct hls_info {
+  /* The playlist's request */
+  http_request_info_t request;
+  double startTime;             /* seconds into a VOD stream to start from */
+  unsigned prefetch;            /* segments downloaded ahead of the one read */
+} hls_info_t;
+
+/* Starts fetching the playlist, returning NULL if the URL can't be handled or
+   allocation fails */
+transport_t *ASHLSTransportCreate(http_client_t *client, const hls_info_t *info,
+                                  transport_event_proc proc, void *context);
+
+/* Where in the stream reading started, in seconds: the start of the segment
+   the start time fell in. Known once there's something to read */
+double ASHLSTransportStartTime(transport_t *transport);
+
+/* The duration of a VOD stream. Returns false for a live one, or if the
+   playlist hasn't been loaded yet */
+bool ASHLSTransportDuration(transport_t *transport, double *duration);
+
+#endif
@@ -0,0 +1,1820 @@
+//
+//  ASHTTPClient.c
+//  AudioStreamer
+//
+
+#include "ASHTTPClient.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#else
+#include <sys/event.h>
+#endif
+
+/* Received bytes not yet taken by the response parser */
+#define kConnBufferSize 32768
+/* Body bytes not yet read by the request's reader */
+#define kRequestBufferSize 65536
+/* Most of an abandoned body read off to keep its connection */
+#define kDrainLimit 65536
+/* Idle connections are closed after this many seconds, and no more than this
+   many are kept */
+#define kIdleTimeout 30.0
+#define kMaxIdleConnections 8
+#define kMaxRedirects 5
+#define kMaxEvents 32
+/* The kqueue's one timer */
+#define kTimerIdent 1
+
+#ifdef MSG_NOSIGNAL
+#define kSendFlags MSG_NOSIGNAL
+#else
+#define kSendFlags 0
+#endif
+
+typedef struct conn conn_t;
+typedef struct http_request http_request_t;
+typedef struct lookup lookup_t;
+
+/* What a descriptor being watched belongs to */
+typedef enum {
+  HANDLE_WAKE,
+  HANDLE_TIMER,
+  HANDLE_SOCKET,
+  HANDLE_LOOKUP,
+} handle_kind_t;
+
+typedef struct poll_handle {
+  handle_kind_t kind;
+  void *owner;
+} poll_handle_t;
+
+typedef enum {
+  CONN_RESOLVING,
+  CONN_CONNECTING,
+  CONN_SOCKS_GREETING,
+  CONN_SOCKS_CONNECT,
+  CONN_ACTIVE,      /* carrying a request, or reading off an abandoned body */
+  CONN_IDLE,
+  CONN_CLOSED,
+} conn_state_t;
+
+typedef enum {
+  RESPONSE_HEAD,
+  RESPONSE_BODY,
+} response_state_t;
+
+typedef enum {
+  BODY_LENGTH,
+  BODY_CHUNKED,
+  BODY_UNTIL_CLOSE,
+} body_framing_t;
+
+typedef enum {
+  CHUNK_SIZE,
+  CHUNK_DATA,
+  CHUNK_DATA_END,
+  CHUNK_TRAILER,
+} chunk_state_t;
+
+/* A host name lookup on a thread of its own. The thread writes a byte to its
+   end of the socket pair once it's done; whichever of it and the client lets
+   go last frees the lookup */
+struct lookup {
+  atomic_int       refs;
+  atomic_bool      done;
+  int              fds[2];
+  char            *host;
+  char             service[8];
+  struct addrinfo *result;
+  int              status;
+};
+
+struct conn {
+  http_client_t *client;
+  conn_t        *next;          /* in the client's list of connections */
+  conn_state_t   state;
+  char          *key;           /* connections with the same key are alike */
+  http_proxy_type_t proxyType;
+  char          *host;          /* where the socket connects to */
+  uint16_t       port;
+  char          *targetHost;    /* where a SOCKS proxy connects to */
+  uint16_t       targetPort;
+
+  int            fd;
+  poll_handle_t  socketHandle;
+  bool           watchRead;
+  bool           watchWrite;
+  lookup_t      *lookup;
+  poll_handle_t  lookupHandle;
+  struct addrinfo *addresses;
+  struct addrinfo *nextAddress;
+
+  uint8_t       *out;
+  size_t         outLength;
+  size_t         outSent;
+  uint8_t        in[kConnBufferSize];
+  size_t         inLength;
+
+  http_request_t *request;      /* sent on the connection, or NULL */
+  http_request_t *redirected;   /* to be restarted once parsing is done */
+  bool           draining;      /* the response is for an abandoned request,
+                                   and any request is waiting behind it */
+  bool           used;          /* has carried a request */
+  bool           reused;        /* had carried one before the current one */
+  double         idleSince;
+
+  /* The response being read */
+  response_state_t response;
+  body_framing_t framing;
+  chunk_state_t  chunk;
+  uint64_t       remaining;     /* of the body or of the current chunk */
+  uint64_t       drainLeft;     /* before an abandoned body isn't worth it */
+  bool           keepAlive;
+  bool           sawResponse;   /* any bytes of a response have arrived */
+};
+
+struct http_request {
+  transport_t     transport;    /* must be first */
+  http_client_t  *client;
+  conn_t         *conn;
+  http_request_t *nextPending;
+  bool            pending;
+
+  http_proxy_type_t proxyType;
+  char           *proxyHost;
+  uint16_t        proxyPort;
+  char           *extraHeaders; /* header lines sent with every attempt */
+  char           *host;
+  uint16_t        port;
+  char           *path;
+  char           *text;         /* the request as sent */
+  size_t          textLength;
+  int             redirects;
+  bool            retried;      /* on a fresh connection after a stale one */
+
+  int             status;
+  char          **headerNames;
+  char          **headerValues;
+  size_t          headerCount;
+
+  uint8_t         buffer[kRequestBufferSize];
+  size_t          bufferStart;
+  size_t          bufferCount;
+  bool            complete;
+  bool            endSent;
+  bool            errorSent;
+  char           *error;
+  char           *redirect;
+};
+
+struct http_client {
+  int             pollfd;
+  int             wake[2];
+  poll_handle_t   wakeHandle;
+  bool            wakeSignalled;
+  int             timer;        /* timerfd on Linux, -1 elsewhere */
+  poll_handle_t   timerHandle;
+  bool            processing;
+  conn_t         *conns;
+  conn_t         *dead;         /* closed, freed once processing is done */
+  http_request_t *pending;      /* with an event to send */
+  http_request_t *pendingTail;
+  http_client_task_t *tasks;    /* waiting to run */
+  http_client_task_t *tasksTail;
+  http_client_task_t *timers;   /* timed tasks, soonest first */
+  http_client_stats_t stats;
+};
+
+static void conn_parse(conn_t *conn);
+static void conn_close(conn_t *conn);
+static bool request_start(http_request_t *req);
+static void request_fail(http_request_t *req, const char *error);
+
+/* The request the response being read is for, if it's still wanted */
+static http_request_t *conn_reader(const conn_t *conn) {
+  return conn->draining ? NULL : conn->request;
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/* Like asprintf, which isn't everywhere */
+static char *format(const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  int length = vsnprintf(NULL, 0, fmt, args);
+  va_end(args);
+  if (length < 0) return NULL;
+  char *result = malloc((size_t)length + 1);
+  if (result == NULL) return NULL;
+  va_start(args, fmt);
+  vsnprintf(result, (size_t)length + 1, fmt, args);
+  va_end(args);
+  return result;
+}
+
+/* Writes a host as it goes in a URL, with an IPv6 address in brackets */
+static void format_host(char *buffer, size_t size, const char *host) {
+  if (strchr(host, ':') != NULL) {
+    snprintf(buffer, size, "[%s]", host);
+  } else {
+    snprintf(buffer, size, "%s", host);
+  }
+}
+
+static void set_nonblocking(int fd) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+#ifdef SO_NOSIGPIPE
+  int on = 1;
+  setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+}
+
+/* Poller */
+
+static int poller_create(void) {
+#ifdef __linux__
+  return epoll_create1(EPOLL_CLOEXEC);
+#else
+  return kqueue();
+#endif
+}
+
+static bool poller_watch(int pollfd, int fd, poll_handle_t *handle,
+                         bool read, bool write, bool added) {
+#ifdef __linux__
+  struct epoll_event ev = {0};
+  ev.events = (read ? EPOLLIN : 0) | (write ? EPOLLOUT : 0);
+  ev.data.ptr = handle;
+  return epoll_ctl(pollfd, added ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &ev) == 0;
+#else
+  (void)added;
+  struct kevent changes[2];
+  EV_SET(&changes[0], fd, EVFILT_READ, EV_ADD | (read ? EV_ENABLE : EV_DISABLE),
+         0, 0, handle);
+  EV_SET(&changes[1], fd, EVFILT_WRITE, EV_ADD | (write ? EV_ENABLE : EV_DISABLE),
+         0, 0, handle);
+  return kevent(pollfd, changes, 2, NULL, 0, NULL) == 0;
+#endif
+}
+
+static void poller_unwatch(int pollfd, int fd) {
+#ifdef __linux__
+  epoll_ctl(pollfd, EPOLL_CTL_DEL, fd, NULL);
+#else
+  /* Closing the descriptor takes it out of the kqueue */
+  (void)pollfd;
+  (void)fd;
+#endif
+}
+
+typedef struct poll_event {
+  poll_handle_t *handle;
+  bool readable;
+  bool writable;
+} poll_event_t;
+
+static int poller_wait(int pollfd, poll_event_t *events, int timeout) {
+#ifdef __linux__
+  struct epoll_event evs[kMaxEvents];
+  int n = epoll_wait(pollfd, evs, kMaxEvents, timeout);
+  for (int i = 0; i < n; i++) {
+    events[i].handle = evs[i].data.ptr;
+    /* Errors and hangups show up when reading or writing */
+    events[i].readable = (evs[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) != 0;
+    events[i].writable = (evs[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) != 0;
+  }
+  return n;
+#else
+  struct kevent evs[kMaxEvents];
+  struct timespec ts, *tsp = NULL;
+  if (timeout >= 0) {
+    ts.tv_sec = timeout / 1000;
+    ts.tv_nsec = (timeout % 1000) * 1000000L;
+    tsp = &ts;
+  }
+  int n = kevent(pollfd, NULL, 0, evs, kMaxEvents, tsp);
+  for (int i = 0; i < n; i++) {
+    events[i].handle = evs[i].udata;
+    events[i].readable = evs[i].filter == EVFILT_READ;
+    events[i].writable = evs[i].filter == EVFILT_WRITE;
+  }
+  return n;
+#endif
+}
+
+/* Host name lookups */
+
+static void lookup_release(lookup_t *lookup) {
+  if (atomic_fetch_sub_explicit(&lookup->refs, 1, memory_order_acq_rel) != 1) {
+    return;
+  }
+  if (lookup->result != NULL) freeaddrinfo(lookup->result);
+  free(lookup->host);
+  free(lookup);
+}
+
+static void *lookup_thread(void *arg) {
+  lookup_t *lookup = arg;
+  struct addrinfo hints = {0};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  lookup->status = getaddrinfo(lookup->host, lookup->service, &hints,
+                               &lookup->result);
+  atomic_store_explicit(&lookup->done, true, memory_order_release);
+  char byte = 0;
+  send(lookup->fds[1], &byte, 1, kSendFlags);
+  close(lookup->fds[1]);
+  lookup_release(lookup);
+  return NULL;
+}
+
+static lookup_t *lookup_start(const char *host, uint16_t port) {
+  lookup_t *lookup = calloc(1, sizeof(lookup_t));
+  if (lookup == NULL) return NULL;
+  lookup->host = strdup(host);
+  snprintf(lookup->service, sizeof(lookup->service), "%u", port);
+  atomic_init(&lookup->refs, 2);
+  atomic_init(&lookup->done, false);
+  if (lookup->host == NULL ||
+      socketpair(AF_UNIX, SOCK_STREAM, 0, lookup->fds) != 0) {
+    free(lookup->host);
+    free(lookup);
+    return NULL;
+  }
+  set_nonblocking(lookup->fds[0]);
+  set_nonblocking(lookup->fds[1]);
+
+  pthread_attr_t attr;
+  pthread_t thread;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  int err = pthread_create(&thread, &attr, lookup_thread, lookup);
+  pthread_attr_destroy(&attr);
+  if (err != 0) {
+    close(lookup->fds[0]);
+    close(lookup->fds[1]);
+    free(lookup->host);
+    free(lookup);
+    return NULL;
+  }
+  return lookup;
+}
+
+/* Lets go of a lookup from the client's side, whether or not it's done */
+static void lookup_cancel(http_client_t *client, lookup_t *lookup) {
+  poller_unwatch(client->pollfd, lookup->fds[0]);
+  close(lookup->fds[0]);
+  lookup_release(lookup);
+}
+
+/* Timers */
+
+static bool timer_open(http_client_t *client) {
+  client->timerHandle.kind = HANDLE_TIMER;
+  client->timerHandle.owner = client;
+#ifdef __linux__
+  client->timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  return client->timer >= 0 &&
+         poller_watch(client->pollfd, client->timer, &client->timerHandle,
+                      true, false, false);
+#else
+  /* The kqueue has timers of its own */
+  return true;
+#endif
+}
+
+/* Sets the timer for the first timed task, or stops it if there's none */
+static void timer_arm(http_client_t *client) {
+  http_client_task_t *first = client->timers;
+#ifdef __linux__
+  struct itimerspec spec;
+  memset(&spec, 0, sizeof(spec));
+  if (first != NULL) {
+    spec.it_value.tv_sec = (time_t)first->due;
+    spec.it_value.tv_nsec = (long)((first->due - (double)spec.it_value.tv_sec) * 1e9);
+    /* All zeros would stop it */
+    if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0) {
+      spec.it_value.tv_nsec = 1;
+    }
+  }
+  timerfd_settime(client->timer, TFD_TIMER_ABSTIME, &spec, NULL);
+#else
+  struct kevent change;
+  if (first != NULL) {
+    double delay = first->due - now();
+    int64_t ms = delay > 0 ? (int64_t)(delay * 1000) + 1 : 0;
+    EV_SET(&change, kTimerIdent, EVFILT_TIMER, EV_ADD | EV_ONESHOT, 0, ms,
+           &client->timerHandle);
+  } else {
+    EV_SET(&change, kTimerIdent, EVFILT_TIMER, EV_DELETE, 0, 0, NULL);
+  }
+  kevent(client->pollfd, &change, 1, NULL, 0, NULL);
+#endif
+}
+
+/* Moves the timed tasks which are due onto the queue of tasks to run */
+static void timer_fire(http_client_t *client, double time) {
+  if (client->timers == NULL) return;
+  while (client->timers != NULL && client->timers->due <= time) {
+    http_client_task_t *task = client->timers;
+    client->timers = task->next;
+    task->scheduled = false;
+    task->timed = false;
+    ASHTTPClientSchedule(client, task);
+  }
+  timer_arm(client);
+}
+
+/* Requests */
+
+static void client_wake(http_client_t *client) {
+  if (client->processing || client->wakeSignalled) return;
+  char byte = 0;
+  if (send(client->wake[1], &byte, 1, kSendFlags) == 1) {
+    client->wakeSignalled = true;
+  }
+}
+
+/* Queues up the request to be looked at for an event to send */
+static void request_poke(http_request_t *req) {
+  if (req->pending) return;
+  req->pending = true;
+  req->nextPending = NULL;
+  http_client_t *client = req->client;
+  if (client->pendingTail != NULL) {
+    client->pendingTail->nextPending = req;
+  } else {
+    client->pending = req;
+  }
+  client->pendingTail = req;
+  client_wake(client);
+}
+
+static void request_unpend(http_request_t *req) {
+  if (!req->pending) return;
+  http_client_t *client = req->client;
+  http_request_t *prev = NULL;
+  for (http_request_t *r = client->pending; r != NULL; prev = r, r = r->nextPending) {
+    if (r != req) continue;
+    if (prev != NULL) {
+      prev->nextPending = r->nextPending;
+    } else {
+      client->pending = r->nextPending;
+    }
+    if (client->pendingTail == r) client->pendingTail = prev;
+    break;
+  }
+  req->pending = false;
+}
+
+static void request_clear_response(http_request_t *req) {
+  for (size_t i = 0; i < req->headerCount; i++) {
+    free(req->headerNames[i]);
+    free(req->headerValues[i]);
+  }
+  free(req->headerNames);
+  free(req->headerValues);
+  req->headerNames = NULL;
+  req->headerValues = NULL;
+  req->headerCount = 0;
+  req->status = 0;
+  req->bufferStart = 0;
+  req->bufferCount = 0;
+}
+
+static bool request_add_header(http_request_t *req, const char *name,
+                               size_t nameLength, const char *value,
+                               size_t valueLength) {
+  char **names = realloc(req->headerNames, (req->headerCount + 1) * sizeof(char*));
+  if (names == NULL) return false;
+  req->headerNames = names;
+  char **values = realloc(req->headerValues, (req->headerCount + 1) * sizeof(char*));
+  if (values == NULL) return false;
+  req->headerValues = values;
+  names[req->headerCount] = strndup(name, nameLength);
+  values[req->headerCount] = strndup(value, valueLength);
+  if (names[req->headerCount] == NULL || values[req->headerCount] == NULL) {
+    free(names[req->headerCount]);
+    free(values[req->headerCount]);
+    return false;
+  }
+  req->headerCount++;
+  return true;
+}
+
+static size_t request_space(const http_request_t *req) {
+  return kRequestBufferSize - req->bufferCount;
+}
+
+static void request_append(http_request_t *req, const uint8_t *data,
+                           size_t length) {
+  size_t tail = (req->bufferStart + req->bufferCount) % kRequestBufferSize;
+  size_t first = kRequestBufferSize - tail;
+  if (first > length) first = length;
+  memcpy(req->buffer + tail, data, first);
+  memcpy(req->buffer, data + first, length - first);
+  req->bufferCount += length;
+}
+
+/* URLs */
+
+typedef struct url_parts {
+  char    *host;
+  uint16_t port;
+  char    *path;
+} url_parts_t;
+
+static void url_free(url_parts_t *url) {
+  free(url->host);
+  free(url->path);
+}
+
+/* Splits an http URL into its host, port and path (with the query) */
+static bool url_parse(const char *url, url_parts_t *parts) {
+  memset(parts, 0, sizeof(*parts));
+  if (strncasecmp(url, "http://", 7) != 0) return false;
+  const char *authority = url + 7;
+  size_t authorityLength = strcspn(authority, "/?#");
+  const char *rest = authority + authorityLength;
+
+  /* Drop any user info */
+  const char *at = memchr(authority, '@', authorityLength);
+  if (at != NULL) {
+    authorityLength -= (size_t)(at + 1 - authority);
+    authority = at + 1;
+  }
+
+  const char *host = authority;
+  size_t hostLength = authorityLength;
+  const char *port = NULL;
+  if (authorityLength > 0 && authority[0] == '[') {
+    const char *close = memchr(authority, ']', authorityLength);
+    if (close == NULL) return false;
+    host = authority + 1;
+    hostLength = (size_t)(close - host);
+    if (close + 1 < authority + authorityLength && close[1] == ':') port = close + 2;
+  } else {
+    const char *colon = memchr(authority, ':', authorityLength);
+    if (colon != NULL) {
+      hostLength = (size_t)(colon - authority);
+      port = colon + 1;
+    }
+  }
+  if (hostLength == 0) return false;
+
+  parts->port = 80;
+  if (port != NULL && port < authority + authorityLength) {
+    char *end;
+    unsigned long value = strtoul(port, &end, 10);
+    if (end != authority + authorityLength || value == 0 || value > 65535) {
+      return false;
+    }
+    parts->port = (uint16_t)value;
+  }
+
+  size_t pathLength = strcspn(rest, "#");
+  parts->host = strndup(host, hostLength);
+  if (pathLength == 0 || rest[0] != '/') {
+    /* Only a query, or nothing at all */
+    size_t length = pathLength + 2;
+    parts->path = malloc(length);
+    if (parts->path != NULL) snprintf(parts->path, length, "/%.*s", (int)pathLength, rest);
+  } else {
+    parts->path = strndup(rest, pathLength);
+  }
+  if (parts->host == NULL || parts->path == NULL) {
+    url_free(parts);
+    return false;
+  }
+  return true;
+}
+
+/* Works out where a redirect's location points to, relative to the request.
+   Returns NULL if it isn't somewhere the client can go */
+static char *resolve_location(const http_request_t *req, const char *location) {
+  if (strncasecmp(location, "http://", 7) == 0) {
+    return strdup(location);
+  } else if (strstr(location, "://") != NULL) {
+    return NULL;
+  }
+  char host[300];
+  format_host(host, sizeof(host), req->host);
+  if (location[0] == '/' && location[1] == '/') {
+    return format("http:%s", location);
+  } else if (location[0] == '/') {
+    return format("http://%s:%u%s", host, req->port, location);
+  }
+  /* Relative to the directory of the request's path */
+  size_t dir = strcspn(req->path, "?");
+  while (dir > 0 && req->path[dir - 1] != '/') dir--;
+  return format("http://%s:%u%.*s%s", host, req->port, (int)dir, req->path,
+                location);
+}
+
+/* Connections */
+
+static void conn_update_watch(conn_t *conn) {
+  if (conn->fd < 0) return;
+  bool read = conn->state != CONN_CONNECTING && conn->inLength < kConnBufferSize;
+  bool write = conn->state == CONN_CONNECTING || conn->outSent < conn->outLength;
+  if (read == conn->watchRead && write == conn->watchWrite) return;
+  poller_watch(conn->client->pollfd, conn->fd, &conn->socketHandle, read, write, true);
+  conn->watchRead = read;
+  conn->watchWrite = write;
+}
+
+static void conn_close_socket(conn_t *conn) {
+  if (conn->fd < 0) return;
+  poller_unwatch(conn->client->pollfd, conn->fd);
+  close(conn->fd);
+  conn->fd = -1;
+  conn->watchRead = false;
+  conn->watchWrite = false;
+}
+
+/* Closes the connection, failing its request if it has one. It's freed once
+   the client has finished processing */
+static void conn_close(conn_t *conn) {
+  if (conn->state == CONN_CLOSED) return;
+  conn->state = CONN_CLOSED;
+  conn_close_socket(conn);
+  if (conn->lookup != NULL) {
+    lookup_cancel(conn->client, conn->lookup);
+    conn->lookup = NULL;
+  }
+  if (conn->addresses != NULL) {
+    freeaddrinfo(conn->addresses);
+    conn->addresses = NULL;
+  }
+  http_client_t *client = conn->client;
+  conn_t **link = &client->conns;
+  while (*link != conn) link = &(*link)->next;
+  *link = conn->next;
+  conn->next = client->dead;
+  client->dead = conn;
+
+  http_request_t *req = conn->request;
+  conn->request = NULL;
+  if (req == NULL) return;
+  req->conn = NULL;
+  if (conn->draining) {
+    /* Its response never started, so it can go on another connection */
+    if (!request_start(req)) request_fail(req, "Out of memory");
+  } else if (!req->complete && req->error == NULL) {
+    request_fail(req, "The connection was lost");
+  }
+}
+
+static void conn_free(conn_t *conn) {
+  free(conn->key);
+  free(conn->host);
+  free(conn->targetHost);
+  free(conn->out);
+  free(conn);
+}
+
+static bool conn_send(conn_t *conn, const void *data, size_t length) {
+  if (conn->outSent == conn->outLength) {
+    conn->outSent = conn->outLength = 0;
+  }
+  uint8_t *out = realloc(conn->out, conn->outLength + length);
+  if (out == NULL) return false;
+  conn->out = out;
+  memcpy(conn->out + conn->outLength, data, length);
+  conn->outLength += length;
+  return true;
+}
+
+static void conn_flush(conn_t *conn) {
+  while (conn->fd >= 0 && conn->outSent < conn->outLength) {
+    ssize_t sent = send(conn->fd, conn->out + conn->outSent,
+                        conn->outLength - conn->outSent, kSendFlags);
+    if (sent < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) break;
+      conn_close(conn);
+      return;
+    }
+    conn->outSent += (size_t)sent;
+  }
+  conn_update_watch(conn);
+}
+
+/* Gets ready to read a new response */
+static void conn_reset_response(conn_t *conn) {
+  conn->response = RESPONSE_HEAD;
+  conn->framing = BODY_UNTIL_CLOSE;
+  conn->remaining = 0;
+  conn->drainLeft = kDrainLimit;
+  conn->keepAlive = false;
+  conn->sawResponse = false;
+  conn->draining = false;
+}
+
+/* Sends the connection's request, whose response is read once any response
+   before it has been */
+static void conn_send_request(conn_t *conn) {
+  http_request_t *req = conn->request;
+  conn->client->stats.requests++;
+  conn->reused = conn->used;
+  conn->used = true;
+  if (conn->reused) conn->client->stats.connectionsReused++;
+  if (!conn_send(conn, req->text, req->textLength)) {
+    conn_close(conn);
+    return;
+  }
+  conn_flush(conn);
+}
+
+/* Puts the connection in the pool, closing the oldest idle one if there are
+   too many */
+static void conn_make_idle(conn_t *conn) {
+  conn->state = CONN_IDLE;
+  conn->idleSince = now();
+  conn->inLength = 0;
+  conn_update_watch(conn);
+
+  size_t idle = 0;
+  conn_t *oldest = NULL;
+  for (conn_t *c = conn->client->conns; c != NULL; c = c->next) {
+    if (c->state != CONN_IDLE) continue;
+    idle++;
+    if (oldest == NULL || c->idleSince < oldest->idleSince) oldest = c;
+  }
+  if (idle > kMaxIdleConnections) conn_close(oldest);
+}
+
+/* The connection is set up, so the request can go, or it can wait in the
+   pool if the request has gone away */
+static void conn_ready(conn_t *conn) {
+  if (conn->addresses != NULL) {
+    freeaddrinfo(conn->addresses);
+    conn->addresses = NULL;
+  }
+  if (conn->request != NULL) {
+    conn->state = CONN_ACTIVE;
+    conn_reset_response(conn);
+    conn_send_request(conn);
+  } else {
+    conn_make_idle(conn);
+  }
+}
+
+static void conn_try_connect(conn_t *conn) {
+  while (conn->nextAddress != NULL) {
+    struct addrinfo *ai = conn->nextAddress;
+    conn->nextAddress = ai->ai_next;
+    int fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd < 0) continue;
+    set_nonblocking(fd);
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) != 0 && errno != EINPROGRESS) {
+      close(fd);
+      continue;
+    }
+    conn->fd = fd;
+    conn->state = CONN_CONNECTING;
+    if (!poller_watch(conn->client->pollfd, fd, &conn->socketHandle, false, true, false)) {
+      close(fd);
+      conn->fd = -1;
+      continue;
+    }
+    conn->watchWrite = true;
+    return;
+  }
+  conn_close(conn);
+}
+
+static void conn_resolved(conn_t *conn, struct addrinfo *addresses) {
+  conn->addresses = addresses;
+  conn->nextAddress = addresses;
+  conn_try_connect(conn);
+}
+
+static void conn_lookup_done(conn_t *conn) {
+  lookup_t *lookup = conn->lookup;
+  if (!atomic_load_explicit(&lookup->done, memory_order_acquire)) return;
+  struct addrinfo *result = lookup->status == 0 ? lookup->result : NULL;
+  lookup->result = NULL;
+  conn->lookup = NULL;
+  lookup_cancel(conn->client, lookup);
+  if (result == NULL) {
+    conn_close(conn);
+    return;
+  }
+  conn_resolved(conn, result);
+}
+
+static void conn_start(conn_t *conn) {
+  /* Addresses are used as they are, anything else is looked up */
+  struct addrinfo hints = {0};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+  char service[8];
+  snprintf(service, sizeof(service), "%u", conn->port);
+  struct addrinfo *result;
+  if (getaddrinfo(conn->host, service, &hints, &result) == 0) {
+    conn_resolved(conn, result);
+    return;
+  }
+
+  conn->state = CONN_RESOLVING;
+  conn->lookup = lookup_start(conn->host, conn->port);
+  if (conn->lookup == NULL ||
+      !poller_watch(conn->client->pollfd, conn->lookup->fds[0],
+                    &conn->lookupHandle, true, false, false)) {
+    conn_close(conn);
+  }
+}
+
+/* Sends the SOCKS5 request to connect to the origin */
+static void conn_socks_connect(conn_t *conn) {
+  size_t hostLength = strlen(conn->targetHost);
+  uint8_t message[4 + 1 + 255 + 2] = {5, 1, 0, 3, (uint8_t)hostLength};
+  memcpy(message + 5, conn->targetHost, hostLength);
+  message[5 + hostLength] = (uint8_t)(conn->targetPort >> 8);
+  message[6 + hostLength] = (uint8_t)conn->targetPort;
+  conn->state = CONN_SOCKS_CONNECT;
+  if (!conn_send(conn, message, 7 + hostLength)) {
+    conn_close(conn);
+    return;
+  }
+  conn_flush(conn);
+}
+
+static void conn_connected(conn_t *conn) {
+  int err = 0;
+  socklen_t length = sizeof(err);
+  if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &length) != 0 || err != 0) {
+    conn_close_socket(conn);
+    conn_try_connect(conn);
+    return;
+  }
+  conn->client->stats.connectionsOpened++;
+  if (conn->proxyType == HTTP_PROXY_SOCKS) {
+    /* Version 5, one method: no authentication */
+    static const uint8_t greeting[] = {5, 1, 0};
+    conn->state = CONN_SOCKS_GREETING;
+    if (!conn_send(conn, greeting, sizeof(greeting))) {
+      conn_close(conn);
+      return;
+    }
+    conn_flush(conn);
+  } else {
+    conn_ready(conn);
+  }
+}
+
+/* Drops the first count bytes of the input */
+static void conn_consume(conn_t *conn, size_t count) {
+  memmove(conn->in, conn->in + count, conn->inLength - count);
+  conn->inLength -= count;
+}
+
+/* Reads the SOCKS5 proxy's replies, returning false if more is needed */
+static bool conn_parse_socks(conn_t *conn) {
+  if (conn->state == CONN_SOCKS_GREETING) {
+    if (conn->inLength < 2) return false;
+    if (conn->in[0] != 5 || conn->in[1] != 0) {
+      conn_close(conn);
+      return false;
+    }
+    conn_consume(conn, 2);
+    conn_socks_connect(conn);
+    return conn->state != CONN_CLOSED;
+  }
+
+  if (conn->inLength < 5) return false;
+  if (conn->in[0] != 5 || conn->in[1] != 0) {
+    conn_close(conn);
+    return false;
+  }
+  size_t length;
+  switch (conn->in[3]) {
+    case 1: length = 4 + 4 + 2; break;
+    case 4: length = 4 + 16 + 2; break;
+    case 3: length = 4 + 1 + conn->in[4] + 2; break;
+    default:
+      conn_close(conn);
+      return false;
+  }
+  if (conn->inLength < length) return false;
+  conn_consume(conn, length);
+  conn_ready(conn);
+  return conn->state != CONN_CLOSED;
+}
+
+/* Finds the end of a line starting at pos, returning its length or -1 */
+static ssize_t find_line(const conn_t *conn, size_t pos) {
+  const uint8_t *end = memchr(conn->in + pos, '\n', conn->inLength - pos);
+  if (end == NULL) return -1;
+  return end - (conn->in + pos);
+}
+
+static bool header_is(const char *line, size_t nameLength, const char *name) {
+  return strlen(name) == nameLength && strncasecmp(line, name, nameLength) == 0;
+}
+
+/* Whether a comma separated header value has the given token in it */
+static bool has_token(const char *value, size_t length, const char *token) {
+  size_t tokenLength = strlen(token);
+  for (size_t i = 0; i + tokenLength <= length; i++) {
+    if (strncasecmp(value + i, token, tokenLength) == 0 &&
+        (i == 0 || value[i - 1] == ' ' || value[i - 1] == ',') &&
+        (i + tokenLength == length || value[i + tokenLength] == ' ' ||
+         value[i + tokenLength] == ',')) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Takes the request off the connection, leaving the connection to read off
+   the rest of the response if that's cheap enough */
+static void conn_abandon(conn_t *conn) {
+  http_request_t *req = conn->request;
+  conn->request = NULL;
+  if (req != NULL) req->conn = NULL;
+  if (conn->state != CONN_ACTIVE) return;
+  if (conn->draining || conn->outSent < conn->outLength ||
+      (conn->response == RESPONSE_BODY &&
+       (conn->framing == BODY_UNTIL_CLOSE ||
+        (conn->framing == BODY_LENGTH && conn->remaining > conn->drainLeft)))) {
+    /* Whatever's left is too much, or unknown */
+    conn_close(conn);
+  } else {
+    conn->draining = true;
+  }
+}
+
+/* Parses the status line and headers, which run up to end. Returns false if
+   the connection was closed */
+static bool conn_parse_head(conn_t *conn, size_t end) {
+  http_request_t *req = conn_reader(conn);
+  const char *text = (const char *)conn->in;
+  int major, minor, status;
+  if (sscanf(text, "HTTP/%d.%d %d", &major, &minor, &status) != 3) {
+    if (req != NULL) request_fail(req, "The server sent a malformed response");
+    conn_close(conn);
+    return false;
+  }
+  if (status >= 100 && status < 200) {
+    /* Informational, the real response follows */
+    conn_consume(conn, end);
+    return true;
+  }
+
+  bool http11 = major > 1 || (major == 1 && minor >= 1);
+  bool chunked = false, close = !http11, haveLength = false;
+  uint64_t length = 0;
+  const char *location = NULL;
+  size_t locationLength = 0;
+  if (req != NULL) {
+    request_clear_response(req);
+    req->status = status;
+  }
+
+  size_t pos = (size_t)find_line(conn, 0) + 1;
+  while (pos < end) {
+    ssize_t lineLength = find_line(conn, pos);
+    const char *line = text + pos;
+    pos += (size_t)lineLength + 1;
+    while (lineLength > 0 && (line[lineLength - 1] == '\r' || line[lineLength - 1] == '\n')) {
+      lineLength--;
+    }
+    const char *colon = memchr(line, ':', (size_t)lineLength);
+    if (colon == NULL) continue;
+    size_t nameLength = (size_t)(colon - line);
+    const char *value = colon + 1;
+    size_t valueLength = (size_t)(line + lineLength - value);
+    while (valueLength > 0 && (*value == ' ' || *value == '\t')) {
+      value++;
+      valueLength--;
+    }
+    while (valueLength > 0 && (value[valueLength - 1] == ' ' ||
+                               value[valueLength - 1] == '\t')) {
+      valueLength--;
+    }
+
+    if (header_is(line, nameLength, "Content-Length")) {
+      length = strtoull(value, NULL, 10);
+      haveLength = true;
+    } else if (header_is(line, nameLength, "Transfer-Encoding")) {
+      chunked = has_token(value, valueLength, "chunked");
+    } else if (header_is(line, nameLength, "Connection") ||
+               header_is(line, nameLength, "Proxy-Connection")) {
+      if (has_token(value, valueLength, "close")) close = true;
+      if (has_token(value, valueLength, "keep-alive")) close = false;
+    } else if (header_is(line, nameLength, "Location")) {
+      location = value;
+      locationLength = valueLength;
+    }
+    if (req != NULL &&
+        !request_add_header(req, line, nameLength, value, valueLength)) {
+      request_fail(req, "Out of memory");
+      conn_close(conn);
+      return false;
+    }
+  }
+
+  conn->response = RESPONSE_BODY;
+  conn->sawResponse = true;
+  conn->keepAlive = !close;
+  if (status == 204 || status == 304) {
+    conn->framing = BODY_LENGTH;
+    conn->remaining = 0;
+  } else if (chunked) {
+    conn->framing = BODY_CHUNKED;
+    conn->chunk = CHUNK_SIZE;
+  } else if (haveLength) {
+    conn->framing = BODY_LENGTH;
+    conn->remaining = length;
+  } else {
+    conn->framing = BODY_UNTIL_CLOSE;
+    conn->keepAlive = false;
+  }
+  conn_consume(conn, end);
+  if (conn->draining && (conn->framing == BODY_UNTIL_CLOSE ||
+                         (conn->framing == BODY_LENGTH &&
+                          conn->remaining > conn->drainLeft))) {
+    /* The abandoned request's body is too much to read off, and whatever
+       is waiting behind it is better off on another connection than
+       waiting for a body which may be slow to come */
+    conn_close(conn);
+    return false;
+  }
+
+  bool redirect = status == 301 || status == 302 || status == 303 ||
+                  status == 307 || status == 308;
+  if (req != NULL && redirect && location != NULL) {
+    char *value = strndup(location, locationLength);
+    char *target = value != NULL ? resolve_location(req, value) : NULL;
+    if (target == NULL || req->redirects >= kMaxRedirects) {
+      req->redirect = value;
+      free(target);
+      conn_abandon(conn);
+      request_fail(req, "The server redirected to a location which can't be followed");
+      return conn->state != CONN_CLOSED;
+    }
+    free(value);
+    url_parts_t parts;
+    bool parsed = url_parse(target, &parts);
+    free(target);
+    if (!parsed) {
+      conn_abandon(conn);
+      request_fail(req, "The server redirected to a malformed location");
+      return conn->state != CONN_CLOSED;
+    }
+    free(req->host);
+    free(req->path);
+    req->host = parts.host;
+    req->port = parts.port;
+    req->path = parts.path;
+    req->redirects++;
+    req->retried = false;
+    request_clear_response(req);
+    conn_abandon(conn);
+    conn->redirected = req;
+    return conn->state != CONN_CLOSED;
+  }
+  return true;
+}
+
+/* Takes a run of body bytes, returning how many were taken */
+static size_t conn_take_body(conn_t *conn, const uint8_t *data, size_t length) {
+  http_request_t *req = conn_reader(conn);
+  if (req == NULL) {
+    /* Being read off to keep the connection */
+    if (length > conn->drainLeft) {
+      conn_close(conn);
+      return 0;
+    }
+    conn->drainLeft -= length;
+    return length;
+  }
+  size_t space = request_space(req);
+  if (length > space) length = space;
+  if (length == 0) return 0;
+  bool wasEmpty = req->bufferCount == 0;
+  request_append(req, data, length);
+  if (wasEmpty) request_poke(req);
+  return length;
+}
+
+/* The whole response has been read */
+static void conn_response_done(conn_t *conn) {
+  if (conn->draining && conn->request != NULL) {
+    /* On to the response for the request waiting behind it */
+    if (conn->keepAlive) {
+      conn_reset_response(conn);
+    } else {
+      conn_close(conn);
+    }
+    return;
+  }
+  http_request_t *req = conn->request;
+  conn->request = NULL;
+  if (req != NULL && !conn->draining) {
+    req->conn = NULL;
+    req->complete = true;
+    request_poke(req);
+  }
+  conn->draining = false;
+  if (conn->keepAlive && conn->inLength == 0) {
+    conn_make_idle(conn);
+  } else {
+    conn_close(conn);
+  }
+}
+
+/* Reads as much of the body out of the input as can be taken, returning
+   false once nothing more can be done for now */
+static bool conn_parse_body(conn_t *conn) {
+  size_t pos = 0;
+  bool done = false;
+  while (conn->state == CONN_ACTIVE && !done) {
+    size_t available = conn->inLength - pos;
+    if (conn->framing == BODY_LENGTH || conn->framing == BODY_UNTIL_CLOSE ||
+        conn->chunk == CHUNK_DATA) {
+      if (conn->framing != BODY_UNTIL_CLOSE && conn->remaining == 0) {
+        if (conn->framing == BODY_LENGTH) {
+          done = true;
+        } else {
+          conn->chunk = CHUNK_DATA_END;
+        }
+        continue;
+      }
+      if (conn->framing != BODY_UNTIL_CLOSE && available > conn->remaining) {
+        available = (size_t)conn->remaining;
+      }
+      if (available == 0) break;
+      size_t taken = conn_take_body(conn, conn->in + pos, available);
+      if (taken == 0) break;
+      pos += taken;
+      if (conn->framing != BODY_UNTIL_CLOSE) conn->remaining -= taken;
+      continue;
+    }
+
+    /* The framing of a chunked body */
+    ssize_t lineLength = find_line(conn, pos);
+    if (lineLength < 0) {
+      if (conn->inLength - pos >= kConnBufferSize / 2) {
+        if (conn_reader(conn) != NULL) request_fail(conn->request, "The server sent a malformed response");
+        conn_close(conn);
+      }
+      break;
+    }
+    const char *line = (const char *)conn->in + pos;
+    pos += (size_t)lineLength + 1;
+    if (conn->chunk == CHUNK_SIZE) {
+      char *end;
+      conn->remaining = strtoull(line, &end, 16);
+      if (end == line) {
+        if (conn_reader(conn) != NULL) request_fail(conn->request, "The server sent a malformed response");
+        conn_close(conn);
+        break;
+      }
+      conn->chunk = conn->remaining == 0 ? CHUNK_TRAILER : CHUNK_DATA;
+    } else if (conn->chunk == CHUNK_DATA_END) {
+      conn->chunk = CHUNK_SIZE;
+    } else if (lineLength == 0 || (lineLength == 1 && line[0] == '\r')) {
+      /* The blank line after the trailers */
+      done = true;
+    }
+  }
+  if (conn->state != CONN_ACTIVE) return false;
+  conn_consume(conn, pos);
+  if (done) {
+    conn_response_done(conn);
+    return conn->state == CONN_ACTIVE && conn->inLength > 0;
+  }
+  return false;
+}
+
+/* Works through whatever input there is */
+static void conn_parse(conn_t *conn) {
+  while (conn->inLength > 0) {
+    switch (conn->state) {
+      case CONN_SOCKS_GREETING:
+      case CONN_SOCKS_CONNECT:
+        if (!conn_parse_socks(conn)) goto out;
+        break;
+
+      case CONN_IDLE:
+        /* Nothing should arrive on an idle connection */
+        conn_close(conn);
+        goto out;
+
+      case CONN_ACTIVE:
+        if (conn->response == RESPONSE_BODY) {
+          if (!conn_parse_body(conn)) goto out;
+          break;
+        }
+        conn->sawResponse = true;
+        if (memcmp(conn->in, "HTTP/", conn->inLength < 5 ? conn->inLength : 5) != 0) {
+          /* Not HTTP at all, so it's all body */
+          conn->response = RESPONSE_BODY;
+          conn->framing = BODY_UNTIL_CLOSE;
+          conn->keepAlive = false;
+          if (conn_reader(conn) != NULL) {
+            request_clear_response(conn->request);
+            conn->request->status = 200;
+          }
+          break;
+        }
+        {
+          size_t end = 0;
+          for (size_t i = 0; i + 1 < conn->inLength; i++) {
+            if (conn->in[i] == '\n' &&
+                (conn->in[i + 1] == '\n' ||
+                 (conn->in[i + 1] == '\r' && i + 2 < conn->inLength &&
+                  conn->in[i + 2] == '\n'))) {
+              end = i + (conn->in[i + 1] == '\n' ? 2 : 3);
+              break;
+            }
+          }
+          if (end == 0) {
+            if (conn->inLength == kConnBufferSize) {
+              if (conn_reader(conn) != NULL) request_fail(conn->request, "The server's response headers are too long");
+              conn_close(conn);
+            }
+            goto out;
+          }
+          if (!conn_parse_head(conn, end)) goto out;
+          if (conn->redirected != NULL) {
+            /* Read off the rest of the redirect before it's followed */
+            if (conn->response == RESPONSE_BODY && conn->inLength > 0 &&
+                conn->state == CONN_ACTIVE) {
+              conn_parse_body(conn);
+            } else if (conn->state == CONN_ACTIVE && conn->response == RESPONSE_BODY &&
+                       conn->framing == BODY_LENGTH && conn->remaining == 0) {
+              conn_response_done(conn);
+            }
+            goto out;
+          }
+          if (conn->framing == BODY_LENGTH && conn->remaining == 0 &&
+              conn->inLength == 0) {
+            conn_response_done(conn);
+            goto out;
+          }
+        }
+        break;
+
+      default:
+        goto out;
+    }
+  }
+out:
+  if (conn->state != CONN_CLOSED) conn_update_watch(conn);
+  http_request_t *redirected = conn->redirected;
+  conn->redirected = NULL;
+  if (redirected != NULL && redirected->error == NULL &&
+      !request_start(redirected)) {
+    request_fail(redirected, "Out of memory");
+  }
+}
+
+/* The other end has closed the connection */
+static void conn_eof(conn_t *conn) {
+  http_request_t *req = conn_reader(conn);
+  if (conn->state == CONN_ACTIVE && conn->response == RESPONSE_BODY &&
+      conn->framing == BODY_UNTIL_CLOSE) {
+    conn_close_socket(conn);
+    conn_response_done(conn);
+    return;
+  }
+  if (req != NULL && conn->state == CONN_ACTIVE && !conn->sawResponse &&
+      conn->reused && !req->retried) {
+    /* The server gave up on an idle connection just as it was reused, so try
+       again on a fresh one */
+    conn->request = NULL;
+    req->conn = NULL;
+    req->retried = true;
+    conn_close(conn);
+    if (!request_start(req)) request_fail(req, "Out of memory");
+    return;
+  }
+  conn_close(conn);
+}
+
+static void conn_readable(conn_t *conn) {
+  if (conn->state == CONN_CONNECTING) return;
+  while (conn->state != CONN_CLOSED && conn->inLength < kConnBufferSize) {
+    ssize_t got = recv(conn->fd, conn->in + conn->inLength,
+                       kConnBufferSize - conn->inLength, 0);
+    if (got < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+      conn_eof(conn);
+      return;
+    }
+    if (got == 0) {
+      conn_parse(conn);
+      if (conn->state != CONN_CLOSED) conn_eof(conn);
+      return;
+    }
+    conn->inLength += (size_t)got;
+    conn_parse(conn);
+  }
+  if (conn->state != CONN_CLOSED) conn_update_watch(conn);
+}
+
+static void conn_writable(conn_t *conn) {
+  if (conn->state == CONN_CONNECTING) {
+    conn_connected(conn);
+  } else {
+    conn_flush(conn);
+  }
+}
+
+static char *conn_key(http_proxy_type_t proxyType, const char *proxyHost,
+                      uint16_t proxyPort, const char *host, uint16_t port) {
+  /* Anything can share a connection to an HTTP proxy */
+  if (proxyType == HTTP_PROXY_HTTP) {
+    host = "";
+    port = 0;
+  }
+  return format("%d %s:%u %s:%u", proxyType, proxyHost ? proxyHost : "",
+                proxyPort, host, port);
+}
+
+static conn_t *conn_create(http_client_t *client, http_request_t *req,
+                           char *key) {
+  conn_t *conn = calloc(1, sizeof(conn_t));
+  if (conn == NULL) return NULL;
+  conn->client = client;
+  conn->key = key;
+  conn->fd = -1;
+  conn->socketHandle.kind = HANDLE_SOCKET;
+  conn->socketHandle.owner = conn;
+  conn->lookupHandle.kind = HANDLE_LOOKUP;
+  conn->lookupHandle.owner = conn;
+  conn->proxyType = req->proxyType;
+  if (req->proxyType == HTTP_PROXY_NONE) {
+    conn->host = strdup(req->host);
+    conn->port = req->port;
+  } else {
+    conn->host = strdup(req->proxyHost);
+    conn->port = req->proxyPort;
+    conn->targetHost = strdup(req->host);
+    conn->targetPort = req->port;
+  }
+  if (conn->host == NULL ||
+      (req->proxyType != HTTP_PROXY_NONE && conn->targetHost == NULL)) {
+    conn_free(conn);
+    return NULL;
+  }
+  conn->next = client->conns;
+  client->conns = conn;
+  return conn;
+}
+
+/* Builds the request's text for where it's going now */
+static bool request_build(http_request_t *req) {
+  char host[300];
+  format_host(host, sizeof(host), req->host);
+  char port[8] = "";
+  if (req->port != 80) snprintf(port, sizeof(port), ":%u", req->port);
+
+  char *text;
+  if (req->proxyType == HTTP_PROXY_HTTP) {
+    text = format("GET http://%s%s%s HTTP/1.1\r\nHost: %s%s\r\n%s\r\n",
+                  host, port, req->path, host, port, req->extraHeaders);
+  } else {
+    text = format("GET %s HTTP/1.1\r\nHost: %s%s\r\n%s\r\n",
+                  req->path, host, port, req->extraHeaders);
+  }
+  if (text == NULL) return false;
+  free(req->text);
+  req->text = text;
+  req->textLength = strlen(text);
+  return true;
+}
+
+/* Sends the request on an idle connection to the same place, or on one
+   still being set up, or failing those on a new connection */
+static bool request_start(http_request_t *req) {
+  http_client_t *client = req->client;
+  if (req->proxyType == HTTP_PROXY_SOCKS && strlen(req->host) > 255) {
+    request_fail(req, "The host name is too long");
+    return true;
+  }
+  if (!request_build(req)) return false;
+  char *key = conn_key(req->proxyType, req->proxyHost, req->proxyPort,
+                       req->host, req->port);
+  if (key == NULL) return false;
+
+  /* Idle connections are best, then ones being set up, then ones reading off
+     the rest of an abandoned response */
+  double time = now();
+  conn_t *found = NULL;
+  int rank = 0;
+  for (conn_t *c = client->conns; c != NULL; c = c->next) {
+    if (strcmp(c->key, key) != 0 || c->request != NULL) continue;
+    if (c->state == CONN_IDLE && time - c->idleSince < kIdleTimeout) {
+      found = c;
+      break;
+    } else if (c->state < CONN_ACTIVE && rank < 2) {
+      found = c;
+      rank = 2;
+    } else if (c->state == CONN_ACTIVE && c->draining && rank < 1) {
+      found = c;
+      rank = 1;
+    }
+  }
+
+  if (found != NULL) {
+    free(key);
+    found->request = req;
+    req->conn = found;
+    if (found->state == CONN_IDLE) {
+      found->state = CONN_ACTIVE;
+      conn_reset_response(found);
+    }
+    if (found->state == CONN_ACTIVE) conn_send_request(found);
+    return true;
+  }
+
+  conn_t *conn = conn_create(client, req, key);
+  if (conn == NULL) {
+    free(key);
+    return false;
+  }
+  conn->request = req;
+  req->conn = conn;
+  conn_start(conn);
+  return true;
+}
+
+static void request_fail(http_request_t *req, const char *error) {
+  if (req->error != NULL || req->complete) return;
+  req->error = strdup(error);
+  if (req->error == NULL) req->error = strdup("");
+  request_poke(req);
+}
+
+/* Sends the event the request has waiting, if any */
+static void request_deliver(http_request_t *req) {
+  transport_t *transport = &req->transport;
+  if (ASTransportIsPaused(transport)) return;
+  if (req->error != NULL && req->bufferCount == 0) {
+    if (req->errorSent) return;
+    req->errorSent = true;
+    ASTransportNotify(transport, TRANSPORT_EVENT_ERROR);
+  } else if (req->bufferCount > 0) {
+    ASTransportNotify(transport, TRANSPORT_EVENT_READABLE);
+  } else if (req->complete && !req->endSent) {
+    req->endSent = true;
+    ASTransportNotify(transport, TRANSPORT_EVENT_END);
+  }
+}
+
+/* Transport */
+
+static ssize_t request_read(transport_t *transport, void *buffer, size_t length) {
+  http_request_t *req = (http_request_t *)transport;
+  if (req->bufferCount == 0) return req->error != NULL ? -1 : 0;
+  if (length > req->bufferCount) length = req->bufferCount;
+  size_t first = kRequestBufferSize - req->bufferStart;
+  if (first > length) first = length;
+  memcpy(buffer, req->buffer + req->bufferStart, first);
+  memcpy((uint8_t *)buffer + first, req->buffer, length - first);
+  req->bufferStart = (req->bufferStart + length) % kRequestBufferSize;
+  req->bufferCount -= length;
+
+  /* Make room for what the connection has waiting */
+  if (req->conn != NULL && req->conn->inLength > 0) {
+    conn_parse(req->conn);
+  }
+  /* Whatever's left, or the end, is the next event */
+  if (req->bufferCount > 0 || req->complete || req->error != NULL) {
+    request_poke(req);
+  }
+  return (ssize_t)length;
+}
+
+static bool request_has_bytes(transport_t *transport) {
+  return ((http_request_t *)transport)->bufferCount > 0;
+}
+
+static bool request_at_end(transport_t *transport) {
+  http_request_t *req = (http_request_t *)transport;
+  return req->complete && req->bufferCount == 0;
+}
+
+static void request_set_paused(transport_t *transport, bool paused) {
+  if (!paused) request_poke((http_request_t *)transport);
+}
+
+static int request_status(transport_t *transport) {
+  return ((http_request_t *)transport)->status;
+}
+
+static size_t request_header_count(transport_t *transport) {
+  return ((http_request_t *)transport)->headerCount;
+}
+
+static bool request_header(transport_t *transport, size_t index,
+                           const char **name, const char **value) {
+  http_request_t *req = (http_request_t *)transport;
+  if (index >= req->headerCount) return false;
+  *name = req->headerNames[index];
+  *value = req->headerValues[index];
+  return true;
+}
+
+static const char *request_error(transport_t *transport) {
+  return ((http_request_t *)transport)->error;
+}
+
+static void request_close(transport_t *transport) {
+  http_request_t *req = (http_request_t *)transport;
+  request_unpend(req);
+  conn_t *conn = req->conn;
+  if (conn != NULL) {
+    if (conn->redirected == req) conn->redirected = NULL;
+    if (conn->state < CONN_ACTIVE) {
+      /* Still being set up, so it's kept for whatever wants it next */
+      conn->request = NULL;
+      req->conn = NULL;
+    } else {
+      conn_abandon(conn);
+      if (conn->state == CONN_ACTIVE && conn->inLength > 0) conn_parse(conn);
+    }
+  }
+  request_clear_response(req);
+  free(req->proxyHost);
+  free(req->extraHeaders);
+  free(req->host);
+  free(req->path);
+  free(req->text);
+  free(req->error);
+  free(req->redirect);
+  free(req);
+}
+
+static const transport_ops_t request_ops = {
+  .read = request_read,
+  .hasBytesAvailable = request_has_bytes,
+  .atEnd = request_at_end,
+  .setPaused = request_set_paused,
+  .statusCode = request_status,
+  .headerCount = request_header_count,
+  .header = request_header,
+  .error = request_error,
+  .close = request_close,
+};
+
+/* Client */
+
+http_client_t *ASHTTPClientCreate(void) {
+  http_client_t *client = calloc(1, sizeof(http_client_t));
+  if (client == NULL) return NULL;
+  client->pollfd = poller_create();
+  if (client->pollfd < 0) {
+    free(client);
+    return NULL;
+  }
+  client->wakeHandle.kind = HANDLE_WAKE;
+  client->wakeHandle.owner = client;
+  client->timer = -1;
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, client->wake) != 0) {
+    close(client->pollfd);
+    free(client);
+    return NULL;
+  }
+  set_nonblocking(client->wake[0]);
+  set_nonblocking(client->wake[1]);
+  if (!poller_watch(client->pollfd, client->wake[0], &client->wakeHandle,
+                    true, false, false) ||
+      !timer_open(client)) {
+    ASHTTPClientDestroy(client);
+    return NULL;
+  }
+  return client;
+}
+
+static void client_free_dead(http_client_t *client) {
+  while (client->dead != NULL) {
+    conn_t *conn = client->dead;
+    client->dead = conn->next;
+    conn_free(conn);
+  }
+}
+
+void ASHTTPClientDestroy(http_client_t *client) {
+  while (client->conns != NULL) {
+    conn_close(client->conns);
+  }
+  client_free_dead(client);
+  close(client->wake[0]);
+  close(client->wake[1]);
+  if (client->timer >= 0) close(client->timer);
+  close(client->pollfd);
+  free(client);
+}
+
+int ASHTTPClientFileDescriptor(const http_client_t *client) {
+  return client->pollfd;
+}
+
+void ASHTTPClientProcess(http_client_t *client, int timeout) {
+  poll_event_t events[kMaxEvents];
+  int count = poller_wait(client->pollfd, events,
+                          client->pending != NULL || client->tasks != NULL ?
+                            0 : timeout);
+  client->processing = true;
+
+  for (int i = 0; i < count; i++) {
+    poll_handle_t *handle = events[i].handle;
+    if (handle->kind == HANDLE_WAKE) {
+      char bytes[16];
+      while (recv(client->wake[0], bytes, sizeof(bytes), 0) > 0) {}
+      client->wakeSignalled = false;
+      continue;
+    }
+    if (handle->kind == HANDLE_TIMER) {
+#ifdef __linux__
+      uint64_t expirations;
+      while (read(client->timer, &expirations, sizeof(expirations)) > 0) {}
+#endif
+      continue;
+    }
+    conn_t *conn = handle->owner;
+    if (conn->state == CONN_CLOSED) continue;
+    if (handle->kind == HANDLE_LOOKUP) {
+      if (conn->lookup != NULL) conn_lookup_done(conn);
+      continue;
+    }
+    if (events[i].writable) conn_writable(conn);
+    if (events[i].readable && conn->state != CONN_CLOSED) conn_readable(conn);
+  }
+
+  /* Idle connections which have been waiting too long */
+  double time = now();
+  for (conn_t *conn = client->conns; conn != NULL; ) {
+    conn_t *next = conn->next;
+    if (conn->state == CONN_IDLE && time - conn->idleSince >= kIdleTimeout) {
+      conn_close(conn);
+    }
+    conn = next;
+  }
+  timer_fire(client, time);
+
+  /* Events are sent last, as readers are free to open and close requests,
+     followed by tasks, which may send events of their own */
+  while (client->pending != NULL || client->tasks != NULL) {
+    if (client->pending != NULL) {
+      http_request_t *req = client->pending;
+      client->pending = req->nextPending;
+      if (client->pending == NULL) client->pendingTail = NULL;
+      req->pending = false;
+      request_deliver(req);
+      continue;
+    }
+    http_client_task_t *task = client->tasks;
+    client->tasks = task->next;
+    if (client->tasks == NULL) client->tasksTail = NULL;
+    task->scheduled = false;
+    task->run(task->context);
+  }
+
+  client->processing = false;
+  client_free_dead(client);
+}
+
+bool ASHTTPClientHandlesURL(const char *url) {
+  url_parts_t parts;
+  if (!url_parse(url, &parts)) return false;
+  url_free(&parts);
+  return true;
+}
+
+transport_t *ASHTTPClientOpen(http_client_t *client,
+                              const http_request_info_t *info,
+                              transport_event_proc proc, void *context) {
+  url_parts_t parts;
+  if (!url_parse(info->url, &parts)) return NULL;
+  http_request_t *req = calloc(1, sizeof(http_request_t));
+  if (req == NULL) {
+    url_free(&parts);
+    return NULL;
+  }
+  ASTransportInit(&req->transport, &request_ops, proc, context);
+  req->client = client;
+  req->host = parts.host;
+  req->port = parts.port;
+  req->path = parts.path;
+  req->proxyType = info->proxyHost != NULL ? info->proxyType : HTTP_PROXY_NONE;
+  req->proxyPort = info->proxyPort;
+  if (req->proxyType != HTTP_PROXY_NONE) {
+    req->proxyHost = strdup(info->proxyHost);
+  }
+
+  size_t length = 1;
+  for (size_t i = 0; i < info->headerCount; i++) {
+    length += strlen(info->headers[2 * i]) + strlen(info->headers[2 * i + 1]) + 4;
+  }
+  req->extraHeaders = malloc(length);
+  if (req->extraHeaders == NULL ||
+      (req->proxyType != HTTP_PROXY_NONE && req->proxyHost == NULL)) {
+    request_close(&req->transport);
+    return NULL;
+  }
+  char *end = req->extraHeaders;
+  *end = '\0';
+  for (size_t i = 0; i < info->headerCount; i++) {
+    end += sprintf(end, "%s: %s\r\n", info->headers[2 * i], info->headers[2 * i + 1]);
+  }
+
+  if (!request_start(req)) {
+    request_close(&req->transport);
+    return NULL;
+  }
+  return &req->transport;
+}
+
+const char *ASHTTPClientRedirectLocation(transport_t *transport) {
+  return ((http_request_t *)transport)->redirect;
+}
+
+void ASHTTPClientSchedule(http_client_t *client, http_client_task_t *task) {
+  if (task->scheduled) return;
+  task->scheduled = true;
+  task->next = NULL;
+  if (client->tasksTail != NULL) {
+    client->tasksTail->next = task;
+  } else {
+    client->tasks = task;
+  }
+  client->tasksTail = task;
+  client_wake(client);
+}
+
+void ASHTTPClientScheduleAfter(http_client_t *client, http_client_task_t *task,
+                               double delay) {
+  if (task->scheduled) return;
+  task->scheduled = true;
+  task->timed = true;
+  task->due = now() + (delay > 0 ? delay : 0);
+  http_client_task_t **link = &client->timers;
+  while (*link != NULL && (*link)->due <= task->due) link = &(*link)->next;
+  task->next = *link;
+  *link = task;
+  if (client->timers == task) timer_arm(client);
+}
+
+void ASHTTPClientUnschedule(http_client_t *client, http_client_task_t *task) {
+  if (!task->scheduled) return;
+  if (task->timed) {
+    http_client_task_t **link = &client->timers;
+    while (*link != NULL && *link != task) link = &(*link)->next;
+    if (*link != NULL) *link = task->next;
+    task->scheduled = false;
+    task->timed = false;
+    if (link == &client->timers) timer_arm(client);
+    return;
+  }
+  http_client_task_t *prev = NULL;
+  for (http_client_task_t *t = client->tasks; t != NULL; prev = t, t = t->next) {
+    if (t != task) continue;
+    if (prev != NULL) {
+      prev->next = t->next;
+    } else {
+      client->tasks = t->next;
+    }
+    if (client->tasksTail == t) client->tasksTail = prev;
+    break;
+  }
+  task->scheduled = false;
+}
+
+void ASHTTPClientGetStats(const http_client_t *client,
+                          http_client_stats_t *stats) {
+  *stats = client->stats;
+}
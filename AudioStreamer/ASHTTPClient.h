@@ -0,0 +1,124 @@
+//
+//  ASHTTPClient.h
+//  AudioStreamer
+//
+
+#ifndef AS_HTTP_CLIENT_H
+#define AS_HTTP_CLIENT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ASTransport.h"
+
+/*
+ * Non-blocking HTTP/1.1 client with persistent connections.
+ *
+ * Every request is a transport (see ASTransport.h) reading the response
+ * body. Connections are kept open once a response has been read in full and
+ * reused for the next request to the same origin through the same proxy, so
+ * a run of Range requests for one file only pays for connecting once. A
+ * request which is closed before its body has all been read leaves its
+ * connection reading off the rest in the background if only a little is
+ * left, and otherwise closes it. A connection still being set up when its
+ * request is closed carries on and is used for the next request which wants
+ * it.
+ *
+ * Only http URLs are handled. Redirects to other http URLs are followed;
+ * a redirect anywhere else fails the request, leaving the location for the
+ * caller to deal with. Requests can go through an HTTP proxy or a SOCKS5
+ * proxy. A server which doesn't answer in HTTP at all (such as a SHOUTcast
+ * server answering "ICY 200 OK") is taken to be sending a body with status
+ * 200 and no headers, which runs until it closes the connection.
+ *
+ * All sockets are watched with one kqueue (epoll on Linux), which is what
+ * ASHTTPClientFileDescriptor returns: once it's readable, ASHTTPClientProcess
+ * does whatever is ready. Host names are looked up on short-lived threads of
+ * their own so that a slow lookup never holds up the rest. Otherwise a
+ * client, and all of its requests, must be used from one thread.
+ *
+ * This is plain C without any CoreFoundation dependency.
+ */
+
+typedef struct http_client http_client_t;
+
+typedef enum {
+  HTTP_PROXY_NONE,
+  HTTP_PROXY_HTTP,
+  HTTP_PROXY_SOCKS,
+} http_proxy_type_t;
+
+typedef struct http_request_info {
+  const char *url;
+  /* Extra request headers, as pairs of name and value */
+  const char *const *headers;
+  size_t headerCount;
+  http_proxy_type_t proxyType;
+  const char *proxyHost;
+  uint16_t proxyPort;
+} http_request_info_t;
+
+/* Work run from ASHTTPClientProcess, for transports built on top of the
+   client's requests which have events of their own to send, or things to do
+   later on. The fields are the client's to manage once it's been scheduled */
+typedef struct http_client_task {
+  void (*run)(void *context);
+  void *context;
+  struct http_client_task *next;
+  double due;                   /* when a timed task is to run */
+  bool scheduled;
+  bool timed;
+} http_client_task_t;
+
+typedef struct http_client_stats {
+  uint64_t requests;            /* requests sent, including redirects */
+  uint64_t connectionsOpened;   /* connections established */
+  uint64_t connectionsReused;   /* requests sent on an earlier connection */
+} http_client_stats_t;
+
+/* Returns NULL if the kqueue can't be created or allocation fails */
+http_client_t *ASHTTPClientCreate(void);
+
+/* Closes every connection. Any requests still open must be closed first */
+void ASHTTPClientDestroy(http_client_t *client);
+
+/* Descriptor which becomes readable when there's something to process */
+int ASHTTPClientFileDescriptor(const http_client_t *client);
+
+/* Handles whatever is ready, first waiting up to timeout milliseconds for
+   something to be (or forever if it's negative). Request events are sent
+   from here */
+void ASHTTPClientProcess(http_client_t *client, int timeout);
+
+/* Whether the client can fetch the URL */
+bool ASHTTPClientHandlesURL(const char *url);
+
+/* Starts a GET request, returning the transport reading its body, or NULL if
+   the URL can't be handled or allocation fails */
+transport_t *ASHTTPClientOpen(http_client_t *client,
+                              const http_request_info_t *info,
+                              transport_event_proc proc, void *context);
+
+/* The location of a redirect which couldn't be followed, if that's what
+   failed the request, otherwise NULL. The transport must be one the client
+   opened */
+const char *ASHTTPClientRedirectLocation(transport_t *transport);
+
+/* Runs the task once, from the next ASHTTPClientProcess after request events
+   have been sent. Does nothing if it's already waiting to run */
+void ASHTTPClientSchedule(http_client_t *client, http_client_task_t *task);
+
+/* Runs the task once, from the first ASHTTPClientProcess at least delay
+   seconds from now. The client's descriptor becomes readable when it's due.
+   Does nothing if it's already waiting to run */
+void ASHTTPClientScheduleAfter(http_client_t *client, http_client_task_t *task,
+                               double delay);
+
+/* Takes back a task which hasn't run yet */
+void ASHTTPClientUnschedule(http_client_t *client, http_client_task_t *task);
+
+void ASHTTPClientGetStats(const http_client_t *client,
+                          http_client_stats_t *stats);
+
+#endif
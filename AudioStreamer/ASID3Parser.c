@@ -0,0 +1,365 @@
+//
+//  ASID3Parser.c
+//  AudioStreamer
+//
+
+#include "ASID3Parser.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define kTagHeaderSize 10
+
+typedef enum id3_state {
+  ID3_STATE_TAG_HEADER = 0, /* gathering the 10 byte tag header */
+  ID3_STATE_EXT_SIZE,       /* gathering the extended header's size */
+  ID3_STATE_EXT_SKIP,       /* skipping the rest of the extended header */
+  ID3_STATE_FRAME_HEADER,   /* gathering a frame header */
+  ID3_STATE_FRAME_DATA,     /* buffering a wanted frame */
+  ID3_STATE_FRAME_SKIP,     /* skipping an unwanted frame */
+  ID3_STATE_PADDING,        /* skipping padding up to the end of the tag */
+  ID3_STATE_DONE,
+  ID3_STATE_NO_TAG
+} id3_state_t;
+
+struct id3_parser {
+  id3_frame_filter   filter;
+  id3_frame_callback callback;
+  void              *context;
+
+  id3_state_t state;
+  uint8_t     version;
+  bool        tagUnsync;     /* v2.3 and earlier: the whole tag is unsynced */
+  bool        lastWasFF;     /* tag-level unsync state across chunks */
+  uint64_t    tagSize;       /* header + body + footer */
+  uint64_t    rawRemaining;  /* bytes of the tag not yet fed in */
+
+  /* Small fixed-size pieces: the tag header, extended header size and frame
+     headers are gathered here */
+  uint8_t header[kTagHeaderSize];
+  size_t  headerLength;
+
+  /* Current frame, or the extended header being skipped */
+  char     frameID[5];
+  uint8_t  frameFlags;
+  uint64_t frameRemaining;
+  size_t   frameLength;
+  uint8_t  frame[kID3MaxFrameSize];
+};
+
+id3_parser_t *ASID3ParserCreate(id3_frame_filter filter,
+                                id3_frame_callback callback, void *context) {
+  id3_parser_t *parser = malloc(sizeof(id3_parser_t));
+  if (parser == NULL) return NULL;
+  parser->filter = filter;
+  parser->callback = callback;
+  parser->context = context;
+  ASID3ParserReset(parser);
+  return parser;
+}
+
+void ASID3ParserDestroy(id3_parser_t *parser) {
+  free(parser);
+}
+
+void ASID3ParserReset(id3_parser_t *parser) {
+  parser->state = ID3_STATE_TAG_HEADER;
+  parser->version = 0;
+  parser->tagUnsync = false;
+  parser->lastWasFF = false;
+  parser->tagSize = 0;
+  parser->rawRemaining = 0;
+  parser->headerLength = 0;
+  parser->frameRemaining = 0;
+  parser->frameLength = 0;
+}
+
+uint64_t ASID3ParserTagSize(const id3_parser_t *parser) {
+  return parser->tagSize;
+}
+
+static inline uint32_t syncsafe32(const uint8_t *b) {
+  return ((uint32_t)(b[0] & 0x7F) << 21) | ((uint32_t)(b[1] & 0x7F) << 14) |
+         ((uint32_t)(b[2] & 0x7F) << 7)  |  (uint32_t)(b[3] & 0x7F);
+}
+
+static inline uint32_t be32(const uint8_t *b) {
+  return ((uint32_t)b[0] << 24) | ((uint32_t)b[1] << 16) |
+         ((uint32_t)b[2] << 8)  |  (uint32_t)b[3];
+}
+
+size_t ASID3Resynchronize(uint8_t *bytes, size_t length) {
+  uint8_t *ff = memchr(bytes, 0xFF, length);
+  if (ff == NULL) return length;
+
+  /* Everything up to the first 0xFF is already in place. From there on, copy
+     whole runs between 0xFF bytes, dropping a 0x00 which follows any of them */
+  uint8_t *out = ff;
+  const uint8_t *in = ff;
+  const uint8_t *end = bytes + length;
+  while (in < end) {
+    const uint8_t *next = memchr(in, 0xFF, (size_t)(end - in));
+    size_t run = next == NULL ? (size_t)(end - in) : (size_t)(next - in) + 1;
+    memmove(out, in, run);
+    out += run;
+    in += run;
+    if (next != NULL && in < end && *in == 0x00) in++;
+  }
+  return (size_t)(out - bytes);
+}
+
+static size_t frame_header_size(const id3_parser_t *parser) {
+  return parser->version == 2 ? 6 : 10;
+}
+
+static bool frame_is_readable(const id3_parser_t *parser) {
+  uint8_t flags = parser->frameFlags;
+  if (parser->version == 3) {
+    return (flags & 0xC0) == 0;  /* compressed or encrypted */
+  } else if (parser->version == 4) {
+    return (flags & 0x0C) == 0;
+  }
+  return true;
+}
+
+/* Strips header extensions from a fully buffered frame and hands it over */
+static void deliver_frame(id3_parser_t *parser) {
+  uint8_t *data = parser->frame;
+  size_t length = parser->frameLength;
+
+  if (parser->version == 4 && (parser->frameFlags & 0x02)) {
+    length = ASID3Resynchronize(data, length);
+  }
+  if ((parser->version == 3 && (parser->frameFlags & 0x20)) ||
+      (parser->version == 4 && (parser->frameFlags & 0x40))) {
+    /* Group identifier */
+    if (length < 1) return;
+    data++;
+    length--;
+  }
+  if (parser->version == 4 && (parser->frameFlags & 0x01)) {
+    /* Data length indicator */
+    if (length < 4) return;
+    data += 4;
+    length -= 4;
+  }
+
+  id3_frame_t frame;
+  memcpy(frame.id, parser->frameID, sizeof(frame.id));
+  frame.version = parser->version;
+  frame.data = data;
+  frame.length = length;
+  parser->callback(parser->context, &frame);
+}
+
+static void begin_frame(id3_parser_t *parser) {
+  const uint8_t *h = parser->header;
+  size_t idLength;
+  uint32_t size;
+  if (parser->version == 2) {
+    idLength = 3;
+    size = ((uint32_t)h[3] << 16) | ((uint32_t)h[4] << 8) | h[5];
+    parser->frameFlags = 0;
+  } else {
+    idLength = 4;
+    size = parser->version == 4 ? syncsafe32(h + 4) : be32(h + 4);
+    parser->frameFlags = h[9];
+  }
+
+  /* A zero byte where an ID should be is the start of the padding */
+  if (h[0] == 0) {
+    parser->state = ID3_STATE_PADDING;
+    return;
+  }
+  memcpy(parser->frameID, h, idLength);
+  parser->frameID[idLength] = '\0';
+  parser->frameRemaining = size;
+  parser->frameLength = 0;
+
+  bool wanted = size > 0 && size <= kID3MaxFrameSize &&
+                frame_is_readable(parser) &&
+                parser->filter(parser->context, parser->frameID, parser->version);
+  parser->state = wanted ? ID3_STATE_FRAME_DATA : ID3_STATE_FRAME_SKIP;
+  if (size == 0) parser->state = ID3_STATE_FRAME_HEADER;
+}
+
+/* Gathers up to 'want' bytes into the header buffer. Returns the number of
+   bytes used */
+static size_t gather(id3_parser_t *parser, const uint8_t *bytes, size_t length,
+                     size_t want) {
+  size_t n = want - parser->headerLength;
+  if (n > length) n = length;
+  memcpy(parser->header + parser->headerLength, bytes, n);
+  parser->headerLength += n;
+  return n;
+}
+
+/* Walks the body of the tag. The bytes given here have already had any
+   tag-level unsynchronization removed */
+static void parse_body(id3_parser_t *parser, const uint8_t *bytes, size_t length) {
+  while (length > 0) {
+    size_t used = length;
+    switch (parser->state) {
+      case ID3_STATE_EXT_SIZE:
+        used = gather(parser, bytes, length, 4);
+        if (parser->headerLength == 4) {
+          /* v2.3 doesn't count the size itself, v2.4 does (and is syncsafe) */
+          uint32_t size;
+          if (parser->version == 3) {
+            size = be32(parser->header);
+          } else {
+            size = syncsafe32(parser->header);
+            size = size >= 4 ? size - 4 : 0;
+          }
+          parser->frameRemaining = size;
+          parser->headerLength = 0;
+          parser->state = ID3_STATE_EXT_SKIP;
+        }
+        break;
+
+      case ID3_STATE_EXT_SKIP:
+      case ID3_STATE_FRAME_SKIP:
+        if (used > parser->frameRemaining) used = (size_t)parser->frameRemaining;
+        parser->frameRemaining -= used;
+        if (parser->frameRemaining == 0) parser->state = ID3_STATE_FRAME_HEADER;
+        break;
+
+      case ID3_STATE_FRAME_HEADER:
+        used = gather(parser, bytes, length, frame_header_size(parser));
+        if (parser->headerLength == frame_header_size(parser)) {
+          parser->headerLength = 0;
+          begin_frame(parser);
+        }
+        break;
+
+      case ID3_STATE_FRAME_DATA:
+        if (used > parser->frameRemaining) used = (size_t)parser->frameRemaining;
+        memcpy(parser->frame + parser->frameLength, bytes, used);
+        parser->frameLength += used;
+        parser->frameRemaining -= used;
+        if (parser->frameRemaining == 0) {
+          deliver_frame(parser);
+          parser->state = ID3_STATE_FRAME_HEADER;
+        }
+        break;
+
+      default:
+        /* Padding, or the tag is over. Nothing more to look at */
+        return;
+    }
+    bytes += used;
+    length -= used;
+  }
+}
+
+/* Undoes tag-level unsynchronization a run at a time. memchr() finds the
+   0xFF bytes, so stretches without any are passed along untouched */
+static void parse_unsynced_body(id3_parser_t *parser, const uint8_t *bytes,
+                                size_t length) {
+  if (parser->lastWasFF && length > 0) {
+    parser->lastWasFF = false;
+    if (bytes[0] == 0x00) {
+      bytes++;
+      length--;
+    }
+  }
+  while (length > 0) {
+    const uint8_t *ff = memchr(bytes, 0xFF, length);
+    if (ff == NULL) {
+      parse_body(parser, bytes, length);
+      return;
+    }
+    size_t run = (size_t)(ff - bytes) + 1;
+    parse_body(parser, bytes, run);
+    bytes += run;
+    length -= run;
+    if (length == 0) {
+      parser->lastWasFF = true;
+    } else if (bytes[0] == 0x00) {
+      bytes++;
+      length--;
+    }
+  }
+}
+
+/* Parses the tag header. Returns false if there is no usable tag */
+static bool begin_tag(id3_parser_t *parser) {
+  const uint8_t *h = parser->header;
+  if (memcmp(h, "ID3", 3) != 0) return false;
+  if (h[3] < 2 || h[3] > 4 || h[4] == 0xFF) return false;
+  if ((h[6] | h[7] | h[8] | h[9]) & 0x80) return false;
+
+  uint8_t flags = h[5];
+  parser->version = h[3];
+  uint32_t bodySize = syncsafe32(h + 6);
+  parser->rawRemaining = bodySize;
+  if (parser->version == 4 && (flags & 0x10)) {
+    parser->rawRemaining += kTagHeaderSize;  /* footer */
+  }
+  parser->tagSize = kTagHeaderSize + parser->rawRemaining;
+  parser->tagUnsync = parser->version <= 3 && (flags & 0x80);
+  parser->headerLength = 0;
+
+  if (parser->version == 2 && (flags & 0x40)) {
+    /* v2.2 compression was never defined, so nothing can be read */
+    parser->state = ID3_STATE_PADDING;
+  } else if (parser->version >= 3 && (flags & 0x40)) {
+    parser->state = ID3_STATE_EXT_SIZE;
+  } else {
+    parser->state = ID3_STATE_FRAME_HEADER;
+  }
+  return true;
+}
+
+id3_status_t ASID3ParserFeed(id3_parser_t *parser, const uint8_t *bytes,
+                             size_t length, size_t *consumed) {
+  size_t total = 0;
+
+  if (parser->state == ID3_STATE_TAG_HEADER) {
+    size_t n = gather(parser, bytes, length, kTagHeaderSize);
+    total += n;
+    if (parser->headerLength < kTagHeaderSize) {
+      /* Bail out early if what we have can't be the start of a tag */
+      if (memcmp(parser->header, "ID3", parser->headerLength < 3 ?
+                 parser->headerLength : 3) != 0) {
+        parser->state = ID3_STATE_NO_TAG;
+      }
+    } else if (!begin_tag(parser)) {
+      parser->state = ID3_STATE_NO_TAG;
+    }
+    if (parser->state == ID3_STATE_NO_TAG) {
+      if (consumed != NULL) *consumed = 0;
+      return ID3_STATUS_NO_TAG;
+    }
+    if (parser->state == ID3_STATE_TAG_HEADER) {
+      if (consumed != NULL) *consumed = total;
+      return ID3_STATUS_NEED_MORE;
+    }
+    bytes += n;
+    length -= n;
+  }
+
+  if (parser->state == ID3_STATE_DONE || parser->state == ID3_STATE_NO_TAG) {
+    if (consumed != NULL) *consumed = 0;
+    return parser->state == ID3_STATE_DONE ? ID3_STATUS_DONE : ID3_STATUS_NO_TAG;
+  }
+
+  size_t body = length;
+  if (body > parser->rawRemaining) body = (size_t)parser->rawRemaining;
+  if (body > 0) {
+    if (parser->tagUnsync) {
+      parse_unsynced_body(parser, bytes, body);
+    } else {
+      parse_body(parser, bytes, body);
+    }
+    parser->rawRemaining -= body;
+    total += body;
+  }
+
+  if (consumed != NULL) *consumed = total;
+  if (parser->rawRemaining == 0) {
+    parser->state = ID3_STATE_DONE;
+    return ID3_STATUS_DONE;
+  }
+  return ID3_STATUS_NEED_MORE;
+}
@@ -0,0 +1,73 @@
+//
+//  ASID3Parser.h
+//  AudioStreamer
+//
+
+#ifndef AS_ID3_PARSER_H
+#define AS_ID3_PARSER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Incremental ID3v2.2/2.3/2.4 tag parser.
+ *
+ * Bytes are fed in as they arrive from the network, in chunks of any size, and
+ * the parser picks up where it left off. Only frames which the caller asks for
+ * are buffered, in a fixed buffer inside the parser, so memory use does not
+ * depend on the tag size. Everything else (artwork, for example) is skipped by
+ * counting bytes rather than storing them.
+ *
+ * Unsynchronization is undone on the fly, both for whole tags (v2.3) and for
+ * single frames (v2.4).
+ */
+
+/* Largest frame payload that is ever buffered. Bigger frames are skipped */
+#define kID3MaxFrameSize (16 * 1024)
+
+typedef struct id3_parser id3_parser_t;
+
+typedef enum id3_status {
+  ID3_STATUS_NEED_MORE = 0, /* in the middle of a tag */
+  ID3_STATUS_DONE,          /* the whole tag has been consumed */
+  ID3_STATUS_NO_TAG         /* the data doesn't start with a supported tag */
+} id3_status_t;
+
+typedef struct id3_frame {
+  char           id[5];     /* NUL-terminated, 3 characters for v2.2 */
+  uint8_t        version;   /* major version of the tag (2, 3 or 4) */
+  const uint8_t *data;      /* payload with any header extensions removed */
+  size_t         length;
+} id3_frame_t;
+
+/* Asked with each frame ID whether that frame should be buffered */
+typedef bool (*id3_frame_filter)(void *context, const char *frameID, uint8_t version);
+
+/* Invoked with each buffered frame once all of it has been read */
+typedef void (*id3_frame_callback)(void *context, const id3_frame_t *frame);
+
+/* Creates a parser. Returns NULL if allocation fails */
+id3_parser_t *ASID3ParserCreate(id3_frame_filter filter,
+                                id3_frame_callback callback, void *context);
+
+void ASID3ParserDestroy(id3_parser_t *parser);
+
+/* Starts over, expecting a tag at the beginning of the next bytes fed */
+void ASID3ParserReset(id3_parser_t *parser);
+
+/* Feeds the next chunk of data. If consumed is non-NULL it receives the number
+   of bytes which belonged to the tag, so with ID3_STATUS_DONE the audio data
+   begins at bytes + *consumed */
+id3_status_t ASID3ParserFeed(id3_parser_t *parser, const uint8_t *bytes,
+                             size_t length, size_t *consumed);
+
+/* Total size of the tag in bytes, including its header and footer, or 0 if
+   the header hasn't been read yet */
+uint64_t ASID3ParserTagSize(const id3_parser_t *parser);
+
+/* Removes unsynchronization (0xFF 0x00 -> 0xFF) from a buffer in place and
+   returns the new length */
+size_t ASID3Resynchronize(uint8_t *bytes, size_t length);
+
+#endif
@@ -0,0 +1,137 @@
+//
+//  ASIcyDemuxer.c
+//  AudioStreamer
+//
+
+#include "ASIcyDemuxer.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* The length byte counts in units of 16 bytes */
+#define kMaxMetadataLength (255 * 16)
+
+typedef enum icy_state {
+  ICY_STATE_AUDIO = 0,
+  ICY_STATE_LENGTH,
+  ICY_STATE_METADATA
+} icy_state_t;
+
+struct icy_demuxer {
+  icy_state_t state;
+  uint32_t    metaInterval;
+  uint32_t    audioRemaining;  /* audio bytes left before the length byte */
+  size_t      metaRemaining;   /* metadata bytes left in the current block */
+  size_t      metaLength;      /* metadata bytes gathered so far */
+  uint8_t     metadata[kMaxMetadataLength];
+};
+
+icy_demuxer_t *ASIcyDemuxerCreate(void) {
+  icy_demuxer_t *demuxer = malloc(sizeof(icy_demuxer_t));
+  if (demuxer == NULL) return NULL;
+  ASIcyDemuxerReset(demuxer, 0);
+  return demuxer;
+}
+
+void ASIcyDemuxerDestroy(icy_demuxer_t *demuxer) {
+  free(demuxer);
+}
+
+void ASIcyDemuxerReset(icy_demuxer_t *demuxer, uint32_t metaInterval) {
+  demuxer->state = ICY_STATE_AUDIO;
+  demuxer->metaInterval = metaInterval;
+  demuxer->audioRemaining = metaInterval;
+  demuxer->metaRemaining = 0;
+  demuxer->metaLength = 0;
+}
+
+size_t ASIcyDemuxerNext(icy_demuxer_t *demuxer, const uint8_t *bytes,
+                        size_t length, icy_span_t *span) {
+  span->type = ICY_SPAN_NONE;
+  span->data = NULL;
+  span->length = 0;
+  if (length == 0) return 0;
+
+  switch (demuxer->state) {
+    case ICY_STATE_AUDIO: {
+      size_t run = length;
+      if (demuxer->metaInterval > 0) {
+        if (run > demuxer->audioRemaining) run = demuxer->audioRemaining;
+        demuxer->audioRemaining -= (uint32_t)run;
+        if (demuxer->audioRemaining == 0) demuxer->state = ICY_STATE_LENGTH;
+      }
+      span->type = ICY_SPAN_AUDIO;
+      span->data = bytes;
+      span->length = run;
+      return run;
+    }
+
+    case ICY_STATE_LENGTH:
+      demuxer->metaRemaining = (size_t)bytes[0] * 16;
+      demuxer->metaLength = 0;
+      if (demuxer->metaRemaining == 0) {
+        demuxer->state = ICY_STATE_AUDIO;
+        demuxer->audioRemaining = demuxer->metaInterval;
+      } else {
+        demuxer->state = ICY_STATE_METADATA;
+      }
+      return 1;
+
+    case ICY_STATE_METADATA: {
+      size_t run = length;
+      if (run > demuxer->metaRemaining) run = demuxer->metaRemaining;
+      memcpy(demuxer->metadata + demuxer->metaLength, bytes, run);
+      demuxer->metaLength += run;
+      demuxer->metaRemaining -= run;
+      if (demuxer->metaRemaining == 0) {
+        /* Blocks are padded out to a multiple of 16 with NULs */
+        size_t end = demuxer->metaLength;
+        while (end > 0 && demuxer->metadata[end - 1] == '\0') end--;
+        span->type = ICY_SPAN_METADATA;
+        span->data = demuxer->metadata;
+        span->length = end;
+        demuxer->state = ICY_STATE_AUDIO;
+        demuxer->audioRemaining = demuxer->metaInterval;
+      }
+      return run;
+    }
+  }
+  return length;
+}
+
+static const uint8_t *find(const uint8_t *haystack, size_t length,
+                           const char *needle, size_t needleLength) {
+  while (length >= needleLength) {
+    const uint8_t *first = memchr(haystack, needle[0], length - needleLength + 1);
+    if (first == NULL) return NULL;
+    if (memcmp(first, needle, needleLength) == 0) return first;
+    length -= (size_t)(first - haystack) + 1;
+    haystack = first + 1;
+  }
+  return NULL;
+}
+
+bool ASIcyParseStreamTitle(const uint8_t *metadata, size_t length,
+                           const uint8_t **title, size_t *titleLength) {
+  static const char key[] = "StreamTitle='";
+  const size_t keyLength = sizeof(key) - 1;
+
+  const uint8_t *start = find(metadata, length, key, keyLength);
+  if (start == NULL) return false;
+  start += keyLength;
+  size_t remaining = length - (size_t)(start - metadata);
+
+  /* The value ends at "';". Titles may contain quotes and semicolons on their
+     own, so fall back to the last quote if the terminator is missing */
+  const uint8_t *end = find(start, remaining, "';", 2);
+  if (end == NULL) {
+    end = start + remaining;
+    const uint8_t *quote = end;
+    while (quote > start && quote[-1] != '\'') quote--;
+    if (quote > start) end = quote - 1;
+  }
+
+  *title = start;
+  *titleLength = (size_t)(end - start);
+  return true;
+}
@@ -0,0 +1,58 @@
+//
+//  ASIcyDemuxer.h
+//  AudioStreamer
+//
+
+#ifndef AS_ICY_DEMUXER_H
+#define AS_ICY_DEMUXER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Splits an ICY (Shoutcast/Icecast) body into audio and metadata.
+ *
+ * An ICY body with an "icy-metaint" of N is N bytes of audio, one length byte
+ * L, then L * 16 bytes of metadata, repeated. The demuxer is a small state
+ * machine which walks that layout a run at a time rather than a byte at a
+ * time. Audio runs are handed back as spans into the caller's buffer, so they
+ * are never copied, and metadata is gathered into a fixed buffer inside the
+ * demuxer. Nothing is allocated after creation.
+ */
+
+typedef struct icy_demuxer icy_demuxer_t;
+
+typedef enum icy_span_type {
+  ICY_SPAN_NONE = 0,  /* bytes were consumed, nothing to report yet */
+  ICY_SPAN_AUDIO,     /* a run of audio bytes within the input */
+  ICY_SPAN_METADATA   /* a complete metadata block, NUL padding removed */
+} icy_span_type_t;
+
+typedef struct icy_span {
+  icy_span_type_t type;
+  const uint8_t  *data;
+  size_t          length;
+} icy_span_t;
+
+/* Creates a demuxer. Returns NULL if allocation fails */
+icy_demuxer_t *ASIcyDemuxerCreate(void);
+
+void ASIcyDemuxerDestroy(icy_demuxer_t *demuxer);
+
+/* Restarts the demuxer at the beginning of a body with the given metadata
+   interval. An interval of 0 means the body contains no metadata at all */
+void ASIcyDemuxerReset(icy_demuxer_t *demuxer, uint32_t metaInterval);
+
+/* Consumes bytes from the front of the input and describes them in span.
+   Returns how many bytes were consumed, which is nonzero whenever length is.
+   Spans of type ICY_SPAN_METADATA stay valid until the next call */
+size_t ASIcyDemuxerNext(icy_demuxer_t *demuxer, const uint8_t *bytes,
+                        size_t length, icy_span_t *span);
+
+/* Finds the StreamTitle='...'; value in a metadata block. On success title
+   points into the block and titleLength is its length in bytes */
+bool ASIcyParseStreamTitle(const uint8_t *metadata, size_t length,
+                           const uint8_t **title, size_t *titleLength);
+
+#endif
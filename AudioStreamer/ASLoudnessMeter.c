@@ -0,0 +1,207 @@
+//
+//  ASLoudnessMeter.c
+//  AudioStreamer
+//
+
+#include "ASLoudnessMeter.h"
+
+#include <ctype.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#define kAbsoluteGate -70.0
+#define kRelativeGate -10.0
+/* Four 100 ms steps to each 400 ms block */
+#define kStepsPerBlock 4
+/* Histogram bins from -70 to +10 LUFS; louder blocks go in the top one */
+#define kHistogramMin kAbsoluteGate
+#define kBinWidth 0.1
+#define kBins 800
+
+typedef struct biquad {
+  double b0, b1, b2, a1, a2;
+} biquad_t;
+
+struct loudness_meter {
+  uint32_t channels;
+  double   sampleRate;
+  biquad_t shelf;
+  biquad_t highpass;
+  double  *state;               /* four per channel, two for each filter */
+
+  uint32_t stepFrames;          /* frames in 100 ms */
+  uint32_t filled;              /* frames of the current step so far */
+  double   sum;                 /* of the current step's squares, all channels */
+  double   steps[kStepsPerBlock]; /* mean squares of the latest steps */
+  uint64_t stepCount;
+
+  double   binEnergy[kBins];
+  uint64_t binBlocks[kBins];
+  uint64_t gatedBlocks;
+};
+
+/* The K-weighting filter's two stages for a sample rate, from the analogue
+   prototypes BS.1770's 48 kHz coefficients were made from */
+static void k_weighting(double sampleRate, biquad_t *shelf, biquad_t *highpass) {
+  double f0 = 1681.974450955533;
+  double gain = 3.999843853973347;
+  double q = 0.7071752369554196;
+  double k = tan(M_PI * f0 / sampleRate);
+  double vh = pow(10.0, gain / 20.0);
+  double vb = pow(vh, 0.4996667741545416);
+  double a0 = 1.0 + k / q + k * k;
+  shelf->b0 = (vh + vb * k / q + k * k) / a0;
+  shelf->b1 = 2.0 * (k * k - vh) / a0;
+  shelf->b2 = (vh - vb * k / q + k * k) / a0;
+  shelf->a1 = 2.0 * (k * k - 1.0) / a0;
+  shelf->a2 = (1.0 - k / q + k * k) / a0;
+
+  f0 = 38.13547087602444;
+  q = 0.5003270373238773;
+  k = tan(M_PI * f0 / sampleRate);
+  a0 = 1.0 + k / q + k * k;
+  highpass->b0 = 1.0;
+  highpass->b1 = -2.0;
+  highpass->b2 = 1.0;
+  highpass->a1 = 2.0 * (k * k - 1.0) / a0;
+  highpass->a2 = (1.0 - k / q + k * k) / a0;
+}
+
+static double block_loudness(double energy) {
+  return -0.691 + 10.0 * log10(energy);
+}
+
+loudness_meter_t *ASLoudnessMeterCreate(double sampleRate, uint32_t channels) {
+  if (channels == 0 || !(sampleRate >= 8000.0)) return NULL;
+  loudness_meter_t *meter = calloc(1, sizeof(loudness_meter_t));
+  if (meter == NULL) return NULL;
+  meter->state = calloc(channels * 4, sizeof(double));
+  if (meter->state == NULL) {
+    free(meter);
+    return NULL;
+  }
+  meter->channels = channels;
+  meter->sampleRate = sampleRate;
+  meter->stepFrames = (uint32_t) lround(sampleRate / 10.0);
+  k_weighting(sampleRate, &meter->shelf, &meter->highpass);
+  return meter;
+}
+
+void ASLoudnessMeterDestroy(loudness_meter_t *meter) {
+  if (meter == NULL) return;
+  free(meter->state);
+  free(meter);
+}
+
+void ASLoudnessMeterReset(loudness_meter_t *meter) {
+  memset(meter->state, 0, meter->channels * 4 * sizeof(double));
+  meter->filled = 0;
+  meter->sum = 0;
+  meter->stepCount = 0;
+  memset(meter->binEnergy, 0, sizeof(meter->binEnergy));
+  memset(meter->binBlocks, 0, sizeof(meter->binBlocks));
+  meter->gatedBlocks = 0;
+}
+
+/* Filters one channel's samples and returns the sum of their squares */
+static double filter_channel(const biquad_t *shelf, const biquad_t *hp,
+                             double *restrict s, const float *restrict in,
+                             uint32_t frames) {
+  double s0 = s[0], s1 = s[1], s2 = s[2], s3 = s[3];
+  double sum = 0;
+  for (uint32_t i = 0; i < frames; i++) {
+    double x = in[i];
+    double y = shelf->b0 * x + s0;
+    s0 = shelf->b1 * x - shelf->a1 * y + s1;
+    s1 = shelf->b2 * x - shelf->a2 * y;
+    double z = y + s2;
+    s2 = -2.0 * y - hp->a1 * z + s3;
+    s3 = y - hp->a2 * z;
+    sum += z * z;
+  }
+  /* Keep silence from decaying into denormals */
+  if (fabs(s0) + fabs(s1) + fabs(s2) + fabs(s3) < 1e-30) {
+    s0 = s1 = s2 = s3 = 0;
+  }
+  s[0] = s0;
+  s[1] = s1;
+  s[2] = s2;
+  s[3] = s3;
+  return sum;
+}
+
+static void add_block(loudness_meter_t *meter, double energy) {
+  if (energy <= 0) return;
+  double loudness = block_loudness(energy);
+  if (loudness <= kAbsoluteGate) return;
+  int bin = (int) floor((loudness - kHistogramMin) / kBinWidth);
+  if (bin >= kBins) bin = kBins - 1;
+  meter->binEnergy[bin] += energy;
+  meter->binBlocks[bin]++;
+  meter->gatedBlocks++;
+}
+
+void ASLoudnessMeterProcess(loudness_meter_t *meter, const float *const *channels,
+                            uint32_t frames) {
+  uint32_t done = 0;
+  while (done < frames) {
+    uint32_t count = meter->stepFrames - meter->filled;
+    if (count > frames - done) count = frames - done;
+    for (uint32_t ch = 0; ch < meter->channels; ch++) {
+      meter->sum += filter_channel(&meter->shelf, &meter->highpass,
+                                   meter->state + 4 * ch, channels[ch] + done,
+                                   count);
+    }
+    done += count;
+    meter->filled += count;
+    if (meter->filled < meter->stepFrames) break;
+
+    meter->steps[meter->stepCount % kStepsPerBlock] = meter->sum / meter->stepFrames;
+    meter->stepCount++;
+    meter->sum = 0;
+    meter->filled = 0;
+    if (meter->stepCount >= kStepsPerBlock) {
+      double energy = 0;
+      for (int i = 0; i < kStepsPerBlock; i++) energy += meter->steps[i];
+      add_block(meter, energy / kStepsPerBlock);
+    }
+  }
+}
+
+bool ASLoudnessMeterIntegrated(const loudness_meter_t *meter, double *lufs) {
+  if (meter->gatedBlocks == 0) return false;
+  double total = 0;
+  for (int i = 0; i < kBins; i++) total += meter->binEnergy[i];
+  double gate = block_loudness(total / meter->gatedBlocks) + kRelativeGate;
+
+  double energy = 0;
+  uint64_t blocks = 0;
+  for (int i = 0; i < kBins; i++) {
+    /* A bin's blocks are taken to be at its middle */
+    if (kHistogramMin + (i + 0.5) * kBinWidth <= gate) continue;
+    energy += meter->binEnergy[i];
+    blocks += meter->binBlocks[i];
+  }
+  if (blocks == 0) return false;
+  *lufs = block_loudness(energy / blocks);
+  return true;
+}
+
+double ASLoudnessMeterGatedDuration(const loudness_meter_t *meter) {
+  /* Blocks start 100 ms apart */
+  return meter->gatedBlocks * 0.1;
+}
+
+bool ASLoudnessParseReplayGain(const char *value, double *gain) {
+  char *end;
+  double parsed = strtod(value, &end);
+  if (end == value || !isfinite(parsed)) return false;
+  while (isspace((unsigned char) *end)) end++;
+  if (strncasecmp(end, "dB", 2) == 0) end += 2;
+  while (isspace((unsigned char) *end)) end++;
+  if (*end != '\0') return false;
+  *gain = parsed;
+  return true;
+}
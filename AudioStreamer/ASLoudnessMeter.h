@@ -0,0 +1,60 @@
+//
+//  ASLoudnessMeter.h
+//  AudioStreamer
+//
+
+#ifndef AS_LOUDNESS_METER_H
+#define AS_LOUDNESS_METER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Integrated loudness of decoded PCM, as EBU R128 measures it (ITU-R
+ * BS.1770-4).
+ *
+ * Each channel goes through the K-weighting filter, a high shelf followed by
+ * a high pass, whose coefficients are worked out for the sample rate. The mean
+ * square of the filtered signal is taken over 400 ms blocks overlapping by
+ * 75%, and the channels' are summed into each block's loudness. Blocks
+ * quieter than -70 LUFS are left out, then those more than 10 LU below the
+ * loudness of the rest, and the integrated loudness is that of the blocks
+ * which remain.
+ *
+ * Blocks are kept in a histogram of 0.1 LU bins rather than one by one, so
+ * memory stays the same however long the stream plays, and nothing is
+ * allocated once the meter has been created. Each bin sums the energy of its
+ * blocks, so only the relative gate is as coarse as a bin.
+ *
+ * Channels are all weighted alike, which is exact for mono and stereo.
+ *
+ * This is plain C without any CoreFoundation dependency.
+ */
+
+typedef struct loudness_meter loudness_meter_t;
+
+/* Returns NULL if the format can't be measured or allocation fails */
+loudness_meter_t *ASLoudnessMeterCreate(double sampleRate, uint32_t channels);
+
+void ASLoudnessMeterDestroy(loudness_meter_t *meter);
+
+/* Measures a block of non-interleaved float samples, one pointer per channel
+   for as many channels as the meter was created with */
+void ASLoudnessMeterProcess(loudness_meter_t *meter, const float *const *channels,
+                            uint32_t frames);
+
+/* The integrated loudness so far, in LUFS. Returns false if no block has been
+   loud enough to count yet */
+bool ASLoudnessMeterIntegrated(const loudness_meter_t *meter, double *lufs);
+
+/* Seconds of audio in the blocks which passed the absolute gate */
+double ASLoudnessMeterGatedDuration(const loudness_meter_t *meter);
+
+/* Forgets everything measured */
+void ASLoudnessMeterReset(loudness_meter_t *meter);
+
+/* Reads a ReplayGain gain, such as "-6.48 dB", into decibels. Returns false
+   if it isn't one */
+bool ASLoudnessParseReplayGain(const char *value, double *gain);
+
+#endif
@@ -0,0 +1,264 @@
+//
+//  ASMP3Parser.c
+//  AudioStreamer
+//
+
+#include "ASMP3Parser.h"
+#include "ASFrameScanner.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Enough to decide on any frame: a whole frame plus the following header,
+   or a free format frame and the header which ends it */
+#define kCarrySize (2 * (kMP3MaxFrameLength + 4) + 10)
+
+struct mp3_parser {
+  mp3_format_callback formatCallback;
+  void               *context;
+  as_frame_scanner_t *scanner;
+
+  bool         formatReported;
+  bool         firstFrame;     /* the next frame would be the first one */
+  mp3_header_t format;
+  mp3_header_t header;         /* of the frame being scanned */
+  uint32_t     freeFormatLength; /* without padding, 0 unless free format */
+  uint64_t     crcErrors;
+};
+
+/* Layer III bitrates in kbit/s, MPEG 1 and then MPEG 2/2.5 */
+static const uint16_t kBitrates[2][15] = {
+  {0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320},
+  {0,  8, 16, 24, 32, 40, 48, 56,  64,  80,  96, 112, 128, 144, 160}
+};
+
+static const uint32_t kSampleRates[4][3] = {
+  {11025, 12000,  8000},  /* MPEG 2.5 */
+  {    0,     0,     0},  /* reserved */
+  {22050, 24000, 16000},  /* MPEG 2 */
+  {44100, 48000, 32000}   /* MPEG 1 */
+};
+
+bool ASMP3ParseHeader(const uint8_t *p, mp3_header_t *header) {
+  if (p[0] != 0xFF || (p[1] & 0xE0) != 0xE0) return false;
+  uint8_t version = (p[1] >> 3) & 0x3;
+  uint8_t layer = (p[1] >> 1) & 0x3;
+  uint8_t bitrateIndex = p[2] >> 4;
+  uint8_t rateIndex = (p[2] >> 2) & 0x3;
+  if (version == 1 || layer != 1 || bitrateIndex == 15 || rateIndex == 3 ||
+      (p[3] & 0x3) == 2 /* reserved emphasis */) {
+    return false;
+  }
+
+  bool mpeg1 = version == 3;
+  bool mono = (p[3] >> 6) == 3;
+  header->version = mpeg1 ? 1 : version == 2 ? 2 : 25;
+  header->channels = mono ? 1 : 2;
+  header->crc = (p[1] & 0x1) == 0;
+  header->padding = (p[2] >> 1) & 0x1;
+  header->bitrate = kBitrates[mpeg1 ? 0 : 1][bitrateIndex] * 1000u;
+  header->sampleRate = kSampleRates[version][rateIndex];
+  header->samplesPerFrame = mpeg1 ? 1152 : 576;
+  header->frameLength = header->bitrate == 0 ? 0 :
+      (mpeg1 ? 144 : 72) * header->bitrate / header->sampleRate + header->padding;
+  header->sideInfoLength = mpeg1 ? (mono ? 17 : 32) : (mono ? 9 : 17);
+  return true;
+}
+
+/* CRC-16 with polynomial 0x8005, as used by MPEG audio. The table is worked
+   out ahead of time so that parsers on different threads share it safely */
+static const uint16_t kCRC16Table[256] = {
+  0x0000, 0x8005, 0x800f, 0x000a, 0x801b, 0x001e, 0x0014, 0x8011,
+  0x8033, 0x0036, 0x003c, 0x8039, 0x0028, 0x802d, 0x8027, 0x0022,
+  0x8063, 0x0066, 0x006c, 0x8069, 0x0078, 0x807d, 0x8077, 0x0072,
+  0x0050, 0x8055, 0x805f, 0x005a, 0x804b, 0x004e, 0x0044, 0x8041,
+  0x80c3, 0x00c6, 0x00cc, 0x80c9, 0x00d8, 0x80dd, 0x80d7, 0x00d2,
+  0x00f0, 0x80f5, 0x80ff, 0x00fa, 0x80eb, 0x00ee, 0x00e4, 0x80e1,
+  0x00a0, 0x80a5, 0x80af, 0x00aa, 0x80bb, 0x00be, 0x00b4, 0x80b1,
+  0x8093, 0x0096, 0x009c, 0x8099, 0x0088, 0x808d, 0x8087, 0x0082,
+  0x8183, 0x0186, 0x018c, 0x8189, 0x0198, 0x819d, 0x8197, 0x0192,
+  0x01b0, 0x81b5, 0x81bf, 0x01ba, 0x81ab, 0x01ae, 0x01a4, 0x81a1,
+  0x01e0, 0x81e5, 0x81ef, 0x01ea, 0x81fb, 0x01fe, 0x01f4, 0x81f1,
+  0x81d3, 0x01d6, 0x01dc, 0x81d9, 0x01c8, 0x81cd, 0x81c7, 0x01c2,
+  0x0140, 0x8145, 0x814f, 0x014a, 0x815b, 0x015e, 0x0154, 0x8151,
+  0x8173, 0x0176, 0x017c, 0x8179, 0x0168, 0x816d, 0x8167, 0x0162,
+  0x8123, 0x0126, 0x012c, 0x8129, 0x0138, 0x813d, 0x8137, 0x0132,
+  0x0110, 0x8115, 0x811f, 0x011a, 0x810b, 0x010e, 0x0104, 0x8101,
+  0x8303, 0x0306, 0x030c, 0x8309, 0x0318, 0x831d, 0x8317, 0x0312,
+  0x0330, 0x8335, 0x833f, 0x033a, 0x832b, 0x032e, 0x0324, 0x8321,
+  0x0360, 0x8365, 0x836f, 0x036a, 0x837b, 0x037e, 0x0374, 0x8371,
+  0x8353, 0x0356, 0x035c, 0x8359, 0x0348, 0x834d, 0x8347, 0x0342,
+  0x03c0, 0x83c5, 0x83cf, 0x03ca, 0x83db, 0x03de, 0x03d4, 0x83d1,
+  0x83f3, 0x03f6, 0x03fc, 0x83f9, 0x03e8, 0x83ed, 0x83e7, 0x03e2,
+  0x83a3, 0x03a6, 0x03ac, 0x83a9, 0x03b8, 0x83bd, 0x83b7, 0x03b2,
+  0x0390, 0x8395, 0x839f, 0x039a, 0x838b, 0x038e, 0x0384, 0x8381,
+  0x0280, 0x8285, 0x828f, 0x028a, 0x829b, 0x029e, 0x0294, 0x8291,
+  0x82b3, 0x02b6, 0x02bc, 0x82b9, 0x02a8, 0x82ad, 0x82a7, 0x02a2,
+  0x82e3, 0x02e6, 0x02ec, 0x82e9, 0x02f8, 0x82fd, 0x82f7, 0x02f2,
+  0x02d0, 0x82d5, 0x82df, 0x02da, 0x82cb, 0x02ce, 0x02c4, 0x82c1,
+  0x8243, 0x0246, 0x024c, 0x8249, 0x0258, 0x825d, 0x8257, 0x0252,
+  0x0270, 0x8275, 0x827f, 0x027a, 0x826b, 0x026e, 0x0264, 0x8261,
+  0x0220, 0x8225, 0x822f, 0x022a, 0x823b, 0x023e, 0x0234, 0x8231,
+  0x8213, 0x0216, 0x021c, 0x8219, 0x0208, 0x820d, 0x8207, 0x0202,
+};
+
+static uint16_t crc16(uint16_t crc, const uint8_t *data, size_t length) {
+  for (size_t i = 0; i < length; i++) {
+    crc = (uint16_t)((crc << 8) ^ kCRC16Table[((crc >> 8) ^ data[i]) & 0xFF]);
+  }
+  return crc;
+}
+
+/* The CRC covers the last two header bytes and the side information */
+static bool crc_matches(const uint8_t *frame, const mp3_header_t *header) {
+  uint16_t crc = crc16(0xFFFF, frame + 2, 2);
+  crc = crc16(crc, frame + 6, header->sideInfoLength);
+  return crc == (uint16_t)((frame[4] << 8) | frame[5]);
+}
+
+/* Whether the frame holds a Xing/Info or VBRI header rather than audio */
+static bool is_info_frame(const uint8_t *frame, const mp3_header_t *header) {
+  const uint8_t *tag = frame + 4 + (header->crc ? 2 : 0) + header->sideInfoLength;
+  if (header->frameLength < 4 + 32 + 4 + 2) return false;
+  return memcmp(tag, "Xing", 4) == 0 || memcmp(tag, "Info", 4) == 0 ||
+         memcmp(frame + 4 + 32, "VBRI", 4) == 0;
+}
+
+/* Header bytes which stay the same from frame to frame: version, layer, CRC
+   flag, sample rate, free format or not, and mono or not */
+static void lock_bytes(const uint8_t *p, uint8_t bytes[3]) {
+  bytes[0] = p[1] & 0xFF;
+  bytes[1] = (p[2] & 0x0C) | ((p[2] >> 4) == 0 ? 0x01 : 0);
+  bytes[2] = (p[3] >> 6) == 3 ? 1 : 0;
+}
+
+static bool matches_lock(const uint8_t *p, const uint8_t bytes[3]) {
+  uint8_t other[3];
+  lock_bytes(p, other);
+  return memcmp(other, bytes, 3) == 0;
+}
+
+/* Finds the length of a free format frame by looking for the next header
+   with the same format. Returns 0 if more data is needed, or SIZE_MAX if
+   there's no such header within the largest possible frame */
+static size_t measure_free_format(const uint8_t *p, size_t available) {
+  size_t limit = available < kMP3MaxFrameLength + 4 ? available
+                                                    : kMP3MaxFrameLength + 4;
+  uint8_t bytes[3];
+  lock_bytes(p, bytes);
+  for (size_t j = 4 + 32; j + 4 <= limit; j++) {
+    const uint8_t *ff = memchr(p + j, 0xFF, limit - 4 - j + 1);
+    if (ff == NULL) break;
+    j = (size_t)(ff - p);
+    mp3_header_t next;
+    if (ASMP3ParseHeader(ff, &next) && matches_lock(ff, bytes)) return j;
+  }
+  return available >= kMP3MaxFrameLength + 4 ? SIZE_MAX : 0;
+}
+
+static bool is_header(const uint8_t *p) {
+  mp3_header_t header;
+  return ASMP3ParseHeader(p, &header);
+}
+
+static size_t frame_length(void *context, const uint8_t *p, size_t available,
+                           bool locked) {
+  mp3_parser_t *parser = context;
+  mp3_header_t *header = &parser->header;
+  if (!ASMP3ParseHeader(p, header)) return 0;
+
+  uint32_t length = header->frameLength;
+  if (length == 0) {
+    if (locked && parser->freeFormatLength > 0) {
+      length = parser->freeFormatLength + header->padding;
+    } else {
+      size_t measured = measure_free_format(p, available);
+      if (measured == 0) return kASFrameNeedMore;
+      if (measured == SIZE_MAX) return 0;
+      length = (uint32_t)measured;
+      parser->freeFormatLength = length - header->padding;
+    }
+  }
+  if (length < 4 + (header->crc ? 2 : 0) + header->sideInfoLength) return 0;
+  return length;
+}
+
+static void synced(void *context, const uint8_t *p, uint64_t offset) {
+  (void)p;
+  mp3_parser_t *parser = context;
+  const mp3_header_t *header = &parser->header;
+  if (!parser->formatReported ||
+      parser->format.sampleRate != header->sampleRate ||
+      parser->format.channels != header->channels ||
+      parser->format.version != header->version) {
+    ASFrameScannerFlush(parser->scanner);
+    parser->format = *header;
+    parser->formatReported = true;
+    parser->formatCallback(parser->context, header, offset);
+  }
+}
+
+static void frame(void *context, const uint8_t *p, size_t length) {
+  mp3_parser_t *parser = context;
+  const mp3_header_t *header = &parser->header;
+  if (header->crc && !crc_matches(p, header)) {
+    parser->crcErrors++;
+  } else if (parser->firstFrame && is_info_frame(p, header)) {
+    /* Header frames carry no audio */
+  } else {
+    ASFrameScannerEmit(parser->scanner, p, (uint32_t)length);
+  }
+  parser->firstFrame = false;
+}
+
+static const as_frame_codec_t kMP3Codec = {
+  .headerLength = 4,
+  .isHeader = is_header,
+  .lockBytes = lock_bytes,
+  .frameLength = frame_length,
+  .synced = synced,
+  .frame = frame
+};
+
+mp3_parser_t *ASMP3ParserCreate(mp3_format_callback formatCallback,
+                                as_packets_callback packetsCallback,
+                                void *context) {
+  mp3_parser_t *parser = calloc(1, sizeof(mp3_parser_t));
+  if (parser == NULL) return NULL;
+  parser->scanner = ASFrameScannerCreate(&kMP3Codec, parser, kCarrySize,
+                                         packetsCallback, context);
+  if (parser->scanner == NULL) {
+    free(parser);
+    return NULL;
+  }
+  parser->formatCallback = formatCallback;
+  parser->context = context;
+  ASMP3ParserReset(parser);
+  return parser;
+}
+
+void ASMP3ParserDestroy(mp3_parser_t *parser) {
+  if (parser == NULL) return;
+  ASFrameScannerDestroy(parser->scanner);
+  free(parser);
+}
+
+void ASMP3ParserReset(mp3_parser_t *parser) {
+  ASFrameScannerReset(parser->scanner);
+  parser->formatReported = false;
+  parser->firstFrame = true;
+  parser->freeFormatLength = 0;
+}
+
+void ASMP3ParserGetStats(const mp3_parser_t *parser, mp3_stats_t *stats) {
+  as_frame_stats_t frames;
+  ASFrameScannerGetStats(parser->scanner, &frames);
+  stats->frames = frames.packets;
+  stats->crcErrors = parser->crcErrors;
+  stats->skippedBytes = frames.skippedBytes;
+  stats->syncLosses = frames.syncLosses;
+}
+
+void ASMP3ParserParse(mp3_parser_t *parser, const uint8_t *bytes, size_t length) {
+  ASFrameScannerParse(parser->scanner, bytes, length);
+}
@@ -0,0 +1,81 @@
+//
+//  ASMP3Parser.h
+//  AudioStreamer
+//
+
+#ifndef AS_MP3_PARSER_H
+#define AS_MP3_PARSER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ASPacketDesc.h"
+
+/*
+ * MPEG-1/2/2.5 Layer III frame scanner.
+ *
+ * Splits a stream of MP3 data into frames without the help of
+ * AudioFileStream. Bytes can be fed in chunks of any size; complete frames are
+ * handed back a run at a time, pointing straight into the caller's buffer
+ * whenever possible. Only a frame split across two chunks is copied.
+ *
+ * Before the scanner trusts a frame header it must be followed by another
+ * header of the same format, which rejects the false sync words that turn up
+ * inside ID3 tags and audio data. Frames whose CRC doesn't match are dropped,
+ * as are Xing/Info/VBRI header frames (which hold no audio). Free format
+ * streams are handled by measuring the distance between the first two frames.
+ * ID3v2 tags anywhere in the stream are skipped.
+ */
+
+typedef struct mp3_parser mp3_parser_t;
+
+typedef struct mp3_header {
+  uint8_t  version;         /* 1, 2, or 25 for MPEG 2.5 */
+  uint8_t  channels;
+  bool     crc;             /* a CRC follows the header */
+  bool     padding;
+  uint32_t bitrate;         /* bits per second, 0 for free format */
+  uint32_t sampleRate;
+  uint32_t samplesPerFrame;
+  uint32_t frameLength;     /* bytes including the header, 0 if free format */
+  size_t   sideInfoLength;
+} mp3_header_t;
+
+typedef struct mp3_stats {
+  uint64_t frames;          /* frames handed back */
+  uint64_t crcErrors;       /* frames dropped for a bad CRC */
+  uint64_t skippedBytes;    /* bytes discarded while looking for sync */
+  uint64_t syncLosses;      /* times the expected next frame wasn't there */
+} mp3_stats_t;
+
+/* Invoked when the first frame is found, and again if the format changes.
+   offset is where that frame starts, counted from the first byte fed since
+   the parser was created or reset */
+typedef void (*mp3_format_callback)(void *context, const mp3_header_t *format,
+                                    uint64_t offset);
+
+/* Largest frame the scanner accepts (free format at 640 kbit/s) */
+#define kMP3MaxFrameLength 2881
+
+/* Decodes the four byte header at p. Returns false if it isn't a valid
+   Layer III header */
+bool ASMP3ParseHeader(const uint8_t *p, mp3_header_t *header);
+
+/* Creates a parser. Returns NULL if allocation fails */
+mp3_parser_t *ASMP3ParserCreate(mp3_format_callback formatCallback,
+                                as_packets_callback packetsCallback,
+                                void *context);
+
+void ASMP3ParserDestroy(mp3_parser_t *parser);
+
+/* Forgets any partial frame and the current sync, for example after a seek.
+   The format is reported again with the next frame */
+void ASMP3ParserReset(mp3_parser_t *parser);
+
+/* Scans the next chunk of data, invoking the callbacks as frames are found */
+void ASMP3ParserParse(mp3_parser_t *parser, const uint8_t *bytes, size_t length);
+
+void ASMP3ParserGetStats(const mp3_parser_t *parser, mp3_stats_t *stats);
+
+#endif
@@ -0,0 +1,264 @@
+//
+//  ASMP4Info.c
+//  AudioStreamer
+//
+
+#include "ASMP4Info.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* moov/trak/mdia/minf/stbl is as deep as it goes */
+#define kMaxDepth 8
+/* The most of a box's payload that's ever needed at once (a version 1 mdhd) */
+#define kFieldsSize 32
+
+#define BOX(a, b, c, d) \
+  (((uint32_t)(a) << 24) | ((uint32_t)(b) << 16) | ((uint32_t)(c) << 8) | (uint32_t)(d))
+
+typedef enum scan_state {
+  SCAN_HEADER,              /* reading a box header */
+  SCAN_FIELDS,              /* reading the start of a box's payload */
+  SCAN_ENTRIES,             /* reading stts entries */
+  SCAN_SKIP,                /* skipping to the end of a box */
+  SCAN_DONE
+} scan_state_t;
+
+struct mp4_info {
+  scan_state_t state;
+  uint64_t offset;          /* of the next byte expected */
+  uint8_t  bytes[kFieldsSize];
+  size_t   have;            /* bytes read into the buffer */
+  size_t   need;            /* bytes wanted in the buffer */
+
+  uint32_t type;            /* of the box being read */
+  uint64_t boxEnd;
+  uint64_t ends[kMaxDepth]; /* of the containers the box is in */
+  int      depth;
+  uint32_t entriesLeft;     /* in the stts */
+
+  /* The trak being read */
+  bool     sound;
+  uint32_t timescale;
+  uint64_t duration;
+  uint64_t packetCount;
+
+  bool             found;   /* of the first sound trak */
+  mp4_track_info_t track;
+};
+
+static uint32_t read32(const uint8_t *p) {
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+         ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static uint64_t read64(const uint8_t *p) {
+  return ((uint64_t)read32(p) << 32) | read32(p + 4);
+}
+
+mp4_info_t *ASMP4InfoCreate(void) {
+  mp4_info_t *info = calloc(1, sizeof(mp4_info_t));
+  if (info == NULL) return NULL;
+  info->need = 8;
+  return info;
+}
+
+void ASMP4InfoDestroy(mp4_info_t *info) {
+  free(info);
+}
+
+/* Leaves the containers which end here */
+static void close_containers(mp4_info_t *info) {
+  while (info->depth > 0 && info->offset >= info->ends[info->depth - 1]) {
+    info->depth--;
+    /* The trak just left, if it's the first with sound, is the one */
+    if (info->depth == 1 && !info->found && info->sound && info->timescale > 0) {
+      info->found = true;
+      info->track.timescale = info->timescale;
+      info->track.duration = info->duration;
+      info->track.packetCount = info->packetCount;
+    }
+  }
+}
+
+static void next_box(mp4_info_t *info) {
+  close_containers(info);
+  info->state = SCAN_HEADER;
+  info->have = 0;
+  info->need = 8;
+}
+
+static void read_fields(mp4_info_t *info, size_t need) {
+  info->state = SCAN_FIELDS;
+  info->have = 0;
+  info->need = need;
+}
+
+static void skip_box(mp4_info_t *info) {
+  if (info->offset < info->boxEnd) {
+    info->state = SCAN_SKIP;
+  } else {
+    next_box(info);
+  }
+}
+
+/* Works out what to do with the box whose header was just read */
+static void handle_header(mp4_info_t *info) {
+  const uint8_t *p = info->bytes;
+  uint64_t start = info->offset - info->have;
+  uint64_t size = read32(p);
+  info->type = read32(p + 4);
+  if (size == 1) {
+    if (info->have < 16) {
+      info->need = 16;
+      return;
+    }
+    size = read64(p + 8);
+  }
+  /* A box running to the end of the file is only allowed to be the mdat */
+  bool toEnd = size == 0;
+  if (toEnd) size = UINT64_MAX - start;
+
+  if (start == 0 && info->type != BOX('f', 't', 'y', 'p')) {
+    info->state = SCAN_DONE;
+    return;
+  }
+  if (size < info->have ||
+      (info->depth > 0 && start + size > info->ends[info->depth - 1])) {
+    info->state = SCAN_DONE;
+    return;
+  }
+  info->boxEnd = start + size;
+  uint64_t payload = size - info->have;
+
+  switch (info->type) {
+    case BOX('m', 'o', 'o', 'v'):
+    case BOX('t', 'r', 'a', 'k'):
+    case BOX('m', 'd', 'i', 'a'):
+    case BOX('m', 'i', 'n', 'f'):
+    case BOX('s', 't', 'b', 'l'):
+      if (toEnd || info->depth == kMaxDepth) {
+        info->state = SCAN_DONE;
+        return;
+      }
+      if (info->type == BOX('t', 'r', 'a', 'k')) {
+        info->sound = false;
+        info->timescale = 0;
+        info->duration = 0;
+        info->packetCount = 0;
+      }
+      info->ends[info->depth++] = info->boxEnd;
+      next_box(info);
+      return;
+
+    case BOX('m', 'd', 'h', 'd'):
+      read_fields(info, payload < kFieldsSize ? (size_t) payload : kFieldsSize);
+      return;
+    case BOX('h', 'd', 'l', 'r'):
+      read_fields(info, payload < 12 ? (size_t) payload : 12);
+      return;
+    case BOX('s', 't', 't', 's'):
+      read_fields(info, payload < 8 ? (size_t) payload : 8);
+      return;
+
+    case BOX('m', 'd', 'a', 't'):
+      /* Only after the moov is the mdat's size of any use, and there's
+         nothing more to read either way */
+      if (info->found && !toEnd) info->track.mediaBytes = payload;
+      info->state = SCAN_DONE;
+      return;
+
+    default:
+      skip_box(info);
+      return;
+  }
+}
+
+/* Takes what's needed from the start of a box's payload */
+static void handle_fields(mp4_info_t *info) {
+  const uint8_t *p = info->bytes;
+  size_t have = info->have;
+  switch (info->type) {
+    case BOX('m', 'd', 'h', 'd'):
+      if (have >= 32 && p[0] == 1) {
+        info->timescale = read32(p + 20);
+        info->duration = read64(p + 24);
+        if (info->duration == UINT64_MAX) info->timescale = 0;
+      } else if (have >= 20 && p[0] == 0) {
+        info->timescale = read32(p + 12);
+        info->duration = read32(p + 16);
+        if (info->duration == UINT32_MAX) info->timescale = 0;
+      }
+      break;
+    case BOX('h', 'd', 'l', 'r'):
+      info->sound = have >= 12 && read32(p + 8) == BOX('s', 'o', 'u', 'n');
+      break;
+    case BOX('s', 't', 't', 's'):
+      if (have < 8) break;
+      info->entriesLeft = read32(p + 4);
+      if (info->entriesLeft > (info->boxEnd - info->offset) / 8) {
+        info->state = SCAN_DONE;
+        return;
+      }
+      if (info->entriesLeft > 0) {
+        info->state = SCAN_ENTRIES;
+        info->have = 0;
+        info->need = 8;
+        return;
+      }
+      break;
+  }
+  skip_box(info);
+}
+
+bool ASMP4InfoScan(mp4_info_t *info, uint64_t fileOffset, const uint8_t *bytes,
+                   size_t length) {
+  if (info->state == SCAN_DONE) return true;
+  if (fileOffset != info->offset) {
+    info->state = SCAN_DONE;
+    return true;
+  }
+  while (length > 0 && info->state != SCAN_DONE) {
+    if (info->state == SCAN_SKIP) {
+      uint64_t skip = info->boxEnd - info->offset;
+      if (skip > length) skip = length;
+      bytes += skip;
+      length -= (size_t) skip;
+      info->offset += skip;
+      if (info->offset == info->boxEnd) next_box(info);
+      continue;
+    }
+
+    size_t count = info->need - info->have;
+    if (count > length) count = length;
+    memcpy(info->bytes + info->have, bytes, count);
+    info->have += count;
+    info->offset += count;
+    bytes += count;
+    length -= count;
+    if (info->have < info->need) break;
+
+    switch (info->state) {
+      case SCAN_HEADER:
+        handle_header(info);
+        break;
+      case SCAN_FIELDS:
+        handle_fields(info);
+        break;
+      case SCAN_ENTRIES:
+        info->packetCount += read32(info->bytes);
+        info->have = 0;
+        if (--info->entriesLeft == 0) skip_box(info);
+        break;
+      default:
+        break;
+    }
+  }
+  return info->state == SCAN_DONE;
+}
+
+bool ASMP4InfoTrack(const mp4_info_t *info, mp4_track_info_t *track) {
+  if (!info->found) return false;
+  *track = info->track;
+  return true;
+}
@@ -0,0 +1,56 @@
+//
+//  ASMP4Info.h
+//  AudioStreamer
+//
+
+#ifndef AS_MP4_INFO_H
+#define AS_MP4_INFO_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Duration and size of the audio in an MP4/M4A file, read from its boxes as
+ * the start of the file goes by.
+ *
+ * The boxes are walked as a stream, so nothing but a few bytes of the box
+ * being read is ever kept. Of the first sound track in the moov box, the
+ * media header (mdhd) gives the exact duration and the time-to-sample table
+ * (stts) the number of packets. The size of the mdat box following the moov
+ * gives the number of bytes of audio, and with it the exact average bitrate
+ * of a file holding nothing else.
+ *
+ * Only files whose moov comes before their mdat (prepared for streaming) can
+ * be read this way; for others, and anything which isn't an MP4 file at all,
+ * the scan gives up as soon as it can tell.
+ *
+ * This is plain C without any CoreFoundation dependency.
+ */
+
+typedef struct mp4_info mp4_info_t;
+
+typedef struct mp4_track_info {
+  uint32_t timescale;       /* units per second of the duration */
+  uint64_t duration;        /* in timescale units */
+  uint64_t packetCount;     /* samples in the stts, 0 if there was none */
+  uint64_t mediaBytes;      /* payload of the mdat, 0 until it's been seen */
+} mp4_track_info_t;
+
+/* Returns NULL if allocation fails */
+mp4_info_t *ASMP4InfoCreate(void);
+
+void ASMP4InfoDestroy(mp4_info_t *info);
+
+/* Feeds raw bytes of the file starting at the given file offset, which must
+   carry on from the last bytes fed (the first from offset 0). Bytes from
+   anywhere else end the scan. Returns true once no more bytes are needed,
+   whether or not the track was found */
+bool ASMP4InfoScan(mp4_info_t *info, uint64_t fileOffset, const uint8_t *bytes,
+                   size_t length);
+
+/* Gives what was found of the sound track. Returns false if its duration
+   isn't known (yet) */
+bool ASMP4InfoTrack(const mp4_info_t *info, mp4_track_info_t *track);
+
+#endif
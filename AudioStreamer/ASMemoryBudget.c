@@ -0,0 +1,53 @@
+//
+//  ASMemoryBudget.c
+//  AudioStreamer
+//
+
+#include "ASMemoryBudget.h"
+
+/* Smallest packet the descriptions of a VBR buffer are sized for, and how many
+   times smaller than the first packets ones may be */
+#define kMinPacketSize 32
+#define kPacketSizeSpread 4
+
+void ASMemoryBudgetFit(const memory_budget_t *budget, buffer_layout_t *layout) {
+  layout->bufferCount = budget->bufferCount;
+  layout->bufferSize = budget->bufferSize;
+  layout->descsPerBuffer = 0;
+  layout->readAheadLimit = SIZE_MAX;
+  if (budget->vbr) {
+    uint32_t smallest = budget->typicalPacketSize / kPacketSizeSpread;
+    if (smallest < kMinPacketSize) smallest = kMinPacketSize;
+    uint32_t descs = budget->bufferSize / smallest;
+    if (descs < 1) descs = 1;
+    layout->descsPerBuffer = descs < budget->maxDescs ? descs : budget->maxDescs;
+  }
+  if (budget->budget == 0) return;
+
+  /* Half for the buffers, the rest for reading ahead */
+  size_t share = budget->budget / 2;
+  if (!budget->vbr && share / kMinBudgetBuffers < layout->bufferSize) {
+    size_t size = share / kMinBudgetBuffers;
+    layout->bufferSize = size > kMinBudgetBufferSize ? (uint32_t)size
+                                                     : kMinBudgetBufferSize;
+    /* Buffers have to hold whole frames, and still be at least the least */
+    uint32_t bytesPerPacket = budget->bytesPerPacket;
+    if (bytesPerPacket > 0) {
+      layout->bufferSize -= layout->bufferSize % bytesPerPacket;
+      if (layout->bufferSize < kMinBudgetBufferSize) {
+        layout->bufferSize += bytesPerPacket;
+      }
+    }
+  }
+
+  size_t perBuffer = layout->bufferSize + budget->bufferOverhead +
+                     layout->descsPerBuffer * budget->descSize;
+  size_t fewest = budget->bufferCount < kMinBudgetBuffers ? budget->bufferCount
+                                                          : kMinBudgetBuffers;
+  size_t count = share / perBuffer;
+  if (count > budget->bufferCount) count = budget->bufferCount;
+  if (count < fewest) count = fewest;
+  layout->bufferCount = (uint32_t)count;
+  size_t used = count * perBuffer;
+  layout->readAheadLimit = budget->budget > used ? budget->budget - used : 0;
+}
@@ -0,0 +1,54 @@
+//
+//  ASMemoryBudget.h
+//  AudioStreamer
+//
+
+#ifndef AS_MEMORY_BUDGET_H
+#define AS_MEMORY_BUDGET_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Lays out the audio queue buffers of a stream, and how much audio may be
+ * read ahead of them.
+ *
+ * VBR buffers get packet descriptions for packets a few times smaller than
+ * the first ones; a buffer of packets smaller still is handed to the audio
+ * queue before it's full. CBR buffers need none.
+ *
+ * Given a budget, half of it goes to the buffers and their descriptions,
+ * which sets how many buffers there are, down to a few. CBR buffers are also
+ * made smaller to fit, down to 1 KB of whole frames. Whatever the buffers
+ * leave over is what may be read ahead.
+ *
+ * This is plain C without any CoreFoundation dependency.
+ */
+
+/* Fewest buffers, and smallest CBR buffer, a budget cuts down to */
+#define kMinBudgetBuffers 4
+#define kMinBudgetBufferSize 1024
+
+typedef struct memory_budget {
+  size_t   budget;              /* bytes, or 0 for no limit */
+  uint32_t bufferCount;         /* buffers wanted */
+  uint32_t bufferSize;          /* bytes of audio in each */
+  bool     vbr;
+  uint32_t typicalPacketSize;   /* average of the first packets, or 0 */
+  uint32_t bytesPerPacket;      /* of CBR audio, or 0 if not known */
+  uint32_t maxDescs;            /* most descriptions a buffer may have */
+  size_t   descSize;            /* bytes of each description */
+  size_t   bufferOverhead;      /* bytes each buffer takes besides those */
+} memory_budget_t;
+
+typedef struct buffer_layout {
+  uint32_t bufferCount;
+  uint32_t bufferSize;
+  uint32_t descsPerBuffer;      /* 0 for CBR */
+  size_t   readAheadLimit;      /* bytes, SIZE_MAX without a budget */
+} buffer_layout_t;
+
+void ASMemoryBudgetFit(const memory_budget_t *budget, buffer_layout_t *layout);
+
+#endif
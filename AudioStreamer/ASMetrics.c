@@ -0,0 +1,116 @@
+//
+//  ASMetrics.c
+//  AudioStreamer
+//
+
+#include "ASMetrics.h"
+
+#include <stdlib.h>
+
+static const double binLimits[kMetricsBufferBins - 1] = kMetricsBufferBinLimits;
+
+struct stream_metrics {
+  double   started;
+  double   firstByte;           /* < 0 until there is one */
+  double   firstAudio;
+  unsigned rebuffers;
+  double   stallTime;
+  double   stallStart;          /* < 0 unless stalled */
+  bool     stopped;
+  double   histogram[kMetricsBufferBins];
+  int      level;               /* bin of the level reported last, < 0 if not
+                                   playing then */
+  double   levelSince;
+  uint64_t bytesDownloaded;
+  uint64_t bytesWasted;
+  unsigned reconnects;
+};
+
+stream_metrics_t *ASMetricsCreate(double now) {
+  stream_metrics_t *metrics = calloc(1, sizeof(stream_metrics_t));
+  if (metrics == NULL) return NULL;
+  metrics->started = now;
+  metrics->firstByte = -1;
+  metrics->firstAudio = -1;
+  metrics->stallStart = -1;
+  metrics->level = -1;
+  return metrics;
+}
+
+void ASMetricsDestroy(stream_metrics_t *metrics) {
+  free(metrics);
+}
+
+void ASMetricsAddBytes(stream_metrics_t *metrics, uint64_t bytes, double now) {
+  if (metrics->firstByte < 0 && bytes > 0) metrics->firstByte = now;
+  metrics->bytesDownloaded += bytes;
+}
+
+void ASMetricsAddWasted(stream_metrics_t *metrics, uint64_t bytes) {
+  metrics->bytesWasted += bytes;
+}
+
+void ASMetricsReconnected(stream_metrics_t *metrics) {
+  metrics->reconnects++;
+}
+
+static int bin_for(double seconds) {
+  int bin = 0;
+  while (bin < kMetricsBufferBins - 1 && seconds >= binLimits[bin]) bin++;
+  return bin;
+}
+
+void ASMetricsBufferLevel(stream_metrics_t *metrics, double seconds,
+                          bool playing, double now) {
+  if (metrics->stopped) return;
+  if (metrics->level >= 0 && now > metrics->levelSince) {
+    metrics->histogram[metrics->level] += now - metrics->levelSince;
+  }
+  metrics->level = playing ? bin_for(seconds) : -1;
+  metrics->levelSince = now;
+}
+
+static void end_stall(stream_metrics_t *metrics, double now) {
+  if (metrics->stallStart < 0) return;
+  metrics->stallTime += now - metrics->stallStart;
+  metrics->stallStart = -1;
+}
+
+void ASMetricsPlaying(stream_metrics_t *metrics, double now) {
+  if (metrics->stopped) return;
+  if (metrics->firstAudio < 0) metrics->firstAudio = now;
+  end_stall(metrics, now);
+}
+
+void ASMetricsStalled(stream_metrics_t *metrics, double now) {
+  if (metrics->stopped || metrics->stallStart >= 0) return;
+  metrics->rebuffers++;
+  metrics->stallStart = now;
+}
+
+void ASMetricsStopped(stream_metrics_t *metrics, double now) {
+  if (metrics->stopped) return;
+  ASMetricsBufferLevel(metrics, 0, false, now);
+  end_stall(metrics, now);
+  metrics->stopped = true;
+}
+
+void ASMetricsGetSnapshot(const stream_metrics_t *metrics, double now,
+                          metrics_snapshot_t *snapshot) {
+  snapshot->timeToFirstByte = metrics->firstByte >= 0 ?
+    metrics->firstByte - metrics->started : -1;
+  snapshot->timeToFirstAudio = metrics->firstAudio >= 0 ?
+    metrics->firstAudio - metrics->started : -1;
+  snapshot->rebuffers = metrics->rebuffers;
+  snapshot->stallTime = metrics->stallTime;
+  if (metrics->stallStart >= 0) snapshot->stallTime += now - metrics->stallStart;
+  for (int i = 0; i < kMetricsBufferBins; i++) {
+    snapshot->bufferHistogram[i] = metrics->histogram[i];
+  }
+  if (metrics->level >= 0 && now > metrics->levelSince) {
+    snapshot->bufferHistogram[metrics->level] += now - metrics->levelSince;
+  }
+  snapshot->bytesDownloaded = metrics->bytesDownloaded;
+  snapshot->bytesWasted = metrics->bytesWasted;
+  snapshot->reconnects = metrics->reconnects;
+}
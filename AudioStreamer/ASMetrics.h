@@ -0,0 +1,73 @@
+//
+//  ASMetrics.h
+//  AudioStreamer
+//
+
+#ifndef AS_METRICS_H
+#define AS_METRICS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Keeps the quality-of-service measurements of one stream.
+ *
+ * The streamer reports what happens as it happens, with the time (in seconds,
+ * from any fixed point) it happened at: its start, the first byte of audio
+ * data, playback starting, running out of audio and so on. Time spent playing
+ * is split up by how much audio was buffered at the time, which gives a
+ * histogram of buffer occupancy. The level reported last is taken to hold
+ * until the next report, so reports should come whenever it changes much,
+ * and at least whenever playback starts or stops.
+ *
+ * This is plain C without any CoreFoundation dependency.
+ */
+
+/* Seconds buffered up to which each bin of the histogram goes; the last bin
+   has everything above the last of these */
+#define kMetricsBufferBins 8
+#define kMetricsBufferBinLimits {0.5, 1, 2, 4, 8, 16, 32}
+
+typedef struct stream_metrics stream_metrics_t;
+
+typedef struct metrics_snapshot {
+  double   timeToFirstByte;     /* seconds, or -1 if there hasn't been one */
+  double   timeToFirstAudio;    /* seconds, or -1 if playback hasn't started */
+  unsigned rebuffers;
+  double   stallTime;           /* seconds, including a stall going on now */
+  double   bufferHistogram[kMetricsBufferBins]; /* seconds spent playing */
+  uint64_t bytesDownloaded;
+  uint64_t bytesWasted;
+  unsigned reconnects;
+} metrics_snapshot_t;
+
+/* Starts measuring from the given time. Returns NULL if allocation fails */
+stream_metrics_t *ASMetricsCreate(double now);
+
+void ASMetricsDestroy(stream_metrics_t *metrics);
+
+/* Records bytes read from the network. The first of them is the first byte */
+void ASMetricsAddBytes(stream_metrics_t *metrics, uint64_t bytes, double now);
+
+/* Records bytes which were downloaded but thrown away before being played */
+void ASMetricsAddWasted(stream_metrics_t *metrics, uint64_t bytes);
+
+void ASMetricsReconnected(stream_metrics_t *metrics);
+
+/* Records how much audio is buffered, and whether it's playing */
+void ASMetricsBufferLevel(stream_metrics_t *metrics, double seconds,
+                          bool playing, double now);
+
+/* Playback started: the first audio, or the end of a stall */
+void ASMetricsPlaying(stream_metrics_t *metrics, double now);
+
+/* Playback ran out of audio */
+void ASMetricsStalled(stream_metrics_t *metrics, double now);
+
+/* The stream is finished with, which ends any stall */
+void ASMetricsStopped(stream_metrics_t *metrics, double now);
+
+void ASMetricsGetSnapshot(const stream_metrics_t *metrics, double now,
+                          metrics_snapshot_t *snapshot);
+
+#endif
@@ -0,0 +1,445 @@
+//
+//  ASNetworkSimulator.c
+//  AudioStreamer
+//
+
+#include "ASNetworkSimulator.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Bytes in each packet, as for TCP over Ethernet */
+#define kPacketSize 1460
+/* Bytes a transport can have sent to it but not yet read */
+#define kReceiveWindow (256 * 1024)
+#define kWindowPackets (kReceiveWindow / kPacketSize + 1)
+
+typedef struct sim_transport sim_transport_t;
+
+typedef enum {
+  SIM_CHANGE_BANDWIDTH,
+  SIM_CHANGE_DISCONNECT,
+} sim_change_kind_t;
+
+typedef struct sim_change {
+  double time;
+  sim_change_kind_t kind;
+  double bandwidth;
+} sim_change_t;
+
+struct network_simulator {
+  double       now;
+  uint32_t     random;
+  sim_link_t   link;
+  sim_change_t *changes;        /* in time order */
+  size_t       changeCount;
+  size_t       changeCapacity;
+  size_t       nextChange;
+  sim_transport_t *transports;
+};
+
+struct sim_transport {
+  transport_t  transport;       /* must be first */
+  network_simulator_t *sim;
+  sim_transport_t *next;
+
+  const uint8_t *body;
+  size_t       length;
+  int          status;
+  char       **headerNames;
+  char       **headerValues;
+  size_t       headerCount;
+  double       openTime;
+  double       sourceRate;      /* 0 for a file */
+  size_t       burst;
+
+  size_t       sent;            /* bytes put on the link */
+  size_t       arrived;
+  size_t       consumed;
+  bool         sending;         /* is a packet on its way out? */
+  double       remaining;       /* bytes of it still to send, as of sendTime */
+  double       sendTime;
+  double       rate;            /* its share of the bandwidth */
+  double       sendDone;        /* when it will have been sent */
+  /* Arrival times of the packets in flight, oldest first */
+  double       flight[kWindowPackets];
+  size_t       flightHead;
+  size_t       flightCount;
+  double       lastArrival;
+
+  char        *error;
+  bool         due;             /* is there an event to send? */
+  bool         endSent;
+  bool         errorSent;
+};
+
+/* Uniform in [0, 1), from a xorshift generator */
+static double sim_random(network_simulator_t *sim) {
+  uint32_t x = sim->random;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  sim->random = x;
+  return (double)x / 4294967296.0;
+}
+
+/* When a live source will have made the next packet */
+static double sim_source_ready(const sim_transport_t *t) {
+  size_t size = t->length - t->sent;
+  if (size > kPacketSize) size = kPacketSize;
+  if (t->sourceRate <= 0 || t->sent + size <= t->burst) return -INFINITY;
+  return t->openTime + (double)(t->sent + size - t->burst) / t->sourceRate;
+}
+
+/* Whether the next packet could go but for the source */
+static bool sim_window_open(sim_transport_t *t) {
+  return t->error == NULL && t->sent < t->length &&
+         t->sent - t->consumed < kReceiveWindow;
+}
+
+static bool sim_can_send(sim_transport_t *t) {
+  return sim_window_open(t) && sim_source_ready(t) <= t->sim->now;
+}
+
+/* Puts the next packet of every transport which can send on the link, and
+   shares the bandwidth out evenly again among those sending */
+static void sim_reshare(network_simulator_t *sim) {
+  unsigned senders = 0;
+  for (sim_transport_t *t = sim->transports; t != NULL; t = t->next) {
+    if (t->sending) {
+      t->remaining -= (sim->now - t->sendTime) * t->rate;
+      if (t->remaining < 0) t->remaining = 0;
+    } else if (sim_can_send(t)) {
+      size_t size = t->length - t->sent;
+      t->remaining = size > kPacketSize ? kPacketSize : size;
+      t->sending = true;
+    } else {
+      continue;
+    }
+    t->sendTime = sim->now;
+    senders++;
+  }
+  if (senders == 0) return;
+  double rate = sim->link.bandwidth / senders;
+  for (sim_transport_t *t = sim->transports; t != NULL; t = t->next) {
+    if (!t->sending) continue;
+    t->rate = rate > 0 ? rate : 0;
+    t->sendDone = rate > 0 ? sim->now + t->remaining / rate : INFINITY;
+  }
+}
+
+static void sim_packet_sent(sim_transport_t *t) {
+  network_simulator_t *sim = t->sim;
+  size_t size = t->length - t->sent;
+  if (size > kPacketSize) size = kPacketSize;
+  t->sent += size;
+  t->sending = false;
+
+  /* Packets can be held up but not reordered */
+  double arrival = t->sendDone + sim->link.latency +
+                   sim->link.jitter * sim_random(sim);
+  if (arrival < t->lastArrival) arrival = t->lastArrival;
+  t->lastArrival = arrival;
+  t->flight[(t->flightHead + t->flightCount) % kWindowPackets] = arrival;
+  t->flightCount++;
+  sim_reshare(sim);
+}
+
+static void sim_packet_arrived(sim_transport_t *t) {
+  t->flightHead = (t->flightHead + 1) % kWindowPackets;
+  t->flightCount--;
+  t->arrived += kPacketSize;
+  if (t->arrived > t->sent) t->arrived = t->sent;
+  t->due = true;
+}
+
+static void sim_fail(sim_transport_t *t, const char *error) {
+  if (t->error != NULL || t->arrived == t->length) return;
+  t->error = strdup(error);
+  /* What has already arrived can still be read */
+  t->sending = false;
+  t->flightCount = 0;
+  t->sent = t->arrived;
+  t->due = true;
+}
+
+/* Sends every event which is due, to transports which aren't paused */
+static void sim_flush(network_simulator_t *sim) {
+  bool sent;
+  do {
+    sent = false;
+    for (sim_transport_t *t = sim->transports; t != NULL; t = t->next) {
+      if (!t->due || t->transport.paused) continue;
+      t->due = false;
+      transport_event_t event;
+      if (t->arrived > t->consumed) {
+        event = TRANSPORT_EVENT_READABLE;
+      } else if (t->error != NULL) {
+        if (t->errorSent) continue;
+        t->errorSent = true;
+        event = TRANSPORT_EVENT_ERROR;
+      } else if (t->consumed == t->length) {
+        if (t->endSent) continue;
+        t->endSent = true;
+        event = TRANSPORT_EVENT_END;
+      } else {
+        continue;
+      }
+      /* The reader may open or close transports, so start over after */
+      ASTransportNotify(&t->transport, event);
+      sent = true;
+      break;
+    }
+  } while (sent);
+}
+
+/* Transport */
+
+static ssize_t sim_read(transport_t *transport, void *buffer, size_t length) {
+  sim_transport_t *t = (sim_transport_t*) transport;
+  size_t available = t->arrived - t->consumed;
+  if (available == 0) return t->error != NULL ? -1 : 0;
+  if (length > available) length = available;
+  memcpy(buffer, t->body + t->consumed, length);
+  t->consumed += length;
+  if (!t->sending && sim_can_send(t)) sim_reshare(t->sim);
+  if (t->consumed == t->length || t->arrived == t->consumed) t->due = true;
+  return (ssize_t) length;
+}
+
+static bool sim_has_bytes_available(transport_t *transport) {
+  sim_transport_t *t = (sim_transport_t*) transport;
+  return t->arrived > t->consumed;
+}
+
+static bool sim_at_end(transport_t *transport) {
+  sim_transport_t *t = (sim_transport_t*) transport;
+  return t->consumed == t->length;
+}
+
+static void sim_set_paused(transport_t *transport, bool paused) {
+  sim_transport_t *t = (sim_transport_t*) transport;
+  /* Anything which came in meanwhile is sent on the next advance */
+  if (!paused) t->due = true;
+}
+
+static int sim_status_code(transport_t *transport) {
+  return ((sim_transport_t*) transport)->status;
+}
+
+static size_t sim_header_count(transport_t *transport) {
+  return ((sim_transport_t*) transport)->headerCount;
+}
+
+static bool sim_header(transport_t *transport, size_t index, const char **name,
+                       const char **value) {
+  sim_transport_t *t = (sim_transport_t*) transport;
+  if (index >= t->headerCount) return false;
+  *name = t->headerNames[index];
+  *value = t->headerValues[index];
+  return true;
+}
+
+static const char *sim_error(transport_t *transport) {
+  return ((sim_transport_t*) transport)->error;
+}
+
+static void sim_free(sim_transport_t *t) {
+  for (size_t i = 0; i < t->headerCount; i++) {
+    free(t->headerNames[i]);
+    free(t->headerValues[i]);
+  }
+  free(t->headerNames);
+  free(t->headerValues);
+  free(t->error);
+  free(t);
+}
+
+static void sim_close(transport_t *transport) {
+  sim_transport_t *t = (sim_transport_t*) transport;
+  network_simulator_t *sim = t->sim;
+  for (sim_transport_t **p = &sim->transports; *p != NULL; p = &(*p)->next) {
+    if (*p == t) {
+      *p = t->next;
+      break;
+    }
+  }
+  bool wasSending = t->sending;
+  sim_free(t);
+  if (wasSending) sim_reshare(sim);
+}
+
+static const transport_ops_t sim_ops = {
+  .read = sim_read,
+  .hasBytesAvailable = sim_has_bytes_available,
+  .atEnd = sim_at_end,
+  .setPaused = sim_set_paused,
+  .statusCode = sim_status_code,
+  .headerCount = sim_header_count,
+  .header = sim_header,
+  .error = sim_error,
+  .close = sim_close,
+};
+
+/* Simulator */
+
+network_simulator_t *ASNetworkSimulatorCreate(const sim_link_t *link,
+                                              uint32_t seed) {
+  network_simulator_t *sim = calloc(1, sizeof(network_simulator_t));
+  if (sim == NULL) return NULL;
+  sim->link = *link;
+  /* xorshift never leaves 0 */
+  sim->random = seed != 0 ? seed : 0x9e3779b9;
+  return sim;
+}
+
+void ASNetworkSimulatorDestroy(network_simulator_t *sim) {
+  if (sim == NULL) return;
+  free(sim->changes);
+  free(sim);
+}
+
+static bool sim_schedule(network_simulator_t *sim, const sim_change_t *change) {
+  if (sim->changeCount == sim->changeCapacity) {
+    size_t capacity = sim->changeCapacity > 0 ? sim->changeCapacity * 2 : 8;
+    sim_change_t *changes = realloc(sim->changes,
+                                    capacity * sizeof(sim_change_t));
+    if (changes == NULL) return false;
+    sim->changes = changes;
+    sim->changeCapacity = capacity;
+  }
+  /* After any others at the same time, so they happen in the order given */
+  size_t i = sim->changeCount;
+  while (i > sim->nextChange && sim->changes[i - 1].time > change->time) {
+    sim->changes[i] = sim->changes[i - 1];
+    i--;
+  }
+  sim->changes[i] = *change;
+  sim->changeCount++;
+  return true;
+}
+
+bool ASNetworkSimulatorScheduleBandwidth(network_simulator_t *sim, double time,
+                                         double bandwidth) {
+  sim_change_t change = {
+    .time = time < sim->now ? sim->now : time,
+    .kind = SIM_CHANGE_BANDWIDTH,
+    .bandwidth = bandwidth,
+  };
+  return sim_schedule(sim, &change);
+}
+
+bool ASNetworkSimulatorScheduleDisconnect(network_simulator_t *sim,
+                                          double time) {
+  sim_change_t change = {
+    .time = time < sim->now ? sim->now : time,
+    .kind = SIM_CHANGE_DISCONNECT,
+  };
+  return sim_schedule(sim, &change);
+}
+
+transport_t *ASNetworkSimulatorOpen(network_simulator_t *sim,
+                                    const sim_response_t *response,
+                                    transport_event_proc proc, void *context) {
+  sim_transport_t *t = calloc(1, sizeof(sim_transport_t));
+  if (t == NULL) return NULL;
+  ASTransportInit(&t->transport, &sim_ops, proc, context);
+  t->sim = sim;
+  t->body = response->body;
+  t->length = response->length;
+  t->status = response->status;
+  t->openTime = sim->now;
+  t->sourceRate = response->sourceRate;
+  t->burst = response->burst;
+  if (response->headerCount > 0) {
+    t->headerNames = calloc(response->headerCount, sizeof(char*));
+    t->headerValues = calloc(response->headerCount, sizeof(char*));
+    if (t->headerNames == NULL || t->headerValues == NULL) {
+      sim_free(t);
+      return NULL;
+    }
+    for (size_t i = 0; i < response->headerCount; i++) {
+      t->headerNames[i] = strdup(response->headers[2 * i]);
+      t->headerValues[i] = strdup(response->headers[2 * i + 1]);
+      t->headerCount++;
+      if (t->headerNames[i] == NULL || t->headerValues[i] == NULL) {
+        sim_free(t);
+        return NULL;
+      }
+    }
+  }
+
+  t->next = sim->transports;
+  sim->transports = t;
+  if (t->length == 0) {
+    /* Nothing to send, so it ends as soon as the response arrives */
+    t->flight[0] = sim->now + sim->link.latency;
+    t->flightCount = 1;
+  } else {
+    sim_reshare(sim);
+  }
+  return &t->transport;
+}
+
+double ASNetworkSimulatorTime(const network_simulator_t *sim) {
+  return sim->now;
+}
+
+void ASNetworkSimulatorAdvance(network_simulator_t *sim, double seconds) {
+  double end = sim->now + (seconds > 0 ? seconds : 0);
+  sim_flush(sim);
+  for (;;) {
+    /* Find whatever happens next */
+    double when = INFINITY;
+    sim_transport_t *sender = NULL, *receiver = NULL, *source = NULL;
+    sim_change_t *change = NULL;
+    for (sim_transport_t *t = sim->transports; t != NULL; t = t->next) {
+      if (t->sending && t->sendDone < when) {
+        when = t->sendDone;
+        sender = t;
+        receiver = source = NULL;
+      }
+      if (!t->sending && t->sourceRate > 0 && sim_window_open(t) &&
+          fmax(sim_source_ready(t), sim->now) < when) {
+        when = fmax(sim_source_ready(t), sim->now);
+        sender = NULL;
+        source = t;
+      }
+      if (t->flightCount > 0 && t->flight[t->flightHead] < when) {
+        when = t->flight[t->flightHead];
+        sender = source = NULL;
+        receiver = t;
+      }
+    }
+    if (sim->nextChange < sim->changeCount &&
+        sim->changes[sim->nextChange].time <= when) {
+      change = &sim->changes[sim->nextChange];
+      when = change->time;
+      sender = receiver = source = NULL;
+    }
+    if (when > end) break;
+
+    sim->now = when;
+    if (change != NULL) {
+      sim->nextChange++;
+      if (change->kind == SIM_CHANGE_BANDWIDTH) {
+        sim->link.bandwidth = change->bandwidth;
+      } else {
+        for (sim_transport_t *t = sim->transports; t != NULL; t = t->next) {
+          sim_fail(t, "Connection reset by peer");
+        }
+      }
+      sim_reshare(sim);
+    } else if (sender != NULL) {
+      sim_packet_sent(sender);
+    } else if (source != NULL) {
+      /* The source has made the next packet */
+      sim_reshare(sim);
+    } else {
+      sim_packet_arrived(receiver);
+    }
+    sim_flush(sim);
+  }
+  sim->now = end;
+}
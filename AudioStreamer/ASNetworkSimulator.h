@@ -0,0 +1,86 @@
+//
+//  ASNetworkSimulator.h
+//  AudioStreamer
+//
+
+#ifndef AS_NETWORK_SIMULATOR_H
+#define AS_NETWORK_SIMULATOR_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ASTransport.h"
+
+/*
+ * A simulated network link, for running the streaming pipeline against
+ * scripted network conditions instead of a real server.
+ *
+ * Each transport opened on the simulator serves a response from memory, such
+ * as a recorded capture of an MP3, AAC or ICY stream. Its bytes arrive in
+ * packets as the link would deliver them: after a latency, at the link's
+ * bandwidth (shared evenly among the transports receiving at the time), each
+ * packet held up by a random amount up to the jitter, and never more than a
+ * receive window ahead of the reader. A live response is sent no faster than
+ * its source makes it. Bandwidth changes and disconnects can be
+ * scripted for any moment; a disconnect fails every transport which hasn't
+ * received all of its body.
+ *
+ * Time is virtual and only moves when ASNetworkSimulatorAdvance is called,
+ * which is also when events are sent, so a run depends only on the script and
+ * the seed and comes out the same every time, however fast or slow the
+ * machine running it is.
+ *
+ * This is plain C without any CoreFoundation dependency.
+ */
+
+typedef struct network_simulator network_simulator_t;
+
+typedef struct sim_link {
+  double bandwidth;             /* bytes per second */
+  double latency;               /* seconds until the first byte arrives */
+  double jitter;                /* seconds a packet can be held up by */
+} sim_link_t;
+
+typedef struct sim_response {
+  const uint8_t *body;          /* not copied; must outlive the transport */
+  size_t length;
+  int status;
+  /* Response headers, as pairs of name and value */
+  const char *const *headers;
+  size_t headerCount;
+  /* Bytes per second a live source makes, which is as fast as the body can
+     be sent, or 0 for a file. The server has burst bytes in hand to start
+     with */
+  double sourceRate;
+  size_t burst;
+} sim_response_t;
+
+/* Creates a simulator at time 0. The seed decides the jitter. Returns NULL if
+   allocation fails */
+network_simulator_t *ASNetworkSimulatorCreate(const sim_link_t *link,
+                                              uint32_t seed);
+
+/* Any transports still open must be closed first */
+void ASNetworkSimulatorDestroy(network_simulator_t *sim);
+
+/* Scripts the link's bandwidth to change at the given time */
+bool ASNetworkSimulatorScheduleBandwidth(network_simulator_t *sim, double time,
+                                         double bandwidth);
+
+/* Scripts the link to drop every connection at the given time */
+bool ASNetworkSimulatorScheduleDisconnect(network_simulator_t *sim, double time);
+
+/* Starts a response arriving over the link. Returns NULL if allocation
+   fails */
+transport_t *ASNetworkSimulatorOpen(network_simulator_t *sim,
+                                    const sim_response_t *response,
+                                    transport_event_proc proc, void *context);
+
+/* The current virtual time, in seconds */
+double ASNetworkSimulatorTime(const network_simulator_t *sim);
+
+/* Moves time on by the given number of seconds, delivering whatever arrives
+   meanwhile and sending events for it */
+void ASNetworkSimulatorAdvance(network_simulator_t *sim, double seconds);
+
+#endif
@@ -0,0 +1,261 @@
+//
+//  ASNormalizer.c
+//  AudioStreamer
+//
+
+#include "ASNormalizer.h"
+#include "ASLoudnessMeter.h"
+
+#include <math.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Seconds of audio to measure before trusting the measurement */
+#define kMinMeasured 3.0
+#define kMaxBoost 12.0
+#define kMaxCut -30.0
+/* Time constants of the gain's smoothing and the limiter's recovery */
+#define kGainTime 1.0
+#define kReleaseTime 0.08
+/* -1 dBTP */
+#define kCeiling 0.89125094f
+#define kLookahead 64
+/* Interpolation filter taps for each of the three points between samples.
+   The points lie between the samples kInterpDelay and kInterpDelay - 1
+   frames back */
+#define kInterpTaps 12
+#define kInterpDelay (kInterpTaps / 2)
+#define kDelay (kLookahead + kInterpDelay)
+/* Frames processed at a time, each with one step of the gain's smoothing */
+#define kBlockFrames 64
+
+struct normalizer {
+  /* Shared with other threads, as the bits of doubles */
+  atomic_uint_fast64_t known;   /* from the tags, NAN if not */
+  atomic_uint_fast64_t measured;
+  atomic_uint_fast64_t gainDB;
+
+  /* Touched only by the processing thread */
+  uint32_t  channels;
+  double    sampleRate;
+  double    target;
+  loudness_meter_t *meter;
+  uint32_t  sinceEstimate;      /* frames measured since it was last looked at */
+  bool      started;            /* has any audio been processed? */
+  double    gain;               /* linear, at the end of the last block */
+  float     interp[3][kInterpTaps];
+
+  float    *delay;              /* kDelay frames, interleaved */
+  uint32_t  delayPos;
+  float     required[kLookahead + 1]; /* limiter gains the peaks need */
+  uint32_t  requiredPos;
+  uint32_t  limiting;           /* frames until no peak needs limiting */
+  float     limit;              /* limiter gain of the last frame */
+  float     release;
+};
+
+static void store_double(atomic_uint_fast64_t *a, double value) {
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  atomic_store_explicit(a, bits, memory_order_relaxed);
+}
+
+static double load_double(const atomic_uint_fast64_t *a) {
+  uint64_t bits = atomic_load_explicit((atomic_uint_fast64_t*) a,
+                                       memory_order_relaxed);
+  double value;
+  memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+/* Hann-windowed sinc taps for the points a quarter, half and three quarters
+   of the way from one sample to the next */
+static void interp_taps(float taps[3][kInterpTaps]) {
+  for (int p = 0; p < 3; p++) {
+    for (int j = 0; j < kInterpTaps; j++) {
+      double d = j - kInterpDelay + (p + 1) / 4.0;
+      double sinc = M_PI * d == 0 ? 1 : sin(M_PI * d) / (M_PI * d);
+      double window = cos(M_PI * d / kInterpTaps);
+      taps[p][j] = (float)(sinc * window * window);
+    }
+  }
+}
+
+normalizer_t *ASNormalizerCreate(double sampleRate, uint32_t channels,
+                                 double target) {
+  normalizer_t *n = calloc(1, sizeof(normalizer_t));
+  if (n == NULL) return NULL;
+  n->meter = ASLoudnessMeterCreate(sampleRate, channels);
+  n->delay = calloc(kDelay * channels, sizeof(float));
+  if (n->meter == NULL || n->delay == NULL) {
+    ASNormalizerDestroy(n);
+    return NULL;
+  }
+  atomic_init(&n->known, 0);
+  atomic_init(&n->measured, 0);
+  atomic_init(&n->gainDB, 0);
+  store_double(&n->known, NAN);
+  store_double(&n->measured, NAN);
+  store_double(&n->gainDB, 0);
+  n->channels = channels;
+  n->sampleRate = sampleRate;
+  n->target = target;
+  n->gain = 1;
+  interp_taps(n->interp);
+  n->release = (float)(1 - exp(-1 / (kReleaseTime * sampleRate)));
+  ASNormalizerFlush(n);
+  return n;
+}
+
+void ASNormalizerDestroy(normalizer_t *normalizer) {
+  if (normalizer == NULL) return;
+  ASLoudnessMeterDestroy(normalizer->meter);
+  free(normalizer->delay);
+  free(normalizer);
+}
+
+void ASNormalizerSetLoudness(normalizer_t *normalizer, double lufs) {
+  store_double(&normalizer->known, lufs);
+}
+
+bool ASNormalizerLoudness(const normalizer_t *normalizer, double *lufs) {
+  double value = load_double(&normalizer->known);
+  if (isnan(value)) value = load_double(&normalizer->measured);
+  if (isnan(value)) return false;
+  *lufs = value;
+  return true;
+}
+
+double ASNormalizerGain(const normalizer_t *normalizer) {
+  return load_double(&normalizer->gainDB);
+}
+
+void ASNormalizerFlush(normalizer_t *n) {
+  memset(n->delay, 0, kDelay * n->channels * sizeof(float));
+  n->delayPos = 0;
+  for (int i = 0; i <= kLookahead; i++) n->required[i] = 1;
+  n->requiredPos = 0;
+  n->limiting = 0;
+  n->limit = 1;
+}
+
+/* The linear gain the stream should end up with, or 0 if it isn't known */
+static double target_gain(normalizer_t *n, uint32_t frames) {
+  double loudness = load_double(&n->known);
+  if (isnan(loudness)) {
+    n->sinceEstimate += frames;
+    /* The measurement only changes every 100 ms */
+    if (n->sinceEstimate >= n->sampleRate / 10) {
+      n->sinceEstimate = 0;
+      double measured;
+      if (ASLoudnessMeterGatedDuration(n->meter) >= kMinMeasured &&
+          ASLoudnessMeterIntegrated(n->meter, &measured)) {
+        store_double(&n->measured, measured);
+      }
+    }
+    loudness = load_double(&n->measured);
+    if (isnan(loudness)) return 0;
+  }
+  double db = n->target - loudness;
+  if (db > kMaxBoost) db = kMaxBoost;
+  if (db < kMaxCut) db = kMaxCut;
+  return pow(10, db / 20);
+}
+
+/* Fills in the gains for a block, moving towards the target */
+static void block_gains(normalizer_t *n, float *gains, uint32_t frames) {
+  double target = target_gain(n, frames);
+  if (target == 0) target = n->gain;
+  /* Tags known from the start are followed from the start */
+  if (!n->started) n->gain = target;
+  n->started = true;
+
+  double end = n->gain + (target - n->gain) *
+               (1 - exp(-(double) frames / (kGainTime * n->sampleRate)));
+  double step = (end - n->gain) / frames;
+  for (uint32_t i = 0; i < frames; i++) {
+    gains[i] = (float)(n->gain + step * (i + 1));
+  }
+  n->gain = end;
+  store_double(&n->gainDB, 20 * log10(end));
+}
+
+/* The true peak, across channels, of the frame kInterpDelay back, up to the
+   next one. The newest frame is at the delay line's position */
+static float true_peak(const normalizer_t *n) {
+  float peak = 0;
+  for (uint32_t ch = 0; ch < n->channels; ch++) {
+    float history[kInterpTaps];
+    for (int j = 0; j < kInterpTaps; j++) {
+      uint32_t pos = (n->delayPos + kDelay - j) % kDelay;
+      history[j] = n->delay[pos * n->channels + ch];
+    }
+    float sample = fabsf(history[kInterpDelay]);
+    if (sample > peak) peak = sample;
+    for (int p = 0; p < 3; p++) {
+      float sum = 0;
+      for (int j = 0; j < kInterpTaps; j++) sum += n->interp[p][j] * history[j];
+      if (fabsf(sum) > peak) peak = fabsf(sum);
+    }
+  }
+  return peak;
+}
+
+/* The limiter's gain for the frame leaving the delay line. Each peak within
+   the look ahead allows a gain which ramps down to what it needs */
+static float limiter_gain(normalizer_t *n) {
+  float gain = 1;
+  if (n->limiting > 0) {
+    n->limiting--;
+    for (uint32_t k = 0; k <= kLookahead; k++) {
+      float req = n->required[(n->requiredPos + k) % (kLookahead + 1)];
+      float allowed = req + (1 - req) * k / kLookahead;
+      if (allowed < gain) gain = allowed;
+    }
+  }
+  float released = n->limit + (1 - n->limit) * n->release;
+  n->limit = gain < released ? gain : released;
+  return n->limit;
+}
+
+void ASNormalizerProcess(normalizer_t *n, float *const *channels,
+                         uint32_t frames) {
+  float gains[kBlockFrames];
+  uint32_t done = 0;
+  while (done < frames) {
+    uint32_t count = frames - done;
+    if (count > kBlockFrames) count = kBlockFrames;
+    if (isnan(load_double(&n->known))) {
+      const float *block[n->channels];
+      for (uint32_t ch = 0; ch < n->channels; ch++) {
+        block[ch] = channels[ch] + done;
+      }
+      ASLoudnessMeterProcess(n->meter, block, count);
+    }
+    block_gains(n, gains, count);
+
+    for (uint32_t i = 0; i < count; i++) {
+      /* In with the new frame, and out with the one kDelay frames old */
+      float *slot = n->delay + n->delayPos * n->channels;
+      float out[n->channels];
+      for (uint32_t ch = 0; ch < n->channels; ch++) {
+        out[ch] = slot[ch];
+        slot[ch] = channels[ch][done + i] * gains[i];
+      }
+
+      float peak = true_peak(n);
+      float req = peak > kCeiling ? kCeiling / peak : 1;
+      n->required[n->requiredPos] = req;
+      n->requiredPos = (n->requiredPos + 1) % (kLookahead + 1);
+      if (req < 1) n->limiting = kLookahead + 1;
+
+      float gain = limiter_gain(n);
+      for (uint32_t ch = 0; ch < n->channels; ch++) {
+        channels[ch][done + i] = out[ch] * gain;
+      }
+      n->delayPos = (n->delayPos + 1) % kDelay;
+    }
+    done += count;
+  }
+}
@@ -0,0 +1,66 @@
+//
+//  ASNormalizer.h
+//  AudioStreamer
+//
+
+#ifndef AS_NORMALIZER_H
+#define AS_NORMALIZER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Loudness normalization of decoded PCM.
+ *
+ * Audio is brought to a target integrated loudness by a gain worked out
+ * from how loud the stream is. When its tags say (ReplayGain or R128 gains,
+ * see ASLoudnessMeter.h for reading them) that's used straight away.
+ * Otherwise the stream is measured as it plays, and once a few seconds of it
+ * have been the gain starts following the measurement. Changes of gain are
+ * smoothed over about a second so they're never heard as steps, and no more
+ * than 12 dB is ever added.
+ *
+ * After the gain, a limiter keeps the true peak (estimated by interpolating
+ * four times over, as BS.1770 describes) below -1 dBTP. It looks ahead 64
+ * frames and ramps the gain down over them before a peak, then lets it
+ * recover over about 80 ms, so peaks are never clipped. The look ahead, plus
+ * a few frames for the interpolation, delays the audio by 70 frames.
+ *
+ * The tags' loudness is set from one thread while the audio is processed on
+ * another (the audio thread), and the loudness and gain can be read from any
+ * thread. Nothing is allocated or locked once it's been created.
+ *
+ * This is plain C without any CoreFoundation dependency.
+ */
+
+typedef struct normalizer normalizer_t;
+
+/* Creates a normalizer aiming at the given loudness, in LUFS. Returns NULL
+   if the format can't be measured or allocation fails */
+normalizer_t *ASNormalizerCreate(double sampleRate, uint32_t channels,
+                                 double target);
+
+void ASNormalizerDestroy(normalizer_t *normalizer);
+
+/* Says how loud the stream is, in LUFS, from its tags. NAN goes back to
+   measuring it */
+void ASNormalizerSetLoudness(normalizer_t *normalizer, double lufs);
+
+/* The loudness the gain is based on, from the tags or as measured so far.
+   Returns false if it isn't known yet */
+bool ASNormalizerLoudness(const normalizer_t *normalizer, double *lufs);
+
+/* The gain being applied before the limiter, in dB */
+double ASNormalizerGain(const normalizer_t *normalizer);
+
+/* Normalizes a block of non-interleaved float samples in place, one pointer
+   per channel for as many channels as it was created with. Only to be called
+   from one thread at a time */
+void ASNormalizerProcess(normalizer_t *normalizer, float *const *channels,
+                         uint32_t frames);
+
+/* Drops the audio delayed by the limiter, for when the stream starts again
+   somewhere else. Called from the same thread as ASNormalizerProcess */
+void ASNormalizerFlush(normalizer_t *normalizer);
+
+#endif
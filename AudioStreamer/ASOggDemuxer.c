@@ -0,0 +1,462 @@
+//
+//  ASOggDemuxer.c
+//  AudioStreamer
+//
+
+#include "ASOggDemuxer.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+/* Header, then at most 255 lacing values of at most 255 bytes each */
+#define kPageHeaderSize 27
+#define kMaxPageSize (kPageHeaderSize + 255 + 255 * 255)
+
+struct ogg_demuxer {
+  ogg_stream_filter   filter;
+  ogg_packet_callback callback;
+  void               *context;
+
+  /* The logical stream being followed */
+  bool     following;
+  uint32_t serial;
+  bool     linkStarted;       /* a page other than a BOS page has been seen */
+  bool     sequenceKnown;
+  uint32_t nextSequence;
+
+  /* A packet continued across pages */
+  uint8_t *packet;
+  size_t   packetLength;
+  size_t   packetCapacity;
+  bool     skipContinued;     /* drop the rest of a packet whose start is lost */
+
+  ogg_stats_t stats;
+
+  /* A page split across reads */
+  size_t  pageFill;
+  uint8_t page[kMaxPageSize];
+};
+
+/* CRC-32 with polynomial 0x04C11DB7, unreflected; worked out ahead of time
+   so that demuxers on different threads share it safely */
+static const uint32_t kCRCTable[256] = {
+  0x00000000, 0x04c11db7, 0x09823b6e, 0x0d4326d9, 0x130476dc, 0x17c56b6b,
+  0x1a864db2, 0x1e475005, 0x2608edb8, 0x22c9f00f, 0x2f8ad6d6, 0x2b4bcb61,
+  0x350c9b64, 0x31cd86d3, 0x3c8ea00a, 0x384fbdbd, 0x4c11db70, 0x48d0c6c7,
+  0x4593e01e, 0x4152fda9, 0x5f15adac, 0x5bd4b01b, 0x569796c2, 0x52568b75,
+  0x6a1936c8, 0x6ed82b7f, 0x639b0da6, 0x675a1011, 0x791d4014, 0x7ddc5da3,
+  0x709f7b7a, 0x745e66cd, 0x9823b6e0, 0x9ce2ab57, 0x91a18d8e, 0x95609039,
+  0x8b27c03c, 0x8fe6dd8b, 0x82a5fb52, 0x8664e6e5, 0xbe2b5b58, 0xbaea46ef,
+  0xb7a96036, 0xb3687d81, 0xad2f2d84, 0xa9ee3033, 0xa4ad16ea, 0xa06c0b5d,
+  0xd4326d90, 0xd0f37027, 0xddb056fe, 0xd9714b49, 0xc7361b4c, 0xc3f706fb,
+  0xceb42022, 0xca753d95, 0xf23a8028, 0xf6fb9d9f, 0xfbb8bb46, 0xff79a6f1,
+  0xe13ef6f4, 0xe5ffeb43, 0xe8bccd9a, 0xec7dd02d, 0x34867077, 0x30476dc0,
+  0x3d044b19, 0x39c556ae, 0x278206ab, 0x23431b1c, 0x2e003dc5, 0x2ac12072,
+  0x128e9dcf, 0x164f8078, 0x1b0ca6a1, 0x1fcdbb16, 0x018aeb13, 0x054bf6a4,
+  0x0808d07d, 0x0cc9cdca, 0x7897ab07, 0x7c56b6b0, 0x71159069, 0x75d48dde,
+  0x6b93dddb, 0x6f52c06c, 0x6211e6b5, 0x66d0fb02, 0x5e9f46bf, 0x5a5e5b08,
+  0x571d7dd1, 0x53dc6066, 0x4d9b3063, 0x495a2dd4, 0x44190b0d, 0x40d816ba,
+  0xaca5c697, 0xa864db20, 0xa527fdf9, 0xa1e6e04e, 0xbfa1b04b, 0xbb60adfc,
+  0xb6238b25, 0xb2e29692, 0x8aad2b2f, 0x8e6c3698, 0x832f1041, 0x87ee0df6,
+  0x99a95df3, 0x9d684044, 0x902b669d, 0x94ea7b2a, 0xe0b41de7, 0xe4750050,
+  0xe9362689, 0xedf73b3e, 0xf3b06b3b, 0xf771768c, 0xfa325055, 0xfef34de2,
+  0xc6bcf05f, 0xc27dede8, 0xcf3ecb31, 0xcbffd686, 0xd5b88683, 0xd1799b34,
+  0xdc3abded, 0xd8fba05a, 0x690ce0ee, 0x6dcdfd59, 0x608edb80, 0x644fc637,
+  0x7a089632, 0x7ec98b85, 0x738aad5c, 0x774bb0eb, 0x4f040d56, 0x4bc510e1,
+  0x46863638, 0x42472b8f, 0x5c007b8a, 0x58c1663d, 0x558240e4, 0x51435d53,
+  0x251d3b9e, 0x21dc2629, 0x2c9f00f0, 0x285e1d47, 0x36194d42, 0x32d850f5,
+  0x3f9b762c, 0x3b5a6b9b, 0x0315d626, 0x07d4cb91, 0x0a97ed48, 0x0e56f0ff,
+  0x1011a0fa, 0x14d0bd4d, 0x19939b94, 0x1d528623, 0xf12f560e, 0xf5ee4bb9,
+  0xf8ad6d60, 0xfc6c70d7, 0xe22b20d2, 0xe6ea3d65, 0xeba91bbc, 0xef68060b,
+  0xd727bbb6, 0xd3e6a601, 0xdea580d8, 0xda649d6f, 0xc423cd6a, 0xc0e2d0dd,
+  0xcda1f604, 0xc960ebb3, 0xbd3e8d7e, 0xb9ff90c9, 0xb4bcb610, 0xb07daba7,
+  0xae3afba2, 0xaafbe615, 0xa7b8c0cc, 0xa379dd7b, 0x9b3660c6, 0x9ff77d71,
+  0x92b45ba8, 0x9675461f, 0x8832161a, 0x8cf30bad, 0x81b02d74, 0x857130c3,
+  0x5d8a9099, 0x594b8d2e, 0x5408abf7, 0x50c9b640, 0x4e8ee645, 0x4a4ffbf2,
+  0x470cdd2b, 0x43cdc09c, 0x7b827d21, 0x7f436096, 0x7200464f, 0x76c15bf8,
+  0x68860bfd, 0x6c47164a, 0x61043093, 0x65c52d24, 0x119b4be9, 0x155a565e,
+  0x18197087, 0x1cd86d30, 0x029f3d35, 0x065e2082, 0x0b1d065b, 0x0fdc1bec,
+  0x3793a651, 0x3352bbe6, 0x3e119d3f, 0x3ad08088, 0x2497d08d, 0x2056cd3a,
+  0x2d15ebe3, 0x29d4f654, 0xc5a92679, 0xc1683bce, 0xcc2b1d17, 0xc8ea00a0,
+  0xd6ad50a5, 0xd26c4d12, 0xdf2f6bcb, 0xdbee767c, 0xe3a1cbc1, 0xe760d676,
+  0xea23f0af, 0xeee2ed18, 0xf0a5bd1d, 0xf464a0aa, 0xf9278673, 0xfde69bc4,
+  0x89b8fd09, 0x8d79e0be, 0x803ac667, 0x84fbdbd0, 0x9abc8bd5, 0x9e7d9662,
+  0x933eb0bb, 0x97ffad0c, 0xafb010b1, 0xab710d06, 0xa6322bdf, 0xa2f33668,
+  0xbcb4666d, 0xb8757bda, 0xb5365d03, 0xb1f740b4,
+};
+
+/* Starting from zero, as Ogg has it */
+static uint32_t page_crc(const uint8_t *page, size_t length) {
+  uint32_t crc = 0;
+  for (size_t i = 0; i < length; i++) {
+    /* The CRC field itself counts as zeros */
+    uint8_t byte = (i >= 22 && i < 26) ? 0 : page[i];
+    crc = (crc << 8) ^ kCRCTable[(crc >> 24) ^ byte];
+  }
+  return crc;
+}
+
+static uint32_t read_le32(const uint8_t *p) {
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) |
+         ((uint32_t)p[3] << 24);
+}
+
+static uint64_t read_le64(const uint8_t *p) {
+  return (uint64_t)read_le32(p) | ((uint64_t)read_le32(p + 4) << 32);
+}
+
+ogg_demuxer_t *ASOggDemuxerCreate(ogg_stream_filter filter,
+                                  ogg_packet_callback callback,
+                                  void *context) {
+  ogg_demuxer_t *demuxer = calloc(1, sizeof(ogg_demuxer_t));
+  if (demuxer == NULL) return NULL;
+  demuxer->filter = filter;
+  demuxer->callback = callback;
+  demuxer->context = context;
+  return demuxer;
+}
+
+void ASOggDemuxerDestroy(ogg_demuxer_t *demuxer) {
+  if (demuxer == NULL) return;
+  free(demuxer->packet);
+  free(demuxer);
+}
+
+void ASOggDemuxerReset(ogg_demuxer_t *demuxer) {
+  ASOggDemuxerResync(demuxer);
+  demuxer->following = false;
+  demuxer->linkStarted = false;
+}
+
+void ASOggDemuxerResync(ogg_demuxer_t *demuxer) {
+  demuxer->pageFill = 0;
+  demuxer->packetLength = 0;
+  demuxer->skipContinued = false;
+  demuxer->sequenceKnown = false;
+  demuxer->linkStarted = true;
+}
+
+void ASOggDemuxerGetStats(const ogg_demuxer_t *demuxer, ogg_stats_t *stats) {
+  *stats = demuxer->stats;
+}
+
+/* Length of the page at p, or 0 if more than 'available' bytes are needed to
+   tell */
+static size_t page_length(const uint8_t *p, size_t available) {
+  if (available < kPageHeaderSize) return 0;
+  size_t segments = p[26];
+  if (available < kPageHeaderSize + segments) return 0;
+  size_t length = kPageHeaderSize + segments;
+  for (size_t i = 0; i < segments; i++) {
+    length += p[kPageHeaderSize + i];
+  }
+  return length;
+}
+
+/* Appends to the packet being put back together. Returns false if it has
+   grown too large or memory ran out, in which case the packet is dropped */
+static bool append_packet(ogg_demuxer_t *demuxer, const uint8_t *data,
+                          size_t length) {
+  size_t needed = demuxer->packetLength + length;
+  if (needed > kOggMaxPacketSize) goto drop;
+  if (needed > demuxer->packetCapacity) {
+    size_t capacity = demuxer->packetCapacity ? demuxer->packetCapacity : 4096;
+    while (capacity < needed) capacity *= 2;
+    uint8_t *packet = realloc(demuxer->packet, capacity);
+    if (packet == NULL) goto drop;
+    demuxer->packet = packet;
+    demuxer->packetCapacity = capacity;
+  }
+  memcpy(demuxer->packet + demuxer->packetLength, data, length);
+  demuxer->packetLength = needed;
+  return true;
+
+drop:
+  demuxer->packetLength = 0;
+  demuxer->skipContinued = true;
+  demuxer->stats.lostPackets++;
+  return false;
+}
+
+/* Splits a complete, verified page into packets */
+static void handle_page(ogg_demuxer_t *demuxer, const uint8_t *page) {
+  uint8_t flags = page[5];
+  bool continued = flags & 0x01;
+  bool bos = flags & 0x02;
+  bool eos = flags & 0x04;
+  int64_t granule = (int64_t)read_le64(page + 6);
+  uint32_t serial = read_le32(page + 14);
+  uint32_t sequence = read_le32(page + 18);
+  size_t segments = page[26];
+  const uint8_t *lacing = page + kPageHeaderSize;
+  const uint8_t *body = lacing + segments;
+
+  if (bos) {
+    /* Either the start of the next track in a chain, or another stream
+       multiplexed alongside the one already followed */
+    if (demuxer->following && !demuxer->linkStarted) return;
+    size_t first = 0;
+    for (size_t i = 0; i < segments; i++) {
+      first += lacing[i];
+      if (lacing[i] < 255) break;
+    }
+    demuxer->following = false;
+    if (!demuxer->filter(demuxer->context, serial, body, first)) return;
+    demuxer->following = true;
+    demuxer->serial = serial;
+    demuxer->linkStarted = false;
+    demuxer->packetLength = 0;
+    demuxer->skipContinued = false;
+  } else {
+    if (!demuxer->following || serial != demuxer->serial) return;
+    demuxer->linkStarted = true;
+    if (demuxer->sequenceKnown && sequence != demuxer->nextSequence &&
+        demuxer->packetLength > 0) {
+      /* A page went missing in the middle of a packet */
+      demuxer->packetLength = 0;
+      demuxer->stats.lostPackets++;
+    }
+  }
+  demuxer->sequenceKnown = true;
+  demuxer->nextSequence = sequence + 1;
+
+  if (!continued) {
+    if (demuxer->packetLength > 0) {
+      demuxer->packetLength = 0;
+      demuxer->stats.lostPackets++;
+    }
+    demuxer->skipContinued = false;
+  } else if (demuxer->packetLength == 0) {
+    /* The start of this packet was never seen */
+    demuxer->skipContinued = true;
+  }
+
+  /* The granule position belongs to the last packet ending on the page */
+  size_t lastEnding = segments;
+  for (size_t i = 0; i < segments; i++) {
+    if (lacing[i] < 255) lastEnding = i;
+  }
+
+  ogg_packet_t packet = {
+    .serial = serial,
+    .bos = bos,
+  };
+  size_t start = 0, offset = 0;
+  for (size_t i = 0; i < segments; i++) {
+    offset += lacing[i];
+    if (lacing[i] == 255) continue;
+
+    if (demuxer->skipContinued) {
+      demuxer->skipContinued = false;
+    } else if (demuxer->packetLength > 0) {
+      if (append_packet(demuxer, body + start, offset - start)) {
+        packet.data = demuxer->packet;
+        packet.length = demuxer->packetLength;
+        demuxer->packetLength = 0;
+        packet.granule = i == lastEnding ? granule : -1;
+        packet.eos = eos && i == lastEnding;
+        demuxer->callback(demuxer->context, &packet);
+      }
+    } else {
+      packet.data = body + start;
+      packet.length = offset - start;
+      packet.granule = i == lastEnding ? granule : -1;
+      packet.eos = eos && i == lastEnding;
+      demuxer->callback(demuxer->context, &packet);
+    }
+    packet.bos = false;
+    start = offset;
+  }
+
+  /* Whatever is left continues on the next page */
+  if (segments > 0 && lacing[segments - 1] == 255 && !demuxer->skipContinued) {
+    append_packet(demuxer, body + start, offset - start);
+  }
+  if (eos) {
+    demuxer->following = false;
+    demuxer->packetLength = 0;
+    demuxer->skipContinued = false;
+  }
+}
+
+/* Checks the page at p, which must be complete, and handles it. Returns false
+   if it isn't a valid page */
+static bool check_page(ogg_demuxer_t *demuxer, const uint8_t *p, size_t length) {
+  if (p[4] != 0) return false;  /* version */
+  if (page_crc(p, length) != read_le32(p + 22)) {
+    demuxer->stats.crcErrors++;
+    return false;
+  }
+  demuxer->stats.pages++;
+  handle_page(demuxer, p);
+  return true;
+}
+
+/* Finds the next place a page could start: the capture pattern, or a prefix
+   of it right at the end of the data */
+static size_t find_capture(const uint8_t *bytes, size_t length) {
+  const uint8_t *p = bytes, *end = bytes + length;
+  while ((p = memchr(p, 'O', (size_t)(end - p))) != NULL) {
+    size_t left = (size_t)(end - p);
+    if (memcmp(p, "OggS", left < 4 ? left : 4) == 0) break;
+    p++;
+  }
+  return p == NULL ? length : (size_t)(p - bytes);
+}
+
+/* Drops the first byte of a buffered page which turned out to be bad, and
+   keeps whatever follows from the next capture pattern on */
+static void resync_page_buffer(ogg_demuxer_t *demuxer) {
+  size_t next = 1 + find_capture(demuxer->page + 1, demuxer->pageFill - 1);
+  demuxer->stats.skippedBytes += next;
+  memmove(demuxer->page, demuxer->page + next, demuxer->pageFill - next);
+  demuxer->pageFill -= next;
+}
+
+void ASOggDemuxerParse(ogg_demuxer_t *demuxer, const uint8_t *bytes,
+                       size_t length) {
+  /* Complete the page which was split across reads, if there is one */
+  while (demuxer->pageFill > 0) {
+    if (demuxer->pageFill >= 4 && memcmp(demuxer->page, "OggS", 4) != 0) {
+      resync_page_buffer(demuxer);
+      continue;
+    }
+    size_t total = page_length(demuxer->page, demuxer->pageFill);
+    size_t want = total > 0 ? total :
+                  demuxer->pageFill < kPageHeaderSize ? (size_t)kPageHeaderSize :
+                  (size_t)kPageHeaderSize + demuxer->page[26];
+    if (demuxer->pageFill < want) {
+      if (length == 0) return;
+      size_t take = want - demuxer->pageFill;
+      if (take > length) take = length;
+      memcpy(demuxer->page + demuxer->pageFill, bytes, take);
+      demuxer->pageFill += take;
+      bytes += take;
+      length -= take;
+      continue;
+    }
+    if (total == 0) continue;
+    if (check_page(demuxer, demuxer->page, total)) {
+      /* After a false start the buffer can run on past this page */
+      memmove(demuxer->page, demuxer->page + total, demuxer->pageFill - total);
+      demuxer->pageFill -= total;
+    } else {
+      resync_page_buffer(demuxer);
+    }
+  }
+
+  /* Then handle whole pages straight out of the input */
+  while (length > 0) {
+    size_t skip = find_capture(bytes, length);
+    demuxer->stats.skippedBytes += skip;
+    bytes += skip;
+    length -= skip;
+    if (length == 0) return;
+
+    size_t total = page_length(bytes, length);
+    if (length < 4 || total == 0 || total > length) {
+      /* Not all here yet. The capture pattern (or a prefix of it) is at the
+         start, so this has to be the start of the next page */
+      memcpy(demuxer->page, bytes, length);
+      demuxer->pageFill = length;
+      return;
+    }
+    if (check_page(demuxer, bytes, total)) {
+      bytes += total;
+      length -= total;
+    } else {
+      bytes++;
+      length--;
+      demuxer->stats.skippedBytes++;
+    }
+  }
+}
+
+ogg_codec_t ASOggIdentifyCodec(const uint8_t *data, size_t length) {
+  if (length >= 8 && memcmp(data, "OpusHead", 8) == 0) return OGG_CODEC_OPUS;
+  if (length >= 7 && memcmp(data, "\x01vorbis", 7) == 0) return OGG_CODEC_VORBIS;
+  if (length >= 5 && memcmp(data, "\x7F" "FLAC", 5) == 0) return OGG_CODEC_FLAC;
+  return OGG_CODEC_UNKNOWN;
+}
+
+bool ASOggParseOpusHead(const uint8_t *data, size_t length, opus_head_t *head) {
+  if (length < 19 || memcmp(data, "OpusHead", 8) != 0) return false;
+  /* Only the major version (top four bits) has to be understood */
+  if ((data[8] >> 4) != 0 || data[9] == 0) return false;
+  head->channels = data[9];
+  head->preSkip = (uint16_t)(data[10] | (data[11] << 8));
+  head->inputSampleRate = read_le32(data + 12);
+  head->outputGain = (int16_t)(data[16] | (data[17] << 8));
+  head->mappingFamily = data[18];
+  return true;
+}
+
+uint32_t ASOggOpusPacketSamples(const uint8_t *data, size_t length) {
+  if (length == 0) return 0;
+  uint8_t config = data[0] >> 3;
+  uint32_t frameSamples;
+  if (config < 12) {
+    /* SILK: 10, 20, 40 or 60 ms */
+    static const uint32_t kSilk[4] = {480, 960, 1920, 2880};
+    frameSamples = kSilk[config & 0x3];
+  } else if (config < 16) {
+    /* Hybrid: 10 or 20 ms */
+    frameSamples = (config & 0x1) ? 960 : 480;
+  } else {
+    /* CELT: 2.5, 5, 10 or 20 ms */
+    frameSamples = 120u << (config & 0x3);
+  }
+
+  uint32_t frames;
+  switch (data[0] & 0x3) {
+    case 0:  frames = 1; break;
+    case 1:
+    case 2:  frames = 2; break;
+    default:
+      if (length < 2) return 0;
+      frames = data[1] & 0x3F;
+  }
+  /* No packet may hold more than 120 ms */
+  if (frames == 0 || frames * frameSamples > 5760) return 0;
+  return frames * frameSamples;
+}
+
+bool ASOggFindComment(const uint8_t *data, size_t length, const char *field,
+                      const uint8_t **value, size_t *valueLength) {
+  size_t pos;
+  if (length >= 8 && memcmp(data, "OpusTags", 8) == 0) {
+    pos = 8;
+  } else if (length >= 7 && memcmp(data, "\x03vorbis", 7) == 0) {
+    pos = 7;
+  } else {
+    return false;
+  }
+
+  /* Vendor string, then the number of comments */
+  if (length - pos < 4) return false;
+  uint32_t vendorLength = read_le32(data + pos);
+  pos += 4;
+  if (length - pos < vendorLength) return false;
+  pos += vendorLength;
+  if (length - pos < 4) return false;
+  uint32_t count = read_le32(data + pos);
+  pos += 4;
+
+  size_t fieldLength = strlen(field);
+  for (uint32_t i = 0; i < count; i++) {
+    if (length - pos < 4) return false;
+    uint32_t commentLength = read_le32(data + pos);
+    pos += 4;
+    if (length - pos < commentLength) return false;
+    const uint8_t *comment = data + pos;
+    pos += commentLength;
+    if (commentLength > fieldLength && comment[fieldLength] == '=' &&
+        strncasecmp((const char *)comment, field, fieldLength) == 0) {
+      *value = comment + fieldLength + 1;
+      *valueLength = commentLength - fieldLength - 1;
+      return true;
+    }
+  }
+  return false;
+}
@@ -0,0 +1,120 @@
+//
+//  ASOggDemuxer.h
+//  AudioStreamer
+//
+
+#ifndef AS_OGG_DEMUXER_H
+#define AS_OGG_DEMUXER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Ogg page and packet demuxer.
+ *
+ * Bytes can be fed in chunks of any size. Pages are found by their capture
+ * pattern and checked against their CRC; a page which fails is skipped and
+ * the demuxer hunts for the next one. Packets are put back together from the
+ * lacing values, including packets continued across pages, and handed back
+ * one at a time. A packet which lies within one page points straight into the
+ * input (or the page buffer, if the page itself was split across reads); only
+ * packets spanning pages are copied, into a buffer which is reused.
+ *
+ * One logical stream is followed at a time. Whenever a new stream begins
+ * (each track of a chained stream, as Icecast sends them, is a new stream)
+ * the filter callback is shown its first packet and decides whether to follow
+ * it. Pages of any other stream are ignored.
+ *
+ * A few helpers at the end deal with the Opus and Vorbis headers carried in
+ * the first packets of a stream.
+ */
+
+typedef struct ogg_demuxer ogg_demuxer_t;
+
+typedef struct ogg_packet {
+  const uint8_t *data;
+  size_t         length;
+  uint32_t       serial;   /* logical stream the packet belongs to */
+  int64_t        granule;  /* the page's granule position if this is the last
+                              packet to end on the page, otherwise -1 */
+  bool           bos;      /* first packet of the stream */
+  bool           eos;      /* last packet of the stream */
+} ogg_packet_t;
+
+typedef struct ogg_stats {
+  uint64_t pages;           /* pages which passed their CRC */
+  uint64_t crcErrors;       /* pages which didn't */
+  uint64_t skippedBytes;    /* bytes discarded while looking for a page */
+  uint64_t lostPackets;     /* packets dropped because a page was missing */
+} ogg_stats_t;
+
+/* Decides whether to follow a new logical stream, given its first packet */
+typedef bool (*ogg_stream_filter)(void *context, uint32_t serial,
+                                  const uint8_t *data, size_t length);
+
+/* Receives each packet of the stream being followed. The packet is only
+   valid for the duration of the call */
+typedef void (*ogg_packet_callback)(void *context, const ogg_packet_t *packet);
+
+/* Largest packet which will be put back together from several pages */
+#define kOggMaxPacketSize (1 << 20)
+
+/* Creates a demuxer. Returns NULL if allocation fails */
+ogg_demuxer_t *ASOggDemuxerCreate(ogg_stream_filter filter,
+                                  ogg_packet_callback callback,
+                                  void *context);
+
+void ASOggDemuxerDestroy(ogg_demuxer_t *demuxer);
+
+/* Forgets everything, for a new stream */
+void ASOggDemuxerReset(ogg_demuxer_t *demuxer);
+
+/* Forgets any partial page or packet but keeps following the same logical
+   stream, for when reading carries on from somewhere else in it (a seek) */
+void ASOggDemuxerResync(ogg_demuxer_t *demuxer);
+
+/* Demuxes the next chunk of data, invoking the callbacks as packets are
+   found */
+void ASOggDemuxerParse(ogg_demuxer_t *demuxer, const uint8_t *bytes,
+                       size_t length);
+
+void ASOggDemuxerGetStats(const ogg_demuxer_t *demuxer, ogg_stats_t *stats);
+
+/* Codec helpers */
+
+typedef enum ogg_codec {
+  OGG_CODEC_UNKNOWN = 0,
+  OGG_CODEC_OPUS,
+  OGG_CODEC_VORBIS,
+  OGG_CODEC_FLAC
+} ogg_codec_t;
+
+typedef struct opus_head {
+  uint8_t  channels;
+  uint16_t preSkip;         /* samples at 48 kHz to drop from the start */
+  uint32_t inputSampleRate; /* informational only, Opus always decodes at 48 kHz */
+  int16_t  outputGain;      /* Q7.8 dB */
+  uint8_t  mappingFamily;
+} opus_head_t;
+
+/* Opus streams always run at this rate, and granule positions count it */
+#define kOpusSampleRate 48000
+
+/* Identifies the codec from the first packet of a stream */
+ogg_codec_t ASOggIdentifyCodec(const uint8_t *data, size_t length);
+
+/* Parses an OpusHead packet. Returns false if it isn't one */
+bool ASOggParseOpusHead(const uint8_t *data, size_t length, opus_head_t *head);
+
+/* Number of 48 kHz samples an Opus packet decodes to, or 0 if the packet is
+   malformed */
+uint32_t ASOggOpusPacketSamples(const uint8_t *data, size_t length);
+
+/* Looks up a field (such as "TITLE") in an OpusTags or Vorbis comment
+   packet. The field name is matched without regard to case. Returns false if
+   the field isn't there */
+bool ASOggFindComment(const uint8_t *data, size_t length, const char *field,
+                      const uint8_t **value, size_t *valueLength);
+
+#endif
@@ -0,0 +1,212 @@
+//
+//  ASOutputSink.c
+//  AudioStreamer
+//
+
+#include "ASOutputSink.h"
+#include "ASWAVWriter.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+void ASOutputSinkInit(output_sink_t *sink, const output_sink_ops_t *ops) {
+  sink->ops = ops;
+  sink->sampleRate = 0;
+  sink->channels = 0;
+  sink->frames = 0;
+}
+
+bool ASOutputSinkStart(output_sink_t *sink, uint32_t sampleRate,
+                       uint16_t channels) {
+  if (sink->sampleRate != 0 || sampleRate == 0 || channels == 0) return false;
+  if (!sink->ops->start(sink, sampleRate, channels)) return false;
+  sink->sampleRate = sampleRate;
+  sink->channels = channels;
+  return true;
+}
+
+bool ASOutputSinkWrite(output_sink_t *sink, const float *samples,
+                       size_t frames) {
+  if (sink->sampleRate == 0) return false;
+  if (frames == 0) return true;
+  if (!sink->ops->write(sink, samples, frames)) return false;
+  sink->frames += frames;
+  return true;
+}
+
+uint64_t ASOutputSinkFrameCount(const output_sink_t *sink) {
+  return sink->frames;
+}
+
+bool ASOutputSinkClose(output_sink_t *sink) {
+  if (sink == NULL) return false;
+  return sink->ops->close(sink);
+}
+
+/* WAV file */
+
+typedef struct wav_sink {
+  output_sink_t sink;
+  char         *path;
+  wav_writer_t *writer;
+} wav_sink_t;
+
+static bool wav_start(output_sink_t *sink, uint32_t sampleRate,
+                      uint16_t channels) {
+  wav_sink_t *wav = (wav_sink_t *)sink;
+  wav->writer = ASWAVWriterCreate(wav->path, sampleRate, channels);
+  return wav->writer != NULL;
+}
+
+static bool wav_write(output_sink_t *sink, const float *samples,
+                      size_t frames) {
+  wav_sink_t *wav = (wav_sink_t *)sink;
+  return ASWAVWriterWrite(wav->writer, samples, frames);
+}
+
+static bool wav_close(output_sink_t *sink) {
+  wav_sink_t *wav = (wav_sink_t *)sink;
+  /* A file which was never started was never created, so nothing failed */
+  bool ok = wav->writer == NULL || ASWAVWriterClose(wav->writer);
+  free(wav->path);
+  free(wav);
+  return ok;
+}
+
+static const output_sink_ops_t wav_ops = {
+  .start = wav_start,
+  .write = wav_write,
+  .close = wav_close,
+};
+
+output_sink_t *ASOutputSinkCreateWAV(const char *path) {
+  wav_sink_t *wav = calloc(1, sizeof(wav_sink_t));
+  if (wav == NULL) return NULL;
+  wav->path = strdup(path);
+  if (wav->path == NULL) {
+    free(wav);
+    return NULL;
+  }
+  ASOutputSinkInit(&wav->sink, &wav_ops);
+  return &wav->sink;
+}
+
+/* Callback */
+
+/* For sinks with nothing to get ready */
+static bool nothing_to_start(output_sink_t *sink, uint32_t sampleRate,
+                             uint16_t channels) {
+  (void)sink;
+  (void)sampleRate;
+  (void)channels;
+  return true;
+}
+
+/* For sinks with nothing to finish */
+static bool free_sink(output_sink_t *sink) {
+  free(sink);
+  return true;
+}
+
+typedef struct callback_sink {
+  output_sink_t    sink;
+  output_sink_proc proc;
+  void            *context;
+} callback_sink_t;
+
+static bool callback_write(output_sink_t *sink, const float *samples,
+                           size_t frames) {
+  callback_sink_t *callback = (callback_sink_t *)sink;
+  callback->proc(callback->context, samples, frames);
+  return true;
+}
+
+static const output_sink_ops_t callback_ops = {
+  .start = nothing_to_start,
+  .write = callback_write,
+  .close = free_sink,
+};
+
+output_sink_t *ASOutputSinkCreateCallback(output_sink_proc proc, void *context) {
+  callback_sink_t *callback = calloc(1, sizeof(callback_sink_t));
+  if (callback == NULL) return NULL;
+  ASOutputSinkInit(&callback->sink, &callback_ops);
+  callback->proc = proc;
+  callback->context = context;
+  return &callback->sink;
+}
+
+/* Null */
+
+static bool null_write(output_sink_t *sink, const float *samples,
+                       size_t frames) {
+  (void)sink;
+  (void)samples;
+  (void)frames;
+  return true;
+}
+
+static const output_sink_ops_t null_ops = {
+  .start = nothing_to_start,
+  .write = null_write,
+  .close = free_sink,
+};
+
+output_sink_t *ASOutputSinkCreateNull(void) {
+  output_sink_t *sink = calloc(1, sizeof(output_sink_t));
+  if (sink == NULL) return NULL;
+  ASOutputSinkInit(sink, &null_ops);
+  return sink;
+}
+
+/* Tee */
+
+typedef struct tee_sink {
+  output_sink_t  sink;
+  output_sink_t *first;
+  output_sink_t *second;
+} tee_sink_t;
+
+static bool tee_start(output_sink_t *sink, uint32_t sampleRate,
+                      uint16_t channels) {
+  tee_sink_t *tee = (tee_sink_t *)sink;
+  return ASOutputSinkStart(tee->first, sampleRate, channels) &&
+         ASOutputSinkStart(tee->second, sampleRate, channels);
+}
+
+static bool tee_write(output_sink_t *sink, const float *samples,
+                      size_t frames) {
+  tee_sink_t *tee = (tee_sink_t *)sink;
+  /* Both hear about every frame, even if the first fails */
+  bool first = ASOutputSinkWrite(tee->first, samples, frames);
+  bool second = ASOutputSinkWrite(tee->second, samples, frames);
+  return first && second;
+}
+
+static bool tee_close(output_sink_t *sink) {
+  tee_sink_t *tee = (tee_sink_t *)sink;
+  bool first = ASOutputSinkClose(tee->first);
+  bool second = ASOutputSinkClose(tee->second);
+  free(tee);
+  return first && second;
+}
+
+static const output_sink_ops_t tee_ops = {
+  .start = tee_start,
+  .write = tee_write,
+  .close = tee_close,
+};
+
+output_sink_t *ASOutputSinkCreateTee(output_sink_t *first,
+                                     output_sink_t *second) {
+  tee_sink_t *tee = calloc(1, sizeof(tee_sink_t));
+  if (tee == NULL) {
+    ASOutputSinkClose(first);
+    ASOutputSinkClose(second);
+    return NULL;
+  }
+  ASOutputSinkInit(&tee->sink, &tee_ops);
+  tee->first = first;
+  tee->second = second;
+  return &tee->sink;
+}
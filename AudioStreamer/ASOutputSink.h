@@ -0,0 +1,88 @@
+//
+//  ASOutputSink.h
+//  AudioStreamer
+//
+
+#ifndef AS_OUTPUT_SINK_H
+#define AS_OUTPUT_SINK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Where decoded audio goes when a stream is rendered instead of played.
+ *
+ * A sink is told the format once it's known, then given interleaved 32-bit
+ * float frames as they're decoded, as fast as they can be, and finally
+ * closed. Nothing about it needs an audio device, so the sinks here work the
+ * same on any platform: a WAV file, a callback, one which throws the audio
+ * away (for checking that a stream decodes, or timing how fast it does) and
+ * one which hands it to two others.
+ *
+ * Like ASTransport.h, each implementation fills in an output_sink_ops_t and
+ * embeds an output_sink_t as the first member of its own structure, so a
+ * sink of any other kind can be written through the same functions. A sink
+ * must only be used from one thread at a time.
+ *
+ * This is plain C without any CoreFoundation dependency.
+ */
+
+typedef struct output_sink output_sink_t;
+
+typedef struct output_sink_ops {
+  /* Gets ready for audio in the format. Returns false if it can't */
+  bool (*start)(output_sink_t *sink, uint32_t sampleRate, uint16_t channels);
+  /* Takes frames of samples, one per channel each. Returns false if they
+     couldn't be written */
+  bool (*write)(output_sink_t *sink, const float *samples, size_t frames);
+  /* Finishes up and frees the sink. Returns false if anything failed along
+     the way */
+  bool (*close)(output_sink_t *sink);
+} output_sink_ops_t;
+
+struct output_sink {
+  const output_sink_ops_t *ops;
+  uint32_t sampleRate;        /* 0 until started */
+  uint16_t channels;
+  uint64_t frames;            /* written so far */
+};
+
+/* Called with each run of frames written to a callback sink */
+typedef void (*output_sink_proc)(void *context, const float *samples,
+                                 size_t frames);
+
+/* Sets up the common part of a new sink */
+void ASOutputSinkInit(output_sink_t *sink, const output_sink_ops_t *ops);
+
+/* Writes 32-bit float WAV, see ASWAVWriter.h. The file is created when the
+   sink is started. Returns NULL if allocation fails */
+output_sink_t *ASOutputSinkCreateWAV(const char *path);
+
+/* Passes the frames on to a function */
+output_sink_t *ASOutputSinkCreateCallback(output_sink_proc proc, void *context);
+
+/* Counts the frames and drops them */
+output_sink_t *ASOutputSinkCreateNull(void);
+
+/* Writes to both sinks, which it then owns. Returns NULL, having closed
+   them, if allocation fails */
+output_sink_t *ASOutputSinkCreateTee(output_sink_t *first,
+                                     output_sink_t *second);
+
+/* Starts a sink. A sink which has been started can't be started again */
+bool ASOutputSinkStart(output_sink_t *sink, uint32_t sampleRate,
+                       uint16_t channels);
+
+/* Writes to a sink which has been started */
+bool ASOutputSinkWrite(output_sink_t *sink, const float *samples,
+                       size_t frames);
+
+/* Frames written so far */
+uint64_t ASOutputSinkFrameCount(const output_sink_t *sink);
+
+/* Closes and frees a sink, whether or not it was started. Returns false if
+   anything failed, in which case whatever it wrote may be incomplete */
+bool ASOutputSinkClose(output_sink_t *sink);
+
+#endif
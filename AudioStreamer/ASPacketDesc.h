@@ -0,0 +1,32 @@
+//
+//  ASPacketDesc.h
+//  AudioStreamer
+//
+
+#ifndef AS_PACKET_DESC_H
+#define AS_PACKET_DESC_H
+
+#include <stdint.h>
+
+/*
+ * Packet descriptions produced by the built-in parsers.
+ *
+ * The layout matches CoreAudio's AudioStreamPacketDescription, so an array of
+ * these can be handed to the same code which consumes packets produced by
+ * AudioFileStream. Keeping a copy of the definition here means the parsers
+ * themselves don't depend on any Apple framework.
+ */
+
+typedef struct as_packet_desc {
+  int64_t  startOffset;     /* from the start of the data pointer given */
+  uint32_t variableFrames;  /* 0 unless frames per packet vary */
+  uint32_t byteSize;
+} as_packet_desc_t;
+
+/* Receives a run of complete packets. The data and descriptions are only
+   valid for the duration of the call */
+typedef void (*as_packets_callback)(void *context, const void *data,
+                                    uint32_t byteCount, uint32_t packetCount,
+                                    const as_packet_desc_t *descs);
+
+#endif
@@ -0,0 +1,204 @@
+//
+//  ASPacketRing.c
+//  AudioStreamer
+//
+
+#include "ASPacketRing.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define kDefaultByteCapacity   (64 * 1024)
+#define kDefaultPacketCapacity 256
+
+typedef struct packet_ring_desc {
+  size_t   offset;
+  uint32_t byteSize;
+  uint32_t variableFrames;
+} packet_ring_desc_t;
+
+struct packet_ring {
+  /* Packet data. Live bytes run from the first packet's offset to 'tail',
+     possibly wrapping around the end of the buffer once */
+  uint8_t *bytes;
+  size_t   byteCapacity;
+  size_t   tail;         /* where the next packet is written */
+  size_t   byteCount;    /* payload bytes currently held */
+  bool     wrapped;      /* tail has wrapped behind the first packet */
+
+  /* Descriptors, a ring of its own */
+  packet_ring_desc_t *descs;
+  size_t descCapacity;
+  size_t descStart;
+  size_t descCount;
+};
+
+packet_ring_t *ASPacketRingCreate(size_t byteCapacity, size_t packetCapacity) {
+  packet_ring_t *ring = calloc(1, sizeof(packet_ring_t));
+  if (ring == NULL) return NULL;
+  ring->byteCapacity = byteCapacity > 0 ? byteCapacity : kDefaultByteCapacity;
+  ring->descCapacity = packetCapacity > 0 ? packetCapacity : kDefaultPacketCapacity;
+  ring->bytes = malloc(ring->byteCapacity);
+  ring->descs = malloc(ring->descCapacity * sizeof(packet_ring_desc_t));
+  if (ring->bytes == NULL || ring->descs == NULL) {
+    ASPacketRingDestroy(ring);
+    return NULL;
+  }
+  return ring;
+}
+
+void ASPacketRingDestroy(packet_ring_t *ring) {
+  if (ring == NULL) return;
+  free(ring->bytes);
+  free(ring->descs);
+  free(ring);
+}
+
+static inline packet_ring_desc_t *desc_at(const packet_ring_t *ring, size_t i) {
+  size_t idx = ring->descStart + i;
+  if (idx >= ring->descCapacity) idx -= ring->descCapacity;
+  return &ring->descs[idx];
+}
+
+static void reset_positions(packet_ring_t *ring) {
+  ring->tail = 0;
+  ring->byteCount = 0;
+  ring->wrapped = false;
+  ring->descStart = 0;
+  ring->descCount = 0;
+}
+
+/* Moves all packets into a new buffer of the given capacity, laid out in order
+   from offset 0 */
+static bool grow_bytes(packet_ring_t *ring, size_t needed) {
+  size_t capacity = ring->byteCapacity * 2;
+  while (capacity < needed) capacity *= 2;
+  uint8_t *bytes = malloc(capacity);
+  if (bytes == NULL) return false;
+
+  size_t pos = 0;
+  for (size_t i = 0; i < ring->descCount; i++) {
+    packet_ring_desc_t *desc = desc_at(ring, i);
+    memcpy(bytes + pos, ring->bytes + desc->offset, desc->byteSize);
+    desc->offset = pos;
+    pos += desc->byteSize;
+  }
+  free(ring->bytes);
+  ring->bytes = bytes;
+  ring->byteCapacity = capacity;
+  ring->tail = pos;
+  ring->wrapped = false;
+  return true;
+}
+
+static bool grow_descs(packet_ring_t *ring) {
+  size_t capacity = ring->descCapacity * 2;
+  packet_ring_desc_t *descs = malloc(capacity * sizeof(packet_ring_desc_t));
+  if (descs == NULL) return false;
+  for (size_t i = 0; i < ring->descCount; i++) {
+    descs[i] = *desc_at(ring, i);
+  }
+  free(ring->descs);
+  ring->descs = descs;
+  ring->descCapacity = capacity;
+  ring->descStart = 0;
+  return true;
+}
+
+/* Finds a contiguous spot for byteSize bytes, growing the buffer if needed */
+static bool reserve(packet_ring_t *ring, uint32_t byteSize, size_t *offset) {
+  if (ring->descCount == 0) {
+    reset_positions(ring);
+  }
+  size_t head = ring->descCount > 0 ? desc_at(ring, 0)->offset : 0;
+
+  if (!ring->wrapped) {
+    if (ring->tail + byteSize <= ring->byteCapacity) {
+      *offset = ring->tail;
+      return true;
+    }
+    /* Not enough room at the end, but maybe before the first packet */
+    if (ring->descCount > 0 && byteSize <= head) {
+      ring->wrapped = true;
+      *offset = 0;
+      return true;
+    }
+  } else if (ring->tail + byteSize <= head) {
+    *offset = ring->tail;
+    return true;
+  }
+
+  if (!grow_bytes(ring, ring->byteCount + byteSize)) return false;
+  *offset = ring->tail;
+  return true;
+}
+
+bool ASPacketRingPush(packet_ring_t *ring, const void *data, uint32_t byteSize,
+                      uint32_t variableFrames) {
+  if (ring->descCount == ring->descCapacity && !grow_descs(ring)) {
+    return false;
+  }
+  size_t offset;
+  if (!reserve(ring, byteSize, &offset)) return false;
+
+  memcpy(ring->bytes + offset, data, byteSize);
+  ring->tail = offset + byteSize;
+  ring->byteCount += byteSize;
+
+  packet_ring_desc_t *desc = desc_at(ring, ring->descCount);
+  desc->offset = offset;
+  desc->byteSize = byteSize;
+  desc->variableFrames = variableFrames;
+  ring->descCount++;
+  return true;
+}
+
+bool ASPacketRingPeek(const packet_ring_t *ring, packet_ring_entry_t *entry) {
+  if (ring == NULL || ring->descCount == 0) return false;
+  const packet_ring_desc_t *desc = desc_at(ring, 0);
+  entry->data = ring->bytes + desc->offset;
+  entry->byteSize = desc->byteSize;
+  entry->variableFrames = desc->variableFrames;
+  return true;
+}
+
+void ASPacketRingPop(packet_ring_t *ring) {
+  if (ring->descCount == 0) return;
+  packet_ring_desc_t *desc = desc_at(ring, 0);
+  size_t oldHead = desc->offset;
+  ring->byteCount -= desc->byteSize;
+  if (++ring->descStart == ring->descCapacity) ring->descStart = 0;
+  ring->descCount--;
+
+  if (ring->descCount == 0) {
+    reset_positions(ring);
+  } else if (ring->wrapped && desc_at(ring, 0)->offset < oldHead) {
+    /* The reader followed the writer back to the start of the buffer */
+    ring->wrapped = false;
+  }
+}
+
+void ASPacketRingConsume(packet_ring_t *ring, uint32_t byteCount) {
+  if (ring->descCount == 0) return;
+  packet_ring_desc_t *desc = desc_at(ring, 0);
+  if (byteCount >= desc->byteSize) {
+    ASPacketRingPop(ring);
+    return;
+  }
+  desc->offset += byteCount;
+  desc->byteSize -= byteCount;
+  ring->byteCount -= byteCount;
+}
+
+void ASPacketRingClear(packet_ring_t *ring) {
+  if (ring == NULL) return;
+  reset_positions(ring);
+}
+
+size_t ASPacketRingCount(const packet_ring_t *ring) {
+  return ring->descCount;
+}
+
+size_t ASPacketRingByteCount(const packet_ring_t *ring) {
+  return ring->byteCount;
+}
@@ -0,0 +1,73 @@
+//
+//  ASPacketRing.h
+//  AudioStreamer
+//
+
+#ifndef AS_PACKET_RING_H
+#define AS_PACKET_RING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A growable FIFO of audio packets.
+ *
+ * Packet data lives in one contiguous byte ring, and a parallel ring of small
+ * descriptors records where each packet starts and how large it is. Every
+ * packet is stored contiguously (a packet which would straddle the end of the
+ * byte ring is placed at its beginning instead) so a pointer to it can be
+ * handed straight to the code which copies packets into audio buffers.
+ *
+ * When either ring runs out of room it doubles in size, so once a stream has
+ * reached its steady state no further allocations happen. This replaces a
+ * malloc() and free() per queued packet.
+ *
+ * This is plain C without any CoreFoundation dependency.
+ */
+
+typedef struct packet_ring packet_ring_t;
+
+typedef struct packet_ring_entry {
+  const void *data;           /* start of the packet's bytes */
+  uint32_t    byteSize;       /* number of bytes in the packet */
+  uint32_t    variableFrames; /* mVariableFramesInPacket, 0 if not variable */
+} packet_ring_entry_t;
+
+/* Creates a ring with the given initial capacities. Either capacity may be 0
+   to use a default. Returns NULL if allocation fails. */
+packet_ring_t *ASPacketRingCreate(size_t byteCapacity, size_t packetCapacity);
+
+/* Frees the ring and all packets within it */
+void ASPacketRingDestroy(packet_ring_t *ring);
+
+/* Copies a packet onto the end of the ring. Returns false only if the ring
+   needed to grow and the allocation failed, in which case it is unchanged */
+bool ASPacketRingPush(packet_ring_t *ring, const void *data, uint32_t byteSize,
+                      uint32_t variableFrames);
+
+/* Fills in the oldest packet. Returns false if the ring is empty */
+bool ASPacketRingPeek(const packet_ring_t *ring, packet_ring_entry_t *entry);
+
+/* Removes the oldest packet */
+void ASPacketRingPop(packet_ring_t *ring);
+
+/* Removes the first byteCount bytes of the oldest packet, leaving the rest of
+   it at the front of the ring. Used for CBR data which can be split at any
+   byte. The whole packet is removed if byteCount covers all of it */
+void ASPacketRingConsume(packet_ring_t *ring, uint32_t byteCount);
+
+/* Drops every packet while keeping the allocated storage around for reuse */
+void ASPacketRingClear(packet_ring_t *ring);
+
+/* Number of packets in the ring */
+size_t ASPacketRingCount(const packet_ring_t *ring);
+
+/* Number of payload bytes held in the ring */
+size_t ASPacketRingByteCount(const packet_ring_t *ring);
+
+static inline bool ASPacketRingIsEmpty(const packet_ring_t *ring) {
+  return ring == NULL || ASPacketRingCount(ring) == 0;
+}
+
+#endif
@@ -29,6 +29,22 @@ @interface ASPlaylist : NSObject <AudioStreamerDelegate> {
   float volume;               /* volume for all streams on this playlist */
 
   NSInteger tries;            /* # of retry attempts */
+
+  /* Preloading of the next song */
+  AudioStreamer *preloadStream; /* stream for the next url, not yet playing */
+  BOOL preloadBitrateReady;   /* did preloadStream's bitrate become ready? */
+  NSTimer *preloadTimer;      /* checks whether it's time to preload */
+  BOOL preloadScheduled;      /* is preloadStream set to start at the splice? */
+  BOOL crossfading;           /* is preloadStream fading in over this one? */
+
+  /* Transition gap metrics */
+  CFAbsoluteTime transitionStart; /* when the last song was left, or 0 */
+  NSUInteger transitionCount;
+  double transitionGapTotal;  /* milliseconds, over all transitions */
+
+  /* Quality-of-service metrics */
+  AudioStreamerMetrics pastMetrics; /* totals of the streams done with */
+  NSTimer *metricsTimer;      /* calls the metricsHandler */
 }
 
 /** @name Properties */
@@ -56,6 +72,171 @@ @interface ASPlaylist : NSObject <AudioStreamerDelegate> {
  */
 @property (readonly) AudioStreamer *streamer;
 
+/**
+ * @brief How long before the end of a song to start loading the next one
+ *
+ * @details When the current song has this many seconds or fewer left to play,
+ * the next song in the playlist is connected to and buffered with
+ * <[AudioStreamer preload]>, so that it can start playing as soon as the
+ * current one finishes. Once all of the current song has been given to its
+ * audio queue, the next one is set to start on the frame after its last (see
+ * <[AudioStreamer playAtHostTime:]>), so songs with gapless info are joined
+ * with no gap at all. Songs whose duration isn't known (such as live
+ * streams) never cause a preload. The interval should be long enough to cover
+ * connecting and filling <[AudioStreamer bufferFillCountToStart]> buffers.
+ *
+ * Set to 0 to turn preloading off.
+ *
+ * Default: 0
+ */
+@property (readwrite) NSTimeInterval preloadInterval;
+
+/**
+ * @brief How long consecutive songs overlap, crossfading from one to the next
+ *
+ * @details When the current song has this many seconds left, the next song
+ * starts playing and the two are faded along equal-power curves (see
+ * <[AudioStreamer crossfadeInDuration:]>) so that the overall loudness stays
+ * level. The next song is preloaded in time for this whatever
+ * <preloadInterval> is. Songs whose duration isn't known are never faded out.
+ *
+ * Set to 0 to play songs one after another instead.
+ *
+ * Default: 0
+ */
+@property (readwrite) NSTimeInterval crossfadeDuration;
+
+/**
+ * @brief The most memory each song's stream uses for buffered audio, in bytes
+ *
+ * @details Sets <[AudioStreamer memoryBudget]> on each song's stream. While
+ * the next song is preloaded or crossfaded in there are two streams.
+ *
+ * Default: 0
+ */
+@property (readwrite) NSUInteger memoryBudget;
+
+/**
+ * @brief Milliseconds of audio to buffer before starting each song
+ *
+ * @details Sets <[AudioStreamer bufferDurationToStart]> and
+ * <[AudioStreamer adaptiveStart]> on each song's stream. 0 leaves streams
+ * starting on their default number of buffers.
+ *
+ * Default: 0
+ */
+@property (readwrite) UInt32 bufferDurationToStart;
+
+/**
+ * @brief Flag if to start each song as soon as its download can keep up
+ *
+ * @see [AudioStreamer adaptiveStart]
+ *
+ * Default: NO
+ */
+@property (readwrite) BOOL adaptiveStart;
+
+/**
+ * @brief Mirrors of a station's playlist requested at once
+ *
+ * @details Sets <[AudioStreamer mirrorRaceCount]> on each song's stream, for
+ * songs which are PLS or M3U playlists of a station's mirrors.
+ *
+ * Default: 3
+ */
+@property (readwrite) UInt32 mirrorRaceCount;
+
+/**
+ * @brief Seconds of a live stream kept to be paused and rewound within
+ *
+ * @see [AudioStreamer timeShiftDuration]
+ *
+ * Default: 0
+ */
+@property (readwrite) NSTimeInterval timeShiftDuration;
+
+/**
+ * @brief Flag if to play every song at the same loudness
+ *
+ * @details Sets <[AudioStreamer loudnessNormalization]> on each song's stream,
+ * aiming at the <loudnessTarget>. Takes effect from the next song to be
+ * started or preloaded.
+ *
+ * Default: NO
+ */
+@property (readwrite) BOOL loudnessNormalization;
+
+/**
+ * @brief The loudness to normalize songs to, in LUFS
+ *
+ * @see [AudioStreamer loudnessTarget]
+ *
+ * Default: -18
+ */
+@property (readwrite) double loudnessTarget;
+
+/**
+ * @brief CPU time spent fading the two songs of the last crossfade
+ *
+ * @details In milliseconds, for both songs together. This is 0 until there
+ * has been a crossfade.
+ */
+@property (readonly) double lastCrossfadeCPUTime;
+
+/**
+ * @brief The silence between the last two songs, in milliseconds
+ *
+ * @details Measured from when the previous song stopped to when the next one
+ * started playing, whether the previous song finished or <next> was invoked.
+ * This is 0 until there has been a transition.
+ */
+@property (readonly) double lastTransitionGap;
+
+/**
+ * @brief The average silence between songs, in milliseconds
+ *
+ * @see lastTransitionGap
+ */
+@property (readonly) double averageTransitionGap;
+
+/**
+ * @brief Flag if to take quality-of-service measurements of every song
+ *
+ * @details Set on each stream the playlist creates from then on (see
+ * <[AudioStreamer metricsEnabled]>).
+ *
+ * Default: NO
+ */
+@property (readwrite) BOOL metricsEnabled;
+
+/**
+ * @brief The measurements taken over all songs played so far
+ *
+ * @details Counts, times and bytes are totals over every song, including the
+ * current one. A preloaded song which was never played counts its downloaded
+ * bytes as wasted. The times to first byte and audio, and the throughput, are
+ * those of the current (or last) song.
+ */
+@property (readonly) AudioStreamerMetrics metrics;
+
+/**
+ * @brief How often to hand <metrics> to the <metricsHandler>, in seconds
+ *
+ * Default: 10
+ */
+@property (readwrite) NSTimeInterval metricsInterval;
+
+/**
+ * @brief A callback given the <metrics> every <metricsInterval> seconds
+ *
+ * @details Called on the main thread while a song is playing, if
+ * <metricsEnabled> is set.
+ *
+ * Default: nil
+ */
+@property (readwrite, copy) void (^metricsHandler)(ASPlaylist *sender,
+                                                   AudioStreamerMetrics metrics);
+
 /** @name Initializers */
 
 /**
@@ -14,6 +14,10 @@
 NSString * const ASStreamError       = @"ASStreamError";
 NSString * const ASAttemptingNewSong = @"ASAttemptingNewSong";
 
+/* Preloading for a crossfade starts this many seconds before it, to leave
+   time to connect and buffer */
+#define kCrossfadePreloadLead 10
+
 @implementation ASPlaylist
 
 // Backwards compatibility for subclasses.
@@ -27,6 +31,11 @@ - (instancetype)init {
 - (instancetype)initWithCapacity:(NSUInteger)capacity {
   if ((self = [super init])) {
     urls = [NSMutableArray arrayWithCapacity:capacity];
+    _metricsInterval = 10;
+    _loudnessTarget = -18;
+    _mirrorRaceCount = 3;
+    pastMetrics.timeToFirstByte = -1;
+    pastMetrics.timeToFirstAudio = -1;
   }
   return self;
 }
@@ -45,18 +54,84 @@ - (void)addSong:(NSURL*)url play:(BOOL)play {
 
 - (void)removeSongAtIndex:(NSUInteger)idx {
   [urls removeObjectAtIndex:idx];
+  if (idx == 0) {
+    [self cancelPreload];
+  }
 }
 
 - (void)clearSongList {
   [urls removeAllObjects];
+  [self cancelPreload];
+}
+
+/* Adds the metrics of a stream the playlist is done with to the totals */
+- (void)addPastMetrics:(AudioStreamer *)streamer played:(BOOL)played {
+  if (streamer == nil || ![streamer metricsEnabled]) return;
+  AudioStreamerMetrics metrics = [streamer metrics];
+  if (!played) {
+    pastMetrics.bytesDownloaded += metrics.bytesDownloaded;
+    pastMetrics.bytesWasted += metrics.bytesDownloaded;
+    return;
+  }
+  pastMetrics.timeToFirstByte = metrics.timeToFirstByte;
+  pastMetrics.timeToFirstAudio = metrics.timeToFirstAudio;
+  pastMetrics.rebufferCount += metrics.rebufferCount;
+  pastMetrics.stallTime += metrics.stallTime;
+  for (int i = 0; i < AS_METRICS_BUFFER_BINS; i++) {
+    pastMetrics.bufferOccupancy[i] += metrics.bufferOccupancy[i];
+  }
+  pastMetrics.bytesDownloaded += metrics.bytesDownloaded;
+  pastMetrics.throughput = metrics.throughput;
+  pastMetrics.bytesWasted += metrics.bytesWasted;
+  pastMetrics.reconnectCount += metrics.reconnectCount;
+}
+
+- (AudioStreamerMetrics)metrics {
+  AudioStreamerMetrics total = pastMetrics;
+  if (stream == nil || ![stream metricsEnabled]) return total;
+  AudioStreamerMetrics metrics = [stream metrics];
+  total.timeToFirstByte = metrics.timeToFirstByte;
+  total.timeToFirstAudio = metrics.timeToFirstAudio;
+  total.rebufferCount += metrics.rebufferCount;
+  total.stallTime += metrics.stallTime;
+  for (int i = 0; i < AS_METRICS_BUFFER_BINS; i++) {
+    total.bufferOccupancy[i] += metrics.bufferOccupancy[i];
+  }
+  total.bytesDownloaded += metrics.bytesDownloaded;
+  total.throughput = metrics.throughput;
+  total.bytesWasted += metrics.bytesWasted;
+  total.reconnectCount += metrics.reconnectCount;
+  return total;
+}
+
+- (void)reportMetrics {
+  if (_metricsHandler != nil) {
+    _metricsHandler(self, [self metrics]);
+  }
+}
+
+/* Creates a stream set up the way the playlist wants it */
+- (AudioStreamer *)streamForURL:(NSURL *)url {
+  AudioStreamer *streamer = [AudioStreamer streamWithURL:url];
+  [streamer setDelegate:self];
+  [streamer setEqualPowerFades:_crossfadeDuration > 0];
+  [streamer setLoudnessNormalization:_loudnessNormalization];
+  [streamer setLoudnessTarget:_loudnessTarget];
+  [streamer setMemoryBudget:_memoryBudget];
+  [streamer setBufferDurationToStart:_bufferDurationToStart];
+  [streamer setAdaptiveStart:_adaptiveStart];
+  [streamer setMirrorRaceCount:_mirrorRaceCount];
+  [streamer setTimeShiftDuration:_timeShiftDuration];
+  [streamer setMetricsEnabled:_metricsEnabled];
+  return streamer;
 }
 
 - (void)setAudioStream {
   if (stream != nil) {
     [stream stop];
+    [self addPastMetrics:stream played:YES];
   }
-  stream = [AudioStreamer streamWithURL:_playingURL];
-  [stream setDelegate:self];
+  stream = [self streamForURL:_playingURL];
   [[NSNotificationCenter defaultCenter]
         postNotificationName:ASCreatedNewStream
                       object:self
@@ -64,7 +139,105 @@ - (void)setAudioStream {
   volumeSet = [stream setVolume:volume];
 }
 
+/* Starts loading the next song if the current one is close enough to its
+   end, and once it's loaded, starts it playing at the right moment */
+- (void)checkPreload {
+  if (preloadStream != nil) {
+    [self checkTransition];
+    return;
+  }
+  if (stream == nil || [urls count] == 0) return;
+  double duration, progress;
+  if (![stream duration:&duration] || ![stream progress:&progress]) return;
+  double lead = _preloadInterval;
+  if (_crossfadeDuration > 0) {
+    lead = MAX(lead, _crossfadeDuration + kCrossfadePreloadLead);
+  }
+  if (duration - progress > lead) return;
+
+  preloadStream = [self streamForURL:urls[0]];
+  preloadBitrateReady = NO;
+  [preloadStream preload];
+}
+
+/* Starts the preloaded song fading in once the current one has
+   crossfadeDuration left, or otherwise on the frame after its last */
+- (void)checkTransition {
+  if (preloadScheduled || ![preloadStream isPreloaded]) return;
+  if (_crossfadeDuration > 0) {
+    [self checkCrossfade];
+    return;
+  }
+  UInt64 endTime;
+  if (![stream endHostTime:&endTime]) return;
+  [preloadStream setVolume:volume];
+  preloadScheduled = [preloadStream playAtHostTime:endTime];
+}
+
+- (void)checkCrossfade {
+  double duration, progress;
+  if (![stream duration:&duration] || ![stream progress:&progress]) return;
+  double remaining = duration - progress;
+  if (remaining > _crossfadeDuration) return;
+
+  /* Streams without a processing tap ramp their volume instead */
+  if (![stream crossfadeOutDuration:remaining]) {
+    [stream fadeOutDuration:(float)remaining];
+  }
+  [preloadStream setVolume:volume];
+  if (![preloadStream crossfadeInDuration:remaining]) {
+    [preloadStream fadeInDuration:(float)remaining];
+  }
+  preloadScheduled = [preloadStream play];
+  crossfading = preloadScheduled;
+}
+
+- (void)cancelPreload {
+  [preloadStream setDelegate:nil];
+  [preloadStream stop];
+  [self addPastMetrics:preloadStream played:NO];
+  preloadStream = nil;
+  preloadScheduled = NO;
+  crossfading = NO;
+}
+
+/* Drops a preloaded stream which failed, unless it has since been replaced */
+- (void)dropPreload:(AudioStreamer *)preloaded {
+  if (preloaded == preloadStream) {
+    [self cancelPreload];
+  }
+}
+
+/* Makes the preloaded stream the current one, if it's for the url about to be
+   played and hasn't failed */
+- (BOOL)takePreloadedStream {
+  AudioStreamer *preloaded = preloadStream;
+  preloadStream = nil;
+  preloadScheduled = NO;
+  crossfading = NO;
+  if (preloaded == nil) return NO;
+  if (![[preloaded url] isEqual:_playingURL] || [preloaded isDone]) {
+    [preloaded setDelegate:nil];
+    [preloaded stop];
+    [self addPastMetrics:preloaded played:NO];
+    return NO;
+  }
+
+  stream = preloaded;
+  [[NSNotificationCenter defaultCenter]
+        postNotificationName:ASCreatedNewStream
+                      object:self
+                    userInfo:@{@"stream": stream}];
+  volumeSet = [stream setVolume:volume];
+  return YES;
+}
+
 - (void)streamerBitrateIsReady:(AudioStreamer *)sender {
+  if (sender == preloadStream) {
+    /* Announced once the song actually starts playing */
+    preloadBitrateReady = YES;
+    return;
+  }
   NSAssert(sender == stream,
            @"Should only receive delegate calls for the current stream");
 
@@ -82,12 +255,23 @@ - (void)streamerBitrateIsReady:(AudioStreamer *)sender {
 }
 
 - (void)streamerStatusDidChange:(AudioStreamer *)sender {
+  if (sender == preloadStream) {
+    /* If it failed, the song is loaded again normally when its turn comes */
+    if ([sender isDone]) {
+      [self performSelector:@selector(dropPreload:) withObject:sender afterDelay:0];
+    }
+    return;
+  }
   NSAssert(sender == stream,
            @"Should only receive delegate calls for the current stream");
   if (!volumeSet) {
     volumeSet = [sender setVolume:volume];
   }
 
+  if (transitionStart != 0 && [sender isPlaying]) {
+    [self recordTransitionGap];
+  }
+
   if (stopping) {
     return;
   } else if ([self isError]) {
@@ -125,6 +309,13 @@ finally give up and clear our cache of urls (see below) */
   }
 }
 
+- (void)recordTransitionGap {
+  _lastTransitionGap = (CFAbsoluteTimeGetCurrent() - transitionStart) * 1000.0;
+  transitionGapTotal += _lastTransitionGap;
+  transitionCount++;
+  transitionStart = 0;
+}
+
 - (void)retry {
   if (tries > 2) {
     /* too many retries means just skip to the next song */
@@ -145,6 +336,7 @@ - (void)play {
   }
 
   if ([urls count] == 0) {
+    transitionStart = 0;
     [[NSNotificationCenter defaultCenter]
           postNotificationName:ASNoSongsLeft
                         object:self];
@@ -153,14 +345,43 @@ - (void)play {
 
   _playingURL = urls[0];
   [urls removeObjectAtIndex:0];
-  [self setAudioStream];
+  BOOL preloaded = [self takePreloadedStream];
+  if (!preloaded) {
+    [self setAudioStream];
+  }
   tries = 0;
 
   [[NSNotificationCenter defaultCenter]
         postNotificationName:ASAttemptingNewSong
                       object:self];
 
-  [stream start];
+  if (preloaded) {
+    /* A stream spliced onto the end of the last one is already playing */
+    if (![stream play] && [stream isPlaying] && transitionStart != 0) {
+      [self recordTransitionGap];
+    }
+    if (preloadBitrateReady) {
+      [self streamerBitrateIsReady:stream];
+    }
+  } else {
+    [stream start];
+  }
+
+  if ((_preloadInterval > 0 || _crossfadeDuration > 0) && preloadTimer == nil) {
+    preloadTimer = [NSTimer scheduledTimerWithTimeInterval:0.25
+                                                    target:self
+                                                  selector:@selector(checkPreload)
+                                                  userInfo:nil
+                                                   repeats:YES];
+  }
+  if (_metricsEnabled && _metricsHandler != nil && _metricsInterval > 0 &&
+      metricsTimer == nil) {
+    metricsTimer = [NSTimer scheduledTimerWithTimeInterval:_metricsInterval
+                                                    target:self
+                                                  selector:@selector(reportMetrics)
+                                                  userInfo:nil
+                                                   repeats:YES];
+  }
 
   if ([urls count] < 2) {
     [[NSNotificationCenter defaultCenter]
@@ -170,6 +391,10 @@ - (void)play {
 }
 
 - (void)pause {
+  /* The splice time no longer holds */
+  if (preloadScheduled) {
+    [self cancelPreload];
+  }
   [stream pause];
 }
 
@@ -197,20 +422,40 @@ - (BOOL)duration:(double*)ret {
   return [stream duration:ret];
 }
 
+- (double)averageTransitionGap {
+  if (transitionCount == 0) return 0;
+  return transitionGapTotal / transitionCount;
+}
+
 - (void)next {
   assert(!nexting);
   nexting = YES;
+  transitionStart = CFAbsoluteTimeGetCurrent();
   lastKnownSeekTime = 0;
   retrying = FALSE;
+  BOOL crossfaded = crossfading;
+  double fadeTime = [stream fadeProcessingTime];
   [self stop];
   [self play];
+  if (crossfaded) {
+    _lastCrossfadeCPUTime = fadeTime + [stream fadeProcessingTime];
+  }
   nexting = NO;
 }
 
 - (void)stop {
   assert(!stopping);
   stopping = YES;
+  [preloadTimer invalidate];
+  preloadTimer = nil;
+  [metricsTimer invalidate];
+  metricsTimer = nil;
+  /* Moving on to the next song is what the preloaded stream is for */
+  if (!nexting) {
+    [self cancelPreload];
+  }
   [stream stop];
+  [self addPastMetrics:stream played:YES];
   stream = nil;
   _playingURL = nil;
   stopping = NO;
@@ -0,0 +1,85 @@
+//
+//  ASSPSCQueue.c
+//  AudioStreamer
+//
+
+#include "ASSPSCQueue.h"
+
+#include <stdatomic.h>
+#include <stdlib.h>
+
+/* Keeps the two indices on separate cache lines, so the threads don't keep
+   taking the line from each other */
+#define kCacheLineSize 64
+
+struct spsc_queue {
+  size_t mask;          /* capacity - 1, the capacity being a power of two */
+  void **items;
+
+  _Alignas(kCacheLineSize) atomic_size_t head; /* next to pop */
+  size_t cachedTail;    /* consumer's last look at tail */
+
+  _Alignas(kCacheLineSize) atomic_size_t tail; /* next to push */
+  size_t cachedHead;    /* producer's last look at head */
+};
+
+spsc_queue_t *ASSPSCQueueCreate(size_t capacity) {
+  size_t size = 2;
+  while (size < capacity) {
+    size *= 2;
+    if (size == 0) return NULL;
+  }
+
+  spsc_queue_t *queue;
+  if (posix_memalign((void **)&queue, kCacheLineSize, sizeof(*queue)) != 0) {
+    return NULL;
+  }
+  queue->items = calloc(size, sizeof(void *));
+  if (queue->items == NULL) {
+    free(queue);
+    return NULL;
+  }
+  queue->mask = size - 1;
+  atomic_init(&queue->head, 0);
+  atomic_init(&queue->tail, 0);
+  queue->cachedTail = 0;
+  queue->cachedHead = 0;
+  return queue;
+}
+
+void ASSPSCQueueDestroy(spsc_queue_t *queue) {
+  if (queue == NULL) return;
+  free(queue->items);
+  free(queue);
+}
+
+bool ASSPSCQueuePush(spsc_queue_t *queue, void *item) {
+  size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+  if (tail - queue->cachedHead > queue->mask) {
+    /* Looks full; see how far the consumer has got since */
+    queue->cachedHead = atomic_load_explicit(&queue->head,
+                                             memory_order_acquire);
+    if (tail - queue->cachedHead > queue->mask) return false;
+  }
+  queue->items[tail & queue->mask] = item;
+  atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+  return true;
+}
+
+bool ASSPSCQueuePop(spsc_queue_t *queue, void **item) {
+  size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+  if (head == queue->cachedTail) {
+    queue->cachedTail = atomic_load_explicit(&queue->tail,
+                                             memory_order_acquire);
+    if (head == queue->cachedTail) return false;
+  }
+  *item = queue->items[head & queue->mask];
+  atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+  return true;
+}
+
+size_t ASSPSCQueueCount(const spsc_queue_t *queue) {
+  size_t head = atomic_load_explicit(&queue->head, memory_order_acquire);
+  size_t tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+  return tail - head;
+}
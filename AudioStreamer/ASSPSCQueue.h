@@ -0,0 +1,45 @@
+//
+//  ASSPSCQueue.h
+//  AudioStreamer
+//
+
+#ifndef AS_SPSC_QUEUE_H
+#define AS_SPSC_QUEUE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * A bounded, lock-free FIFO of pointers between exactly two threads.
+ *
+ * One thread only ever pushes and the other only ever pops, so neither ever
+ * waits on the other: the producer owns the tail index and the consumer owns
+ * the head, and each publishes its own index to the other with release
+ * ordering. This is what the audio queue's thread uses to hand played buffers
+ * back to the thread which fills them, where taking a lock could hold up
+ * playback.
+ *
+ * This is plain C without any CoreFoundation dependency.
+ */
+
+typedef struct spsc_queue spsc_queue_t;
+
+/* Creates a queue holding at least capacity items. Returns NULL if
+   allocation fails */
+spsc_queue_t *ASSPSCQueueCreate(size_t capacity);
+
+void ASSPSCQueueDestroy(spsc_queue_t *queue);
+
+/* Adds an item on the end of the queue. Producer thread only. Returns false
+   if the queue is full */
+bool ASSPSCQueuePush(spsc_queue_t *queue, void *item);
+
+/* Takes the oldest item off the queue. Consumer thread only. Returns false if
+   the queue is empty */
+bool ASSPSCQueuePop(spsc_queue_t *queue, void **item);
+
+/* Number of items in the queue. Exact from either thread when the other one
+   is idle, otherwise a snapshot */
+size_t ASSPSCQueueCount(const spsc_queue_t *queue);
+
+#endif
@@ -0,0 +1,450 @@
+//
+//  ASSeekIndex.c
+//  AudioStreamer
+//
+
+#include "ASSeekIndex.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Enough to hold the first frame of any MPEG audio stream along with a VBRI
+   table of a sensible size */
+#define kHeaderWindowSize 8192
+
+struct seek_index {
+  /* Received packets, one point every kSeekPointInterval packets */
+  seek_point_t *points;
+  size_t        pointCount;
+  size_t        pointCapacity;
+  uint64_t      receivedPackets; /* packets [0, receivedPackets) are known */
+  uint64_t      receivedBytes;   /* where packet receivedPackets starts */
+
+  /* VBRI table, converted to points */
+  seek_point_t *tablePoints;
+  size_t        tablePointCount;
+
+  /* Xing/Info header */
+  bool     hasTOC;
+  uint8_t  toc[100];
+  uint64_t headerPackets;
+  uint64_t headerBytes;
+  uint64_t audioByteCount;
+  uint32_t headerFrameLength; /* length of the frame holding the header */
+  bool     firstPacketIsHeader;
+
+  /* LAME tag following the Xing/Info header */
+  bool     hasEncoderDelay;
+  uint32_t encoderDelay;
+  uint32_t encoderPadding;
+
+  /* Window of raw bytes used to find the header */
+  bool     headerDone;
+  bool     dataOffsetKnown;
+  uint64_t dataOffset;
+  uint64_t windowStart;
+  size_t   windowLength;
+  uint8_t  window[kHeaderWindowSize];
+};
+
+seek_index_t *ASSeekIndexCreate(void) {
+  seek_index_t *index = calloc(1, sizeof(seek_index_t));
+  if (index == NULL) return NULL;
+  ASSeekIndexReset(index);
+  return index;
+}
+
+void ASSeekIndexDestroy(seek_index_t *index) {
+  if (index == NULL) return;
+  free(index->points);
+  free(index->tablePoints);
+  free(index);
+}
+
+void ASSeekIndexReset(seek_index_t *index) {
+  index->pointCount = 0;
+  index->receivedPackets = 0;
+  index->receivedBytes = 0;
+  free(index->tablePoints);
+  index->tablePoints = NULL;
+  index->tablePointCount = 0;
+  index->hasTOC = false;
+  index->headerPackets = 0;
+  index->headerBytes = 0;
+  index->audioByteCount = 0;
+  index->headerFrameLength = 0;
+  index->firstPacketIsHeader = false;
+  index->hasEncoderDelay = false;
+  index->encoderDelay = 0;
+  index->encoderPadding = 0;
+  index->headerDone = false;
+  index->dataOffsetKnown = false;
+  index->dataOffset = 0;
+  index->windowStart = 0;
+  index->windowLength = 0;
+}
+
+void ASSeekIndexSetDataOffset(seek_index_t *index, uint64_t dataOffset) {
+  index->dataOffset = dataOffset;
+  index->dataOffsetKnown = true;
+}
+
+void ASSeekIndexSetAudioByteCount(seek_index_t *index, uint64_t byteCount) {
+  index->audioByteCount = byteCount;
+}
+
+uint64_t ASSeekIndexPacketCount(const seek_index_t *index) {
+  return index->headerPackets;
+}
+
+uint64_t ASSeekIndexByteCount(const seek_index_t *index) {
+  return index->headerBytes;
+}
+
+bool ASSeekIndexEncoderDelay(const seek_index_t *index, uint32_t *delay,
+                             uint32_t *padding) {
+  if (!index->hasEncoderDelay) return false;
+  *delay = index->encoderDelay;
+  *padding = index->encoderPadding;
+  return true;
+}
+
+bool ASSeekIndexFirstPacketIsHeader(const seek_index_t *index) {
+  return index->firstPacketIsHeader;
+}
+
+static inline uint32_t be16(const uint8_t *b) {
+  return ((uint32_t)b[0] << 8) | b[1];
+}
+
+static inline uint32_t be32(const uint8_t *b) {
+  return ((uint32_t)b[0] << 24) | ((uint32_t)b[1] << 16) |
+         ((uint32_t)b[2] << 8)  |  (uint32_t)b[3];
+}
+
+typedef enum header_result {
+  HEADER_NEED_MORE = 0,
+  HEADER_FOUND,
+  HEADER_NONE
+} header_result_t;
+
+/* The LAME tag's encoder delay and padding are 12 bits each, this far into
+   the tag */
+#define kLAMEDelayOffset 21
+#define kLAMETagSize     24
+
+/* room is how much of the frame is left from p, so that a LAME tag is only
+   waited for if the frame is big enough to hold one */
+static header_result_t parse_xing(seek_index_t *index, const uint8_t *p,
+                                  size_t length, size_t room) {
+  size_t pos = 8;
+  if (length < pos) return HEADER_NEED_MORE;
+  uint32_t flags = be32(p + 4);
+  size_t lame = pos + ((flags & 0x1) ? 4 : 0) + ((flags & 0x2) ? 4 : 0) +
+                ((flags & 0x4) ? 100 : 0) + ((flags & 0x8) ? 4 : 0);
+  size_t needed = lame + kLAMETagSize <= room ? lame + kLAMETagSize : lame;
+  if (length < needed) return HEADER_NEED_MORE;
+
+  if (flags & 0x1) {
+    index->headerPackets = be32(p + pos);
+    pos += 4;
+  }
+  if (flags & 0x2) {
+    index->headerBytes = be32(p + pos);
+    pos += 4;
+  }
+  if (flags & 0x4) {
+    memcpy(index->toc, p + pos, sizeof(index->toc));
+    /* Tables which aren't in increasing order are garbage */
+    index->hasTOC = true;
+    for (int i = 1; i < 100; i++) {
+      if (index->toc[i] < index->toc[i - 1]) index->hasTOC = false;
+    }
+  }
+  /* LAME and ffmpeg (which writes "Lavc"/"Lavf") fill in the tag */
+  if (needed > lame && (memcmp(p + lame, "LAME", 4) == 0 ||
+                        memcmp(p + lame, "Lav", 3) == 0)) {
+    const uint8_t *d = p + lame + kLAMEDelayOffset;
+    index->encoderDelay = ((uint32_t)d[0] << 4) | (d[1] >> 4);
+    index->encoderPadding = ((uint32_t)(d[1] & 0xF) << 8) | d[2];
+    index->hasEncoderDelay = true;
+  }
+  return HEADER_FOUND;
+}
+
+static header_result_t parse_vbri(seek_index_t *index, const uint8_t *p,
+                                  size_t length) {
+  if (length < 26) return HEADER_NEED_MORE;
+  uint64_t bytes = be32(p + 10);
+  uint64_t frames = be32(p + 14);
+  uint32_t entries = be16(p + 18);
+  uint32_t scale = be16(p + 20);
+  uint32_t entrySize = be16(p + 22);
+  uint32_t framesPerEntry = be16(p + 24);
+  index->headerPackets = frames;
+  index->headerBytes = bytes;
+
+  if (entries == 0 || entrySize == 0 || entrySize > 4 || framesPerEntry == 0) {
+    return HEADER_FOUND;
+  }
+  size_t needed = 26 + (size_t)entries * entrySize;
+  if (needed + 4 + 32 > kHeaderWindowSize) return HEADER_FOUND;
+  if (length < needed) return HEADER_NEED_MORE;
+
+  index->tablePoints = malloc(entries * sizeof(seek_point_t));
+  if (index->tablePoints == NULL) return HEADER_FOUND;
+  const uint8_t *entry = p + 26;
+  uint64_t offset = 0;
+  for (uint32_t i = 0; i < entries; i++, entry += entrySize) {
+    index->tablePoints[i].packet = (uint64_t)i * framesPerEntry;
+    index->tablePoints[i].byteOffset = offset;
+    uint32_t size = 0;
+    for (uint32_t b = 0; b < entrySize; b++) size = (size << 8) | entry[b];
+    offset += (uint64_t)size * scale;
+  }
+  index->tablePointCount = entries;
+  return HEADER_FOUND;
+}
+
+/* Layer III bitrates in kbit/s, MPEG 1 and then MPEG 2/2.5 */
+static const uint16_t kBitrates[2][15] = {
+  {0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320},
+  {0,  8, 16, 24, 32, 40, 48, 56,  64,  80,  96, 112, 128, 144, 160}
+};
+
+static const uint32_t kSampleRates[4][3] = {
+  {11025, 12000,  8000},  /* MPEG 2.5 */
+  {    0,     0,     0},  /* reserved */
+  {22050, 24000, 16000},  /* MPEG 2 */
+  {44100, 48000, 32000}   /* MPEG 1 */
+};
+
+typedef enum tag_type {
+  TAG_NEED_MORE = 0,
+  TAG_NONE,
+  TAG_XING,
+  TAG_VBRI
+} tag_type_t;
+
+/* Works out which header, if any, the layer III frame at p carries. The tag
+   starts at *tagOffset within the frame and the frame's length (0 for free
+   format) goes in *frameLength */
+static tag_type_t find_tag(const uint8_t *p, size_t length, size_t *tagOffset,
+                           uint32_t *frameLength) {
+  if (length < 4) return TAG_NEED_MORE;
+  if (p[0] != 0xFF || (p[1] & 0xE0) != 0xE0) return TAG_NONE;
+
+  uint8_t version = (p[1] >> 3) & 0x3;  /* 3 = MPEG 1, 2 = MPEG 2, 0 = 2.5 */
+  uint8_t layer = (p[1] >> 1) & 0x3;    /* 1 = layer III */
+  uint8_t bitrateIndex = p[2] >> 4;
+  uint8_t rateIndex = (p[2] >> 2) & 0x3;
+  bool mono = ((p[3] >> 6) & 0x3) == 3;
+  if (version == 1 || layer != 1 || bitrateIndex == 15 || rateIndex == 3) {
+    return TAG_NONE;
+  }
+  bool mpeg1 = version == 3;
+  uint32_t bitrate = kBitrates[mpeg1 ? 0 : 1][bitrateIndex] * 1000;
+  uint32_t rate = kSampleRates[version][rateIndex];
+  *frameLength = bitrate == 0 ? 0 :
+                 (mpeg1 ? 144 : 72) * bitrate / rate + ((p[2] >> 1) & 0x1);
+
+  size_t sideInfo = mpeg1 ? (mono ? 17 : 32) : (mono ? 9 : 17);
+  size_t xing = 4 + sideInfo;
+  if (length < xing + 4) return TAG_NEED_MORE;
+  if (memcmp(p + xing, "Xing", 4) == 0 || memcmp(p + xing, "Info", 4) == 0) {
+    *tagOffset = xing;
+    return TAG_XING;
+  }
+
+  /* VBRI always sits 32 bytes after the frame header */
+  size_t vbri = 4 + 32;
+  if (length < vbri + 4) return TAG_NEED_MORE;
+  if (memcmp(p + vbri, "VBRI", 4) == 0) {
+    *tagOffset = vbri;
+    return TAG_VBRI;
+  }
+  return TAG_NONE;
+}
+
+/* Looks for a Xing/Info or VBRI header in the frame at the start of p */
+static header_result_t parse_header(seek_index_t *index, const uint8_t *p,
+                                    size_t length) {
+  size_t offset;
+  uint32_t frameLength;
+  header_result_t result;
+  switch (find_tag(p, length, &offset, &frameLength)) {
+    case TAG_NEED_MORE: return HEADER_NEED_MORE;
+    case TAG_NONE:
+    default:            return HEADER_NONE;
+    case TAG_XING:
+      result = parse_xing(index, p + offset, length - offset,
+                          frameLength > offset ? frameLength - offset : SIZE_MAX);
+      break;
+    case TAG_VBRI:
+      result = parse_vbri(index, p + offset, length - offset);
+      break;
+  }
+  if (result == HEADER_FOUND) index->headerFrameLength = frameLength;
+  return result;
+}
+
+void ASSeekIndexSetFirstPacket(seek_index_t *index, const uint8_t *data,
+                               size_t length) {
+  size_t offset;
+  uint32_t frameLength;
+  tag_type_t tag = find_tag(data, length, &offset, &frameLength);
+  index->firstPacketIsHeader = tag == TAG_XING || tag == TAG_VBRI;
+}
+
+static void window_append(seek_index_t *index, uint64_t fileOffset,
+                          const uint8_t *bytes, size_t length) {
+  if (fileOffset != index->windowStart + index->windowLength) {
+    index->windowStart = fileOffset;
+    index->windowLength = 0;
+  }
+  if (length >= kHeaderWindowSize) {
+    size_t skip = length - kHeaderWindowSize;
+    memcpy(index->window, bytes + skip, kHeaderWindowSize);
+    index->windowStart = fileOffset + skip;
+    index->windowLength = kHeaderWindowSize;
+    return;
+  }
+  size_t total = index->windowLength + length;
+  if (total > kHeaderWindowSize) {
+    size_t drop = total - kHeaderWindowSize;
+    memmove(index->window, index->window + drop, index->windowLength - drop);
+    index->windowStart += drop;
+    index->windowLength -= drop;
+  }
+  memcpy(index->window + index->windowLength, bytes, length);
+  index->windowLength += length;
+}
+
+bool ASSeekIndexScanHeader(seek_index_t *index, uint64_t fileOffset,
+                           const uint8_t *bytes, size_t length) {
+  if (index->headerDone) return true;
+
+  /* Until the data offset is known the header could be anywhere ahead, so
+     the most recent bytes are kept around. Once it is known, only the bytes
+     from there on matter */
+  if (index->dataOffsetKnown) {
+    if (fileOffset + length <= index->dataOffset) return false;
+    if (fileOffset < index->dataOffset) {
+      size_t skip = (size_t)(index->dataOffset - fileOffset);
+      bytes += skip;
+      length -= skip;
+      fileOffset = index->dataOffset;
+    }
+  }
+  if (length > 0) window_append(index, fileOffset, bytes, length);
+  if (!index->dataOffsetKnown) return false;
+
+  if (index->dataOffset < index->windowStart) {
+    /* The start of the audio data went by unseen */
+    index->headerDone = true;
+    return true;
+  }
+  if (index->dataOffset >= index->windowStart + index->windowLength) {
+    return false;
+  }
+
+  size_t start = (size_t)(index->dataOffset - index->windowStart);
+  header_result_t result = parse_header(index, index->window + start,
+                                        index->windowLength - start);
+  if (result == HEADER_NEED_MORE &&
+      (start > 0 || index->windowLength < kHeaderWindowSize)) {
+    /* Make room so the whole header can fit */
+    memmove(index->window, index->window + start, index->windowLength - start);
+    index->windowStart += start;
+    index->windowLength -= start;
+    return false;
+  }
+  index->headerDone = true;
+  index->windowLength = 0;
+  return true;
+}
+
+void ASSeekIndexAddPacket(seek_index_t *index, uint64_t packet,
+                          uint32_t byteSize) {
+  if (packet != index->receivedPackets) return;
+  uint64_t byteOffset = index->receivedBytes;
+  index->receivedPackets++;
+  index->receivedBytes += byteSize;
+  if (packet % kSeekPointInterval != 0) return;
+
+  if (index->pointCount == index->pointCapacity) {
+    size_t capacity = index->pointCapacity > 0 ? index->pointCapacity * 2 : 1024;
+    seek_point_t *points = realloc(index->points, capacity * sizeof(seek_point_t));
+    if (points == NULL) {
+      /* Stop indexing, what's there is still correct */
+      index->receivedPackets = packet;
+      index->receivedBytes = byteOffset;
+      return;
+    }
+    index->points = points;
+    index->pointCapacity = capacity;
+  }
+  index->points[index->pointCount].packet = packet;
+  index->points[index->pointCount].byteOffset = byteOffset;
+  index->pointCount++;
+}
+
+/* Finds the last point at or before the packet, the table must be sorted */
+static const seek_point_t *search(const seek_point_t *points, size_t count,
+                                  uint64_t packet) {
+  if (count == 0 || points[0].packet > packet) return NULL;
+  size_t lo = 0;
+  size_t hi = count;
+  while (hi - lo > 1) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (points[mid].packet <= packet) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+  return &points[lo];
+}
+
+bool ASSeekIndexLookup(const seek_index_t *index, uint64_t packet,
+                       seek_point_t *point, bool *exact) {
+  const seek_point_t *found;
+
+  if (packet < index->receivedPackets) {
+    found = search(index->points, index->pointCount, packet);
+    if (found != NULL) {
+      *point = *found;
+      /* Received packets are counted from the first one handed over, which
+         comes after the header frame unless the header frame was one */
+      if (!index->firstPacketIsHeader) {
+        point->byteOffset += index->headerFrameLength;
+      }
+      *exact = true;
+      return true;
+    }
+  }
+
+  found = search(index->tablePoints, index->tablePointCount, packet);
+  if (found != NULL) {
+    *point = *found;
+    *exact = false;
+    return true;
+  }
+
+  uint64_t bytes = index->headerBytes > 0 ? index->headerBytes
+                                          : index->audioByteCount;
+  if (index->hasTOC && index->headerPackets > 0 && bytes > 0) {
+    double percent = (double)packet * 100.0 / (double)index->headerPackets;
+    if (percent < 0) percent = 0;
+    if (percent > 99.999) percent = 99.999;
+    int i = (int)percent;
+    double a = index->toc[i];
+    double b = i < 99 ? index->toc[i + 1] : 256.0;
+    double fraction = (a + (b - a) * (percent - i)) / 256.0;
+    point->packet = packet;
+    point->byteOffset = (uint64_t)(fraction * (double)bytes);
+    *exact = false;
+    return true;
+  }
+  return false;
+}
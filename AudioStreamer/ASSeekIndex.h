@@ -0,0 +1,100 @@
+//
+//  ASSeekIndex.h
+//  AudioStreamer
+//
+
+#ifndef AS_SEEK_INDEX_H
+#define AS_SEEK_INDEX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Maps packet numbers to byte offsets for seeking.
+ *
+ * The index draws on three sources, best first:
+ *
+ *  - Packets which have actually been received. Their offsets are recorded
+ *    (every kSeekPointInterval packets) as they arrive, so a seek anywhere
+ *    within the part of the stream which has been downloaded lands exactly on
+ *    a packet boundary.
+ *  - A VBRI table in the first frame of an MPEG audio stream, which gives the
+ *    size of each run of frames.
+ *  - A Xing/Info table of contents in the first frame, which gives the byte
+ *    position of each percent of the stream. Offsets from it are estimates.
+ *
+ * All byte offsets are relative to the start of the audio data (the
+ * AudioFileStream data offset). Lookups are a binary search.
+ */
+
+/* Received packets are recorded once per this many packets */
+#define kSeekPointInterval 8
+
+typedef struct seek_index seek_index_t;
+
+typedef struct seek_point {
+  uint64_t packet;
+  uint64_t byteOffset;  /* relative to the start of the audio data */
+} seek_point_t;
+
+/* Creates an empty index. Returns NULL if allocation fails */
+seek_index_t *ASSeekIndexCreate(void);
+
+void ASSeekIndexDestroy(seek_index_t *index);
+
+/* Forgets everything, for a new stream */
+void ASSeekIndexReset(seek_index_t *index);
+
+/* Gives the file offset of the audio data, once it is known. Bytes of the
+   header (see below) may be fed before or after this is called */
+void ASSeekIndexSetDataOffset(seek_index_t *index, uint64_t dataOffset);
+
+/* Gives the size of the audio data, used with a Xing table of contents that
+   doesn't record the size itself */
+void ASSeekIndexSetAudioByteCount(seek_index_t *index, uint64_t byteCount);
+
+/* Feeds raw bytes of the file starting at the given file offset, so that a
+   Xing/Info or VBRI header in the first frame can be found. Only a small
+   window of the most recent bytes is kept. Returns true once the index no
+   longer needs any more bytes, whether or not a header was found */
+bool ASSeekIndexScanHeader(seek_index_t *index, uint64_t fileOffset,
+                           const uint8_t *bytes, size_t length);
+
+/* Gives the data of the first packet the parser produced. If the stream has a
+   Xing/Info or VBRI frame, this tells whether the parser counts that frame as
+   packet 0 or skips over it */
+void ASSeekIndexSetFirstPacket(seek_index_t *index, const uint8_t *data,
+                               size_t length);
+
+/* Records the size of a received packet. Packets must be reported in order
+   starting from packet 0 and are assumed to be back to back in the file;
+   anything that doesn't continue the run received so far is ignored. After a
+   seek to an estimated position packet numbers are guesses, and shouldn't be
+   reported at all */
+void ASSeekIndexAddPacket(seek_index_t *index, uint64_t packet,
+                          uint32_t byteSize);
+
+/* Finds where to start reading to play the given packet. The point returned
+   is at or before the packet. Returns false if nothing is known about that
+   part of the stream. exact is set if the point is a real packet boundary
+   rather than an estimate */
+bool ASSeekIndexLookup(const seek_index_t *index, uint64_t packet,
+                       seek_point_t *point, bool *exact);
+
+/* Total number of packets in the stream according to its header, or 0 */
+uint64_t ASSeekIndexPacketCount(const seek_index_t *index);
+
+/* Total number of audio bytes according to the stream's header, or 0 */
+uint64_t ASSeekIndexByteCount(const seek_index_t *index);
+
+/* Encoder delay and padding in samples, from a LAME tag following a Xing/Info
+   header. Returns false if there was no such tag */
+bool ASSeekIndexEncoderDelay(const seek_index_t *index, uint32_t *delay,
+                             uint32_t *padding);
+
+/* Whether the first packet (see ASSeekIndexSetFirstPacket) is the frame
+   holding the header rather than audio */
+bool ASSeekIndexFirstPacketIsHeader(const seek_index_t *index);
+
+#endif
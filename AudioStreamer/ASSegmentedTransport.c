@@ -0,0 +1,574 @@
+//
+//  ASSegmentedTransport.c
+//  AudioStreamer
+//
+
+#include "ASSegmentedTransport.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+/* Seconds of download each throughput measurement covers */
+#define kSampleInterval 0.5
+/* How much faster another connection has to make things to be kept */
+#define kMinGain 0.1
+#define kInitialConnections 2
+
+typedef struct segmented segmented_t;
+typedef struct segment segment_t;
+
+struct segment {
+  segmented_t *owner;
+  segment_t   *next;
+  transport_t *request;         /* NULL once the response has ended */
+  uint64_t     start;
+  uint64_t     length;
+  uint8_t     *data;
+  uint64_t     received;
+  uint64_t     consumed;
+  bool         checked;         /* has its response been looked at? */
+};
+
+struct segmented {
+  transport_t  transport;       /* must be first */
+  http_client_t *client;
+  http_client_task_t task;
+
+  /* The request, copied */
+  char        *url;
+  char       **headers;
+  size_t       headerCount;
+  bool         hasIfRange;
+  http_proxy_type_t proxyType;
+  char        *proxyHost;
+  uint16_t     proxyPort;
+  char        *validator;       /* for If-Range on later segments */
+
+  uint64_t     start;
+  uint64_t     end;             /* 0 until the file's length is known */
+  uint64_t     next;            /* start of the next segment to request */
+  uint64_t     segmentSize;
+  segment_t   *head;            /* being read, followed by those after it */
+  segment_t   *tail;
+  unsigned     segments;
+  unsigned     active;          /* segments with a request open */
+
+  unsigned     maxConnections;
+  unsigned     target;          /* connections to keep busy */
+  unsigned     best;            /* connections which gave bestRate */
+  bool         settled;
+  double       bestRate;
+  double       sampleStart;
+  uint64_t     sampleBytes;
+
+  bool         ranged;          /* the server sent a 206 for the first segment */
+  bool         passthrough;     /* it didn't, so that response is passed on */
+  char       **responseNames;
+  char       **responseValues;
+  size_t       responseCount;
+  char        *error;
+  char        *redirect;
+  bool         endSent;
+  bool         errorSent;
+};
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static char *copy_string(const char *string) {
+  return string != NULL ? strdup(string) : NULL;
+}
+
+static void segmented_poke(segmented_t *s) {
+  ASHTTPClientSchedule(s->client, &s->task);
+}
+
+static void segment_free(segment_t *seg) {
+  if (seg->request != NULL) ASTransportClose(seg->request);
+  free(seg->data);
+  free(seg);
+}
+
+static void segmented_fail(segmented_t *s, const char *error) {
+  if (s->error != NULL) return;
+  s->error = strdup(error != NULL ? error : "");
+  /* Nothing more will arrive, but whatever has can still be read */
+  for (segment_t *seg = s->head; seg != NULL; seg = seg->next) {
+    if (seg->request == NULL) continue;
+    ASTransportClose(seg->request);
+    seg->request = NULL;
+  }
+  s->active = 0;
+  segmented_poke(s);
+}
+
+/* Segments */
+
+static void segment_event(void *context, transport_t *transport,
+                          transport_event_t event);
+
+static bool segment_request(segmented_t *s, segment_t *seg) {
+  char range[64];
+  snprintf(range, sizeof(range), "bytes=%" PRIu64 "-%" PRIu64, seg->start,
+           seg->start + seg->length - 1);
+  size_t count = s->headerCount;
+  const char *fields[2 * (count + 2)];
+  for (size_t i = 0; i < 2 * count; i++) {
+    fields[i] = s->headers[i];
+  }
+  fields[2 * count] = "Range";
+  fields[2 * count + 1] = range;
+  count++;
+  if (s->ranged && !s->hasIfRange && s->validator != NULL) {
+    fields[2 * count] = "If-Range";
+    fields[2 * count + 1] = s->validator;
+    count++;
+  }
+
+  http_request_info_t info = {
+    .url = s->url,
+    .headers = fields,
+    .headerCount = count,
+    .proxyType = s->proxyType,
+    .proxyHost = s->proxyHost,
+    .proxyPort = s->proxyPort,
+  };
+  seg->request = ASHTTPClientOpen(s->client, &info, segment_event, seg);
+  return seg->request != NULL;
+}
+
+static segment_t *segment_add(segmented_t *s) {
+  segment_t *seg = calloc(1, sizeof(segment_t));
+  if (seg == NULL) return NULL;
+  seg->owner = s;
+  seg->start = s->next;
+  seg->length = s->segmentSize;
+  if (s->end > 0 && seg->length > s->end - seg->start) {
+    seg->length = s->end - seg->start;
+  }
+  if (s->ranged) {
+    seg->data = malloc((size_t)seg->length);
+    if (seg->data == NULL) {
+      free(seg);
+      return NULL;
+    }
+  }
+  if (!segment_request(s, seg)) {
+    free(seg->data);
+    free(seg);
+    return NULL;
+  }
+  if (s->tail != NULL) {
+    s->tail->next = seg;
+  } else {
+    s->head = seg;
+  }
+  s->tail = seg;
+  s->segments++;
+  s->active++;
+  s->next += seg->length;
+  return seg;
+}
+
+/* Requests segments until enough connections are busy, or as many segments
+   are waiting to be read as are allowed */
+static void segmented_fill(segmented_t *s) {
+  if (!s->ranged || s->error != NULL) return;
+  while (s->active < s->target && s->segments < 2 * s->maxConnections &&
+         s->next < s->end) {
+    if (segment_add(s) == NULL) {
+      if (s->active == 0) segmented_fail(s, "could not start a request");
+      return;
+    }
+  }
+}
+
+/* Lets go of segments at the front which have been read in full, which makes
+   room for more */
+static void segmented_advance(segmented_t *s) {
+  while (s->head != NULL && s->head->request == NULL &&
+         s->head->consumed == s->head->length) {
+    segment_t *seg = s->head;
+    s->head = seg->next;
+    if (s->head == NULL) s->tail = NULL;
+    s->segments--;
+    segment_free(seg);
+  }
+  segmented_fill(s);
+}
+
+/* Measures throughput, and decides on the number of connections from it */
+static void segmented_sample(segmented_t *s) {
+  double time = now();
+  double elapsed = time - s->sampleStart;
+  if (elapsed < kSampleInterval) return;
+  double rate = (double)s->sampleBytes / elapsed;
+  bool limited = s->active < s->target && s->next < s->end;
+  s->sampleStart = time;
+  s->sampleBytes = 0;
+  /* Throughput held back by the reader says nothing about connections */
+  if (s->settled || limited) return;
+
+  if (rate > s->bestRate * (1 + kMinGain)) {
+    s->bestRate = rate;
+    s->best = s->target;
+    if (s->target < s->maxConnections) {
+      s->target++;
+    } else {
+      s->settled = true;
+    }
+  } else if (s->target > s->best) {
+    /* The last connection added didn't help */
+    s->target = s->best;
+    s->settled = true;
+  }
+  segmented_fill(s);
+}
+
+/* Parses "bytes <first>-<last>/<total>" */
+static bool parse_content_range(const char *value, uint64_t *first,
+                                uint64_t *last, uint64_t *total) {
+  return value != NULL &&
+         sscanf(value, "bytes %" SCNu64 "-%" SCNu64 "/%" SCNu64,
+                first, last, total) == 3 &&
+         *first <= *last && *last < *total;
+}
+
+static bool add_response_header(segmented_t *s, const char *name,
+                                const char *value) {
+  char **names = realloc(s->responseNames, (s->responseCount + 1) * sizeof(char *));
+  if (names == NULL) return false;
+  s->responseNames = names;
+  char **values = realloc(s->responseValues, (s->responseCount + 1) * sizeof(char *));
+  if (values == NULL) return false;
+  s->responseValues = values;
+  names[s->responseCount] = strdup(name);
+  values[s->responseCount] = strdup(value);
+  if (names[s->responseCount] == NULL || values[s->responseCount] == NULL) {
+    free(names[s->responseCount]);
+    free(values[s->responseCount]);
+    return false;
+  }
+  s->responseCount++;
+  return true;
+}
+
+/* Takes the first segment's 206 as the response for the whole range */
+static bool segmented_start(segmented_t *s, segment_t *seg, uint64_t last,
+                            uint64_t total) {
+  transport_t *request = seg->request;
+  if (s->end == 0 || s->end > total) s->end = total;
+  if (seg->start + seg->length > last + 1) seg->length = last + 1 - seg->start;
+  s->next = seg->start + seg->length;
+  if (s->next > s->end) s->next = s->end;
+
+  seg->data = malloc((size_t)seg->length);
+  if (seg->data == NULL) return false;
+
+  const char *etag = ASTransportHeaderValue(request, "ETag");
+  if (etag == NULL || strncmp(etag, "W/", 2) == 0) {
+    etag = ASTransportHeaderValue(request, "Last-Modified");
+  }
+  s->validator = copy_string(etag);
+
+  size_t count = ASTransportHeaderCount(request);
+  for (size_t i = 0; i < count; i++) {
+    const char *name, *value;
+    if (!ASTransportHeader(request, i, &name, &value) ||
+        strcasecmp(name, "Content-Length") == 0 ||
+        strcasecmp(name, "Content-Range") == 0) {
+      continue;
+    }
+    if (!add_response_header(s, name, value)) return false;
+  }
+  char range[96], length[32];
+  snprintf(range, sizeof(range), "bytes %" PRIu64 "-%" PRIu64 "/%" PRIu64,
+           s->start, s->end - 1, total);
+  snprintf(length, sizeof(length), "%" PRIu64, s->end - s->start);
+  if (!add_response_header(s, "Content-Range", range) ||
+      !add_response_header(s, "Content-Length", length)) {
+    return false;
+  }
+
+  s->ranged = true;
+  s->target = kInitialConnections < s->maxConnections ?
+                kInitialConnections : s->maxConnections;
+  s->sampleStart = now();
+  segmented_fill(s);
+  return true;
+}
+
+/* Looks at a segment's response once it has arrived. Returns whether its body
+   can be read */
+static bool segment_check(segmented_t *s, segment_t *seg) {
+  seg->checked = true;
+  int status = ASTransportStatusCode(seg->request);
+  uint64_t first, last, total;
+  bool partial = status == 206 &&
+    parse_content_range(ASTransportHeaderValue(seg->request, "Content-Range"),
+                        &first, &last, &total) &&
+    first == seg->start;
+
+  if (!s->ranged) {
+    /* The first segment: without a range, pass the response on as it is */
+    if (!partial) {
+      s->passthrough = true;
+      return true;
+    }
+    if (!segmented_start(s, seg, last, total)) {
+      segmented_fail(s, "out of memory");
+      return false;
+    }
+    return true;
+  }
+  if (!partial || last + 1 < seg->start + seg->length) {
+    segmented_fail(s, "the file changed while it was being downloaded");
+    return false;
+  }
+  return true;
+}
+
+static void segment_event(void *context, transport_t *transport,
+                          transport_event_t event) {
+  segment_t *seg = context;
+  segmented_t *s = seg->owner;
+
+  if (event == TRANSPORT_EVENT_ERROR) {
+    if (s->passthrough) {
+      segmented_poke(s);
+      return;
+    }
+    if (seg == s->head && !s->ranged) {
+      s->redirect = copy_string(ASHTTPClientRedirectLocation(transport));
+    }
+    segmented_fail(s, ASTransportError(transport));
+    return;
+  }
+  if (!seg->checked && !segment_check(s, seg)) return;
+  if (s->passthrough) {
+    segmented_poke(s);
+    return;
+  }
+
+  while (ASTransportHasBytesAvailable(transport)) {
+    uint64_t space = seg->length - seg->received;
+    if (space == 0) {
+      segmented_fail(s, "the server sent more than was asked for");
+      return;
+    }
+    ssize_t length = ASTransportRead(transport, seg->data + seg->received,
+                                     (size_t)space);
+    if (length <= 0) break;
+    seg->received += (uint64_t)length;
+    s->sampleBytes += (uint64_t)length;
+  }
+
+  bool head = seg == s->head;
+  if (event == TRANSPORT_EVENT_END || ASTransportAtEnd(transport)) {
+    if (seg->received < seg->length) {
+      segmented_fail(s, "the response ended early");
+      return;
+    }
+    ASTransportClose(transport);
+    seg->request = NULL;
+    s->active--;
+    segmented_advance(s);
+  }
+  segmented_sample(s);
+  if (head) segmented_poke(s);
+}
+
+/* Transport */
+
+static ssize_t segmented_read(transport_t *transport, void *buffer, size_t length) {
+  segmented_t *s = (segmented_t *)transport;
+  if (s->passthrough) return ASTransportRead(s->head->request, buffer, length);
+
+  size_t total = 0;
+  while (total < length && s->head != NULL) {
+    segment_t *seg = s->head;
+    uint64_t available = seg->received - seg->consumed;
+    if (available > length - total) available = length - total;
+    memcpy((uint8_t *)buffer + total, seg->data + seg->consumed, (size_t)available);
+    seg->consumed += available;
+    total += (size_t)available;
+    if (seg->consumed < seg->length || seg->request != NULL) break;
+    segmented_advance(s);
+  }
+  if (total == 0 && s->error != NULL) return -1;
+
+  /* Whatever's left, or the end, is the next event */
+  if (ASTransportHasBytesAvailable(transport) || ASTransportAtEnd(transport) ||
+      s->error != NULL) {
+    segmented_poke(s);
+  }
+  return (ssize_t)total;
+}
+
+static bool segmented_has_bytes(transport_t *transport) {
+  segmented_t *s = (segmented_t *)transport;
+  if (s->passthrough) return ASTransportHasBytesAvailable(s->head->request);
+  return s->head != NULL && s->head->received > s->head->consumed;
+}
+
+static bool segmented_at_end(transport_t *transport) {
+  segmented_t *s = (segmented_t *)transport;
+  if (s->passthrough) return ASTransportAtEnd(s->head->request);
+  return s->ranged && s->error == NULL && s->head == NULL && s->next >= s->end;
+}
+
+static void segmented_set_paused(transport_t *transport, bool paused) {
+  segmented_t *s = (segmented_t *)transport;
+  if (s->passthrough) ASTransportSetPaused(s->head->request, paused);
+  if (!paused) segmented_poke(s);
+}
+
+static int segmented_status(transport_t *transport) {
+  segmented_t *s = (segmented_t *)transport;
+  if (s->passthrough) return ASTransportStatusCode(s->head->request);
+  return s->ranged ? 206 : 0;
+}
+
+static size_t segmented_header_count(transport_t *transport) {
+  segmented_t *s = (segmented_t *)transport;
+  if (s->passthrough) return ASTransportHeaderCount(s->head->request);
+  return s->responseCount;
+}
+
+static bool segmented_header(transport_t *transport, size_t index,
+                             const char **name, const char **value) {
+  segmented_t *s = (segmented_t *)transport;
+  if (s->passthrough) {
+    return ASTransportHeader(s->head->request, index, name, value);
+  }
+  if (index >= s->responseCount) return false;
+  *name = s->responseNames[index];
+  *value = s->responseValues[index];
+  return true;
+}
+
+static const char *segmented_error(transport_t *transport) {
+  segmented_t *s = (segmented_t *)transport;
+  if (s->passthrough) return ASTransportError(s->head->request);
+  return s->error;
+}
+
+/* Sends the event the transport has waiting, if any */
+static void segmented_deliver(void *context) {
+  segmented_t *s = context;
+  transport_t *transport = &s->transport;
+  if (ASTransportIsPaused(transport)) return;
+  bool hasBytes = ASTransportHasBytesAvailable(transport);
+  if (ASTransportError(transport) != NULL && !hasBytes) {
+    if (s->errorSent) return;
+    s->errorSent = true;
+    ASTransportNotify(transport, TRANSPORT_EVENT_ERROR);
+  } else if (hasBytes) {
+    ASTransportNotify(transport, TRANSPORT_EVENT_READABLE);
+  } else if (ASTransportAtEnd(transport) && !s->endSent) {
+    s->endSent = true;
+    ASTransportNotify(transport, TRANSPORT_EVENT_END);
+  }
+}
+
+static void segmented_close(transport_t *transport) {
+  segmented_t *s = (segmented_t *)transport;
+  ASHTTPClientUnschedule(s->client, &s->task);
+  while (s->head != NULL) {
+    segment_t *seg = s->head;
+    s->head = seg->next;
+    segment_free(seg);
+  }
+  for (size_t i = 0; i < 2 * s->headerCount; i++) {
+    free(s->headers[i]);
+  }
+  for (size_t i = 0; i < s->responseCount; i++) {
+    free(s->responseNames[i]);
+    free(s->responseValues[i]);
+  }
+  free(s->headers);
+  free(s->responseNames);
+  free(s->responseValues);
+  free(s->url);
+  free(s->proxyHost);
+  free(s->validator);
+  free(s->error);
+  free(s->redirect);
+  free(s);
+}
+
+static const transport_ops_t segmented_ops = {
+  .read = segmented_read,
+  .hasBytesAvailable = segmented_has_bytes,
+  .atEnd = segmented_at_end,
+  .setPaused = segmented_set_paused,
+  .statusCode = segmented_status,
+  .headerCount = segmented_header_count,
+  .header = segmented_header,
+  .error = segmented_error,
+  .close = segmented_close,
+};
+
+transport_t *ASSegmentedTransportCreate(http_client_t *client,
+                                        const segmented_info_t *info,
+                                        transport_event_proc proc,
+                                        void *context) {
+  if (!ASHTTPClientHandlesURL(info->request.url)) return NULL;
+  segmented_t *s = calloc(1, sizeof(segmented_t));
+  if (s == NULL) return NULL;
+  ASTransportInit(&s->transport, &segmented_ops, proc, context);
+  s->client = client;
+  s->task.run = segmented_deliver;
+  s->task.context = s;
+  s->start = info->start;
+  s->end = info->end;
+  s->next = info->start;
+  s->segmentSize = info->segmentSize > 0 ? info->segmentSize : 1;
+  s->maxConnections = info->maxConnections > 0 ? info->maxConnections : 1;
+  s->target = 1;
+
+  bool copied = true;
+  s->url = copy_string(info->request.url);
+  s->proxyType = info->request.proxyType;
+  s->proxyHost = copy_string(info->request.proxyHost);
+  s->proxyPort = info->request.proxyPort;
+  copied = s->url != NULL &&
+           (info->request.proxyHost == NULL || s->proxyHost != NULL);
+  s->headers = calloc(2 * info->request.headerCount + 1, sizeof(char *));
+  if (s->headers == NULL) copied = false;
+  for (size_t i = 0; copied && i < info->request.headerCount; i++) {
+    const char *name = info->request.headers[2 * i];
+    if (strcasecmp(name, "Range") == 0) continue;
+    if (strcasecmp(name, "If-Range") == 0) s->hasIfRange = true;
+    s->headers[2 * s->headerCount] = strdup(name);
+    s->headers[2 * s->headerCount + 1] = strdup(info->request.headers[2 * i + 1]);
+    s->headerCount++;
+    copied = s->headers[2 * s->headerCount - 2] != NULL &&
+             s->headers[2 * s->headerCount - 1] != NULL;
+  }
+
+  /* The first segment finds out what the server can do */
+  if (!copied || segment_add(s) == NULL) {
+    segmented_close(&s->transport);
+    return NULL;
+  }
+  return &s->transport;
+}
+
+unsigned ASSegmentedTransportConnections(transport_t *transport) {
+  segmented_t *s = (segmented_t *)transport;
+  return s->passthrough ? 1 : s->target;
+}
+
+const char *ASSegmentedTransportRedirectLocation(transport_t *transport) {
+  segmented_t *s = (segmented_t *)transport;
+  if (s->passthrough) return ASHTTPClientRedirectLocation(s->head->request);
+  return s->redirect;
+}
@@ -0,0 +1,62 @@
+//
+//  ASSegmentedTransport.h
+//  AudioStreamer
+//
+
+#ifndef AS_SEGMENTED_TRANSPORT_H
+#define AS_SEGMENTED_TRANSPORT_H
+
+#include <stdint.h>
+
+#include "ASHTTPClient.h"
+#include "ASTransport.h"
+
+/*
+ * Downloads a range of a file over several connections at once.
+ *
+ * One response is read no faster than one connection's congestion window
+ * allows, which for a distant server is often far less than the link could
+ * carry. This splits the range into segments, each fetched with a Range
+ * request of its own on the HTTP client, and hands their bytes back in order,
+ * so that to its reader it's a single 206 response for the whole range.
+ *
+ * The first segment is asked for on its own, which finds out whether the
+ * server does ranges at all and how long the file is. If it answers with
+ * anything but a 206, that response is passed through untouched. Otherwise
+ * more segments are requested alongside, over two connections to begin with.
+ * Throughput is measured every half second; while each connection added has
+ * made it noticeably faster another is tried, up to the most allowed, and one
+ * which didn't help is given up again, settling the count. Later segments
+ * carry If-Range with the first response's validator, so that a file which
+ * changes part way through fails the transport instead of mixing versions.
+ *
+ * Segments which arrive ahead of the one being read are kept in memory, no
+ * more than twice the most connections' worth of them, which also limits how
+ * far the download runs ahead of its reader.
+ *
+ * This is plain C without any CoreFoundation dependency.
+ */
+
+typedef struct segmented_info {
+  /* The file's request, without a Range header */
+  http_request_info_t request;
+  uint64_t start;               /* of the range */
+  uint64_t end;                 /* one past it, or 0 for the rest of the file */
+  uint64_t segmentSize;
+  unsigned maxConnections;
+} segmented_info_t;
+
+/* Starts the download, returning NULL if the URL can't be handled or
+   allocation fails */
+transport_t *ASSegmentedTransportCreate(http_client_t *client,
+                                        const segmented_info_t *info,
+                                        transport_event_proc proc,
+                                        void *context);
+
+/* How many connections the download is aiming to use right now */
+unsigned ASSegmentedTransportConnections(transport_t *transport);
+
+/* As ASHTTPClientRedirectLocation, for the first segment's request */
+const char *ASSegmentedTransportRedirectLocation(transport_t *transport);
+
+#endif
@@ -0,0 +1,44 @@
+//
+//  ASStartPolicy.c
+//  AudioStreamer
+//
+
+#include "ASStartPolicy.h"
+
+#include <math.h>
+
+/* Least audio, in seconds, an adaptive start waits for */
+#define kMinAdaptiveStartTime 0.2
+
+double ASStartPolicyTarget(const start_policy_t *policy,
+                           const start_state_t *state) {
+  double target = policy->duration;
+  if (!policy->adaptive || state->bitrate <= 0 || state->throughput <= 0 ||
+      state->remaining < 0) {
+    return target;
+  }
+
+  /* Playing for t seconds takes t seconds of audio while t * rate / bitrate
+     seconds more arrive, so what's buffered has to make up the difference
+     over what's left of the stream */
+  double ratio = (state->throughput - state->deviation) / state->bitrate;
+  double needed = ratio >= 1 ? 0 : state->remaining * (1 - ratio);
+  return fmin(fmax(needed, kMinAdaptiveStartTime),
+              fmax(target, state->lowWatermark));
+}
+
+bool ASStartPolicyReady(const start_policy_t *policy,
+                        const start_state_t *state) {
+  /* After running dry, wait until the low watermark is buffered */
+  if (state->stalled && state->buffered >= 0) {
+    return state->buffered >= state->lowWatermark;
+  }
+  if (policy->duration > 0 && state->queued >= 0) {
+    /* Everything full is as much as there's going to be */
+    return state->buffersUsed >= state->buffersActive ||
+           state->queued >= ASStartPolicyTarget(policy, state);
+  }
+  return (state->buffersActive < policy->fillCountToStart &&
+          state->buffersUsed >= state->buffersActive) ||
+         state->buffersUsed >= policy->fillCountToStart;
+}
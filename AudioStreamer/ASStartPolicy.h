@@ -0,0 +1,54 @@
+//
+//  ASStartPolicy.h
+//  AudioStreamer
+//
+
+#ifndef AS_START_POLICY_H
+#define AS_START_POLICY_H
+
+#include <stdbool.h>
+
+/*
+ * Decides when a stream has buffered enough to start playing.
+ *
+ * A stream starts once a number of buffers are full, or, given a duration,
+ * once that much audio is buffered whatever the bitrate. An adaptive start
+ * asks for less when the download is fast enough: as little as will last
+ * until the end of the stream at the measured download rate, less its
+ * deviation. After playback runs dry it starts again once the low watermark
+ * is buffered.
+ *
+ * This is plain C without any CoreFoundation dependency.
+ */
+
+typedef struct start_policy {
+  unsigned fillCountToStart;    /* buffers to fill, without a duration */
+  double   duration;            /* seconds of audio to buffer, or 0 */
+  bool     adaptive;
+} start_policy_t;
+
+typedef struct start_state {
+  unsigned buffersUsed;         /* buffers handed to the audio queue */
+  unsigned buffersActive;       /* buffers there are */
+  double   queued;              /* seconds of audio in the buffers, or -1 if
+                                   the sample rate isn't known */
+  bool     stalled;             /* playback ran dry */
+  double   buffered;            /* seconds of audio held in all, read ahead
+                                   included, or -1 if the bitrate isn't known */
+  double   lowWatermark;        /* seconds */
+  double   bitrate;             /* of the stream, bits per second, or 0 */
+  double   throughput;          /* download rate, bits per second, or 0 */
+  double   deviation;           /* of the download rate */
+  double   remaining;           /* seconds of the stream left to play, or -1
+                                   for a live stream or an unknown duration */
+} start_state_t;
+
+/* Seconds of audio to buffer before first starting, given a duration */
+double ASStartPolicyTarget(const start_policy_t *policy,
+                           const start_state_t *state);
+
+/* Whether enough is buffered for playback to start */
+bool ASStartPolicyReady(const start_policy_t *policy,
+                        const start_state_t *state);
+
+#endif
@@ -0,0 +1,185 @@
+//
+//  ASStationPlaylist.c
+//  AudioStreamer
+//
+
+#include "ASStationPlaylist.h"
+#include "ASHLSPlaylist.h"
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+typedef struct pls_entry {
+  long  number;
+  char *url;
+} pls_entry_t;
+
+typedef struct parse_state {
+  const char *base;
+  bool        pls;
+  bool        started;          /* has the first line been seen? */
+  pls_entry_t *entries;         /* of a PLS file, before they're sorted */
+  size_t      entryCount;
+  station_playlist_t *playlist;
+} parse_state_t;
+
+/* Calls proc with each line of the text, trimmed, skipping blank ones and a
+   byte order mark. Stops and returns false as soon as proc does */
+static bool each_line(const char *text, size_t length,
+                      bool (*proc)(void *context, const char *line,
+                                   size_t lineLength),
+                      void *context) {
+  if (length >= 3 && memcmp(text, "\xEF\xBB\xBF", 3) == 0) {
+    text += 3;
+    length -= 3;
+  }
+  size_t pos = 0;
+  while (pos < length) {
+    const char *start = text + pos;
+    const char *newline = memchr(start, '\n', length - pos);
+    size_t lineLength = newline != NULL ? (size_t)(newline - start) : length - pos;
+    pos += lineLength + 1;
+    while (lineLength > 0 && isspace((unsigned char)start[lineLength - 1])) {
+      lineLength--;
+    }
+    while (lineLength > 0 && isspace((unsigned char)*start)) {
+      start++;
+      lineLength--;
+    }
+    if (lineLength > 0 && !proc(context, start, lineLength)) return false;
+  }
+  return true;
+}
+
+static bool add_url(station_playlist_t *playlist, const char *base,
+                    const char *url) {
+  char *resolved = ASHLSResolveURL(base, url);
+  /* Anything but http and https is left out rather than failing the parse */
+  if (resolved == NULL) return true;
+  if (strncasecmp(resolved, "http://", 7) != 0 &&
+      strncasecmp(resolved, "https://", 8) != 0) {
+    free(resolved);
+    return true;
+  }
+  for (size_t i = 0; i < playlist->count; i++) {
+    if (strcmp(playlist->urls[i], resolved) == 0) {
+      free(resolved);
+      return true;
+    }
+  }
+  char **urls = realloc(playlist->urls, (playlist->count + 1) * sizeof(char *));
+  if (urls == NULL) {
+    free(resolved);
+    return false;
+  }
+  playlist->urls = urls;
+  playlist->urls[playlist->count++] = resolved;
+  return true;
+}
+
+/* A "FileN=url" line of a PLS file */
+static bool parse_pls_line(parse_state_t *ps, const char *line,
+                           size_t lineLength) {
+  if (lineLength < 5 || strncasecmp(line, "File", 4) != 0 ||
+      !isdigit((unsigned char)line[4])) {
+    return true;
+  }
+  const char *equals = memchr(line, '=', lineLength);
+  if (equals == NULL) return true;
+  char *end;
+  long number = strtol(line + 4, &end, 10);
+  if (end != equals) return true;
+  const char *value = equals + 1;
+  size_t valueLength = lineLength - (size_t)(value - line);
+  while (valueLength > 0 && isspace((unsigned char)*value)) {
+    value++;
+    valueLength--;
+  }
+  if (valueLength == 0) return true;
+
+  pls_entry_t *entries = realloc(ps->entries,
+                                 (ps->entryCount + 1) * sizeof(pls_entry_t));
+  if (entries == NULL) return false;
+  ps->entries = entries;
+  char *url = strndup(value, valueLength);
+  if (url == NULL) return false;
+  ps->entries[ps->entryCount].number = number;
+  ps->entries[ps->entryCount].url = url;
+  ps->entryCount++;
+  return true;
+}
+
+static bool parse_line(void *context, const char *line, size_t lineLength) {
+  parse_state_t *ps = context;
+  if (!ps->started) {
+    ps->started = true;
+    ps->pls = lineLength == 10 && strncasecmp(line, "[playlist]", 10) == 0;
+    if (ps->pls) return true;
+  }
+  if (ps->pls) return parse_pls_line(ps, line, lineLength);
+  if (line[0] == '#') return true;
+  char *url = strndup(line, lineLength);
+  if (url == NULL) return false;
+  bool ok = add_url(ps->playlist, ps->base, url);
+  free(url);
+  return ok;
+}
+
+/* Insertion sort, which keeps entries with the same number as listed. There
+   are only ever a handful */
+static void sort_entries(pls_entry_t *entries, size_t count) {
+  for (size_t i = 1; i < count; i++) {
+    pls_entry_t entry = entries[i];
+    size_t j = i;
+    while (j > 0 && entries[j - 1].number > entry.number) {
+      entries[j] = entries[j - 1];
+      j--;
+    }
+    entries[j] = entry;
+  }
+}
+
+station_playlist_t *ASStationPlaylistParse(const char *text, size_t length,
+                                           const char *baseURL) {
+  parse_state_t ps = {.base = baseURL};
+  ps.playlist = calloc(1, sizeof(station_playlist_t));
+  if (ps.playlist == NULL) return NULL;
+  bool ok = each_line(text, length, parse_line, &ps);
+
+  /* Entries can come in any order */
+  sort_entries(ps.entries, ps.entryCount);
+  for (size_t i = 0; i < ps.entryCount; i++) {
+    if (ok) ok = add_url(ps.playlist, baseURL, ps.entries[i].url);
+    free(ps.entries[i].url);
+  }
+  free(ps.entries);
+
+  if (!ok || ps.playlist->count == 0) {
+    ASStationPlaylistFree(ps.playlist);
+    return NULL;
+  }
+  return ps.playlist;
+}
+
+void ASStationPlaylistFree(station_playlist_t *playlist) {
+  if (playlist == NULL) return;
+  for (size_t i = 0; i < playlist->count; i++) {
+    free(playlist->urls[i]);
+  }
+  free(playlist->urls);
+  free(playlist);
+}
+
+static bool find_hls_tag(void *context, const char *line, size_t lineLength) {
+  bool *found = context;
+  *found = lineLength >= 7 && strncmp(line, "#EXT-X-", 7) == 0;
+  return !*found;
+}
+
+bool ASStationPlaylistIsHLS(const char *text, size_t length) {
+  bool found = false;
+  each_line(text, length, find_hls_tag, &found);
+  return found;
+}
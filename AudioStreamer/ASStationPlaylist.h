@@ -0,0 +1,47 @@
+//
+//  ASStationPlaylist.h
+//  AudioStreamer
+//
+
+#ifndef AS_STATION_PLAYLIST_H
+#define AS_STATION_PLAYLIST_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * The PLS and M3U files radio stations link to instead of a stream.
+ *
+ * Either lists one or more URLs of the same station, usually mirrors on
+ * different servers, in the order the station would have them tried. A PLS
+ * file is an INI-style "[playlist]" section of File1=, File2=, ... entries,
+ * read in the order of their numbers; an M3U file is one URL to a line, with
+ * lines starting with "#" being comments or extended info. Other PLS keys
+ * (titles, lengths) are skipped, as are URLs listed twice and ones which
+ * aren't http or https, and relative URLs are made absolute against the
+ * playlist's own.
+ *
+ * M3U is also the format of HTTP Live Streaming playlists, which share its
+ * MIME types, so there's a check for those, to be played with
+ * ASHLSTransport.h instead.
+ *
+ * This is plain C without any CoreFoundation dependency.
+ */
+
+typedef struct station_playlist {
+  char  **urls;
+  size_t  count;
+} station_playlist_t;
+
+/* Parses a playlist downloaded from the base URL. Returns NULL if it lists no
+   URLs or allocation fails */
+station_playlist_t *ASStationPlaylistParse(const char *text, size_t length,
+                                           const char *baseURL);
+
+void ASStationPlaylistFree(station_playlist_t *playlist);
+
+/* Whether the text is an HLS playlist, with EXT-X- tags, rather than a list
+   of stations */
+bool ASStationPlaylistIsHLS(const char *text, size_t length);
+
+#endif
@@ -0,0 +1,552 @@
+//
+//  ASStationTransport.c
+//  AudioStreamer
+//
+
+#include "ASStationTransport.h"
+#include "ASStationPlaylist.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+/* Anything bigger is a stream, not a playlist */
+#define kMaxPlaylistLength (64 * 1024)
+/* Runners-up kept open, paused, to fail over to */
+#define kStandbyMirrors 2
+
+typedef struct station station_t;
+
+typedef enum {
+  MIRROR_UNTRIED,
+  MIRROR_RACING,
+  MIRROR_STANDBY,               /* held back in case the winner fails */
+  MIRROR_FAILED,
+  MIRROR_WON,
+} mirror_state_t;
+
+/* A request for one of the mirrors */
+typedef struct racer {
+  station_t   *owner;
+  size_t       index;           /* of its mirror */
+  transport_t *request;
+  bool         checked;         /* its response is audio */
+} racer_t;
+
+typedef struct mirror {
+  char          *url;
+  mirror_state_t state;
+  unsigned       answer;        /* when its response came, 0 if it hasn't */
+  racer_t       *racer;         /* while it's racing or has won */
+} mirror_t;
+
+struct station {
+  transport_t  transport;       /* must be first */
+  http_client_t *client;
+  http_client_task_t task;      /* sends errors */
+
+  /* The request, copied */
+  char        *url;
+  char       **headers;
+  size_t       headerCount;
+  http_proxy_type_t proxyType;
+  char        *proxyHost;
+  uint16_t     proxyPort;
+
+  transport_t *playlistRequest;
+  uint8_t     *playlistData;
+  size_t       playlistLength;
+  bool         hls;
+
+  mirror_t    *mirrors;
+  size_t       mirrorCount;
+  unsigned     racers;          /* to run at once */
+  unsigned     racing;
+  unsigned     answers;         /* responses which have come in */
+  racer_t     *winner;
+  const char **fallbacks;       /* the mirrors' URLs, best first */
+  size_t       fallbackCount;
+
+  char        *lastError;       /* of the last mirror to fail */
+  char        *error;
+  bool         errorSent;
+};
+
+static char *copy_string(const char *string) {
+  return string != NULL ? strdup(string) : NULL;
+}
+
+static void station_poke(station_t *s) {
+  ASHTTPClientSchedule(s->client, &s->task);
+}
+
+static void racer_close(racer_t *r) {
+  station_t *s = r->owner;
+  s->mirrors[r->index].racer = NULL;
+  if (r->request != NULL) ASTransportClose(r->request);
+  free(r);
+}
+
+/* Whether the mirror lost the race without failing */
+static bool raced(const mirror_t *m) {
+  return m->state == MIRROR_RACING || m->state == MIRROR_STANDBY;
+}
+
+/* The best mirror in a state: the first to answer, otherwise the first in
+   the playlist. NULL if there is none */
+static mirror_t *best_mirror(station_t *s, mirror_state_t state) {
+  mirror_t *best = NULL;
+  for (size_t i = 0; i < s->mirrorCount; i++) {
+    mirror_t *m = &s->mirrors[i];
+    if (m->state != state || m->racer == NULL) continue;
+    if (best == NULL ||
+        (m->answer != 0 && (best->answer == 0 || m->answer < best->answer))) {
+      best = m;
+    }
+  }
+  return best;
+}
+
+/* Lists the mirrors left to fall back on, best first */
+static void list_fallbacks(station_t *s) {
+  free(s->fallbacks);
+  s->fallbackCount = 0;
+  s->fallbacks = calloc(s->mirrorCount + 1, sizeof(char *));
+  if (s->fallbacks == NULL) return;
+  /* Those which answered, in the order they did */
+  for (unsigned answer = 1; answer <= s->answers; answer++) {
+    for (size_t i = 0; i < s->mirrorCount; i++) {
+      if (raced(&s->mirrors[i]) && s->mirrors[i].answer == answer) {
+        s->fallbacks[s->fallbackCount++] = s->mirrors[i].url;
+      }
+    }
+  }
+  for (size_t i = 0; i < s->mirrorCount; i++) {
+    if (raced(&s->mirrors[i]) && s->mirrors[i].answer == 0) {
+      s->fallbacks[s->fallbackCount++] = s->mirrors[i].url;
+    }
+  }
+  for (size_t i = 0; i < s->mirrorCount; i++) {
+    if (s->mirrors[i].state == MIRROR_UNTRIED) {
+      s->fallbacks[s->fallbackCount++] = s->mirrors[i].url;
+    }
+  }
+}
+
+static void station_fail(station_t *s, const char *error) {
+  if (s->error != NULL) return;
+  s->error = strdup(error != NULL ? error : "");
+  if (s->playlistRequest != NULL) {
+    ASTransportClose(s->playlistRequest);
+    s->playlistRequest = NULL;
+  }
+  list_fallbacks(s);
+  station_poke(s);
+}
+
+static transport_t *station_open(station_t *s, const char *url,
+                                 transport_event_proc proc, void *context) {
+  http_request_info_t info = {
+    .url = url,
+    .headers = (const char *const *)s->headers,
+    .headerCount = s->headerCount,
+    .proxyType = s->proxyType,
+    .proxyHost = s->proxyHost,
+    .proxyPort = s->proxyPort,
+  };
+  return ASHTTPClientOpen(s->client, &info, proc, context);
+}
+
+/* Racing */
+
+static void racer_event(void *context, transport_t *transport,
+                        transport_event_t event);
+
+/* Starts racing untried mirrors until there are as many racing as there
+   should be, failing if there are none left and nothing is racing */
+static void race(station_t *s) {
+  for (size_t i = 0; i < s->mirrorCount && s->racing < s->racers; i++) {
+    mirror_t *m = &s->mirrors[i];
+    if (m->state != MIRROR_UNTRIED || !ASHTTPClientHandlesURL(m->url)) {
+      continue;
+    }
+    racer_t *r = calloc(1, sizeof(racer_t));
+    if (r == NULL) {
+      station_fail(s, "out of memory");
+      return;
+    }
+    r->owner = s;
+    r->index = i;
+    r->request = station_open(s, m->url, racer_event, r);
+    if (r->request == NULL) {
+      free(r);
+      m->state = MIRROR_FAILED;
+      continue;
+    }
+    m->state = MIRROR_RACING;
+    m->racer = r;
+    s->racing++;
+  }
+  if (s->racing > 0) return;
+
+  char error[512];
+  if (s->lastError != NULL) {
+    snprintf(error, sizeof(error), "no mirror of the station could be played "
+             "(the last said: %s)", s->lastError);
+  } else {
+    snprintf(error, sizeof(error), "no mirror of the station can be raced");
+  }
+  station_fail(s, error);
+}
+
+/* The winner has failed. The best runner-up held back takes over, or if
+   there are none left the transport fails */
+static void winner_failed(station_t *s, const char *error) {
+  racer_t *r = s->winner;
+  s->winner = NULL;
+  free(s->lastError);
+  s->lastError = copy_string(error);
+  s->mirrors[r->index].state = MIRROR_FAILED;
+  racer_close(r);
+
+  mirror_t *m = best_mirror(s, MIRROR_STANDBY);
+  if (m == NULL) {
+    station_fail(s, s->lastError);
+    return;
+  }
+  s->winner = m->racer;
+  m->state = MIRROR_WON;
+  list_fallbacks(s);
+  /* Its response is checked as it would have been in the race, and nothing
+     is read from it until it passes */
+  if (!ASTransportIsPaused(&s->transport)) {
+    ASTransportSetPaused(m->racer->request, false);
+  }
+}
+
+static void racer_failed(station_t *s, racer_t *r, const char *error) {
+  if (r == s->winner) {
+    winner_failed(s, error);
+    return;
+  }
+  free(s->lastError);
+  s->lastError = copy_string(error);
+  s->mirrors[r->index].state = MIRROR_FAILED;
+  s->racing--;
+  racer_close(r);
+  race(s);
+}
+
+/* The racer has audio to read first. The best of the rest are paused, to
+   fail over to without connecting again, and the others called off */
+static void racer_won(station_t *s, racer_t *r) {
+  s->winner = r;
+  r->checked = true;
+  s->mirrors[r->index].state = MIRROR_WON;
+  mirror_t *m;
+  for (unsigned kept = 0; kept < kStandbyMirrors &&
+       (m = best_mirror(s, MIRROR_RACING)) != NULL; kept++) {
+    m->state = MIRROR_STANDBY;
+    ASTransportSetPaused(m->racer->request, true);
+  }
+  for (size_t i = 0; i < s->mirrorCount; i++) {
+    m = &s->mirrors[i];
+    if (m->state == MIRROR_RACING && m->racer != NULL) racer_close(m->racer);
+  }
+  s->racing = 0;
+  list_fallbacks(s);
+
+  /* The winner is held back along with the transport */
+  if (ASTransportIsPaused(&s->transport)) {
+    ASTransportSetPaused(r->request, true);
+  } else {
+    ASTransportNotify(&s->transport, TRANSPORT_EVENT_READABLE);
+  }
+}
+
+static void racer_event(void *context, transport_t *transport,
+                        transport_event_t event) {
+  racer_t *r = context;
+  station_t *s = r->owner;
+  if (r == s->winner && r->checked) {
+    if (event == TRANSPORT_EVENT_ERROR) {
+      winner_failed(s, ASTransportError(transport));
+    } else {
+      ASTransportNotify(&s->transport, event);
+    }
+    return;
+  }
+
+  if (event == TRANSPORT_EVENT_ERROR) {
+    racer_failed(s, r, ASTransportError(transport));
+    return;
+  }
+  int status = ASTransportStatusCode(transport);
+  mirror_t *m = &s->mirrors[r->index];
+  if (status != 0 && m->answer == 0) m->answer = ++s->answers;
+  if (status != 0 && (status < 200 || status > 299)) {
+    char error[64];
+    snprintf(error, sizeof(error), "Server returned HTTP %d", status);
+    racer_failed(s, r, error);
+    return;
+  }
+  /* Error pages can come with a status which says otherwise */
+  const char *type = ASTransportHeaderValue(transport, "Content-Type");
+  if (type != NULL && strncasecmp(type, "text/", 5) == 0) {
+    racer_failed(s, r, "the server didn't send audio");
+    return;
+  }
+  if (ASTransportHasBytesAvailable(transport)) {
+    if (r == s->winner) {
+      /* A runner-up which has taken over */
+      r->checked = true;
+      ASTransportNotify(&s->transport, TRANSPORT_EVENT_READABLE);
+    } else {
+      racer_won(s, r);
+    }
+  } else if (event == TRANSPORT_EVENT_END || ASTransportAtEnd(transport)) {
+    racer_failed(s, r, "the server sent nothing");
+  }
+}
+
+/* Playlist */
+
+static void playlist_loaded(station_t *s) {
+  const char *text = (const char *)s->playlistData;
+  if (ASStationPlaylistIsHLS(text, s->playlistLength)) {
+    s->hls = true;
+    station_fail(s, "the playlist is an HLS one");
+    return;
+  }
+  station_playlist_t *pl = ASStationPlaylistParse(text, s->playlistLength,
+                                                  s->url);
+  if (pl == NULL) {
+    station_fail(s, "the playlist lists no stations");
+    return;
+  }
+  s->mirrors = calloc(pl->count, sizeof(mirror_t));
+  if (s->mirrors == NULL) {
+    ASStationPlaylistFree(pl);
+    station_fail(s, "out of memory");
+    return;
+  }
+  /* The URLs are taken over from the playlist */
+  for (size_t i = 0; i < pl->count; i++) {
+    s->mirrors[i].url = pl->urls[i];
+  }
+  s->mirrorCount = pl->count;
+  pl->count = 0;
+  ASStationPlaylistFree(pl);
+  race(s);
+}
+
+static void playlist_event(void *context, transport_t *transport,
+                           transport_event_t event) {
+  station_t *s = context;
+  if (event == TRANSPORT_EVENT_ERROR) {
+    char *error = copy_string(ASTransportError(transport));
+    ASTransportClose(transport);
+    s->playlistRequest = NULL;
+    station_fail(s, error);
+    free(error);
+    return;
+  }
+  int status = ASTransportStatusCode(transport);
+  if (status != 200) {
+    ASTransportClose(transport);
+    s->playlistRequest = NULL;
+    char error[64];
+    snprintf(error, sizeof(error), "Server returned HTTP %d for the playlist", status);
+    station_fail(s, error);
+    return;
+  }
+
+  if (s->playlistData == NULL) {
+    s->playlistData = malloc(kMaxPlaylistLength);
+    if (s->playlistData == NULL) {
+      station_fail(s, "out of memory");
+      return;
+    }
+  }
+  ssize_t length;
+  while (s->playlistLength < kMaxPlaylistLength &&
+         (length = ASTransportRead(transport, s->playlistData + s->playlistLength,
+                                   kMaxPlaylistLength - s->playlistLength)) > 0) {
+    s->playlistLength += (size_t)length;
+  }
+  if (s->playlistLength == kMaxPlaylistLength) {
+    station_fail(s, "the playlist is too big to be one");
+    return;
+  }
+  if (event == TRANSPORT_EVENT_END || ASTransportAtEnd(transport)) {
+    ASTransportClose(transport);
+    s->playlistRequest = NULL;
+    playlist_loaded(s);
+  }
+}
+
+/* Transport */
+
+/* The winner's request, once its response is known to be audio. A runner-up
+   which has taken over isn't read until then */
+static transport_t *station_source(station_t *s) {
+  return s->winner != NULL && s->winner->checked ? s->winner->request : NULL;
+}
+
+static ssize_t station_read(transport_t *transport, void *buffer,
+                            size_t length) {
+  station_t *s = (station_t *)transport;
+  transport_t *source = station_source(s);
+  if (source == NULL) return s->error != NULL ? -1 : 0;
+  return ASTransportRead(source, buffer, length);
+}
+
+static bool station_has_bytes(transport_t *transport) {
+  transport_t *source = station_source((station_t *)transport);
+  return source != NULL && ASTransportHasBytesAvailable(source);
+}
+
+static bool station_at_end(transport_t *transport) {
+  transport_t *source = station_source((station_t *)transport);
+  return source != NULL && ASTransportAtEnd(source);
+}
+
+static void station_set_paused(transport_t *transport, bool paused) {
+  station_t *s = (station_t *)transport;
+  if (s->winner != NULL) {
+    ASTransportSetPaused(s->winner->request, paused);
+  } else if (!paused && s->error != NULL) {
+    station_poke(s);
+  }
+}
+
+static int station_status(transport_t *transport) {
+  transport_t *source = station_source((station_t *)transport);
+  return source != NULL ? ASTransportStatusCode(source) : 0;
+}
+
+static size_t station_header_count(transport_t *transport) {
+  transport_t *source = station_source((station_t *)transport);
+  return source != NULL ? ASTransportHeaderCount(source) : 0;
+}
+
+static bool station_header(transport_t *transport, size_t index,
+                           const char **name, const char **value) {
+  transport_t *source = station_source((station_t *)transport);
+  return source != NULL && ASTransportHeader(source, index, name, value);
+}
+
+static const char *station_error(transport_t *transport) {
+  station_t *s = (station_t *)transport;
+  if (s->error != NULL) return s->error;
+  transport_t *source = station_source(s);
+  return source != NULL ? ASTransportError(source) : NULL;
+}
+
+/* Sends an error the transport has waiting. Everything else comes from the
+   winner */
+static void station_deliver(void *context) {
+  station_t *s = context;
+  if (ASTransportIsPaused(&s->transport)) return;
+  if (s->error != NULL && !s->errorSent) {
+    s->errorSent = true;
+    ASTransportNotify(&s->transport, TRANSPORT_EVENT_ERROR);
+  }
+}
+
+static void station_close(transport_t *transport) {
+  station_t *s = (station_t *)transport;
+  ASHTTPClientUnschedule(s->client, &s->task);
+  if (s->playlistRequest != NULL) ASTransportClose(s->playlistRequest);
+  for (size_t i = 0; i < s->mirrorCount; i++) {
+    if (s->mirrors[i].racer != NULL) racer_close(s->mirrors[i].racer);
+    free(s->mirrors[i].url);
+  }
+  free(s->mirrors);
+  free(s->fallbacks);
+  for (size_t i = 0; i < 2 * s->headerCount; i++) {
+    free(s->headers[i]);
+  }
+  free(s->headers);
+  free(s->url);
+  free(s->proxyHost);
+  free(s->playlistData);
+  free(s->lastError);
+  free(s->error);
+  free(s);
+}
+
+static const transport_ops_t station_ops = {
+  .read = station_read,
+  .hasBytesAvailable = station_has_bytes,
+  .atEnd = station_at_end,
+  .setPaused = station_set_paused,
+  .statusCode = station_status,
+  .headerCount = station_header_count,
+  .header = station_header,
+  .error = station_error,
+  .close = station_close,
+};
+
+transport_t *ASStationTransportCreate(http_client_t *client,
+                                      const station_info_t *info,
+                                      transport_event_proc proc, void *context) {
+  if (!ASHTTPClientHandlesURL(info->request.url)) return NULL;
+  station_t *s = calloc(1, sizeof(station_t));
+  if (s == NULL) return NULL;
+  ASTransportInit(&s->transport, &station_ops, proc, context);
+  s->client = client;
+  s->task.run = station_deliver;
+  s->task.context = s;
+  s->racers = info->racers > 0 ? info->racers : 1;
+
+  s->url = copy_string(info->request.url);
+  s->proxyType = info->request.proxyType;
+  s->proxyHost = copy_string(info->request.proxyHost);
+  s->proxyPort = info->request.proxyPort;
+  bool copied = s->url != NULL &&
+                (info->request.proxyHost == NULL || s->proxyHost != NULL);
+  s->headers = calloc(2 * info->request.headerCount + 1, sizeof(char *));
+  if (s->headers == NULL) copied = false;
+  for (size_t i = 0; copied && i < info->request.headerCount; i++) {
+    /* Ranges are of the playlist, not the mirrors */
+    const char *name = info->request.headers[2 * i];
+    if (strcasecmp(name, "Range") == 0 || strcasecmp(name, "If-Range") == 0) {
+      continue;
+    }
+    s->headers[2 * s->headerCount] = strdup(name);
+    s->headers[2 * s->headerCount + 1] = strdup(info->request.headers[2 * i + 1]);
+    s->headerCount++;
+    copied = s->headers[2 * s->headerCount - 2] != NULL &&
+             s->headers[2 * s->headerCount - 1] != NULL;
+  }
+  if (!copied) {
+    station_close(&s->transport);
+    return NULL;
+  }
+  s->playlistRequest = station_open(s, s->url, playlist_event, s);
+  if (s->playlistRequest == NULL) {
+    station_close(&s->transport);
+    return NULL;
+  }
+  return &s->transport;
+}
+
+bool ASStationTransportIsHLS(transport_t *transport) {
+  return ((station_t *)transport)->hls;
+}
+
+const char *ASStationTransportURL(transport_t *transport) {
+  station_t *s = (station_t *)transport;
+  return station_source(s) != NULL ? s->mirrors[s->winner->index].url : NULL;
+}
+
+size_t ASStationTransportFallbackCount(transport_t *transport) {
+  return ((station_t *)transport)->fallbackCount;
+}
+
+const char *ASStationTransportFallback(transport_t *transport, size_t index) {
+  station_t *s = (station_t *)transport;
+  return index < s->fallbackCount ? s->fallbacks[index] : NULL;
+}
@@ -0,0 +1,72 @@
+//
+//  ASStationTransport.h
+//  AudioStreamer
+//
+
+#ifndef AS_STATION_TRANSPORT_H
+#define AS_STATION_TRANSPORT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "ASHTTPClient.h"
+#include "ASTransport.h"
+
+/*
+ * Plays a station's PLS or M3U playlist by racing the mirrors it lists.
+ *
+ * The playlist is fetched and parsed (see ASStationPlaylist.h), then the
+ * first few of its mirrors are requested at once. Whichever first answers
+ * with audio (any successful response which isn't text, such as an error
+ * page) and has bytes of it to read wins: the others are closed and the
+ * transport reads the winner's response from then on, its status and
+ * headers included. A mirror which fails makes way for the next in the
+ * playlist, so the same number keep racing until one wins or all have
+ * failed.
+ *
+ * Two of the others still racing, the first to have answered or otherwise
+ * the first in the playlist, are kept open but paused, with whatever they
+ * had sent held back. If the winner then fails, the first of them takes
+ * over once its response is found to be audio, and the transport reads on
+ * from the start of that response without waiting for a new connection;
+ * ASStationTransportURL says which mirror the bytes now come from. The
+ * transport only fails once none of them is left.
+ *
+ * The mirrors which didn't win are also kept as fallbacks, best first: those
+ * which were still racing, in the order their responses came in (the ones
+ * which hadn't answered last), and then any which weren't tried, in playlist
+ * order. Mirrors the HTTP client can't fetch, such as https ones, are never
+ * raced, only left as fallbacks; if the playlist lists nothing else, the
+ * transport fails with all of them there.
+ *
+ * A playlist which turns out to be an HLS one fails the transport too, with
+ * ASStationTransportIsHLS saying so.
+ *
+ * This is plain C without any CoreFoundation dependency.
+ */
+
+typedef struct station_info {
+  /* The playlist's request. Its headers are sent to the mirrors too */
+  http_request_info_t request;
+  unsigned racers;              /* mirrors requested at once, at least 1 */
+} station_info_t;
+
+/* Starts fetching the playlist, returning NULL if the URL can't be handled or
+   allocation fails */
+transport_t *ASStationTransportCreate(http_client_t *client,
+                                      const station_info_t *info,
+                                      transport_event_proc proc, void *context);
+
+/* Whether the transport failed because the playlist is an HLS one */
+bool ASStationTransportIsHLS(transport_t *transport);
+
+/* URL of the mirror being read, or NULL if none has won yet. It changes when
+   a runner-up takes over from a winner which failed */
+const char *ASStationTransportURL(transport_t *transport);
+
+/* The mirrors to fall back on, best first, the ones held open included. There
+   are none until a mirror has won or the transport has failed */
+size_t ASStationTransportFallbackCount(transport_t *transport);
+const char *ASStationTransportFallback(transport_t *transport, size_t index);
+
+#endif
@@ -0,0 +1,129 @@
+//
+//  ASTSDemuxer.c
+//  AudioStreamer
+//
+
+#include "ASTSDemuxer.h"
+
+#define kPacketSize 188
+#define kSyncByte 0x47
+#define kPATPID 0
+
+/* Stream types in a program map */
+#define kStreamMPEG1Audio 0x03
+#define kStreamMPEG2Audio 0x04
+#define kStreamADTS 0x0F
+
+bool ASTSDemuxerProbe(const uint8_t *bytes, size_t length) {
+  if (length < kPacketSize) return false;
+  if (bytes[0] != kSyncByte) return false;
+  return length < 2 * kPacketSize || bytes[kPacketSize] == kSyncByte;
+}
+
+/* The section a table packet's payload points to, checking it's all there.
+   Returns the bytes after the section length, up to the CRC */
+static const uint8_t *table_section(const uint8_t *payload, size_t length,
+                                    uint8_t tableID, size_t *sectionLength) {
+  size_t pointer = payload[0];
+  if (1 + pointer + 3 > length) return NULL;
+  const uint8_t *p = payload + 1 + pointer;
+  if (p[0] != tableID) return NULL;
+  size_t section = ((size_t)(p[1] & 0x0F) << 8) | p[2];
+  /* Five bytes of header after the length, and the CRC at the end */
+  if (section < 9 || 1 + pointer + 3 + section > length) return NULL;
+  *sectionLength = section - 9;
+  return p + 8;
+}
+
+/* The PID of the first program's map, or -1 */
+static int parse_pat(const uint8_t *payload, size_t length) {
+  size_t count;
+  const uint8_t *p = table_section(payload, length, 0x00, &count);
+  if (p == NULL) return -1;
+  for (size_t i = 0; i + 4 <= count; i += 4) {
+    unsigned program = ((unsigned)p[i] << 8) | p[i + 1];
+    /* Program 0 is the network information table */
+    if (program != 0) return ((p[i + 2] & 0x1F) << 8) | p[i + 3];
+  }
+  return -1;
+}
+
+/* The PID of the first audio stream which can be played, or -1 */
+static int parse_pmt(const uint8_t *payload, size_t length,
+                     ts_audio_type_t *type) {
+  size_t count;
+  const uint8_t *p = table_section(payload, length, 0x02, &count);
+  if (p == NULL || count < 4) return -1;
+  size_t infoLength = ((size_t)(p[2] & 0x0F) << 8) | p[3];
+  for (size_t i = 4 + infoLength; i + 5 <= count; ) {
+    uint8_t streamType = p[i];
+    int pid = ((p[i + 1] & 0x1F) << 8) | p[i + 2];
+    size_t esInfo = ((size_t)(p[i + 3] & 0x0F) << 8) | p[i + 4];
+    switch (streamType) {
+      case kStreamADTS:
+        *type = TS_AUDIO_ADTS;
+        return pid;
+      case kStreamMPEG1Audio:
+      case kStreamMPEG2Audio:
+        *type = TS_AUDIO_MPEG;
+        return pid;
+    }
+    i += 5 + esInfo;
+  }
+  return -1;
+}
+
+/* Length of the PES header at the start of a payload, or 0 if it isn't
+   one or doesn't fit */
+static size_t pes_header_length(const uint8_t *payload, size_t length) {
+  if (length < 9 || payload[0] != 0 || payload[1] != 0 || payload[2] != 1) {
+    return 0;
+  }
+  /* Audio streams always have the optional header, marked by its top bits */
+  if ((payload[6] & 0xC0) != 0x80) return 0;
+  size_t header = 9 + (size_t)payload[8];
+  return header <= length ? header : 0;
+}
+
+ts_audio_type_t ASTSDemuxSegment(const uint8_t *bytes, size_t length,
+                                 ts_payload_proc proc, void *context) {
+  int pmtPID = -1;
+  int audioPID = -1;
+  ts_audio_type_t type = TS_AUDIO_NONE;
+  bool inPES = false;
+  size_t pos = 0;
+  while (pos + kPacketSize <= length) {
+    const uint8_t *p = bytes + pos;
+    if (p[0] != kSyncByte) {
+      pos++;
+      continue;
+    }
+    pos += kPacketSize;
+
+    int pid = ((p[1] & 0x1F) << 8) | p[2];
+    bool unitStart = (p[1] & 0x40) != 0;
+    uint8_t adaptation = (p[3] >> 4) & 0x03;
+    size_t start = 4;
+    if (adaptation & 0x02) start += 1 + (size_t)p[4];
+    if (!(adaptation & 0x01) || start >= kPacketSize) continue;
+    const uint8_t *payload = p + start;
+    size_t payloadLength = kPacketSize - start;
+
+    if (pid == kPATPID) {
+      if (unitStart && pmtPID < 0) pmtPID = parse_pat(payload, payloadLength);
+    } else if (pid == pmtPID) {
+      if (unitStart && audioPID < 0) {
+        audioPID = parse_pmt(payload, payloadLength, &type);
+      }
+    } else if (pid == audioPID) {
+      if (unitStart) {
+        size_t header = pes_header_length(payload, payloadLength);
+        inPES = header > 0;
+        payload += header;
+        payloadLength -= header;
+      }
+      if (inPES && payloadLength > 0) proc(context, payload, payloadLength);
+    }
+  }
+  return audioPID >= 0 ? type : TS_AUDIO_NONE;
+}
@@ -0,0 +1,47 @@
+//
+//  ASTSDemuxer.h
+//  AudioStreamer
+//
+
+#ifndef AS_TS_DEMUXER_H
+#define AS_TS_DEMUXER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Takes the audio out of an MPEG-2 transport stream, as HLS segments are.
+ *
+ * The program association table gives the first program's map, and the map
+ * the first audio stream of a type which can be played: AAC in ADTS frames
+ * or MPEG audio (MP3). That stream's PES packets are unwrapped and their
+ * payloads handed back in order, which gives back the ADTS or MP3 stream
+ * that was put in. Everything else (video, timed ID3 metadata) is dropped.
+ *
+ * Each HLS segment starts with its own tables, so a segment is demuxed on its
+ * own, in one go. Tables are expected to fit in one packet, as they always do
+ * for a stream this simple. A packet without sync is skipped up to the next
+ * one.
+ *
+ * This is plain C without any CoreFoundation dependency.
+ */
+
+typedef enum ts_audio_type {
+  TS_AUDIO_NONE,              /* there's no audio which can be played */
+  TS_AUDIO_ADTS,
+  TS_AUDIO_MPEG,
+} ts_audio_type_t;
+
+typedef void (*ts_payload_proc)(void *context, const uint8_t *bytes,
+                                size_t length);
+
+/* Whether the bytes look like the start of a transport stream */
+bool ASTSDemuxerProbe(const uint8_t *bytes, size_t length);
+
+/* Hands the audio payload of a whole segment to proc, a run at a time, and
+   returns what type of audio it was */
+ts_audio_type_t ASTSDemuxSegment(const uint8_t *bytes, size_t length,
+                          ts_payload_proc proc, void *context);
+
+#endif
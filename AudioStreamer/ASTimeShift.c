@@ -0,0 +1,169 @@
+//
+//  ASTimeShift.c
+//  AudioStreamer
+//
+
+#include "ASTimeShift.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* Descriptors are allowed for packets of this many bytes on average, which
+   is less than a second of any bitrate worth recording would use */
+#define kMinAveragePacketSize 128
+#define kMinDescriptors 1024
+
+typedef struct descriptor {
+  uint64_t position;          /* of its first byte, counted from the start */
+  uint64_t sampleTime;
+  uint32_t byteSize;
+  uint32_t variableFrames;
+} descriptor_t;
+
+struct time_shift {
+  int           fd;
+  uint8_t      *map;
+  size_t        mapLength;
+  descriptor_t *descriptors;  /* at the start of the map */
+  size_t        descriptorCount;
+  uint8_t      *bytes;        /* after them */
+  size_t        byteCapacity;
+
+  uint32_t      framesPerPacket;
+  uint64_t      first;
+  uint64_t      end;
+  uint64_t      position;     /* where the next packet goes */
+  uint64_t      sampleTime;   /* of the next packet */
+};
+
+static descriptor_t *descriptor(const time_shift_t *ts, uint64_t number) {
+  return &ts->descriptors[number % ts->descriptorCount];
+}
+
+time_shift_t *ASTimeShiftCreate(const char *directory, size_t byteCapacity,
+                                uint32_t framesPerPacket) {
+  if (byteCapacity == 0) return NULL;
+  time_shift_t *ts = calloc(1, sizeof(time_shift_t));
+  if (ts == NULL) return NULL;
+  ts->fd = -1;
+  ts->framesPerPacket = framesPerPacket;
+  ts->byteCapacity = byteCapacity;
+  ts->descriptorCount = byteCapacity / kMinAveragePacketSize;
+  if (ts->descriptorCount < kMinDescriptors) {
+    ts->descriptorCount = kMinDescriptors;
+  }
+  size_t descriptorBytes = ts->descriptorCount * sizeof(descriptor_t);
+  ts->mapLength = descriptorBytes + byteCapacity;
+
+  size_t length = strlen(directory) + sizeof("/AudioStreamer-timeshift-XXXXXX");
+  char *path = malloc(length);
+  if (path == NULL) goto fail;
+  snprintf(path, length, "%s/AudioStreamer-timeshift-XXXXXX", directory);
+  ts->fd = mkstemp(path);
+  if (ts->fd >= 0) unlink(path);
+  free(path);
+  if (ts->fd < 0) goto fail;
+
+  /* The file starts out sparse, and only takes up what's been written */
+  if (ftruncate(ts->fd, (off_t)ts->mapLength) != 0) goto fail;
+  void *map = mmap(NULL, ts->mapLength, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   ts->fd, 0);
+  if (map == MAP_FAILED) goto fail;
+  ts->map = map;
+  ts->descriptors = (descriptor_t *)ts->map;
+  ts->bytes = ts->map + descriptorBytes;
+  return ts;
+
+fail:
+  ASTimeShiftDestroy(ts);
+  return NULL;
+}
+
+void ASTimeShiftDestroy(time_shift_t *ts) {
+  if (ts == NULL) return;
+  if (ts->map != NULL) munmap(ts->map, ts->mapLength);
+  if (ts->fd >= 0) close(ts->fd);
+  free(ts);
+}
+
+bool ASTimeShiftAppend(time_shift_t *ts, const void *data, uint32_t byteSize,
+                       uint32_t variableFrames) {
+  if (byteSize > ts->byteCapacity) return false;
+
+  /* A packet which would straddle the end of the byte ring starts again at
+     its beginning */
+  uint64_t position = ts->position;
+  size_t offset = (size_t)(position % ts->byteCapacity);
+  if (offset + byteSize > ts->byteCapacity) {
+    position += ts->byteCapacity - offset;
+    offset = 0;
+  }
+
+  /* Drop the packets about to be written over, and the one whose descriptor
+     is about to be reused */
+  while (ts->first < ts->end) {
+    const descriptor_t *oldest = descriptor(ts, ts->first);
+    if (oldest->position + ts->byteCapacity >= position + byteSize &&
+        ts->end - ts->first < ts->descriptorCount) {
+      break;
+    }
+    ts->first++;
+  }
+
+  memcpy(ts->bytes + offset, data, byteSize);
+  descriptor_t *d = descriptor(ts, ts->end);
+  d->position = position;
+  d->sampleTime = ts->sampleTime;
+  d->byteSize = byteSize;
+  d->variableFrames = variableFrames;
+  ts->end++;
+  ts->position = position + byteSize;
+  ts->sampleTime += variableFrames > 0 ? variableFrames : ts->framesPerPacket;
+  return true;
+}
+
+uint64_t ASTimeShiftFirst(const time_shift_t *ts) {
+  return ts->first;
+}
+
+uint64_t ASTimeShiftEnd(const time_shift_t *ts) {
+  return ts->end;
+}
+
+bool ASTimeShiftPacket(const time_shift_t *ts, uint64_t number,
+                       time_shift_packet_t *packet) {
+  if (number < ts->first || number >= ts->end) return false;
+  const descriptor_t *d = descriptor(ts, number);
+  packet->data = ts->bytes + d->position % ts->byteCapacity;
+  packet->byteSize = d->byteSize;
+  packet->variableFrames = d->variableFrames;
+  packet->sampleTime = d->sampleTime;
+  return true;
+}
+
+bool ASTimeShiftFind(const time_shift_t *ts, uint64_t sampleTime,
+                     uint64_t *number) {
+  if (ts->first == ts->end) return false;
+  /* The last packet starting at or before the time */
+  uint64_t low = ts->first;
+  uint64_t high = ts->end - 1;
+  while (low < high) {
+    uint64_t middle = low + (high - low + 1) / 2;
+    if (descriptor(ts, middle)->sampleTime <= sampleTime) {
+      low = middle;
+    } else {
+      high = middle - 1;
+    }
+  }
+  *number = low;
+  return true;
+}
+
+uint64_t ASTimeShiftBytesFrom(const time_shift_t *ts, uint64_t number) {
+  if (number < ts->first) number = ts->first;
+  if (number >= ts->end) return 0;
+  return ts->position - descriptor(ts, number)->position;
+}
@@ -0,0 +1,76 @@
+//
+//  ASTimeShift.h
+//  AudioStreamer
+//
+
+#ifndef AS_TIME_SHIFT_H
+#define AS_TIME_SHIFT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A rolling recording of a live stream's audio packets, so that it can be
+ * played back later than it arrives: paused without losing anything, or
+ * rewound.
+ *
+ * Packets live in a file mapped into memory, written round and round. Like
+ * ASPacketRing.h there's a byte ring holding the packets themselves, each
+ * one contiguous, and a ring of fixed-size descriptors, one per packet, which
+ * say where its bytes are and the sample time its first frame plays at. Once
+ * either ring is full the oldest packets are overwritten, so what's held is a
+ * window of the most recent audio, bounded by the size of the file. As the
+ * pages are the file's, which the system writes out and drops as it sees fit,
+ * memory use doesn't grow with the window. The file is unlinked as soon as
+ * it's been created, so nothing is left behind.
+ *
+ * Packets are numbered from 0 in the order they're added, and sample times
+ * counted from the start of packet 0: each packet adds its variable frame
+ * count, or otherwise the fixed number of frames per packet.
+ *
+ * This is plain C without any CoreFoundation dependency.
+ */
+
+typedef struct time_shift time_shift_t;
+
+typedef struct time_shift_packet {
+  const void *data;           /* start of the packet's bytes */
+  uint32_t    byteSize;
+  uint32_t    variableFrames; /* mVariableFramesInPacket, 0 if not variable */
+  uint64_t    sampleTime;     /* of its first frame */
+} time_shift_packet_t;
+
+/* Creates a recording of about byteCapacity bytes of packets in a new file in
+   the directory. Returns NULL if the file can't be created and mapped, or
+   allocation fails */
+time_shift_t *ASTimeShiftCreate(const char *directory, size_t byteCapacity,
+                                uint32_t framesPerPacket);
+
+/* Unmaps and closes the file */
+void ASTimeShiftDestroy(time_shift_t *timeShift);
+
+/* Copies a packet onto the end, overwriting the oldest as needed. Returns
+   false if it's too big to ever fit */
+bool ASTimeShiftAppend(time_shift_t *timeShift, const void *data,
+                       uint32_t byteSize, uint32_t variableFrames);
+
+/* Number of the oldest packet still held */
+uint64_t ASTimeShiftFirst(const time_shift_t *timeShift);
+
+/* One past the number of the newest packet */
+uint64_t ASTimeShiftEnd(const time_shift_t *timeShift);
+
+/* Fills in a packet. Returns false if it isn't held */
+bool ASTimeShiftPacket(const time_shift_t *timeShift, uint64_t number,
+                       time_shift_packet_t *packet);
+
+/* The number of the packet playing at a sample time, or of the oldest or
+   newest if it's before or after those held. Returns false if nothing is */
+bool ASTimeShiftFind(const time_shift_t *timeShift, uint64_t sampleTime,
+                     uint64_t *number);
+
+/* Bytes of the packets from the given one on */
+uint64_t ASTimeShiftBytesFrom(const time_shift_t *timeShift, uint64_t number);
+
+#endif
@@ -0,0 +1,76 @@
+//
+//  ASTransport.c
+//  AudioStreamer
+//
+
+#include "ASTransport.h"
+
+#include <strings.h>
+
+void ASTransportInit(transport_t *transport, const transport_ops_t *ops,
+                     transport_event_proc proc, void *context) {
+  transport->ops = ops;
+  transport->proc = proc;
+  transport->context = context;
+  transport->paused = false;
+}
+
+ssize_t ASTransportRead(transport_t *transport, void *buffer, size_t length) {
+  return transport->ops->read(transport, buffer, length);
+}
+
+bool ASTransportHasBytesAvailable(transport_t *transport) {
+  return transport->ops->hasBytesAvailable(transport);
+}
+
+bool ASTransportAtEnd(transport_t *transport) {
+  return transport->ops->atEnd(transport);
+}
+
+void ASTransportSetPaused(transport_t *transport, bool paused) {
+  if (transport->paused == paused) return;
+  transport->paused = paused;
+  transport->ops->setPaused(transport, paused);
+}
+
+bool ASTransportIsPaused(const transport_t *transport) {
+  return transport->paused;
+}
+
+int ASTransportStatusCode(transport_t *transport) {
+  return transport->ops->statusCode(transport);
+}
+
+size_t ASTransportHeaderCount(transport_t *transport) {
+  return transport->ops->headerCount(transport);
+}
+
+bool ASTransportHeader(transport_t *transport, size_t index, const char **name,
+                       const char **value) {
+  return transport->ops->header(transport, index, name, value);
+}
+
+const char *ASTransportHeaderValue(transport_t *transport, const char *name) {
+  size_t count = ASTransportHeaderCount(transport);
+  for (size_t i = 0; i < count; i++) {
+    const char *key, *value;
+    if (ASTransportHeader(transport, i, &key, &value) &&
+        strcasecmp(key, name) == 0) {
+      return value;
+    }
+  }
+  return NULL;
+}
+
+const char *ASTransportError(transport_t *transport) {
+  return transport->ops->error(transport);
+}
+
+void ASTransportClose(transport_t *transport) {
+  transport->ops->close(transport);
+}
+
+void ASTransportNotify(transport_t *transport, transport_event_t event) {
+  if (transport->paused || transport->proc == NULL) return;
+  transport->proc(transport->context, transport, event);
+}
@@ -0,0 +1,101 @@
+//
+//  ASTransport.h
+//  AudioStreamer
+//
+
+#ifndef AS_TRANSPORT_H
+#define AS_TRANSPORT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * The interface a streamer reads a file's bytes through.
+ *
+ * A transport is one response body: the bytes of a file from some offset,
+ * read as they become available, plus the status and headers of the response
+ * they came in. Events say when there is something to read, when the body has
+ * all been read and when something has gone wrong, much like a CFReadStream's.
+ * While a transport is paused no events are sent, which is how a reader holds
+ * it back once enough is buffered; an event which is due is sent once it is
+ * resumed.
+ *
+ * Each implementation fills in a transport_ops_t and embeds a transport_t as
+ * the first member of its own structure. Events are sent from the thread the
+ * transport was opened on, and a transport must only be used from that
+ * thread.
+ *
+ * This is plain C without any CoreFoundation dependency.
+ */
+
+typedef struct transport transport_t;
+
+typedef enum {
+  TRANSPORT_EVENT_READABLE,   /* there are bytes to read */
+  TRANSPORT_EVENT_END,        /* every byte of the body has been read */
+  TRANSPORT_EVENT_ERROR,      /* the body can't be read any further */
+} transport_event_t;
+
+typedef void (*transport_event_proc)(void *context, transport_t *transport,
+                                     transport_event_t event);
+
+typedef struct transport_ops {
+  /* Reads up to length bytes, returning how many were read, 0 if there are
+     none right now or -1 on error */
+  ssize_t (*read)(transport_t *transport, void *buffer, size_t length);
+  bool (*hasBytesAvailable)(transport_t *transport);
+  bool (*atEnd)(transport_t *transport);
+  void (*setPaused)(transport_t *transport, bool paused);
+  /* The response's status code, or 0 if there isn't one */
+  int (*statusCode)(transport_t *transport);
+  size_t (*headerCount)(transport_t *transport);
+  bool (*header)(transport_t *transport, size_t index, const char **name,
+                 const char **value);
+  /* Description of what went wrong, or NULL */
+  const char *(*error)(transport_t *transport);
+  void (*close)(transport_t *transport);
+} transport_ops_t;
+
+struct transport {
+  const transport_ops_t *ops;
+  transport_event_proc   proc;
+  void                  *context;
+  bool                   paused;
+};
+
+/* Sets up the common part of a new transport */
+void ASTransportInit(transport_t *transport, const transport_ops_t *ops,
+                     transport_event_proc proc, void *context);
+
+ssize_t ASTransportRead(transport_t *transport, void *buffer, size_t length);
+bool ASTransportHasBytesAvailable(transport_t *transport);
+
+/* Whether every byte of the body has been read */
+bool ASTransportAtEnd(transport_t *transport);
+
+/* Stops or starts the transport's events */
+void ASTransportSetPaused(transport_t *transport, bool paused);
+bool ASTransportIsPaused(const transport_t *transport);
+
+int ASTransportStatusCode(transport_t *transport);
+
+/* Response headers, in the order they were received. Names are as the server
+   wrote them */
+size_t ASTransportHeaderCount(transport_t *transport);
+bool ASTransportHeader(transport_t *transport, size_t index, const char **name,
+                       const char **value);
+
+/* Value of the first header with the given name, compared ignoring case, or
+   NULL if there isn't one */
+const char *ASTransportHeaderValue(transport_t *transport, const char *name);
+
+const char *ASTransportError(transport_t *transport);
+
+/* Closes the transport and frees it. No more events are sent */
+void ASTransportClose(transport_t *transport);
+
+/* For implementations: sends an event unless the transport is paused */
+void ASTransportNotify(transport_t *transport, transport_event_t event);
+
+#endif
@@ -0,0 +1,129 @@
+//
+//  ASWAVWriter.c
+//  AudioStreamer
+//
+
+#include "ASWAVWriter.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define kWAVEFormatIEEEFloat 3
+/* RIFF header, fmt chunk with an empty extension, fact chunk, data header */
+#define kHeaderSize (12 + 26 + 12 + 8)
+#define kMaxDataSize (UINT32_MAX - kHeaderSize + 8)
+
+struct wav_writer {
+  FILE     *file;
+  uint32_t  sampleRate;
+  uint16_t  channels;
+  uint64_t  frames;
+  uint64_t  dataSize;
+  bool      failed;
+};
+
+static void put16(uint8_t *p, uint16_t value) {
+  p[0] = (uint8_t) value;
+  p[1] = (uint8_t) (value >> 8);
+}
+
+static void put32(uint8_t *p, uint32_t value) {
+  put16(p, (uint16_t) value);
+  put16(p + 2, (uint16_t) (value >> 16));
+}
+
+static void wav_header(uint8_t *header, uint32_t sampleRate, uint16_t channels,
+                       uint32_t frames, uint32_t dataSize) {
+  uint16_t blockAlign = channels * sizeof(float);
+  memcpy(header, "RIFF", 4);
+  put32(header + 4, kHeaderSize - 8 + dataSize);
+  memcpy(header + 8, "WAVE", 4);
+
+  memcpy(header + 12, "fmt ", 4);
+  put32(header + 16, 18);
+  put16(header + 20, kWAVEFormatIEEEFloat);
+  put16(header + 22, channels);
+  put32(header + 24, sampleRate);
+  put32(header + 28, sampleRate * blockAlign);
+  put16(header + 32, blockAlign);
+  put16(header + 34, 32);
+  put16(header + 36, 0);
+
+  /* Required of every format but PCM */
+  memcpy(header + 38, "fact", 4);
+  put32(header + 42, 4);
+  put32(header + 46, frames);
+
+  memcpy(header + 50, "data", 4);
+  put32(header + 54, dataSize);
+}
+
+wav_writer_t *ASWAVWriterCreate(const char *path, uint32_t sampleRate,
+                                uint16_t channels) {
+  if (channels == 0) return NULL;
+  wav_writer_t *writer = calloc(1, sizeof(wav_writer_t));
+  if (writer == NULL) return NULL;
+  writer->sampleRate = sampleRate;
+  writer->channels = channels;
+  writer->file = fopen(path, "wb");
+  if (writer->file == NULL) {
+    free(writer);
+    return NULL;
+  }
+
+  uint8_t header[kHeaderSize];
+  wav_header(header, sampleRate, channels, 0, 0);
+  if (fwrite(header, sizeof(header), 1, writer->file) != 1) {
+    fclose(writer->file);
+    free(writer);
+    return NULL;
+  }
+  return writer;
+}
+
+bool ASWAVWriterWrite(wav_writer_t *writer, const float *samples,
+                      size_t frames) {
+  size_t frameSize = writer->channels * sizeof(float);
+  uint64_t room = (kMaxDataSize - writer->dataSize) / frameSize;
+  if (frames > room) frames = (size_t) room;
+  if (frames == 0 || writer->failed) return !writer->failed;
+
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  for (size_t i = 0; i < frames * writer->channels; i++) {
+    uint32_t bits;
+    uint8_t bytes[4];
+    memcpy(&bits, &samples[i], sizeof(bits));
+    put32(bytes, bits);
+    if (fwrite(bytes, sizeof(bytes), 1, writer->file) != 1) {
+      writer->failed = true;
+      return false;
+    }
+  }
+#else
+  if (fwrite(samples, frameSize, frames, writer->file) != frames) {
+    writer->failed = true;
+    return false;
+  }
+#endif
+  writer->frames += frames;
+  writer->dataSize += frames * frameSize;
+  return true;
+}
+
+uint64_t ASWAVWriterFrameCount(const wav_writer_t *writer) {
+  return writer->frames;
+}
+
+bool ASWAVWriterClose(wav_writer_t *writer) {
+  if (writer == NULL) return false;
+  uint8_t header[kHeaderSize];
+  wav_header(header, writer->sampleRate, writer->channels,
+             writer->frames > UINT32_MAX ? UINT32_MAX : (uint32_t) writer->frames,
+             (uint32_t) writer->dataSize);
+  bool ok = !writer->failed && fseek(writer->file, 0, SEEK_SET) == 0 &&
+            fwrite(header, sizeof(header), 1, writer->file) == 1;
+  ok = fclose(writer->file) == 0 && ok;
+  free(writer);
+  return ok;
+}
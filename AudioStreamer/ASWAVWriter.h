@@ -0,0 +1,43 @@
+//
+//  ASWAVWriter.h
+//  AudioStreamer
+//
+
+#ifndef AS_WAV_WRITER_H
+#define AS_WAV_WRITER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Writes interleaved 32-bit float samples to a WAV file.
+ *
+ * The header goes out first with its sizes left at zero, and is filled in
+ * when the writer is closed, so the file can be written as the audio is
+ * decoded without knowing its length beforehand. A WAV file can't describe
+ * more than 4 GB of samples; anything past that is dropped.
+ *
+ * This is plain C without any CoreFoundation dependency.
+ */
+
+typedef struct wav_writer wav_writer_t;
+
+/* Creates or truncates the file and writes its header. Returns NULL if the
+   file can't be written or allocation fails */
+wav_writer_t *ASWAVWriterCreate(const char *path, uint32_t sampleRate,
+                                uint16_t channels);
+
+/* Appends frames of samples, one per channel each. Returns false if the
+   write failed */
+bool ASWAVWriterWrite(wav_writer_t *writer, const float *samples,
+                      size_t frames);
+
+/* Frames written so far */
+uint64_t ASWAVWriterFrameCount(const wav_writer_t *writer);
+
+/* Fills in the header and closes the file. Returns false if anything failed
+   along the way, in which case the file is incomplete */
+bool ASWAVWriterClose(wav_writer_t *writer);
+
+#endif
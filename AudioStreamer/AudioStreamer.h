@@ -27,9 +27,14 @@
 #import <AudioToolbox/AudioToolbox.h>
 #import <Foundation/Foundation.h>
 
-/* Maximum number of packets which can be contained in one buffer */
+/* Maximum number of packets which can be contained in one buffer. Buffers
+   are given fewer when their packets are large enough not to need them */
 #define kAQMaxPacketDescs 512
 
+/* File type for Ogg streams. AudioFileStream knows nothing of Ogg, so these
+   are always demuxed by AudioStreamer itself */
+#define kASOggFileType 'OggS'
+
 /**
  * The state that the streamer is in.
  *
@@ -153,7 +158,12 @@ typedef NS_ENUM(NSInteger, AudioStreamerErrorCode)
   /**
    * The connection to the stream timed out
    */
-  AS_TIMED_OUT = 1022
+  AS_TIMED_OUT = 1022,
+  /**
+   * The decoded audio couldn't be rendered offline or written to
+   * <[AudioStreamer pcmOutputPath]> or <[AudioStreamer outputSink]>
+   */
+  AS_OFFLINE_RENDER_FAILED = 1023
 };
 
 /**
@@ -220,18 +230,71 @@ typedef NS_ENUM(NSUInteger, AudioStreamerLogLevel) {
 	AS_LOG_LEVEL_VERBOSE
 };
 
+/**
+ * Number of bins in <[AudioStreamerMetrics bufferOccupancy]>
+ */
+#define AS_METRICS_BUFFER_BINS 8
+
+/**
+ * Quality-of-service measurements of a stream, as returned by
+ * <[AudioStreamer metrics]>. Times are in seconds.
+ */
+typedef struct AudioStreamerMetrics {
+  /** From <[AudioStreamer start]> (or <[AudioStreamer preload]>) to the first
+      byte received from the network, or -1 if there hasn't been one */
+  double timeToFirstByte;
+  /** From the start to the audio queue first playing, or -1 if it hasn't */
+  double timeToFirstAudio;
+  /** Times playback ran out of audio and had to wait for more */
+  UInt32 rebufferCount;
+  /** Time spent waiting for more audio, including a wait going on now */
+  double stallTime;
+  /** Time spent playing with up to 0.5, 1, 2, 4, 8, 16 and 32 seconds of
+      audio buffered, and with more than that in the last bin */
+  double bufferOccupancy[AS_METRICS_BUFFER_BINS];
+  /** Bytes received from the network */
+  UInt64 bytesDownloaded;
+  /** Bytes per second the network is delivering, 0 until it's known */
+  double throughput;
+  /** Audio received from the network and thrown away by seeks before being
+      played. Audio which went into the disk cache isn't counted */
+  UInt64 bytesWasted;
+  /** Times the stream reconnected after a network error */
+  UInt32 reconnectCount;
+} AudioStreamerMetrics;
+
 enum AudioStreamerProxyType : NSUInteger;
-enum AudioStreamerID3ParserState : NSUInteger;
 struct buffer;
-struct queued_vbr_packet;
-struct queued_cbr_packet;
+struct packet_ring;
+struct time_shift;
+struct icy_demuxer;
+struct id3_parser;
+struct seek_index;
+struct mp4_info;
+struct mp3_parser;
+struct adts_parser;
+struct ogg_demuxer;
+struct disk_cache_entry;
+struct crossfade;
+struct buffer_controller;
+struct spsc_queue;
+struct transport;
+struct stream_metrics;
+struct output_sink;
+struct snapshot;
+struct queue_context;
+struct normalizer;
 
 @class AudioStreamer;
+@class ASStreamerRef;
 
 /**
  * The AudioStreamerDelegate protocol provides callbacks for events that may happen
  * during the stream. This replaces the former NSNotification system used in Matt
  * Gallagher's original version.
+ *
+ * Callbacks are made on the stream's <[AudioStreamer delegateQueue]>, after the
+ * event has happened, so the stream may have moved on again by then.
  */
 @protocol AudioStreamerDelegate <NSObject>
 
@@ -251,7 +314,10 @@ - (void)streamerStatusDidChange:(AudioStreamer *)sender;
  * @brief Called when the stream has collected enough data to calculate the bitrate
  *
  * @details This is the earliest that seeks can be performed and, in some streams,
- * the earliest that the duration can be calculated.
+ * the earliest that the duration can be calculated. When the stream's headers
+ * give the bitrate (a Xing, Info or VBRI header, an MP4 moov, or a constant
+ * bitrate frame header) this is as soon as the first frame arrives; otherwise
+ * it's once enough packets have been seen to estimate it.
  *
  * @param sender The streamer that called this method
  *
@@ -279,16 +345,25 @@ - (void)streamerMetadataIsReady:(AudioStreamer *)sender;
  * This class is essentially a pipeline of three components to get audio to the
  * speakers:
  *
- *              CFReadStream => AudioFileStream => AudioQueue
- *
- * ### CFReadStream
- *
- * The method of reading HTTP data is using the low-level CFReadStream class
- * because it allows configuration of proxies and scheduling/rescheduling on the
- * event loop. All data read from the HTTP stream is piped into the
- * AudioFileStream which then parses all of the data. This stage of the pipeline
- * also flags that events are happening to prevent a timeout. All network
- * activity occurs on the thread which started the audio stream.
+ *              Transport => AudioFileStream => AudioQueue
+ *
+ * ### Transport
+ *
+ * HTTP data is read by a non-blocking HTTP/1.1 client which keeps connections
+ * open, so that the Range requests made when seeking don't each have to
+ * connect again (see <persistentConnections>). Anything it can't fetch, such as
+ * https URLs, is read with the low-level CFReadStream class instead, as are
+ * bytes from the disk cache. Either way the stream can be held back and
+ * resumed, and proxies are honoured. HTTP Live Streaming playlists are played
+ * through the same client, which fetches their segments and takes the audio
+ * out of them so it reads like any other stream (see <hlsPrefetchSegments>).
+ * A station's PLS or M3U playlist is read by racing the mirrors it lists and
+ * keeping the fastest (see <mirrorRaceCount>). A live stream can be recorded
+ * as it plays so that it can be paused and rewound (see <timeShiftDuration>).
+ * All data read from the HTTP stream is
+ * piped into the AudioFileStream which then parses all of the data. This stage
+ * of the pipeline also flags that events are happening to prevent a timeout.
+ * All network activity occurs on the stream thread (see "Threading" below).
  *
  * ### AudioFileStream
  *
@@ -315,18 +390,39 @@ - (void)streamerMetadataIsReady:(AudioStreamer *)sender;
  *
  * This final stage is also implemented by Apple, and receives all of the full
  * buffers of data from the AudioFileStream's parsed packets. The implementation
- * manages its own set of threads, but callbacks are invoked on the main thread.
- * The two callbacks that the audio stream is interested in are playback state
+ * manages its own set of threads, and its callbacks are invoked on them. The
+ * two callbacks that the audio stream is interested in are playback state
  * changing and audio buffers being freed.
  *
- * When a buffer is freed, then it is marked as so, and if the stream was
- * waiting for a buffer to be freed a message to empty the queue as much as
- * possible is sent to the main thread's run loop. Otherwise no extra action
- * need be performed.
+ * Freed buffers are handed to the stream thread through a lock-free queue, so
+ * the audio queue's thread never waits on it. There each one is marked as
+ * freed, and if the stream was waiting for a buffer to be freed, the queue is
+ * emptied as much as possible. Otherwise no extra action need be performed.
  *
  * The main purpose of knowing when the playback state changes is to change the
  * state of the player accordingly.
  *
+ * ## Threading
+ *
+ * Reading, parsing and filling buffers for every AudioStreamer happens on one
+ * thread of its own, the stream thread, so that a busy main thread can't hold
+ * up playback. All of a stream's state lives there. Its methods and properties
+ * can be used from any thread. Calls which change the stream are run on the
+ * stream thread. Most of them, such as <pause>, <play>, <stop>, <seekToTime:>
+ * and <setVolume:>, don't wait for it: they return what the stream's state says
+ * will happen, and the stream thread carries them out in the order they were
+ * made. Only <start>, <preload>, <playAtHostTime:>, <endHostTime:> and the
+ * equal-power crossfades wait, since their results depend on the stream
+ * thread's answer. Properties and other getters don't wait either: the
+ * stream thread publishes a snapshot of what they report as it changes, and
+ * they read that, under a lock which is only ever held for a moment. A UI timer
+ * polling <progress:> never waits on a stream which is busy. Delegate callbacks
+ * are made on the <delegateQueue>, and the snapshot is up to date by the time
+ * each is.
+ *
+ * Letting go of a stream on another thread doesn't wait for the stream thread
+ * either. Whatever belongs there is handed over and closed there later.
+ *
  * ## Errors
  *
  * There are a large number of places where error can happen, and the stream can
@@ -351,6 +447,31 @@ - (void)streamerMetadataIsReady:(AudioStreamer *)sender;
  * proper byte offset. This second stream is then used to put data through the
  * pipelines.
  *
+ * ## Disk cache
+ *
+ * When a disk cache has been set up with <setDiskCacheDirectory:sizeLimit:>,
+ * the bytes of seekable files are also written to disk as they arrive. Any
+ * range of the file already on disk is then read from there instead, both
+ * after a seek and when the same URL is played again, and only the gaps
+ * between cached ranges are requested from the remote source (with an
+ * If-Range header, so that a file which has changed is fetched afresh). The
+ * read stream is simply swapped between cached bytes and the network as the
+ * stream moves from one range to the next.
+ *
+ * ## Gapless playback
+ *
+ * Encoders add silence to the start of a stream (priming) and pad out its
+ * end. When a stream says how much (in a LAME tag or an iTunSMPB comment for
+ * MP3, the packet table of an MPEG-4 file, or the header of an Opus stream),
+ * each buffer given to the audio queue is trimmed so that exactly the frames
+ * of real audio are played. After a seek to an estimated position the packet
+ * numbers aren't known for certain, and nothing is trimmed from then on.
+ *
+ * With the padding gone, one stream can follow another with no gap: once all
+ * of a stream has been given to the queue, <endHostTime:> tells when its last
+ * frame will play, and a preloaded stream started with <playAtHostTime:>
+ * picks up from there. ASPlaylist does this for songs it preloads.
+ *
  * ## Example usage
  *
  * An audio stream is a one-shot thing. Once initialized, the source cannot be
@@ -367,7 +488,20 @@ @interface AudioStreamer : NSObject {
   int             proxyPort;
 
   /* Created as part of the <start> method */
-  CFReadStreamRef stream;
+  struct transport *stream;
+  bool   usingHTTPClient;     /* is the stream from the persistent client? */
+  bool   usingSegments;       /* ...and downloading over several connections? */
+  bool   httpClientRefused;   /* was this URL redirected where it can't go? */
+  bool   hlsStream;           /* is the URL an HLS playlist? */
+  bool   hlsStarted;          /* has the HLS transport said where it started? */
+  double hlsStartTime;        /* seconds into the playlist to open it from */
+  double hlsDuration;         /* of a VOD playlist, 0 when live or not known */
+  bool   stationStream;       /* is the URL a station's PLS or M3U playlist? */
+  bool   racingMirrors;       /* ...and is the stream racing its mirrors? */
+  NSURL  *mirrorURL;          /* the mirror being read, nil until one won */
+  NSMutableArray *mirrorURLs; /* mirrors left to fail over to, best first */
+  UInt64 segmentStart;        /* File offset where the read stream started */
+  UInt64 rangeWindow;         /* bytes asked for at a time after seeking */
 
   /* Timeout management */
   NSTimer *timeout; /* timer managing the timeout event */
@@ -375,8 +509,14 @@ @interface AudioStreamer : NSObject {
   bool rescheduled; /* flag if the http stream was rescheduled */
   int events;       /* events which have happened since the last tick */
 
-  /* Once the stream has bytes read from it, these are created */
+  /* Once the stream has bytes read from it, these are created. MP3 and ADTS
+     streams are split into packets by one of the built-in parsers instead of
+     an AudioFileStream when nativeParsing is on */
   AudioFileStreamID audioFileStream;
+  struct mp3_parser *mp3Parser;
+  struct adts_parser *adtsParser;
+  struct ogg_demuxer *oggDemuxer; /* always used for Ogg streams */
+  NSData *magicCookie;       /* made by a built-in parser for the queue */
 
   /* The audio file stream will fill in these parameters */
   UInt64 fileLength;         /* length of file, set from http headers */
@@ -387,41 +527,49 @@ @interface AudioStreamer : NSObject {
    created once the first packet arrives */
   AudioQueueRef audioQueue;
   UInt32 packetBufferSize;   /* guessed from audioFileStream */
+  UInt32 packetSizeUpperBound; /* largest packet, when known without audioFileStream */
 
   /* When receiving audio data, raw data is placed into these buffers. The
    * buffers are essentially a "ring buffer of buffers" as each buffer is cycled
    * through and then freed when not in use. Each buffer can contain one or many
-   * packets, so the packetDescs array is a list of packets which describes the
-   * data in the next pending buffer (used to enqueue data into the AudioQueue
-   * structure */
+   * packets, described by its own slice of packetDescPool (used to enqueue
+   * data into the AudioQueue structure) */
   struct buffer **buffers; /* Information for each buffer */
-  AudioStreamPacketDescription packetDescs[kAQMaxPacketDescs];
-  UInt32 packetsFilled;         /* number of valid entries in packetDescs */
+  UInt32 activeBuffers;    /* how many of maxBuffers are in the ring now */
+  UInt32 maxBuffers;       /* bufferCount, or fewer to fit the memoryBudget */
+  AudioStreamPacketDescription *packetDescPool; /* descsPerBuffer per buffer */
+  UInt32 descsPerBuffer;        /* 0 for CBR, which needs none */
+  UInt32 typicalPacketSize;     /* average of the first packets */
+  size_t readAheadLimit;        /* bytes of queuedPackets the budget allows */
+  UInt32 packetsFilled;         /* packets in the pending buffer */
   UInt32 bytesFilled;           /* bytes in use in the pending buffer */
   unsigned int fillBufferIndex; /* index of the pending buffer */
   UInt32 buffersUsed;           /* Number of buffers in use */
+  UInt64 bytesInQueue;          /* bytes in the buffers in use */
+  UInt64 framesInQueue;         /* audio frames in the buffers in use */
 
   /* cache state (see above description) */
   bool waitingOnBuffer;
-  struct queued_vbr_packet *queued_vbr_head;
-  struct queued_vbr_packet *queued_vbr_tail;
-  struct queued_cbr_packet *queued_cbr_head;
-  struct queued_cbr_packet *queued_cbr_tail;
+  struct packet_ring *queuedPackets; /* packets waiting for a free buffer */
+  struct time_shift *timeShift;      /* a live stream's recording, if any */
+  UInt64 timeShiftNext;              /* recorded packet to play next */
+  UInt64 timeShiftNextFrame;         /* ...and the sample time it starts at */
 
   /* Internal metadata about state */
   AudioStreamerState state_;
 
   /* ID3 support */
-  enum AudioStreamerID3ParserState id3ParserState;
+  struct id3_parser *id3Parser; /* Reads the ID3v2 tag across network reads */
+  bool id3Finished;             /* Is the tag done with (or absent)? */
+  NSString *id3Title;
+  NSString *id3Artist;
 
   /* ICY stream metadata */
   bool   icyStream;           /* Is this an ICY stream? */
   bool   icyChecked;          /* Have we already checked if this is an ICY stream? */
   bool   icyHeadersParsed;    /* Are all the ICY headers parsed? */
   int    icyMetaInterval;     /* The interval between ICY metadata bytes */
-  UInt16 icyMetaBytesRemaining;     /* How many bytes of ICY metadata are left? */
-  int    icyDataBytesRead;    /* How many data bytes have been read in an ICY stream since metadata? */
-  NSMutableString *icyMetadata;     /* The string of metadata itself, as it is being read */
+  struct icy_demuxer *icyDemuxer;   /* Separates ICY metadata from the audio */
   double icyBitrate;          /* The bitrate of the ICY stream */
 
   /* Miscellaneous metadata */
@@ -430,19 +578,87 @@ @interface AudioStreamer : NSObject {
   bool   seekable;           /* Does the stream accept the range header? */
   double seekTime;
   bool   seeking;            /* Are we currently in the process of seeking? */
-  double lastProgress;       /* last calculated progress point */
   UInt32 processedPacketsCount;     /* bit rate calculation utility */
   UInt64 processedPacketsSizeTotal; /* helps calculate the bit rate */
   bool   bitrateNotification;       /* notified that the bitrate is ready */
   bool   isParsing;           /* Are we parsing the file stream? */
-  UInt64 totalAudioPackets;   /* Total number of audio packets expected */
+  struct seek_index *seekIndex; /* Maps packets to byte offsets */
+  struct mp4_info *mp4Info;   /* Duration and size from an MP4's boxes */
+  double headerBitrate;       /* Of the first MP3 frame, 0 if unknown */
+  bool   indexingPackets;     /* Are packet numbers known for certain? */
+  UInt64 streamOffset;        /* File offset of the next byte to be parsed */
   bool   vbr;                 /* Are we playing a VBR stream? */
   bool   didConnect;          /* Did we connect successfully at some point? */
   bool   queuePaused;         /* Is the audio queue paused? */
   bool   bitrateEstimated;    /* Was the last bitrate calculation an estimate? */
-  bool   defaultBufferSizeUsed;     /* Was the default buffer size used? */
   UInt64 audioBytesReceived;  /* The total number of audio bytes we have received so far */
   UInt64 audioPacketsReceived;    /* The total number of audio packets we have received so far */
+
+  /* Ogg streams */
+  int    oggHeadersLeft;      /* header packets still to come in this track */
+  UInt16 opusPreSkip;         /* samples at the start of the track to skip */
+  bool   oggTimePending;      /* waiting for a granule position after a seek */
+  UInt64 oggSamplesSinceSeek; /* samples received while waiting for one */
+
+  /* Disk cache */
+  struct disk_cache_entry *cacheEntry; /* cached ranges of this URL, if any */
+  bool   readingCache;        /* Is the read stream serving cached bytes? */
+  bool   cacheWritable;       /* Are bytes from the network being stored? */
+  bool   responseChecked;     /* Has the current response been looked at? */
+  UInt64 cacheWriteOffset;    /* File offset of the next byte from the network */
+  UInt64 segmentEnd;          /* File offset where the read stream stops */
+
+  /* Gapless playback */
+  UInt64 primingFrames;       /* decoded frames to drop from the start */
+  UInt64 validFrames;         /* frames of audio after those, 0 if unknown */
+  bool   trimmingFrames;      /* Are packet numbers exact enough to trim by? */
+  UInt64 framesEnqueued;      /* frames given to the queue since it started */
+
+  /* Hand-off from the audio queue's threads to the stream thread, and what
+     the processing tap works with. Kept apart so that they can outlive the
+     stream until the queue has been disposed of */
+  struct queue_context *queueContext;
+
+  /* The context of the stream's transports and run loop source, which finds
+     the stream without keeping it alive */
+  ASStreamerRef *streamerRef;
+
+  /* What getters called from other threads report (see "Threading"), with
+     the objects among it, all read and written under the snapshot's lock */
+  struct snapshot *snapshot;
+  NSError *snapshotError;
+  NSDictionary *snapshotHTTPHeaders;
+  NSString *snapshotCurrentSong;
+
+  /* Equal-power fades and loudness normalization, applied to the decoded
+     audio by a processing tap */
+  AudioQueueProcessingTapRef processingTap;
+  struct crossfade *crossfade; /* owned by the queue context, for the tap */
+  struct normalizer *normalizer; /* likewise, if normalization is on */
+  double taggedLoudness;      /* LUFS from ReplayGain or R128 tags, or NAN */
+
+  /* How much to buffer, from how fast the network keeps up */
+  struct buffer_controller *bufferController;
+  double streamBitrate;       /* bits/sec the watermarks were worked out for */
+  double lowWatermark;        /* seconds to buffer before resuming after a stall */
+  double highWatermark;       /* seconds to read ahead of playback at most */
+
+  bool   preloading;          /* Buffering without playing until told to */
+
+  /* Quality-of-service measurements, when they're enabled */
+  struct stream_metrics *streamMetrics;
+  NSTimer *metricsTimer;      /* calls the metricsHandler */
+
+  /* Rendering offline for the pcmHandler, pcmOutputPath or outputSink,
+     instead of playing */
+  bool   renderingOffline;
+  bool   offlinePrimed;       /* has the queue's render timeline started? */
+  bool   queueFlushed;        /* has the queue been told nothing more is coming? */
+  UInt64 framesRendered;      /* frames rendered since the queue started */
+  UInt64 lastBufferFrames;    /* frames in the buffer given to the queue last */
+  AudioStreamBasicDescription renderFormat;
+  AudioQueueBufferRef renderBuffer;
+  struct output_sink *renderSink; /* everything the rendered audio goes to */
 }
 
 /** @name Creating an audio stream */
@@ -468,6 +684,15 @@ + (instancetype)streamWithURL:(NSURL*)url;
  */
 @property (nonatomic, readwrite, weak) id <AudioStreamerDelegate> delegate;
 
+/**
+ * @brief The queue delegate callbacks are made on
+ *
+ * @details Set this before the stream starts.
+ *
+ * Default: the main queue
+ */
+@property (readwrite) NSOperationQueue *delegateQueue;
+
 /**
  * @brief Tests whether the stream is playing
  *
@@ -524,6 +749,9 @@ + (instancetype)streamWithURL:(NSURL*)url;
  * - The duration cannot be calculated
  * - The Accept-Ranges HTTP header does not return "bytes"
  *
+ * A live stream which is being recorded (see <timeShiftDuration>) can be seeked
+ * within the recording whatever the above.
+ *
  * The <seekToTime:> method will always return this value but this property may be
  * useful for those who want to know whether they can seek beforehand. An example could
  * be if you wanted to disable user interaction if a seek bar.
@@ -605,6 +833,10 @@ + (instancetype)streamWithURL:(NSURL*)url;
  * as the data needed to store is much larger. The default value covers most
  * bitrates but further tweaking may be required in certain cases.
  *
+ * This is the most buffers there will be. Once the stream's bitrate is known,
+ * only enough of them to hold the low watermark (see <bufferInfinite>) are
+ * kept, and more are added after a stall.
+ *
  * Default: 256
  */
 @property (readwrite) UInt32 bufferCount;
@@ -625,6 +857,25 @@ + (instancetype)streamWithURL:(NSURL*)url;
  */
 @property (readwrite) UInt32 bufferSize;
 
+/**
+ * @brief The most memory to use for buffered audio, in bytes
+ *
+ * @details When set, the number of buffers, the size of CBR buffers and the
+ * audio read ahead of them (see <bufferInfinite>) are all cut down so that
+ * together they fit in this many bytes, along with the packet descriptions of
+ * VBR buffers. Half goes to the buffers, and whatever they leave to reading
+ * ahead. <bufferCount> and <bufferSize> become the most that's used.
+ *
+ * Buffers are never made fewer than 4, or CBR buffers smaller than 1 KB, so a
+ * budget too small for that is overrun. Reading ahead stops at the budget
+ * even with <bufferInfinite> set.
+ *
+ * Set to 0 for no budget.
+ *
+ * Default: 0
+ */
+@property (readwrite) NSUInteger memoryBudget;
+
 /**
  * @brief The number of buffers to fill before starting the stream
  *
@@ -636,10 +887,48 @@ + (instancetype)streamWithURL:(NSURL*)url;
  * not error if not done so. AudioStreamer will simply fallback to the bufferCount
  * as the amount to fill instead.
  *
+ * This only applies to the first start. After playback runs out of data, it
+ * starts again once the low watermark is buffered (see <bufferInfinite>).
+ *
  * Default: 32
  */
 @property (readwrite) UInt32 bufferFillCountToStart;
 
+/**
+ * @brief Milliseconds of audio to buffer before starting the stream
+ *
+ * @details When set, this replaces <bufferFillCountToStart>: the stream
+ * starts once this much audio is buffered, whatever the bitrate. The amount
+ * buffered is counted in frames, from the frames per packet and the sample
+ * rate, so it's right for VBR streams too. If the buffer being filled takes
+ * the stream past the target it's handed to the audio queue straight away
+ * rather than once it's full, so the start isn't held up by how much audio
+ * fits in a buffer.
+ *
+ * As with <bufferFillCountToStart>, this only applies to the first start.
+ *
+ * Set to 0 to start on <bufferFillCountToStart> instead.
+ *
+ * Default: 0
+ */
+@property (readwrite) UInt32 bufferDurationToStart;
+
+/**
+ * @brief Flag if to start as soon as the buffered audio won't run out
+ *
+ * @details With <bufferDurationToStart> set, this starts the stream earlier
+ * when the download is fast enough: once the measured download rate (less its
+ * deviation) shows that what's buffered will last until the end of the
+ * stream. A download faster than the stream needs only a fraction of a second
+ * buffered; a slower one needs enough to make up the difference, up to the
+ * larger of <bufferDurationToStart> and the low watermark. Live streams, and
+ * streams started before the download rate is known, wait for
+ * <bufferDurationToStart>.
+ *
+ * Default: NO
+ */
+@property (readwrite) BOOL adaptiveStart;
+
 /**
  * @brief The file type of this audio stream
  *
@@ -655,13 +944,35 @@ + (instancetype)streamWithURL:(NSURL*)url;
  */
 @property (readwrite) AudioFileTypeID fileType;
 
+/**
+ * @brief Flag if to split MP3 and AAC streams into packets without AudioFileStream
+ *
+ * @details When this flag is set, MP3 and ADTS framed AAC streams are parsed by
+ * AudioStreamer's own frame scanners rather than Apple's AudioFileStream. The
+ * scanners only trust a frame header when the next frame follows it and pick
+ * up again quickly after garbage in the stream, which makes them more
+ * forgiving of damaged and restarted internet radio streams. MP3 frames which
+ * fail their CRC are dropped.
+ *
+ * Ogg streams are always demuxed by AudioStreamer, and other file types always
+ * go through AudioFileStream.
+ *
+ * Default: YES
+ */
+@property (readwrite) BOOL nativeParsing;
+
 /**
  * @brief Flag if to infinitely buffer data
  *
- * @details If this flag is set to NO, then a statically sized buffer is used as
- * determined by the <bufferCount> and <bufferSize> properties and the read stream
- * will be descheduled when those fill up. This limits the bandwidth consumed to the
- * remote source and also limits memory usage.
+ * @details If this flag is set to NO, then the read stream is descheduled once
+ * enough is buffered, which limits the bandwidth consumed to the remote source
+ * and also limits memory usage. How much is enough depends on how fast and how
+ * steady the download has been compared with the stream's bitrate: audio is read
+ * ahead of the <bufferCount> buffers up to a high watermark, from a few seconds
+ * on a fast network to a minute on a slow or erratic one. After playback runs
+ * out of data, it waits for a low watermark to be buffered before resuming, and
+ * each stall raises both. Until the bitrate is known, reading stops as soon as
+ * the buffers are full.
  *
  * If, however, you wish to hold the entire stream in memory, then you can set
  * this flag to YES. In this state, the stream will be entirely downloaded,
@@ -691,6 +1002,95 @@ + (instancetype)streamWithURL:(NSURL*)url;
  */
 @property (readwrite) int timeoutInterval;
 
+/**
+ * @brief Flag if to read http URLs over connections which are kept open
+ *
+ * @details When this is YES, http URLs are read by a built-in HTTP/1.1 client
+ * which keeps connections open once a response has been read and reuses them
+ * for later requests to the same server, shared among all streams. When
+ * seeking within a file it's read a window at a time with Range requests,
+ * starting small and growing, so that a seek soon after the last one leaves
+ * little to read off and the connection can be used straight away rather than
+ * connecting again.
+ *
+ * https URLs, redirects to them and proxy auto-configuration are always left
+ * to CFNetwork, as is everything when this is NO.
+ *
+ * Default: YES
+ */
+@property (readwrite) BOOL persistentConnections;
+
+/**
+ * @brief The most connections a file is downloaded over at once
+ *
+ * @details When this is more than 1, files read by the built-in HTTP client
+ * (see <persistentConnections>) are fetched as segments of 256KB, each with a
+ * Range request of its own, several at a time, and put back in order before
+ * they're parsed. This gets around the limit one connection puts on
+ * throughput, filling buffers sooner at the start and after a seek. The
+ * number of connections starts at 2 and goes up while each one added makes
+ * the download noticeably faster. Servers which don't do ranges are read as
+ * usual.
+ *
+ * Default: 1
+ */
+@property (readwrite) UInt32 downloadConnections;
+
+/**
+ * @brief Segments of an HLS stream downloaded ahead of the one being played
+ *
+ * @details URLs ending in .m3u8, or whose response is an HLS playlist, are
+ * played as HTTP Live Streaming streams by the built-in HTTP client, whatever
+ * <persistentConnections> is. Segments are fetched whole, each with a request
+ * of its own, and this many are kept downloading ahead of the one being
+ * played so that a slow segment doesn't run the buffers dry. Transport stream,
+ * fragmented MP4 and packed audio segments of AAC or MP3 can be played, but
+ * not encrypted ones, nor https playlists. A live stream starts near its end
+ * and can't seek; one with an end can, to the start of a segment.
+ *
+ * Default: 2
+ */
+@property (readwrite) UInt32 hlsPrefetchSegments;
+
+/**
+ * @brief Mirrors of a station's playlist requested at once
+ *
+ * @details URLs ending in .pls or .m3u, or whose response is a PLS or M3U
+ * playlist, are taken to list mirrors of a radio station. The playlist is
+ * fetched by the built-in HTTP client, whatever <persistentConnections> is,
+ * and this many of its mirrors are requested at the same time. Whichever
+ * first sends audio is played and the others are called off; one which fails
+ * makes way for the next in the playlist. Those which lost are kept, fastest
+ * first, and if the mirror being played fails later on, the stream carries on
+ * from the next of them rather than stopping. 1 tries the mirrors one at a
+ * time, in the playlist's order.
+ *
+ * Only http playlists are read this way. https mirrors are never raced, but
+ * are still fallen back on.
+ *
+ * Default: 3
+ */
+@property (readwrite) UInt32 mirrorRaceCount;
+
+/**
+ * @brief Seconds of a live stream kept to be paused and rewound within
+ *
+ * @details When this isn't 0, a stream with no length, such as an ICY radio
+ * station, is played from a recording of about this much of it rather than
+ * straight from the network. The recording carries on while playback is
+ * paused, or behind, so <seekToTime:> and <seekByDelta:> can go back as far
+ * as it reaches and <seekToLive> catches up again. A stream paused for longer
+ * than this picks up with the oldest audio still recorded.
+ *
+ * The recording is a file in NSTemporaryDirectory() which is written round
+ * and round, sized at the stream's bitrate (320kbps if it isn't known when
+ * playback starts), so it takes disk space but not memory. It's gone once the
+ * stream stops. Streams of raw PCM aren't recorded.
+ *
+ * Default: 0
+ */
+@property (readwrite) NSTimeInterval timeShiftDuration;
+
 /**
  * @brief Rate to playback audio
  *
@@ -704,6 +1104,18 @@ + (instancetype)streamWithURL:(NSURL*)url;
  */
 @property (readwrite) float playbackRate;
 
+/**
+ * @brief Flag if to allow equal-power fades of the decoded audio
+ *
+ * @details When this flag is set, a processing tap is put on the audio queue
+ * so that <crossfadeInDuration:> and <crossfadeOutDuration:> can scale the
+ * decoded samples themselves. Otherwise the audio goes to the output
+ * untouched. This must be set before the stream is started.
+ *
+ * Default: NO
+ */
+@property (readwrite) BOOL equalPowerFades;
+
 /**
  * @brief The log level to use
  *
@@ -754,6 +1166,31 @@ - (void)setSOCKSProxy:(NSString*)host port:(int)port;
  */
 - (BOOL)start;
 
+/**
+ * @brief Starts downloading and buffering this audio stream without playing it
+ *
+ * @details The stream connects, parses its headers and fills its buffers as
+ * <start> would, but then waits in the AS_WAITING_FOR_DATA state instead of
+ * starting playback. Once <play> is invoked, playback begins immediately if
+ * enough was buffered, and otherwise as soon as it is. This is used to get the
+ * next song ready before the current one ends.
+ *
+ * Like <start>, this can only be invoked once, and only instead of <start>.
+ *
+ * @return YES if the stream was started, or NO if the stream was previously
+ *         started and this had no effect.
+ */
+- (BOOL)preload;
+
+/**
+ * @brief Tests whether a stream started with <preload> is ready to play
+ *
+ * @details Returns YES if as much is buffered as <bufferFillCountToStart> or
+ * <bufferDurationToStart> asks for (or the whole stream is buffered) and
+ * <play> has not yet been invoked, NO otherwise
+ */
+@property (nonatomic, getter=isPreloaded, readonly) BOOL preloaded;
+
 /**
  * @brief Stop all streams, clean up resources and prevent all further events
  * from occurring.
@@ -773,13 +1210,38 @@ - (void)stop;
 - (BOOL)pause;
 
 /**
- * @brief Plays the audio stream if paused
+ * @brief Plays the audio stream if paused, or starts playing a preloaded one
  *
- * @return YES if the audio stream entered into the AS_PLAYING state, or NO if
- *         any other error or bad state was encountered.
+ * @return YES if the audio stream entered into the AS_PLAYING state (or will
+ *         once it has buffered enough, if preloaded), or NO if any other error
+ *         or bad state was encountered.
  */
 - (BOOL)play;
 
+/**
+ * @brief Starts playing a preloaded stream at the given time
+ *
+ * @details Used to start this stream exactly as another one ends (see
+ * <endHostTime:>), with no gap between them.
+ *
+ * @param hostTime When to start, in host time units (mach_absolute_time)
+ * @return YES if the stream will start playing then, or NO if it isn't
+ *         preloaded and ready to play (see <preloaded>) or its audio queue
+ *         couldn't be started.
+ */
+- (BOOL)playAtHostTime:(UInt64)hostTime;
+
+/**
+ * @brief Finds when the last frame of audio will have been played
+ *
+ * @details This is only known once all of the stream has been given to the
+ * audio queue, while it is playing at normal speed.
+ *
+ * @param hostTime Filled in with the end time, in host time units
+ * @return YES if the end time was found, NO otherwise
+ */
+- (BOOL)endHostTime:(UInt64 *)hostTime;
+
 /** @name Calculated properties and modifying the stream (all can fail) */
 
 /**
@@ -810,6 +1272,16 @@ - (BOOL)seekToTime:(double)newSeekTime;
  */
 - (BOOL)seekByDelta:(double)seekTimeDelta;
 
+/**
+ * @brief Catch up with a time-shifted live stream
+ *
+ * @details Playback of a stream being recorded (see <timeShiftDuration>) moves
+ * on to the newest audio, less just enough to start playing from again.
+ *
+ * @return YES if the stream will be seeking, or NO if it isn't being recorded
+ */
+- (BOOL)seekToLive;
+
 /**
  * @brief Calculates the bit rate of the stream
  *
@@ -823,6 +1295,21 @@ - (BOOL)seekByDelta:(double)seekTimeDelta;
  */
 - (BOOL)calculatedBitRate:(double*)ret;
 
+/**
+ * @brief Calculates the bit rate of the stream, saying how it was found
+ *
+ * @details The bit rate is exact when it comes from the stream's headers (a
+ * Xing, Info or VBRI header, an MP4 moov, the format of a constant bitrate
+ * stream, or an ICY header), and estimated when it's worked out from the
+ * packets seen so far. Durations based on an estimated bit rate are only
+ * estimates too.
+ *
+ * @param ret The double to fill in with the bit rate on success
+ * @param estimated Set to YES if the bit rate is an estimate, may be NULL
+ * @return YES if the bit rate could be calculated, or NO if it could not be
+ */
+- (BOOL)calculatedBitRate:(double*)ret estimated:(BOOL*)estimated;
+
 /**
  * @brief Attempt to set the volume on the audio queue
  *
@@ -896,4 +1383,213 @@ - (BOOL)fadeInDuration:(float)duration;
  */
 - (BOOL)fadeOutDuration:(float)duration;
 
+/**
+ * @brief Fade in the decoded audio along an equal-power curve
+ *
+ * @details Meant to be paired with <crossfadeOutDuration:> on another stream
+ * over the same span, so that the two streams' combined loudness stays level.
+ * The fade starts with the next audio the queue processes; for a stream which
+ * is preloaded, that is when it starts playing. Requires <equalPowerFades>.
+ *
+ * @param duration The length of the fade, in seconds
+ * @return YES if the fade was set, or NO if the stream has no processing tap
+ *         (<equalPowerFades> was off or the tap couldn't be made)
+ */
+- (BOOL)crossfadeInDuration:(double)duration;
+
+/**
+ * @brief Fade out the decoded audio along an equal-power curve
+ *
+ * @details Like <crossfadeInDuration:>, but down to silence. The stream stays
+ * silent after the fade until another is set.
+ *
+ * @param duration The length of the fade, in seconds
+ * @return YES if the fade was set, or NO if the stream has no processing tap
+ */
+- (BOOL)crossfadeOutDuration:(double)duration;
+
+/**
+ * @brief CPU time spent applying the current or last equal-power fade
+ *
+ * @details In milliseconds, as measured on the audio thread. 0 if there has
+ * been no such fade.
+ */
+@property (readonly) double fadeProcessingTime;
+
+/** @name Loudness normalization */
+
+/**
+ * @brief Flag if to bring the stream to the same loudness as others
+ *
+ * @details When this flag is set, a processing tap scales the decoded audio
+ * so that its integrated loudness (as EBU R128 measures it) comes out at the
+ * <loudnessTarget>. How loud the stream is comes from its ReplayGain or R128
+ * tags (ID3 TXXX frames, or Vorbis and Opus comments) if it has them, and is
+ * otherwise measured as it plays, the gain following along once a few
+ * seconds have been. A limiter keeps the true peak below -1 dBTP, which
+ * delays the audio by a millisecond or two. This must be set before the
+ * stream is started.
+ *
+ * Default: NO
+ */
+@property (readwrite) BOOL loudnessNormalization;
+
+/**
+ * @brief The loudness to normalize to, in LUFS
+ *
+ * @details -18 is the ReplayGain 2.0 reference level, -23 that of EBU R128
+ * broadcasts. Must be set before the stream starts.
+ *
+ * Default: -18
+ */
+@property (readwrite) double loudnessTarget;
+
+/**
+ * @brief The stream's integrated loudness, in LUFS
+ *
+ * @details From its tags, or as measured so far with <loudnessNormalization>
+ * on.
+ *
+ * @param ret The double to fill in with the loudness on success
+ * @return YES if the loudness is known, or NO if it isn't (yet)
+ */
+- (BOOL)loudness:(double*)ret;
+
+/**
+ * @brief The gain normalization is applying, in dB
+ *
+ * @details Before the limiter. 0 when <loudnessNormalization> is off.
+ */
+@property (readonly) double normalizationGain;
+
+/** @name Metrics */
+
+/**
+ * @brief Flag if to take quality-of-service measurements of the stream
+ *
+ * @details These are how long it took to start, how often and for how long
+ * playback stalled, how much was buffered and how fast the network was (see
+ * <AudioStreamerMetrics>). Nothing is measured when this is NO. It must be set
+ * before the stream starts.
+ *
+ * Default: NO
+ */
+@property (readwrite) BOOL metricsEnabled;
+
+/**
+ * @brief The measurements taken so far
+ *
+ * @details All zero (and -1 for the times to first byte and audio) unless
+ * <metricsEnabled> was set when the stream started. These stay available once
+ * the stream is done.
+ */
+@property (readonly) AudioStreamerMetrics metrics;
+
+/**
+ * @brief How often to hand <metrics> to the <metricsHandler>, in seconds
+ *
+ * @details Must be set before the stream starts.
+ *
+ * Default: 10
+ */
+@property (readwrite) NSTimeInterval metricsInterval;
+
+/**
+ * @brief A callback given the <metrics> every <metricsInterval> seconds
+ *
+ * @details Called on the <delegateQueue> while the stream is running, if
+ * <metricsEnabled> is set. Must be set before the stream starts.
+ *
+ * Default: nil
+ */
+@property (readwrite, copy) void (^metricsHandler)(AudioStreamer *sender,
+                                                   AudioStreamerMetrics metrics);
+
+/** @name Offline rendering */
+
+/**
+ * @brief A callback given the decoded audio instead of it being played
+ *
+ * @details When this, <pcmOutputPath> or <outputSink> is set, nothing is
+ * played. The audio queue renders offline instead, as fast as the stream can
+ * be read and decoded, without needing an audio device, and the state goes to
+ * AS_DONE once the whole stream has been rendered. This is meant for things
+ * like loudness scanning, drawing waveforms and checking that streams decode.
+ *
+ * The samples are 32-bit floats, interleaved, at the stream's own sample rate
+ * and channel count, which the format describes. They're only valid during the
+ * call, which is made on the stream thread, so the callback should be quick
+ * and mustn't call back into the streamer. Volume and fades apply to the
+ * rendered audio as they would to playback, but <playbackRate> doesn't.
+ *
+ * Must be set before the stream starts.
+ *
+ * Default: nil
+ */
+@property (readwrite, copy) void (^pcmHandler)(AudioStreamer *sender,
+                                               const float *samples,
+                                               UInt32 frameCount,
+                                               AudioStreamBasicDescription format);
+
+/**
+ * @brief A WAV file to write the decoded audio to instead of playing it
+ *
+ * @details Rendered offline as for <pcmHandler>, and written as 32-bit float
+ * samples. The file is complete once the state goes to AS_DONE. It can be
+ * used along with the <pcmHandler>. Must be set before the stream starts.
+ *
+ * Default: nil
+ */
+@property (readwrite, copy) NSString *pcmOutputPath;
+
+/**
+ * @brief A sink to write the decoded audio through instead of playing it
+ *
+ * @details Rendered offline as for <pcmHandler>, and given to the sink in the
+ * same format. Any kind of sink from ASOutputSink.h will do, such as a null
+ * sink, which only counts the frames, for checking that a stream decodes as
+ * fast as it can. It can be used along with the <pcmHandler> and
+ * <pcmOutputPath>.
+ *
+ * The stream takes the sink over once it starts rendering, after which this
+ * is NULL again, and closes it when it's done. One which was never taken over
+ * is closed when the stream is released. Must be set before the stream
+ * starts.
+ *
+ * Default: NULL
+ */
+@property (readwrite) struct output_sink *outputSink;
+
+/** @name Disk cache */
+
+/**
+ * @brief Sets up the disk cache shared by all streams
+ *
+ * @details Files which can be seeked and have an ETag or Last-Modified header
+ * are cached on disk as they are streamed, so that seeking back and playing
+ * the same URL again don't go to the network. Live streams are never cached.
+ *
+ * The cache is kept under the size limit by removing the least recently used
+ * files. Streams which have already started keep using the cache they started
+ * with.
+ *
+ * By default there is no disk cache.
+ *
+ * @param path The directory to keep the cache in, which is created if it
+ *        doesn't exist, or nil to turn the cache off
+ * @param sizeLimit The most disk space the cache can take, in bytes
+ * @return YES if the cache could be set up, or NO if the directory couldn't
+ *         be used
+ */
++ (BOOL)setDiskCacheDirectory:(NSString *)path sizeLimit:(UInt64)sizeLimit;
+
+/**
+ * @brief The fraction of audio bytes read from the disk cache
+ *
+ * @details Counts every byte streamed since the cache was set up, whether it
+ * came from the cache or the network. Returns 0 if there is no cache or
+ * nothing has been streamed yet.
+ */
++ (double)diskCacheHitRate;
+
 @end
@@ -25,15 +25,66 @@
  * Alex Crichton for the Hermes project */
 
 #import "AudioStreamer.h"
+#import "ASADTSParser.h"
+#import "ASBufferController.h"
+#import "ASCFTransport.h"
+#import "ASCrossfade.h"
+#import "ASDiskCache.h"
+#import "ASGapless.h"
+#import "ASHLSTransport.h"
+#import "ASHTTPClient.h"
+#import "ASLoudnessMeter.h"
+#import "ASMemoryBudget.h"
+#import "ASMetrics.h"
+#import "ASNormalizer.h"
+#import "ASSegmentedTransport.h"
+#import "ASIcyDemuxer.h"
+#import "ASID3Parser.h"
+#import "ASMP3Parser.h"
+#import "ASMP4Info.h"
+#import "ASOggDemuxer.h"
+#import "ASOutputSink.h"
+#import "ASPacketRing.h"
+#import "ASSeekIndex.h"
+#import "ASSPSCQueue.h"
+#import "ASStartPolicy.h"
+#import "ASStationTransport.h"
+#import "ASTimeShift.h"
+
+#import <mach/mach_time.h>
+#import <pthread.h>
 
 #define BitRateEstimationMinPackets 50
 
+/* Most channels an equal-power fade is applied to */
+#define kMaxTapChannels 8
+
+/* Bitrate a live stream's recording is sized for when the stream's isn't
+   known, and room left over for packets larger than the bitrate says */
+#define kTimeShiftDefaultBitrate 320000
+#define kTimeShiftSlack 1.25
+
 /* Defaults */
 #define kDefaultNumAQBufs 256
 #define kDefaultAQDefaultBufSize 8192
 #define kDefaultNumAQBufsToStart 32
 #define kDefaultAudioFileType kAudioFileMP3Type
 
+/* Seeks read the file a window at a time, growing from the first size to the
+   second, when connections are kept open */
+#define kRangeWindowMin 65536
+#define kRangeWindowMax 1048576
+
+/* Size of the segments of a file downloaded over several connections */
+#define kDownloadSegmentSize 262144
+
+/* Frames rendered at a time when rendering offline */
+#define kOfflineRenderFrames 4096
+
+/* Loudness of audio at ReplayGain's reference level and of R128 gains' */
+#define kReplayGainReference -18.0
+#define kR128GainReference -23.0
+
 /* CHECK_ERR */
 #define _CHECK_ERR_NORET(err, code, reasonStr) {                                 \
     if (err) { [self failWithErrorCode:code reason:reasonStr]; return; }        \
@@ -72,6 +123,43 @@
   } while(0)
 #endif
 
+/* Public methods which change a stream may be called from any thread. Each
+   one calls itself again on the stream thread, where all of a stream's state
+   is looked after, and publishes what it changed for getters to see. Those
+   whose answer has to come from the stream thread wait for it */
+#define ON_STREAM_THREAD(type, call)                                          \
+  if ([NSThread currentThread] != ASStreamThread()) {                         \
+    __block type ret_;                                                        \
+    ASPerformOnStreamThread(^{ ret_ = (call); [self publishSnapshot]; });     \
+    return ret_;                                                              \
+  }
+
+/* The rest don't. They answer with what the snapshot says the call will do,
+   so that a busy stream thread never holds up the caller */
+#define ON_STREAM_THREAD_LATER(type, expected, call)                          \
+  if ([NSThread currentThread] != ASStreamThread()) {                         \
+    pthread_mutex_lock(&snapshot->lock);                                      \
+    type ret_ = (expected);                                                   \
+    pthread_mutex_unlock(&snapshot->lock);                                    \
+    ASPerformOnStreamThreadLater(^{ (void)(call); [self publishSnapshot]; }); \
+    return ret_;                                                              \
+  }
+#define ON_STREAM_THREAD_LATER_VOID(call)                                     \
+  if ([NSThread currentThread] != ASStreamThread()) {                         \
+    ASPerformOnStreamThreadLater(^{ call; [self publishSnapshot]; });         \
+    return;                                                                   \
+  }
+
+/* Getters called from any other thread answer from the snapshot, without
+   waiting for the stream thread. On the stream thread they work it out */
+#define FROM_SNAPSHOT(type, expr)                                             \
+  if ([NSThread currentThread] != ASStreamThread()) {                         \
+    pthread_mutex_lock(&snapshot->lock);                                      \
+    type ret_ = (expr);                                                       \
+    pthread_mutex_unlock(&snapshot->lock);                                    \
+    return ret_;                                                              \
+  }
+
 /* Logging */
 #define LOG(lvl, fmt, args...)\
   do {\
@@ -96,43 +184,186 @@ typedef NS_ENUM(NSUInteger, AudioStreamerProxyType) {
   AS_PROXY_HTTP,
 };
 
-typedef NS_ENUM(NSUInteger, AudioStreamerID3ParserState) {
-  ID3_STATE_INITIAL = 0,
-  ID3_STATE_READY_TO_PARSE,
-  ID3_STATE_PARSED
-};
-
-typedef NS_OPTIONS(NSUInteger, AudioStreamerID3FlagInfo) {
-  ID3_FLAG_UNSYNC = (1 << 0),
-  ID3_FLAG_EXTENDED_HEADER = (1 << 1)
-};
-
-typedef struct queued_vbr_packet {
-  AudioStreamPacketDescription desc;
-  struct queued_vbr_packet *next;
-  char data[];
-} queued_vbr_packet_t;
-
-typedef struct queued_cbr_packet {
-  struct queued_cbr_packet *next;
-  UInt32 byteSize;
-  char data[];
-} queued_cbr_packet_t;
-
 typedef struct buffer {
-  AudioStreamPacketDescription packetDescs[kAQMaxPacketDescs];
+  AudioStreamPacketDescription *packetDescs; /* in packetDescPool */
   AudioQueueBufferRef ref;
   UInt32 packetCount;
   UInt32 packetStart;
+  UInt32 frames;              /* enqueued, after trimming */
   bool inuse;
 } buffer_t;
 
+/* What the audio queue's callbacks and the processing tap use. It has to stay
+   valid until the queue has been disposed of, which may be after the stream
+   which created it has gone away */
+typedef struct queue_context {
+  spsc_queue_t *playedBuffers;    /* buffers the queue has finished with */
+  bool runningChanged;            /* has the queue started or stopped? (atomic) */
+  CFRunLoopSourceRef queueEvents; /* signalled when either of the above is */
+  crossfade_t *crossfade;
+  normalizer_t *normalizer;
+} queue_context_t;
+
+/* What getters report when called off the stream thread, as of the last time
+   the stream thread published it */
+typedef struct snapshot {
+  pthread_mutex_t lock;
+  AudioStreamerState state;
+  bool seekable;
+  bool timeShifted;             /* has a recording to seek in */
+  bool preloading;              /* preloaded, and play not yet called */
+  bool preloaded;
+  AudioStreamBasicDescription streamDescription;
+  bool hasDuration;
+  double duration;
+  bool hasBitRate;
+  double bitRate;
+  BOOL bitRateEstimated;
+  bool hasBufferProgress;
+  double bufferProgress;
+  AudioQueueRef audioQueue;     /* only used while playing or paused */
+  double seekTime;
+  double lastProgress;          /* last calculated progress point */
+  AudioStreamerMetrics metrics;
+  bool hasLoudness;
+  double loudness;
+  double normalizationGain;
+  double fadeProcessingTime;
+} snapshot_t;
+
+/* Packets from the built-in parsers are handed on as they are */
+_Static_assert(sizeof(as_packet_desc_t) == sizeof(AudioStreamPacketDescription) &&
+               offsetof(as_packet_desc_t, startOffset) ==
+                 offsetof(AudioStreamPacketDescription, mStartOffset) &&
+               offsetof(as_packet_desc_t, variableFrames) ==
+                 offsetof(AudioStreamPacketDescription, mVariableFramesInPacket) &&
+               offsetof(as_packet_desc_t, byteSize) ==
+                 offsetof(AudioStreamPacketDescription, mDataByteSize),
+               "as_packet_desc_t must match AudioStreamPacketDescription");
+
 /* Errors, not an 'extern' */
 NSString * const ASErrorDomain = @"com.alexcrichton.audiostreamer";
 
+/* Shared by all streams, see +setDiskCacheDirectory:sizeLimit: */
+static disk_cache_t *sharedDiskCache;
+static NSString *sharedDiskCacheDirectory;
+static double sharedDiskCacheHitRate;   /* read from any thread (atomic) */
+
+/* One thread reads, parses and fills buffers for every stream, so none of it
+   waits on whatever the main thread is busy with */
+static NSThread *streamThread;
+static CFRunLoopRef streamRunLoop;
+static dispatch_semaphore_t streamThreadStarted;
+
+/* Keeps connections open for every stream, run on the stream thread */
+static http_client_t *sharedHTTPClient;
+
+/* Stands in for a stream as the context of its transports and run loop
+   source. Those can outlive a stream let go of on another thread, so they
+   find it through a weak reference, which is nil once it's going away */
+@interface ASStreamerRef : NSObject {
+ @public
+  __weak AudioStreamer *streamer;
+}
+@end
+
+@implementation ASStreamerRef
+@end
+
 /* Woohoo, actual implementation now! */
 @implementation AudioStreamer
 
+/* Set on the stream thread, and read through getters which go there */
+@synthesize error = _error;
+@synthesize httpHeaders = _httpHeaders;
+@synthesize streamDescription = _streamDescription;
+@synthesize currentSong = _currentSong;
+
++ (void)runStreamThread:(id)unused {
+  streamRunLoop = CFRunLoopGetCurrent();
+  /* A run loop without any sources returns straight away */
+  [[NSRunLoop currentRunLoop] addPort:[NSMachPort port]
+                              forMode:NSDefaultRunLoopMode];
+  dispatch_semaphore_signal(streamThreadStarted);
+  while (true) {
+    @autoreleasepool {
+      [[NSRunLoop currentRunLoop] runMode:NSDefaultRunLoopMode
+                               beforeDate:[NSDate distantFuture]];
+    }
+  }
+}
+
+/* The stream thread, started the first time it's needed */
+static NSThread *ASStreamThread(void) {
+  static dispatch_once_t once;
+  dispatch_once(&once, ^{
+    streamThreadStarted = dispatch_semaphore_create(0);
+    streamThread = [[NSThread alloc] initWithTarget:[AudioStreamer class]
+                                           selector:@selector(runStreamThread:)
+                                             object:nil];
+    [streamThread setName:@"AudioStreamer"];
+    [streamThread start];
+    dispatch_semaphore_wait(streamThreadStarted, DISPATCH_TIME_FOREVER);
+  });
+  return streamThread;
+}
+
+/* Runs a block on the stream thread and waits for it to finish */
+static void ASPerformOnStreamThread(void (^block)(void)) {
+  if ([NSThread currentThread] == ASStreamThread()) {
+    block();
+    return;
+  }
+  dispatch_semaphore_t done = dispatch_semaphore_create(0);
+  CFRunLoopPerformBlock(streamRunLoop, kCFRunLoopCommonModes, ^{
+    block();
+    dispatch_semaphore_signal(done);
+  });
+  CFRunLoopWakeUp(streamRunLoop);
+  dispatch_semaphore_wait(done, DISPATCH_TIME_FOREVER);
+}
+
+/* Runs a block on the stream thread without waiting for it */
+static void ASPerformOnStreamThreadLater(void (^block)(void)) {
+  if ([NSThread currentThread] == ASStreamThread()) {
+    block();
+    return;
+  }
+  CFRunLoopPerformBlock(streamRunLoop, kCFRunLoopCommonModes, block);
+  CFRunLoopWakeUp(streamRunLoop);
+}
+
+/* Runs the HTTP client whenever it has something to do */
+static void ASHTTPClientCallBack(CFFileDescriptorRef fdref, CFOptionFlags callBackTypes,
+                                 void *info) {
+  ASHTTPClientProcess(sharedHTTPClient, 0);
+  CFFileDescriptorEnableCallBacks(fdref, kCFFileDescriptorReadCallBack);
+}
+
+/* The shared HTTP client, set up on the stream thread the first time it's
+   needed. Returns NULL if it couldn't be */
+static http_client_t *ASSharedHTTPClient(void) {
+  if (sharedHTTPClient != NULL) return sharedHTTPClient;
+  http_client_t *client = ASHTTPClientCreate();
+  if (client == NULL) return NULL;
+  CFFileDescriptorRef fdref = CFFileDescriptorCreate(NULL,
+                                                     ASHTTPClientFileDescriptor(client),
+                                                     false, ASHTTPClientCallBack,
+                                                     NULL);
+  CFRunLoopSourceRef source = fdref != NULL ?
+    CFFileDescriptorCreateRunLoopSource(NULL, fdref, 0) : NULL;
+  if (source == NULL) {
+    if (fdref != NULL) CFRelease(fdref);
+    ASHTTPClientDestroy(client);
+    return NULL;
+  }
+  CFFileDescriptorEnableCallBacks(fdref, kCFFileDescriptorReadCallBack);
+  CFRunLoopAddSource(CFRunLoopGetCurrent(), source, kCFRunLoopCommonModes);
+  CFRelease(source);
+  sharedHTTPClient = client;
+  return client;
+}
+
 /* Converts a given OSStatus to a friendly string.
  * The return value should be freed when done */
 static char* OSStatusToStr(OSStatus status) {
@@ -178,26 +409,216 @@ static void ASPacketsProc(void *inClientData, UInt32 inNumberBytes, UInt32
 }
 
 /* AudioQueue callback notifying that a buffer is done, invoked on AudioQueue's
- * own personal threads, not the main thread */
+ * own personal threads, not the stream thread. The buffer is handed over to
+ * the stream thread without taking any locks, or touching the stream */
 static void ASAudioQueueOutputCallback(void *inClientData, AudioQueueRef inAQ,
                                 AudioQueueBufferRef inBuffer) {
-  AudioStreamer *streamer = (__bridge AudioStreamer *)inClientData;
-  [streamer handleBufferCompleteForQueue:inAQ buffer:inBuffer];
+  queue_context_t *context = inClientData;
+  /* There's room for every buffer there is */
+  bool pushed = ASSPSCQueuePush(context->playedBuffers, inBuffer);
+  assert(pushed);
+  (void) pushed;
+  CFRunLoopSourceSignal(context->queueEvents);
+  CFRunLoopWakeUp(streamRunLoop);
 }
 
 /* AudioQueue callback that a property has changed, invoked on AudioQueue's own
  * personal threads like above */
 static void ASAudioQueueIsRunningCallback(void *inUserData, AudioQueueRef inAQ,
                                    AudioQueuePropertyID inID) {
-  AudioStreamer *streamer = (__bridge AudioStreamer *)inUserData;
-  [streamer handlePropertyChangeForQueue:inAQ propertyID:inID];
+  queue_context_t *context = inUserData;
+  __atomic_store_n(&context->runningChanged, true, __ATOMIC_RELEASE);
+  CFRunLoopSourceSignal(context->queueEvents);
+  CFRunLoopWakeUp(streamRunLoop);
+}
+
+/* Run loop source callback on the stream thread, for whatever the two
+ * callbacks above have handed over */
+static void ASQueueEventsPerform(void *info) {
+  AudioStreamer *streamer = ((__bridge ASStreamerRef *)info)->streamer;
+  [streamer handleQueueEvents];
+  [streamer publishSnapshot];
+}
+
+/* Transport callback when an event has occurred */
+static void ASTransportCallBack(void *context, transport_t *transport,
+                                transport_event_t event) {
+  AudioStreamer *streamer = ((__bridge ASStreamerRef *)context)->streamer;
+  [streamer handleReadFromStream:transport event:event];
+  [streamer publishSnapshot];
+}
+
+/* The done reason for a state, and whether there's been an error */
+static AudioStreamerDoneReason ASDoneReason(AudioStreamerState state, bool hasError) {
+  switch (state) {
+    case AS_STOPPED:
+      return AS_DONE_STOPPED;
+    case AS_DONE:
+      if (hasError) {
+        return AS_DONE_ERROR;
+      } else {
+        return AS_DONE_EOF;
+      }
+    default:
+      break;
+  }
+  return AS_NOT_DONE;
 }
 
-/* CFReadStream callback when an event has occurred */
-static void ASReadStreamCallBack(CFReadStreamRef aStream, CFStreamEventType eventType,
-                          void* inClientInfo) {
-  AudioStreamer *streamer = (__bridge AudioStreamer *)inClientInfo;
-  [streamer handleReadFromStream:aStream eventType:eventType];
+/* Works out how far playback has got, remembering it in lastProgress for
+   once the queue has stopped. Called with the snapshot's lock held */
+static BOOL ASProgress(AudioStreamerState state, double sampleRate,
+                       AudioQueueRef queue, double seekTime,
+                       double *lastProgress, double *ret) {
+  if (state == AS_STOPPED) {
+    *ret = *lastProgress;
+    return YES;
+  }
+  if (sampleRate <= 0 || (state != AS_PLAYING && state != AS_PAUSED))
+    return NO;
+
+  AudioTimeStamp queueTime;
+  Boolean discontinuity;
+  OSStatus osErr = AudioQueueGetCurrentTime(queue, NULL, &queueTime, &discontinuity);
+  if (osErr) {
+    return NO;
+  }
+
+  double progress = seekTime + queueTime.mSampleTime / sampleRate;
+  if (progress < 0.0) {
+    progress = 0.0;
+  }
+
+  *lastProgress = progress;
+  *ret = progress;
+  return YES;
+}
+
+/* A published value, if it was known */
+static BOOL ASSnapshotValue(bool known, double value, double *ret) {
+  if (!known) return NO;
+  *ret = value;
+  return YES;
+}
+
+static BOOL ASSnapshotBitRate(const snapshot_t *snapshot, double *rate,
+                              BOOL *estimated) {
+  if (!snapshot->hasBitRate) return NO;
+  *rate = snapshot->bitRate;
+  if (estimated != NULL) *estimated = snapshot->bitRateEstimated;
+  return YES;
+}
+
+/* Lets go of what the audio queue's callbacks used, once it's been disposed of */
+static void ASQueueContextDestroy(queue_context_t *context) {
+  if (context == NULL) return;
+  if (context->queueEvents != NULL) {
+    CFRunLoopSourceInvalidate(context->queueEvents);
+    CFRelease(context->queueEvents);
+  }
+  ASSPSCQueueDestroy(context->playedBuffers);
+  ASCrossfadeDestroy(context->crossfade);
+  ASNormalizerDestroy(context->normalizer);
+  free(context);
+}
+
+/* Processing tap callback, which runs on the audio thread. It only touches
+   the fader and the normalizer, never the rest of the streamer */
+static void ASProcessingTapProc(void *inClientData, AudioQueueProcessingTapRef inAQTap,
+                                UInt32 inNumberFrames, AudioTimeStamp *ioTimeStamp,
+                                AudioQueueProcessingTapFlags *ioFlags,
+                                UInt32 *outNumberFrames, AudioBufferList *ioData) {
+  queue_context_t *context = inClientData;
+  OSStatus osErr = AudioQueueProcessingTapGetSourceAudio(inAQTap, inNumberFrames,
+                                                         ioTimeStamp, ioFlags,
+                                                         outNumberFrames, ioData);
+  if (osErr || ioData->mNumberBuffers > kMaxTapChannels) return;
+
+  float *channels[kMaxTapChannels];
+  for (UInt32 i = 0; i < ioData->mNumberBuffers; i++) {
+    channels[i] = ioData->mBuffers[i].mData;
+  }
+  normalizer_t *normalizer = context->normalizer;
+  if (normalizer != NULL) {
+    /* Audio held back from before a seek mustn't play after it */
+    if (*ioFlags & kAudioQueueProcessingTap_StartOfStream) {
+      ASNormalizerFlush(normalizer);
+    }
+    ASNormalizerProcess(normalizer, channels, *outNumberFrames);
+  }
+  ASCrossfadeProcess(context->crossfade, channels, ioData->mNumberBuffers,
+                     *outNumberFrames);
+}
+
+/* ID3 parser filter, only the title, artist, comment and user text frames
+   are buffered */
+static bool ASID3FrameFilter(void *context, const char *frameID, uint8_t version) {
+  if (version <= 2) {
+    return strcmp(frameID, "TT2") == 0 || strcmp(frameID, "TP1") == 0 ||
+           strcmp(frameID, "COM") == 0 || strcmp(frameID, "TXX") == 0;
+  }
+  return strcmp(frameID, "TIT2") == 0 || strcmp(frameID, "TPE1") == 0 ||
+         strcmp(frameID, "COMM") == 0 || strcmp(frameID, "TXXX") == 0;
+}
+
+/* ID3 parser callback when a buffered frame has been read */
+static void ASID3FrameProc(void *context, const id3_frame_t *frame) {
+  AudioStreamer *streamer = (__bridge AudioStreamer *)context;
+  [streamer handleID3Frame:frame];
+}
+
+/* MP3 parser callback when the first frame has been found */
+static void ASMP3FormatProc(void *context, const mp3_header_t *format,
+                            uint64_t offset) {
+  AudioStreamer *streamer = (__bridge AudioStreamer *)context;
+  [streamer handleMP3Format:format offset:offset];
+}
+
+/* ADTS parser callback when the first frame has been found */
+static void ASADTSFormatProc(void *context, const adts_header_t *format,
+                             uint64_t offset) {
+  AudioStreamer *streamer = (__bridge AudioStreamer *)context;
+  [streamer handleADTSFormat:format offset:offset];
+}
+
+/* Output sink callback with audio rendered for the pcmHandler */
+static void ASRenderedProc(void *context, const float *samples, size_t frames) {
+  AudioStreamer *streamer = (__bridge AudioStreamer *)context;
+  [streamer handleRenderedSamples:samples frames:frames];
+}
+
+/* Adds a sink to what rendered audio goes to. NULL if it couldn't be created,
+   closing what there was */
+static output_sink_t *ASJoinSinks(output_sink_t *sink, output_sink_t *more) {
+  if (more == NULL) {
+    if (sink != NULL) ASOutputSinkClose(sink);
+    return NULL;
+  }
+  if (sink == NULL) return more;
+  return ASOutputSinkCreateTee(sink, more);
+}
+
+/* Ogg demuxer filter, only streams of a known audio codec are followed */
+static bool ASOggStreamFilter(void *context, uint32_t serial,
+                              const uint8_t *data, size_t length) {
+  return ASOggIdentifyCodec(data, length) != OGG_CODEC_UNKNOWN;
+}
+
+/* Ogg demuxer callback when a packet has been read */
+static void ASOggPacketProc(void *context, const ogg_packet_t *packet) {
+  AudioStreamer *streamer = (__bridge AudioStreamer *)context;
+  [streamer handleOggPacket:packet];
+}
+
+/* Built-in parser callback when packets are available */
+static void ASNativePacketsProc(void *context, const void *data,
+                                uint32_t byteCount, uint32_t packetCount,
+                                const as_packet_desc_t *descs) {
+  AudioStreamer *streamer = (__bridge AudioStreamer *)context;
+  [streamer handleAudioPackets:data
+                   numberBytes:byteCount
+                 numberPackets:packetCount
+            packetDescriptions:(AudioStreamPacketDescription *)descs];
 }
 
 /* Private method. Developers should call +[AudioStreamer streamWithURL:] */
@@ -209,6 +630,28 @@ - (instancetype)initWithURL:(NSURL*)url {
     _bufferFillCountToStart = kDefaultNumAQBufsToStart;
     _timeoutInterval = 10;
     _playbackRate = 1.0f;
+    _nativeParsing = YES;
+    _persistentConnections = YES;
+    _downloadConnections = 1;
+    _hlsPrefetchSegments = 2;
+    _mirrorRaceCount = 3;
+    NSString *extension = [[url path] pathExtension];
+    hlsStream = [extension caseInsensitiveCompare:@"m3u8"] == NSOrderedSame;
+    stationStream = [extension caseInsensitiveCompare:@"pls"] == NSOrderedSame ||
+                    [extension caseInsensitiveCompare:@"m3u"] == NSOrderedSame;
+    _metricsInterval = 10;
+    _loudnessTarget = kReplayGainReference;
+    readAheadLimit = SIZE_MAX;
+    taggedLoudness = NAN;
+    _delegateQueue = [NSOperationQueue mainQueue];
+    streamerRef = [[ASStreamerRef alloc] init];
+    streamerRef->streamer = self;
+    snapshot = calloc(1, sizeof(snapshot_t));
+    if (snapshot == NULL) return nil;
+    pthread_mutex_init(&snapshot->lock, NULL);
+    snapshot->state = state_;
+    snapshot->metrics.timeToFirstByte = -1;
+    snapshot->metrics.timeToFirstAudio = -1;
 #if defined(DEBUG)
     _logLevel = AS_LOG_LEVEL_INFO;
 #else
@@ -224,13 +667,57 @@ + (instancetype)streamWithURL:(NSURL*)url{
 }
 
 - (void)dealloc {
-  [self stop];
-  assert(queued_vbr_head == NULL);
-  assert(queued_vbr_tail == NULL);
-  assert(queued_cbr_head == NULL);
-  assert(queued_cbr_tail == NULL);
+  /* Nothing can be told about a stream which is going away. Whatever the
+     stream thread's run loop and the audio queue still use is let go of over
+     there, without waiting. Until then they find a nil streamer */
+  _delegate = nil;
   assert(timeout == nil);
-  assert(buffers == NULL);
+  assert(metricsTimer == nil);
+  transport_t *transport = stream;
+  disk_cache_entry_t *entry = cacheEntry;
+  AudioQueueRef queue = audioQueue;
+  AudioQueueProcessingTapRef tap = processingTap;
+  queue_context_t *context = queueContext;
+  ASStreamerRef *ref = streamerRef;
+  ASPerformOnStreamThreadLater(^{
+    if (transport != NULL) ASTransportClose(transport);
+    ASDiskCacheCloseEntry(entry);
+    if (queue != NULL) {
+      AudioQueueStop(queue, true);
+      if (tap != NULL) AudioQueueProcessingTapDispose(tap);
+      AudioQueueDispose(queue, true);
+    }
+    ASQueueContextDestroy(context);
+    /* The transports' and the run loop source's context, until now */
+    (void) ref;
+  });
+
+  /* Nothing else is used by any other thread */
+  if (renderSink != NULL) ASOutputSinkClose(renderSink);
+  if (_outputSink != NULL) ASOutputSinkClose(_outputSink);
+  if (audioFileStream != NULL) AudioFileStreamClose(audioFileStream);
+  if (buffers != NULL) {
+    for (UInt32 i = 0; i < maxBuffers; i++) {
+      free(buffers[i]);
+    }
+    free(buffers);
+  }
+  free(packetDescPool);
+  ASPacketRingDestroy(queuedPackets);
+  ASTimeShiftDestroy(timeShift);
+  ASIcyDemuxerDestroy(icyDemuxer);
+  ASID3ParserDestroy(id3Parser);
+  ASSeekIndexDestroy(seekIndex);
+  ASMP4InfoDestroy(mp4Info);
+  ASMP3ParserDestroy(mp3Parser);
+  ASADTSParserDestroy(adtsParser);
+  ASOggDemuxerDestroy(oggDemuxer);
+  ASBufferControllerDestroy(bufferController);
+  ASMetricsDestroy(streamMetrics);
+  if (snapshot != NULL) {
+    pthread_mutex_destroy(&snapshot->lock);
+    free(snapshot);
+  }
 }
 
 - (void)setHTTPProxy:(NSString*)host port:(int)port {
@@ -246,6 +733,7 @@ - (void)setSOCKSProxy:(NSString*)host port:(int)port {
 }
 
 - (BOOL)setVolume:(float)volume {
+  ON_STREAM_THREAD_LATER(BOOL, snapshot->audioQueue != NULL, [self setVolume:volume]);
   if (audioQueue != NULL) {
     AudioQueueSetParameter(audioQueue, kAudioQueueParam_Volume, volume);
     return YES;
@@ -254,58 +742,85 @@ - (BOOL)setVolume:(float)volume {
 }
 
 - (BOOL)isPlaying {
+  FROM_SNAPSHOT(BOOL, snapshot->state == AS_PLAYING);
   return state_ == AS_PLAYING;
 }
 
 - (BOOL)isPaused {
+  FROM_SNAPSHOT(BOOL, snapshot->state == AS_PAUSED);
   return state_ == AS_PAUSED;
 }
 
 - (BOOL)isWaiting {
+  FROM_SNAPSHOT(BOOL, snapshot->state == AS_WAITING_FOR_DATA ||
+                      snapshot->state == AS_WAITING_FOR_QUEUE_TO_START);
   return state_ == AS_WAITING_FOR_DATA ||
          state_ == AS_WAITING_FOR_QUEUE_TO_START;
 }
 
 - (BOOL)isDone {
+  FROM_SNAPSHOT(BOOL, snapshot->state == AS_DONE || snapshot->state == AS_STOPPED);
   return state_ == AS_DONE || state_ == AS_STOPPED;
 }
 
 - (AudioStreamerDoneReason)doneReason {
-  switch (state_) {
-    case AS_STOPPED:
-      return AS_DONE_STOPPED;
-    case AS_DONE:
-      if (_error) {
-        return AS_DONE_ERROR;
-      } else {
-        return AS_DONE_EOF;
-      }
-    default:
-      break;
-  }
-  return AS_NOT_DONE;
+  FROM_SNAPSHOT(AudioStreamerDoneReason,
+                ASDoneReason(snapshot->state, snapshotError != nil));
+  return ASDoneReason(state_, _error != nil);
 }
 
 - (BOOL)isSeekable {
+  FROM_SNAPSHOT(BOOL, snapshot->seekable);
   double tmp;
+  /* Anywhere in the recording will do */
+  if (timeShift != NULL) return YES;
+  /* The playlist says where each segment starts */
+  if (hlsStream) return seekable && [self duration:&tmp];
   return seekable && [self duration:&tmp] && [self calculatedBitRate:&tmp] && tmp != 0.0;
 }
 
+- (NSError *)error {
+  FROM_SNAPSHOT(NSError *, snapshotError);
+  return _error;
+}
+
+- (NSDictionary *)httpHeaders {
+  FROM_SNAPSHOT(NSDictionary *, snapshotHTTPHeaders);
+  return _httpHeaders;
+}
+
+- (AudioStreamBasicDescription)streamDescription {
+  FROM_SNAPSHOT(AudioStreamBasicDescription, snapshot->streamDescription);
+  return _streamDescription;
+}
+
+- (NSString *)currentSong {
+  FROM_SNAPSHOT(NSString *, snapshotCurrentSong);
+  return _currentSong;
+}
+
 - (void)setCurrentSong:(NSString *)currentSong {
   _currentSong = currentSong;
+  [self publishSnapshot];
   if (!_currentSong) {
     return;
   }
   __strong id <AudioStreamerDelegate> delegate = _delegate;
   if (delegate && [delegate respondsToSelector:@selector(streamerMetadataIsReady:)]) {
-    [delegate streamerMetadataIsReady:self];
+    [_delegateQueue addOperationWithBlock:^{
+      [delegate streamerMetadataIsReady:self];
+    }];
   }
 }
 
 - (BOOL)start {
+  ON_STREAM_THREAD(BOOL, [self start]);
   if (stream != NULL) return NO;
   assert(audioQueue == NULL);
   assert(state_ == AS_INITIALIZED);
+  if (_metricsEnabled) {
+    streamMetrics = ASMetricsCreate(CFAbsoluteTimeGetCurrent());
+  }
   [self openReadStream];
   if (![self isDone]) {
     timeout = [NSTimer scheduledTimerWithTimeInterval:_timeoutInterval
@@ -313,11 +828,19 @@ - (BOOL)start {
                                              selector:@selector(checkTimeout)
                                              userInfo:nil
                                               repeats:YES];
+    if (streamMetrics != NULL && _metricsHandler != nil && _metricsInterval > 0) {
+      metricsTimer = [NSTimer scheduledTimerWithTimeInterval:_metricsInterval
+                                                      target:self
+                                                    selector:@selector(reportMetrics)
+                                                    userInfo:nil
+                                                     repeats:YES];
+    }
   }
   return YES;
 }
 
 - (BOOL)pause {
+  ON_STREAM_THREAD_LATER(BOOL, snapshot->state == AS_PLAYING, [self pause]);
   if (state_ != AS_PLAYING) return NO;
   assert(audioQueue != NULL);
   OSStatus osErr = AudioQueuePause(audioQueue);
@@ -327,16 +850,82 @@ - (BOOL)pause {
   return YES;
 }
 
+- (BOOL)preload {
+  ON_STREAM_THREAD(BOOL, [self preload]);
+  if (stream != NULL) return NO;
+  preloading = true;
+  return [self start];
+}
+
 - (BOOL)play {
+  ON_STREAM_THREAD_LATER(BOOL, snapshot->preloading ?
+                                 snapshot->state != AS_DONE &&
+                                   snapshot->state != AS_STOPPED :
+                                 snapshot->state == AS_PAUSED,
+                         [self play]);
+  if (preloading) {
+    preloading = false;
+    /* Start straight away if as much is buffered as playback would have
+       waited for, or everything there is has been. Otherwise the queue starts
+       as usual once enough is */
+    if ([self isReadyToPlay]) {
+      _error = nil;
+      return [self startAudioQueue];
+    }
+    return ![self isDone];
+  }
   if (state_ != AS_PAUSED) return NO;
   assert(audioQueue != NULL);
   [self startAudioQueue];
   return YES;
 }
 
+- (BOOL)isPreloaded {
+  FROM_SNAPSHOT(BOOL, snapshot->preloaded);
+  return preloading && [self isReadyToPlay];
+}
+
+- (BOOL)playAtHostTime:(UInt64)hostTime {
+  ON_STREAM_THREAD(BOOL, [self playAtHostTime:hostTime]);
+  if (![self isPreloaded]) return NO;
+  preloading = false;
+  _error = nil;
+  AudioTimeStamp startTime;
+  memset(&startTime, 0, sizeof(startTime));
+  startTime.mHostTime = hostTime;
+  startTime.mFlags = kAudioTimeStampHostTimeValid;
+  return [self startAudioQueueAtTime:&startTime];
+}
+
+- (BOOL)endHostTime:(UInt64 *)hostTime {
+  ON_STREAM_THREAD(BOOL, [self endHostTime:hostTime]);
+  if (state_ != AS_PLAYING || _playbackRate != 1.0f || bytesFilled > 0 ||
+      [self hasQueuedPackets] || ![self readStreamAtEnd]) {
+    return NO;
+  }
+  AudioTimeStamp queueTime;
+  OSStatus osErr = AudioQueueGetCurrentTime(audioQueue, NULL, &queueTime, NULL);
+  if (osErr || !(queueTime.mFlags & kAudioTimeStampSampleTimeValid)) return NO;
+  UInt64 now = (queueTime.mFlags & kAudioTimeStampHostTimeValid) ?
+               queueTime.mHostTime : mach_absolute_time();
+
+  double remaining = ((double)framesEnqueued - queueTime.mSampleTime) /
+                     _streamDescription.mSampleRate;
+  if (remaining < 0) remaining = 0;
+  mach_timebase_info_data_t timebase;
+  mach_timebase_info(&timebase);
+  *hostTime = now + (UInt64)(remaining * NSEC_PER_SEC * timebase.denom / timebase.numer);
+  return YES;
+}
+
 - (void)stop {
+  ON_STREAM_THREAD_LATER_VOID([self stop]);
   if (state_ == AS_STOPPED) return; // Already stopped.
 
+  /* Where it stopped is what progress reports from now on */
+  double progress;
+  [self progress:&progress];
+
   AudioStreamerState prevState = state_;
   if (state_ != AS_DONE) {
     // Delay notification to the end to avoid race conditions
@@ -345,25 +934,53 @@ - (void)stop {
 
   [timeout invalidate];
   timeout = nil;
+  [metricsTimer invalidate];
+  metricsTimer = nil;
 
   /* Clean up our streams */
   [self closeReadStream];
-  if (audioFileStream && !isParsing) {
+  if (!isParsing) {
     [self closeFileStream];
   }
+  ASDiskCacheCloseEntry(cacheEntry);
+  cacheEntry = NULL;
+  cacheWritable = false;
+  /* Whatever was rendered before stopping is kept */
+  if (renderSink != NULL) {
+    ASOutputSinkClose(renderSink);
+    renderSink = NULL;
+  }
   if (audioQueue) {
     AudioQueueStop(audioQueue, true);
+    if (processingTap) {
+      AudioQueueProcessingTapDispose(processingTap);
+      processingTap = NULL;
+    }
     OSStatus osErr = AudioQueueDispose(audioQueue, true);
     ASSERT_ERR(!osErr, @"AudioQueueDispose returned error \"%@\"", [[self class] descriptionForAQErrorCode:osErr]);
     audioQueue = nil;
+    renderBuffer = NULL;
+    /* Whatever the queue handed over on its way out is of no interest */
+    void *played;
+    while (ASSPSCQueuePop(queueContext->playedBuffers, &played));
+    __atomic_store_n(&queueContext->runningChanged, false, __ATOMIC_RELAXED);
   }
   if (buffers != NULL) {
-    for (UInt32 i = 0; i < _bufferCount; i++) {
+    for (UInt32 i = 0; i < maxBuffers; i++) {
       free(buffers[i]);
     }
     free(buffers);
     buffers = NULL;
   }
+  free(packetDescPool);
+  packetDescPool = NULL;
+  activeBuffers = 0;
+  bytesInQueue = 0;
+  framesInQueue = 0;
+  ASPacketRingDestroy(queuedPackets);
+  queuedPackets = NULL;
+  ASTimeShiftDestroy(timeShift);
+  timeShift = NULL;
 
   _httpHeaders     = nil;
   bytesFilled      = 0;
@@ -377,7 +994,13 @@ - (void)stop {
 }
 
 - (BOOL)seekToTime:(double)newSeekTime {
+  ON_STREAM_THREAD_LATER(BOOL, snapshot->seekable, [self seekToTime:newSeekTime]);
+  /* A recorded stream seeks within the recording, but not to reconnect */
+  if (timeShift != NULL && !_error) {
+    return [self seekTimeShiftToTime:newSeekTime];
+  }
   if (!seekable) return NO;
+  if (hlsStream) return [self seekHLSToTime:newSeekTime];
 
   double bitrate;
   double duration;
@@ -389,6 +1012,12 @@ - (BOOL)seekToTime:(double)newSeekTime {
   assert(!seeking);
   seeking = true;
 
+  /* Audio from the network which is thrown away if the seek has to reconnect */
+  UInt64 unplayedBytes = 0;
+  if (!readingCache && !cacheWritable) {
+    unplayedBytes = bytesInQueue + ASPacketRingByteCount(queuedPackets) + bytesFilled;
+  }
+
   //
   // Store the old time from the audio queue and the time that we're seeking
   // to so that we'll know the correct time progress after seeking.
@@ -411,7 +1040,8 @@ - (BOOL)seekToTime:(double)newSeekTime {
     seekPacket = (SInt64)((bitrate / 8.0) * newSeekTime);
   }
 
-  if (totalAudioPackets != 1000000 && (UInt64)(seekPacket + 5) >= totalAudioPackets) {
+  UInt64 totalPackets = [self audioPacketCount];
+  if (vbr && totalPackets > 0 && (UInt64)(seekPacket + 5) >= totalPackets) {
     // Too little data to play anything useful
     [self setState:AS_DONE];
     return YES;
@@ -420,42 +1050,35 @@ - (BOOL)seekToTime:(double)newSeekTime {
   bool foundCachedPacket = false;
   bool foundQueuedPacket = false;
   if ((processedPacketsCount - 1) < (UInt64)seekPacket) {
-    queued_vbr_packet_t *cur_vbr = queued_vbr_head;
-    queued_cbr_packet_t *cur_cbr = queued_cbr_head;
-    for (UInt32 i = 0; cur_vbr != NULL || cur_cbr != NULL; i++) {
-      if ((processedPacketsCount + i) == (UInt64)seekPacket) {
-        foundCachedPacket = true;
-        break;
-      }
-      if (cur_vbr != NULL) {
-        queued_vbr_packet_t *tmp_vbr = cur_vbr->next;
-        cur_vbr = tmp_vbr;
-      } else if (cur_cbr != NULL) {
-        queued_cbr_packet_t *tmp_cbr = cur_cbr->next;
-        cur_cbr = tmp_cbr;
-      }
-    }
+    /* Each queued entry accounts for one step past processedPacketsCount */
+    foundCachedPacket = !ASPacketRingIsEmpty(queuedPackets) &&
+      ((UInt64)seekPacket - processedPacketsCount) < ASPacketRingCount(queuedPackets);
   } else if ((UInt64)seekPacket < audioPacketsReceived && seekPacket != 0) {
     foundQueuedPacket = true;
   }
 
   if (foundCachedPacket || foundQueuedPacket) {
-    CFReadStreamUnscheduleFromRunLoop(stream, CFRunLoopGetCurrent(), kCFRunLoopCommonModes);
+    ASTransportSetPaused(stream, true);
     unscheduled = true;
     rescheduled = false;
   }
 
   buffer_t **oldBuffers;
   if (foundQueuedPacket) {
-    oldBuffers = malloc(_bufferCount * sizeof(buffer_t*));
+    oldBuffers = malloc(activeBuffers * sizeof(buffer_t*));
     CHECK_ERR(oldBuffers == NULL, AS_AUDIO_QUEUE_BUFFER_ALLOCATION_FAILED, @"", NO);
-    memcpy(oldBuffers, buffers, _bufferCount * sizeof(AudioQueueBufferRef));
+    memcpy(oldBuffers, buffers, activeBuffers * sizeof(AudioQueueBufferRef));
   }
 
   waitingOnBuffer = false;
 
   /* Stop audio for now */
   osErr = AudioQueueStop(audioQueue, true);
+  framesEnqueued = 0;
+  queueFlushed = false;
+  offlinePrimed = false;
+  /* Take back the buffers the queue let go of while stopping */
+  [self handleQueueEvents];
   if (osErr) {
     if (foundQueuedPacket) {
       free(oldBuffers);
@@ -468,32 +1091,22 @@ - (BOOL)seekToTime:(double)newSeekTime {
   if (foundCachedPacket) {
     UInt32 packetsRemoved = 0;
     UInt32 bytesRemoved = 0;
-    queued_vbr_packet_t *cur_vbr = queued_vbr_head;
-    queued_cbr_packet_t *cur_cbr = queued_cbr_head;
-    for (UInt32 i = 0; cur_vbr != NULL || cur_cbr != NULL; i++) {
-      if ((processedPacketsCount + i) == (UInt64)seekPacket) {
-        break;
-      }
-      if (cur_vbr != NULL) {
-        queued_vbr_packet_t *tmp_vbr = cur_vbr->next;
-        free(cur_vbr);
-        cur_vbr = tmp_vbr;
+    packet_ring_entry_t entry;
+    for (UInt64 i = processedPacketsCount;
+         i < (UInt64)seekPacket && ASPacketRingPeek(queuedPackets, &entry); i++) {
+      if (vbr) {
         packetsRemoved++;
-      } else if (cur_cbr != NULL) {
-        queued_cbr_packet_t *tmp_cbr = cur_cbr->next;
-        bytesRemoved += cur_cbr->byteSize;
-        free(cur_cbr);
-        cur_cbr = tmp_cbr;
+      } else {
+        bytesRemoved += entry.byteSize;
       }
+      ASPacketRingPop(queuedPackets);
     }
-    queued_vbr_head = cur_vbr;
-    queued_cbr_head = cur_cbr;
 
     processedPacketsCount += (vbr ? packetsRemoved : bytesRemoved);
 
     //discontinuous = true;
     [self enqueueCachedData];
-    waitingOnBuffer = (queued_vbr_head != NULL || queued_cbr_head != NULL);
+    waitingOnBuffer = !ASPacketRingIsEmpty(queuedPackets);
     if (packetDuration > 0 && vbr) {
       seekTime = processedPacketsCount * packetDuration;
     } else if (!vbr) {
@@ -501,18 +1114,20 @@ - (BOOL)seekToTime:(double)newSeekTime {
     }
     if (![self startAudioQueue]) return NO;
 
-    CFReadStreamScheduleWithRunLoop(stream, CFRunLoopGetCurrent(), kCFRunLoopCommonModes);
-    rescheduled = true;
+    if (!rescheduled) {
+      ASTransportSetPaused(stream, false);
+      rescheduled = true;
+    }
 
     seeking = false;
     return YES;
   } else if (foundQueuedPacket) {
-    UInt32 seekPacketIdx = _bufferCount + 1;
-    UInt32 endPacketIdx = _bufferCount + 1;
+    UInt32 seekPacketIdx = activeBuffers + 1;
+    UInt32 endPacketIdx = activeBuffers + 1;
     SInt64 startPacket = seekPacket;
     SInt64 endPacket = seekPacket;
     UInt32 nextFillBuffer = fillBufferIndex +1;
-    if (nextFillBuffer >= _bufferCount) nextFillBuffer = 0;
+    if (nextFillBuffer >= activeBuffers) nextFillBuffer = 0;
     UInt32 i = nextFillBuffer;
     UInt32 last = 0;
     while (i != fillBufferIndex) {
@@ -533,12 +1148,12 @@ - (BOOL)seekToTime:(double)newSeekTime {
         }
       }
       i++;
-      if (i >= _bufferCount) i = 0;
+      if (i >= activeBuffers) i = 0;
     }
-    if (seekPacketIdx != (_bufferCount + 1)) {
+    if (seekPacketIdx != (activeBuffers + 1)) {
       i = seekPacketIdx;
       UInt32 nextBuffer = endPacketIdx + 1;
-      if (nextBuffer >= _bufferCount) nextBuffer = 0;
+      if (nextBuffer >= activeBuffers) nextBuffer = 0;
       bool start = true;
       while (i != nextBuffer || start) {
         start = false;
@@ -549,19 +1164,14 @@ - (BOOL)seekToTime:(double)newSeekTime {
           buffers[i]->inuse = (packetEnd >= seekPacket);
         }
         i++;
-        if (i >= _bufferCount) i = 0;
+        if (i >= activeBuffers) i = 0;
       }
       i = seekPacketIdx;
       buffersUsed = 0;
+      bytesInQueue = 0;
+      framesInQueue = 0;
       while (buffers[i]->inuse) {
-        AudioQueueBufferRef fillBuf = oldBuffers[i]->ref;
-
-        if (vbr) {
-          osErr = AudioQueueEnqueueBuffer(audioQueue, fillBuf, oldBuffers[i]->packetCount,
-                                          oldBuffers[i]->packetDescs);
-        } else {
-          osErr = AudioQueueEnqueueBuffer(audioQueue, fillBuf, 0, NULL);
-        }
+        osErr = [self enqueueQueueBuffer:oldBuffers[i]];
         if (osErr) {
           free(oldBuffers);
           [self failWithErrorCode:AS_AUDIO_QUEUE_ENQUEUE_FAILED reason:[[self class] descriptionForAQErrorCode:osErr]];
@@ -570,14 +1180,14 @@ - (BOOL)seekToTime:(double)newSeekTime {
 
         buffersUsed++;
         i++;
-        if (i >= _bufferCount) i = 0;
-        if (buffersUsed == _bufferCount) break;
+        if (i >= activeBuffers) i = 0;
+        if (buffersUsed == activeBuffers) break;
       }
       fillBufferIndex = i;
       processedPacketsCount -= packetsFilled;
       packetsFilled = bytesFilled = 0;
       [self enqueueCachedData];
-      waitingOnBuffer = (queued_vbr_head != NULL || queued_cbr_head != NULL);
+      waitingOnBuffer = !ASPacketRingIsEmpty(queuedPackets);
       if (packetDuration > 0 && vbr) {
         seekTime = oldBuffers[seekPacketIdx]->packetStart * packetDuration;
       } else if (!vbr) {
@@ -586,10 +1196,12 @@ - (BOOL)seekToTime:(double)newSeekTime {
 
       free(oldBuffers);
 
-      if (![self startAudioQueue]) return NO;
+      if (!preloading && ![self startAudioQueue]) return NO;
 
-      CFReadStreamScheduleWithRunLoop(stream, CFRunLoopGetCurrent(), kCFRunLoopCommonModes);
-      rescheduled = true;
+      if (!rescheduled) {
+        ASTransportSetPaused(stream, false);
+        rescheduled = true;
+      }
 
       seeking = false;
       return YES;
@@ -602,40 +1214,59 @@ - (BOOL)seekToTime:(double)newSeekTime {
   processedPacketsCount = (UInt32)seekPacket;
   audioPacketsReceived = (UInt64)seekPacket;
 
-  if (packetDuration > 0 && !vbr) {
-    seekPacket = (SInt64)floor(newSeekTime / packetDuration);
-  }
-
   //
-  // Calculate the byte offset for seeking
+  // The seek index knows exactly where every packet received so far begins,
+  // and has the stream's own table of contents for the rest
   //
-  seekByteOffset = dataOffset + (UInt64)((newSeekTime / duration) * (fileLength - dataOffset));
+  seek_point_t point;
+  bool exact = false;
+  if (vbr && packetDuration > 0 &&
+      ASSeekIndexLookup(seekIndex, (UInt64)seekPacket, &point, &exact)) {
+    seekPacket = (SInt64)point.packet;
+    processedPacketsCount = (UInt32)seekPacket;
+    audioPacketsReceived = (UInt64)seekPacket;
+    seekByteOffset = dataOffset + point.byteOffset;
+    seekTime = seekPacket * packetDuration;
+  } else {
+    if (packetDuration > 0 && !vbr) {
+      seekPacket = (SInt64)floor(newSeekTime / packetDuration);
+    }
 
-  //
-  // Attempt to leave 1 useful packet at the end of the file (although in
-  // reality, this may still seek too far if the file has a long trailer).
-  //
-  if (seekByteOffset > fileLength - 2 * packetBufferSize) {
-    seekByteOffset = fileLength - 2 * packetBufferSize;
-  }
+    //
+    // Calculate the byte offset for seeking
+    //
+    seekByteOffset = dataOffset + (UInt64)((newSeekTime / duration) * (fileLength - dataOffset));
 
-  if (packetDuration > 0 && bitrate > 0) {
-    UInt32 ioFlags = 0;
-    SInt64 packetAlignedByteOffset;
-    osErr = AudioFileStreamSeek(audioFileStream, seekPacket, &packetAlignedByteOffset, &ioFlags);
-    if (!osErr && !(ioFlags & kAudioFileStreamSeekFlag_OffsetIsEstimated)) {
-      if (!bitrateEstimated) {
-        seekTime = packetAlignedByteOffset * 8.0 / bitrate;
-      }
-      seekByteOffset = (UInt64)packetAlignedByteOffset + dataOffset;
-      if (seekByteOffset >= fileLength - 1) {
-        // End of the file. We're done here.
-        [self setState:AS_DONE];
-        return YES;
+    //
+    // Attempt to leave 1 useful packet at the end of the file (although in
+    // reality, this may still seek too far if the file has a long trailer).
+    //
+    if (seekByteOffset > fileLength - 2 * packetBufferSize) {
+      seekByteOffset = fileLength - 2 * packetBufferSize;
+    }
+
+    if (packetDuration > 0 && bitrate > 0) {
+      UInt32 ioFlags = 0;
+      SInt64 packetAlignedByteOffset;
+      osErr = AudioFileStreamSeek(audioFileStream, seekPacket, &packetAlignedByteOffset, &ioFlags);
+      if (!osErr && !(ioFlags & kAudioFileStreamSeekFlag_OffsetIsEstimated)) {
+        if (!bitrateEstimated) {
+          seekTime = packetAlignedByteOffset * 8.0 / bitrate;
+        }
+        seekByteOffset = (UInt64)packetAlignedByteOffset + dataOffset;
+        exact = vbr;
       }
     }
   }
+  if (seekByteOffset >= fileLength - 1) {
+    // End of the file. We're done here.
+    [self setState:AS_DONE];
+    return YES;
+  }
+  indexingPackets = exact;
+  trimmingFrames = exact;
 
+  if (streamMetrics != NULL) ASMetricsAddWasted(streamMetrics, unplayedBytes);
   [self closeReadStream];
   [self setState:AS_WAITING_FOR_DATA];
 
@@ -643,7 +1274,7 @@ - (BOOL)seekToTime:(double)newSeekTime {
   packetsFilled = 0;
   bytesFilled = 0;
   audioBytesReceived = 0;
-  waitingOnBuffer = (queued_vbr_head != NULL || queued_cbr_head != NULL);
+  waitingOnBuffer = !ASPacketRingIsEmpty(queuedPackets);
 
   /* Open a new stream with a new offset */
   BOOL ret = [self openReadStream];
@@ -651,53 +1282,205 @@ - (BOOL)seekToTime:(double)newSeekTime {
   return ret;
 }
 
-- (BOOL)seekByDelta:(double)seekTimeDelta {
-  double p = 0;
-  if ([self progress:&p]) {
-    return [self seekToTime:p + seekTimeDelta];
-  }
-  return NO;
-}
-
-- (BOOL)progress:(double*)ret {
-  double sampleRate = _streamDescription.mSampleRate;
-  if (state_ == AS_STOPPED) {
-    *ret = lastProgress;
+/**
+ * @brief Seeks an HLS stream by loading its playlist again from a time
+ *
+ * Segments have no byte offsets to seek to, so whatever has been buffered is
+ * thrown away and the transport starts over from the segment the time falls
+ * in. The seek time is put right to the start of that segment once the
+ * transport has found it.
+ *
+ * @param newSeekTime The time to seek to, in seconds
+ * @return YES if the playlist was opened again, or the time is past the end
+ */
+- (BOOL)seekHLSToTime:(double)newSeekTime {
+  if (newSeekTime >= hlsDuration) {
+    [self setState:AS_DONE];
     return YES;
   }
-  if (sampleRate <= 0 || (state_ != AS_PLAYING && state_ != AS_PAUSED))
-    return NO;
+  assert(!seeking);
+  seeking = true;
 
-  AudioTimeStamp queueTime;
-  Boolean discontinuity;
-  OSStatus osErr = AudioQueueGetCurrentTime(audioQueue, NULL, &queueTime, &discontinuity);
+  UInt64 unplayedBytes = bytesInQueue + ASPacketRingByteCount(queuedPackets) + bytesFilled;
+  waitingOnBuffer = false;
+
+  /* Stop audio for now */
+  OSStatus osErr = AudioQueueStop(audioQueue, true);
+  framesEnqueued = 0;
+  queueFlushed = false;
+  offlinePrimed = false;
+  /* Take back the buffers the queue let go of while stopping */
+  [self handleQueueEvents];
   if (osErr) {
+    seeking = false;
+    [self failWithErrorCode:AS_AUDIO_QUEUE_STOP_FAILED reason:[[self class] descriptionForAQErrorCode:osErr]];
     return NO;
   }
 
-  double progress = seekTime + queueTime.mSampleTime / sampleRate;
-  if (progress < 0.0) {
-    progress = 0.0;
-  }
+  if (streamMetrics != NULL) ASMetricsAddWasted(streamMetrics, unplayedBytes);
+  [self closeReadStream];
+  [self setState:AS_WAITING_FOR_DATA];
 
-  lastProgress = progress;
-  *ret = progress;
-  return YES;
+  hlsStartTime = newSeekTime;
+  seekTime = newSeekTime;
+  indexingPackets = false;
+  trimmingFrames = false;
+  fillBufferIndex = 0;
+  packetsFilled = 0;
+  bytesFilled = 0;
+  audioBytesReceived = 0;
+
+  BOOL ret = [self openReadStream];
+  /* The parsers pick up again at the first frame of the segment */
+  discontinuous = true;
+  seeking = false;
+  return ret;
 }
 
-- (BOOL)bufferProgress:(double*)ret {
-  if (state_ != AS_PLAYING && state_ != AS_PAUSED)
+/**
+ * @brief Seeks a recorded live stream to a time within the recording
+ *
+ * Times before the oldest audio recorded go to it, and times after what
+ * <seekToLive> would go to go there instead.
+ *
+ * @param newSeekTime The time to seek to, in seconds since the recording began
+ * @return YES if the stream is seeking, NO if nothing is recorded yet
+ */
+- (BOOL)seekTimeShiftToTime:(double)newSeekTime {
+  double sampleRate = _streamDescription.mSampleRate;
+  UInt64 packet;
+  if (sampleRate <= 0 ||
+      !ASTimeShiftFind(timeShift, (UInt64)(MAX(newSeekTime, 0) * sampleRate), &packet)) {
     return NO;
-
-  double duration;
-  if (![self duration:&duration]) return NO;
-
-  *ret = (double)(audioBytesReceived + seekByteOffset) / (double)fileLength * duration;
-  return YES;
+  }
+  return [self seekTimeShiftToPacket:MIN(packet, [self timeShiftLivePacket])];
 }
 
-- (BOOL)calculatedBitRate:(double*)rate {
-  if (icyBitrate > 0)
+/**
+ * @brief The recorded packet to catch up to, which is as far back from the
+ *        newest as the buffers would fill before starting a new stream
+ */
+- (UInt64)timeShiftLivePacket {
+  UInt64 first = ASTimeShiftFirst(timeShift);
+  UInt64 packet = ASTimeShiftEnd(timeShift);
+  UInt64 startBytes = (UInt64)_bufferFillCountToStart * packetBufferSize;
+  while (packet > first && ASTimeShiftBytesFrom(timeShift, packet) < startBytes) {
+    packet--;
+  }
+  return packet;
+}
+
+/**
+ * @brief Throws away what's buffered and plays a recorded live stream on from
+ *        one of its packets
+ *
+ * Nothing needs reading again, so this carries on straight away, unless
+ * playback was paused, in which case it stays paused.
+ *
+ * @param packet The number of the recorded packet to play from
+ * @return YES if the stream is seeking, NO if the audio queue failed
+ */
+- (BOOL)seekTimeShiftToPacket:(UInt64)packet {
+  time_shift_packet_t start;
+  if (!ASTimeShiftPacket(timeShift, packet, &start)) return NO;
+  assert(!seeking);
+  seeking = true;
+  bool paused = state_ == AS_PAUSED;
+  waitingOnBuffer = false;
+
+  /* Stop audio for now */
+  OSStatus osErr = AudioQueueStop(audioQueue, true);
+  framesEnqueued = 0;
+  queueFlushed = false;
+  offlinePrimed = false;
+  /* Take back the buffers the queue let go of while stopping */
+  [self handleQueueEvents];
+  if (osErr) {
+    seeking = false;
+    [self failWithErrorCode:AS_AUDIO_QUEUE_STOP_FAILED reason:[[self class] descriptionForAQErrorCode:osErr]];
+    return NO;
+  }
+
+  seekTime = start.sampleTime / _streamDescription.mSampleRate;
+  timeShiftNext = packet;
+  timeShiftNextFrame = start.sampleTime;
+  trimmingFrames = false;
+  fillBufferIndex = 0;
+  packetsFilled = 0;
+  bytesFilled = 0;
+  [self enqueueTimeShift];
+
+  seeking = false;
+  if (paused) {
+    /* Playing starts the queue again from where it now is */
+    queuePaused = true;
+    [self setState:AS_PAUSED];
+    return YES;
+  }
+  return preloading || [self startAudioQueue];
+}
+
+- (BOOL)seekToLive {
+  ON_STREAM_THREAD_LATER(BOOL, snapshot->timeShifted, [self seekToLive]);
+  if (timeShift == NULL || _error || ASTimeShiftEnd(timeShift) == 0) return NO;
+  return [self seekTimeShiftToPacket:[self timeShiftLivePacket]];
+}
+
+- (BOOL)seekByDelta:(double)seekTimeDelta {
+  ON_STREAM_THREAD_LATER(BOOL, snapshot->seekable, [self seekByDelta:seekTimeDelta]);
+  double p = 0;
+  if ([self progress:&p]) {
+    return [self seekToTime:p + seekTimeDelta];
+  }
+  return NO;
+}
+
+- (BOOL)progress:(double*)ret {
+  /* The queue is only disposed of once it's published that it's stopped, so
+     asking it the time here is as good as on the stream thread */
+  FROM_SNAPSHOT(BOOL, ASProgress(snapshot->state,
+                                 snapshot->streamDescription.mSampleRate,
+                                 snapshot->audioQueue, snapshot->seekTime,
+                                 &snapshot->lastProgress, ret));
+  pthread_mutex_lock(&snapshot->lock);
+  BOOL known = ASProgress(state_, _streamDescription.mSampleRate, audioQueue,
+                          seekTime, &snapshot->lastProgress, ret);
+  pthread_mutex_unlock(&snapshot->lock);
+  return known;
+}
+
+- (BOOL)bufferProgress:(double*)ret {
+  FROM_SNAPSHOT(BOOL, ASSnapshotValue(snapshot->hasBufferProgress,
+                                      snapshot->bufferProgress, ret));
+  if (state_ != AS_PLAYING && state_ != AS_PAUSED)
+    return NO;
+
+  double duration;
+  if (![self duration:&duration]) return NO;
+
+  *ret = (double)(audioBytesReceived + seekByteOffset) / (double)fileLength * duration;
+  return YES;
+}
+
+- (BOOL)calculatedBitRate:(double*)rate {
+  return [self calculatedBitRate:rate estimated:NULL];
+}
+
+- (BOOL)calculatedBitRate:(double*)rate estimated:(BOOL*)estimated {
+  FROM_SNAPSHOT(BOOL, ASSnapshotBitRate(snapshot, rate, estimated));
+  if (![self bitRate:rate]) return NO;
+  if (estimated != NULL) *estimated = bitrateEstimated;
+  return YES;
+}
+
+/**
+ * @brief Works out the bit rate, setting bitrateEstimated to how
+ *
+ * @param rate The double to fill in with the bit rate on success
+ * @return YES if the bit rate is known
+ */
+- (BOOL)bitRate:(double*)rate {
+  if (icyBitrate > 0)
   {
     *rate = icyBitrate;
     bitrateEstimated = false;
@@ -720,7 +1503,25 @@ - (BOOL)calculatedBitRate:(double*)rate {
       return YES;
     }
 
-    // Method two - average
+    // Method two - totals from the Xing or VBRI header
+    UInt64 headerPackets = seekIndex != NULL ? ASSeekIndexPacketCount(seekIndex) : 0;
+    UInt64 headerBytes = seekIndex != NULL ? ASSeekIndexByteCount(seekIndex) : 0;
+    if (headerPackets > 0 && headerBytes > 0) {
+      *rate = 8.0 * headerBytes / headerPackets * packetsPerSec;
+      bitrateEstimated = false;
+      return YES;
+    }
+
+    // Method three - the size of an MP4's mdat over its duration
+    mp4_track_info_t track;
+    if (mp4Info != NULL && ASMP4InfoTrack(mp4Info, &track) &&
+        track.mediaBytes > 0 && track.duration > 0) {
+      *rate = 8.0 * track.mediaBytes * track.timescale / track.duration;
+      bitrateEstimated = false;
+      return YES;
+    }
+
+    // Method four - average
     Float64 bytesPerPacket;
     UInt32 bytesPerPacketSize = sizeof(bytesPerPacket);
     status = AudioFileStreamGetProperty(audioFileStream,
@@ -732,7 +1533,7 @@ - (BOOL)calculatedBitRate:(double*)rate {
       return YES;
     }
 
-    // Method three (similar to two)
+    // Method five (similar to four)
     if (processedPacketsCount > BitRateEstimationMinPackets) {
       double averagePacketByteSize = processedPacketsSizeTotal /
                                       processedPacketsCount;
@@ -741,6 +1542,13 @@ - (BOOL)calculatedBitRate:(double*)rate {
       bitrateEstimated = true;
       return YES;
     }
+
+    // Method six - the first frame's header, right if the bitrate is constant
+    if (headerBitrate > 0) {
+      *rate = headerBitrate;
+      bitrateEstimated = true;
+      return YES;
+    }
     return NO;
   }
   else
@@ -751,26 +1559,52 @@ - (BOOL)calculatedBitRate:(double*)rate {
   }
 }
 
+/**
+ * @brief Total number of packets in the stream
+ *
+ * @return The count given by the file stream, or failing that by a Xing or
+ *         VBRI header or an MP4's stts, or 0 if none is known
+ */
+- (UInt64)audioPacketCount {
+  UInt64 packetCount;
+  UInt32 packetCountSize = sizeof(packetCount);
+  OSStatus status = AudioFileStreamGetProperty(audioFileStream,
+                                               kAudioFileStreamProperty_AudioDataPacketCount,
+                                               &packetCountSize, &packetCount);
+  if (status == 0 && packetCount > 0) return packetCount;
+  packetCount = seekIndex != NULL ? ASSeekIndexPacketCount(seekIndex) : 0;
+  if (packetCount > 0) return packetCount;
+  mp4_track_info_t track;
+  if (mp4Info != NULL && ASMP4InfoTrack(mp4Info, &track)) return track.packetCount;
+  return 0;
+}
+
 - (BOOL)duration:(double*)ret {
+  FROM_SNAPSHOT(BOOL, ASSnapshotValue(snapshot->hasDuration,
+                                      snapshot->duration, ret));
+  /* An HLS playlist with an end adds up its segments */
+  if (hlsStream) {
+    if (hlsDuration <= 0) return NO;
+    *ret = hlsDuration;
+    return YES;
+  }
+  /* An MP4's media header has it exactly */
+  mp4_track_info_t track;
+  if (mp4Info != NULL && ASMP4InfoTrack(mp4Info, &track) && track.duration > 0) {
+    *ret = (double)track.duration / track.timescale;
+    return YES;
+  }
   if (fileLength == 0) return NO;
 
   double packetDuration = _streamDescription.mFramesPerPacket / _streamDescription.mSampleRate;
   if (packetDuration <= 0) return NO;
 
   // Method one
-  UInt64 packetCount;
-  UInt32 packetCountSize = sizeof(packetCount);
-  OSStatus status = AudioFileStreamGetProperty(audioFileStream,
-                                               kAudioFileStreamProperty_AudioDataPacketCount,
-                                               &packetCountSize, &packetCount);
-  if (status != 0) {
-    // Method two
-    packetCount = totalAudioPackets;
-  }
+  UInt64 packetCount = [self audioPacketCount];
 
-  if (packetCount == 1000000)
+  if (packetCount == 0)
   {
-    // Method three
+    // Method two
     double calcBitrate;
     if (![self calculatedBitRate:&calcBitrate]) return NO;
     if (calcBitrate == 0) return NO;
@@ -785,6 +1619,8 @@ - (BOOL)duration:(double*)ret {
 }
 
 - (BOOL)fadeTo:(float)volume duration:(float)duration {
+  ON_STREAM_THREAD_LATER(BOOL, snapshot->audioQueue != NULL,
+                         [self fadeTo:volume duration:duration]);
   if (audioQueue != NULL) {
     AudioQueueSetParameter(audioQueue, kAudioQueueParam_VolumeRampTime, duration);
     AudioQueueSetParameter(audioQueue, kAudioQueueParam_Volume, volume);
@@ -794,6 +1630,8 @@ - (BOOL)fadeTo:(float)volume duration:(float)duration {
 }
 
 - (BOOL)fadeInDuration:(float)duration {
+  ON_STREAM_THREAD_LATER(BOOL, snapshot->audioQueue != NULL,
+                         [self fadeInDuration:duration]);
   //-- set the gain to 0.0, so we can call this method just after creating the streamer
   [self setVolume:0.0];
   return [self fadeTo:1.0 duration:duration];
@@ -803,6 +1641,133 @@ - (BOOL)fadeOutDuration:(float)duration {
   return [self fadeTo:0.0 duration:duration];
 }
 
+- (BOOL)crossfadeInDuration:(double)duration {
+  ON_STREAM_THREAD(BOOL, [self crossfadeInDuration:duration]);
+  if (!_equalPowerFades || processingTap == NULL) return NO;
+  ASCrossfadeStart(crossfade, CROSSFADE_IN,
+                   (UInt64)(duration * _streamDescription.mSampleRate));
+  return YES;
+}
+
+- (BOOL)crossfadeOutDuration:(double)duration {
+  ON_STREAM_THREAD(BOOL, [self crossfadeOutDuration:duration]);
+  if (!_equalPowerFades || processingTap == NULL) return NO;
+  ASCrossfadeStart(crossfade, CROSSFADE_OUT,
+                   (UInt64)(duration * _streamDescription.mSampleRate));
+  return YES;
+}
+
+- (AudioStreamerMetrics)metrics {
+  FROM_SNAPSHOT(AudioStreamerMetrics, snapshot->metrics);
+  AudioStreamerMetrics result = {.timeToFirstByte = -1, .timeToFirstAudio = -1};
+  if (streamMetrics == NULL) return result;
+
+  metrics_snapshot_t current;
+  ASMetricsGetSnapshot(streamMetrics, CFAbsoluteTimeGetCurrent(), &current);
+  result.timeToFirstByte = current.timeToFirstByte;
+  result.timeToFirstAudio = current.timeToFirstAudio;
+  result.rebufferCount = current.rebuffers;
+  result.stallTime = current.stallTime;
+  _Static_assert(AS_METRICS_BUFFER_BINS == kMetricsBufferBins, "histogram size");
+  for (int i = 0; i < AS_METRICS_BUFFER_BINS; i++) {
+    result.bufferOccupancy[i] = current.bufferHistogram[i];
+  }
+  result.bytesDownloaded = current.bytesDownloaded;
+  if (bufferController != NULL) {
+    result.throughput = ASBufferControllerThroughput(bufferController, NULL) / 8.0;
+  }
+  result.bytesWasted = current.bytesWasted;
+  result.reconnectCount = current.reconnects;
+  return result;
+}
+
+/**
+ * @brief Hands the metrics to the metricsHandler
+ */
+- (void)reportMetrics {
+  void (^handler)(AudioStreamer *, AudioStreamerMetrics) = _metricsHandler;
+  if (handler == nil) return;
+  AudioStreamerMetrics metrics = [self metrics];
+  [_delegateQueue addOperationWithBlock:^{
+    handler(self, metrics);
+  }];
+}
+
+/**
+ * @brief Tells the metrics how much is buffered, and whether it's playing
+ */
+- (void)updateMetrics {
+  double buffered = 0;
+  [self bufferedSeconds:&buffered];
+  ASMetricsBufferLevel(streamMetrics, buffered, state_ == AS_PLAYING,
+                       CFAbsoluteTimeGetCurrent());
+}
+
+- (BOOL)loudness:(double*)ret {
+  FROM_SNAPSHOT(BOOL, ASSnapshotValue(snapshot->hasLoudness,
+                                      snapshot->loudness, ret));
+  if (normalizer != NULL) return ASNormalizerLoudness(normalizer, ret);
+  if (isnan(taggedLoudness)) return NO;
+  *ret = taggedLoudness;
+  return YES;
+}
+
+- (double)normalizationGain {
+  FROM_SNAPSHOT(double, snapshot->normalizationGain);
+  if (normalizer == NULL) return 0;
+  return ASNormalizerGain(normalizer);
+}
+
+/**
+ * @brief Takes how loud the stream is from one of its tags
+ *
+ * @param loudness In LUFS
+ */
+- (void)setTaggedLoudness:(double)loudness {
+  LOG_INFO(@"Tagged loudness: %.2f LUFS", loudness);
+  taggedLoudness = loudness;
+  if (normalizer != NULL) ASNormalizerSetLoudness(normalizer, loudness);
+}
+
+- (double)fadeProcessingTime {
+  FROM_SNAPSHOT(double, snapshot->fadeProcessingTime);
+  if (crossfade == NULL) return 0;
+  return ASCrossfadeCPUTime(crossfade) / (double)NSEC_PER_MSEC;
+}
+
++ (BOOL)setDiskCacheDirectory:(NSString *)path sizeLimit:(UInt64)sizeLimit {
+  if ([NSThread currentThread] != ASStreamThread()) {
+    __block BOOL ret;
+    ASPerformOnStreamThread(^{
+      ret = [self setDiskCacheDirectory:path sizeLimit:sizeLimit];
+    });
+    return ret;
+  }
+  if (sharedDiskCache != NULL && [path isEqualToString:sharedDiskCacheDirectory]) {
+    ASDiskCacheSetSizeLimit(sharedDiskCache, sizeLimit);
+    return YES;
+  }
+  /* Streams using the old cache keep it alive until they're done */
+  ASDiskCacheDestroy(sharedDiskCache);
+  sharedDiskCache = NULL;
+  sharedDiskCacheDirectory = nil;
+  double hitRate = 0;
+  __atomic_store(&sharedDiskCacheHitRate, &hitRate, __ATOMIC_RELAXED);
+  if (path == nil) return YES;
+
+  sharedDiskCache = ASDiskCacheCreate([path fileSystemRepresentation], sizeLimit);
+  if (sharedDiskCache == NULL) return NO;
+  sharedDiskCacheDirectory = [path copy];
+  return YES;
+}
+
++ (double)diskCacheHitRate {
+  /* As of the last time a stream published its snapshot */
+  double hitRate;
+  __atomic_load(&sharedDiskCacheHitRate, &hitRate, __ATOMIC_RELAXED);
+  return hitRate;
+}
+
 #pragma mark - Internal methods
 
 + (NSString *)descriptionForASErrorCode:(AudioStreamerErrorCode)anErrorCode {
@@ -841,6 +1806,8 @@ + (NSString *)descriptionForASErrorCode:(AudioStreamerErrorCode)anErrorCode {
       return @"Audio buffer too small";
     case AS_TIMED_OUT:
       return @"Timed out";
+    case AS_OFFLINE_RENDER_FAILED:
+      return @"Offline rendering failed";
   }
 }
 
@@ -979,7 +1946,8 @@ - (void)failWithErrorCode:(AudioStreamerErrorCode)errorCode reason:(NSString*)re
   assert(reason != nil);
 
   /* Attempt to save our last point of progress */
-  [self progress:&lastProgress];
+  double progress;
+  [self progress:&progress];
 
   LOG_ERROR(@"got an error: %@ (%@)", [[self class] descriptionForASErrorCode:errorCode], reason);
 
@@ -988,6 +1956,7 @@ - (void)failWithErrorCode:(AudioStreamerErrorCode)errorCode reason:(NSString*)re
                              NSLocalizedFailureReasonErrorKey:
                                NSLocalizedString(reason, nil)};
   _error = [NSError errorWithDomain:ASErrorDomain code:errorCode userInfo:userInfo];
+  [self publishSnapshot];
 
   if (shouldStop)
   {
@@ -1006,6 +1975,17 @@ - (void)setState:(AudioStreamerState)aStatus shouldNotify:(BOOL)shouldNotify {
 
   if (state_ == aStatus) return;
   state_ = aStatus;
+  /* Before anyone hears about it, and before a stopped queue goes away */
+  [self publishSnapshot];
+
+  if (streamMetrics != NULL) {
+    [self updateMetrics];
+    if (aStatus == AS_PLAYING) {
+      ASMetricsPlaying(streamMetrics, CFAbsoluteTimeGetCurrent());
+    } else if (aStatus == AS_DONE || aStatus == AS_STOPPED) {
+      ASMetricsStopped(streamMetrics, CFAbsoluteTimeGetCurrent());
+    }
+  }
 
   if (shouldNotify)
     [self notifyStateChange];
@@ -1014,7 +1994,24 @@ - (void)setState:(AudioStreamerState)aStatus shouldNotify:(BOOL)shouldNotify {
 - (void)notifyStateChange {
   __strong id <AudioStreamerDelegate> delegate = _delegate;
   if (delegate && [delegate respondsToSelector:@selector(streamerStatusDidChange:)]) {
-    [delegate streamerStatusDidChange:self];
+    [_delegateQueue addOperationWithBlock:^{
+      [delegate streamerStatusDidChange:self];
+    }];
+  }
+}
+
+/**
+ * @brief Tells the delegate the bitrate can be calculated, once per stream
+ */
+- (void)notifyBitrateReady {
+  if (bitrateNotification) return;
+  bitrateNotification = true;
+  [self publishSnapshot];
+  __strong id <AudioStreamerDelegate> delegate = _delegate;
+  if (delegate && [delegate respondsToSelector:@selector(streamerBitrateIsReady:)]) {
+    [_delegateQueue addOperationWithBlock:^{
+      [delegate streamerBitrateIsReady:self];
+    }];
   }
 }
 
@@ -1085,6 +2082,10 @@ + (AudioFileTypeID)hintForFileExtension:(NSString *)fileExtension {
     return kAudioFile3GPType;
   } else if ([fileExtension isEqual:@"3g2"]) {
     return kAudioFile3GP2Type;
+  } else if ([fileExtension isEqual:@"ogg"] ||
+             [fileExtension isEqual:@"oga"] ||
+             [fileExtension isEqual:@"opus"]) {
+    return kASOggFileType;
   }
   return 0;
 }
@@ -1096,6 +2097,11 @@ + (AudioFileTypeID)hintForFileExtension:(NSString *)fileExtension {
  * https://github.com/DigitalDJ/AudioStreamer/blob/master/Classes/AudioStreamer.m
  */
 + (AudioFileTypeID)hintForMIMEType:(NSString*)mimeType {
+  /* ICY headers leave the space after the colon, and either may carry
+     parameters such as "; charset=..." */
+  mimeType = [[[mimeType componentsSeparatedByString:@";"] firstObject]
+              stringByTrimmingCharactersInSet:[NSCharacterSet whitespaceCharacterSet]];
+  mimeType = [mimeType lowercaseString];
   if ([mimeType isEqual:@"audio/mpeg"]) {
     return kAudioFileMP3Type;
   } else if ([mimeType isEqual:@"audio/vnd.wave"] ||
@@ -1114,7 +2120,8 @@ + (AudioFileTypeID)hintForMIMEType:(NSString*)mimeType {
   } else if ([mimeType isEqual:@"audio/x-caf"]) {
     return kAudioFileCAFType;
   } else if ([mimeType isEqual:@"audio/aac"] ||
-             [mimeType isEqual:@"audio/aacp"]) {
+             [mimeType isEqual:@"audio/aacp"] ||
+             [mimeType isEqual:@"audio/x-aac"]) {
     return kAudioFileAAC_ADTSType;
   } else if ([mimeType isEqual:@"audio/basic"]) {
     return kAudioFileNextType;
@@ -1122,10 +2129,45 @@ + (AudioFileTypeID)hintForMIMEType:(NSString*)mimeType {
     return kAudioFile3GPType;
   } else if ([mimeType isEqual:@"audio/3gpp2"]) {
     return kAudioFile3GP2Type;
+  } else if ([mimeType isEqual:@"application/ogg"] ||
+             [mimeType isEqual:@"audio/ogg"] ||
+             [mimeType isEqual:@"audio/opus"] ||
+             [mimeType isEqual:@"audio/vorbis"]) {
+    return kASOggFileType;
   }
   return 0;
 }
 
+/**
+ * @brief Whether a response's MIME type is that of an HLS playlist
+ *
+ * The URLs of HLS streams usually end in .m3u8, which is how most are found
+ * out, but not always.
+ */
++ (BOOL)isHLSMIMEType:(NSString*)mimeType {
+  mimeType = [[[mimeType componentsSeparatedByString:@";"] firstObject]
+              stringByTrimmingCharactersInSet:[NSCharacterSet whitespaceCharacterSet]];
+  mimeType = [mimeType lowercaseString];
+  return [mimeType isEqual:@"application/vnd.apple.mpegurl"];
+}
+
+/**
+ * @brief Whether a response's MIME type is that of a station's playlist
+ *
+ * M3U's types are also used for HLS playlists, which the station transport
+ * tells apart by their contents.
+ */
++ (BOOL)isStationPlaylistMIMEType:(NSString*)mimeType {
+  mimeType = [[[mimeType componentsSeparatedByString:@";"] firstObject]
+              stringByTrimmingCharactersInSet:[NSCharacterSet whitespaceCharacterSet]];
+  mimeType = [mimeType lowercaseString];
+  return [mimeType isEqual:@"audio/x-scpls"] ||
+         [mimeType isEqual:@"application/pls+xml"] ||
+         [mimeType isEqual:@"application/x-mpegurl"] ||
+         [mimeType isEqual:@"audio/mpegurl"] ||
+         [mimeType isEqual:@"audio/x-mpegurl"];
+}
+
 /**
  * @brief Creates a new stream for reading audio data
  *
@@ -1138,142 +2180,658 @@ + (AudioFileTypeID)hintForMIMEType:(NSString*)mimeType {
 - (BOOL)openReadStream {
   NSAssert(stream == NULL, @"Download stream already initialized");
 
-  /* Create our GET request */
-  CFHTTPMessageRef message = CFHTTPMessageCreateRequest(NULL,
-                                                        CFSTR("GET"),
-                                                        (__bridge CFURLRef) _url,
-                                                        kCFHTTPVersion1_1);
   /* ID3 support */
-  id3ParserState = ID3_STATE_INITIAL;
+  if (id3Parser == NULL) {
+    id3Parser = ASID3ParserCreate(ASID3FrameFilter, ASID3FrameProc,
+                                  (__bridge void*) self);
+    CHECK_ERR(id3Parser == NULL, AS_FILE_STREAM_OPEN_FAILED, @"", NO);
+  }
+  ASID3ParserReset(id3Parser);
+  id3Finished = false;
+  id3Title = nil;
+  id3Artist = nil;
 
   /* ICY metadata */
-  CFHTTPMessageSetHeaderFieldValue(message, CFSTR("Icy-MetaData"), CFSTR("1"));
   icyStream = false;
   icyChecked = false;
-  icyMetaBytesRemaining = 0;
-  icyDataBytesRead = 0;
   icyHeadersParsed = false;
-  icyMetadata = [NSMutableString string];
+  if (icyDemuxer == NULL) {
+    icyDemuxer = ASIcyDemuxerCreate();
+    CHECK_ERR(icyDemuxer == NULL, AS_FILE_STREAM_OPEN_FAILED, @"", NO);
+  }
+  ASIcyDemuxerReset(icyDemuxer, 0);
   [self setCurrentSong:nil];
 
+  if (seekIndex == NULL) {
+    seekIndex = ASSeekIndexCreate();
+    CHECK_ERR(seekIndex == NULL, AS_FILE_STREAM_OPEN_FAILED, @"", NO);
+  }
+  /* Only the first connection starts at the beginning of the file, later
+     ones end the scan */
+  if (mp4Info == NULL) {
+    mp4Info = ASMP4InfoCreate();
+    CHECK_ERR(mp4Info == NULL, AS_FILE_STREAM_OPEN_FAILED, @"", NO);
+  }
+
+  /* What's been learnt about the network carries over to new connections */
+  if (bufferController == NULL) {
+    bufferController = ASBufferControllerCreate();
+    CHECK_ERR(bufferController == NULL, AS_FILE_STREAM_OPEN_FAILED, @"", NO);
+  }
+  streamOffset = 0;
+  rangeWindow = kRangeWindowMin;
+  if (mp3Parser) ASMP3ParserReset(mp3Parser);
+  if (adtsParser) ASADTSParserReset(adtsParser);
+  if (oggDemuxer) ASOggDemuxerResync(oggDemuxer);
+  oggTimePending = false;
+  oggSamplesSinceSeek = 0;
+
+  /* HLS segments and station mirrors aren't one file which could be cached */
+  if (cacheEntry == NULL && sharedDiskCache != NULL && !hlsStream &&
+      !stationStream) {
+    cacheEntry = ASDiskCacheOpenEntry(sharedDiskCache,
+                                      [[_url absoluteString] UTF8String]);
+  }
+
   /* When seeking to a time within the stream, we both already know the file
-     length and the seekByteOffset will be set to know what to send to the
-     remote server */
+     length and the seekByteOffset will be set to know where to read from */
   if (fileLength > 0 && seekByteOffset > 0) {
-    NSString *str = [NSString stringWithFormat:@"bytes=%lld-%lld",
-                                               seekByteOffset, fileLength - 1];
-    CFHTTPMessageSetHeaderFieldValue(message,
-                                     CFSTR("Range"),
-                                     (__bridge CFStringRef) str);
     discontinuous = vbr;
+    streamOffset = seekByteOffset;
+    /* Ogg pages say exactly where they are in the stream */
+    oggTimePending = oggDemuxer != NULL;
+    oggHeadersLeft = 0;
   }
 
-  stream = CFReadStreamCreateForHTTPRequest(NULL, message);
-  CFRelease(message);
+  [self setState:AS_WAITING_FOR_DATA];
 
-  /* Follow redirection codes by default */
-  CHECK_ERR(!CFReadStreamSetProperty(stream,
-                                     kCFStreamPropertyHTTPShouldAutoredirect,
-                                     kCFBooleanTrue),
-            AS_FILE_STREAM_SET_PROPERTY_FAILED, @"", NO);
+  return [self openReadStreamAtOffset:streamOffset];
+}
 
-  /* Deal with proxies */
-  switch (proxyType) {
-    case AS_PROXY_HTTP: {
-      CFDictionaryRef proxySettings;
-      if ([[[_url scheme] lowercaseString] isEqualToString:@"https"]) {
-        proxySettings = (__bridge CFDictionaryRef)
-          [NSMutableDictionary dictionaryWithObjectsAndKeys:
-            proxyHost, kCFStreamPropertyHTTPSProxyHost,
-            @(proxyPort), kCFStreamPropertyHTTPSProxyPort,
-            nil];
-      } else {
-        proxySettings = (__bridge CFDictionaryRef)
-        [NSMutableDictionary dictionaryWithObjectsAndKeys:
-          proxyHost, kCFStreamPropertyHTTPProxyHost,
-          @(proxyPort), kCFStreamPropertyHTTPProxyPort,
-          nil];
-      }
-      CFReadStreamSetProperty(stream, kCFStreamPropertyHTTPProxy,
-                              proxySettings);
-      break;
-    }
-    case AS_PROXY_SOCKS: {
-      CFDictionaryRef proxySettings = (__bridge CFDictionaryRef)
-        [NSMutableDictionary dictionaryWithObjectsAndKeys:
-          proxyHost, kCFStreamPropertySOCKSProxyHost,
-          @(proxyPort), kCFStreamPropertySOCKSProxyPort,
-          nil];
-      CFReadStreamSetProperty(stream, kCFStreamPropertySOCKSProxy,
-                              proxySettings);
-      break;
-    }
-    default:
-    case AS_PROXY_SYSTEM: {
-      CFDictionaryRef proxySettings = CFNetworkCopySystemProxySettings();
-      CFReadStreamSetProperty(stream, kCFStreamPropertyHTTPProxy, proxySettings);
-      CFRelease(proxySettings);
-      break;
+/**
+ * @brief Opens the read stream at a byte offset into the file
+ *
+ * If the disk cache has the bytes at the offset, the stream reads the run of
+ * them straight from the cache. Otherwise an HTTP request is made, asking
+ * only for the bytes up to the next cached range if any are cached.
+ *
+ * @param offset The file offset to start reading at
+ * @return YES if the stream was opened, or NO if it failed to open
+ */
+- (BOOL)openReadStreamAtOffset:(UInt64)offset {
+  const UInt8 *cached = NULL;
+  UInt64 cachedLength = 0;
+  UInt64 length = 0;
+  if (cacheEntry != NULL) {
+    cachedLength = ASDiskCacheEntryRead(cacheEntry, offset, &cached);
+    length = ASDiskCacheEntryLength(cacheEntry);
+  }
+  responseChecked = false;
+  segmentStart = offset;
+
+  if (cachedLength > 0) {
+    LOG_INFO(@"reading bytes %llu-%llu from the disk cache", offset,
+             offset + cachedLength - 1);
+    readingCache = true;
+    usingHTTPClient = false;
+    segmentEnd = offset + cachedLength;
+    if (!_httpHeaders) [self restoreCachedResponse];
+    CFReadStreamRef cachedStream =
+      CFReadStreamCreateWithBytesNoCopy(NULL, cached, (CFIndex)cachedLength,
+                                        kCFAllocatorNull);
+    CHECK_ERR(cachedStream == NULL, AS_FILE_STREAM_OPEN_FAILED, @"", NO);
+    stream = ASCFTransportCreate(cachedStream, ASTransportCallBack,
+                                 (__bridge void*) streamerRef);
+    CFRelease(cachedStream);
+    CHECK_ERR(stream == NULL, AS_FILE_STREAM_OPEN_FAILED, @"", NO);
+    return YES;
+  }
+
+  readingCache = false;
+  NSDictionary *headers = [self requestHeadersAtOffset:offset cacheLength:length];
+  racingMirrors = false;
+  stream = [self openHTTPClientRequestWithHeaders:headers offset:offset];
+  usingHTTPClient = stream != NULL;
+  hlsStarted = false;
+  CHECK_ERR(stream == NULL && hlsStream, AS_FILE_STREAM_OPEN_FAILED,
+            @"HLS streams can only be read over http", NO);
+  CHECK_ERR(stream == NULL && stationStream && mirrorURL == nil,
+            AS_FILE_STREAM_OPEN_FAILED,
+            @"Station playlists can only be read over http", NO);
+  if (stream == NULL) {
+    CFReadStreamRef httpStream = [self createHTTPStreamWithHeaders:headers];
+    if (httpStream == NULL) return NO;
+    stream = ASCFTransportCreate(httpStream, ASTransportCallBack,
+                                 (__bridge void*) streamerRef);
+    CFRelease(httpStream);
+    CHECK_ERR(stream == NULL, AS_FILE_STREAM_OPEN_FAILED, @"", NO);
+  }
+  return YES;
+}
+
+/**
+ * @brief Works out the headers of the request for the file from an offset
+ *
+ * Sets segmentEnd to where the response will stop.
+ *
+ * @param offset The file offset to start reading at
+ * @param cacheLength The length of the file according to the disk cache, or 0
+ *        if the cache knows nothing of it
+ * @return The headers to send along with the request
+ */
+- (NSDictionary *)requestHeadersAtOffset:(UInt64)offset
+                             cacheLength:(UInt64)cacheLength {
+  NSMutableDictionary *headers = [NSMutableDictionary dictionary];
+  /* HLS segments never carry ICY metadata */
+  if (!hlsStream) headers[@"Icy-MetaData"] = @"1";
+
+  /* Only ask for the gap up to the next cached range. If-Range makes sure the
+     server sends the whole file again if it has changed since it was cached */
+  NSString *validator = nil;
+  UInt64 end = 0;
+  if (cacheLength > 0) {
+    segmentEnd = ASDiskCacheEntryNextCached(cacheEntry, offset);
+    if (offset > 0 || segmentEnd < cacheLength) {
+      end = segmentEnd;
+      validator = @(ASDiskCacheEntryValidator(cacheEntry));
     }
+  } else {
+    segmentEnd = fileLength;
+    if (offset > 0) end = fileLength;
   }
 
-  /* handle SSL connections */
-  if ([[[_url scheme] lowercaseString] isEqualToString:@"https"]) {
-    NSDictionary *sslSettings = @{
-      (id)kCFStreamSSLLevel: (NSString*)kCFStreamSocketSecurityLevelNegotiatedSSL,
-      (id)kCFStreamSSLValidatesCertificateChain:  @YES,
-      (id)kCFStreamSSLPeerName:                   [NSNull null]
-    };
+  /* Over a connection which is kept open, a window at a time */
+  BOOL windowed = _persistentConnections && _downloadConnections <= 1 && seekable &&
+                  fileLength > 0 && offset + rangeWindow < segmentEnd;
+  if (windowed) {
+    segmentEnd = offset + rangeWindow;
+    end = segmentEnd;
+    if (validator == nil) {
+      validator = _httpHeaders[@"ETag"];
+      if (validator == nil || [validator hasPrefix:@"W/"]) {
+        validator = _httpHeaders[@"Last-Modified"];
+      }
+    }
+  }
 
-    CFReadStreamSetProperty(stream, kCFStreamPropertySSLSettings,
-                            (__bridge CFDictionaryRef) sslSettings);
+  if (end > 0) {
+    headers[@"Range"] = [NSString stringWithFormat:@"bytes=%llu-%llu", offset, end - 1];
+    if (validator != nil) headers[@"If-Range"] = validator;
   }
+  return headers;
+}
 
-  [self setState:AS_WAITING_FOR_DATA];
+/**
+ * @brief The URL being read: the mirror a station's playlist led to, or
+ *        otherwise the stream's own
+ */
+- (NSURL *)sourceURL {
+  return mirrorURL != nil ? mirrorURL : _url;
+}
 
-  CHECK_ERR(!CFReadStreamOpen(stream), AS_FILE_STREAM_OPEN_FAILED, @"", NO);
+/**
+ * @brief Keeps the mirrors the station transport ranked, to fail over to
+ *
+ * @param transport The station transport
+ */
+- (void)takeMirrorFallbacks:(transport_t *)transport {
+  size_t count = ASStationTransportFallbackCount(transport);
+  mirrorURLs = [NSMutableArray arrayWithCapacity:count];
+  for (size_t i = 0; i < count; i++) {
+    NSURL *url = [NSURL URLWithString:@(ASStationTransportFallback(transport, i))];
+    if (url != nil) [mirrorURLs addObject:url];
+  }
+}
 
-  /* Set the callback to receive a few events, and then we're ready to
-     schedule and go */
-  CFStreamClientContext context = {0, (__bridge void*) self, NULL, NULL, NULL};
-  CFReadStreamSetClient(stream,
-                        kCFStreamEventHasBytesAvailable |
-                          kCFStreamEventErrorOccurred |
-                          kCFStreamEventEndEncountered,
-                        ASReadStreamCallBack,
-                        &context);
-  CFReadStreamScheduleWithRunLoop(stream, CFRunLoopGetCurrent(),
-                                  kCFRunLoopCommonModes);
+/**
+ * @brief Gets ready for the response of another of a station's mirrors
+ *
+ * The new server's response starts a new stream, with ICY headers and
+ * frames of its own.
+ */
+- (void)resetForNewMirror {
+  _httpHeaders = nil;
+  icyStream = false;
+  icyChecked = false;
+  icyHeadersParsed = false;
+  ASIcyDemuxerReset(icyDemuxer, 0);
+  if (mp3Parser) ASMP3ParserReset(mp3Parser);
+  if (adtsParser) ASADTSParserReset(adtsParser);
+  if (oggDemuxer) ASOggDemuxerResync(oggDemuxer);
+  discontinuous = true;
+}
 
-  return YES;
+/**
+ * @brief Carries on playing a station from the next of its mirrors
+ *
+ * The station transport has already moved on to the runners-up it held
+ * open, so these are the mirrors left after them, tried in the order the
+ * transport ranked them, straight away rather than racing them again.
+ * Whatever was buffered keeps playing while the new one connects.
+ *
+ * @return YES if there was a mirror left to try
+ */
+- (BOOL)failOverToNextMirror {
+  NSURL *next = [mirrorURLs firstObject];
+  if (next == nil) return NO;
+  [mirrorURLs removeObjectAtIndex:0];
+  LOG_INFO(@"switching to mirror %@", next);
+  mirrorURL = next;
+  httpClientRefused = false;
+  ASTransportClose(stream);
+  stream = NULL;
+  [self resetForNewMirror];
+  return [self openReadStreamAtOffset:0];
 }
 
-//
-// handleReadFromStream:eventType:
-//
+/**
+ * @brief Starts a request on the shared HTTP client
+ *
+ * @param headers The headers to send along with the request
+ * @param offset The file offset the request starts at
+ * @return The request's transport, or NULL if the client can't be used for it
+ */
+- (transport_t *)openHTTPClientRequestWithHeaders:(NSDictionary *)headers
+                                           offset:(UInt64)offset {
+  NSURL *sourceURL = [self sourceURL];
+  NSString *url = [sourceURL absoluteString];
+  /* Only the client can read HLS streams and race a station's mirrors */
+  BOOL racing = stationStream && mirrorURL == nil;
+  if ((!_persistentConnections && !hlsStream && !racing) || httpClientRefused ||
+      !ASHTTPClientHandlesURL([url UTF8String])) {
+    return NULL;
+  }
+
+  http_request_info_t info = {.url = [url UTF8String]};
+  NSString *host = proxyHost;
+  switch (proxyType) {
+    case AS_PROXY_HTTP:
+      info.proxyType = HTTP_PROXY_HTTP;
+      break;
+    case AS_PROXY_SOCKS:
+      info.proxyType = HTTP_PROXY_SOCKS;
+      break;
+    default:
+    case AS_PROXY_SYSTEM: {
+      /* The first proxy the system would use for the URL, if it's one the
+         client can go through */
+      CFDictionaryRef settings = CFNetworkCopySystemProxySettings();
+      if (settings == NULL) break;
+      NSArray *proxies = (__bridge_transfer NSArray *)
+        CFNetworkCopyProxiesForURL((__bridge CFURLRef) sourceURL, settings);
+      CFRelease(settings);
+      NSDictionary *proxy = [proxies firstObject];
+      NSString *type = proxy[(id)kCFProxyTypeKey];
+      if (type == nil || [type isEqualToString:(id)kCFProxyTypeNone]) break;
+      if ([type isEqualToString:(id)kCFProxyTypeHTTP]) {
+        info.proxyType = HTTP_PROXY_HTTP;
+      } else if ([type isEqualToString:(id)kCFProxyTypeSOCKS]) {
+        info.proxyType = HTTP_PROXY_SOCKS;
+      } else {
+        return NULL;
+      }
+      host = proxy[(id)kCFProxyHostNameKey];
+      info.proxyPort = (uint16_t)[proxy[(id)kCFProxyPortNumberKey] intValue];
+      if (host == nil) return NULL;
+      break;
+    }
+  }
+  if (info.proxyType != HTTP_PROXY_NONE) {
+    info.proxyHost = [host UTF8String];
+    if (proxyType != AS_PROXY_SYSTEM) info.proxyPort = (uint16_t)proxyPort;
+  }
+
+  /* HLS requests can have no headers at all, and a VLA can't be empty */
+  const char *fields[2 * MAX([headers count], (NSUInteger)1)];
+  size_t count = 0;
+  for (NSString *key in headers) {
+    fields[2 * count] = [key UTF8String];
+    fields[2 * count + 1] = [headers[key] UTF8String];
+    count++;
+  }
+  info.headers = fields;
+  info.headerCount = count;
+
+  http_client_t *client = ASSharedHTTPClient();
+  if (client == NULL) return NULL;
+
+  if (hlsStream) {
+    usingSegments = false;
+    hls_info_t hls = {
+      .request = info,
+      .startTime = hlsStartTime,
+      .prefetch = _hlsPrefetchSegments,
+    };
+    return ASHLSTransportCreate(client, &hls, ASTransportCallBack,
+                                (__bridge void*) streamerRef);
+  }
+  if (racing) {
+    usingSegments = false;
+    racingMirrors = true;
+    station_info_t station = {.request = info, .racers = _mirrorRaceCount};
+    return ASStationTransportCreate(client, &station, ASTransportCallBack,
+                                    (__bridge void*) streamerRef);
+  }
+
+  /* Segments are only worth trying for files which can be read in ranges */
+  usingSegments = _downloadConnections > 1 && (_httpHeaders == nil || seekable);
+  if (usingSegments) {
+    segmented_info_t segmented = {
+      .request = info,
+      .start = offset,
+      .end = headers[@"Range"] != nil ? segmentEnd : 0,
+      .segmentSize = kDownloadSegmentSize,
+      .maxConnections = _downloadConnections,
+    };
+    return ASSegmentedTransportCreate(client, &segmented, ASTransportCallBack,
+                                      (__bridge void*) streamerRef);
+  }
+  return ASHTTPClientOpen(client, &info, ASTransportCallBack,
+                          (__bridge void*) streamerRef);
+}
+
+/**
+ * @brief Creates the HTTP stream for reading from the remote source
+ *
+ * @param headers The headers to send along with the request
+ * @return The new stream, which hasn't been opened yet
+ */
+- (CFReadStreamRef)createHTTPStreamWithHeaders:(NSDictionary *)headers {
+  NSURL *sourceURL = [self sourceURL];
+  /* Create our GET request */
+  CFHTTPMessageRef message = CFHTTPMessageCreateRequest(NULL,
+                                                        CFSTR("GET"),
+                                                        (__bridge CFURLRef) sourceURL,
+                                                        kCFHTTPVersion1_1);
+  for (NSString *key in headers) {
+    CFHTTPMessageSetHeaderFieldValue(message, (__bridge CFStringRef) key,
+                                     (__bridge CFStringRef) headers[key]);
+  }
+
+  CFReadStreamRef httpStream = CFReadStreamCreateForHTTPRequest(NULL, message);
+  CFRelease(message);
+
+  /* Follow redirection codes by default */
+  if (!CFReadStreamSetProperty(httpStream,
+                               kCFStreamPropertyHTTPShouldAutoredirect,
+                               kCFBooleanTrue)) {
+    CFRelease(httpStream);
+    [self failWithErrorCode:AS_FILE_STREAM_SET_PROPERTY_FAILED reason:@""];
+    return NULL;
+  }
+
+  /* Share connections where CFNetwork can */
+  if (_persistentConnections) {
+    CFReadStreamSetProperty(httpStream, kCFStreamPropertyHTTPAttemptPersistentConnection,
+                            kCFBooleanTrue);
+  }
+
+  /* Deal with proxies */
+  switch (proxyType) {
+    case AS_PROXY_HTTP: {
+      CFDictionaryRef proxySettings;
+      if ([[[sourceURL scheme] lowercaseString] isEqualToString:@"https"]) {
+        proxySettings = (__bridge CFDictionaryRef)
+          [NSMutableDictionary dictionaryWithObjectsAndKeys:
+            proxyHost, kCFStreamPropertyHTTPSProxyHost,
+            @(proxyPort), kCFStreamPropertyHTTPSProxyPort,
+            nil];
+      } else {
+        proxySettings = (__bridge CFDictionaryRef)
+        [NSMutableDictionary dictionaryWithObjectsAndKeys:
+          proxyHost, kCFStreamPropertyHTTPProxyHost,
+          @(proxyPort), kCFStreamPropertyHTTPProxyPort,
+          nil];
+      }
+      CFReadStreamSetProperty(httpStream, kCFStreamPropertyHTTPProxy,
+                              proxySettings);
+      break;
+    }
+    case AS_PROXY_SOCKS: {
+      CFDictionaryRef proxySettings = (__bridge CFDictionaryRef)
+        [NSMutableDictionary dictionaryWithObjectsAndKeys:
+          proxyHost, kCFStreamPropertySOCKSProxyHost,
+          @(proxyPort), kCFStreamPropertySOCKSProxyPort,
+          nil];
+      CFReadStreamSetProperty(httpStream, kCFStreamPropertySOCKSProxy,
+                              proxySettings);
+      break;
+    }
+    default:
+    case AS_PROXY_SYSTEM: {
+      CFDictionaryRef proxySettings = CFNetworkCopySystemProxySettings();
+      CFReadStreamSetProperty(httpStream, kCFStreamPropertyHTTPProxy, proxySettings);
+      CFRelease(proxySettings);
+      break;
+    }
+  }
+
+  /* handle SSL connections */
+  if ([[[sourceURL scheme] lowercaseString] isEqualToString:@"https"]) {
+    NSDictionary *sslSettings = @{
+      (id)kCFStreamSSLLevel: (NSString*)kCFStreamSocketSecurityLevelNegotiatedSSL,
+      (id)kCFStreamSSLValidatesCertificateChain:  @YES,
+      (id)kCFStreamSSLPeerName:                   [NSNull null]
+    };
+
+    CFReadStreamSetProperty(httpStream, kCFStreamPropertySSLSettings,
+                            (__bridge CFDictionaryRef) sslSettings);
+  }
+
+  return httpStream;
+}
+
+/**
+ * @brief Whether reading carries on with another stream once this one ends
+ *
+ * This is the case when the current stream covers only one range of the file,
+ * either cached bytes, a gap between cached ranges or a window of the file
+ * read over a connection which is kept open.
+ */
+- (BOOL)hasNextReadStream {
+  UInt64 length = cacheEntry != NULL ? ASDiskCacheEntryLength(cacheEntry) : 0;
+  /* Windows of the file run up to its end */
+  if (length == 0 && !readingCache && segmentEnd < fileLength) length = fileLength;
+  UInt64 position = readingCache ? segmentEnd : cacheWriteOffset;
+  return length > 0 && position < length && (readingCache || segmentEnd < length);
+}
+
+/**
+ * @brief Swaps the finished read stream for one covering the next range
+ *
+ * Anything already parsed or waiting for a buffer is left alone, so playback
+ * carries on from the new stream as if nothing had happened.
+ */
+- (BOOL)openNextReadStream {
+  UInt64 offset = readingCache ? segmentEnd : cacheWriteOffset;
+  if (!readingCache) rangeWindow = MIN(rangeWindow * 2, kRangeWindowMax);
+  ASTransportClose(stream);
+  stream = NULL;
+  return [self openReadStreamAtOffset:offset];
+}
+
+/**
+ * @brief Whether the read stream has delivered the last byte of the file
+ */
+- (BOOL)readStreamAtEnd {
+  return stream != NULL && ASTransportAtEnd(stream) && ![self hasNextReadStream];
+}
+
+/**
+ * @brief Decides whether the bytes of an HTTP response go in the disk cache
+ *
+ * Only complete files and byte ranges of them with a length and a validator
+ * are cached. A response which can't be cached drops whatever was cached for
+ * the URL, as it can no longer be trusted.
+ *
+ * @param headers The response's headers
+ * @param statusCode The response's status code
+ */
+- (void)checkResponseForCache:(NSDictionary *)headers statusCode:(int)statusCode {
+  responseChecked = true;
+  cacheWritable = false;
+  cacheWriteOffset = 0;
+
+  UInt64 start = 0, total = 0;
+  if (statusCode == 206) {
+    /* Content-Range: bytes <start>-<end>/<total> */
+    NSScanner *scanner = [NSScanner scannerWithString:headers[@"Content-Range"] ?: @""];
+    unsigned long long first, last, length;
+    if ([scanner scanString:@"bytes" intoString:NULL] &&
+        [scanner scanUnsignedLongLong:&first] &&
+        [scanner scanString:@"-" intoString:NULL] &&
+        [scanner scanUnsignedLongLong:&last] &&
+        [scanner scanString:@"/" intoString:NULL] &&
+        [scanner scanUnsignedLongLong:&length]) {
+      start = first;
+      total = length;
+      /* Content-Length is only that of the range */
+      fileLength = total;
+    }
+    seekable = true;
+  } else if (statusCode == 200) {
+    total = (UInt64)[headers[@"Content-Length"] longLongValue];
+  }
+  cacheWriteOffset = start;
+  if (cacheEntry == NULL) return;
+
+  NSString *validator = headers[@"ETag"];
+  if (validator == nil || [validator hasPrefix:@"W/"]) {
+    validator = headers[@"Last-Modified"];
+  }
+  if (total == 0 || validator == nil || !seekable || headers[@"icy-metaint"]) {
+    ASDiskCacheEntrySetInfo(cacheEntry, 0, "", NULL, 0);
+    return;
+  }
+
+  /* Keep the headers to stand in for a response when playing from the cache */
+  NSMutableDictionary *saved = [_httpHeaders mutableCopy] ?: [headers mutableCopy];
+  [saved removeObjectForKey:@"Content-Range"];
+  saved[@"Content-Length"] = [NSString stringWithFormat:@"%llu", total];
+  saved[@"Accept-Ranges"] = @"bytes";
+  NSData *metadata = [NSPropertyListSerialization dataWithPropertyList:saved
+                                                                format:NSPropertyListBinaryFormat_v1_0
+                                                               options:0
+                                                                 error:NULL];
+  if (ASDiskCacheEntryLength(cacheEntry) > 0 &&
+      (ASDiskCacheEntryLength(cacheEntry) != total ||
+       strcmp(ASDiskCacheEntryValidator(cacheEntry), [validator UTF8String]) != 0)) {
+    LOG_INFO(@"cached copy of the file is out of date");
+  }
+  cacheWritable = ASDiskCacheEntrySetInfo(cacheEntry, total, [validator UTF8String],
+                                          [metadata bytes], [metadata length]);
+}
+
+/**
+ * @brief Fills in what would have come from the HTTP response when the first
+ * bytes are read from the disk cache
+ */
+- (void)restoreCachedResponse {
+  size_t length;
+  const void *metadata = ASDiskCacheEntryMetadata(cacheEntry, &length);
+  NSDictionary *headers = nil;
+  if (metadata != NULL) {
+    headers = [NSPropertyListSerialization propertyListWithData:[NSData dataWithBytes:metadata length:length]
+                                                        options:NSPropertyListImmutable
+                                                         format:NULL
+                                                          error:NULL];
+  }
+  _httpHeaders = [headers isKindOfClass:[NSDictionary class]] ? headers : @{};
+  fileLength = ASDiskCacheEntryLength(cacheEntry);
+  seekable = true;
+}
+
+/* Header names compare ignoring case, as they do in a CFHTTPMessage */
+static Boolean ASHeaderNameEqual(const void *a, const void *b) {
+  return [(__bridge NSString *)a caseInsensitiveCompare:(__bridge NSString *)b] == NSOrderedSame;
+}
+
+static CFHashCode ASHeaderNameHash(const void *name) {
+  return [[(__bridge NSString *)name lowercaseString] hash];
+}
+
+/**
+ * @brief The headers of the current stream's response
+ *
+ * @return The headers, looked up ignoring the case of their names
+ */
+- (NSDictionary *)responseHeaders {
+  CFDictionaryKeyCallBacks keyCallBacks = kCFTypeDictionaryKeyCallBacks;
+  keyCallBacks.equal = ASHeaderNameEqual;
+  keyCallBacks.hash = ASHeaderNameHash;
+  CFMutableDictionaryRef headers =
+    CFDictionaryCreateMutable(NULL, 0, &keyCallBacks,
+                              &kCFTypeDictionaryValueCallBacks);
+  size_t count = ASTransportHeaderCount(stream);
+  for (size_t i = 0; i < count; i++) {
+    const char *name, *value;
+    if (!ASTransportHeader(stream, i, &name, &value)) continue;
+    NSString *key = @(name);
+    NSString *string = [[NSString alloc] initWithBytes:value length:strlen(value)
+                                               encoding:NSUTF8StringEncoding] ?:
+                       [[NSString alloc] initWithBytes:value length:strlen(value)
+                                               encoding:NSISOLatin1StringEncoding];
+    if (key == nil || string == nil) continue;
+    CFDictionarySetValue(headers, (__bridge CFStringRef) key,
+                         (__bridge CFStringRef) string);
+  }
+  return (__bridge_transfer NSDictionary *)headers;
+}
+
+//
+// handleReadFromStream:event:
+//
 // Reads data from the network file stream into the AudioFileStream
 //
 // Parameters:
 //    aStream - the network file stream
-//    eventType - the event which triggered this method
+//    event - the event which triggered this method
 //
-- (void)handleReadFromStream:(CFReadStreamRef)aStream
-                   eventType:(CFStreamEventType)eventType {
+- (void)handleReadFromStream:(transport_t *)aStream
+                       event:(transport_event_t)event {
   assert(aStream == stream);
-  assert(!waitingOnBuffer || _bufferInfinite);
   events++;
 
-  switch (eventType) {
-    case kCFStreamEventErrorOccurred: {
+  switch (event) {
+    case TRANSPORT_EVENT_ERROR: {
       LOG_INFO(@"error");
-      /* Deprecated. Will eventually be a local variable. */
-      NSError *networkError = (__bridge_transfer NSError*) CFReadStreamCopyError(aStream);
+      const char *location = !usingHTTPClient || hlsStream || racingMirrors ? NULL :
+        usingSegments ? ASSegmentedTransportRedirectLocation(aStream) :
+                        ASHTTPClientRedirectLocation(aStream);
+      if (location != NULL) {
+        /* CFNetwork can follow redirects the client can't */
+        LOG_INFO(@"redirected to %s, reading with CFNetwork instead", location);
+        httpClientRefused = true;
+        ASTransportClose(stream);
+        stream = NULL;
+        [self openReadStreamAtOffset:segmentStart];
+        return;
+      }
+      if (racingMirrors && mirrorURL == nil &&
+          ASStationTransportIsHLS(aStream)) {
+        /* HLS playlists can be served with the same types as M3U ones */
+        LOG_INFO(@"the playlist is an HLS one, reading it as one");
+        stationStream = false;
+        hlsStream = true;
+        ASTransportClose(stream);
+        stream = NULL;
+        [self openReadStreamAtOffset:0];
+        return;
+      }
+      if (racingMirrors) {
+        /* Those which couldn't be raced, such as https ones, and after a
+           win, those left once the ones held open had failed too */
+        [self takeMirrorFallbacks:aStream];
+      }
+      if (stationStream && [self failOverToNextMirror]) return;
+      const char *description = ASTransportError(aStream);
+      NSString *reason = description != NULL ? @(description) : @"";
       if (!_error) {
         if (buffersUsed != 0) {
           /* shouldStop = NO as we will retry connecting later */
-          [self failWithErrorCode:AS_NETWORK_CONNECTION_FAILED reason:[networkError localizedDescription] shouldStop:NO];
+          [self failWithErrorCode:AS_NETWORK_CONNECTION_FAILED reason:reason shouldStop:NO];
         } else {
-          [self failWithErrorCode:AS_NETWORK_CONNECTION_FAILED reason:[networkError localizedDescription] shouldStop:YES];
+          [self failWithErrorCode:AS_NETWORK_CONNECTION_FAILED reason:reason shouldStop:YES];
         }
       } else {
         /* We tried reconnecting but failed. Time to stop. */
@@ -1283,7 +2841,12 @@ - (void)handleReadFromStream:(CFReadStreamRef)aStream
       }
       return;
     }
-    case kCFStreamEventEndEncountered:
+    case TRANSPORT_EVENT_END:
+      if ([self hasNextReadStream]) {
+        LOG_DEBUG(@"end of range at %llu", readingCache ? segmentEnd : cacheWriteOffset);
+        [self openNextReadStream];
+        return;
+      }
       LOG_INFO(@"end");
       [timeout invalidate];
       timeout = nil;
@@ -1299,8 +2862,9 @@ - (void)handleReadFromStream:(CFReadStreamRef)aStream
       if (state_ == AS_WAITING_FOR_DATA) {
         if (buffersUsed > 0) {
           /* If we got some data, the stream was either short or interrupted early.
-           * We have some data so go ahead and play that. */
-          [self startAudioQueue];
+           * We have some data so go ahead and play that (once asked to, if
+           * preloading). */
+          if (!preloading) [self startAudioQueue];
         } else if ((seekByteOffset - dataOffset) != 0) {
           /* If a seek was performed, and no data came back, then we probably
              seeked to the end or near the end of the stream */
@@ -1312,65 +2876,114 @@ - (void)handleReadFromStream:(CFReadStreamRef)aStream
       }
       return;
 
-    default:
-      return;
-
-    case kCFStreamEventHasBytesAvailable:
+    case TRANSPORT_EVENT_READABLE:
       break;
   }
   LOG_VERBOSE(@"data");
 
-  CFHTTPMessageRef message = (CFHTTPMessageRef)CFReadStreamCopyProperty(stream, kCFStreamPropertyHTTPResponseHeader);
-  CFIndex statusCode = CFHTTPMessageGetResponseStatusCode(message);
+  /* Cached bytes have no HTTP response */
+  int statusCode = 0;
+  if (!readingCache) {
+    /* A runner-up the station transport held open has taken over from the
+       mirror which won */
+    const char *mirror = racingMirrors ? ASStationTransportURL(stream) : NULL;
+    if (mirror != NULL && mirrorURL != nil &&
+        strcmp(mirror, [[mirrorURL absoluteString] UTF8String]) != 0) {
+      mirrorURL = [NSURL URLWithString:@(mirror)];
+      [self takeMirrorFallbacks:stream];
+      LOG_INFO(@"mirror %@ took over", mirrorURL);
+      [self resetForNewMirror];
+    }
 
-  if (statusCode >= 400) {
-    [self failWithErrorCode:AS_AUDIO_DATA_NOT_FOUND
-                     reason:[NSString stringWithFormat:@"Server returned HTTP %ld", statusCode]];
-  }
+    statusCode = ASTransportStatusCode(stream);
 
-  /* Read off the HTTP headers into our own class if we haven't done so */
-  if (!_httpHeaders) {
-    _httpHeaders = (__bridge_transfer NSDictionary *)CFHTTPMessageCopyAllHeaderFields(message);
+    if (statusCode >= 400) {
+      if (stationStream && [self failOverToNextMirror]) return;
+      [self failWithErrorCode:AS_AUDIO_DATA_NOT_FOUND
+                       reason:[NSString stringWithFormat:@"Server returned HTTP %d", statusCode]];
+      /* Failing stopped the stream and closed it */
+      return;
+    }
 
-    //
-    // Only read the content length if we seeked to time zero, otherwise
-    // we may only have a subset of the total bytes.
-    //
-    if ((seekByteOffset - dataOffset) == 0) {
-      fileLength = (UInt64)[_httpHeaders[@"Content-Length"] longLongValue];
+    NSDictionary *headers = [self responseHeaders];
+
+    /* A playlist whose URL didn't say so is opened again as one */
+    if (!hlsStream && !stationStream) {
+      NSString *type = headers[@"Content-Type"];
+      hlsStream = [[self class] isHLSMIMEType:type];
+      stationStream = !hlsStream && [[self class] isStationPlaylistMIMEType:type];
+      if (hlsStream || stationStream) {
+        LOG_INFO(@"response is %@ playlist, reading it as one",
+                 hlsStream ? @"an HLS" : @"a station's");
+        ASDiskCacheCloseEntry(cacheEntry);
+        cacheEntry = NULL;
+        ASTransportClose(stream);
+        stream = NULL;
+        [self openReadStreamAtOffset:0];
+        return;
+      }
     }
 
-    seekable = [_httpHeaders[@"Accept-Ranges"] caseInsensitiveCompare:@"bytes"] == NSOrderedSame;
-  }
+    /* Read off the HTTP headers into our own class if we haven't done so */
+    if (!_httpHeaders) {
+      _httpHeaders = headers;
 
-  CFRelease(message);
+      //
+      // Only read the content length if we seeked to time zero, otherwise
+      // we may only have a subset of the total bytes.
+      //
+      if ((seekByteOffset - dataOffset) == 0) {
+        fileLength = (UInt64)[_httpHeaders[@"Content-Length"] longLongValue];
+      }
+
+      seekable = [_httpHeaders[@"Accept-Ranges"] caseInsensitiveCompare:@"bytes"] == NSOrderedSame;
+    }
+
+    if (!responseChecked) {
+      [self checkResponseForCache:headers statusCode:statusCode];
+    }
+
+    /* The HLS transport only knows where in the stream it started, and how
+       long the stream is, once there's something to read */
+    if (hlsStream && !hlsStarted) {
+      hlsStarted = true;
+      seekTime = ASHLSTransportStartTime(stream);
+      seekable = ASHLSTransportDuration(stream, &hlsDuration);
+    }
+
+    /* The mirror which won the race is read from now on, with the rest to
+       fall back on */
+    if (racingMirrors && mirrorURL == nil) {
+      mirrorURL = [NSURL URLWithString:@(ASStationTransportURL(stream))];
+      [self takeMirrorFallbacks:stream];
+      LOG_INFO(@"playing mirror %@", mirrorURL);
+    }
+  }
 
   OSStatus osErr;
 
-  /* If we haven't yet opened up a file stream, then do so now */
-  if (!audioFileStream) {
-    /* If a file type wasn't specified, we have to guess */
+  /* If a file type wasn't specified, we have to guess. The file stream itself
+     is opened once the first audio arrives, after any ICY headers have had
+     their say */
+  if (_fileType == 0) {
+    _fileType = [[self class] hintForMIMEType:_httpHeaders[@"Content-Type"]];
     if (_fileType == 0) {
-      _fileType = [[self class] hintForMIMEType:_httpHeaders[@"Content-Type"]];
+      _fileType = [[self class] hintForFileExtension:[[[self sourceURL] path] pathExtension]];
       if (_fileType == 0) {
-        _fileType = [[self class] hintForFileExtension:[[_url path] pathExtension]];
-        if (_fileType == 0) {
-          _fileType = kDefaultAudioFileType;
-        }
+        _fileType = kDefaultAudioFileType;
       }
     }
-
-    // create an audio file stream parser
-    osErr = AudioFileStreamOpen((__bridge void*) self, ASPropertyListenerProc,
-                                ASPacketsProc, _fileType, &audioFileStream);
-    CHECK_ERR(osErr, AS_FILE_STREAM_OPEN_FAILED, [[self class] descriptionForAFSErrorCode:osErr]);
   }
 
   UInt32 bufferSize = (_bufferSize > 0) ? _bufferSize : kDefaultAQDefaultBufSize;
   UInt8 bytes[bufferSize];
   CFIndex length;
-  while (stream && CFReadStreamHasBytesAvailable(stream) && ![self isDone]) {
-    length = CFReadStreamRead(stream, bytes, (CFIndex)sizeof(bytes));
+  while (stream && ASTransportHasBytesAvailable(stream) && ![self isDone]) {
+    /* Cached bytes are always available, so stop as soon as enough is
+       buffered rather than parsing the whole file into memory. The stream
+       picks up again once it is rescheduled */
+    if (readingCache && waitingOnBuffer && ![self shouldReadAhead]) break;
+    length = ASTransportRead(stream, bytes, sizeof(bytes));
 
     if (length < 0) {
       if (didConnect) {
@@ -1388,8 +3001,6 @@ - (void)handleReadFromStream:(CFReadStreamRef)aStream
     didConnect = true;
 
     // Shoutcast support.
-    UInt8 bytesNoMetadata[bufferSize]; // Bytes without the ICY metadata
-    UInt32 lengthNoMetadata = 0;
     NSUInteger streamStart = 0;
 
     if (!icyChecked && statusCode == 200) {
@@ -1405,12 +3016,27 @@ - (void)handleReadFromStream:(CFReadStreamRef)aStream
           icyMetaInterval = [_httpHeaders[@"icy-metaint"] intValue];
           icyBitrate = [_httpHeaders[@"icy-br"] doubleValue] * 1000.0;
           icyHeadersParsed = true;
+          ASIcyDemuxerReset(icyDemuxer, (UInt32)MAX(icyMetaInterval, 0));
         }
       }
       icyChecked = true;
     }
 
-    if (!icyStream && id3ParserState != ID3_STATE_PARSED) {
+    if (readingCache) {
+      ASDiskCacheEntryCountHit(cacheEntry, (UInt64)length);
+    } else {
+      if (cacheWritable && !icyStream) {
+        ASDiskCacheEntryWrite(cacheEntry, cacheWriteOffset, bytes, (size_t)length);
+      }
+      cacheWriteOffset += (UInt64)length;
+      CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+      ASBufferControllerAddBytes(bufferController, (size_t)length, now);
+      if (streamMetrics != NULL) {
+        ASMetricsAddBytes(streamMetrics, (UInt64)length, now);
+      }
+    }
+
+    if (!icyStream && !id3Finished) {
       // ID3 support
       [self parseID3TagsInBytes:bytes length:length];
     } else if (icyStream && !icyHeadersParsed) {
@@ -1450,17 +3076,9 @@ - (void)handleReadFromStream:(CFReadStreamRef)aStream
 
               if (_fileType != oldFileType) {
                 LOG_INFO(@"ICY stream Content-Type: %@", lineItems[1]);
-                AudioFileStreamClose(audioFileStream);
-                AudioQueueStop(audioQueue, true);
-                if (buffers) {
-                  for (UInt32 j = 0; j < _bufferCount; ++j) {
-                    AudioQueueFreeBuffer(audioQueue, buffers[j]->ref);
-                  }
-                }
-
-                osErr = AudioFileStreamOpen((__bridge void*) self, ASPropertyListenerProc,
-                                            ASPacketsProc, _fileType, &audioFileStream);
-                CHECK_ERR(osErr, AS_FILE_STREAM_OPEN_FAILED, [[self class] descriptionForAFSErrorCode:osErr]);
+                /* No audio has been parsed yet, so there's nothing to tear
+                   down unless the stream was reconnected */
+                [self closeFileStream];
               }
             }
             else if ([lineItems[0] caseInsensitiveCompare:@"icy-metaint"] == NSOrderedSame) {
@@ -1484,346 +3102,261 @@ - (void)handleReadFromStream:(CFReadStreamRef)aStream
 
       if (icyHeadersParsed) {
         streamStart = streamStart + 4;
+        ASIcyDemuxerReset(icyDemuxer, (UInt32)MAX(icyMetaInterval, 0));
       }
     }
 
-    if (icyHeadersParsed) {
-      for (CFIndex byte = (CFIndex)streamStart; byte < length; byte++) {
-        if (icyMetaBytesRemaining > 0) {
-          [icyMetadata appendFormat:@"%c", bytes[byte]];
-
-          icyMetaBytesRemaining--;
-
-          if (icyMetaBytesRemaining == 0) {
-            // Ready for parsing
-            NSArray *metadataArr = [icyMetadata componentsSeparatedByString:@";"];
-            for (NSString *metadataLine in metadataArr) {
-              NSString *key;
-              NSScanner *scanner = [NSScanner scannerWithString:metadataLine];
-              [scanner scanUpToString:@"=" intoString:&key];
-              if ([scanner isAtEnd] || ![key isEqualToString:@"StreamTitle"]) continue; // Not interested in other metadata
-              [scanner scanString:@"=" intoString:nil];
-              [scanner scanString:@"'" intoString:nil];
-              NSUInteger scanLoc = [scanner scanLocation];
-              NSString *value = [metadataLine substringWithRange:NSMakeRange(scanLoc, [metadataLine length] - scanLoc - 1)];
-
-              LOG_INFO(@"ICY stream title (current song): %@", value);
-
-              [self setCurrentSong:value];
-            }
-            icyDataBytesRead = 0;
-          }
-
-          continue;
+    osErr = 0;
+    if (icyStream && !icyHeadersParsed) {
+      /* Still waiting on the rest of the ICY headers */
+    } else if (icyMetaInterval > 0) {
+      /* Hand each run of audio between metadata blocks straight to the parser */
+      CFIndex pos = (CFIndex)streamStart;
+      while (pos < length && !osErr && ![self isDone]) {
+        icy_span_t span;
+        pos += (CFIndex)ASIcyDemuxerNext(icyDemuxer, bytes + pos, (size_t)(length - pos), &span);
+        if (span.type == ICY_SPAN_AUDIO) {
+          osErr = [self parseAudioBytes:span.data length:(UInt32)span.length];
+        } else if (span.type == ICY_SPAN_METADATA) {
+          [self handleICYMetadata:span.data length:span.length];
         }
-
-        if (icyMetaInterval > 0 && icyDataBytesRead == icyMetaInterval) {
-          icyMetaBytesRemaining = bytes[byte] * 16;
-
-          icyMetadata = [NSMutableString string];
-
-          if (icyMetaBytesRemaining == 0) {
-            icyDataBytesRead = 0;
-          }
-
-          continue;
-        }
-
-        icyDataBytesRead++;
-        bytesNoMetadata[lengthNoMetadata] = bytes[byte];
-        lengthNoMetadata++;
       }
-    }
-
-    isParsing = true;
-    UInt32 parseFlags;
-    if (discontinuous) {
-      parseFlags = kAudioFileStreamParseFlag_Discontinuity;
-    } else {
-      parseFlags = 0;
-    }
-    if (lengthNoMetadata > 0) {
-      osErr = AudioFileStreamParseBytes(audioFileStream, lengthNoMetadata,
-                                        bytesNoMetadata, parseFlags);
-    } else if (icyMetaInterval == 0) {
-      osErr = AudioFileStreamParseBytes(audioFileStream, (UInt32)length,
-                                        bytes, parseFlags);
     } else {
-      osErr = 0;
+      osErr = [self parseAudioBytes:bytes + streamStart
+                             length:(UInt32)(length - (CFIndex)streamStart)];
     }
-    isParsing = false;
 
     if ([self isDone]) [self closeFileStream];
     CHECK_ERR(osErr, AS_FILE_STREAM_PARSE_BYTES_FAILED, [[self class] descriptionForAFSErrorCode:osErr]);
   }
 }
 
-- (void)parseID3TagsInBytes:(UInt8[])bytes length:(CFIndex)length
-{
-  UInt8 id3Version;
-  int id3TagSize;
-  AudioStreamerID3FlagInfo id3FlagInfo = 0;
-  int id3PosStart;
-  UInt8 syncedBytes[length];
-  while (true) {
-    if (id3ParserState == ID3_STATE_INITIAL) {
-      if (length <= 10) {
-        /* Not enough bytes */
-        id3ParserState = ID3_STATE_PARSED;
-        break;
-      }
-
-      if (bytes[0] != 'I' || bytes[1] != 'D' || bytes[2] != '3') {
-        id3ParserState = ID3_STATE_PARSED; // Done here
-        break;
-      }
-
-      id3Version = bytes[3];
-      LOG_INFO(@"ID3 version 2.%hhu", id3Version);
-      if (id3Version != 2 && id3Version != 3 && id3Version != 4) { /* Only supporting ID3v2.2, v2.3 and v2.4 */
-        id3ParserState = ID3_STATE_PARSED;
-        break;
-      }
-
-      if ((bytes[5] & 0x80) != 0) {
-        id3FlagInfo |= ID3_FLAG_UNSYNC;
-      }
-      if ((bytes[5] & 0x40) != 0) {
-        if (id3Version >= 3) {
-          id3FlagInfo |= ID3_FLAG_EXTENDED_HEADER;
-        } else {
-          id3ParserState = ID3_STATE_PARSED;
-          break;
-        }
-      }
-
-      id3TagSize = ((bytes[6] & 0x7F) << 21) | ((bytes[7] & 0x7F) << 14) |
-                    ((bytes[8] & 0x7F) << 7) | (bytes[9] & 0x7F);
-
-      if (length < id3TagSize) {
-        LOG_WARN(@"Not enough data received to parse ID3.");
-        id3ParserState = ID3_STATE_PARSED;
-        break;
-      }
-
-      if (id3TagSize > 0) {
-        if (id3Version <= 3 && (id3FlagInfo & ID3_FLAG_UNSYNC)) {
-          for (int pos = 10, last = 0, i = 0; pos < id3TagSize; pos++) {
-            UInt8 byte = bytes[pos];
-            if (last != 0xFF || byte != 0) {
-              syncedBytes[i++] = byte;
-            }
-            last = byte;
-          }
-        } else {
-          for (int pos = 10, i = 0; pos < id3TagSize; pos++, i++) {
-            syncedBytes[i] = bytes[pos];
-          }
-        }
-
-        if (id3FlagInfo & ID3_FLAG_EXTENDED_HEADER) {
-          int extendedHeaderSize = ((syncedBytes[0] << 24) | (syncedBytes[1] << 16) |
-                                    (syncedBytes[2] << 8) | syncedBytes[3]);
-          if (extendedHeaderSize > id3TagSize) {
-            id3ParserState = ID3_STATE_PARSED;
-            break;
-          }
-          int extendedPadding;
-          if (id3Version == 3) {
-            extendedPadding = ((syncedBytes[5] << 24) | (syncedBytes[6] << 16) |
-                               (syncedBytes[7] << 8) | syncedBytes[8]);
-          } else {
-            extendedPadding = 0;
-          }
-          id3PosStart = ((id3Version == 3) ? 4 : 0) + extendedHeaderSize;
-          if (extendedPadding < id3TagSize) {
-            id3TagSize -= extendedPadding;
-          } else {
-            id3ParserState = ID3_STATE_PARSED;
-            break;
-          }
-        } else {
-          id3PosStart = 0;
-        }
-
-        id3ParserState = ID3_STATE_READY_TO_PARSE;
-        continue;
-      }
-    } else if (id3ParserState == ID3_STATE_READY_TO_PARSE) {
-      int pos = id3PosStart;
-
-      NSString *id3Title;
-      NSString *id3Artist;
-
-      while ((pos + 10) < id3TagSize) {
-        int startPos = pos;
-
-        int frameSize;
-        if (id3Version >= 3) {
-          pos += 4;
-          frameSize = ((syncedBytes[pos] << 24) + (syncedBytes[pos+1] << 16) +
-                       (syncedBytes[pos+2] << 8) + syncedBytes[pos+3]);
-          pos += 4;
-        } else {
-          pos += 3;
-          frameSize = (syncedBytes[pos] << 16) + (syncedBytes[pos+1] << 8) + syncedBytes[pos+2];
-          pos += 3;
-        }
-        if ((frameSize+pos+2) > id3TagSize || frameSize == 0) {
-          break;
-        }
+/**
+ * @brief Creates the parser which splits the stream into packets
+ *
+ * MP3 and ADTS streams use the built-in frame scanners if <nativeParsing> is
+ * set, Ogg streams always use the built-in demuxer, and everything else an
+ * AudioFileStream for the current file type.
+ *
+ * @return YES if the parser was created, or NO if it failed
+ */
+- (BOOL)openFileStream {
+  if (_fileType == kASOggFileType) {
+    oggDemuxer = ASOggDemuxerCreate(ASOggStreamFilter, ASOggPacketProc,
+                                    (__bridge void*) self);
+    CHECK_ERR(oggDemuxer == NULL, AS_FILE_STREAM_OPEN_FAILED, @"", NO);
+    return YES;
+  }
+  if (_nativeParsing && _fileType == kAudioFileMP3Type) {
+    mp3Parser = ASMP3ParserCreate(ASMP3FormatProc, ASNativePacketsProc,
+                                  (__bridge void*) self);
+    CHECK_ERR(mp3Parser == NULL, AS_FILE_STREAM_OPEN_FAILED, @"", NO);
+    return YES;
+  }
+  if (_nativeParsing && _fileType == kAudioFileAAC_ADTSType) {
+    adtsParser = ASADTSParserCreate(ASADTSFormatProc, ASNativePacketsProc,
+                                    (__bridge void*) self);
+    CHECK_ERR(adtsParser == NULL, AS_FILE_STREAM_OPEN_FAILED, @"", NO);
+    return YES;
+  }
 
-        int flags = 0;
-        if (id3Version >= 3) {
-          flags = (syncedBytes[pos] << 8) + syncedBytes[pos+1];
+  OSStatus osErr = AudioFileStreamOpen((__bridge void*) self, ASPropertyListenerProc,
+                                       ASPacketsProc, _fileType, &audioFileStream);
+  CHECK_ERR(osErr, AS_FILE_STREAM_OPEN_FAILED, [[self class] descriptionForAFSErrorCode:osErr], NO);
+  return YES;
+}
 
-          if ((id3Version == 3 && (flags & 0x80) > 0) || (id3Version >= 4 && (flags & 0x8) > 0) || /* compressed */
-              (id3Version == 3 && (flags & 0x40) > 0) || (id3Version >= 4 && (flags & 0x4) > 0) /* encrypted */) {
-            // Unsupported - skip to next frame
-            pos += 10 + frameSize;
-            continue;
-          }
+/**
+ * @brief Feeds audio data into the file stream parser
+ *
+ * @param bytes The audio data, with any ICY metadata removed
+ * @param length The number of bytes of audio data
+ * @return The error from the file stream parser, if any
+ */
+- (OSStatus)parseAudioBytes:(const UInt8 *)bytes length:(UInt32)length {
+  if (length == 0) return 0;
+  if (!audioFileStream && !mp3Parser && !adtsParser && !oggDemuxer &&
+      ![self openFileStream]) {
+    return 0;
+  }
+  OSStatus osErr = 0;
+  isParsing = true;
+  if (mp3Parser) {
+    ASMP3ParserParse(mp3Parser, bytes, length);
+  } else if (adtsParser) {
+    ASADTSParserParse(adtsParser, bytes, length);
+  } else if (oggDemuxer) {
+    ASOggDemuxerParse(oggDemuxer, bytes, length);
+  } else {
+    UInt32 parseFlags = discontinuous ? kAudioFileStreamParseFlag_Discontinuity : 0;
+    osErr = AudioFileStreamParseBytes(audioFileStream, length, bytes, parseFlags);
+  }
+  isParsing = false;
+  /* Once the file stream knows where the audio starts, the seek index can
+     look at the first frame for a Xing or VBRI header */
+  if (!icyStream && !oggDemuxer) {
+    ASSeekIndexScanHeader(seekIndex, streamOffset, bytes, length);
+  }
+  if (!icyStream && audioFileStream != NULL) {
+    ASMP4InfoScan(mp4Info, streamOffset, bytes, length);
+  }
+  streamOffset += length;
+  return osErr;
+}
 
-          if ((id3Version == 3 && (flags & 0x20)) || (id3Version >= 4 && (flags & 0x40))) {
-            pos++;
-            frameSize--;
-          }
+/**
+ * @brief Handles a complete block of ICY metadata
+ *
+ * Only the StreamTitle field is of interest, and it becomes the current song.
+ */
+- (void)handleICYMetadata:(const UInt8 *)metadata length:(size_t)length {
+  const UInt8 *title;
+  size_t titleLength;
+  if (!ASIcyParseStreamTitle(metadata, length, &title, &titleLength)) return;
+
+  NSString *value = [[NSString alloc] initWithBytes:title
+                                             length:titleLength
+                                           encoding:NSUTF8StringEncoding];
+  if (value == nil) {
+    value = [[NSString alloc] initWithBytes:title
+                                     length:titleLength
+                                   encoding:NSISOLatin1StringEncoding];
+  }
+  if (value == nil) return;
 
-          pos += 2;
-        }
+  LOG_INFO(@"ICY stream title (current song): %@", value);
 
-        CFStringEncoding encoding;
-
-        UInt8 syncedFrameBytes[frameSize];
-        if (id3Version >= 4 && (flags & 0x2)) {
-          for (int pos2 = pos, last = 0, i = 0; pos2 < (frameSize+pos); pos2++) {
-            UInt8 byte = syncedBytes[pos2];
-            if (last != 0xFF || byte != 0) {
-              if (i == 0) {
-                if (byte == 3) {
-                  encoding = kCFStringEncodingUTF8;
-                } else if (byte == 2) {
-                  encoding = kCFStringEncodingUTF16BE;
-                } else if (byte == 1) {
-                  encoding = kCFStringEncodingUTF16;
-                } else {
-                  // Default encoding
-                  encoding = kCFStringEncodingISOLatin1;
-                }
-              }
-              if ((pos+i-1) > pos) {
-                // I hate UTF-16
-                if ((encoding == kCFStringEncodingUTF16 || encoding == kCFStringEncodingUTF16BE) &&
-                    i >= 4 && (i % 2) == 0 && syncedFrameBytes[i-3] == 0 && syncedFrameBytes[i-2] == 0 &&
-                    (syncedFrameBytes[i-1] != 0 || byte != 0)) {
-                  bool bigEndian = (encoding == kCFStringEncodingUTF16BE);
-                  UInt8 prevByte = syncedFrameBytes[i-1];
-                  syncedFrameBytes[bigEndian ? (i-2) : (i-3)] = ' ';
-                  syncedFrameBytes[i-1] = bigEndian ? 0 : '&';
-                  syncedFrameBytes[i] = bigEndian ? '&' : 0;
-                  i++;
-                  syncedFrameBytes[i] = bigEndian ? 0 : ' ';
-                  i++;
-                  syncedFrameBytes[i] = bigEndian ? ' ' : 0;
-                  i++;
-                  syncedFrameBytes[i] = prevByte;
-                  i++;
-                } else if ((encoding == kCFStringEncodingUTF8 || encoding == kCFStringEncodingISOLatin1) &&
-                           syncedFrameBytes[i-1] == 0 && byte != 0) {
-                  syncedFrameBytes[i-1] = ' ';
-                  syncedFrameBytes[i] = '&';
-                  i++;
-                  syncedFrameBytes[i] = ' ';
-                  i++;
-                }
-              }
-              syncedFrameBytes[i++] = byte;
-            }
-            last = byte;
-          }
-        } else {
-          for (int pos2 = pos, i = 0; pos2 < (frameSize+pos); pos2++, i++) {
-            UInt8 byte = syncedBytes[pos2];
-            if (i == 0) {
-              if (byte == 3) {
-                encoding = kCFStringEncodingUTF8;
-              } else if (byte == 2) {
-                encoding = kCFStringEncodingUTF16BE;
-              } else if (byte == 1) {
-                encoding = kCFStringEncodingUTF16;
-              } else {
-                // Default encoding
-                encoding = kCFStringEncodingISOLatin1;
-              }
-            }
-            if ((pos2-1) > pos) {
-              // I hate UTF-16
-              if ((encoding == kCFStringEncodingUTF16 || encoding == kCFStringEncodingUTF16BE) &&
-                  i >= 4 && (i % 2) == 0 && syncedFrameBytes[i-3] == 0 && syncedFrameBytes[i-2] == 0 &&
-                  (syncedFrameBytes[i-1] != 0 || byte != 0)) {
-                bool bigEndian = (encoding == kCFStringEncodingUTF16BE);
-                UInt8 prevByte = syncedFrameBytes[i-1];
-                syncedFrameBytes[bigEndian ? (i-2) : (i-3)] = ' ';
-                syncedFrameBytes[i-1] = bigEndian ? 0 : '&';
-                syncedFrameBytes[i] = bigEndian ? '&' : 0;
-                i++;
-                syncedFrameBytes[i] = bigEndian ? 0 : ' ';
-                i++;
-                syncedFrameBytes[i] = bigEndian ? ' ' : 0;
-                i++;
-                syncedFrameBytes[i] = prevByte;
-                i++;
-              } else if ((encoding == kCFStringEncodingUTF8 || encoding == kCFStringEncodingISOLatin1) &&
-                         syncedFrameBytes[i-1] == 0 && byte != 0) {
-                syncedFrameBytes[i-1] = ' ';
-                syncedFrameBytes[i] = '&';
-                i++;
-                syncedFrameBytes[i] = ' ';
-                i++;
-              }
-            }
-            syncedFrameBytes[i] = byte;
-          }
-        }
+  [self setCurrentSong:value];
+}
 
-        size_t tagLen = (id3Version <= 2) ? 3 : 4;
-        if (!strncmp((char*)syncedBytes+startPos, id3Version <= 2 ? "TT2" : "TIT2", tagLen)) {
-          id3Title = @([(__bridge_transfer NSString *)CFStringCreateWithBytes(kCFAllocatorDefault,
-                                                                              &syncedFrameBytes[1],
-                                                                              frameSize - 1, encoding,
-                                                                              encoding == kCFStringEncodingUTF16)
-                        UTF8String]);
-        } else if (!strncmp((char*)syncedBytes+startPos, id3Version <= 2 ? "TP1" : "TPE1", tagLen)) {
-          id3Artist = @([(__bridge_transfer NSString *)CFStringCreateWithBytes(kCFAllocatorDefault,
-                                                                               &syncedFrameBytes[1],
-                                                                               frameSize - 1, encoding,
-                                                                               encoding == kCFStringEncodingUTF16)
-                         UTF8String]);
-        }
+/**
+ * @brief Feeds the next bytes of the stream to the ID3 parser
+ *
+ * The tag may be spread over any number of reads, the parser keeps its place
+ * in between. Once the whole tag has been read the title and artist become
+ * the current song.
+ */
+- (void)parseID3TagsInBytes:(const UInt8 *)bytes length:(CFIndex)length {
+  id3_status_t status = ASID3ParserFeed(id3Parser, bytes, (size_t)length, NULL);
+  if (status == ID3_STATUS_NEED_MORE) return;
+  id3Finished = true;
+  if (status != ID3_STATUS_DONE) return;
+
+  LOG_INFO(@"ID3 tag of %llu bytes parsed", ASID3ParserTagSize(id3Parser));
+
+  NSString *currSong = nil;
+  if (id3Title && id3Artist) {
+    currSong = [NSString stringWithFormat:@"%@ - %@", id3Artist, id3Title];
+  } else if (id3Title) {
+    currSong = [NSString stringWithFormat:@"Unknown Artist - %@", id3Title];
+  } else if (id3Artist) {
+    currSong = [NSString stringWithFormat:@"%@ - Unknown Title", id3Artist];
+  }
+  id3Title = nil;
+  id3Artist = nil;
 
-        pos += frameSize;
-      }
+  [self setCurrentSong:currSong];
+  LOG_INFO(@"ID3 Current Song: %@", currSong);
+}
 
-      NSString *currSong = nil;
-      if (id3Title && id3Artist) {
-        currSong = [NSString stringWithFormat:@"%@ - %@", id3Artist, id3Title];
-      } else if (id3Title) {
-        currSong = [NSString stringWithFormat:@"Unknown Artist - %@", id3Title];
-      } else if (id3Artist) {
-        currSong = [NSString stringWithFormat:@"%@ - Unknown Title", id3Artist];
-      }
+/**
+ * @brief Decodes the text of an ID3 text information frame
+ *
+ * Frames may hold several values (v2.4), which are joined with " & ".
+ */
+- (NSString *)textOfID3Frame:(const id3_frame_t *)frame {
+  NSArray *values = [self valuesOfID3Frame:frame];
+  if ([values count] == 0) return nil;
+  return [values componentsJoinedByString:@" & "];
+}
 
-      [self setCurrentSong:currSong];
-      LOG_INFO(@"ID3 Current Song: %@", currSong);
+/**
+ * @brief Decodes the NUL-separated values of an ID3 text frame
+ *
+ * The first byte of the frame selects the encoding. Empty values are left
+ * out.
+ */
+- (NSArray *)valuesOfID3Frame:(const id3_frame_t *)frame {
+  if (frame->length < 2) return nil;
+
+  CFStringEncoding encoding;
+  switch (frame->data[0]) {
+    case 3:  encoding = kCFStringEncodingUTF8;    break;
+    case 2:  encoding = kCFStringEncodingUTF16BE; break;
+    case 1:  encoding = kCFStringEncodingUTF16;   break;
+    default: encoding = kCFStringEncodingISOLatin1;
+  }
+  NSString *text = (__bridge_transfer NSString *)
+      CFStringCreateWithBytes(kCFAllocatorDefault, frame->data + 1,
+                              (CFIndex)frame->length - 1, encoding,
+                              encoding == kCFStringEncodingUTF16);
+  if (text == nil) return nil;
+
+  /* Every UTF-16 value carries its own byte order mark */
+  text = [text stringByReplacingOccurrencesOfString:@"\uFEFF" withString:@""];
+  NSMutableArray *values = [NSMutableArray array];
+  for (NSString *value in [text componentsSeparatedByCharactersInSet:
+                          [NSCharacterSet characterSetWithRange:NSMakeRange(0, 1)]]) {
+    if ([value length] > 0) [values addObject:value];
+  }
+  return values;
+}
 
-      id3ParserState = ID3_STATE_PARSED;
-      break;
-    } else {
-      break;
+/**
+ * @brief Handles an ID3 frame buffered by the parser
+ *
+ * Only the title, artist and comment frames are asked for (see
+ * ASID3FrameFilter).
+ */
+- (void)handleID3Frame:(const id3_frame_t *)frame {
+  if (strcmp(frame->id, "COMM") == 0 || strcmp(frame->id, "COM") == 0) {
+    [self handleID3Comment:frame];
+    return;
+  }
+  if (strcmp(frame->id, "TXXX") == 0 || strcmp(frame->id, "TXX") == 0) {
+    /* A description and a value. Only ReplayGain's are of interest */
+    NSArray *values = [self valuesOfID3Frame:frame];
+    double gain;
+    if ([values count] >= 2 &&
+        [values[0] caseInsensitiveCompare:@"REPLAYGAIN_TRACK_GAIN"] == NSOrderedSame &&
+        ASLoudnessParseReplayGain([values[1] UTF8String], &gain)) {
+      [self setTaggedLoudness:kReplayGainReference - gain];
     }
+    return;
+  }
+  NSString *text = [self textOfID3Frame:frame];
+  if (text == nil) return;
+  if (strcmp(frame->id, "TIT2") == 0 || strcmp(frame->id, "TT2") == 0) {
+    id3Title = text;
+  } else {
+    id3Artist = text;
   }
 }
 
+/**
+ * @brief Looks for iTunes' gapless info in an ID3 comment frame
+ *
+ * A comment is an encoding byte, a language, a description and the text.
+ * iTunes gives its encoder delay and padding in one described as "iTunSMPB".
+ */
+- (void)handleID3Comment:(const id3_frame_t *)frame {
+  if (frame->length < 5) return;
+  /* Without the language it reads as a text frame of two values */
+  NSMutableData *data = [NSMutableData dataWithBytes:frame->data length:1];
+  [data appendBytes:frame->data + 4 length:frame->length - 4];
+  id3_frame_t text = *frame;
+  text.data = [data bytes];
+  text.length = [data length];
+
+  NSArray *values = [self valuesOfID3Frame:&text];
+  if ([values count] < 2 || ![values[0] isEqualToString:@"iTunSMPB"]) return;
+  gapless_info_t info;
+  if (!ASGaplessParseITunSMPB([values[1] UTF8String], &info)) return;
+  primingFrames = info.priming;
+  validFrames = info.validFrames;
+  LOG_INFO(@"iTunSMPB: %llu priming frames, %llu valid", primingFrames, validFrames);
+}
+
 //
 // enqueueBuffer
 //
@@ -1843,58 +3376,258 @@ - (int)enqueueBuffer {
   buffersUsed++;
 
   // enqueue buffer
-  AudioQueueBufferRef fillBuf = buffers[fillBufferIndex]->ref;
-  fillBuf->mAudioDataByteSize = bytesFilled;
+  buffer_t *fillBuf = buffers[fillBufferIndex];
+  fillBuf->ref->mAudioDataByteSize = bytesFilled;
+  fillBuf->packetCount = packetsFilled;
+  fillBuf->packetStart -= (packetsFilled - 1);
 
-  OSStatus osErr;
-  if (vbr) {
-    osErr = AudioQueueEnqueueBuffer(audioQueue, fillBuf, packetsFilled,
-                                    buffers[fillBufferIndex]->packetDescs);
-  } else {
-    osErr = AudioQueueEnqueueBuffer(audioQueue, fillBuf, 0, NULL);
-  }
+  OSStatus osErr = [self enqueueQueueBuffer:fillBuf];
   CHECK_ERR(osErr, AS_AUDIO_QUEUE_ENQUEUE_FAILED, [[self class] descriptionForAQErrorCode:osErr], -1);
-
-  buffers[fillBufferIndex]->packetCount = packetsFilled;
-  buffers[fillBufferIndex]->packetStart -= (packetsFilled - 1);
   LOG_DEBUG(@"committed buffer %d", fillBufferIndex);
 
-  if (state_ == AS_WAITING_FOR_DATA) {
+  if (state_ == AS_WAITING_FOR_DATA && !preloading) {
     /* Once we have a small amount of queued data, then we can go ahead and
      * start the audio queue and the file stream should remain ahead of it */
-    if ((_bufferCount < _bufferFillCountToStart && buffersUsed >= _bufferCount) || buffersUsed >= _bufferFillCountToStart) {
+    if ([self hasBufferedEnoughToStart]) {
       _error = nil; // We have successfully reconnected. Clear the error.
       if (![self startAudioQueue]) return -1;
     }
   }
+  if (renderingOffline && ![self renderOffline]) return -1;
+
+  /* move on to the next buffer and wait for it to be in use */
+  if (++fillBufferIndex >= activeBuffers) fillBufferIndex = 0;
+  bytesFilled   = 0;    // reset bytes filled
+  packetsFilled = 0;    // reset packets filled
+
+  /* The ring can only shrink back while the next buffer is at its start */
+  if (fillBufferIndex == 0 || (streamBitrate == 0 && bitrateNotification)) {
+    if (![self updateBufferTargets]) return -1;
+  }
+
+  /* If we have no more queued data, and the stream has reached its end, then
+     we're not going to be enqueueing any more buffers to the audio stream. In
+     this case flush it out and asynchronously stop it */
+  if (![self hasQueuedPackets] && [self readStreamAtEnd]) {
+    osErr = AudioQueueFlush(audioQueue);
+    CHECK_ERR(osErr, AS_AUDIO_QUEUE_FLUSH_FAILED, [[self class] descriptionForAQErrorCode:osErr], -1);
+    queueFlushed = true;
+    if (renderingOffline && ![self renderOffline]) return -1;
+  }
+
+  if (buffers[fillBufferIndex]->inuse) {
+    LOG_DEBUG(@"waiting for buffer %d", fillBufferIndex);
+    waitingOnBuffer = true;
+    /* Packets read from here on wait in queuedPackets */
+    [self checkBufferLevels];
+    return 0;
+  }
+  return 1;
+}
+
+/**
+ * @brief Seconds of audio in the buffers in use and in queuedPackets, or
+ *        recorded and not yet played
+ *
+ * @param seconds Filled in with the buffered duration
+ * @return NO if the bitrate isn't known yet
+ */
+- (BOOL)bufferedSeconds:(double *)seconds {
+  if (streamBitrate <= 0) return NO;
+  UInt64 bytes = bytesInQueue + ASPacketRingByteCount(queuedPackets);
+  if (timeShift != NULL) bytes += ASTimeShiftBytesFrom(timeShift, timeShiftNext);
+  *seconds = bytes * 8.0 / streamBitrate;
+  return YES;
+}
+
+/**
+ * @brief Whether the read stream should keep going while every buffer is full
+ *
+ * Packets read meanwhile are set aside in queuedPackets, up to the high
+ * watermark. A live stream being recorded is always read, so that the
+ * recording keeps up whatever playback is doing.
+ */
+- (BOOL)shouldReadAhead {
+  if (timeShift != NULL) return YES;
+  if (queuedPackets != NULL &&
+      ASPacketRingByteCount(queuedPackets) >= readAheadLimit) {
+    return NO;
+  }
+  if (_bufferInfinite) return YES;
+  double buffered;
+  return [self bufferedSeconds:&buffered] && buffered < highWatermark;
+}
+
+/**
+ * @brief Holds back the read stream once enough is buffered, and resumes
+ *        playback which ran out of data once there's enough to go on with
+ */
+- (void)checkBufferLevels {
+  if (stream != NULL && waitingOnBuffer && !(unscheduled && !rescheduled) &&
+      ![self shouldReadAhead]) {
+    ASTransportSetPaused(stream, true);
+    /* Make sure we don't have ourselves marked as rescheduled */
+    unscheduled = true;
+    rescheduled = false;
+    ASBufferControllerIdle(bufferController);
+  }
+
+  if (state_ == AS_WAITING_FOR_DATA && queuePaused && !preloading &&
+      !seeking && [self hasBufferedEnoughToStart]) {
+    _error = nil;
+    [self startAudioQueue];
+  }
+}
+
+/**
+ * @brief Refreshes the watermarks, and resizes the ring of buffers to match
+ *
+ * @return NO if allocating a buffer failed
+ */
+- (BOOL)updateBufferTargets {
+  double rate;
+  if (![self calculatedBitRate:&rate] || rate <= 0) return YES;
+  streamBitrate = rate;
+  ASBufferControllerSetBitrate(bufferController, rate);
+  buffer_watermarks_t marks;
+  ASBufferControllerGetWatermarks(bufferController, &marks);
+  lowWatermark = marks.low;
+  highWatermark = marks.high;
+
+  /* Audio read ahead waits in queuedPackets, so the audio queue only needs
+     enough buffers to play through the low watermark */
+  double bufferBytes = rate / 8.0 * lowWatermark;
+  UInt32 target = (UInt32)MIN(ceil(bufferBytes / packetBufferSize), maxBuffers);
+  target = MAX(target, MIN(_bufferFillCountToStart, maxBuffers));
+  return [self resizeBuffers:target];
+}
+
+/**
+ * @brief Works out how many buffers there can be, how many packets each one
+ *        holds, and how much audio can be read ahead of them
+ *
+ * See ASMemoryBudget.h. Must be called once packetBufferSize is known.
+ */
+- (void)fitMemoryBudget {
+  memory_budget_t budget = {
+    .budget = _memoryBudget,
+    .bufferCount = _bufferCount,
+    .bufferSize = packetBufferSize,
+    .vbr = vbr,
+    .typicalPacketSize = typicalPacketSize,
+    .bytesPerPacket = _streamDescription.mBytesPerPacket,
+    .maxDescs = kAQMaxPacketDescs,
+    .descSize = sizeof(AudioStreamPacketDescription),
+    .bufferOverhead = sizeof(buffer_t),
+  };
+  buffer_layout_t layout;
+  ASMemoryBudgetFit(&budget, &layout);
+  maxBuffers = layout.bufferCount;
+  packetBufferSize = layout.bufferSize;
+  descsPerBuffer = layout.descsPerBuffer;
+  readAheadLimit = layout.readAheadLimit;
+  if (_memoryBudget == 0) return;
+  LOG_INFO(@"memory budget: %u buffers of %u bytes, %zu bytes read ahead",
+           (unsigned int)maxBuffers, (unsigned int)packetBufferSize, readAheadLimit);
+}
+
+/**
+ * @brief Grows or shrinks the ring of buffers in place
+ *
+ * New buffers go on the end of the ring, after the buffers filled longest ago,
+ * so they're filled in turn. Buffers only come off the end when none of them
+ * are in use and the next buffer to fill isn't among them, otherwise the ring
+ * is left as it is until the next try.
+ *
+ * @param count How many buffers the ring should have, at most maxBuffers
+ * @return NO if allocating a buffer failed
+ */
+- (BOOL)resizeBuffers:(UInt32)count {
+  assert(count > 0 && count <= maxBuffers);
+  for (; activeBuffers < count; activeBuffers++) {
+    buffer_t *buf = calloc(1, sizeof(buffer_t));
+    CHECK_ERR(buf == NULL, AS_AUDIO_QUEUE_BUFFER_ALLOCATION_FAILED, @"", NO);
+    /* Buffers stay in their slots, so each keeps the slot's descriptions */
+    buf->packetDescs = packetDescPool + (size_t)activeBuffers * descsPerBuffer;
+    OSStatus osErr = AudioQueueAllocateBuffer(audioQueue, packetBufferSize,
+                                              &buf->ref);
+    if (osErr) free(buf);
+    CHECK_ERR(osErr, AS_AUDIO_QUEUE_BUFFER_ALLOCATION_FAILED, [[self class] descriptionForAQErrorCode:osErr], NO);
+    buffers[activeBuffers] = buf;
+  }
+
+  if (activeBuffers <= count || fillBufferIndex >= count) return YES;
+  for (UInt32 i = count; i < activeBuffers; i++) {
+    if (buffers[i]->inuse) return YES;
+  }
+  for (UInt32 i = count; i < activeBuffers; i++) {
+    AudioQueueFreeBuffer(audioQueue, buffers[i]->ref);
+    free(buffers[i]);
+    buffers[i] = NULL;
+  }
+  LOG_DEBUG(@"shrunk from %u to %u buffers", (unsigned int)activeBuffers,
+            (unsigned int)count);
+  activeBuffers = count;
+  return YES;
+}
+
+/**
+ * @brief Gives a filled buffer to the audio queue
+ *
+ * Frames of a VBR buffer which fall before or after the real audio (see
+ * ASGapless.h) are trimmed off, as long as its packet numbers are exact.
+ *
+ * @param buf The buffer, with its size, packet count and first packet set
+ * @return The queue's error, if any
+ */
+- (OSStatus)enqueueQueueBuffer:(buffer_t *)buf {
+  if (!vbr) {
+    buf->frames = 0;
+    if (_streamDescription.mBytesPerPacket > 0) {
+      lastBufferFrames = buf->ref->mAudioDataByteSize /
+                         _streamDescription.mBytesPerPacket *
+                         _streamDescription.mFramesPerPacket;
+      framesEnqueued += lastBufferFrames;
+      buf->frames = (UInt32)lastBufferFrames;
+    }
+    bytesInQueue += buf->ref->mAudioDataByteSize;
+    framesInQueue += buf->frames;
+    return AudioQueueEnqueueBuffer(audioQueue, buf->ref, 0, NULL);
+  }
 
-  /* move on to the next buffer and wait for it to be in use */
-  if (++fillBufferIndex >= _bufferCount) fillBufferIndex = 0;
-  bytesFilled   = 0;    // reset bytes filled
-  packetsFilled = 0;    // reset packets filled
-
-  /* If we have no more queued data, and the stream has reached its end, then
-     we're not going to be enqueueing any more buffers to the audio stream. In
-     this case flush it out and asynchronously stop it */
-  if (queued_vbr_head == NULL && queued_cbr_head == NULL &&
-      CFReadStreamGetStatus(stream) == kCFStreamStatusAtEnd) {
-    osErr = AudioQueueFlush(audioQueue);
-    CHECK_ERR(osErr, AS_AUDIO_QUEUE_FLUSH_FAILED, [[self class] descriptionForAQErrorCode:osErr], -1);
+  UInt64 frames = [self framesInPackets:buf->packetDescs count:buf->packetCount];
+  UInt32 trimStart = 0, trimEnd = 0;
+  if (trimmingFrames) {
+    gapless_info_t info = {primingFrames, validFrames};
+    ASGaplessTrim(&info, (UInt64)buf->packetStart * _streamDescription.mFramesPerPacket,
+                  frames, &trimStart, &trimEnd);
+  }
+  OSStatus osErr = AudioQueueEnqueueBufferWithParameters(audioQueue, buf->ref,
+                                                         buf->packetCount,
+                                                         buf->packetDescs,
+                                                         trimStart, trimEnd,
+                                                         0, NULL, NULL, NULL);
+  if (!osErr) {
+    lastBufferFrames = frames - trimStart - trimEnd;
+    framesEnqueued += lastBufferFrames;
+    bytesInQueue += buf->ref->mAudioDataByteSize;
+    buf->frames = (UInt32)lastBufferFrames;
+    framesInQueue += buf->frames;
   }
+  return osErr;
+}
 
-  if (buffers[fillBufferIndex]->inuse) {
-    LOG_DEBUG(@"waiting for buffer %d", fillBufferIndex);
-    if (!_bufferInfinite) {
-      CFReadStreamUnscheduleFromRunLoop(stream, CFRunLoopGetCurrent(),
-                                        kCFRunLoopCommonModes);
-      /* Make sure we don't have ourselves marked as rescheduled */
-      unscheduled = true;
-      rescheduled = false;
-    }
-    waitingOnBuffer = true;
-    return 0;
+/**
+ * @brief Audio frames in a run of VBR packets
+ */
+- (UInt64)framesInPackets:(const AudioStreamPacketDescription *)descs
+                    count:(UInt32)count {
+  UInt64 frames = 0;
+  for (UInt32 i = 0; i < count; i++) {
+    UInt32 packetFrames = descs[i].mVariableFramesInPacket;
+    frames += packetFrames ? packetFrames : _streamDescription.mFramesPerPacket;
   }
-  return 1;
+  return frames;
 }
 
 //
@@ -1910,9 +3643,26 @@ - (int)enqueueBuffer {
 - (void)createQueue {
   assert(audioQueue == NULL);
 
+  /* The queue's callbacks come on its own threads and are handed over to this
+     one through these */
+  if (queueContext == NULL) {
+    queueContext = calloc(1, sizeof(queue_context_t));
+    CHECK_ERR(queueContext == NULL, AS_AUDIO_QUEUE_CREATION_FAILED, @"");
+    queueContext->playedBuffers = ASSPSCQueueCreate(_bufferCount);
+    CHECK_ERR(queueContext->playedBuffers == NULL, AS_AUDIO_QUEUE_CREATION_FAILED, @"");
+    CFRunLoopSourceContext context = {
+      .info = (__bridge void*) streamerRef,
+      .perform = ASQueueEventsPerform
+    };
+    queueContext->queueEvents = CFRunLoopSourceCreate(NULL, 0, &context);
+    CHECK_ERR(queueContext->queueEvents == NULL, AS_AUDIO_QUEUE_CREATION_FAILED, @"");
+    CFRunLoopAddSource(CFRunLoopGetCurrent(), queueContext->queueEvents,
+                       kCFRunLoopCommonModes);
+  }
+
   // create the audio queue
   OSStatus osErr = AudioQueueNewOutput(&_streamDescription, ASAudioQueueOutputCallback,
-                                       (__bridge void*) self, CFRunLoopGetMain(), NULL,
+                                       queueContext, NULL, NULL,
                                        0, &audioQueue);
   CHECK_ERR(osErr, AS_AUDIO_QUEUE_CREATION_FAILED, [[self class] descriptionForAQErrorCode:osErr]);
 
@@ -1920,10 +3670,25 @@ - (void)createQueue {
   // listen to the "isRunning" property
   osErr = AudioQueueAddPropertyListener(audioQueue, kAudioQueueProperty_IsRunning,
                                         ASAudioQueueIsRunningCallback,
-                                        (__bridge void*) self);
+                                        queueContext);
   CHECK_ERR(osErr, AS_AUDIO_QUEUE_ADD_LISTENER_FAILED, [[self class] descriptionForAQErrorCode:osErr]);
 
-  if (vbr) {
+  renderingOffline = _pcmHandler != nil || _pcmOutputPath != nil ||
+                     _outputSink != NULL;
+  if (renderingOffline) {
+    [self setUpOfflineRendering];
+    if ([self isDone]) return;
+  }
+
+  if (_equalPowerFades || _loudnessNormalization) {
+    [self createProcessingTap];
+    if ([self isDone]) return;
+  }
+
+  if (vbr && packetSizeUpperBound > 0) {
+    /* The built-in parsers know the largest packet there can be */
+    packetBufferSize = packetSizeUpperBound;
+  } else if (vbr) {
     /* Try to determine the packet size, eventually falling back to some
        reasonable default of a size */
     UInt32 sizeOfUInt32 = sizeof(UInt32);
@@ -1938,28 +3703,31 @@ - (void)createQueue {
       if (osErr || packetBufferSize == 0) {
         // No packet size available, just use the default
         packetBufferSize = _bufferSize;
-        defaultBufferSizeUsed = true;
       }
     }
   } else {
     packetBufferSize = _bufferSize;
-    defaultBufferSizeUsed = true;
   }
 
-  // allocate audio queue buffers
-  buffers = malloc(_bufferCount * sizeof(buffer_t*));
-  CHECK_ERR(buffers == NULL, AS_AUDIO_QUEUE_BUFFER_ALLOCATION_FAILED, @"");
-  for (UInt32 i = 0; i < _bufferCount; ++i) {
-    buffers[i] = malloc(sizeof(buffer_t));
-    CHECK_ERR(buffers[i] == NULL, AS_AUDIO_QUEUE_BUFFER_ALLOCATION_FAILED, @"");
-    buffers[i]->inuse = false;
-    buffers[i]->packetStart = 0;
-    buffers[i]->packetCount = 0;
+  [self fitMemoryBudget];
 
-    osErr = AudioQueueAllocateBuffer(audioQueue, packetBufferSize,
-                                     &(buffers[i]->ref));
-    CHECK_ERR(osErr, AS_AUDIO_QUEUE_BUFFER_ALLOCATION_FAILED, [[self class] descriptionForAQErrorCode:osErr]);
+  /* Allocate audio queue buffers. Every one of them is used until the
+     bitrate is known, after which the ring is sized to the watermarks */
+  buffers = calloc(maxBuffers, sizeof(buffer_t*));
+  CHECK_ERR(buffers == NULL, AS_AUDIO_QUEUE_BUFFER_ALLOCATION_FAILED, @"");
+  if (descsPerBuffer > 0) {
+    packetDescPool = calloc((size_t)maxBuffers * descsPerBuffer,
+                            sizeof(AudioStreamPacketDescription));
+    CHECK_ERR(packetDescPool == NULL, AS_AUDIO_QUEUE_BUFFER_ALLOCATION_FAILED, @"");
   }
+  activeBuffers = 0;
+  streamBitrate = 0;
+  if (![self resizeBuffers:maxBuffers]) return;
+
+  /* Overflow storage for packets which arrive while every buffer is in use.
+     It starts out with room for a few buffers' worth and grows as needed */
+  queuedPackets = ASPacketRingCreate(4 * packetBufferSize, 0);
+  CHECK_ERR(queuedPackets == NULL, AS_AUDIO_QUEUE_BUFFER_ALLOCATION_FAILED, @"");
 
   /* Playback rate */
 
@@ -1969,10 +3737,12 @@ - (void)createQueue {
   propVal = kAudioQueueTimePitchAlgorithm_Spectral;
   AudioQueueSetProperty(audioQueue, kAudioQueueProperty_TimePitchAlgorithm, &propVal, sizeof(propVal));
 
-  propVal = (_playbackRate == 1.0f || fileLength == 0) ? 1 : 0;
+  /* Offline, frames are counted as they were given to the queue */
+  bool changeRate = _playbackRate != 1.0f && fileLength > 0 && !renderingOffline;
+  propVal = changeRate ? 0 : 1;
   AudioQueueSetProperty(audioQueue, kAudioQueueProperty_TimePitchBypass, &propVal, sizeof(propVal));
 
-  if (_playbackRate != 1.0f && fileLength > 0) {
+  if (changeRate) {
     AudioQueueSetParameter(audioQueue, kAudioQueueParam_PlayRate, _playbackRate);
   }
 
@@ -1980,6 +3750,13 @@ - (void)createQueue {
      the file stream to the audio queue. If any of this fails it's "OK" because
      the stream either doesn't have a magic or error will propagate later */
 
+  if (magicCookie) {
+    /* Built by one of the built-in parsers */
+    AudioQueueSetProperty(audioQueue, kAudioQueueProperty_MagicCookie,
+                          [magicCookie bytes], (UInt32)[magicCookie length]);
+    return;
+  }
+
   // get the cookie size
   UInt32 cookieSize;
   Boolean writable;
@@ -2009,6 +3786,222 @@ - (void)createQueue {
   free(cookieData);
 }
 
+/**
+ * @brief Has the audio queue render into memory instead of playing
+ *
+ * The audio comes out as interleaved floats in the renderBuffer, as
+ * renderOffline asks for it.
+ */
+- (void)setUpOfflineRendering {
+  UInt32 channels = _streamDescription.mChannelsPerFrame;
+  if (channels == 0) channels = 2;
+  renderFormat = (AudioStreamBasicDescription) {
+    .mSampleRate = _streamDescription.mSampleRate,
+    .mFormatID = kAudioFormatLinearPCM,
+    .mFormatFlags = kAudioFormatFlagsNativeFloatPacked,
+    .mBytesPerPacket = channels * sizeof(float),
+    .mFramesPerPacket = 1,
+    .mBytesPerFrame = channels * sizeof(float),
+    .mChannelsPerFrame = channels,
+    .mBitsPerChannel = 32
+  };
+  OSStatus osErr = AudioQueueSetOfflineRenderFormat(audioQueue, &renderFormat, NULL);
+  CHECK_ERR(osErr, AS_OFFLINE_RENDER_FAILED, [[self class] descriptionForAQErrorCode:osErr]);
+  osErr = AudioQueueAllocateBuffer(audioQueue, kOfflineRenderFrames * renderFormat.mBytesPerFrame,
+                                   &renderBuffer);
+  CHECK_ERR(osErr, AS_AUDIO_QUEUE_BUFFER_ALLOCATION_FAILED, [[self class] descriptionForAQErrorCode:osErr]);
+
+  /* Everything rendered goes out through one sink, which the outputSink
+     becomes part of */
+  output_sink_t *sink = _outputSink;
+  _outputSink = NULL;
+  if (_pcmOutputPath != nil) {
+    sink = ASJoinSinks(sink, ASOutputSinkCreateWAV([_pcmOutputPath fileSystemRepresentation]));
+    CHECK_ERR(sink == NULL, AS_OFFLINE_RENDER_FAILED, @"");
+  }
+  if (_pcmHandler != nil) {
+    sink = ASJoinSinks(sink, ASOutputSinkCreateCallback(ASRenderedProc,
+                                                        (__bridge void*) self));
+    CHECK_ERR(sink == NULL, AS_OFFLINE_RENDER_FAILED, @"");
+  }
+  renderSink = sink;
+  CHECK_ERR(!ASOutputSinkStart(renderSink, (uint32_t)renderFormat.mSampleRate,
+                               (uint16_t)channels),
+            AS_OFFLINE_RENDER_FAILED, @"The PCM output file couldn't be created");
+  offlinePrimed = false;
+  queueFlushed = false;
+  framesRendered = 0;
+}
+
+/**
+ * @brief Renders as much as the audio queue can, for the pcmHandler and
+ *        pcmOutputPath
+ *
+ * Only frames given to the queue are rendered, as it would make up silence
+ * for any more. Until it has been flushed the last buffer is held back too
+ * (unless it's the only one), since the decoder may need the packets after
+ * it to finish its frames.
+ *
+ * @return NO if rendering or writing failed
+ */
+- (BOOL)renderOffline {
+  if (!offlinePrimed || queuePaused || seeking) return YES;
+  UInt64 available = framesEnqueued;
+  if (!queueFlushed && activeBuffers > 1) {
+    available -= MIN(available, lastBufferFrames);
+  }
+
+  while (framesRendered < available) {
+    UInt32 frames = (UInt32)MIN(available - framesRendered, kOfflineRenderFrames);
+    AudioTimeStamp time;
+    memset(&time, 0, sizeof(time));
+    time.mSampleTime = framesRendered;
+    time.mFlags = kAudioTimeStampSampleTimeValid;
+    OSStatus osErr = AudioQueueOfflineRender(audioQueue, &time, renderBuffer, frames);
+    CHECK_ERR(osErr, AS_OFFLINE_RENDER_FAILED, [[self class] descriptionForAQErrorCode:osErr], NO);
+    framesRendered += frames;
+
+    UInt32 rendered = renderBuffer->mAudioDataByteSize / renderFormat.mBytesPerFrame;
+    if (rendered == 0) continue;
+    const float *samples = renderBuffer->mAudioData;
+    CHECK_ERR(!ASOutputSinkWrite(renderSink, samples, rendered), AS_OFFLINE_RENDER_FAILED,
+              @"Writing the PCM output failed", NO);
+  }
+  return YES;
+}
+
+/**
+ * @brief Hands rendered audio to the pcmHandler
+ */
+- (void)handleRenderedSamples:(const float *)samples frames:(size_t)frames {
+  _pcmHandler(self, samples, (UInt32)frames, renderFormat);
+}
+
+/**
+ * @brief Puts a processing tap on the audio queue for equal-power fades and
+ *        loudness normalization
+ *
+ * The tap sees the decoded audio after any effects. It only works on
+ * non-interleaved float samples; in any other format the tap is removed
+ * again and neither fades nor normalization are available.
+ */
+- (void)createProcessingTap {
+  /* The queue context owns them, as the tap uses them until it's disposed of */
+  ASCrossfadeDestroy(queueContext->crossfade);
+  crossfade = queueContext->crossfade = ASCrossfadeCreate();
+  CHECK_ERR(crossfade == NULL, AS_AUDIO_QUEUE_CREATION_FAILED, @"");
+  ASNormalizerDestroy(queueContext->normalizer);
+  normalizer = queueContext->normalizer = NULL;
+
+  UInt32 maxFrames;
+  AudioStreamBasicDescription tapFormat;
+  OSStatus osErr = AudioQueueProcessingTapNew(audioQueue, ASProcessingTapProc,
+                                              queueContext,
+                                              kAudioQueueProcessingTap_PostEffects,
+                                              &maxFrames, &tapFormat, &processingTap);
+  if (osErr) {
+    LOG_WARN(@"No processing tap for fades: %@", [[self class] descriptionForAQErrorCode:osErr]);
+    processingTap = NULL;
+    return;
+  }
+  if (!(tapFormat.mFormatFlags & kAudioFormatFlagIsFloat) ||
+      !(tapFormat.mFormatFlags & kAudioFormatFlagIsNonInterleaved) ||
+      tapFormat.mBitsPerChannel != 32 || tapFormat.mChannelsPerFrame > kMaxTapChannels) {
+    LOG_WARN(@"Processing tap format can't be faded");
+    AudioQueueProcessingTapDispose(processingTap);
+    processingTap = NULL;
+    return;
+  }
+
+  if (_loudnessNormalization) {
+    normalizer = queueContext->normalizer =
+      ASNormalizerCreate(tapFormat.mSampleRate, tapFormat.mChannelsPerFrame,
+                         _loudnessTarget);
+    if (normalizer == NULL) {
+      LOG_WARN(@"Loudness can't be normalized");
+    } else if (!isnan(taggedLoudness)) {
+      ASNormalizerSetLoudness(normalizer, taggedLoudness);
+    }
+  }
+}
+
+/**
+ * @brief Fills in what the start policy decides on, as things stand
+ */
+- (void)getStartPolicy:(start_policy_t *)policy state:(start_state_t *)state {
+  policy->fillCountToStart = _bufferFillCountToStart;
+  policy->duration = _bufferDurationToStart / 1000.0;
+  policy->adaptive = _adaptiveStart;
+
+  state->buffersUsed = buffersUsed;
+  state->buffersActive = activeBuffers;
+  double sampleRate = _streamDescription.mSampleRate;
+  state->queued = sampleRate > 0 ? framesInQueue / sampleRate : -1;
+  state->stalled = queuePaused;
+  if (![self bufferedSeconds:&state->buffered]) state->buffered = -1;
+  state->lowWatermark = lowWatermark;
+  state->bitrate = streamBitrate;
+  state->throughput = 0;
+  state->deviation = 0;
+  state->remaining = -1;
+  /* Only an adaptive start needs the download rate and the duration */
+  double duration;
+  if (_adaptiveStart && [self duration:&duration]) {
+    state->throughput = ASBufferControllerThroughput(bufferController, &state->deviation);
+    state->remaining = MAX(duration - seekTime, 0);
+  }
+}
+
+/**
+ * @brief Whether enough buffers are full for playback to start
+ */
+- (BOOL)hasBufferedEnoughToStart {
+  start_policy_t policy;
+  start_state_t state;
+  [self getStartPolicy:&policy state:&state];
+  return ASStartPolicyReady(&policy, &state);
+}
+
+/**
+ * @brief Hands a partly filled buffer to the audio queue if that's enough to
+ *        reach the <bufferDurationToStart>
+ *
+ * @return NO if enqueueing the buffer failed the stream
+ */
+- (BOOL)checkStartTarget {
+  if (_bufferDurationToStart == 0 || state_ != AS_WAITING_FOR_DATA ||
+      queuePaused || waitingOnBuffer || packetsFilled == 0 ||
+      _streamDescription.mSampleRate <= 0) {
+    return YES;
+  }
+  UInt64 filling;
+  if (vbr) {
+    filling = [self framesInPackets:buffers[fillBufferIndex]->packetDescs
+                              count:packetsFilled];
+  } else if (_streamDescription.mBytesPerPacket > 0) {
+    filling = bytesFilled / _streamDescription.mBytesPerPacket *
+              _streamDescription.mFramesPerPacket;
+  } else {
+    return YES;
+  }
+  start_policy_t policy;
+  start_state_t state;
+  [self getStartPolicy:&policy state:&state];
+  if ((framesInQueue + filling) / _streamDescription.mSampleRate >=
+      ASStartPolicyTarget(&policy, &state)) {
+    if ([self enqueueBuffer] < 0) return NO;
+  }
+  return YES;
+}
+
+/**
+ * @brief Whether a stream which hasn't started playing yet could
+ */
+- (BOOL)isReadyToPlay {
+  return state_ == AS_WAITING_FOR_DATA && audioQueue != NULL &&
+         ([self hasBufferedEnoughToStart] || (buffersUsed > 0 && [self readStreamAtEnd]));
+}
+
 /**
  * @brief Sets up the audio queue and starts it
  *
@@ -2018,9 +4011,25 @@ - (void)createQueue {
  */
 - (BOOL)startAudioQueue
 {
-  OSStatus osErr = AudioQueueStart(audioQueue, NULL);
+  return [self startAudioQueueAtTime:NULL];
+}
+
+- (BOOL)startAudioQueueAtTime:(const AudioTimeStamp *)startTime
+{
+  OSStatus osErr = AudioQueueStart(audioQueue, startTime);
   CHECK_ERR(osErr, AS_AUDIO_QUEUE_START_FAILED, [[self class] descriptionForAQErrorCode:osErr], NO);
 
+  if (renderingOffline && !offlinePrimed) {
+    /* Offline rendering begins with a render of no frames at time 0 */
+    AudioTimeStamp time;
+    memset(&time, 0, sizeof(time));
+    time.mFlags = kAudioTimeStampSampleTimeValid;
+    osErr = AudioQueueOfflineRender(audioQueue, &time, renderBuffer, 0);
+    CHECK_ERR(osErr, AS_OFFLINE_RENDER_FAILED, [[self class] descriptionForAQErrorCode:osErr], NO);
+    offlinePrimed = true;
+    framesRendered = 0;
+  }
+
   if (queuePaused) {
     queuePaused = false;
     [self setState:AS_PLAYING];
@@ -2028,7 +4037,7 @@ - (BOOL)startAudioQueue
     [self setState:AS_WAITING_FOR_QUEUE_TO_START];
   }
 
-  return YES;
+  return !renderingOffline || [self renderOffline];
 }
 
 //
@@ -2060,6 +4069,7 @@ - (void)handlePropertyChangeForFileStream:(AudioFileStreamID)inAudioFileStream
                                                   &offsetSize, &offset);
       CHECK_ERR(osErr, AS_FILE_STREAM_GET_PROPERTY_FAILED, [[self class] descriptionForAFSErrorCode:osErr]);
       dataOffset = (UInt64)offset;
+      ASSeekIndexSetDataOffset(seekIndex, dataOffset);
 
       if (audioDataByteCount) {
         fileLength = dataOffset + audioDataByteCount;
@@ -2075,6 +4085,7 @@ - (void)handlePropertyChangeForFileStream:(AudioFileStreamID)inAudioFileStream
                                                   &byteCountSize, &audioDataByteCount);
       CHECK_ERR(osErr, AS_FILE_STREAM_GET_PROPERTY_FAILED, [[self class] descriptionForAFSErrorCode:osErr]);
       fileLength = dataOffset + audioDataByteCount;
+      ASSeekIndexSetAudioByteCount(seekIndex, audioDataByteCount);
       LOG_DEBUG(@"have byte count: %llu", audioDataByteCount);
       break;
     }
@@ -2093,6 +4104,22 @@ - (void)handlePropertyChangeForFileStream:(AudioFileStreamID)inAudioFileStream
       break;
     }
 
+    case kAudioFileStreamProperty_PacketTableInfo: {
+      AudioFilePacketTableInfo tableInfo;
+      UInt32 tableInfoSize = sizeof(tableInfo);
+      OSStatus osErr = AudioFileStreamGetProperty(inAudioFileStream,
+                                                  kAudioFileStreamProperty_PacketTableInfo,
+                                                  &tableInfoSize, &tableInfo);
+      CHECK_ERR(osErr, AS_FILE_STREAM_GET_PROPERTY_FAILED, [[self class] descriptionForAFSErrorCode:osErr]);
+      if (tableInfo.mNumberValidFrames > 0) {
+        primingFrames = (UInt64)tableInfo.mPrimingFrames;
+        validFrames = (UInt64)tableInfo.mNumberValidFrames;
+      }
+      LOG_DEBUG(@"have packet table: %llu priming frames, %llu valid",
+                primingFrames, validFrames);
+      break;
+    }
+
     case kAudioFileStreamProperty_FormatList: {
       Boolean outWriteable;
       UInt32 formatListSize;
@@ -2128,6 +4155,194 @@ - (void)handlePropertyChangeForFileStream:(AudioFileStreamID)inAudioFileStream
   }
 }
 
+/**
+ * @brief Handles the format of an MP3 stream found by the built-in parser
+ *
+ * This stands in for the properties an AudioFileStream would report: the
+ * data format and, if the stream was read from the start, the data offset.
+ *
+ * @param format The header of the first frame
+ * @param offset Where the first frame starts, relative to where parsing began
+ */
+- (void)handleMP3Format:(const mp3_header_t *)format offset:(uint64_t)offset {
+  /* If we seeked, don't re-read the data */
+  if (_streamDescription.mSampleRate == 0) {
+    _streamDescription.mFormatID = kAudioFormatMPEGLayer3;
+    _streamDescription.mSampleRate = format->sampleRate;
+    _streamDescription.mChannelsPerFrame = format->channels;
+    _streamDescription.mFramesPerPacket = format->samplesPerFrame;
+    LOG_INFO(@"have data format");
+  } else if (_streamDescription.mSampleRate != format->sampleRate ||
+             _streamDescription.mChannelsPerFrame != format->channels) {
+    LOG_WARN(@"MP3 format changed mid-stream to %u Hz, %d channel(s)",
+             format->sampleRate, format->channels);
+  }
+
+  if (seekByteOffset == 0 && dataOffset == 0) {
+    dataOffset = offset;
+    ASSeekIndexSetDataOffset(seekIndex, dataOffset);
+    LOG_DEBUG(@"have data offset: %llu", dataOffset);
+  }
+  packetSizeUpperBound = kMP3MaxFrameLength;
+  discontinuous = true;
+}
+
+/**
+ * @brief Handles the format of an ADTS stream found by the built-in parser
+ *
+ * Besides the data format this builds the magic cookie the audio queue needs
+ * to decode raw AAC packets.
+ *
+ * @param format The header of the first frame
+ * @param offset Where the first frame starts, relative to where parsing began
+ */
+- (void)handleADTSFormat:(const adts_header_t *)format offset:(uint64_t)offset {
+  /* If we seeked, don't re-read the data */
+  if (_streamDescription.mSampleRate == 0) {
+    /* ADTS can't say whether there's SBR data (HE-AAC) in the stream. Low
+       sample rate LC streams almost always carry it, and decoding one as
+       HE-AAC when it doesn't only costs an upsample, so assume it does */
+    if (format->objectType == 2 && format->sampleRate <= 24000) {
+      _streamDescription.mFormatID = kAudioFormatMPEG4AAC_HE;
+      _streamDescription.mSampleRate = 2.0 * format->sampleRate;
+      _streamDescription.mFramesPerPacket = 2 * kADTSFramesPerPacket;
+    } else {
+      _streamDescription.mFormatID = kAudioFormatMPEG4AAC;
+      _streamDescription.mFormatFlags = format->objectType;
+      _streamDescription.mSampleRate = format->sampleRate;
+      _streamDescription.mFramesPerPacket = kADTSFramesPerPacket;
+    }
+    _streamDescription.mChannelsPerFrame = format->channels;
+    LOG_INFO(@"have data format");
+
+    uint8_t cookie[32];
+    size_t cookieSize = ASADTSMagicCookie(format, cookie, sizeof(cookie));
+    magicCookie = [NSData dataWithBytes:cookie length:cookieSize];
+  } else if (format->channels != _streamDescription.mChannelsPerFrame) {
+    LOG_WARN(@"ADTS format changed mid-stream to %u Hz, %d channel(s)",
+             format->sampleRate, format->channels);
+  }
+
+  if (seekByteOffset == 0 && dataOffset == 0) {
+    dataOffset = offset;
+    LOG_DEBUG(@"have data offset: %llu", dataOffset);
+  }
+  packetSizeUpperBound = kADTSMaxFrameLength;
+  discontinuous = true;
+}
+
+/**
+ * @brief Handles a packet of the Ogg stream being followed
+ *
+ * Each track of a chained stream starts over with its own header packets.
+ * The OpusHead packet gives the format and the OpusTags packet the title
+ * and artist; everything after that is audio. Vorbis (and anything else)
+ * can't be decoded by the audio queue, so such streams fail.
+ */
+- (void)handleOggPacket:(const ogg_packet_t *)packet {
+  if (packet->bos) {
+    opus_head_t head;
+    if (ASOggIdentifyCodec(packet->data, packet->length) != OGG_CODEC_OPUS ||
+        !ASOggParseOpusHead(packet->data, packet->length, &head)) {
+      [self failWithErrorCode:AS_FILE_STREAM_PARSE_BYTES_FAILED
+                       reason:@"Only Ogg streams of Opus audio can be played"];
+      return;
+    }
+
+    /* If we seeked, don't re-read the data */
+    if (_streamDescription.mSampleRate == 0) {
+      _streamDescription.mFormatID = kAudioFormatOpus;
+      _streamDescription.mSampleRate = kOpusSampleRate;
+      _streamDescription.mChannelsPerFrame = head.channels;
+      magicCookie = [NSData dataWithBytes:packet->data length:packet->length];
+      primingFrames = head.preSkip;
+      LOG_INFO(@"have data format");
+    } else {
+      /* Packet numbers now run on from another track's */
+      trimmingFrames = false;
+      if (head.channels != _streamDescription.mChannelsPerFrame) {
+        LOG_WARN(@"Ogg stream changed to %d channel(s) in a new track", head.channels);
+      }
+    }
+    opusPreSkip = head.preSkip;
+    oggHeadersLeft = 1;
+    discontinuous = true;
+    return;
+  }
+  if (oggHeadersLeft > 0) {
+    oggHeadersLeft--;
+    [self handleOggComments:packet];
+    return;
+  }
+
+  UInt32 samples = ASOggOpusPacketSamples(packet->data, packet->length);
+  if (samples == 0) return;
+  if (_streamDescription.mFramesPerPacket == 0) {
+    _streamDescription.mFramesPerPacket = samples;
+  }
+
+  /* After a seek, the first granule position (the sample count at the end of
+     the packet) tells where playback really picks up */
+  if (oggTimePending) {
+    oggSamplesSinceSeek += samples;
+    if (packet->granule >= 0) {
+      double start = (double)packet->granule - opusPreSkip - oggSamplesSinceSeek;
+      seekTime = MAX(start, 0) / kOpusSampleRate;
+      oggTimePending = false;
+      LOG_DEBUG(@"Ogg stream resumed at %.3fs", seekTime);
+    }
+  }
+
+  /* The last granule position counts the track's samples, pre-skip and all */
+  if (packet->eos && packet->granule > (int64_t)opusPreSkip) {
+    validFrames = (UInt64)packet->granule - opusPreSkip;
+  }
+
+  AudioStreamPacketDescription desc = {0, samples, (UInt32)packet->length};
+  [self handleAudioPackets:packet->data
+               numberBytes:(UInt32)packet->length
+             numberPackets:1
+        packetDescriptions:&desc];
+}
+
+/**
+ * @brief Takes the title and artist of an Ogg track from its comment packet
+ */
+- (void)handleOggComments:(const ogg_packet_t *)packet {
+  const uint8_t *value;
+  size_t valueLength;
+  /* Opus gives its gains in 1/256 dB; Vorbis comments follow ReplayGain */
+  if (ASOggFindComment(packet->data, packet->length, "R128_TRACK_GAIN", &value, &valueLength)) {
+    NSString *gain = [[NSString alloc] initWithBytes:value length:valueLength
+                                            encoding:NSUTF8StringEncoding];
+    [self setTaggedLoudness:kR128GainReference - [gain intValue] / 256.0];
+  } else if (ASOggFindComment(packet->data, packet->length, "REPLAYGAIN_TRACK_GAIN",
+                              &value, &valueLength)) {
+    NSString *text = [[NSString alloc] initWithBytes:value length:valueLength
+                                            encoding:NSUTF8StringEncoding];
+    double gain;
+    if (text != nil && ASLoudnessParseReplayGain([text UTF8String], &gain)) {
+      [self setTaggedLoudness:kReplayGainReference - gain];
+    }
+  }
+
+  NSString *fields[2] = {nil, nil};
+  const char *names[2] = {"ARTIST", "TITLE"};
+  for (int i = 0; i < 2; i++) {
+    if (ASOggFindComment(packet->data, packet->length, names[i], &value, &valueLength)) {
+      fields[i] = [[NSString alloc] initWithBytes:value
+                                           length:valueLength
+                                         encoding:NSUTF8StringEncoding];
+    }
+  }
+  if (fields[0] == nil && fields[1] == nil) return;
+
+  NSString *currSong = [NSString stringWithFormat:@"%@ - %@",
+                        fields[0] ?: @"Unknown Artist", fields[1] ?: @"Unknown Title"];
+  LOG_INFO(@"Ogg Current Song: %@", currSong);
+  [self setCurrentSong:currSong];
+}
+
 //
 // handleAudioPackets:numberBytes:numberPackets:packetDescriptions:
 //
@@ -2153,77 +4368,88 @@ - (void)handleAudioPackets:(const void*)inInputData
   if (!audioQueue) {
     vbr = (inPacketDescriptions != NULL);
 
-    if (fileLength != 0) {
-      OSStatus status = 0;
-      UInt32 ioFlags = 0;
-      SInt64 byteOffset;
-      SInt64 lower = 0;
-      SInt64 upper = 1000000;
-      SInt64 current;
-      while (upper - lower > 1 || status != 0)
-      {
-        current = (upper + lower) / 2;
-        status = AudioFileStreamSeek(audioFileStream, current, &byteOffset, &ioFlags);
-        if (status == 0)
-        {
-          lower = current;
-        }
-        else
-        {
-          upper = current;
-        }
+    if (vbr && inNumberPackets > 0) {
+      ASSeekIndexSetFirstPacket(seekIndex,
+                                inInputData + inPacketDescriptions[0].mStartOffset,
+                                inPacketDescriptions[0].mDataByteSize);
+    }
+    /* Ogg page headers sit between packets, so packet sizes say nothing
+       about where each packet is in the file */
+    indexingPackets = vbr && oggDemuxer == NULL;
+    typicalPacketSize = inNumberPackets > 0 ? inNumberBytes / inNumberPackets : 0;
+    trimmingFrames = vbr;
+    if (vbr && _streamDescription.mFormatID == kAudioFormatMPEGLayer3) {
+      [self takeLAMEGaplessInfo];
+      /* A header frame's bitrate is only whatever made it big enough */
+      mp3_header_t header;
+      if (inNumberPackets > 0 && !ASSeekIndexFirstPacketIsHeader(seekIndex) &&
+          inPacketDescriptions[0].mDataByteSize >= 4 &&
+          ASMP3ParseHeader(inInputData + inPacketDescriptions[0].mStartOffset, &header)) {
+        headerBitrate = header.bitrate;
       }
-      AudioFileStreamSeek(audioFileStream, 0, &byteOffset, &ioFlags);
-      totalAudioPackets = (UInt64)current + 1;
-      seekByteOffset = (UInt64)byteOffset + dataOffset;
-      [self closeReadStream];
-      [self openReadStream];
     }
 
     assert(!waitingOnBuffer);
     [self createQueue];
     if ([self isDone]) return; // Queue creation failed. Abort.
+    if (vbr && fileLength == 0 && !hlsStream && _timeShiftDuration > 0) {
+      [self createTimeShift];
+    }
   }
 
+  if (indexingPackets) {
+    for (UInt32 i = 0; i < inNumberPackets; i++) {
+      ASSeekIndexAddPacket(seekIndex, audioPacketsReceived + i,
+                           inPacketDescriptions[i].mDataByteSize);
+    }
+  }
   audioBytesReceived += inNumberBytes;
   audioPacketsReceived += inNumberPackets;
+  /* Headers may have given the bitrate already, without waiting for enough
+     packets to estimate it */
+  double bitrate;
+  if (!bitrateNotification && [self bitRate:&bitrate] && bitrate > 0) {
+    [self notifyBitrateReady];
+  }
 
-  if (inPacketDescriptions) {
+  if (timeShift != NULL) {
+    /* Everything is recorded, and played from the recording */
+    for (UInt32 i = 0; i < inNumberPackets; i++) {
+      AudioStreamPacketDescription *desc = &inPacketDescriptions[i];
+      bool recorded = ASTimeShiftAppend(timeShift, inInputData + desc->mStartOffset,
+                                        desc->mDataByteSize, desc->mVariableFramesInPacket);
+      CHECK_ERR(!recorded, AS_AUDIO_QUEUE_ENQUEUE_FAILED, @"");
+    }
+    if (!waitingOnBuffer) [self enqueueTimeShift];
+    if ([self isDone] || ![self checkStartTarget]) return;
+    [self checkBufferLevels];
+  } else if (inPacketDescriptions) {
     /* Place each packet into a buffer and then send each buffer into the audio
        queue */
     UInt32 i;
-    for (i = 0; i < inNumberPackets && !waitingOnBuffer && queued_vbr_head == NULL; i++) {
+    for (i = 0; i < inNumberPackets && !waitingOnBuffer && ASPacketRingIsEmpty(queuedPackets); i++) {
       AudioStreamPacketDescription *desc = &inPacketDescriptions[i];
       int ret = [self handleVBRPacket:(inInputData + desc->mStartOffset)
                                  desc:desc];
       CHECK_ERR(ret < 0, AS_AUDIO_QUEUE_ENQUEUE_FAILED, @"");
       if (!ret) break;
     }
-    if (i == inNumberPackets) return;
+    if (i == inNumberPackets) {
+      [self checkStartTarget];
+      return;
+    }
 
+    /* Set aside whatever didn't fit for when a buffer frees up */
     for (; i < inNumberPackets; i++) {
-      /* Allocate the packet */
-      UInt32 size = inPacketDescriptions[i].mDataByteSize;
-      queued_vbr_packet_t *packet = malloc(sizeof(queued_vbr_packet_t) + size);
-      CHECK_ERR(packet == NULL, AS_AUDIO_QUEUE_ENQUEUE_FAILED, @"");
-
-      /* Prepare the packet */
-      packet->next = NULL;
-      packet->desc = inPacketDescriptions[i];
-      packet->desc.mStartOffset = 0;
-      memcpy(packet->data, inInputData + inPacketDescriptions[i].mStartOffset,
-             size);
-
-      if (queued_vbr_head == NULL) {
-        queued_vbr_head = queued_vbr_tail = packet;
-      } else {
-        queued_vbr_tail->next = packet;
-        queued_vbr_tail = packet;
-      }
+      AudioStreamPacketDescription *desc = &inPacketDescriptions[i];
+      bool queued = ASPacketRingPush(queuedPackets, inInputData + desc->mStartOffset,
+                                     desc->mDataByteSize, desc->mVariableFramesInPacket);
+      CHECK_ERR(!queued, AS_AUDIO_QUEUE_ENQUEUE_FAILED, @"");
     }
+    [self checkBufferLevels];
   } else {
     size_t offset = 0;
-    while (inNumberBytes && !waitingOnBuffer && queued_cbr_head == NULL) {
+    while (inNumberBytes && !waitingOnBuffer && ASPacketRingIsEmpty(queuedPackets)) {
       size_t copySize;
       int ret = [self handleCBRPacket:(inInputData + offset)
                              byteSize:inNumberBytes
@@ -2233,28 +4459,60 @@ - (void)handleAudioPackets:(const void*)inInputData
       inNumberBytes -= copySize;
       offset += copySize;
     }
-    while (inNumberBytes) {
-      /* Allocate the packet */
-      size_t size = MIN(packetBufferSize - bytesFilled, inNumberBytes);
-      queued_cbr_packet_t *packet = malloc(sizeof(queued_cbr_packet_t) + size);
-      CHECK_ERR(packet == NULL, AS_AUDIO_QUEUE_ENQUEUE_FAILED, @"");
-
-      /* Prepare the packet */
-      packet->next = NULL;
-      packet->byteSize = inNumberBytes;
-      memcpy(packet->data, inInputData + offset, size);
+    if (![self checkStartTarget]) return;
+    /* CBR data can be split anywhere, so the remainder is kept as one run
+       and consumed piecemeal by enqueueCachedData */
+    if (inNumberBytes) {
+      bool queued = ASPacketRingPush(queuedPackets, inInputData + offset, inNumberBytes, 0);
+      CHECK_ERR(!queued, AS_AUDIO_QUEUE_ENQUEUE_FAILED, @"");
+      [self checkBufferLevels];
+    }
+  }
+}
 
-      if (queued_cbr_head == NULL) {
-        queued_cbr_head = queued_cbr_tail = packet;
-      } else {
-        queued_cbr_tail->next = packet;
-        queued_cbr_tail = packet;
-      }
+/**
+ * @brief Starts recording a live stream for <timeShiftDuration>
+ *
+ * Playback goes on straight from the network if the recording can't be made.
+ */
+- (void)createTimeShift {
+  double bitrate;
+  if (![self bitRate:&bitrate] || bitrate <= 0) bitrate = kTimeShiftDefaultBitrate;
+  size_t capacity = (size_t)(_timeShiftDuration * bitrate / 8 * kTimeShiftSlack);
+  capacity = MAX(capacity, (size_t)packetBufferSize);
+  timeShift = ASTimeShiftCreate([NSTemporaryDirectory() fileSystemRepresentation],
+                                capacity, _streamDescription.mFramesPerPacket);
+  timeShiftNext = 0;
+  timeShiftNextFrame = 0;
+  if (timeShift == NULL) {
+    LOG_WARN(@"couldn't create a %zu byte time-shift recording", capacity);
+  } else {
+    LOG_INFO(@"recording %.0fs of the stream in %zu bytes", _timeShiftDuration, capacity);
+  }
+}
 
-      inNumberBytes -= size;
-      offset += size;
-    }
+/**
+ * @brief Takes the encoder delay and padding from an MP3 stream's LAME tag
+ *
+ * An iTunSMPB comment or packet table found earlier takes precedence.
+ */
+- (void)takeLAMEGaplessInfo {
+  uint32_t delay, padding;
+  if (primingFrames > 0 || validFrames > 0 ||
+      !ASSeekIndexEncoderDelay(seekIndex, &delay, &padding)) {
+    return;
+  }
+  UInt32 framesPerPacket = _streamDescription.mFramesPerPacket;
+  gapless_info_t info;
+  ASGaplessFromLAME(&info, delay, padding,
+                    ASSeekIndexPacketCount(seekIndex) * framesPerPacket);
+  /* The header's frame decodes to silence if it is played at all */
+  if (ASSeekIndexFirstPacketIsHeader(seekIndex)) {
+    info.priming += framesPerPacket;
   }
+  primingFrames = info.priming;
+  validFrames = info.validFrames;
+  LOG_INFO(@"LAME tag: %llu priming frames, %llu valid", primingFrames, validFrames);
 }
 
 - (int)handleVBRPacket:(const void*)data
@@ -2268,9 +4526,12 @@ - (int)handleVBRPacket:(const void*)data
   CHECK_ERR(packetSize > packetBufferSize, AS_AUDIO_BUFFER_TOO_SMALL,
             @"The audio buffer was too small to handle the audio packets.", -1);
 
-  // if the space remaining in the buffer is not enough for this packet, then
-  // enqueue the buffer and wait for another to become available.
-  if (packetBufferSize - bytesFilled < packetSize) {
+  // if the space remaining in the buffer is not enough for this packet, or
+  // it has no descriptions left, then enqueue the buffer and wait for another
+  // to become available. Either way the packet hasn't been consumed yet, so a
+  // 0 returned here is safe for callers to retry it later.
+  if (packetBufferSize - bytesFilled < packetSize ||
+      packetsFilled >= descsPerBuffer) {
     int hasFreeBuffer = [self enqueueBuffer];
     if (hasFreeBuffer <= 0) {
       return hasFreeBuffer;
@@ -2283,13 +4544,8 @@ - (int)handleVBRPacket:(const void*)data
   /* global statistics */
   processedPacketsSizeTotal += 8.0 * packetSize / (_streamDescription.mFramesPerPacket / _streamDescription.mSampleRate);
   processedPacketsCount++;
-  if (processedPacketsCount > BitRateEstimationMinPackets &&
-      !bitrateNotification) {
-    bitrateNotification = true;
-    __strong id <AudioStreamerDelegate> delegate = _delegate;
-    if (delegate && [delegate respondsToSelector:@selector(streamerBitrateIsReady:)]) {
-      [delegate streamerBitrateIsReady:self];
-    }
+  if (processedPacketsCount > BitRateEstimationMinPackets) {
+    [self notifyBitrateReady];
   }
 
   // copy data to the audio queue buffer
@@ -2304,8 +4560,6 @@ - (int)handleVBRPacket:(const void*)data
   bytesFilled += packetSize;
   packetsFilled++;
 
-  /* If filled our buffer with packets, then commit it to the system */
-  if (packetsFilled >= kAQMaxPacketDescs) return [self enqueueBuffer];
   return 1;
 }
 
@@ -2339,13 +4593,7 @@ - (int)handleCBRPacket:(const void*)data
 
   // Bitrate isn't estimated with these packets.
   // It's safe to calculate the bitrate as soon as we start getting audio.
-  if (!bitrateNotification) {
-    bitrateNotification = true;
-    __strong id <AudioStreamerDelegate> delegate = _delegate;
-    if (delegate && [delegate respondsToSelector:@selector(streamerBitrateIsReady:)]) {
-      [delegate streamerBitrateIsReady:self];
-    }
-  }
+  [self notifyBitrateReady];
 
   return 1;
 }
@@ -2359,41 +4607,160 @@ - (void)enqueueCachedData {
   if ([self isDone]) return;
   assert(!waitingOnBuffer);
   assert(!buffers[fillBufferIndex]->inuse);
+  if (timeShift != NULL) {
+    [self enqueueTimeShift];
+    return;
+  }
   assert(stream != NULL);
   LOG_DEBUG(@"processing some cached data");
 
   /* Queue up as many packets as possible into the buffers */
-  while (queued_vbr_head != NULL || queued_cbr_head != NULL) {
-    if (queued_cbr_head != NULL) {
-      size_t copySize;
-      int ret = [self handleCBRPacket:queued_cbr_head->data
-                             byteSize:queued_cbr_head->byteSize
-                             copySize:&copySize];
+  packet_ring_entry_t entry;
+  while (ASPacketRingPeek(queuedPackets, &entry)) {
+    if (vbr) {
+      AudioStreamPacketDescription desc = {
+        .mStartOffset = 0,
+        .mVariableFramesInPacket = entry.variableFrames,
+        .mDataByteSize = entry.byteSize
+      };
+      int ret = [self handleVBRPacket:entry.data desc:&desc];
       CHECK_ERR(ret < 0, AS_AUDIO_QUEUE_ENQUEUE_FAILED, @"");
       if (ret == 0) break;
-      queued_cbr_packet_t *next_cbr = queued_cbr_head->next;
-      free(queued_cbr_head);
-      queued_cbr_head = next_cbr;
+      ASPacketRingPop(queuedPackets);
     } else {
-      int ret = [self handleVBRPacket:queued_vbr_head->data desc:&queued_vbr_head->desc];
+      size_t copySize;
+      int ret = [self handleCBRPacket:entry.data
+                             byteSize:entry.byteSize
+                             copySize:&copySize];
       CHECK_ERR(ret < 0, AS_AUDIO_QUEUE_ENQUEUE_FAILED, @"");
       if (ret == 0) break;
-      queued_vbr_packet_t *next_vbr = queued_vbr_head->next;
-      free(queued_vbr_head);
-      queued_vbr_head = next_vbr;
+      ASPacketRingConsume(queuedPackets, (UInt32)copySize);
     }
   }
 
-  /* If we finished queueing all our saved packets, we can re-schedule the
-   * stream to run */
-  if (queued_vbr_head == NULL && queued_cbr_head == NULL) {
-    queued_vbr_tail = NULL;
-    queued_cbr_tail = NULL;
+  [self resumeReadAhead];
+}
+
+/**
+ * @brief Re-schedules the read stream held back at the high watermark once
+ *        playback has eaten into what's buffered
+ *
+ * The buffers alone can hold more than the high watermark, with nothing set
+ * aside to wait on, so this is checked as each buffer finishes as well as
+ * after cached data is enqueued.
+ */
+- (void)resumeReadAhead {
+  if (stream != NULL && unscheduled && !rescheduled && [self shouldReadAhead]) {
     rescheduled = true;
-    if (!_bufferInfinite) {
-      CFReadStreamScheduleWithRunLoop(stream, CFRunLoopGetCurrent(), kCFRunLoopCommonModes);
-    }
+    ASTransportSetPaused(stream, false);
+  }
+}
+
+/**
+ * @brief Sends recorded packets to the audio queue, from the next to be played
+ *
+ * Packets written over before they could be, because playback was held up
+ * for longer than the recording lasts, are skipped.
+ */
+- (void)enqueueTimeShift {
+  time_shift_packet_t packet;
+  UInt64 first = ASTimeShiftFirst(timeShift);
+  if (timeShiftNext < first && ASTimeShiftPacket(timeShift, first, &packet)) {
+    double skipped = (packet.sampleTime - timeShiftNextFrame) / _streamDescription.mSampleRate;
+    LOG_INFO(@"playback fell %.1fs behind the time-shift recording", skipped);
+    seekTime += skipped;
+    timeShiftNext = first;
+    timeShiftNextFrame = packet.sampleTime;
+  }
+
+  while (ASTimeShiftPacket(timeShift, timeShiftNext, &packet)) {
+    AudioStreamPacketDescription desc = {
+      .mStartOffset = 0,
+      .mVariableFramesInPacket = packet.variableFrames,
+      .mDataByteSize = packet.byteSize
+    };
+    int ret = [self handleVBRPacket:packet.data desc:&desc];
+    CHECK_ERR(ret < 0, AS_AUDIO_QUEUE_ENQUEUE_FAILED, @"");
+    if (ret == 0) break;
+    timeShiftNext++;
+    timeShiftNextFrame = packet.sampleTime + (packet.variableFrames > 0 ?
+                         packet.variableFrames : _streamDescription.mFramesPerPacket);
+  }
+}
+
+/**
+ * @brief Whether any packets read are still to be sent to the audio queue
+ */
+- (BOOL)hasQueuedPackets {
+  if (timeShift != NULL && timeShiftNext < ASTimeShiftEnd(timeShift)) return YES;
+  return !ASPacketRingIsEmpty(queuedPackets);
+}
+
+/**
+ * @brief Deals with everything handed over from the audio queue's threads
+ */
+- (void)handleQueueEvents {
+  void *buffer;
+  while (audioQueue != NULL && ASSPSCQueuePop(queueContext->playedBuffers, &buffer)) {
+    [self handleBufferCompleteForQueue:audioQueue buffer:buffer];
+  }
+  if (audioQueue != NULL &&
+      __atomic_exchange_n(&queueContext->runningChanged, false, __ATOMIC_ACQ_REL)) {
+    [self handlePropertyChangeForQueue:audioQueue
+                            propertyID:kAudioQueueProperty_IsRunning];
+  }
+}
+
+/**
+ * @brief Publishes what getters called on other threads report
+ *
+ * Called on the stream thread whenever something may have changed: after
+ * each state change, event from the network or audio queue, and call made
+ * from another thread.
+ */
+- (void)publishSnapshot {
+  double duration = 0, bitRate = 0, bufferProgress = 0, loudness = 0;
+  BOOL bitRateEstimated = NO;
+  bool hasDuration = [self duration:&duration];
+  bool hasBitRate = [self calculatedBitRate:&bitRate estimated:&bitRateEstimated];
+  bool hasBufferProgress = [self bufferProgress:&bufferProgress];
+  bool hasLoudness = [self loudness:&loudness];
+  bool seekable = [self isSeekable];
+  bool preloaded = [self isPreloaded];
+  bool timeShifted = timeShift != NULL && !_error;
+  AudioStreamerMetrics metrics = [self metrics];
+  double normalizationGain = [self normalizationGain];
+  double fadeProcessingTime = [self fadeProcessingTime];
+  if (sharedDiskCache != NULL) {
+    double hitRate = ASDiskCacheHitRate(sharedDiskCache);
+    __atomic_store(&sharedDiskCacheHitRate, &hitRate, __ATOMIC_RELAXED);
   }
+
+  pthread_mutex_lock(&snapshot->lock);
+  snapshot->state = state_;
+  snapshot->seekable = seekable;
+  snapshot->timeShifted = timeShifted;
+  snapshot->preloading = preloading;
+  snapshot->preloaded = preloaded;
+  snapshot->streamDescription = _streamDescription;
+  snapshot->hasDuration = hasDuration;
+  snapshot->duration = duration;
+  snapshot->hasBitRate = hasBitRate;
+  snapshot->bitRate = bitRate;
+  snapshot->bitRateEstimated = bitRateEstimated;
+  snapshot->hasBufferProgress = hasBufferProgress;
+  snapshot->bufferProgress = bufferProgress;
+  snapshot->audioQueue = audioQueue;
+  snapshot->seekTime = seekTime;
+  snapshot->metrics = metrics;
+  snapshot->hasLoudness = hasLoudness;
+  snapshot->loudness = loudness;
+  snapshot->normalizationGain = normalizationGain;
+  snapshot->fadeProcessingTime = fadeProcessingTime;
+  snapshotError = _error;
+  snapshotHTTPHeaders = _httpHeaders;
+  snapshotCurrentSong = _currentSong;
+  pthread_mutex_unlock(&snapshot->lock);
 }
 
 //
@@ -2410,15 +4777,15 @@ - (void)handleBufferCompleteForQueue:(AudioQueueRef)inAQ
   /* we're only registered for one audio queue... */
   assert(inAQ == audioQueue);
   /* Sanity check to make sure we're on the right thread */
-  assert([NSThread currentThread] == [NSThread mainThread]);
+  assert([NSThread currentThread] == ASStreamThread());
 
   /* Figure out which buffer just became free, and it had better damn well be
      one of our own buffers */
   UInt32 idx;
-  for (idx = 0; idx < _bufferCount; idx++) {
+  for (idx = 0; idx < activeBuffers; idx++) {
     if (buffers[idx]->ref == inBuffer) break;
   }
-  CHECK_ERR(idx >= _bufferCount, AS_AUDIO_QUEUE_BUFFER_MISMATCH, @"");
+  CHECK_ERR(idx >= activeBuffers, AS_AUDIO_QUEUE_BUFFER_MISMATCH, @"");
   assert(buffers[idx]->inuse);
 
   LOG_DEBUG(@"buffer %u finished", (unsigned int)idx);
@@ -2426,6 +4793,9 @@ - (void)handleBufferCompleteForQueue:(AudioQueueRef)inAQ
   /* Signal the buffer is no longer in use */
   buffers[idx]->inuse = false;
   buffersUsed--;
+  bytesInQueue -= MIN(bytesInQueue, inBuffer->mAudioDataByteSize);
+  framesInQueue -= MIN(framesInQueue, buffers[idx]->frames);
+  if (streamMetrics != NULL) [self updateMetrics];
 
   /* If we're done with the buffers because the stream is dying, then there's no
    * need to call more methods on it */
@@ -2434,14 +4804,25 @@ - (void)handleBufferCompleteForQueue:(AudioQueueRef)inAQ
 
   /* If there is absolutely no more data which will ever come into the stream,
    * then we're done with the audio */
-  } else if (buffersUsed == 0 && queued_vbr_head == NULL && queued_cbr_head == NULL &&
-             !seeking && stream != nil && CFReadStreamGetStatus(stream) == kCFStreamStatusAtEnd) {
+  } else if (buffersUsed == 0 && ![self hasQueuedPackets] &&
+             !seeking && [self readStreamAtEnd]) {
     assert(!waitingOnBuffer);
     seekable = false;
-    AudioQueueStop(audioQueue, false);
+    if (!renderingOffline) {
+      AudioQueueStop(audioQueue, false);
+      return;
+    }
+    /* Everything has been rendered, so there's nothing to wait for */
+    AudioQueueStop(audioQueue, true);
+    bool written = ASOutputSinkClose(renderSink);
+    renderSink = NULL;
+    CHECK_ERR(!written, AS_OFFLINE_RENDER_FAILED, @"Writing the PCM output failed");
+    [self setState:AS_DONE];
 
-  /* If we are out of buffers then we need to reconnect or wait */
-  } else if (buffersUsed == 0 && ![self isDone] && ![self isWaiting]) {
+  /* If we are out of buffers then we need to reconnect or wait. Offline,
+   * rendering catching up with the network isn't a stall */
+  } else if (buffersUsed == 0 && ![self isDone] && ![self isWaiting] &&
+             (_error || !renderingOffline)) {
     if (_error)
     {
       /* A previous error occurred without the need to halt,
@@ -2454,6 +4835,7 @@ - (void)handleBufferCompleteForQueue:(AudioQueueRef)inAQ
         [self notifyStateChange];
       }
       /* Try to reconnect */
+      if (streamMetrics != NULL) ASMetricsReconnected(streamMetrics);
       double progress;
       [self progress:&progress];
       if (![self seekToTime:progress]) {
@@ -2469,21 +4851,19 @@ - (void)handleBufferCompleteForQueue:(AudioQueueRef)inAQ
       CHECK_ERR(osErr, AS_AUDIO_QUEUE_PAUSE_FAILED, [[self class] descriptionForAQErrorCode:osErr]);
       queuePaused = true;
 
-      /* This can either fix or delay the problem
-       * If it cannot fix it, the network is simply too slow */
-      if (defaultBufferSizeUsed && packetBufferSize < 65536 && !seeking) {
-        packetBufferSize = packetBufferSize * 2;
-        for (UInt32 j = 0; j < _bufferCount; ++j) {
-          AudioQueueFreeBuffer(audioQueue, buffers[j]->ref);
-        }
-        for (UInt32 i = 0; i < _bufferCount; ++i) {
-          osErr = AudioQueueAllocateBuffer(audioQueue, packetBufferSize,
-                                           &(buffers[i]->ref));
-          CHECK_ERR(osErr, AS_AUDIO_QUEUE_BUFFER_ALLOCATION_FAILED, [[self class] descriptionForAQErrorCode:osErr]);
+      /* Buffer more from now on, both before resuming and ahead of
+       * playback. If that doesn't help, the network is simply too slow */
+      if (!seeking) {
+        LOG_INFO(@"ran out of data, buffering more");
+        if (streamMetrics != NULL) {
+          ASMetricsStalled(streamMetrics, CFAbsoluteTimeGetCurrent());
         }
+        ASBufferControllerStall(bufferController);
+        if (![self updateBufferTargets]) return;
       }
 
       [self setState:AS_WAITING_FOR_DATA];
+      [self resumeReadAhead];
     }
 
   /* If we just opened up a buffer so try to fill it with some cached
@@ -2491,6 +4871,10 @@ - (void)handleBufferCompleteForQueue:(AudioQueueRef)inAQ
   } else if (waitingOnBuffer) {
     waitingOnBuffer = false;
     [self enqueueCachedData];
+
+  /* Otherwise reading may have been held back by full buffers alone */
+  } else {
+    [self resumeReadAhead];
   }
 }
 
@@ -2506,7 +4890,7 @@ - (void)handleBufferCompleteForQueue:(AudioQueueRef)inAQ
 - (void)handlePropertyChangeForQueue:(AudioQueueRef)inAQ
                           propertyID:(AudioQueuePropertyID)inID {
   /* Sanity check to make sure we're on the expected thread */
-  assert([NSThread currentThread] == [NSThread mainThread]);
+  assert([NSThread currentThread] == ASStreamThread());
   /* We only asked for one property, so the audio queue had better damn well
      only tell us about this property */
   assert(inID == kAudioQueueProperty_IsRunning);
@@ -2519,11 +4903,8 @@ - (void)handlePropertyChangeForQueue:(AudioQueueRef)inAQ
     OSStatus osErr = AudioQueueGetProperty(audioQueue, kAudioQueueProperty_IsRunning,
                                            &running, &output);
     if (!osErr && !running) {
-      [self setState:AS_DONE shouldNotify:NO];
-      // Let the method exit before notifying the world.
-      dispatch_async(dispatch_get_main_queue(), ^{
-        [self notifyStateChange];
-      });
+      /* The world hears about it once this method has exited */
+      [self setState:AS_DONE];
     }
   }
 }
@@ -2533,26 +4914,13 @@ - (void)handlePropertyChangeForQueue:(AudioQueueRef)inAQ
  */
 - (void)closeReadStream {
   if (waitingOnBuffer) waitingOnBuffer = false;
-  queued_vbr_packet_t *cur_vbr = queued_vbr_head;
-  queued_cbr_packet_t *cur_cbr = queued_cbr_head;
-  while (cur_vbr != NULL || cur_cbr != NULL) {
-    if (cur_vbr != NULL) {
-      queued_vbr_packet_t *tmp = cur_vbr->next;
-      free(cur_vbr);
-      cur_vbr = tmp;
-    } else {
-      queued_cbr_packet_t *tmp = cur_cbr->next;
-      free(cur_cbr);
-      cur_cbr = tmp;
-    }
-  }
-  queued_vbr_head = queued_vbr_tail = NULL;
-  queued_cbr_head = queued_cbr_tail = NULL;
+  ASPacketRingClear(queuedPackets);
+  /* Reconnecting isn't the network being slow */
+  ASBufferControllerIdle(bufferController);
 
   if (stream) {
-    CFReadStreamClose(stream);
-    CFRelease(stream);
-    stream = nil;
+    ASTransportClose(stream);
+    stream = NULL;
   }
 }
 
@@ -2560,6 +4928,13 @@ - (void)closeReadStream {
  * @brief Closes the file stream
  */
 - (void)closeFileStream {
+  ASMP3ParserDestroy(mp3Parser);
+  mp3Parser = NULL;
+  ASADTSParserDestroy(adtsParser);
+  adtsParser = NULL;
+  ASOggDemuxerDestroy(oggDemuxer);
+  oggDemuxer = NULL;
+  if (audioFileStream == NULL) return;
   OSStatus osErr = AudioFileStreamClose(audioFileStream);
   ASSERT_ERR(!osErr, @"AudioFileStreamClose returned error \"%@\"", [[self class] descriptionForAFSErrorCode:osErr]);
   audioFileStream = nil;
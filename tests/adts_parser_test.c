@@ -0,0 +1,161 @@
+//
+//  adts_parser_test.c
+//  AudioStreamer
+//
+//  Builds an ADTS stream with a leading tag, garbage, a frame of two raw data
+//  blocks that can't be split, and a change of format. Fed to ASADTSParser in
+//  chunks of any size, the same raw packets and format changes have to come
+//  back every time.
+//
+
+#include "ASADTSParser.h"
+#include "test.h"
+#include "test_streams.h"
+
+#include <stdlib.h>
+
+#define kMaxStream (1 << 20)
+#define kMaxPackets 2048
+#define kMaxFormats 8
+
+typedef struct expected_format {
+  uint32_t sampleRate;
+  uint8_t  channels;
+  uint64_t offset;
+} expected_format_t;
+
+static uint8_t stream[kMaxStream];
+static size_t streamLength;
+
+/* What should come out */
+static uint32_t packetLengths[kMaxPackets];
+static size_t packetCount;
+static uint8_t audio[kMaxStream];
+static size_t audioLength;
+static expected_format_t formats[kMaxFormats];
+static size_t formatCount;
+
+/* What did */
+static uint32_t gotLengths[kMaxPackets];
+static size_t gotCount;
+static uint8_t gotAudio[kMaxStream];
+static size_t gotAudioLength;
+static expected_format_t gotFormats[kMaxFormats];
+static size_t gotFormatCount;
+
+static void add_frames(int count, uint8_t rateIndex, uint8_t channels,
+                       uint32_t *seed) {
+  for (int i = 0; i < count; i++) {
+    size_t payload = 100 + test_random_below(seed, 700);
+    uint8_t *p = stream + streamLength;
+    streamLength += test_write_adts_frame(p, payload, rateIndex, channels, seed);
+    packetLengths[packetCount++] = (uint32_t)payload;
+    memcpy(audio + audioLength, p + 7, payload);
+    audioLength += payload;
+  }
+}
+
+static void expect_format(uint32_t sampleRate, uint8_t channels) {
+  formats[formatCount].sampleRate = sampleRate;
+  formats[formatCount].channels = channels;
+  formats[formatCount].offset = streamLength;
+  formatCount++;
+}
+
+static void build_stream(void) {
+  uint32_t seed = 5150;
+  streamLength += test_write_id3(stream, 500);
+  expect_format(44100, 2);
+  add_frames(300, 4, 2, &seed);
+
+  test_fill_payload(stream + streamLength, 321, &seed);
+  streamLength += 321;
+  add_frames(100, 4, 2, &seed);
+
+  /* Two raw data blocks and no CRC to say where the second one starts */
+  uint8_t *p = stream + streamLength;
+  streamLength += test_write_adts_frame(p, 400, 4, 2, &seed);
+  p[6] |= 0x01;
+  add_frames(100, 4, 2, &seed);
+
+  expect_format(48000, 1);
+  add_frames(200, 3, 1, &seed);
+}
+
+static void on_format(void *context, const adts_header_t *format, uint64_t offset) {
+  (void)context;
+  if (gotFormatCount == kMaxFormats) return;
+  CHECK(format->objectType == 2);
+  gotFormats[gotFormatCount].sampleRate = format->sampleRate;
+  gotFormats[gotFormatCount].channels = format->channels;
+  gotFormats[gotFormatCount].offset = offset;
+  gotFormatCount++;
+}
+
+static void on_packets(void *context, const void *data, uint32_t byteCount,
+                       uint32_t count, const as_packet_desc_t *descs) {
+  (void)context;
+  uint32_t end = 0;
+  for (uint32_t i = 0; i < count && gotCount < kMaxPackets; i++) {
+    gotLengths[gotCount++] = descs[i].byteSize;
+    memcpy(gotAudio + gotAudioLength, (const uint8_t *)data + descs[i].startOffset,
+           descs[i].byteSize);
+    gotAudioLength += descs[i].byteSize;
+    end = (uint32_t)(descs[i].startOffset + descs[i].byteSize);
+  }
+  CHECK(end <= byteCount);
+}
+
+static void check_chunked(adts_parser_t *parser, size_t chunk) {
+  gotCount = gotAudioLength = gotFormatCount = 0;
+  ASADTSParserReset(parser);
+  for (size_t offset = 0; offset < streamLength; offset += chunk) {
+    size_t length = streamLength - offset < chunk ? streamLength - offset : chunk;
+    ASADTSParserParse(parser, stream + offset, length);
+  }
+  CHECK(gotCount == packetCount);
+  CHECK(memcmp(gotLengths, packetLengths, packetCount * sizeof(uint32_t)) == 0);
+  CHECK(gotAudioLength == audioLength && memcmp(gotAudio, audio, audioLength) == 0);
+  CHECK(gotFormatCount == formatCount);
+  for (size_t i = 0; i < formatCount && i < gotFormatCount; i++) {
+    CHECK(gotFormats[i].sampleRate == formats[i].sampleRate);
+    CHECK(gotFormats[i].channels == formats[i].channels);
+    CHECK(gotFormats[i].offset == formats[i].offset);
+  }
+}
+
+/* AAC LC, 44.1 kHz, stereo gives an AudioSpecificConfig of 0x1210 */
+static void test_magic_cookie(void) {
+  adts_header_t header;
+  uint8_t frame[16];
+  uint32_t seed = 1;
+  test_write_adts_frame(frame, 9, 4, 2, &seed);
+  CHECK(ASADTSParseHeader(frame, &header));
+  uint8_t cookie[64];
+  size_t length = ASADTSMagicCookie(&header, cookie, sizeof(cookie));
+  CHECK(length == 27);
+  CHECK(cookie[0] == 0x03 && cookie[22] == 0x12 && cookie[23] == 0x10);
+  CHECK(ASADTSMagicCookie(&header, cookie, 8) == 0);
+}
+
+int main(void) {
+  build_stream();
+  test_magic_cookie();
+  adts_parser_t *parser = ASADTSParserCreate(on_format, on_packets, NULL);
+  CHECK(parser != NULL);
+  uint64_t runs = 0;
+  for (size_t chunk = 1; chunk <= 64; chunk++, runs++) check_chunked(parser, chunk);
+  for (size_t chunk = 65; chunk < streamLength; chunk = chunk * 2 + 13, runs++) {
+    check_chunked(parser, chunk);
+  }
+  check_chunked(parser, streamLength);
+  runs++;
+
+  /* Statistics carry on across resets: one frame dropped per run */
+  adts_stats_t stats;
+  ASADTSParserGetStats(parser, &stats);
+  CHECK(stats.droppedFrames == runs);
+  CHECK(stats.frames == runs * packetCount);
+  ASADTSParserDestroy(parser);
+  return TEST_RESULT();
+}
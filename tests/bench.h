@@ -0,0 +1,72 @@
+//
+//  bench.h
+//  AudioStreamer
+//
+
+#ifndef AS_BENCH_H
+#define AS_BENCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "test.h"
+
+/*
+ * What the benchmarks share: the fixtures in tests/fixtures, a monotonic
+ * clock, and a loop which runs a piece of work until the timing settles.
+ * Benchmarks print their figures and check only that the work they timed
+ * came out right, so `make bench` fails on a wrong answer but never on a
+ * slow machine.
+ */
+
+#ifndef AS_FIXTURES
+#define AS_FIXTURES "tests/fixtures"
+#endif
+
+/* Runs of the work are repeated for at least this long */
+#define kBenchSeconds 0.5
+
+static inline double bench_now(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double)now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* Reads a whole fixture into memory. Returns NULL, having counted a
+   failure, if it can't be read */
+static inline uint8_t *bench_read_fixture(const char *name, size_t *length) {
+  char path[1024];
+  snprintf(path, sizeof(path), "%s/%s", AS_FIXTURES, name);
+  FILE *file = fopen(path, "rb");
+  CHECK(file != NULL);
+  if (file == NULL) return NULL;
+  fseek(file, 0, SEEK_END);
+  *length = (size_t)ftell(file);
+  fseek(file, 0, SEEK_SET);
+  uint8_t *data = malloc(*length);
+  CHECK(data != NULL && fread(data, 1, *length, file) == *length);
+  fclose(file);
+  return data;
+}
+
+/* Runs the work at least three times and for kBenchSeconds, and returns the
+   fastest run in seconds. The first run warms the caches and isn't counted */
+static inline double bench_best(void (*work)(void *context), void *context) {
+  work(context);
+  double best = -1, start = bench_now();
+  for (int runs = 0; runs < 3 || bench_now() - start < kBenchSeconds; runs++) {
+    double begin = bench_now();
+    work(context);
+    double elapsed = bench_now() - begin;
+    if (best < 0 || elapsed < best) best = elapsed;
+  }
+  return best;
+}
+
+/* Prints one line of results as megabytes of input a second */
+static inline void bench_report(const char *name, size_t bytes, double seconds) {
+  printf("%-32s %10.1f MB/s\n", name, bytes / seconds / 1e6);
+}
+
+#endif
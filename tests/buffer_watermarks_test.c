@@ -0,0 +1,266 @@
+//
+//  buffer_watermarks_test.c
+//  AudioStreamer
+//
+//  Stalls and memory with ASBufferController's watermarks, against fixed
+//  buffering. An hour of 128 kbps playback is simulated on four links: a
+//  steady one, and three whose bandwidth wanders every few seconds and which
+//  drop out now and then. Each link is played twice:
+//
+//    fixed       - starts once 0.84 seconds are buffered and buffers at most
+//                  6.7 seconds, whatever the link is doing
+//    controller  - starts at the low watermark and buffers up to the high
+//                  one, as AudioStreamer does
+//
+//  Audio is counted in seconds rather than bytes, and time moves in 50 ms
+//  steps. Each link is played for five hours from fixed seeds, so every run
+//  gives the same table, which is printed. The controller has to stall at
+//  most half as often as fixed buffering on the lossy links, and neither
+//  its stalls nor the audio it holds may go past the limits recorded below.
+//  On the steady link it has to hold less than fixed buffering does.
+//
+//  The simulated links can't tell the parts of the low watermark apart, so
+//  how each moves it is checked directly first.
+//
+//  The controller holds more on the lossy links: riding out an outage
+//  takes as many seconds of audio as the outage lasts, and these links drop
+//  out for up to 13 to 40 seconds. The limits are there so that holding
+//  more than that for no fewer stalls is caught.
+//
+
+#include "ASBufferController.h"
+#include "test.h"
+
+#include <math.h>
+#include <stdbool.h>
+
+#define kBitrate 128000.0
+#define kStep 0.05
+#define kHour 3600.0
+#define kMaxHigh 60.0         /* ASBufferController's */
+
+typedef enum {
+  LINK_STEADY,
+  LINK_LOSSY,         /* around 200 kbps, short outages */
+  LINK_SLOW_LOSSY,    /* around 140 kbps, shorter and rarer outages */
+  LINK_BURSTY,        /* around 400 kbps but all over the place, long outages */
+  LINK_COUNT
+} link_kind_t;
+
+static const char *const kLinkNames[LINK_COUNT] = {
+  "steady", "lossy", "slow lossy", "bursty",
+};
+
+/* The controller's recorded stalls per hour and mean seconds buffered, with
+   some room */
+static const struct {
+  unsigned stalls;
+  double   meanBuffered;
+} kLimits[LINK_COUNT] = {
+  [LINK_STEADY]     = {0, 6.5},
+  [LINK_LOSSY]      = {10, 20},
+  [LINK_SLOW_LOSSY] = {5, 23},
+  [LINK_BURSTY]     = {17, 35},
+};
+
+typedef struct link_state {
+  link_kind_t kind;
+  uint32_t seed;
+  double bandwidth;
+  double nextChange;
+  double outageEnd;
+} link_state_t;
+
+typedef struct result {
+  unsigned stalls;
+  double   meanBuffered;      /* seconds */
+  double   waiting;           /* seconds, starting and after stalls */
+} result_t;
+
+static double uniform(link_state_t *link) {
+  return test_random(&link->seed) / (double)UINT32_MAX;
+}
+
+/* Bandwidth in bits per second at a time, which only ever moves forwards */
+static double link_bandwidth(link_state_t *link, double now) {
+  if (link->kind == LINK_STEADY) return 1e6;
+  if (now >= link->nextChange) {
+    link->nextChange = now + 1 + uniform(link) * 3;
+    switch (link->kind) {
+      case LINK_LOSSY:
+        link->bandwidth = 200e3 * exp((uniform(link) - 0.5) * 2.0);
+        if (uniform(link) < 0.03) link->outageEnd = now + 5 + uniform(link) * 15;
+        break;
+      case LINK_SLOW_LOSSY:
+        link->bandwidth = 140e3 * exp((uniform(link) - 0.5) * 1.0);
+        if (uniform(link) < 0.02) link->outageEnd = now + 3 + uniform(link) * 10;
+        break;
+      case LINK_BURSTY:
+        link->bandwidth = 400e3 * exp((uniform(link) - 0.5) * 3.0);
+        if (uniform(link) < 0.05) link->outageEnd = now + 10 + uniform(link) * 30;
+        break;
+      default:
+        break;
+    }
+  }
+  if (now < link->outageEnd) return 0;
+  return link->bandwidth;
+}
+
+static result_t play_hour(link_kind_t kind, uint32_t seed, bool controlled) {
+  result_t result = {0};
+  link_state_t link = {.kind = kind, .seed = seed, .outageEnd = -1};
+  buffer_controller_t *controller = ASBufferControllerCreate();
+  CHECK(controller != NULL);
+  if (controller == NULL) return result;
+  ASBufferControllerSetBitrate(controller, kBitrate);
+
+  double buffered = 0;        /* seconds */
+  bool playing = false;
+  double bufferedTotal = 0;
+  double high = 6.7;
+  double low = 0.84;
+  for (double now = 0; now < kHour; now += kStep) {
+    if (controlled) {
+      buffer_watermarks_t watermarks;
+      ASBufferControllerGetWatermarks(controller, &watermarks);
+      CHECK(watermarks.low > 0 && watermarks.low <= watermarks.high &&
+            watermarks.high <= kMaxHigh);
+      high = watermarks.high;
+      low = watermarks.low;
+    }
+
+    double bandwidth = link_bandwidth(&link, now);
+    if (buffered < high) {
+      double arrived = bandwidth * kStep / kBitrate;
+      buffered += arrived;
+      if (arrived > 0) {
+        ASBufferControllerAddBytes(controller, (size_t)(arrived * kBitrate / 8),
+                                   now);
+      }
+    } else {
+      ASBufferControllerIdle(controller);
+    }
+
+    if (playing) {
+      buffered -= kStep;
+      if (buffered <= 0) {
+        buffered = 0;
+        playing = false;
+        result.stalls++;
+        ASBufferControllerStall(controller);
+      }
+    } else {
+      result.waiting += kStep;
+      if (buffered >= low) playing = true;
+    }
+    bufferedTotal += buffered;
+  }
+  if (controlled && kind == LINK_STEADY) {
+    double deviation;
+    double throughput = ASBufferControllerThroughput(controller, &deviation);
+    CHECK(fabs(throughput - 1e6) < 1e4 && deviation < 1e4);
+    CHECK(ASBufferControllerThroughput(controller, NULL) == throughput);
+  }
+  ASBufferControllerDestroy(controller);
+  result.meanBuffered = bufferedTotal / (kHour / kStep);
+  return result;
+}
+
+/* Feeds the controller a steady rate for a while, in 50 ms reads */
+static double feed(buffer_controller_t *controller, double now, double seconds,
+                   double bitrate) {
+  for (double end = now + seconds; now < end; now += kStep) {
+    ASBufferControllerAddBytes(controller, (size_t)(bitrate * kStep / 8), now);
+  }
+  return now;
+}
+
+static void get_watermarks(buffer_controller_t *controller, double *low, double *high) {
+  buffer_watermarks_t watermarks;
+  ASBufferControllerGetWatermarks(controller, &watermarks);
+  *low = watermarks.low;
+  *high = watermarks.high;
+}
+
+static void test_watermarks(void) {
+  buffer_controller_t *controller = ASBufferControllerCreate();
+  CHECK(controller != NULL);
+  if (controller == NULL) return;
+  ASBufferControllerSetBitrate(controller, kBitrate);
+  double low, high;
+  /* Nothing known yet */
+  CHECK(ASBufferControllerThroughput(controller, NULL) == 0);
+  get_watermarks(controller, &low, &high);
+  CHECK(low == 1.5 && high == 12);
+
+  /* A fast steady network needs little */
+  double now = feed(controller, 0, 30, 8 * kBitrate);
+  double fastLow, fastHigh;
+  get_watermarks(controller, &fastLow, &fastHigh);
+  CHECK(fastLow < 1.6 && fabs(fastHigh - 6) < 0.01);
+
+  /* Each stall adds to the low watermark, for a while */
+  ASBufferControllerStall(controller);
+  get_watermarks(controller, &low, &high);
+  CHECK(fabs(low - fastLow - 3) < 0.01 && high == 2 * low);
+  now = feed(controller, now, 120, 8 * kBitrate);
+  get_watermarks(controller, &low, &high);
+  CHECK(low < fastLow + 0.5);
+
+  /* A gap in the middle of reading is ridden out */
+  now = feed(controller, now + 10, 5, 8 * kBitrate);
+  get_watermarks(controller, &low, &high);
+  CHECK(low >= fastLow + 5 && high >= 15);
+  ASBufferControllerDestroy(controller);
+
+  /* A network slower than the stream is given a minute's run */
+  controller = ASBufferControllerCreate();
+  ASBufferControllerSetBitrate(controller, kBitrate);
+  feed(controller, 0, 60, 0.75 * kBitrate);
+  get_watermarks(controller, &low, &high);
+  CHECK(low > 0.25 * 60 && low < 0.25 * 60 + 3);
+  CHECK(high > 45);
+  ASBufferControllerDestroy(controller);
+}
+
+static void print_result(link_kind_t kind, const char *buffering, const result_t *r) {
+  printf("%-10s  %-10s  %6u  %8.1f  %7.0f  %9.0f\n", kLinkNames[kind], buffering,
+         r->stalls, r->meanBuffered, r->meanBuffered * kBitrate / 8 / 1024, r->waiting);
+}
+
+int main(void) {
+  test_watermarks();
+
+  static const uint32_t seeds[] = {42, 7, 1234, 99, 2024};
+  const size_t seedCount = sizeof(seeds) / sizeof(seeds[0]);
+  printf("Per hour, over %zu hours of each link\n", seedCount);
+  printf("%-10s  %-10s  %6s  %8s  %7s  %9s\n", "link", "buffering",
+         "stalls", "mean s", "mean KB", "waiting s");
+  for (int kind = 0; kind < LINK_COUNT; kind++) {
+    result_t fixed = {0}, controlled = {0};
+    for (size_t i = 0; i < seedCount; i++) {
+      result_t f = play_hour(kind, seeds[i], false);
+      result_t c = play_hour(kind, seeds[i], true);
+      fixed.stalls += f.stalls;
+      fixed.meanBuffered += f.meanBuffered / seedCount;
+      fixed.waiting += f.waiting / seedCount;
+      controlled.stalls += c.stalls;
+      controlled.meanBuffered += c.meanBuffered / seedCount;
+      controlled.waiting += c.waiting / seedCount;
+    }
+    fixed.stalls = (unsigned)lround(fixed.stalls / (double)seedCount);
+    controlled.stalls = (unsigned)lround(controlled.stalls / (double)seedCount);
+    print_result(kind, "fixed", &fixed);
+    print_result(kind, "controller", &controlled);
+
+    CHECK(controlled.stalls <= kLimits[kind].stalls);
+    CHECK(controlled.meanBuffered <= kLimits[kind].meanBuffered);
+    if (kind == LINK_STEADY) {
+      CHECK(fixed.stalls == 0 && controlled.meanBuffered < fixed.meanBuffered);
+    } else {
+      CHECK(controlled.stalls * 2 <= fixed.stalls);
+    }
+  }
+  return TEST_RESULT();
+}
@@ -0,0 +1,117 @@
+//
+//  crossfade_test.c
+//  AudioStreamer
+//
+//  Fades one stream out and another in over the same frames, processing
+//  blocks of random sizes, and checks that the summed power stays at 1 all
+//  the way through, that the curves start and end where they should, and
+//  what happens after the end, on a restart and on a cancel.
+//
+
+#include "ASCrossfade.h"
+#include "test.h"
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#define kChannels  2
+#define kMaxBlock  3000
+
+/* Runs a block of constant 1.0 samples through the fader and returns the
+   gains it applied, checking every channel got the same one */
+static void process(crossfade_t *fade, uint32_t frames, float *gains) {
+  static float left[kMaxBlock], right[kMaxBlock];
+  for (uint32_t i = 0; i < frames; i++) left[i] = right[i] = 1.0f;
+  float *channels[kChannels] = {left, right};
+  ASCrossfadeProcess(fade, channels, kChannels, frames);
+  bool same = true;
+  for (uint32_t i = 0; i < frames; i++) {
+    same = same && left[i] == right[i];
+    gains[i] = left[i];
+  }
+  CHECK(same);
+}
+
+static void test_equal_power(uint64_t length, uint32_t *seed) {
+  crossfade_t *out = ASCrossfadeCreate();
+  crossfade_t *in = ASCrossfadeCreate();
+  ASCrossfadeStart(out, CROSSFADE_OUT, length);
+  ASCrossfadeStart(in, CROSSFADE_IN, length);
+
+  static float outGains[kMaxBlock], inGains[kMaxBlock];
+  float worst = 0, lastOut = 1, lastIn = 0;
+  bool monotonic = true, settled = true;
+  uint64_t position = 0;
+  while (position < length + 2000) {
+    uint32_t frames = 1 + test_random_below(seed, kMaxBlock);
+    process(out, frames, outGains);
+    process(in, frames, inGains);
+    for (uint32_t i = 0; i < frames; i++, position++) {
+      if (position == 0) {
+        CHECK(outGains[i] == 1.0f && inGains[i] == 0.0f);
+      }
+      if (position < length) {
+        float power = outGains[i] * outGains[i] + inGains[i] * inGains[i];
+        if (fabsf(power - 1.0f) > worst) worst = fabsf(power - 1.0f);
+        monotonic = monotonic && outGains[i] <= lastOut && inGains[i] >= lastIn;
+        lastOut = outGains[i];
+        lastIn = inGains[i];
+        /* Halfway, both are at -3 dB */
+        if (position == length / 2 && length % 2 == 0) {
+          CHECK(fabsf(outGains[i] - (float)M_SQRT1_2) < 1e-4f);
+          CHECK(fabsf(inGains[i] - (float)M_SQRT1_2) < 1e-4f);
+        }
+      } else {
+        /* After the end, silence going out and untouched coming in */
+        settled = settled && outGains[i] == 0.0f && inGains[i] == 1.0f;
+      }
+    }
+  }
+  CHECK(worst < 1e-4f);
+  CHECK(monotonic);
+  CHECK(settled);
+  /* One frame before the end, each is one step from its final value */
+  CHECK(lastOut <= sinf((float)M_PI_2 / (float)length) + 1e-4f);
+  CHECK(lastIn >= cosf((float)M_PI_2 / (float)length) - 1e-4f);
+  ASCrossfadeDestroy(out);
+  ASCrossfadeDestroy(in);
+}
+
+static void test_restart_and_cancel(void) {
+  static float gains[kMaxBlock];
+  crossfade_t *fade = ASCrossfadeCreate();
+
+  /* Nothing started: untouched */
+  process(fade, 100, gains);
+  CHECK(gains[0] == 1.0f && gains[99] == 1.0f);
+
+  /* A new fade replaces one half done, starting from its own beginning */
+  ASCrossfadeStart(fade, CROSSFADE_OUT, 1000);
+  process(fade, 500, gains);
+  CHECK(gains[499] < 0.75f);
+  ASCrossfadeStart(fade, CROSSFADE_IN, 1000);
+  process(fade, 10, gains);
+  CHECK(gains[0] == 0.0f && gains[9] > 0.0f);
+
+  /* Cancelling leaves the audio alone from the next block */
+  ASCrossfadeStart(fade, CROSSFADE_NONE, 0);
+  process(fade, 10, gains);
+  CHECK(gains[0] == 1.0f && gains[9] == 1.0f);
+
+  /* So does a fade of no length */
+  ASCrossfadeStart(fade, CROSSFADE_OUT, 0);
+  process(fade, 10, gains);
+  CHECK(gains[0] == 1.0f);
+  ASCrossfadeDestroy(fade);
+}
+
+int main(void) {
+  uint32_t seed = 4242;
+  const uint64_t lengths[] = {1, 2, 255, 256, 257, 4410, 44100, 441000};
+  for (size_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+    test_equal_power(lengths[i], &seed);
+  }
+  test_restart_and_cancel();
+  return TEST_RESULT();
+}
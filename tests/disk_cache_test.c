@@ -0,0 +1,313 @@
+//
+//  disk_cache_test.c
+//  AudioStreamer
+//
+//  What ASDiskCache keeps of a remote file: the byte ranges written to it,
+//  merged and read back whatever order they arrive in, kept from one session
+//  to the next while the length and validator stay the same, and whole files
+//  evicted least recently used first to stay under the size limit, never
+//  while they are open.
+//
+
+#include "ASDiskCache.h"
+#include "test.h"
+
+#include <dirent.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define kLength 100000
+
+static char directory[] = "/tmp/disk_cache_test.XXXXXX";
+static uint8_t file[kLength];
+
+static char *path_for(const char *key, const char *extension) {
+  /* Entries are named after the FNV-1a hash of their key */
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (const char *c = key; *c != '\0'; c++) {
+    hash ^= (uint8_t)*c;
+    hash *= 0x100000001b3ULL;
+  }
+  static char path[256];
+  snprintf(path, sizeof(path), "%s/%016llx.%s", directory,
+           (unsigned long long)hash, extension);
+  return path;
+}
+
+/* Makes an entry look as though it was last used at the given time */
+static void set_last_used(const char *key, uint64_t lastUsed) {
+  FILE *index = fopen(path_for(key, "index"), "r+b");
+  CHECK(index != NULL);
+  if (index == NULL) return;
+  fseek(index, 8, SEEK_SET);
+  fwrite(&lastUsed, sizeof(lastUsed), 1, index);
+  fclose(index);
+}
+
+static void remove_directory(void) {
+  DIR *dir = opendir(directory);
+  if (dir == NULL) return;
+  struct dirent *d;
+  char path[512];
+  while ((d = readdir(dir)) != NULL) {
+    if (d->d_name[0] == '.') continue;
+    snprintf(path, sizeof(path), "%s/%s", directory, d->d_name);
+    unlink(path);
+  }
+  closedir(dir);
+  rmdir(directory);
+}
+
+/* Whether what the entry says is cached matches which bytes were written */
+static void check_ranges(const disk_cache_entry_t *entry, const bool *written,
+                         uint32_t *seed) {
+  for (int i = 0; i < 2000; i++) {
+    uint64_t offset = test_random_below(seed, kLength);
+    uint64_t end = offset;
+    while (end < kLength && written[end] == written[offset]) end++;
+
+    const uint8_t *bytes = NULL;
+    uint64_t n = ASDiskCacheEntryRead(entry, offset, &bytes);
+    uint64_t next = ASDiskCacheEntryNextCached(entry, offset);
+    if (written[offset]) {
+      CHECK(n == end - offset && next == offset);
+      CHECK(bytes != NULL && memcmp(bytes, file + offset, (size_t)n) == 0);
+    } else {
+      CHECK(n == 0 && next == end);
+    }
+  }
+}
+
+static void test_ranges(disk_cache_t *cache) {
+  disk_cache_entry_t *entry = ASDiskCacheOpenEntry(cache, "http://a/ranges");
+  CHECK(entry != NULL);
+  if (entry == NULL) return;
+  CHECK(ASDiskCacheOpenEntry(cache, "http://a/ranges") == NULL);
+  CHECK(ASDiskCacheEntryLength(entry) == 0);
+  CHECK(!ASDiskCacheEntryWrite(entry, 0, file, 100));
+  CHECK(ASDiskCacheEntrySetInfo(entry, kLength, "\"v1\"", "headers", 7));
+
+  /* Pieces which touch, overlap, swallow others and fill gaps */
+  static bool written[kLength];
+  memset(written, 0, sizeof(written));
+  uint32_t seed = 5;
+  uint64_t stored = 0;
+  for (int i = 0; i < 300 && !ASDiskCacheEntryComplete(entry); i++) {
+    uint32_t offset = test_random_below(&seed, kLength);
+    uint32_t length = 1 + test_random_below(&seed, i < 200 ? 500 : 5000);
+    if (offset + length > kLength) length = kLength - offset;
+    CHECK(ASDiskCacheEntryWrite(entry, offset, file + offset, length));
+    stored += length;
+    for (uint32_t b = offset; b < offset + length; b++) written[b] = true;
+    if (i % 20 == 0) check_ranges(entry, written, &seed);
+  }
+  check_ranges(entry, written, &seed);
+  CHECK(!ASDiskCacheEntryComplete(entry));
+
+  /* Bytes past the end are dropped */
+  uint8_t tail[20] = {0};
+  memcpy(tail, file + kLength - 10, 10);
+  CHECK(ASDiskCacheEntryWrite(entry, kLength - 10, tail, sizeof(tail)));
+  CHECK(ASDiskCacheEntryWrite(entry, kLength, file, 10));
+  stored += 10;
+  for (uint64_t offset = 0; offset < kLength;) {
+    uint64_t start = ASDiskCacheEntryNextCached(entry, offset);
+    CHECK(ASDiskCacheEntryWrite(entry, offset, file + offset,
+                                (size_t)(start - offset)));
+    stored += start - offset;
+    const uint8_t *bytes;
+    uint64_t n = ASDiskCacheEntryRead(entry, offset, &bytes);
+    CHECK(n > 0);
+    if (n == 0) break;
+    offset += n;
+  }
+  CHECK(ASDiskCacheEntryComplete(entry));
+  const uint8_t *bytes;
+  CHECK(ASDiskCacheEntryRead(entry, 0, &bytes) == kLength);
+  CHECK(memcmp(bytes, file, kLength) == 0);
+  CHECK(ASDiskCacheEntryNextCached(entry, kLength) == kLength);
+
+  disk_cache_stats_t stats;
+  ASDiskCacheGetStats(cache, &stats);
+  CHECK(stats.missBytes == stored && stats.hitBytes == 0);
+  CHECK(ASDiskCacheHitRate(cache) == 0);
+  ASDiskCacheEntryCountHit(entry, stored);
+  ASDiskCacheGetStats(cache, &stats);
+  CHECK(stats.hitBytes == stored && ASDiskCacheHitRate(cache) == 0.5);
+  ASDiskCacheCloseEntry(entry);
+}
+
+static void test_sessions(disk_cache_t *cache) {
+  const char *key = "http://a/sessions";
+  disk_cache_entry_t *entry = ASDiskCacheOpenEntry(cache, key);
+  CHECK(entry != NULL);
+  if (entry == NULL) return;
+  CHECK(ASDiskCacheEntrySetInfo(entry, kLength, "\"v1\"", "abc", 3));
+  CHECK(ASDiskCacheEntryWrite(entry, 1000, file + 1000, 2000));
+  CHECK(ASDiskCacheEntryWrite(entry, 50000, file + 50000, 100));
+  ASDiskCacheCloseEntry(entry);
+
+  /* Everything comes back in the next session */
+  entry = ASDiskCacheOpenEntry(cache, key);
+  CHECK(entry != NULL);
+  if (entry == NULL) return;
+  CHECK(ASDiskCacheEntryLength(entry) == kLength);
+  CHECK(strcmp(ASDiskCacheEntryValidator(entry), "\"v1\"") == 0);
+  size_t metadataLength;
+  const void *metadata = ASDiskCacheEntryMetadata(entry, &metadataLength);
+  CHECK(metadataLength == 3 && memcmp(metadata, "abc", 3) == 0);
+  const uint8_t *bytes;
+  CHECK(ASDiskCacheEntryRead(entry, 1500, &bytes) == 1500);
+  CHECK(memcmp(bytes, file + 1500, 1500) == 0);
+  CHECK(ASDiskCacheEntryNextCached(entry, 3000) == 50000);
+
+  /* The same file keeps what is cached, though the metadata can change */
+  CHECK(ASDiskCacheEntrySetInfo(entry, kLength, "\"v1\"", "de", 2));
+  metadata = ASDiskCacheEntryMetadata(entry, &metadataLength);
+  CHECK(metadataLength == 2 && memcmp(metadata, "de", 2) == 0);
+  CHECK(ASDiskCacheEntryRead(entry, 1000, &bytes) == 2000);
+
+  /* A new validator or length throws it away */
+  CHECK(ASDiskCacheEntrySetInfo(entry, kLength, "\"v2\"", NULL, 0));
+  CHECK(ASDiskCacheEntryRead(entry, 1000, &bytes) == 0);
+  CHECK(ASDiskCacheEntryNextCached(entry, 0) == kLength);
+  ASDiskCacheEntryMetadata(entry, &metadataLength);
+  CHECK(metadataLength == 0);
+  CHECK(ASDiskCacheEntryWrite(entry, 0, file, 100));
+  CHECK(ASDiskCacheEntrySetInfo(entry, kLength - 1, "\"v2\"", NULL, 0));
+  CHECK(ASDiskCacheEntryRead(entry, 0, &bytes) == 0);
+  CHECK(ASDiskCacheEntryWrite(entry, 0, file, 100));
+  ASDiskCacheCloseEntry(entry);
+
+  /* An index which doesn't describe the data file is ignored */
+  CHECK(truncate(path_for(key, "data"), 10) == 0);
+  entry = ASDiskCacheOpenEntry(cache, key);
+  CHECK(entry != NULL);
+  if (entry == NULL) return;
+  CHECK(ASDiskCacheEntryRead(entry, 0, &bytes) == 0);
+  CHECK(ASDiskCacheEntryWrite(entry, 0, file, 100));
+  ASDiskCacheCloseEntry(entry);
+
+  /* As is one which isn't an index at all */
+  FILE *index = fopen(path_for(key, "index"), "wb");
+  CHECK(index != NULL);
+  if (index != NULL) {
+    fputs("not an index", index);
+    fclose(index);
+  }
+  entry = ASDiskCacheOpenEntry(cache, key);
+  CHECK(entry != NULL);
+  if (entry == NULL) return;
+  CHECK(ASDiskCacheEntryLength(entry) == 0);
+  CHECK(ASDiskCacheEntryValidator(entry) == NULL);
+
+  /* A file bigger than the whole cache isn't kept */
+  CHECK(!ASDiskCacheEntrySetInfo(entry, 1ULL << 40, "\"v3\"", NULL, 0));
+  CHECK(ASDiskCacheEntryLength(entry) == 0);
+  CHECK(!ASDiskCacheEntryWrite(entry, 0, file, 100));
+  ASDiskCacheCloseEntry(entry);
+}
+
+/* Stores the whole of a file, and makes it look last used at a time */
+static void store(disk_cache_t *cache, const char *key, uint64_t lastUsed) {
+  disk_cache_entry_t *entry = ASDiskCacheOpenEntry(cache, key);
+  CHECK(entry != NULL);
+  if (entry == NULL) return;
+  CHECK(ASDiskCacheEntrySetInfo(entry, kLength, "\"v1\"", NULL, 0));
+  CHECK(ASDiskCacheEntryWrite(entry, 0, file, kLength));
+  ASDiskCacheCloseEntry(entry);
+  set_last_used(key, lastUsed);
+}
+
+static bool is_cached(disk_cache_t *cache, const char *key) {
+  disk_cache_entry_t *entry = ASDiskCacheOpenEntry(cache, key);
+  CHECK(entry != NULL);
+  if (entry == NULL) return false;
+  bool cached = ASDiskCacheEntryComplete(entry);
+  ASDiskCacheCloseEntry(entry);
+  return cached;
+}
+
+static void test_eviction(disk_cache_t *cache) {
+  /* Start from nothing */
+  ASDiskCacheSetSizeLimit(cache, 1);
+
+  /* Each file takes a little over kLength on disk, so three fit */
+  ASDiskCacheSetSizeLimit(cache, 4 * kLength - 1);
+  store(cache, "http://a/1", 1000);
+  store(cache, "http://a/3", 3000);
+  store(cache, "http://a/2", 2000);
+  disk_cache_stats_t stats;
+  ASDiskCacheGetStats(cache, &stats);
+  uint64_t evictions = stats.evictions;
+
+  /* Room for a fourth is made by evicting the oldest */
+  disk_cache_entry_t *entry = ASDiskCacheOpenEntry(cache, "http://a/4");
+  CHECK(entry != NULL);
+  if (entry == NULL) return;
+  CHECK(ASDiskCacheEntrySetInfo(entry, kLength, "\"v1\"", NULL, 0));
+  ASDiskCacheGetStats(cache, &stats);
+  CHECK(stats.evictions == evictions + 1);
+  CHECK(access(path_for("http://a/1", "index"), F_OK) != 0);
+  CHECK(access(path_for("http://a/1", "data"), F_OK) != 0);
+  CHECK(access(path_for("http://a/2", "index"), F_OK) == 0);
+  CHECK(access(path_for("http://a/3", "index"), F_OK) == 0);
+  CHECK(ASDiskCacheEntryWrite(entry, 0, file, kLength));
+
+  /* What is open stays, however small the limit */
+  ASDiskCacheSetSizeLimit(cache, 1);
+  CHECK(access(path_for("http://a/2", "index"), F_OK) != 0);
+  CHECK(access(path_for("http://a/3", "index"), F_OK) != 0);
+  const uint8_t *bytes;
+  CHECK(ASDiskCacheEntryRead(entry, 0, &bytes) == kLength);
+  CHECK(memcmp(bytes, file, kLength) == 0);
+  ASDiskCacheCloseEntry(entry);
+  CHECK(access(path_for("http://a/4", "index"), F_OK) != 0);
+  ASDiskCacheGetStats(cache, &stats);
+  CHECK(stats.evictions == evictions + 4);
+
+  /* Opening a cache trims it to the limit too, */
+  ASDiskCacheSetSizeLimit(cache, 4 * kLength - 1);
+  store(cache, "http://a/1", 1000);
+  store(cache, "http://a/2", 2000);
+  ASDiskCacheDestroy(cache);
+  /* and clears out anything which isn't an entry */
+  FILE *stray = fopen(path_for("http://a/stray", "index"), "wb");
+  CHECK(stray != NULL);
+  if (stray != NULL) fclose(stray);
+  cache = ASDiskCacheCreate(directory, 2 * kLength - 1);
+  CHECK(cache != NULL);
+  if (cache == NULL) return;
+  CHECK(access(path_for("http://a/stray", "index"), F_OK) != 0);
+  CHECK(access(path_for("http://a/1", "index"), F_OK) != 0);
+  CHECK(is_cached(cache, "http://a/2"));
+
+  /* A cache closed with an entry open lasts until the entry is closed */
+  entry = ASDiskCacheOpenEntry(cache, "http://a/2");
+  CHECK(entry != NULL);
+  ASDiskCacheDestroy(cache);
+  if (entry != NULL) {
+    CHECK(ASDiskCacheEntryComplete(entry));
+    ASDiskCacheCloseEntry(entry);
+  }
+}
+
+int main(void) {
+  if (mkdtemp(directory) == NULL) {
+    perror("mkdtemp");
+    return 1;
+  }
+  uint32_t seed = 1;
+  for (size_t i = 0; i < kLength; i++) file[i] = (uint8_t)test_random(&seed);
+
+  disk_cache_t *cache = ASDiskCacheCreate(directory, 16 * kLength);
+  CHECK(cache != NULL);
+  if (cache != NULL) {
+    test_ranges(cache);
+    test_sessions(cache);
+    test_eviction(cache);
+  }
+  remove_directory();
+  return TEST_RESULT();
+}
@@ -0,0 +1,164 @@
+//
+//  gapless_test.c
+//  AudioStreamer
+//
+//  Checks where gapless playback gets its numbers and what it does with them:
+//  the LAME tag behind a Xing header, found by ASSeekIndex whatever pieces
+//  the file arrives in; iTunSMPB comments; and the trim worked out for runs
+//  of decoded frames, which has to keep exactly the valid frames and nothing
+//  else, however the stream is cut into buffers.
+//
+
+#include "ASGapless.h"
+#include "ASSeekIndex.h"
+#include "test.h"
+#include "test_streams.h"
+
+#define kFramesPerPacket 1152
+#define kPackets         100
+#define kDelay           677
+#define kPadding         1200
+
+/* A tag, then a Xing frame with a frame count, a byte count and a LAME tag
+   giving kDelay and kPadding */
+static size_t build_file(uint8_t *file, size_t *dataOffset) {
+  uint32_t seed = 99;
+  size_t length = test_write_id3(file, 200);
+  *dataOffset = length;
+  test_mp3_frame_t f = {.mpeg1 = true, .rateIndex = 0, .bitrateIndex = 9};
+  uint8_t *p = file + length;
+  length += test_write_xing_frame(p, &f, &seed);
+
+  uint8_t *xing = p + 4 + 32;
+  const uint8_t fields[] = {
+    0, 0, 0, 0x3,                     /* flags: frames and bytes */
+    0, 0, 0, kPackets,
+    0, 0, 0xA2, 0xE4,                 /* 100 frames of 417 bytes */
+  };
+  memcpy(xing + 4, fields, sizeof(fields));
+  uint8_t *lame = xing + 4 + sizeof(fields);
+  memset(lame, 0, 24);
+  memcpy(lame, "LAME3.100", 9);
+  lame[21] = kDelay >> 4;
+  lame[22] = (uint8_t)(((kDelay & 0xF) << 4) | (kPadding >> 8));
+  lame[23] = kPadding & 0xFF;
+
+  for (int i = 0; i < kPackets; i++) {
+    length += test_write_mp3_frame(file + length, &f, false, &seed);
+  }
+  return length;
+}
+
+static void test_lame_tag(void) {
+  static uint8_t file[64 * 1024];
+  size_t dataOffset;
+  size_t length = build_file(file, &dataOffset);
+  seek_index_t *index = ASSeekIndexCreate();
+  CHECK(index != NULL);
+
+  for (size_t chunk = 1; chunk <= 600; chunk += chunk < 64 ? 1 : 37) {
+    ASSeekIndexReset(index);
+    /* The data offset is learnt part way through, as AudioFileStream does */
+    bool done = false;
+    for (size_t offset = 0; offset < length && !done; offset += chunk) {
+      if (offset >= dataOffset / 2) ASSeekIndexSetDataOffset(index, dataOffset);
+      size_t n = length - offset < chunk ? length - offset : chunk;
+      done = ASSeekIndexScanHeader(index, offset, file + offset, n);
+    }
+    CHECK(done);
+    uint32_t delay = 0, padding = 0;
+    CHECK(ASSeekIndexEncoderDelay(index, &delay, &padding));
+    CHECK(delay == kDelay && padding == kPadding);
+    CHECK(ASSeekIndexPacketCount(index) == kPackets);
+  }
+
+  /* Without the tag there is nothing to trim */
+  memset(file + dataOffset + 4 + 32 + 16, 0, 4);
+  ASSeekIndexReset(index);
+  ASSeekIndexSetDataOffset(index, dataOffset);
+  CHECK(ASSeekIndexScanHeader(index, 0, file, length));
+  uint32_t delay, padding;
+  CHECK(!ASSeekIndexEncoderDelay(index, &delay, &padding));
+  ASSeekIndexDestroy(index);
+}
+
+static void test_itunsmpb(void) {
+  gapless_info_t info;
+  const char *text = " 00000000 00000840 000001CA 00000000003F9EB6 00000000"
+                     " 00000000 00000000 00000000";
+  CHECK(ASGaplessParseITunSMPB(text, &info));
+  CHECK(info.priming == 0x840 && info.validFrames == 0x3F9EB6);
+  CHECK(ASGaplessIsKnown(&info));
+  CHECK(!ASGaplessParseITunSMPB(" 00000000 00000000 00000000 0000000000000000",
+                                &info));
+  CHECK(!ASGaplessParseITunSMPB(" 00000000 00000840", &info));
+  CHECK(!ASGaplessParseITunSMPB("not a number", &info));
+}
+
+/* Cuts frameCount decoded frames into buffers of random length and checks
+   that what is kept after trimming is exactly the valid frames */
+static void check_trim(const gapless_info_t *info, uint64_t frameCount,
+                       uint32_t *seed) {
+  uint64_t keptFrom = UINT64_MAX, keptTo = 0, kept = 0;
+  for (uint64_t first = 0; first < frameCount;) {
+    uint64_t n = 1 + test_random_below(seed, 3 * kFramesPerPacket);
+    if (n > frameCount - first) n = frameCount - first;
+    uint32_t start, end;
+    ASGaplessTrim(info, first, n, &start, &end);
+    CHECK(start + end <= n);
+    if (start + end < n) {
+      /* What is kept is one run, so it can't have a gap in the middle */
+      CHECK(keptFrom == UINT64_MAX || first + start == keptTo);
+      if (keptFrom == UINT64_MAX) keptFrom = first + start;
+      keptTo = first + n - end;
+      kept += n - start - end;
+    }
+    first += n;
+  }
+  CHECK(keptFrom == info->priming);
+  uint64_t valid = info->validFrames > 0 ? info->validFrames
+                                         : frameCount - info->priming;
+  CHECK(kept == valid);
+}
+
+static void test_trim(void) {
+  uint32_t seed = 31;
+  gapless_info_t info;
+  uint64_t total = (uint64_t)kPackets * kFramesPerPacket;
+  ASGaplessFromLAME(&info, kDelay, kPadding, total);
+  CHECK(info.priming == kDelay + kMP3DecoderDelay);
+  CHECK(info.validFrames == total - kDelay - kPadding);
+  /* The decoder delay shifts everything, so there are that many frames more
+     to decode at the end */
+  for (int i = 0; i < 100; i++) {
+    check_trim(&info, total + kMP3DecoderDelay, &seed);
+  }
+
+  /* Without a total, only the start is trimmed */
+  ASGaplessFromLAME(&info, kDelay, kPadding, 0);
+  CHECK(info.validFrames == 0);
+  for (int i = 0; i < 100; i++) check_trim(&info, total, &seed);
+
+  /* Exactly on the boundaries */
+  info.priming = 2112;
+  info.validFrames = 10000;
+  uint32_t start, end;
+  ASGaplessTrim(&info, 0, 2112, &start, &end);
+  CHECK(start == 2112 && end == 0);
+  ASGaplessTrim(&info, 2112, 1024, &start, &end);
+  CHECK(start == 0 && end == 0);
+  ASGaplessTrim(&info, 12112, 1024, &start, &end);
+  CHECK(start + end == 1024);
+  ASGaplessTrim(&info, 12000, 1024, &start, &end);
+  CHECK(start == 0 && end == 1024 - 112);
+  /* A buffer holding the whole track */
+  ASGaplessTrim(&info, 0, 20000, &start, &end);
+  CHECK(start == 2112 && end == 20000 - 12112);
+}
+
+int main(void) {
+  test_lame_tag();
+  test_itunsmpb();
+  test_trim();
+  return TEST_RESULT();
+}
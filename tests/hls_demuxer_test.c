@@ -0,0 +1,194 @@
+//
+//  hls_demuxer_test.c
+//  AudioStreamer
+//
+//  Puts ADTS and MP3 streams into generated HLS segments and takes them out
+//  again: MPEG-2 transport streams, with video and timed ID3 listed ahead of
+//  the audio and PES packets of many sizes, and fragmented MP4 with a video
+//  track first, sizes from the trun or the trex, and data offsets counted
+//  from the moof or given in the file. What comes out has to be the stream
+//  that went in, byte for byte, with AAC's ADTS headers made up again.
+//
+
+#include "ASFMP4Demuxer.h"
+#include "ASTSDemuxer.h"
+#include "test.h"
+#include "test_streams.h"
+
+#define kMaxStream 65536
+#define kMaxSegment (4 * kMaxStream)
+#define kMaxFrames 64
+
+typedef struct stream {
+  uint8_t data[kMaxStream];
+  size_t  length;
+  size_t  frames[kMaxFrames];     /* where each frame starts */
+  size_t  count;
+} stream_t;
+
+static stream_t adts, mp3;
+static uint8_t segment[kMaxSegment];
+
+static uint8_t out[kMaxSegment];
+static size_t outLength;
+
+static void collect(void *context, const uint8_t *bytes, size_t length) {
+  (void)context;
+  CHECK(outLength + length <= sizeof(out));
+  if (outLength + length > sizeof(out)) return;
+  memcpy(out + outLength, bytes, length);
+  outLength += length;
+}
+
+static void make_streams(void) {
+  uint32_t seed = 23;
+  adts.length = adts.count = 0;
+  for (size_t i = 0; i < 40; i++) {
+    adts.frames[adts.count++] = adts.length;
+    adts.length += test_write_adts_frame(adts.data + adts.length,
+                                         100 + test_random_below(&seed, 600), 4, 2, &seed);
+  }
+  /* Constant bitrate without padding, so every frame is the same size */
+  mp3.length = mp3.count = 0;
+  test_mp3_frame_t f = {.mpeg1 = true, .bitrateIndex = 9};
+  for (size_t i = 0; i < 40; i++) {
+    mp3.frames[mp3.count++] = mp3.length;
+    mp3.length += test_write_mp3_frame(mp3.data + mp3.length, &f, false, &seed);
+  }
+}
+
+static void test_ts(void) {
+  const size_t pesSizes[] = {50, 170, 171, 172, 500, 4000, kMaxStream};
+  const struct {
+    uint8_t streamType;
+    const stream_t *stream;
+    ts_audio_type_t type;
+  } cases[] = {
+    {0x0F, &adts, TS_AUDIO_ADTS},
+    {0x03, &mp3, TS_AUDIO_MPEG},
+    {0x04, &mp3, TS_AUDIO_MPEG},
+  };
+  uint32_t seed = 230;
+  for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+    for (size_t s = 0; s < sizeof(pesSizes) / sizeof(pesSizes[0]); s++) {
+      const stream_t *stream = cases[c].stream;
+      size_t length = test_write_ts(segment, cases[c].streamType, stream->data,
+                                    stream->length, pesSizes[s], &seed);
+      CHECK(length % 188 == 0 && length <= sizeof(segment));
+      CHECK(ASTSDemuxerProbe(segment, length));
+      outLength = 0;
+      CHECK(ASTSDemuxSegment(segment, length, collect, NULL) == cases[c].type);
+      CHECK(outLength == stream->length && memcmp(out, stream->data, outLength) == 0);
+    }
+  }
+
+  /* Bytes out of sync between packets are skipped */
+  size_t length = test_write_ts(segment, 0x0F, adts.data, adts.length, 1000, &seed);
+  memmove(segment + 2 * 188 + 5, segment + 2 * 188, length - 2 * 188);
+  memset(segment + 2 * 188, 0, 5);
+  outLength = 0;
+  CHECK(ASTSDemuxSegment(segment, length + 5, collect, NULL) == TS_AUDIO_ADTS);
+  CHECK(outLength == adts.length && memcmp(out, adts.data, outLength) == 0);
+
+  /* AC-3 can't be played, and nothing comes out */
+  length = test_write_ts(segment, 0x81, adts.data, adts.length, 1000, &seed);
+  outLength = 0;
+  CHECK(ASTSDemuxSegment(segment, length, collect, NULL) == TS_AUDIO_NONE);
+  CHECK(outLength == 0);
+
+  CHECK(!ASTSDemuxerProbe(adts.data, adts.length));
+  CHECK(!ASTSDemuxerProbe(segment, 100));
+}
+
+/* Writes an init section and a media segment of fragments, the samples
+   being the stream's frames without their ADTS headers if it's AAC */
+static void write_fmp4(test_boxes_t *w, test_fmp4_codec_t codec, const stream_t *stream,
+                       bool defaultSizes, bool based, size_t *segmentStart) {
+  const uint32_t trackID = 7;
+  size_t header = codec == TEST_FMP4_AAC ? 7 : 0;
+  test_box_begin(w, "ftyp");
+  test_put_bytes(w, "iso6", 4);
+  test_put32(w, 0);
+  test_box_end(w);
+  test_write_fmp4_moov(w, codec, trackID,
+                       defaultSizes ? (uint32_t)(stream->frames[1] - header) : 0);
+  *segmentStart = w->length;
+  test_box_begin(w, "styp");
+  test_put_bytes(w, "msdh", 4);
+  test_box_end(w);
+
+  /* Three fragments of uneven numbers of samples */
+  const size_t splits[] = {0, 1, 17, stream->count};
+  for (size_t f = 0; f + 1 < sizeof(splits) / sizeof(splits[0]); f++) {
+    const uint8_t *samples[kMaxFrames];
+    size_t sizes[kMaxFrames];
+    for (size_t i = splits[f]; i < splits[f + 1]; i++) {
+      size_t end = i + 1 < stream->count ? stream->frames[i + 1] : stream->length;
+      samples[i - splits[f]] = stream->data + stream->frames[i] + header;
+      sizes[i - splits[f]] = end - stream->frames[i] - header;
+    }
+    test_write_fmp4_fragment(w, trackID, samples, sizes, splits[f + 1] - splits[f],
+                             defaultSizes, based ? 0 : UINT64_MAX);
+  }
+}
+
+static void test_fmp4(void) {
+  const struct {
+    test_fmp4_codec_t codec;
+    const stream_t *stream;
+    fmp4_codec_t expected;
+    bool defaultSizes;
+    bool based;
+  } cases[] = {
+    {TEST_FMP4_AAC, &adts, FMP4_CODEC_AAC, false, false},
+    {TEST_FMP4_AAC, &adts, FMP4_CODEC_AAC, false, true},
+    {TEST_FMP4_MP3, &mp3, FMP4_CODEC_MPEG, false, false},
+    {TEST_FMP4_MP3, &mp3, FMP4_CODEC_MPEG, true, false},
+    {TEST_FMP4_MP3, &mp3, FMP4_CODEC_MPEG, true, true},
+  };
+  for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+    test_boxes_t w = {.data = segment};
+    size_t start;
+    write_fmp4(&w, cases[c].codec, cases[c].stream, cases[c].defaultSizes,
+               cases[c].based, &start);
+    fmp4_demuxer_t *demuxer = ASFMP4DemuxerCreate();
+    CHECK(demuxer != NULL);
+    if (demuxer == NULL) return;
+    CHECK(ASFMP4DemuxerProbe(segment, start));
+    CHECK(ASFMP4DemuxerProbe(segment + start, w.length - start));
+
+    /* Not without the init section */
+    outLength = 0;
+    CHECK(!ASFMP4DemuxSegment(demuxer, segment + start, w.length - start, start,
+                              collect, NULL));
+    CHECK(ASFMP4DemuxerInit(demuxer, segment, start) == cases[c].expected);
+    CHECK(ASFMP4DemuxSegment(demuxer, segment + start, w.length - start, start,
+                             collect, NULL));
+    CHECK(outLength == cases[c].stream->length &&
+          memcmp(out, cases[c].stream->data, outLength) == 0);
+
+    /* A segment cut short in its last mdat */
+    outLength = 0;
+    CHECK(!ASFMP4DemuxSegment(demuxer, segment + start, w.length - start - 100, start,
+                              collect, NULL) ||
+          outLength < cases[c].stream->length);
+    ASFMP4DemuxerDestroy(demuxer);
+  }
+
+  /* An init section without a sound track */
+  fmp4_demuxer_t *demuxer = ASFMP4DemuxerCreate();
+  test_boxes_t w = {.data = segment};
+  test_box_begin(&w, "moov");
+  test_box_filler(&w, "mvhd", 100);
+  test_box_end(&w);
+  CHECK(ASFMP4DemuxerInit(demuxer, segment, w.length) == FMP4_CODEC_NONE);
+  CHECK(!ASFMP4DemuxerProbe(adts.data, adts.length));
+  ASFMP4DemuxerDestroy(demuxer);
+}
+
+int main(void) {
+  make_streams();
+  test_ts();
+  test_fmp4();
+  return TEST_RESULT();
+}
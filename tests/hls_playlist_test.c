@@ -0,0 +1,196 @@
+//
+//  hls_playlist_test.c
+//  AudioStreamer
+//
+//  Parses HLS playlists: URL resolution against the playlist's own URL,
+//  which media playlist a master playlist leads to, and what a media
+//  playlist says of each segment (durations, sequence numbers, byte ranges
+//  following on from each other, initialization sections, discontinuities,
+//  encryption and the end of the list), with CRLF line ends and a byte
+//  order mark thrown in.
+//
+
+#include "ASHLSPlaylist.h"
+#include "test.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void test_resolve(void) {
+  const char *base = "http://example.com:8000/a/b/list.m3u8?token=1";
+  const struct {
+    const char *url;
+    const char *expected;
+  } cases[] = {
+    {"seg1.ts", "http://example.com:8000/a/b/seg1.ts"},
+    {"hi/seg1.ts?x=2", "http://example.com:8000/a/b/hi/seg1.ts?x=2"},
+    {"../c/seg.ts", "http://example.com:8000/a/c/seg.ts"},
+    {"./../../../seg.ts", "http://example.com:8000/seg.ts"},
+    {"/live/seg.aac", "http://example.com:8000/live/seg.aac"},
+    {"//cdn.example.net/x.ts", "http://cdn.example.net/x.ts"},
+    {"?token=2", "http://example.com:8000/a/b/list.m3u8?token=2"},
+    {"https://other.example/y.ts", "https://other.example/y.ts"},
+  };
+  for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    char *url = ASHLSResolveURL(base, cases[i].url);
+    CHECK(url != NULL && strcmp(url, cases[i].expected) == 0);
+    if (url != NULL && strcmp(url, cases[i].expected) != 0) {
+      fprintf(stderr, "%s -> %s\n", cases[i].url, url);
+    }
+    free(url);
+  }
+  /* A base without a path gets a slash */
+  char *url = ASHLSResolveURL("http://example.com", "seg.ts");
+  CHECK(url != NULL && strcmp(url, "http://example.com/seg.ts") == 0);
+  free(url);
+  CHECK(ASHLSResolveURL("not a url", "seg.ts") == NULL);
+}
+
+static hls_playlist_t *parse(const char *text) {
+  return ASHLSPlaylistParse(text, strlen(text), "http://example.com/hls/master.m3u8");
+}
+
+static void test_master(void) {
+  /* The default audio rendition, whatever the variants are */
+  hls_playlist_t *pl = parse(
+    "#EXTM3U\n"
+    "#EXT-X-MEDIA:TYPE=AUDIO,GROUP-ID=\"aac\",NAME=\"English\",URI=\"en/audio.m3u8\"\n"
+    "#EXT-X-MEDIA:TYPE=SUBTITLES,GROUP-ID=\"subs\",NAME=\"English\",DEFAULT=YES,URI=\"subs.m3u8\"\n"
+    "#EXT-X-MEDIA:TYPE=AUDIO,GROUP-ID=\"aac\",NAME=\"Deutsch\",DEFAULT=YES,URI=\"de/audio.m3u8\"\n"
+    "#EXT-X-MEDIA:TYPE=AUDIO,GROUP-ID=\"aac\",NAME=\"Other\",DEFAULT=YES,URI=\"fr/audio.m3u8\"\n"
+    "#EXT-X-STREAM-INF:BANDWIDTH=800000,CODECS=\"avc1.4d401f,mp4a.40.2\",AUDIO=\"aac\"\n"
+    "video/800.m3u8\n");
+  CHECK(pl != NULL && pl->master);
+  if (pl != NULL) {
+    CHECK(pl->variantCount == 1 && pl->segmentCount == 0);
+    CHECK(strcmp(ASHLSPlaylistMediaURL(pl), "http://example.com/hls/de/audio.m3u8") == 0);
+    ASHLSPlaylistFree(pl);
+  }
+
+  /* The audio-only variant with the most bandwidth */
+  pl = parse(
+    "#EXTM3U\n"
+    "#EXT-X-STREAM-INF:BANDWIDTH=64000,CODECS=\"mp4a.40.5\"\n"
+    "audio/64.m3u8\n"
+    "#EXT-X-STREAM-INF:BANDWIDTH=1200000,CODECS=\"avc1.4d401f,mp4a.40.2\"\n"
+    "video/1200.m3u8\n"
+    "#EXT-X-STREAM-INF:CODECS=\"mp4a.40.2, mp4a.40.2\",BANDWIDTH=128000,NAME=\"x,y\"\n"
+    "audio/128.m3u8\n"
+    "#EXT-X-STREAM-INF:BANDWIDTH=32000,CODECS=\"mp4a.40.29\"\n"
+    "audio/32.m3u8\n");
+  CHECK(pl != NULL && pl->master);
+  if (pl != NULL) {
+    CHECK(pl->variantCount == 4);
+    CHECK(pl->variantCount == 4 && pl->variants[2].audioOnly && !pl->variants[1].audioOnly &&
+          pl->variants[2].bandwidth == 128000);
+    CHECK(strcmp(ASHLSPlaylistMediaURL(pl), "http://example.com/hls/audio/128.m3u8") == 0);
+    ASHLSPlaylistFree(pl);
+  }
+
+  /* Otherwise the variant with the least, as only its audio is wanted */
+  pl = parse(
+    "#EXTM3U\n"
+    "#EXT-X-STREAM-INF:BANDWIDTH=2400000\n"
+    "high.m3u8\n"
+    "#EXT-X-STREAM-INF:BANDWIDTH=400000,CODECS=\"avc1.42e00a,mp4a.40.2\"\n"
+    "low.m3u8\n"
+    "#EXT-X-STREAM-INF:BANDWIDTH=1200000\n"
+    "mid.m3u8\n");
+  CHECK(pl != NULL && pl->master);
+  if (pl != NULL) {
+    CHECK(strcmp(ASHLSPlaylistMediaURL(pl), "http://example.com/hls/low.m3u8") == 0);
+    ASHLSPlaylistFree(pl);
+  }
+}
+
+static void test_media(void) {
+  /* With a byte order mark and CRLF line ends */
+  const char *text =
+    "\xEF\xBB\xBF#EXTM3U\r\n"
+    "#EXT-X-VERSION:7\r\n"
+    "#EXT-X-TARGETDURATION:6\r\n"
+    "#EXT-X-MEDIA-SEQUENCE:1000\r\n"
+    "#EXT-X-MAP:URI=\"init.mp4\",BYTERANGE=\"800@0\"\r\n"
+    "#EXTINF:5.5,\r\n"
+    "#EXT-X-BYTERANGE:20000@800\r\n"
+    "main.mp4\r\n"
+    "#EXTINF:6.0,title\r\n"
+    "#EXT-X-BYTERANGE:30000\r\n"
+    "main.mp4\r\n"
+    "  #EXT-X-PROGRAM-DATE-TIME:2026-01-01T00:00:00Z  \r\n"
+    "#EXTINF:4.25,\r\n"
+    "#EXT-X-BYTERANGE:1000\r\n"
+    "other.mp4\r\n"
+    "\r\n"
+    "#EXT-X-DISCONTINUITY\r\n"
+    "#EXT-X-MAP:URI=\"../init2.mp4\"\r\n"
+    "#EXTINF:6,\r\n"
+    "http://cdn.example.net/last.mp4\r\n"
+    "#EXT-X-ENDLIST\r\n";
+  hls_playlist_t *pl = parse(text);
+  CHECK(pl != NULL && !pl->master);
+  if (pl == NULL) return;
+  CHECK(pl->targetDuration == 6 && pl->mediaSequence == 1000);
+  CHECK(pl->ended && !pl->encrypted);
+  CHECK(pl->segmentCount == 4);
+  if (pl->segmentCount == 4) {
+    const hls_segment_t *s = pl->segments;
+    CHECK(strcmp(s[0].url, "http://example.com/hls/main.mp4") == 0);
+    CHECK(s[0].duration == 5.5 && s[0].sequence == 1000);
+    CHECK(s[0].offset == 800 && s[0].length == 20000);
+    CHECK(strcmp(s[0].mapURL, "http://example.com/hls/init.mp4") == 0);
+    CHECK(s[0].mapOffset == 0 && s[0].mapLength == 800);
+    /* Following on from the last range of the same file */
+    CHECK(s[1].sequence == 1001 && s[1].offset == 20800 && s[1].length == 30000);
+    /* ... but not from one of another */
+    CHECK(s[2].duration == 4.25 && s[2].offset == 0 && s[2].length == 1000);
+    CHECK(!s[2].discontinuity && s[3].discontinuity);
+    CHECK(strcmp(s[3].url, "http://cdn.example.net/last.mp4") == 0);
+    CHECK(s[3].length == 0 && s[3].sequence == 1003);
+    CHECK(strcmp(s[3].mapURL, "http://example.com/init2.mp4") == 0 &&
+          s[3].mapLength == 0);
+  }
+  CHECK(fabs(ASHLSPlaylistDuration(pl) - 21.75) < 1e-9);
+  ASHLSPlaylistFree(pl);
+
+  /* A live playlist, without a sequence number or an end */
+  pl = parse(
+    "#EXTM3U\n"
+    "#EXT-X-TARGETDURATION:10\n"
+    "#EXTINF:10,\nlive0.aac\n"
+    "#EXTINF:10,\nlive1.aac\n");
+  CHECK(pl != NULL && !pl->ended && pl->mediaSequence == 0 && pl->segmentCount == 2);
+  if (pl != NULL && pl->segmentCount == 2) {
+    CHECK(pl->segments[1].sequence == 1 && pl->segments[1].mapURL == NULL);
+  }
+  ASHLSPlaylistFree(pl);
+
+  /* Keys make the segments after them encrypted, and METHOD=NONE stops it */
+  pl = parse(
+    "#EXTM3U\n"
+    "#EXTINF:10,\na.ts\n"
+    "#EXT-X-KEY:METHOD=NONE\n"
+    "#EXTINF:10,\nb.ts\n");
+  CHECK(pl != NULL && !pl->encrypted);
+  ASHLSPlaylistFree(pl);
+  pl = parse(
+    "#EXTM3U\n"
+    "#EXTINF:10,\na.ts\n"
+    "#EXT-X-KEY:METHOD=AES-128,URI=\"key.bin\",IV=0x00000000000000000000000000000001\n"
+    "#EXTINF:10,\nb.ts\n");
+  CHECK(pl != NULL && pl->encrypted && pl->segmentCount == 2);
+  ASHLSPlaylistFree(pl);
+
+  /* Not playlists */
+  CHECK(parse("") == NULL);
+  CHECK(parse("[playlist]\nFile1=http://example.com/stream\n") == NULL);
+  CHECK(parse("#EXTM3") == NULL);
+}
+
+int main(void) {
+  test_resolve();
+  test_master();
+  test_media();
+  return TEST_RESULT();
+}
@@ -0,0 +1,461 @@
+//
+//  hls_transport_test.c
+//  AudioStreamer
+//
+//  Plays generated HLS streams through ASHLSTransport from a loopback
+//  server: a master playlist leading to a VOD audio rendition of transport
+//  stream segments; fragmented MP4 in one file, read in byte ranges after
+//  an EXT-X-MAP, from a server with ranges and from one without; packed MP3
+//  with ID3 timestamps, started part way in; and a live playlist whose
+//  window moves on with every reload until it ends. Each has to read back
+//  as the audio that went in, in order and without gaps, with no more
+//  segments downloading at once than asked for. Missing segments and
+//  playlists, and encryption, fail the transport.
+//
+
+#include "ASHLSTransport.h"
+#include "test.h"
+#include "test_server.h"
+#include "test_streams.h"
+
+#include <time.h>
+
+#define kMaxFiles  64
+#define kPoolSize  (4 << 20)
+#define kMaxOutput (1 << 20)
+#define kLiveWindow 5
+#define kLiveReloads 4          /* the playlist ends on this load */
+
+typedef struct file {
+  char           path[64];
+  const uint8_t *data;
+  size_t         length;
+} file_t;
+
+static file_t files[kMaxFiles];
+static size_t fileCount;
+static uint8_t pool[kPoolSize];
+static size_t poolUsed;
+
+static test_server_t *server;
+
+/* Segment responses being sent right now, and the most there have been */
+static atomic_int inFlight;
+static atomic_int maxInFlight;
+static atomic_int rangeRequests;
+static atomic_int liveLoads;
+
+/* What each stream ought to read back as */
+static uint8_t tsAudio[kMaxOutput], fmp4Audio[kMaxOutput], packedAudio[kMaxOutput],
+               liveAudio[kMaxOutput];
+static size_t tsLength, fmp4Length, packedLength, liveLength;
+/* Where each packed and live segment's audio starts in the above */
+static size_t packedStarts[8], liveStarts[16];
+
+static uint8_t *pool_alloc(size_t length) {
+  CHECK(poolUsed + length <= kPoolSize);
+  uint8_t *p = pool + poolUsed;
+  poolUsed += length;
+  return p;
+}
+
+static void add_file(const char *path, const uint8_t *data, size_t length) {
+  CHECK(fileCount < kMaxFiles);
+  file_t *f = &files[fileCount++];
+  snprintf(f->path, sizeof(f->path), "%s", path);
+  f->data = data;
+  f->length = length;
+}
+
+static void add_text(const char *path, const char *text) {
+  size_t length = strlen(text);
+  uint8_t *copy = pool_alloc(length);
+  memcpy(copy, text, length);
+  add_file(path, copy, length);
+}
+
+static const file_t *find_file(const char *path) {
+  for (size_t i = 0; i < fileCount; i++) {
+    if (strcmp(files[i].path, path) == 0) return &files[i];
+  }
+  return NULL;
+}
+
+static bool send_file(int fd, const test_request_t *request, const uint8_t *data,
+                      size_t length, bool ranges) {
+  if (!request->hasRange || !ranges) {
+    return test_sendf(fd, "HTTP/1.1 200 OK\r\nContent-Length: %zu\r\n\r\n", length) &&
+           test_send(fd, data, length);
+  }
+  atomic_fetch_add(&rangeRequests, 1);
+  uint64_t start = request->rangeStart;
+  uint64_t end = request->rangeEnd < length ? request->rangeEnd : length - 1;
+  return test_sendf(fd, "HTTP/1.1 206 Partial Content\r\n"
+                        "Content-Range: bytes %llu-%llu/%zu\r\n"
+                        "Content-Length: %llu\r\n\r\n",
+                    (unsigned long long)start, (unsigned long long)end, length,
+                    (unsigned long long)(end - start + 1)) &&
+         test_send(fd, data + start, (size_t)(end - start + 1));
+}
+
+/* The live playlist moves on a segment with each load, and ends on the
+   last */
+static bool send_live_playlist(int fd) {
+  int load = atomic_fetch_add(&liveLoads, 1);
+  if (load >= kLiveReloads) load = kLiveReloads - 1;
+  char text[1024];
+  int length = snprintf(text, sizeof(text),
+                        "#EXTM3U\n#EXT-X-TARGETDURATION:1\n#EXT-X-MEDIA-SEQUENCE:%d\n",
+                        load);
+  for (int i = load; i < load + kLiveWindow; i++) {
+    length += snprintf(text + length, sizeof(text) - (size_t)length,
+                       "#EXTINF:1.0,\nlive/%d.aac\n", i);
+  }
+  if (load == kLiveReloads - 1) {
+    length += snprintf(text + length, sizeof(text) - (size_t)length, "#EXT-X-ENDLIST\n");
+  }
+  return test_sendf(fd, "HTTP/1.1 200 OK\r\nContent-Length: %d\r\n\r\n", length) &&
+         test_send(fd, text, (size_t)length);
+}
+
+static bool handle(void *context, int fd, const test_request_t *request) {
+  (void)context;
+  const char *path = request->path;
+  if (strcmp(path, "/live.m3u8") == 0) return send_live_playlist(fd);
+  /* The same file as /single.mp4, from a server without ranges */
+  bool ranges = strncmp(path, "/norange", 8) != 0;
+  const file_t *f = find_file(ranges ? path : path + 8);
+  if (f == NULL) {
+    return test_sendf(fd, "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n");
+  }
+  if (strstr(path, ".m3u8") != NULL) return send_file(fd, request, f->data, f->length, true);
+
+  /* Segments take a while, so that prefetching shows */
+  int now = atomic_fetch_add(&inFlight, 1) + 1;
+  int most = atomic_load(&maxInFlight);
+  while (now > most && !atomic_compare_exchange_weak(&maxInFlight, &most, now)) {}
+  const struct timespec pause = {0, 30000000};
+  nanosleep(&pause, NULL);
+  bool ok = send_file(fd, request, f->data, f->length, ranges);
+  atomic_fetch_sub(&inFlight, 1);
+  return ok;
+}
+
+/* Writes a run of ADTS frames into out, returning their length */
+static size_t write_adts(uint8_t *out, size_t frames, uint32_t *seed) {
+  size_t length = 0;
+  for (size_t i = 0; i < frames; i++) {
+    length += test_write_adts_frame(out + length, 50 + test_random_below(seed, 400), 4, 2,
+                                    seed);
+  }
+  return length;
+}
+
+static void make_ts_stream(uint32_t *seed) {
+  char playlist[2048] = "#EXTM3U\n#EXT-X-TARGETDURATION:10\n#EXT-X-PLAYLIST-TYPE:VOD\n";
+  for (int i = 0; i < 6; i++) {
+    uint8_t *audio = tsAudio + tsLength;
+    size_t length = write_adts(audio, 10 + test_random_below(seed, 20), seed);
+    tsLength += length;
+    uint8_t *segment = pool_alloc(4 * length + 4096);
+    size_t size = test_write_ts(segment, 0x0F, audio, length, 1500, seed);
+    char path[64];
+    snprintf(path, sizeof(path), "/audio/seg%d.ts", i);
+    add_file(path, segment, size);
+    snprintf(playlist + strlen(playlist), sizeof(playlist) - strlen(playlist),
+             "#EXTINF:10.0,\nseg%d.ts\n", i);
+  }
+  strcat(playlist, "#EXT-X-ENDLIST\n");
+  add_text("/audio/index.m3u8", playlist);
+  add_text("/master.m3u8",
+           "#EXTM3U\n"
+           "#EXT-X-MEDIA:TYPE=AUDIO,GROUP-ID=\"a\",NAME=\"Main\",DEFAULT=YES,"
+           "URI=\"audio/index.m3u8\"\n"
+           "#EXT-X-STREAM-INF:BANDWIDTH=900000,CODECS=\"avc1.4d401f,mp4a.40.2\",AUDIO=\"a\"\n"
+           "video/index.m3u8\n");
+}
+
+/* One file holding the init section and a fragment per segment, alternate
+   fragments giving their base offset in the file */
+static void make_fmp4_stream(uint32_t *seed) {
+  test_boxes_t w = {.data = pool_alloc(1 << 20)};
+  test_write_fmp4_moov(&w, TEST_FMP4_AAC, 1, 0);
+  char playlist[2048];
+  snprintf(playlist, sizeof(playlist),
+           "#EXTM3U\n#EXT-X-VERSION:7\n#EXT-X-TARGETDURATION:4\n"
+           "#EXT-X-MAP:URI=\"single.mp4\",BYTERANGE=\"%zu@0\"\n", w.length);
+  for (int i = 0; i < 5; i++) {
+    const uint8_t *samples[40];
+    size_t sizes[40];
+    size_t count = 5 + test_random_below(seed, 30);
+    for (size_t s = 0; s < count; s++) {
+      size_t frame = write_adts(fmp4Audio + fmp4Length, 1, seed);
+      samples[s] = fmp4Audio + fmp4Length + 7;
+      sizes[s] = frame - 7;
+      fmp4Length += frame;
+    }
+    size_t start = w.length;
+    test_write_fmp4_fragment(&w, 1, samples, sizes, count, false, i % 2 ? 0 : UINT64_MAX);
+    /* Ranges after the first follow on from the one before */
+    if (i == 0) {
+      snprintf(playlist + strlen(playlist), sizeof(playlist) - strlen(playlist),
+               "#EXTINF:4.0,\n#EXT-X-BYTERANGE:%zu@%zu\nsingle.mp4\n", w.length - start,
+               start);
+    } else {
+      snprintf(playlist + strlen(playlist), sizeof(playlist) - strlen(playlist),
+               "#EXTINF:4.0,\n#EXT-X-BYTERANGE:%zu\nsingle.mp4\n", w.length - start);
+    }
+  }
+  add_file("/single.mp4", w.data, w.length);
+  strcat(playlist, "#EXT-X-ENDLIST\n");
+  add_text("/fmp4.m3u8", playlist);
+  /* The same segments, from the server without ranges */
+  char norange[2048] = "";
+  for (char *line = strtok(playlist, "\n"); line != NULL; line = strtok(NULL, "\n")) {
+    strcat(norange, strcmp(line, "single.mp4") == 0 ? "/norange/single.mp4" : line);
+    strcat(norange, "\n");
+  }
+  char *map = strstr(norange, "URI=\"single.mp4\"");
+  if (map != NULL) {
+    memmove(map + strlen("URI=\"/norange/"), map + strlen("URI=\""),
+            strlen(map + strlen("URI=\"")) + 1);
+    memcpy(map, "URI=\"/norange/", strlen("URI=\"/norange/"));
+  }
+  add_text("/fmp4-norange.m3u8", norange);
+}
+
+/* MP3 segments, each after an ID3 tag, 10 seconds apiece */
+static void make_packed_stream(uint32_t *seed) {
+  char playlist[1024] = "#EXTM3U\n#EXT-X-TARGETDURATION:10\n";
+  test_mp3_frame_t f = {.mpeg1 = true, .bitrateIndex = 9};
+  for (int i = 0; i < 5; i++) {
+    uint8_t *segment = pool_alloc(65536);
+    size_t size = test_write_id3(segment, 60);
+    packedStarts[i] = packedLength;
+    size_t frames = 5 + test_random_below(seed, 10);
+    for (size_t n = 0; n < frames; n++) {
+      f.padding = test_random_below(seed, 2);
+      size_t length = test_write_mp3_frame(segment + size, &f, false, seed);
+      memcpy(packedAudio + packedLength, segment + size, length);
+      packedLength += length;
+      size += length;
+    }
+    char path[64];
+    snprintf(path, sizeof(path), "/packed/%d.mp3", i);
+    add_file(path, segment, size);
+    snprintf(playlist + strlen(playlist), sizeof(playlist) - strlen(playlist),
+             "#EXTINF:10,\n%d.mp3\n", i);
+  }
+  packedStarts[5] = packedLength;
+  strcat(playlist, "#EXT-X-ENDLIST\n");
+  add_text("/packed/index.m3u8", playlist);
+}
+
+static void make_live_stream(uint32_t *seed) {
+  for (int i = 0; i < kLiveReloads - 1 + kLiveWindow; i++) {
+    uint8_t *segment = pool_alloc(65536);
+    size_t size = test_write_id3(segment, 30);
+    liveStarts[i] = liveLength;
+    size_t length = write_adts(segment + size, 8, seed);
+    memcpy(liveAudio + liveLength, segment + size, length);
+    liveLength += length;
+    char path[64];
+    snprintf(path, sizeof(path), "/live/%d.aac", i);
+    add_file(path, segment, size + length);
+  }
+  liveStarts[kLiveReloads - 1 + kLiveWindow] = liveLength;
+  add_text("/encrypted.m3u8",
+           "#EXTM3U\n#EXT-X-TARGETDURATION:10\n"
+           "#EXT-X-KEY:METHOD=AES-128,URI=\"key\"\n#EXTINF:10,\nlive/0.aac\n"
+           "#EXT-X-ENDLIST\n");
+  add_text("/missing.m3u8",
+           "#EXTM3U\n#EXT-X-TARGETDURATION:10\n#EXTINF:10,\nlive/0.aac\n"
+           "#EXTINF:10,\nnowhere.aac\n#EXT-X-ENDLIST\n");
+}
+
+typedef struct playback {
+  uint8_t *data;
+  size_t   length;
+  bool     end;
+  bool     error;
+} playback_t;
+
+static void on_event(void *context, transport_t *transport, transport_event_t event) {
+  playback_t *playback = context;
+  switch (event) {
+    case TRANSPORT_EVENT_READABLE:
+      for (;;) {
+        ssize_t got = ASTransportRead(transport, playback->data + playback->length,
+                                      kMaxOutput - playback->length);
+        if (got <= 0) break;
+        playback->length += (size_t)got;
+      }
+      break;
+    case TRANSPORT_EVENT_END:
+      playback->end = true;
+      break;
+    case TRANSPORT_EVENT_ERROR:
+      playback->error = true;
+      break;
+  }
+}
+
+/* Plays the path until it ends or fails, returning the transport, still
+   open */
+static transport_t *play(http_client_t *client, playback_t *p, const char *path,
+                         double startTime, unsigned prefetch) {
+  static uint8_t output[kMaxOutput];
+  memset(p, 0, sizeof(*p));
+  p->data = output;
+  atomic_store(&maxInFlight, 0);
+  atomic_store(&rangeRequests, 0);
+  hls_info_t info = {
+    .request = {.url = test_server_url(server, path)},
+    .startTime = startTime,
+    .prefetch = prefetch,
+  };
+  transport_t *transport = ASHLSTransportCreate(client, &info, on_event, p);
+  CHECK(transport != NULL);
+  if (transport == NULL) return NULL;
+  time_t deadline = time(NULL) + 20;
+  while (!p->end && !p->error && time(NULL) < deadline) {
+    ASHTTPClientProcess(client, 100);
+  }
+  CHECK(p->end || p->error);
+  return transport;
+}
+
+static void check_type(transport_t *transport, const char *type) {
+  const char *value = ASTransportHeaderValue(transport, "Content-Type");
+  CHECK(value != NULL && strcmp(value, type) == 0);
+  CHECK(ASTransportStatusCode(transport) == 200);
+}
+
+static void test_master_ts(http_client_t *client) {
+  const unsigned prefetches[] = {1, 2, 4};
+  for (size_t i = 0; i < sizeof(prefetches) / sizeof(prefetches[0]); i++) {
+    playback_t p;
+    transport_t *transport = play(client, &p, "/master.m3u8", 0, prefetches[i]);
+    if (transport == NULL) continue;
+    CHECK(p.end && !p.error);
+    CHECK(p.length == tsLength && memcmp(p.data, tsAudio, tsLength) == 0);
+    check_type(transport, "audio/aac");
+    double duration = 0;
+    CHECK(ASHLSTransportDuration(transport, &duration) && duration == 60);
+    CHECK(ASHLSTransportStartTime(transport) == 0);
+    /* As many segments at once as asked for, and no more */
+    CHECK(atomic_load(&maxInFlight) == (int)prefetches[i]);
+    ASTransportClose(transport);
+  }
+}
+
+static void test_fmp4_ranges(http_client_t *client) {
+  playback_t p;
+  transport_t *transport = play(client, &p, "/fmp4.m3u8", 0, 2);
+  if (transport != NULL) {
+    CHECK(p.end && !p.error);
+    CHECK(p.length == fmp4Length && memcmp(p.data, fmp4Audio, fmp4Length) == 0);
+    check_type(transport, "audio/aac");
+    /* The init section and five segments */
+    CHECK(atomic_load(&rangeRequests) == 6);
+    ASTransportClose(transport);
+  }
+
+  /* The whole file comes back each time, and the range is cut out of it */
+  transport = play(client, &p, "/fmp4-norange.m3u8", 0, 2);
+  if (transport != NULL) {
+    CHECK(p.end && !p.error);
+    CHECK(p.length == fmp4Length && memcmp(p.data, fmp4Audio, fmp4Length) == 0);
+    CHECK(atomic_load(&rangeRequests) == 0);
+    ASTransportClose(transport);
+  }
+}
+
+static void test_packed_seek(http_client_t *client) {
+  /* Times from the start of each segment to the end of the last */
+  const struct { double time; int segment; } cases[] = {
+    {0, 0}, {9.99, 0}, {10, 1}, {25, 2}, {49, 4}, {100, 4},
+  };
+  for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    playback_t p;
+    transport_t *transport = play(client, &p, "/packed/index.m3u8", cases[i].time, 2);
+    if (transport == NULL) continue;
+    size_t start = packedStarts[cases[i].segment];
+    CHECK(p.end && !p.error);
+    CHECK(p.length == packedLength - start &&
+          memcmp(p.data, packedAudio + start, p.length) == 0);
+    check_type(transport, "audio/mpeg");
+    CHECK(ASHLSTransportStartTime(transport) == 10.0 * cases[i].segment);
+    ASTransportClose(transport);
+  }
+}
+
+/* Starts three segments from the end of the first window, and carries on
+   through every reload to the last segment of the last */
+static void test_live(http_client_t *client) {
+  playback_t p;
+  atomic_store(&liveLoads, 0);
+  transport_t *transport = play(client, &p, "/live.m3u8", 0, 2);
+  if (transport == NULL) return;
+  size_t start = liveStarts[kLiveWindow - 3];
+  CHECK(p.end && !p.error);
+  CHECK(p.length == liveLength - start && memcmp(p.data, liveAudio + start, p.length) == 0);
+  check_type(transport, "audio/aac");
+  /* Once it has ended, no more reloads */
+  time_t wait = time(NULL) + 2;
+  while (time(NULL) <= wait) ASHTTPClientProcess(client, 100);
+  CHECK(atomic_load(&liveLoads) == kLiveReloads);
+  double duration;
+  CHECK(ASHLSTransportDuration(transport, &duration) && duration == kLiveWindow);
+  ASTransportClose(transport);
+}
+
+static void test_failures(http_client_t *client) {
+  const struct {
+    const char *path;
+    const char *error;
+  } cases[] = {
+    {"/encrypted.m3u8", "encrypted"},
+    {"/missing.m3u8", "404"},
+    {"/nothing.m3u8", "404"},
+    {"/audio/seg0.ts", "couldn't be read"},
+  };
+  for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    playback_t p;
+    transport_t *transport = play(client, &p, cases[i].path, 0, 2);
+    if (transport == NULL) continue;
+    CHECK(p.error && !p.end);
+    const char *error = ASTransportError(transport);
+    CHECK(error != NULL && strstr(error, cases[i].error) != NULL);
+    ASTransportClose(transport);
+  }
+  /* What arrived before the missing segment is still read */
+  playback_t p;
+  transport_t *transport = play(client, &p, "/missing.m3u8", 0, 1);
+  if (transport != NULL) {
+    CHECK(p.error && p.length == liveStarts[1] && memcmp(p.data, liveAudio, p.length) == 0);
+    ASTransportClose(transport);
+  }
+}
+
+int main(void) {
+  uint32_t seed = 2023;
+  make_ts_stream(&seed);
+  make_fmp4_stream(&seed);
+  make_packed_stream(&seed);
+  make_live_stream(&seed);
+  server = test_server_start(handle, NULL);
+  CHECK(server != NULL);
+  if (server == NULL) return TEST_RESULT();
+  http_client_t *client = ASHTTPClientCreate();
+
+  test_master_ts(client);
+  test_fmp4_ranges(client);
+  test_packed_seek(client);
+  test_live(client);
+  test_failures(client);
+
+  ASHTTPClientDestroy(client);
+  test_server_stop(server);
+  return TEST_RESULT();
+}
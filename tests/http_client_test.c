@@ -0,0 +1,426 @@
+//
+//  http_client_test.c
+//  AudioStreamer
+//
+//  Runs ASHTTPClient against a loopback server which counts the connections
+//  it accepts. Runs of Range requests, and windowed seeks which give up on
+//  each window early, have to share one connection; a long body given up on
+//  must not be read off, nor hold up the next request once its head says
+//  it's long; and chunked bodies, redirects, ICY responses,
+//  Connection: close, a keep-alive connection the server drops, errors and
+//  both kinds of proxy have to come out right. An error response may be
+//  closed from its first event, as AudioStreamer does, with nothing more
+//  heard of it and the next request unharmed.
+//
+
+#include "ASHTTPClient.h"
+#include "test.h"
+#include "test_server.h"
+
+#include <time.h>
+
+#define kFileSize   (1 << 20)
+#define kSmallSize  5000
+
+static uint8_t file[kFileSize];
+static test_server_t *server;
+
+/* The last request target the server saw, and whether it came over SOCKS */
+static pthread_mutex_t lastLock = PTHREAD_MUTEX_INITIALIZER;
+static char lastTarget[1024];
+static bool lastSocks;
+
+static bool send_range(int fd, const test_request_t *request, size_t size) {
+  if (!request->hasRange) {
+    return test_sendf(fd, "HTTP/1.1 200 OK\r\nContent-Length: %zu\r\n\r\n", size) &&
+           test_send(fd, file, size);
+  }
+  uint64_t end = request->rangeEnd < size ? request->rangeEnd : size - 1;
+  uint64_t start = request->rangeStart;
+  return test_sendf(fd, "HTTP/1.1 206 Partial Content\r\n"
+                        "Content-Range: bytes %llu-%llu/%zu\r\n"
+                        "Content-Length: %llu\r\n\r\n",
+                    (unsigned long long)start, (unsigned long long)end, size,
+                    (unsigned long long)(end - start + 1)) &&
+         test_send(fd, file + start, (size_t)(end - start + 1));
+}
+
+static bool handle(void *context, int fd, const test_request_t *request) {
+  (void)context;
+  pthread_mutex_lock(&lastLock);
+  snprintf(lastTarget, sizeof(lastTarget), "%s", request->target);
+  lastSocks = request->socks;
+  pthread_mutex_unlock(&lastLock);
+
+  const char *path = request->path;
+  if (strcmp(path, "/file") == 0) return send_range(fd, request, kFileSize);
+  if (strcmp(path, "/small") == 0) return send_range(fd, request, kSmallSize);
+  if (strcmp(path, "/chunked") == 0) {
+    static const size_t sizes[] = {1, 100, 4096, 7, 30000, 255, 65536, 3};
+    size_t offset = 0;
+    if (!test_sendf(fd, "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n")) {
+      return false;
+    }
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+      if (!test_sendf(fd, "%zx%s\r\n", sizes[i], i == 2 ? ";name=value" : "") ||
+          !test_send(fd, file + offset, sizes[i]) || !test_send(fd, "\r\n", 2)) {
+        return false;
+      }
+      offset += sizes[i];
+    }
+    return test_sendf(fd, "0\r\nX-Trailer: yes\r\n\r\n");
+  }
+  if (strcmp(path, "/redirect") == 0) {
+    return test_sendf(fd, "HTTP/1.1 302 Found\r\nLocation: /small\r\n"
+                          "Content-Length: 5\r\n\r\nmoved");
+  }
+  if (strcmp(path, "/icy") == 0) {
+    test_sendf(fd, "ICY 200 OK\r\nicy-metaint: 8192\r\n\r\n");
+    test_send(fd, file, 20000);
+    return false;
+  }
+  if (strcmp(path, "/close") == 0) {
+    test_sendf(fd, "HTTP/1.1 200 OK\r\nConnection: close\r\nContent-Length: 1000\r\n\r\n");
+    test_send(fd, file, 1000);
+    return false;
+  }
+  if (strcmp(path, "/endless") == 0) {
+    /* Answers late, with a body which never all comes */
+    struct timespec pause = {0, 200000000};
+    nanosleep(&pause, NULL);
+    if (!test_sendf(fd, "HTTP/1.1 200 OK\r\nContent-Length: 1000000000\r\n\r\n") ||
+        !test_send(fd, file, 1000)) {
+      return false;
+    }
+    uint8_t b;
+    while (recv(fd, &b, 1, 0) > 0) {}
+    return false;
+  }
+  if (strcmp(path, "/unavailable") == 0) {
+    return test_sendf(fd, "HTTP/1.1 503 Service Unavailable\r\nRetry-After: 5\r\n"
+                          "Content-Length: 200000\r\n\r\n") &&
+           test_send(fd, file, 200000);
+  }
+  if (strcmp(path, "/stale") == 0) {
+    /* Gives up on the connection when it's reused, without answering */
+    if (request->index > 0) return false;
+    return send_range(fd, request, kSmallSize);
+  }
+  return test_sendf(fd, "HTTP/1.1 404 Not Found\r\nContent-Length: 9\r\n\r\nnot found");
+}
+
+typedef struct fetch {
+  transport_t *transport;
+  uint8_t     *body;
+  size_t       length;
+  size_t       limit;       /* stop reading after this much */
+  bool         end;
+  bool         error;
+} fetch_t;
+
+static void on_event(void *context, transport_t *transport, transport_event_t event) {
+  fetch_t *fetch = context;
+  switch (event) {
+    case TRANSPORT_EVENT_READABLE:
+      while (fetch->length < fetch->limit) {
+        ssize_t got = ASTransportRead(transport, fetch->body + fetch->length,
+                                      fetch->limit - fetch->length);
+        if (got <= 0) break;
+        fetch->length += (size_t)got;
+      }
+      break;
+    case TRANSPORT_EVENT_END:
+      fetch->end = true;
+      break;
+    case TRANSPORT_EVENT_ERROR:
+      fetch->error = true;
+      break;
+  }
+}
+
+/* Opens the URL and runs the client until the body is read up to the limit,
+   or ends, or fails. The transport is left open */
+static void fetch_open(http_client_t *client, fetch_t *fetch, const char *url,
+                       const char *range, const http_request_info_t *proxy,
+                       size_t limit) {
+  static uint8_t body[kFileSize + 100000];
+  memset(fetch, 0, sizeof(*fetch));
+  fetch->body = body;
+  fetch->limit = limit;
+  const char *headers[2] = {"Range", range};
+  http_request_info_t info = {.url = url};
+  if (proxy != NULL) info = *proxy;
+  info.url = url;
+  if (range != NULL) {
+    info.headers = headers;
+    info.headerCount = 1;
+  }
+  fetch->transport = ASHTTPClientOpen(client, &info, on_event, fetch);
+  CHECK(fetch->transport != NULL);
+  if (fetch->transport == NULL) return;
+
+  time_t deadline = time(NULL) + 10;
+  while (!fetch->end && !fetch->error && fetch->length < fetch->limit &&
+         time(NULL) < deadline) {
+    ASHTTPClientProcess(client, 100);
+  }
+  CHECK(time(NULL) < deadline);
+}
+
+/* Fetches the whole body and closes the transport */
+static void fetch(http_client_t *client, fetch_t *fetch, const char *url,
+                  const char *range, const http_request_info_t *proxy) {
+  fetch_open(client, fetch, url, range, proxy, SIZE_MAX);
+  if (fetch->transport == NULL) return;
+  CHECK(fetch->end || fetch->error);
+}
+
+static void fetch_close(fetch_t *fetch) {
+  if (fetch->transport != NULL) ASTransportClose(fetch->transport);
+  fetch->transport = NULL;
+}
+
+static unsigned connections(void) {
+  return atomic_load(&server->connections);
+}
+
+static void test_range_requests(void) {
+  http_client_t *client = ASHTTPClientCreate();
+  unsigned before = connections();
+  uint32_t seed = 1234;
+  fetch_t f;
+  for (int i = 0; i < 20; i++) {
+    uint64_t start = test_random_below(&seed, kFileSize);
+    uint64_t end = start + test_random_below(&seed, 200000);
+    if (end >= kFileSize) end = kFileSize - 1;
+    char range[64];
+    snprintf(range, sizeof(range), "bytes=%llu-%llu", (unsigned long long)start,
+             (unsigned long long)end);
+    fetch(client, &f, test_server_url(server, "/file"), range, NULL);
+    CHECK(f.end && ASTransportStatusCode(f.transport) == 206);
+    CHECK(f.length == end - start + 1 && memcmp(f.body, file + start, f.length) == 0);
+    fetch_close(&f);
+  }
+  CHECK(connections() - before == 1);
+  http_client_stats_t stats;
+  ASHTTPClientGetStats(client, &stats);
+  CHECK(stats.connectionsOpened == 1 && stats.connectionsReused == 19);
+  ASHTTPClientDestroy(client);
+}
+
+/* Seeks read a window at a time. Giving up on a window with less than
+   kDrainLimit (64 KB) of it still to come is cheap, so the connection is
+   kept and the next request goes behind it. The windows are bigger than the
+   client buffers, so some of each really is read off */
+#define kWindow 200000
+
+static void test_windowed_seeks(void) {
+  http_client_t *client = ASHTTPClientCreate();
+  unsigned before = connections();
+  uint32_t seed = 99;
+  fetch_t f;
+  for (int i = 0; i < 30; i++) {
+    uint64_t start = test_random_below(&seed, kFileSize - kWindow);
+    char range[64];
+    snprintf(range, sizeof(range), "bytes=%llu-%llu", (unsigned long long)start,
+             (unsigned long long)start + kWindow - 1);
+    fetch_open(client, &f, test_server_url(server, "/file"), range, NULL,
+               kWindow - 60000 + test_random_below(&seed, 50000));
+    CHECK(f.length > 0 && memcmp(f.body, file + start, f.length) == 0);
+    fetch_close(&f);
+  }
+  CHECK(connections() - before == 1);
+
+  /* Most of a megabyte left isn't worth reading off */
+  fetch_open(client, &f, test_server_url(server, "/file"), NULL, NULL, 1000);
+  fetch_close(&f);
+  fetch(client, &f, test_server_url(server, "/small"), NULL, NULL);
+  CHECK(f.end && f.length == kSmallSize);
+  fetch_close(&f);
+  CHECK(connections() - before == 2);
+  ASHTTPClientDestroy(client);
+
+  /* Given up on before it answers, a request waits on its connection for
+     the head; the next goes behind it. Once the head says the body is too
+     long to read off, the next has to move to a new connection rather than
+     wait on one that never finishes */
+  client = ASHTTPClientCreate();
+  before = connections();
+  memset(&f, 0, sizeof(f));
+  http_request_info_t info = {.url = test_server_url(server, "/endless")};
+  transport_t *endless = ASHTTPClientOpen(client, &info, on_event, &f);
+  CHECK(endless != NULL);
+  for (int i = 0; i < 5; i++) ASHTTPClientProcess(client, 10);
+  CHECK(!f.end && !f.error && ASTransportStatusCode(endless) == 0);
+  ASTransportClose(endless);
+  time_t start = time(NULL);
+  fetch(client, &f, test_server_url(server, "/small"), NULL, NULL);
+  CHECK(f.end && f.length == kSmallSize && time(NULL) - start <= 2);
+  fetch_close(&f);
+  CHECK(connections() - before == 2);
+  ASHTTPClientDestroy(client);
+}
+
+static void test_responses(void) {
+  http_client_t *client = ASHTTPClientCreate();
+  unsigned before = connections();
+  fetch_t f;
+
+  fetch(client, &f, test_server_url(server, "/chunked"), NULL, NULL);
+  CHECK(f.end && f.length == 99998 && memcmp(f.body, file, f.length) == 0);
+  fetch_close(&f);
+
+  /* Followed on the same connection, the body of the redirect unseen */
+  fetch(client, &f, test_server_url(server, "/redirect"), NULL, NULL);
+  CHECK(f.end && ASTransportStatusCode(f.transport) == 200);
+  CHECK(f.length == kSmallSize && memcmp(f.body, file, kSmallSize) == 0);
+  fetch_close(&f);
+
+  fetch(client, &f, test_server_url(server, "/missing"), NULL, NULL);
+  CHECK(f.end && ASTransportStatusCode(f.transport) == 404);
+  CHECK(f.length == 9 && memcmp(f.body, "not found", 9) == 0);
+  fetch_close(&f);
+  CHECK(connections() - before == 1);
+
+  /* Connection: close, then a connection the server drops when it's reused,
+     which is tried again on a new one */
+  fetch(client, &f, test_server_url(server, "/close"), NULL, NULL);
+  CHECK(f.end && f.length == 1000);
+  fetch_close(&f);
+  fetch(client, &f, test_server_url(server, "/stale"), NULL, NULL);
+  CHECK(f.end && f.length == kSmallSize);
+  fetch_close(&f);
+  fetch(client, &f, test_server_url(server, "/stale"), NULL, NULL);
+  CHECK(f.end && f.length == kSmallSize && memcmp(f.body, file, kSmallSize) == 0);
+  fetch_close(&f);
+  /* The first connection, the one after the close and the retry */
+  CHECK(connections() - before == 3);
+
+  /* Not HTTP: all body, up to the close */
+  fetch(client, &f, test_server_url(server, "/icy"), NULL, NULL);
+  CHECK(f.end && ASTransportStatusCode(f.transport) == 200);
+  const char *head = "ICY 200 OK\r\nicy-metaint: 8192\r\n\r\n";
+  size_t headLength = strlen(head);
+  CHECK(f.length == headLength + 20000 && memcmp(f.body, head, headLength) == 0 &&
+        memcmp(f.body + headLength, file, 20000) == 0);
+  fetch_close(&f);
+
+  /* Nobody listening */
+  fetch(client, &f, "http://127.0.0.1:1/", NULL, NULL);
+  CHECK(f.error && ASTransportError(f.transport) != NULL);
+  fetch_close(&f);
+  ASHTTPClientDestroy(client);
+}
+
+/* Closes the transport as soon as the response can be read, the way
+   AudioStreamer gives up on an error status */
+typedef struct refusal {
+  transport_t *transport;
+  int          status;
+  bool         retryAfter;  /* the header was there to read */
+  unsigned     events;      /* after the first */
+} refusal_t;
+
+static void on_refusal(void *context, transport_t *transport,
+                       transport_event_t event) {
+  refusal_t *refusal = context;
+  if (refusal->transport == NULL) {
+    refusal->events++;
+    return;
+  }
+  CHECK(transport == refusal->transport && event == TRANSPORT_EVENT_READABLE);
+  refusal->status = ASTransportStatusCode(transport);
+  const char *value = ASTransportHeaderValue(transport, "retry-after");
+  refusal->retryAfter = value != NULL && strcmp(value, "5") == 0;
+  ASTransportClose(transport);
+  refusal->transport = NULL;
+}
+
+static void refuse(http_client_t *client, const char *path, int status,
+                   bool retryAfter) {
+  refusal_t refusal = {0};
+  http_request_info_t info = {.url = test_server_url(server, path)};
+  refusal.transport = ASHTTPClientOpen(client, &info, on_refusal, &refusal);
+  CHECK(refusal.transport != NULL);
+  if (refusal.transport == NULL) return;
+  time_t deadline = time(NULL) + 10;
+  while (refusal.transport != NULL && time(NULL) < deadline) {
+    ASHTTPClientProcess(client, 100);
+  }
+  CHECK(refusal.transport == NULL && refusal.status == status);
+  CHECK(refusal.retryAfter == retryAfter);
+  /* Nothing more is heard of it */
+  for (int i = 0; i < 3; i++) ASHTTPClientProcess(client, 100);
+  CHECK(refusal.events == 0);
+}
+
+static void test_errors_closed_early(void) {
+  http_client_t *client = ASHTTPClientCreate();
+  unsigned before = connections();
+  fetch_t f;
+
+  /* A short error body is read off and the connection kept */
+  refuse(client, "/missing", 404, false);
+  fetch(client, &f, test_server_url(server, "/small"), NULL, NULL);
+  CHECK(f.end && f.length == kSmallSize && memcmp(f.body, file, kSmallSize) == 0);
+  fetch_close(&f);
+  CHECK(connections() - before == 1);
+
+  /* A long one isn't, and its headers could still be read */
+  refuse(client, "/unavailable", 503, true);
+  fetch(client, &f, test_server_url(server, "/small"), NULL, NULL);
+  CHECK(f.end && f.length == kSmallSize && memcmp(f.body, file, kSmallSize) == 0);
+  fetch_close(&f);
+  CHECK(connections() - before == 2);
+  ASHTTPClientDestroy(client);
+}
+
+static void test_proxies(void) {
+  http_client_t *client = ASHTTPClientCreate();
+  unsigned before = connections();
+  fetch_t f;
+  http_request_info_t proxy = {
+    .proxyType = HTTP_PROXY_HTTP,
+    .proxyHost = "127.0.0.1",
+    .proxyPort = server->port,
+  };
+  /* The origin is made up: only the proxy is connected to */
+  for (int i = 0; i < 3; i++) {
+    fetch(client, &f, "http://radio.invalid:8000/small", NULL, &proxy);
+    CHECK(f.end && f.length == kSmallSize);
+    fetch_close(&f);
+    pthread_mutex_lock(&lastLock);
+    CHECK(strcmp(lastTarget, "http://radio.invalid:8000/small") == 0 && !lastSocks);
+    pthread_mutex_unlock(&lastLock);
+  }
+  CHECK(connections() - before == 1);
+
+  proxy.proxyType = HTTP_PROXY_SOCKS;
+  for (int i = 0; i < 3; i++) {
+    fetch(client, &f, "http://radio.invalid/small", "bytes=100-", &proxy);
+    CHECK(f.end && f.length == kSmallSize - 100 &&
+          memcmp(f.body, file + 100, f.length) == 0);
+    fetch_close(&f);
+    pthread_mutex_lock(&lastLock);
+    CHECK(strcmp(lastTarget, "/small") == 0 && lastSocks);
+    pthread_mutex_unlock(&lastLock);
+  }
+  CHECK(connections() - before == 2);
+  ASHTTPClientDestroy(client);
+}
+
+int main(void) {
+  uint32_t seed = 7;
+  for (size_t i = 0; i < kFileSize; i++) file[i] = (uint8_t)test_random(&seed);
+  server = test_server_start(handle, NULL);
+  CHECK(server != NULL);
+  if (server == NULL) return TEST_RESULT();
+
+  test_range_requests();
+  test_windowed_seeks();
+  test_responses();
+  test_errors_closed_early();
+  test_proxies();
+  test_server_stop(server);
+  return TEST_RESULT();
+}
@@ -0,0 +1,130 @@
+//
+//  icy_demuxer_bench.c
+//  AudioStreamer
+//
+//  ASIcyDemuxer against the byte at a time loop AudioStreamer used before
+//  it, on tests/fixtures/station.icy (an icy-metaint of 16000, a title
+//  every fourth block) read 1 KB, 8 KB and 64 KB at a time. The old loop
+//  copied each audio byte into a buffer of its own and appended metadata a
+//  character at a time; here it appends to a C buffer, which is cheaper
+//  than the NSMutableString it really used, and looks for StreamTitle with
+//  strstr() rather than NSScanner. Either way the audio is gathered into
+//  one buffer, standing in for the parser reading it.
+//
+//  Both have to find the same audio and the same titles.
+//
+
+#include "ASIcyDemuxer.h"
+#include "bench.h"
+
+#include <string.h>
+
+#define kMetaInterval 16000
+
+typedef struct run {
+  size_t         readSize;
+  const uint8_t *body;
+  size_t         length;
+  size_t         audioBytes;
+  size_t         titles;
+  uint8_t       *audio;       /* where the audio is gathered */
+} run_t;
+
+static void run_demuxer(void *context) {
+  run_t *run = context;
+  run->audioBytes = run->titles = 0;
+  icy_demuxer_t *demuxer = ASIcyDemuxerCreate();
+  ASIcyDemuxerReset(demuxer, kMetaInterval);
+  for (size_t read = 0; read < run->length; read += run->readSize) {
+    const uint8_t *bytes = run->body + read;
+    size_t length = run->length - read < run->readSize ? run->length - read
+                                                       : run->readSize;
+    size_t offset = 0;
+    while (offset < length) {
+      icy_span_t span;
+      offset += ASIcyDemuxerNext(demuxer, bytes + offset, length - offset, &span);
+      if (span.type == ICY_SPAN_AUDIO) {
+        memcpy(run->audio + run->audioBytes, span.data, span.length);
+        run->audioBytes += span.length;
+      } else if (span.type == ICY_SPAN_METADATA) {
+        const uint8_t *title;
+        size_t titleLength;
+        if (ASIcyParseStreamTitle(span.data, span.length, &title, &titleLength)) {
+          run->titles++;
+        }
+      }
+    }
+  }
+  ASIcyDemuxerDestroy(demuxer);
+}
+
+static void run_byte_loop(void *context) {
+  run_t *run = context;
+  run->audioBytes = run->titles = 0;
+  uint8_t *bytesNoMetadata = malloc(run->readSize);
+  char metadata[255 * 16 + 1];
+  size_t metadataLength = 0;
+  uint32_t metaBytesRemaining = 0, dataBytesRead = 0;
+  for (size_t read = 0; read < run->length; read += run->readSize) {
+    const uint8_t *bytes = run->body + read;
+    size_t length = run->length - read < run->readSize ? run->length - read
+                                                       : run->readSize;
+    size_t lengthNoMetadata = 0;
+    for (size_t byte = 0; byte < length; byte++) {
+      if (metaBytesRemaining > 0) {
+        metadata[metadataLength++] = (char)bytes[byte];
+        metaBytesRemaining--;
+        if (metaBytesRemaining == 0) {
+          metadata[metadataLength] = '\0';
+          if (strstr(metadata, "StreamTitle=") != NULL) run->titles++;
+          dataBytesRead = 0;
+        }
+        continue;
+      }
+      if (dataBytesRead == kMetaInterval) {
+        metaBytesRemaining = bytes[byte] * 16u;
+        metadataLength = 0;
+        if (metaBytesRemaining == 0) dataBytesRead = 0;
+        continue;
+      }
+      dataBytesRead++;
+      bytesNoMetadata[lengthNoMetadata++] = bytes[byte];
+    }
+    memcpy(run->audio + run->audioBytes, bytesNoMetadata, lengthNoMetadata);
+    run->audioBytes += lengthNoMetadata;
+  }
+  free(bytesNoMetadata);
+}
+
+int main(void) {
+  size_t length;
+  uint8_t *body = bench_read_fixture("station.icy", &length);
+  if (body == NULL) return TEST_RESULT();
+
+  /* The same audio and titles come out of both */
+  run_t demuxer = {.readSize = 8192, .body = body, .length = length};
+  run_t byteLoop = demuxer;
+  demuxer.audio = malloc(length);
+  byteLoop.audio = malloc(length);
+  run_demuxer(&demuxer);
+  run_byte_loop(&byteLoop);
+  CHECK(demuxer.audioBytes == byteLoop.audioBytes);
+  CHECK(memcmp(demuxer.audio, byteLoop.audio, demuxer.audioBytes) == 0);
+  CHECK(demuxer.titles == byteLoop.titles && demuxer.titles > 0);
+  printf("%zu bytes, %zu of audio, %zu titles\n", length, demuxer.audioBytes,
+         demuxer.titles);
+
+  static const size_t readSizes[] = {1024, 8192, 65536};
+  for (size_t i = 0; i < sizeof(readSizes) / sizeof(readSizes[0]); i++) {
+    char name[64];
+    demuxer.readSize = byteLoop.readSize = readSizes[i];
+    snprintf(name, sizeof(name), "demuxer, %zu byte reads", readSizes[i]);
+    bench_report(name, length, bench_best(run_demuxer, &demuxer));
+    snprintf(name, sizeof(name), "byte loop, %zu byte reads", readSizes[i]);
+    bench_report(name, length, bench_best(run_byte_loop, &byteLoop));
+  }
+  free(demuxer.audio);
+  free(byteLoop.audio);
+  free(body);
+  return TEST_RESULT();
+}
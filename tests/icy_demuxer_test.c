@@ -0,0 +1,131 @@
+//
+//  icy_demuxer_test.c
+//  AudioStreamer
+//
+//  Builds an ICY body with known audio and metadata blocks, feeds it to
+//  ASIcyDemuxer in chunks of every size from 1 byte up, and checks that the
+//  audio comes back byte for byte and every metadata block comes back whole.
+//
+
+#include "ASIcyDemuxer.h"
+#include "test.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define kMetaInterval 8192
+#define kBlocks       40
+
+static uint8_t body[kBlocks * (kMetaInterval + 1 + 255 * 16)];
+static size_t bodyLength;
+static uint8_t audio[kBlocks * kMetaInterval];
+static size_t audioLength;
+static char titles[kBlocks][64];
+
+/* Every third block has no metadata. The others carry a title, some with the
+   quotes and semicolons real stations put in them */
+static void build_body(void) {
+  uint32_t seed = 2024;
+  for (int b = 0; b < kBlocks; b++) {
+    for (int i = 0; i < kMetaInterval; i++) {
+      uint8_t byte = (uint8_t)test_random(&seed);
+      body[bodyLength++] = byte;
+      audio[audioLength++] = byte;
+    }
+    if (b % 3 == 2) {
+      body[bodyLength++] = 0;
+      titles[b][0] = '\0';
+      continue;
+    }
+    snprintf(titles[b], sizeof(titles[b]), b % 2 ? "Artist %d - Song; Part %d" :
+             "Band's %d - Track %d", b, b * 7);
+    char meta[255 * 16];
+    int length = snprintf(meta, sizeof(meta),
+                          "StreamTitle='%s';StreamUrl='http://x/%d';", titles[b], b);
+    size_t blocks = ((size_t)length + 15) / 16;
+    body[bodyLength++] = (uint8_t)blocks;
+    memset(body + bodyLength, 0, blocks * 16);
+    memcpy(body + bodyLength, meta, (size_t)length);
+    bodyLength += blocks * 16;
+  }
+}
+
+static uint8_t out[sizeof(audio)];
+
+static void check_chunked(icy_demuxer_t *demuxer, size_t chunk) {
+  ASIcyDemuxerReset(demuxer, kMetaInterval);
+  size_t outLength = 0;
+  int metaBlocks = 0;
+  for (size_t offset = 0; offset < bodyLength; offset += chunk) {
+    size_t length = bodyLength - offset < chunk ? bodyLength - offset : chunk;
+    const uint8_t *bytes = body + offset;
+    while (length > 0) {
+      icy_span_t span;
+      size_t used = ASIcyDemuxerNext(demuxer, bytes, length, &span);
+      CHECK(used > 0 && used <= length);
+      if (used == 0) return;
+      if (span.type == ICY_SPAN_AUDIO) {
+        /* Audio spans point into the input and never cross a metadata block */
+        CHECK(span.data == bytes && span.length == used);
+        CHECK(outLength / kMetaInterval == (outLength + used - 1) / kMetaInterval);
+        memcpy(out + outLength, span.data, span.length);
+        outLength += span.length;
+      } else if (span.type == ICY_SPAN_METADATA) {
+        /* Comes straight after the audio of its block */
+        int block = (int)(outLength / kMetaInterval) - 1;
+        CHECK(outLength % kMetaInterval == 0 && block >= 0 && titles[block][0]);
+        const uint8_t *title;
+        size_t titleLength;
+        CHECK(ASIcyParseStreamTitle(span.data, span.length, &title, &titleLength));
+        CHECK(titleLength == strlen(titles[block]) &&
+              memcmp(title, titles[block], titleLength) == 0);
+        CHECK(span.data[span.length - 1] != '\0');
+        metaBlocks++;
+      }
+      bytes += used;
+      length -= used;
+    }
+  }
+  CHECK(outLength == audioLength);
+  CHECK(memcmp(out, audio, audioLength) == 0);
+  CHECK(metaBlocks == kBlocks - kBlocks / 3);
+}
+
+static void test_stream_title(void) {
+  const uint8_t *title;
+  size_t length;
+  const char *plain = "StreamTitle='A - B';";
+  CHECK(ASIcyParseStreamTitle((const uint8_t *)plain, strlen(plain), &title, &length));
+  CHECK(length == 5 && memcmp(title, "A - B", 5) == 0);
+
+  /* No terminator: up to the last quote */
+  const char *open = "StreamTitle='It's; fine'";
+  CHECK(ASIcyParseStreamTitle((const uint8_t *)open, strlen(open), &title, &length));
+  CHECK(length == 10 && memcmp(title, "It's; fine", 10) == 0);
+
+  const char *none = "StreamUrl='x';";
+  CHECK(!ASIcyParseStreamTitle((const uint8_t *)none, strlen(none), &title, &length));
+}
+
+/* With no interval everything is audio */
+static void test_no_metadata(icy_demuxer_t *demuxer) {
+  ASIcyDemuxerReset(demuxer, 0);
+  icy_span_t span;
+  CHECK(ASIcyDemuxerNext(demuxer, body, bodyLength, &span) == bodyLength);
+  CHECK(span.type == ICY_SPAN_AUDIO && span.length == bodyLength);
+}
+
+int main(void) {
+  build_body();
+  icy_demuxer_t *demuxer = ASIcyDemuxerCreate();
+  CHECK(demuxer != NULL);
+  for (size_t chunk = 1; chunk < 64; chunk++) check_chunked(demuxer, chunk);
+  for (size_t chunk = 64; chunk <= bodyLength; chunk = chunk * 3 + 7) {
+    check_chunked(demuxer, chunk);
+  }
+  check_chunked(demuxer, bodyLength);
+  test_no_metadata(demuxer);
+  test_stream_title();
+  ASIcyDemuxerDestroy(demuxer);
+  return TEST_RESULT();
+}
@@ -0,0 +1,208 @@
+//
+//  id3_parser_bench.c
+//  AudioStreamer
+//
+//  ASID3Parser on tags like the ones tagged files start with: ten text
+//  frames, 500 KB of artwork and some padding, as ID3v2.3 plain and with
+//  the whole tag unsynchronized, and as ID3v2.4 with each frame
+//  unsynchronized on its own and a 12 KB text frame which has to be
+//  buffered and resynchronized. Each is fed 8 KB at a time, wanting only
+//  the text frames.
+//
+//  Then ASID3Resynchronize, which finds the 0xFF bytes with memchr(), is
+//  timed against a loop looking at every byte, on the most a frame can be
+//  buffered with. Both have to give back the same bytes.
+//
+
+#include "ASID3Parser.h"
+#include "bench.h"
+
+#include <string.h>
+
+#define kReadSize 8192
+#define kArtSize (500 * 1024)
+#define kTextFrames 10
+
+static uint8_t art[kArtSize];
+static uint8_t longText[12 * 1024];
+
+typedef struct tag {
+  const char *name;
+  uint8_t    *data;
+  size_t      length;
+  size_t      frames;         /* text frames found on the last run */
+  size_t      textBytes;
+} tag_t;
+
+/* Puts a 0x00 after every 0xFF */
+static size_t unsync(uint8_t *out, const uint8_t *in, size_t length) {
+  size_t n = 0;
+  for (size_t i = 0; i < length; i++) {
+    out[n++] = in[i];
+    if (in[i] == 0xFF) out[n++] = 0x00;
+  }
+  return n;
+}
+
+static void put_size(uint8_t *b, uint32_t value, bool syncsafe) {
+  if (syncsafe) value = (value & 0x7F) | (value & 0x3F80) << 1 |
+                        (value & 0x1FC000) << 2 | (value & 0xFE00000) << 3;
+  b[0] = (uint8_t)(value >> 24);
+  b[1] = (uint8_t)(value >> 16);
+  b[2] = (uint8_t)(value >> 8);
+  b[3] = (uint8_t)value;
+}
+
+/* Writes a frame, unsynchronized on its own if asked. Returns its length */
+static size_t put_frame(uint8_t *p, uint8_t version, const char *id,
+                        const uint8_t *data, size_t length, bool frameUnsync) {
+  memcpy(p, id, 4);
+  size_t stored = length;
+  if (frameUnsync) {
+    stored = unsync(p + 10, data, length);
+  } else {
+    memcpy(p + 10, data, length);
+  }
+  put_size(p + 4, (uint32_t)stored, version == 4);
+  p[8] = 0;
+  p[9] = frameUnsync ? 0x02 : 0;
+  return 10 + stored;
+}
+
+static void build_tag(tag_t *tag, uint8_t version, bool tagUnsync,
+                      bool frameUnsync) {
+  static const char *ids[kTextFrames] = {
+    "TIT2", "TPE1", "TALB", "TPE2", "TCOM", "TCON", "TRCK", "TPOS", "TYER",
+    "TPUB",
+  };
+  uint8_t *body = malloc(2 * (kArtSize + sizeof(longText)) + 65536);
+  size_t length = 0;
+  for (int i = 0; i < kTextFrames; i++) {
+    char text[64];
+    int n = snprintf(text + 1, sizeof(text) - 1, "Text of frame %d \xFF\xFE", i);
+    text[0] = 0;
+    length += put_frame(body + length, version, ids[i], (const uint8_t *)text,
+                        (size_t)n + 1, frameUnsync);
+  }
+  length += put_frame(body + length, version, "APIC", art, sizeof(art),
+                      frameUnsync);
+  if (version == 4) {
+    length += put_frame(body + length, version, "TXXX", longText,
+                        sizeof(longText), frameUnsync);
+  }
+  memset(body + length, 0, 2048);
+  length += 2048;
+
+  tag->data = malloc(10 + 2 * length);
+  memcpy(tag->data, "ID3", 3);
+  tag->data[3] = version;
+  tag->data[4] = 0;
+  tag->data[5] = tagUnsync ? 0x80 : 0;
+  size_t stored = length;
+  if (tagUnsync) {
+    stored = unsync(tag->data + 10, body, length);
+  } else {
+    memcpy(tag->data + 10, body, length);
+  }
+  put_size(tag->data + 6, (uint32_t)stored, true);
+  tag->length = 10 + stored;
+  free(body);
+}
+
+static bool want_text(void *context, const char *frameID, uint8_t version) {
+  (void)context;
+  (void)version;
+  return frameID[0] == 'T';
+}
+
+static void on_frame(void *context, const id3_frame_t *frame) {
+  tag_t *tag = context;
+  tag->frames++;
+  tag->textBytes += frame->length;
+}
+
+static void run_parser(void *context) {
+  tag_t *tag = context;
+  tag->frames = tag->textBytes = 0;
+  id3_parser_t *parser = ASID3ParserCreate(want_text, on_frame, tag);
+  id3_status_t status = ID3_STATUS_NEED_MORE;
+  size_t consumed = 0;
+  for (size_t read = 0; read < tag->length && status == ID3_STATUS_NEED_MORE;
+       read += kReadSize) {
+    size_t length = tag->length - read < kReadSize ? tag->length - read
+                                                   : kReadSize;
+    status = ASID3ParserFeed(parser, tag->data + read, length, &consumed);
+    consumed += read;
+  }
+  CHECK(status == ID3_STATUS_DONE && consumed == tag->length);
+  ASID3ParserDestroy(parser);
+}
+
+/* What resynchronizing is timed on, and a copy to work on in place */
+static uint8_t unsynced[kID3MaxFrameSize];
+static size_t unsyncedLength;
+static uint8_t scratch[kID3MaxFrameSize];
+static size_t resyncedLength;
+
+static size_t resynchronize_bytewise(uint8_t *bytes, size_t length) {
+  size_t out = 0;
+  for (size_t in = 0; in < length; in++) {
+    bytes[out++] = bytes[in];
+    if (bytes[in] == 0xFF && in + 1 < length && bytes[in + 1] == 0x00) in++;
+  }
+  return out;
+}
+
+static void run_resynchronize(void *context) {
+  (void)context;
+  for (int i = 0; i < 64; i++) {
+    memcpy(scratch, unsynced, unsyncedLength);
+    resyncedLength = ASID3Resynchronize(scratch, unsyncedLength);
+  }
+}
+
+static void run_bytewise(void *context) {
+  (void)context;
+  for (int i = 0; i < 64; i++) {
+    memcpy(scratch, unsynced, unsyncedLength);
+    resyncedLength = resynchronize_bytewise(scratch, unsyncedLength);
+  }
+}
+
+int main(void) {
+  uint32_t seed = 1;
+  for (size_t i = 0; i < sizeof(art); i++) art[i] = (uint8_t)test_random(&seed);
+  for (size_t i = 0; i < sizeof(longText); i++) {
+    longText[i] = (uint8_t)test_random(&seed);
+  }
+  longText[0] = 0;
+
+  tag_t tags[] = {
+    {.name = "v2.3"},
+    {.name = "v2.3, tag unsynchronized"},
+    {.name = "v2.4, frames unsynchronized"},
+  };
+  build_tag(&tags[0], 3, false, false);
+  build_tag(&tags[1], 3, true, false);
+  build_tag(&tags[2], 4, false, true);
+  for (size_t i = 0; i < sizeof(tags) / sizeof(tags[0]); i++) {
+    double seconds = bench_best(run_parser, &tags[i]);
+    CHECK(tags[i].frames == kTextFrames + (i == 2));
+    bench_report(tags[i].name, tags[i].length, seconds);
+    free(tags[i].data);
+  }
+
+  /* As much as fits in a frame once unsynchronized */
+  unsyncedLength = unsync(unsynced, longText, sizeof(longText));
+  memcpy(scratch, unsynced, unsyncedLength);
+  size_t expected = resynchronize_bytewise(scratch, unsyncedLength);
+  CHECK(expected == sizeof(longText) && memcmp(scratch, longText, expected) == 0);
+  run_resynchronize(NULL);
+  CHECK(resyncedLength == expected && memcmp(scratch, longText, expected) == 0);
+
+  bench_report("ASID3Resynchronize", 64 * unsyncedLength,
+               bench_best(run_resynchronize, NULL));
+  bench_report("byte at a time", 64 * unsyncedLength,
+               bench_best(run_bytewise, NULL));
+  return TEST_RESULT();
+}
@@ -0,0 +1,328 @@
+//
+//  id3_parser_test.c
+//  AudioStreamer
+//
+//  Builds ID3v2.2, v2.3 and v2.4 tags with text frames, artwork, padding,
+//  extended headers, a footer and unsynchronization of the whole tag and of
+//  single frames. Each is fed to ASID3Parser, followed by audio, in chunks
+//  of every size up to 200 bytes and then of doubling sizes. The wanted
+//  frames have to come back whole, nothing else may, and the audio has to
+//  start where the tag ends.
+//
+
+#include "ASID3Parser.h"
+#include "test.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define kMaxFrames  16
+#define kAudioBytes 3000
+
+static uint8_t tag[64 * 1024];
+static size_t tagLength;
+
+typedef struct expected_frame {
+  char    id[5];
+  uint8_t data[1024];
+  size_t  length;
+} expected_frame_t;
+
+static expected_frame_t expected[kMaxFrames];
+static size_t expectedCount;
+
+static expected_frame_t got[kMaxFrames];
+static size_t gotCount;
+static bool gotTooMany;
+
+static bool want_text(void *context, const char *frameID, uint8_t version) {
+  (void)context;
+  (void)version;
+  return frameID[0] == 'T';
+}
+
+static void on_frame(void *context, const id3_frame_t *frame) {
+  (void)context;
+  if (gotCount == kMaxFrames || frame->length > sizeof(got[0].data)) {
+    gotTooMany = true;
+    return;
+  }
+  expected_frame_t *f = &got[gotCount++];
+  memcpy(f->id, frame->id, sizeof(f->id));
+  memcpy(f->data, frame->data, frame->length);
+  f->length = frame->length;
+}
+
+static void put_syncsafe(uint8_t *b, uint32_t value) {
+  b[0] = (value >> 21) & 0x7F;
+  b[1] = (value >> 14) & 0x7F;
+  b[2] = (value >> 7) & 0x7F;
+  b[3] = value & 0x7F;
+}
+
+static void put_be32(uint8_t *b, uint32_t value) {
+  b[0] = (uint8_t)(value >> 24);
+  b[1] = (uint8_t)(value >> 16);
+  b[2] = (uint8_t)(value >> 8);
+  b[3] = (uint8_t)value;
+}
+
+/* Puts a 0x00 after every 0xFF, which resynchronizing takes out again */
+static size_t unsync(uint8_t *out, const uint8_t *in, size_t length) {
+  size_t n = 0;
+  for (size_t i = 0; i < length; i++) {
+    out[n++] = in[i];
+    if (in[i] == 0xFF) out[n++] = 0x00;
+  }
+  return n;
+}
+
+/* The body of the tag being built, before any tag-level unsynchronization */
+static uint8_t body[64 * 1024];
+static size_t bodyLength;
+
+/* Adds a frame whose payload, as stored, is data. What the parser should
+   hand back is given separately, or NULL if the frame shouldn't come back */
+static void add_frame(uint8_t version, const char *id, uint8_t flags,
+                      const uint8_t *data, size_t length,
+                      const uint8_t *delivered, size_t deliveredLength) {
+  uint8_t *h = body + bodyLength;
+  if (version == 2) {
+    memcpy(h, id, 3);
+    h[3] = (uint8_t)(length >> 16);
+    h[4] = (uint8_t)(length >> 8);
+    h[5] = (uint8_t)length;
+    bodyLength += 6;
+  } else {
+    memcpy(h, id, 4);
+    if (version == 4) {
+      put_syncsafe(h + 4, (uint32_t)length);
+    } else {
+      put_be32(h + 4, (uint32_t)length);
+    }
+    h[8] = 0;
+    h[9] = flags;
+    bodyLength += 10;
+  }
+  memcpy(body + bodyLength, data, length);
+  bodyLength += length;
+
+  if (delivered != NULL) {
+    expected_frame_t *f = &expected[expectedCount++];
+    strcpy(f->id, id);
+    memcpy(f->data, delivered, deliveredLength);
+    f->length = deliveredLength;
+  }
+}
+
+static void add_text(uint8_t version, const char *id, const char *text) {
+  uint8_t data[256];
+  data[0] = 0;      /* ISO-8859-1 */
+  size_t length = strlen(text);
+  memcpy(data + 1, text, length);
+  add_frame(version, id, 0, data, length + 1, data, length + 1);
+}
+
+/* Finishes the tag: its header, the body unsynchronized if asked, padding
+   and a footer */
+static void finish_tag(uint8_t version, uint8_t flags, size_t padding) {
+  memset(body + bodyLength, 0, padding);
+  bodyLength += padding;
+
+  uint8_t *stored = tag + 10;
+  size_t storedLength = bodyLength;
+  if (flags & 0x80) {
+    storedLength = unsync(stored, body, bodyLength);
+  } else {
+    memcpy(stored, body, bodyLength);
+  }
+  memcpy(tag, "ID3", 3);
+  tag[3] = version;
+  tag[4] = 0;
+  tag[5] = flags;
+  put_syncsafe(tag + 6, (uint32_t)storedLength);
+  tagLength = 10 + storedLength;
+  if (flags & 0x10) {
+    memcpy(tag + tagLength, tag, 10);
+    memcpy(tag + tagLength, "3DI", 3);
+    tagLength += 10;
+  }
+}
+
+static void start_tag(void) {
+  bodyLength = 0;
+  expectedCount = 0;
+}
+
+static void fill_random(uint8_t *bytes, size_t length, uint32_t seed) {
+  for (size_t i = 0; i < length; i++) bytes[i] = (uint8_t)test_random(&seed);
+}
+
+/* A v2.3 tag with artwork, a grouped frame, a compressed one and padding */
+static void build_v23(uint8_t flags) {
+  start_tag();
+  add_text(3, "TIT2", "A Song");
+  static uint8_t art[20000];
+  fill_random(art, sizeof(art), 3);
+  add_frame(3, "APIC", 0, art, sizeof(art), NULL, 0);
+  add_text(3, "TPE1", "An \xFF\xE0 Artist");
+
+  /* A group identifier is taken off */
+  uint8_t grouped[] = {0x42, 0, 'G', 'r', 'o', 'u', 'p', 0xFF};
+  add_frame(3, "TALB", 0x20, grouped, sizeof(grouped), grouped + 1,
+            sizeof(grouped) - 1);
+
+  /* Compressed frames can't be read */
+  uint8_t packed[] = {0, 0, 0, 9, 0x78, 0x9C, 1, 2, 3};
+  add_frame(3, "TCOM", 0x80, packed, sizeof(packed), NULL, 0);
+
+  /* Nor can wanted frames too big to buffer */
+  static uint8_t big[kID3MaxFrameSize + 1];
+  fill_random(big, sizeof(big), 4);
+  add_frame(3, "TXXX", 0, big, sizeof(big), NULL, 0);
+  add_text(3, "TYER", "2024");
+  finish_tag(3, flags, 300);
+}
+
+/* A v2.4 tag with an extended header, frames unsynchronized on their own
+   and with a data length indicator, and a footer */
+static void build_v24(void) {
+  start_tag();
+  /* An extended header of 6 bytes, counting its own size */
+  uint8_t *ext = body;
+  put_syncsafe(ext, 6);
+  ext[4] = 1;
+  ext[5] = 0;
+  bodyLength = 6;
+
+  /* Big enough that its syncsafe size isn't its plain one */
+  uint8_t priv[500];
+  fill_random(priv, sizeof(priv), 5);
+  add_frame(4, "PRIV", 0, priv, sizeof(priv), NULL, 0);
+  add_text(4, "TIT2", "Another Song");
+
+  uint8_t raw[] = {3, 0xFF, 0xE0, 'x', 0xFF, 0x00, 'y', 0xFF};
+  uint8_t synced[sizeof(raw) * 2 + 4];
+  put_syncsafe(synced, sizeof(raw));
+  size_t length = 4 + unsync(synced + 4, raw, sizeof(raw));
+  add_frame(4, "TPE1", 0x03, synced, length, raw, sizeof(raw));
+
+  uint8_t grouped[] = {7, 3, 'G'};
+  add_frame(4, "TPE2", 0x40, grouped, sizeof(grouped), grouped + 1, 2);
+
+  uint8_t encrypted[] = {1, 2, 3};
+  add_frame(4, "TENC", 0x04, encrypted, sizeof(encrypted), NULL, 0);
+  finish_tag(4, 0x40 | 0x10, 0);
+}
+
+/* A v2.2 tag, with three letter IDs */
+static void build_v22(void) {
+  start_tag();
+  add_text(2, "TT2", "Old Song");
+  uint8_t pic[2000];
+  fill_random(pic, sizeof(pic), 6);
+  add_frame(2, "PIC", 0, pic, sizeof(pic), NULL, 0);
+  add_text(2, "TP1", "Old Artist");
+  finish_tag(2, 0, 50);
+}
+
+static bool same_frames(void) {
+  if (gotTooMany || gotCount != expectedCount) return false;
+  for (size_t i = 0; i < gotCount; i++) {
+    if (strcmp(got[i].id, expected[i].id) != 0 ||
+        got[i].length != expected[i].length ||
+        memcmp(got[i].data, expected[i].data, got[i].length) != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static uint8_t stream[sizeof(tag) + kAudioBytes];
+
+static void check_chunked(id3_parser_t *parser, const char *name) {
+  memcpy(stream, tag, tagLength);
+  fill_random(stream + tagLength, kAudioBytes, 7);
+  size_t streamLength = tagLength + kAudioBytes;
+
+  int failures = testFailures;
+  for (size_t chunk = 1; chunk <= streamLength && testFailures == failures;
+       chunk = chunk < 200 ? chunk + 1 : chunk * 2) {
+    ASID3ParserReset(parser);
+    gotCount = 0;
+    gotTooMany = false;
+    size_t audioStart = 0;
+    id3_status_t status = ID3_STATUS_NEED_MORE;
+    for (size_t offset = 0; offset < streamLength; offset += chunk) {
+      size_t length = streamLength - offset < chunk ? streamLength - offset : chunk;
+      size_t consumed;
+      status = ASID3ParserFeed(parser, stream + offset, length, &consumed);
+      if (status != ID3_STATUS_NEED_MORE) {
+        audioStart = offset + consumed;
+        break;
+      }
+      CHECK(consumed == length);
+    }
+    CHECK(status == ID3_STATUS_DONE);
+    CHECK(audioStart == tagLength);
+    CHECK(ASID3ParserTagSize(parser) == tagLength);
+    CHECK(same_frames());
+    if (testFailures != failures) {
+      fprintf(stderr, "%s fed %zu bytes at a time\n", name, chunk);
+    }
+  }
+}
+
+static void test_no_tag(id3_parser_t *parser) {
+  static const uint8_t mp3[] = {0xFF, 0xFB, 0x90, 0x64, 0, 0, 0, 0, 0, 0, 0};
+  size_t consumed = 1;
+  ASID3ParserReset(parser);
+  CHECK(ASID3ParserFeed(parser, mp3, sizeof(mp3), &consumed) == ID3_STATUS_NO_TAG);
+  CHECK(consumed == 0);
+
+  /* Found out a byte at a time */
+  ASID3ParserReset(parser);
+  CHECK(ASID3ParserFeed(parser, (const uint8_t*)"ID", 2, &consumed) ==
+        ID3_STATUS_NEED_MORE);
+  CHECK(ASID3ParserFeed(parser, (const uint8_t*)"X", 1, &consumed) ==
+        ID3_STATUS_NO_TAG);
+
+  /* Versions which don't exist, and sizes which aren't syncsafe */
+  static const uint8_t v5[] = {'I', 'D', '3', 5, 0, 0, 0, 0, 0, 10};
+  static const uint8_t unsafe[] = {'I', 'D', '3', 3, 0, 0, 0, 0x80, 0, 10};
+  ASID3ParserReset(parser);
+  CHECK(ASID3ParserFeed(parser, v5, sizeof(v5), NULL) == ID3_STATUS_NO_TAG);
+  ASID3ParserReset(parser);
+  CHECK(ASID3ParserFeed(parser, unsafe, sizeof(unsafe), NULL) == ID3_STATUS_NO_TAG);
+}
+
+static void test_resynchronize(void) {
+  uint8_t bytes[] = {1, 0xFF, 0x00, 0xE0, 0xFF, 0x00, 0x00, 2, 0xFF};
+  static const uint8_t synced[] = {1, 0xFF, 0xE0, 0xFF, 0x00, 2, 0xFF};
+  size_t length = ASID3Resynchronize(bytes, sizeof(bytes));
+  CHECK(length == sizeof(synced) && memcmp(bytes, synced, length) == 0);
+
+  uint8_t plain[] = {1, 2, 3};
+  CHECK(ASID3Resynchronize(plain, sizeof(plain)) == sizeof(plain));
+}
+
+int main(void) {
+  id3_parser_t *parser = ASID3ParserCreate(want_text, on_frame, NULL);
+  CHECK(parser != NULL);
+  if (parser == NULL) return 1;
+
+  test_resynchronize();
+  test_no_tag(parser);
+
+  build_v23(0);
+  check_chunked(parser, "v2.3");
+  build_v23(0x80);
+  check_chunked(parser, "v2.3 unsynchronized");
+  build_v24();
+  check_chunked(parser, "v2.4");
+  build_v22();
+  check_chunked(parser, "v2.2");
+
+  ASID3ParserDestroy(parser);
+  return TEST_RESULT();
+}
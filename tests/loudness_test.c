@@ -0,0 +1,135 @@
+//
+//  loudness_test.c
+//  AudioStreamer
+//
+//  Measures the EBU Tech 3341 minimum requirement signals (stereo 1 kHz
+//  sines in runs of fixed level) with ASLoudnessMeter at several sample
+//  rates and checks the integrated loudness against the expected -23 or
+//  -33 LUFS. Also checks ReplayGain parsing, and that ASNormalizer reaches
+//  its gain from a tagged loudness and keeps peaks below -1 dBTP.
+//
+
+#include "ASLoudnessMeter.h"
+#include "ASNormalizer.h"
+#include "test.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+#define kBlock 4096
+#define kTolerance 0.05   /* LU; the standard allows 0.1 */
+
+typedef struct run {
+  double level;     /* dBFS of each channel's sine */
+  double seconds;
+} run_t;
+
+/* Feeds runs of a stereo 1 kHz sine to the meter */
+static void measure(loudness_meter_t *meter, double rate, const run_t *runs,
+                    size_t count) {
+  static float left[kBlock], right[kBlock];
+  const float *channels[2] = {left, right};
+  double phase = 0, step = 2 * M_PI * 1000 / rate;
+  for (size_t r = 0; r < count; r++) {
+    double amplitude = pow(10, runs[r].level / 20);
+    uint64_t frames = (uint64_t)llround(runs[r].seconds * rate);
+    while (frames > 0) {
+      uint32_t n = frames < kBlock ? (uint32_t)frames : kBlock;
+      for (uint32_t i = 0; i < n; i++) {
+        left[i] = right[i] = (float)(amplitude * sin(phase));
+        phase += step;
+        if (phase > 2 * M_PI) phase -= 2 * M_PI;
+      }
+      ASLoudnessMeterProcess(meter, channels, n);
+      frames -= n;
+    }
+  }
+}
+
+static void test_tech3341(double rate) {
+  static const run_t case1[] = {{-23, 20}};
+  static const run_t case2[] = {{-33, 20}};
+  static const run_t case3[] = {{-36, 10}, {-23, 60}, {-36, 10}};
+  static const run_t case4[] = {{-72, 10}, {-36, 10}, {-23, 60}, {-36, 10}, {-72, 10}};
+  static const run_t case5[] = {{-26, 20}, {-20, 20.1}, {-26, 20}};
+  static const struct {
+    const run_t *runs;
+    size_t count;
+    double expected;
+  } cases[] = {
+    {case1, 1, -23}, {case2, 1, -33}, {case3, 3, -23}, {case4, 5, -23}, {case5, 3, -23},
+  };
+
+  loudness_meter_t *meter = ASLoudnessMeterCreate(rate, 2);
+  CHECK(meter != NULL);
+  if (meter == NULL) return;
+  for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    ASLoudnessMeterReset(meter);
+    measure(meter, rate, cases[i].runs, cases[i].count);
+    double lufs = 0;
+    CHECK(ASLoudnessMeterIntegrated(meter, &lufs));
+    if (fabs(lufs - cases[i].expected) > kTolerance) {
+      fprintf(stderr, "%.0f Hz, case %zu: %.3f LUFS, expected %.1f\n", rate,
+              i + 1, lufs, cases[i].expected);
+    }
+    CHECK(fabs(lufs - cases[i].expected) <= kTolerance);
+  }
+
+  /* Nothing above the absolute gate */
+  ASLoudnessMeterReset(meter);
+  static const run_t quiet[] = {{-80, 5}};
+  measure(meter, rate, quiet, 1);
+  double lufs;
+  CHECK(!ASLoudnessMeterIntegrated(meter, &lufs));
+  CHECK(ASLoudnessMeterGatedDuration(meter) == 0);
+  ASLoudnessMeterDestroy(meter);
+}
+
+static void test_replaygain(void) {
+  double gain = 0;
+  CHECK(ASLoudnessParseReplayGain("-6.48 dB", &gain) && fabs(gain + 6.48) < 1e-9);
+  CHECK(ASLoudnessParseReplayGain("+2.5 dB", &gain) && fabs(gain - 2.5) < 1e-9);
+  CHECK(ASLoudnessParseReplayGain("  1.00", &gain) && fabs(gain - 1) < 1e-9);
+  CHECK(!ASLoudnessParseReplayGain("loud", &gain));
+  CHECK(!ASLoudnessParseReplayGain("", &gain));
+}
+
+/* A stream tagged 7 dB quieter than the target gets 7 dB more, and a full
+   scale square wave still comes out below -1 dBTP */
+static void test_normalizer(void) {
+  const double rate = 48000;
+  normalizer_t *normalizer = ASNormalizerCreate(rate, 2, -23);
+  CHECK(normalizer != NULL);
+  if (normalizer == NULL) return;
+  ASNormalizerSetLoudness(normalizer, -30);
+  double lufs = 0;
+  CHECK(ASNormalizerLoudness(normalizer, &lufs) && lufs == -30);
+
+  static float left[kBlock], right[kBlock];
+  float *channels[2] = {left, right};
+  float peak = 0;
+  for (int block = 0; block < (int)(5 * rate / kBlock); block++) {
+    for (uint32_t i = 0; i < kBlock; i++) {
+      left[i] = right[i] = ((block * kBlock + i) / 24) % 2 ? 1.0f : -1.0f;
+    }
+    ASNormalizerProcess(normalizer, channels, kBlock);
+    for (uint32_t i = 0; i < kBlock; i++) {
+      if (fabsf(left[i]) > peak) peak = fabsf(left[i]);
+      if (fabsf(right[i]) > peak) peak = fabsf(right[i]);
+    }
+  }
+  CHECK(fabs(ASNormalizerGain(normalizer) - 7) < 0.1);
+  CHECK(peak <= powf(10, -1.0f / 20));
+  CHECK(peak > 0.5f);
+  ASNormalizerDestroy(normalizer);
+}
+
+int main(void) {
+  const double rates[] = {32000, 44100, 48000, 96000};
+  for (size_t i = 0; i < sizeof(rates) / sizeof(rates[0]); i++) {
+    test_tech3341(rates[i]);
+  }
+  test_replaygain();
+  test_normalizer();
+  return TEST_RESULT();
+}
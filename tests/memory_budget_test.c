@@ -0,0 +1,168 @@
+//
+//  memory_budget_test.c
+//  AudioStreamer
+//
+//  How ASMemoryBudget lays out a stream's buffers: VBR descriptions sized
+//  for packets a quarter the size of the first ones, CBR without any, and
+//  under a budget no more than half of it spent on buffers, never fewer
+//  than four of them or CBR ones smaller than 1 KB of whole frames, with
+//  what's left over read ahead.
+//
+
+#include "ASMemoryBudget.h"
+#include "test.h"
+
+/* As the streamer has them on a 64-bit Apple platform */
+static const memory_budget_t kStream = {
+  .bufferCount = 256,
+  .bufferSize = 8192,
+  .maxDescs = 512,
+  .descSize = 16,
+  .bufferOverhead = 48,
+};
+
+static void test_descriptions(void) {
+  buffer_layout_t layout;
+
+  /* A 128 kbps MP3 at 44.1 kHz has packets of about 418 bytes, so its
+     descriptions take under a sixth of the 8 KB they used to */
+  memory_budget_t b = kStream;
+  b.vbr = true;
+  b.typicalPacketSize = 418;
+  ASMemoryBudgetFit(&b, &layout);
+  CHECK(layout.descsPerBuffer == 8192 / (418 / 4));
+  CHECK(layout.descsPerBuffer * b.descSize < 8192 / 6);
+  CHECK(layout.bufferCount == 256 && layout.bufferSize == 8192);
+  CHECK(layout.readAheadLimit == SIZE_MAX);
+
+  /* Small or unknown packets are taken to be 32 bytes at least */
+  b.typicalPacketSize = 100;
+  ASMemoryBudgetFit(&b, &layout);
+  CHECK(layout.descsPerBuffer == 8192 / 32);
+  b.typicalPacketSize = 0;
+  ASMemoryBudgetFit(&b, &layout);
+  CHECK(layout.descsPerBuffer == 8192 / 32);
+
+  /* but there are never more than the most a buffer may have */
+  b.bufferSize = 65536;
+  ASMemoryBudgetFit(&b, &layout);
+  CHECK(layout.descsPerBuffer == 512);
+
+  /* nor none, whatever the packets */
+  b.bufferSize = 1000;
+  b.typicalPacketSize = 8000;
+  ASMemoryBudgetFit(&b, &layout);
+  CHECK(layout.descsPerBuffer == 1);
+
+  /* CBR needs none */
+  b = kStream;
+  b.typicalPacketSize = 418;
+  ASMemoryBudgetFit(&b, &layout);
+  CHECK(layout.descsPerBuffer == 0);
+}
+
+static void test_budget(void) {
+  buffer_layout_t layout;
+
+  /* Enough for every buffer: the rest is read ahead */
+  memory_budget_t b = kStream;
+  b.vbr = true;
+  b.typicalPacketSize = 418;
+  b.budget = 16 << 20;
+  ASMemoryBudgetFit(&b, &layout);
+  size_t perBuffer = 8192 + 48 + layout.descsPerBuffer * 16;
+  CHECK(layout.bufferCount == 256 && layout.bufferSize == 8192);
+  CHECK(layout.readAheadLimit == b.budget - 256 * perBuffer);
+
+  /* Otherwise half of it goes to as many buffers as fit */
+  b.budget = 1 << 20;
+  ASMemoryBudgetFit(&b, &layout);
+  CHECK(layout.bufferCount == (1 << 19) / perBuffer);
+  CHECK(layout.bufferSize == 8192);
+  CHECK(layout.readAheadLimit == b.budget - layout.bufferCount * perBuffer);
+
+  /* but never fewer than four VBR buffers, which may leave nothing */
+  b.budget = 10000;
+  ASMemoryBudgetFit(&b, &layout);
+  CHECK(layout.bufferCount == 4 && layout.bufferSize == 8192);
+  CHECK(layout.readAheadLimit == 0);
+  b.bufferCount = 2;
+  ASMemoryBudgetFit(&b, &layout);
+  CHECK(layout.bufferCount == 2);
+
+  /* CBR buffers are shrunk so four take half, */
+  b = kStream;
+  b.budget = 40000;
+  ASMemoryBudgetFit(&b, &layout);
+  CHECK(layout.bufferSize == 5000 && layout.descsPerBuffer == 0);
+  CHECK(layout.bufferCount == 4);
+  CHECK(layout.readAheadLimit == 40000 - 4 * 5048);
+
+  /* holding whole frames, */
+  b.bytesPerPacket = 6;
+  ASMemoryBudgetFit(&b, &layout);
+  CHECK(layout.bufferSize == 4998);
+
+  /* and no smaller than 1 KB, or a frame if that's bigger */
+  b.budget = 2000;
+  ASMemoryBudgetFit(&b, &layout);
+  CHECK(layout.bufferSize == 1026 && layout.bufferCount == 4);
+  CHECK(layout.readAheadLimit == 0);
+  b.bytesPerPacket = 4000;
+  ASMemoryBudgetFit(&b, &layout);
+  CHECK(layout.bufferSize == 4000);
+
+  /* Buffers already small enough are left as they are */
+  b = kStream;
+  b.bufferSize = 2048;
+  b.budget = 40000;
+  ASMemoryBudgetFit(&b, &layout);
+  CHECK(layout.bufferSize == 2048 && layout.bufferCount == 20000 / 2096);
+}
+
+/* Whatever the stream, what is laid out fits a budget which has room for
+   the fewest, smallest buffers */
+static void test_fits(void) {
+  uint32_t seed = 1;
+  for (int i = 0; i < 100000; i++) {
+    memory_budget_t b = kStream;
+    b.bufferCount = 1 + test_random_below(&seed, 512);
+    b.bufferSize = 512 + test_random_below(&seed, 65536);
+    b.vbr = test_random_below(&seed, 2);
+    b.typicalPacketSize = test_random_below(&seed, 4096);
+    b.bytesPerPacket = test_random_below(&seed, 3) * 4 *
+                       (1 + test_random_below(&seed, 8));
+    b.budget = 1 + test_random_below(&seed, 64 << 20);
+    buffer_layout_t layout;
+    ASMemoryBudgetFit(&b, &layout);
+
+    size_t perBuffer = layout.bufferSize + b.bufferOverhead +
+                       layout.descsPerBuffer * b.descSize;
+    size_t used = layout.bufferCount * perBuffer;
+    uint32_t fewest = b.bufferCount < 4 ? b.bufferCount : 4;
+    CHECK(layout.bufferCount >= fewest && layout.bufferCount <= b.bufferCount);
+    CHECK(layout.bufferCount == fewest || used <= b.budget / 2);
+    CHECK(layout.readAheadLimit == (b.budget > used ? b.budget - used : 0));
+    CHECK(layout.bufferSize <= b.bufferSize || b.bufferSize < 1024 ||
+          layout.bufferSize < b.bufferSize + b.bytesPerPacket);
+    if (b.vbr) {
+      CHECK(layout.bufferSize == b.bufferSize);
+      CHECK(layout.descsPerBuffer >= 1 && layout.descsPerBuffer <= b.maxDescs);
+    } else if (layout.bufferSize != b.bufferSize) {
+      CHECK(layout.bufferSize >= 1024);
+      CHECK(b.bytesPerPacket == 0 || layout.bufferSize % b.bytesPerPacket == 0);
+    }
+    if (testFailures > 0) {
+      fprintf(stderr, "budget %zu, %u buffers of %u, %s\n", b.budget,
+              b.bufferCount, b.bufferSize, b.vbr ? "VBR" : "CBR");
+      break;
+    }
+  }
+}
+
+int main(void) {
+  test_descriptions();
+  test_budget();
+  test_fits();
+  return TEST_RESULT();
+}
@@ -0,0 +1,139 @@
+//
+//  metrics_test.c
+//  AudioStreamer
+//
+//  What ASMetrics makes of a stream's events: times to the first byte and
+//  the first audio, stalls counted once each and timed including one still
+//  going on, time spent playing binned by the level buffered, and nothing
+//  counted once the stream has stopped.
+//
+
+#include "ASMetrics.h"
+#include "test.h"
+
+#include <math.h>
+
+static bool near(double a, double b) {
+  return fabs(a - b) < 1e-9;
+}
+
+static void test_start(void) {
+  stream_metrics_t *metrics = ASMetricsCreate(100);
+  CHECK(metrics != NULL);
+  if (metrics == NULL) return;
+  metrics_snapshot_t s;
+  ASMetricsGetSnapshot(metrics, 100, &s);
+  CHECK(s.timeToFirstByte == -1 && s.timeToFirstAudio == -1);
+  CHECK(s.rebuffers == 0 && s.stallTime == 0 && s.reconnects == 0);
+  CHECK(s.bytesDownloaded == 0 && s.bytesWasted == 0);
+
+  /* An empty read isn't the first byte */
+  ASMetricsAddBytes(metrics, 0, 100.1);
+  ASMetricsAddBytes(metrics, 500, 100.25);
+  ASMetricsAddBytes(metrics, 700, 101);
+  ASMetricsPlaying(metrics, 101.5);
+  ASMetricsPlaying(metrics, 103);
+  ASMetricsAddWasted(metrics, 300);
+  ASMetricsAddWasted(metrics, 20);
+  ASMetricsReconnected(metrics);
+  ASMetricsReconnected(metrics);
+  ASMetricsGetSnapshot(metrics, 104, &s);
+  CHECK(near(s.timeToFirstByte, 0.25) && near(s.timeToFirstAudio, 1.5));
+  CHECK(s.bytesDownloaded == 1200 && s.bytesWasted == 320);
+  CHECK(s.reconnects == 2);
+  ASMetricsDestroy(metrics);
+}
+
+static void test_stalls(void) {
+  stream_metrics_t *metrics = ASMetricsCreate(0);
+  CHECK(metrics != NULL);
+  if (metrics == NULL) return;
+  ASMetricsPlaying(metrics, 1);
+  ASMetricsStalled(metrics, 5);
+  ASMetricsStalled(metrics, 6);   /* the same stall */
+  ASMetricsPlaying(metrics, 7);
+  ASMetricsStalled(metrics, 10);
+  metrics_snapshot_t s;
+  ASMetricsGetSnapshot(metrics, 10.5, &s);
+  CHECK(s.rebuffers == 2 && near(s.stallTime, 2.5));
+  CHECK(near(s.timeToFirstAudio, 1));
+  ASMetricsPlaying(metrics, 11);
+  ASMetricsGetSnapshot(metrics, 20, &s);
+  CHECK(s.rebuffers == 2 && near(s.stallTime, 3));
+
+  /* Stopping ends a stall, and then nothing more counts */
+  ASMetricsStalled(metrics, 20);
+  ASMetricsStopped(metrics, 24);
+  ASMetricsStalled(metrics, 25);
+  ASMetricsPlaying(metrics, 26);
+  ASMetricsStopped(metrics, 30);
+  ASMetricsGetSnapshot(metrics, 40, &s);
+  CHECK(s.rebuffers == 3 && near(s.stallTime, 7));
+  ASMetricsDestroy(metrics);
+
+  /* Nor is playback starting after the stream stopped the first audio */
+  metrics = ASMetricsCreate(0);
+  CHECK(metrics != NULL);
+  if (metrics == NULL) return;
+  ASMetricsStopped(metrics, 3);
+  ASMetricsPlaying(metrics, 4);
+  ASMetricsGetSnapshot(metrics, 5, &s);
+  CHECK(s.timeToFirstAudio == -1 && s.rebuffers == 0 && s.stallTime == 0);
+  ASMetricsDestroy(metrics);
+}
+
+static void test_histogram(void) {
+  static const double limits[kMetricsBufferBins - 1] = kMetricsBufferBinLimits;
+  stream_metrics_t *metrics = ASMetricsCreate(0);
+  CHECK(metrics != NULL);
+  if (metrics == NULL) return;
+
+  /* One second at each limit and just below it */
+  double now = 0;
+  double expected[kMetricsBufferBins] = {0};
+  for (int i = 0; i < kMetricsBufferBins - 1; i++) {
+    ASMetricsBufferLevel(metrics, limits[i] - 0.01, true, now);
+    expected[i] += 1;
+    now += 1;
+    ASMetricsBufferLevel(metrics, limits[i], true, now);
+    expected[i + 1] += 1;
+    now += 1;
+  }
+  ASMetricsBufferLevel(metrics, 1000, true, now);
+  expected[kMetricsBufferBins - 1] += 1;
+  now += 1;
+
+  /* Time not playing isn't counted */
+  ASMetricsBufferLevel(metrics, 3, false, now);
+  now += 5;
+  ASMetricsBufferLevel(metrics, 0, true, now);
+  ASMetricsBufferLevel(metrics, 3, true, now);
+  expected[3] += 2;
+  now += 2;
+
+  /* The level playing now counts up to the snapshot */
+  metrics_snapshot_t s;
+  ASMetricsGetSnapshot(metrics, now, &s);
+  for (int i = 0; i < kMetricsBufferBins; i++) {
+    CHECK(near(s.bufferHistogram[i], expected[i]));
+  }
+  ASMetricsGetSnapshot(metrics, now - 3, &s);
+  CHECK(near(s.bufferHistogram[3], expected[3] - 2));
+
+  /* and up to the stream stopping, after which nothing counts */
+  ASMetricsStopped(metrics, now + 1);
+  ASMetricsBufferLevel(metrics, 3, true, now + 2);
+  ASMetricsGetSnapshot(metrics, now + 10, &s);
+  CHECK(near(s.bufferHistogram[3], expected[3] + 1));
+  double total = 0;
+  for (int i = 0; i < kMetricsBufferBins; i++) total += s.bufferHistogram[i];
+  CHECK(near(total, now + 1 - 5));
+  ASMetricsDestroy(metrics);
+}
+
+int main(void) {
+  test_start();
+  test_stalls();
+  test_histogram();
+  return TEST_RESULT();
+}
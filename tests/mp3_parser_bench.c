@@ -0,0 +1,118 @@
+//
+//  mp3_parser_bench.c
+//  AudioStreamer
+//
+//  ASMP3Parser's throughput over a corpus of MP3s: tests/fixtures/vbr.mp3,
+//  and written with test_streams.h, 2 MB each of 128 kbps with an ID3 tag
+//  and a Xing frame in front, 192 kbps at 48 kHz with CRCs, 32 kbps MPEG-2
+//  mono, and free format. Each is fed 8 KB at a time, and the corpus as a
+//  whole is reported too. Every frame written has to come back, and no CRC
+//  may fail.
+//
+
+#include "ASMP3Parser.h"
+#include "bench.h"
+#include "test_streams.h"
+
+#define kReadSize 8192
+#define kStreamSize (2 << 20)
+
+typedef struct corpus_file {
+  const char *name;
+  uint8_t    *data;
+  size_t      length;
+  uint64_t    frames;         /* audio frames in it, 0 if not known */
+  uint64_t    found;          /* handed back on the last run */
+  mp3_stats_t stats;
+} corpus_file_t;
+
+static void format(void *context, const mp3_header_t *header, uint64_t offset) {
+  (void)context;
+  (void)header;
+  (void)offset;
+}
+
+static void packets(void *context, const void *data, uint32_t byteCount,
+                    uint32_t packetCount, const as_packet_desc_t *descs) {
+  (void)data;
+  (void)byteCount;
+  (void)descs;
+  corpus_file_t *file = context;
+  file->found += packetCount;
+}
+
+static void run_parser(void *context) {
+  corpus_file_t *file = context;
+  file->found = 0;
+  mp3_parser_t *parser = ASMP3ParserCreate(format, packets, file);
+  for (size_t read = 0; read < file->length; read += kReadSize) {
+    size_t length = file->length - read < kReadSize ? file->length - read
+                                                    : kReadSize;
+    ASMP3ParserParse(parser, file->data + read, length);
+  }
+  ASMP3ParserGetStats(parser, &file->stats);
+  ASMP3ParserDestroy(parser);
+}
+
+static void run_corpus(void *context) {
+  corpus_file_t *files = context;
+  for (corpus_file_t *file = files; file->name != NULL; file++) {
+    run_parser(file);
+  }
+}
+
+/* Writes frames of one format until the stream is full, padding every
+   third one if the format pads */
+static void write_stream(corpus_file_t *file, test_mp3_frame_t frame,
+                         bool tagged) {
+  uint32_t seed = 1;
+  file->data = malloc(kStreamSize + 2 * kMP3MaxFrameLength);
+  size_t length = 0;
+  if (tagged) {
+    length += test_write_id3(file->data, 4096);
+    length += test_write_xing_frame(file->data + length, &frame, &seed);
+  }
+  while (length < kStreamSize) {
+    test_mp3_frame_t f = frame;
+    f.padding = frame.padding && file->frames % 3 == 0;
+    length += test_write_mp3_frame(file->data + length, &f, false, &seed);
+    file->frames++;
+  }
+  file->length = length;
+}
+
+int main(void) {
+  corpus_file_t files[] = {
+    {.name = "vbr.mp3"},
+    {.name = "128 kbps, tagged"},
+    {.name = "192 kbps, 48 kHz, CRC"},
+    {.name = "32 kbps, MPEG-2 mono"},
+    {.name = "free format"},
+    {.name = NULL},
+  };
+  files[0].data = bench_read_fixture("vbr.mp3", &files[0].length);
+  if (files[0].data == NULL) return TEST_RESULT();
+  write_stream(&files[1], (test_mp3_frame_t){.mpeg1 = true, .bitrateIndex = 9,
+                                             .padding = true}, true);
+  write_stream(&files[2], (test_mp3_frame_t){.mpeg1 = true, .rateIndex = 1,
+                                             .bitrateIndex = 11, .crc = true},
+               false);
+  write_stream(&files[3], (test_mp3_frame_t){.bitrateIndex = 4, .mono = true,
+                                             .padding = true}, false);
+  write_stream(&files[4], (test_mp3_frame_t){.mpeg1 = true, .freeLength = 1000},
+               false);
+
+  size_t total = 0;
+  for (corpus_file_t *file = files; file->name != NULL; file++) {
+    int failures = testFailures;
+    double seconds = bench_best(run_parser, file);
+    CHECK(file->frames == 0 ? file->found > 0 : file->found == file->frames);
+    CHECK(file->stats.crcErrors == 0 && file->stats.syncLosses == 0);
+    if (testFailures > failures) fprintf(stderr, "in %s\n", file->name);
+    bench_report(file->name, file->length, seconds);
+    total += file->length;
+  }
+  bench_report("all of them", total, bench_best(run_corpus, files));
+  for (corpus_file_t *file = files; file->name != NULL; file++) free(file->data);
+  return TEST_RESULT();
+}
@@ -0,0 +1,172 @@
+//
+//  mp3_parser_test.c
+//  AudioStreamer
+//
+//  Builds an MP3 stream with a leading tag, a Xing frame, bitrate changes,
+//  garbage, CRC frames (one of them bad), a tag in the middle, a change of
+//  format and a free format run. Fed to ASMP3Parser in chunks of any size,
+//  the same frames and format changes have to come back every time.
+//
+
+#include "ASMP3Parser.h"
+#include "test.h"
+#include "test_streams.h"
+
+#include <stdlib.h>
+
+#define kMaxStream (1 << 20)
+#define kMaxFrames 1024
+#define kMaxFormats 8
+
+typedef struct expected_format {
+  uint32_t sampleRate;
+  uint8_t  channels;
+  uint64_t offset;
+} expected_format_t;
+
+static uint8_t stream[kMaxStream];
+static size_t streamLength;
+
+/* What should come out */
+static uint32_t frameLengths[kMaxFrames];
+static size_t frameCount;
+static uint8_t audio[kMaxStream];
+static size_t audioLength;
+static expected_format_t formats[kMaxFormats];
+static size_t formatCount;
+
+/* What did */
+static uint32_t gotLengths[kMaxFrames];
+static size_t gotCount;
+static uint8_t gotAudio[kMaxStream];
+static size_t gotAudioLength;
+static expected_format_t gotFormats[kMaxFormats];
+static size_t gotFormatCount;
+
+static void add_frames(const test_mp3_frame_t *base, int count, bool crc,
+                       int badAt, uint32_t *seed) {
+  for (int i = 0; i < count; i++) {
+    test_mp3_frame_t f = *base;
+    f.padding = i % 3 == 1;
+    if (f.bitrateIndex != 0) f.bitrateIndex = (uint8_t)(base->bitrateIndex + i % 3);
+    f.crc = crc;
+    uint8_t *p = stream + streamLength;
+    size_t length = test_write_mp3_frame(p, &f, i == badAt, seed);
+    streamLength += length;
+    if (i == badAt) continue;
+    frameLengths[frameCount++] = (uint32_t)length;
+    memcpy(audio + audioLength, p, length);
+    audioLength += length;
+  }
+}
+
+static void expect_format(const test_mp3_frame_t *f) {
+  static const uint32_t rates[2][3] = {{22050, 24000, 16000}, {44100, 48000, 32000}};
+  formats[formatCount].sampleRate = rates[f->mpeg1][f->rateIndex];
+  formats[formatCount].channels = f->mono ? 1 : 2;
+  formats[formatCount].offset = streamLength;
+  formatCount++;
+}
+
+static void build_stream(void) {
+  uint32_t seed = 77;
+  streamLength += test_write_id3(stream, 300);
+
+  test_mp3_frame_t stereo = {.mpeg1 = true, .rateIndex = 0, .bitrateIndex = 9};
+  expect_format(&stereo);
+  streamLength += test_write_xing_frame(stream + streamLength, &stereo, &seed);
+  add_frames(&stereo, 200, false, -1, &seed);
+
+  /* Garbage, then frames with CRCs. The format is the same, so it isn't
+     reported again */
+  test_fill_payload(stream + streamLength, 123, &seed);
+  streamLength += 123;
+  add_frames(&stereo, 100, true, 40, &seed);
+
+  streamLength += test_write_id3(stream + streamLength, 1000);
+  test_mp3_frame_t mono = {.mpeg1 = false, .rateIndex = 1, .bitrateIndex = 5, .mono = true};
+  expect_format(&mono);
+  add_frames(&mono, 100, false, -1, &seed);
+
+  test_mp3_frame_t free = {.mpeg1 = true, .rateIndex = 1, .bitrateIndex = 0,
+                           .freeLength = 700};
+  expect_format(&free);
+  add_frames(&free, 50, false, -1, &seed);
+}
+
+static void on_format(void *context, const mp3_header_t *format, uint64_t offset) {
+  (void)context;
+  if (gotFormatCount == kMaxFormats) return;
+  gotFormats[gotFormatCount].sampleRate = format->sampleRate;
+  gotFormats[gotFormatCount].channels = format->channels;
+  gotFormats[gotFormatCount].offset = offset;
+  gotFormatCount++;
+}
+
+static void on_packets(void *context, const void *data, uint32_t byteCount,
+                       uint32_t packetCount, const as_packet_desc_t *descs) {
+  (void)context;
+  uint32_t end = 0;
+  for (uint32_t i = 0; i < packetCount && gotCount < kMaxFrames; i++) {
+    CHECK(descs[i].variableFrames == 0);
+    gotLengths[gotCount++] = descs[i].byteSize;
+    memcpy(gotAudio + gotAudioLength, (const uint8_t *)data + descs[i].startOffset,
+           descs[i].byteSize);
+    gotAudioLength += descs[i].byteSize;
+    end = (uint32_t)(descs[i].startOffset + descs[i].byteSize);
+  }
+  CHECK(end == byteCount);
+}
+
+static void check_chunked(mp3_parser_t *parser, size_t chunk) {
+  gotCount = gotAudioLength = gotFormatCount = 0;
+  ASMP3ParserReset(parser);
+  for (size_t offset = 0; offset < streamLength; offset += chunk) {
+    size_t length = streamLength - offset < chunk ? streamLength - offset : chunk;
+    ASMP3ParserParse(parser, stream + offset, length);
+  }
+  CHECK(gotCount == frameCount);
+  CHECK(memcmp(gotLengths, frameLengths, frameCount * sizeof(uint32_t)) == 0);
+  CHECK(gotAudioLength == audioLength && memcmp(gotAudio, audio, audioLength) == 0);
+  CHECK(gotFormatCount == formatCount);
+  for (size_t i = 0; i < formatCount && i < gotFormatCount; i++) {
+    CHECK(gotFormats[i].sampleRate == formats[i].sampleRate);
+    CHECK(gotFormats[i].channels == formats[i].channels);
+    CHECK(gotFormats[i].offset == formats[i].offset);
+  }
+}
+
+static void test_parse_header(void) {
+  mp3_header_t header;
+  const uint8_t good[] = {0xFF, 0xFB, 0x90, 0x44};  /* MPEG 1, 128 kbit/s */
+  CHECK(ASMP3ParseHeader(good, &header));
+  CHECK(header.version == 1 && header.bitrate == 128000 &&
+        header.sampleRate == 44100 && header.frameLength == 417 &&
+        header.samplesPerFrame == 1152 && header.channels == 2 && !header.crc);
+  const uint8_t layer2[] = {0xFF, 0xFD, 0x90, 0x44};
+  CHECK(!ASMP3ParseHeader(layer2, &header));
+  const uint8_t badRate[] = {0xFF, 0xFB, 0x9C, 0x44};
+  CHECK(!ASMP3ParseHeader(badRate, &header));
+}
+
+int main(void) {
+  build_stream();
+  test_parse_header();
+  mp3_parser_t *parser = ASMP3ParserCreate(on_format, on_packets, NULL);
+  CHECK(parser != NULL);
+  uint64_t runs = 0;
+  for (size_t chunk = 1; chunk <= 64; chunk++, runs++) check_chunked(parser, chunk);
+  for (size_t chunk = 65; chunk < streamLength; chunk = chunk * 2 + 11, runs++) {
+    check_chunked(parser, chunk);
+  }
+  check_chunked(parser, streamLength);
+  runs++;
+
+  /* Statistics carry on across resets: one bad CRC per run */
+  mp3_stats_t stats;
+  ASMP3ParserGetStats(parser, &stats);
+  CHECK(stats.crcErrors == runs);
+  CHECK(stats.frames == runs * frameCount);
+  ASMP3ParserDestroy(parser);
+  return TEST_RESULT();
+}
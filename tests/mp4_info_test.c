@@ -0,0 +1,227 @@
+//
+//  mp4_info_test.c
+//  AudioStreamer
+//
+//  Writes MP4 files box by box and scans them with ASMP4Info in chunks of
+//  any size: version 0 and 1 media headers, a 64-bit mdat size, a video
+//  track ahead of the sound track, an mdat running to the end of the file,
+//  one ahead of the moov, and things which aren't MP4 files at all.
+//
+
+#include "ASMP4Info.h"
+#include "test.h"
+#include "test_streams.h"
+
+#define kMaxFile 8192
+
+static uint8_t file[kMaxFile];
+
+static void ftyp(test_boxes_t *w) {
+  test_box_begin(w, "ftyp");
+  test_put_bytes(w, "M4A ", 4);
+  test_put32(w, 0);
+  test_put_bytes(w, "isom", 4);
+  test_box_end(w);
+}
+
+static void mdhd(test_boxes_t *w, int version, uint32_t timescale, uint64_t duration) {
+  test_box_begin(w, "mdhd");
+  test_put32(w, (uint32_t)version << 24);
+  if (version == 1) {
+    test_put64(w, 0);               /* creation */
+    test_put64(w, 0);               /* modification */
+    test_put32(w, timescale);
+    test_put64(w, duration);
+  } else {
+    test_put32(w, 0);
+    test_put32(w, 0);
+    test_put32(w, timescale);
+    test_put32(w, (uint32_t)duration);
+  }
+  test_put32(w, 0x55C40000);        /* language, quality */
+  test_box_end(w);
+}
+
+static void hdlr(test_boxes_t *w, const char *handler) {
+  test_box_begin(w, "hdlr");
+  test_put32(w, 0);
+  test_put32(w, 0);
+  test_put_bytes(w, handler, 4);
+  test_put32(w, 0);
+  test_put32(w, 0);
+  test_put32(w, 0);
+  w->data[w->length++] = 0;    /* empty name */
+  test_box_end(w);
+}
+
+static void stts(test_boxes_t *w, const uint32_t *counts, uint32_t entries) {
+  test_box_begin(w, "stts");
+  test_put32(w, 0);
+  test_put32(w, entries);
+  for (uint32_t i = 0; i < entries; i++) {
+    test_put32(w, counts[i]);
+    test_put32(w, 1024);
+  }
+  test_box_end(w);
+}
+
+static void trak(test_boxes_t *w, const char *handler, int version, uint32_t timescale,
+                 uint64_t duration, const uint32_t *counts, uint32_t entries) {
+  test_box_begin(w, "trak");
+  test_box_filler(w, "tkhd", 84);
+  test_box_begin(w, "mdia");
+  mdhd(w, version, timescale, duration);
+  hdlr(w, handler);
+  test_box_begin(w, "minf");
+  test_box_filler(w, strcmp(handler, "soun") == 0 ? "smhd" : "vmhd", 8);
+  test_box_filler(w, "dinf", 28);
+  test_box_begin(w, "stbl");
+  test_box_filler(w, "stsd", 80);
+  stts(w, counts, entries);
+  test_box_filler(w, "stsz", 20);
+  test_box_end(w);
+  test_box_end(w);
+  test_box_end(w);
+  test_box_end(w);
+}
+
+typedef struct expected {
+  bool     found;
+  uint32_t timescale;
+  uint64_t duration;
+  uint64_t packetCount;
+  uint64_t mediaBytes;
+} expected_t;
+
+/* Scans the file in every chunk size up to 64 and a few bigger ones, and
+   checks the same comes out each time, and that the scan has finished once
+   it has the header of the box at stopAt */
+static void check_scan(const test_boxes_t *w, size_t stopAt, const expected_t *e) {
+  mp4_info_t *info = ASMP4InfoCreate();
+  CHECK(info != NULL);
+  for (size_t chunk = 1; chunk <= w->length; chunk = chunk < 64 ? chunk + 1 : chunk * 3) {
+    ASMP4InfoDestroy(info);
+    info = ASMP4InfoCreate();
+    bool done = false;
+    size_t offset = 0;
+    while (offset < w->length && !done) {
+      size_t n = w->length - offset < chunk ? w->length - offset : chunk;
+      done = ASMP4InfoScan(info, offset, w->data + offset, n);
+      offset += n;
+    }
+    CHECK(done);
+    CHECK(offset <= stopAt + 16 + chunk);
+
+    mp4_track_info_t track;
+    bool found = ASMP4InfoTrack(info, &track);
+    CHECK(found == e->found);
+    if (found && e->found) {
+      CHECK(track.timescale == e->timescale);
+      CHECK(track.duration == e->duration);
+      CHECK(track.packetCount == e->packetCount);
+      CHECK(track.mediaBytes == e->mediaBytes);
+    }
+  }
+  ASMP4InfoDestroy(info);
+}
+
+/* A video track first, then sound with a version 1 mdhd whose duration
+   doesn't fit in 32 bits, then an mdat with a 64-bit size */
+static void test_fast_start(void) {
+  test_boxes_t w = {.data = file};
+  ftyp(&w);
+  test_box_begin(&w, "moov");
+  test_box_filler(&w, "mvhd", 100);
+  const uint32_t video[] = {3000};
+  trak(&w, "vide", 0, 90000, 900000, video, 1);
+  const uint32_t sound[] = {100, 200, 50};
+  trak(&w, "soun", 1, 44100, 5000000000ull, sound, 3);
+  const uint32_t other[] = {9};
+  trak(&w, "soun", 0, 8000, 1000, other, 1);
+  test_box_filler(&w, "udta", 40);
+  test_box_end(&w);
+  test_box_filler(&w, "free", 16);
+  size_t mdatAt = w.length;
+  test_put32(&w, 1);
+  test_put_bytes(&w, "mdat", 4);
+  test_put64(&w, 16 + 7000000000ull);
+  test_fill_payload(w.data + w.length, 500, &(uint32_t){3});
+  w.length += 500;
+
+  expected_t e = {true, 44100, 5000000000ull, 350, 7000000000ull};
+  check_scan(&w, mdatAt, &e);
+}
+
+/* Version 0 everywhere, and an mdat which runs to the end of the file, so
+   its size isn't known */
+static void test_mdat_to_end(void) {
+  test_boxes_t w = {.data = file};
+  ftyp(&w);
+  test_box_begin(&w, "moov");
+  const uint32_t sound[] = {4321};
+  trak(&w, "soun", 0, 48000, 4321 * 1024, sound, 1);
+  test_box_end(&w);
+  size_t mdatAt = w.length;
+  test_put32(&w, 0);
+  test_put_bytes(&w, "mdat", 4);
+  w.length += 300;
+
+  expected_t e = {true, 48000, 4321 * 1024, 4321, 0};
+  check_scan(&w, mdatAt, &e);
+
+  /* With a 32-bit size instead */
+  w.length = mdatAt;
+  test_box_filler(&w, "mdat", 300);
+  e.mediaBytes = 300;
+  check_scan(&w, mdatAt, &e);
+}
+
+/* The mdat comes first, so the moov is too far off to wait for */
+static void test_mdat_first(void) {
+  test_boxes_t w = {.data = file};
+  ftyp(&w);
+  size_t mdatAt = w.length;
+  test_box_filler(&w, "mdat", 2000);
+  test_box_begin(&w, "moov");
+  const uint32_t sound[] = {10};
+  trak(&w, "soun", 0, 44100, 10240, sound, 1);
+  test_box_end(&w);
+  expected_t e = {false, 0, 0, 0, 0};
+  check_scan(&w, mdatAt, &e);
+}
+
+static void test_not_mp4(void) {
+  test_boxes_t w = {.data = file};
+  uint32_t seed = 20;
+  w.length = test_write_id3(w.data, 100);
+  test_mp3_frame_t f = {.mpeg1 = true, .bitrateIndex = 9};
+  for (int i = 0; i < 5; i++) w.length += test_write_mp3_frame(w.data + w.length, &f, false, &seed);
+  expected_t e = {false, 0, 0, 0, 0};
+  check_scan(&w, 0, &e);
+
+  /* A box too big for the one it's in */
+  w.length = 0;
+  ftyp(&w);
+  test_box_begin(&w, "moov");
+  test_box_begin(&w, "trak");
+  test_box_filler(&w, "tkhd", 20);
+  test_box_end(&w);
+  test_box_end(&w);
+  size_t tkhdAt = w.length - 20 - 8;
+  w.data[tkhdAt + 3] = 0xFF;
+  check_scan(&w, tkhdAt, &e);
+
+  /* Bytes from somewhere else end the scan */
+  mp4_info_t *info = ASMP4InfoCreate();
+  CHECK(!ASMP4InfoScan(info, 0, w.data, 10));
+  CHECK(ASMP4InfoScan(info, 20, w.data + 20, 10));
+  ASMP4InfoDestroy(info);
+}
+
+int main(void) {
+  test_fast_start();
+  test_mdat_to_end();
+  test_mdat_first();
+  test_not_mp4();
+  return TEST_RESULT();
+}
@@ -0,0 +1,341 @@
+//
+//  network_simulator_test.c
+//  AudioStreamer
+//
+//  What a simulated link delivers and when: a body arrives after the latency
+//  at the link's bandwidth, shared between transports, no more than a receive
+//  window ahead of the reader and no faster than a live source makes it.
+//  Scripted bandwidth changes and disconnects happen when they're scripted
+//  for, paused transports get no events, and the same seed gives the same
+//  run.
+//
+
+#include "ASNetworkSimulator.h"
+#include "test.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define kStep 0.01
+#define kPacketSize 1460            /* ASNetworkSimulator's */
+#define kReceiveWindow (256 * 1024)
+#define kMaxTrace 4096
+
+typedef struct reader {
+  network_simulator_t *sim;
+  transport_t *transport;
+  const uint8_t *body;
+  size_t length;
+  bool reading;
+  size_t read;
+  bool matches;                     /* what was read is the body */
+  unsigned events;
+  double endTime;                   /* or -1 */
+  double errorTime;                 /* or -1 */
+  /* When each read happened and how much it got */
+  double traceTimes[kMaxTrace];
+  size_t traceBytes[kMaxTrace];
+  size_t traceCount;
+} reader_t;
+
+static void read_available(reader_t *reader) {
+  uint8_t buffer[4096];
+  ssize_t n;
+  while ((n = ASTransportRead(reader->transport, buffer, sizeof(buffer))) > 0) {
+    if (reader->read + (size_t)n > reader->length ||
+        memcmp(buffer, reader->body + reader->read, (size_t)n) != 0) {
+      reader->matches = false;
+    }
+    reader->read += (size_t)n;
+    if (reader->traceCount < kMaxTrace) {
+      reader->traceTimes[reader->traceCount] = ASNetworkSimulatorTime(reader->sim);
+      reader->traceBytes[reader->traceCount] = (size_t)n;
+      reader->traceCount++;
+    }
+  }
+}
+
+static void on_event(void *context, transport_t *transport,
+                     transport_event_t event) {
+  (void)transport;
+  reader_t *reader = context;
+  reader->events++;
+  switch (event) {
+    case TRANSPORT_EVENT_READABLE:
+      if (reader->reading) read_available(reader);
+      break;
+    case TRANSPORT_EVENT_END:
+      reader->endTime = ASNetworkSimulatorTime(reader->sim);
+      break;
+    case TRANSPORT_EVENT_ERROR:
+      reader->errorTime = ASNetworkSimulatorTime(reader->sim);
+      break;
+  }
+}
+
+static uint8_t *make_body(size_t length, uint32_t seed) {
+  uint8_t *body = malloc(length);
+  CHECK(body != NULL);
+  if (body == NULL) exit(1);
+  for (size_t i = 0; i < length; i++) body[i] = (uint8_t)test_random(&seed);
+  return body;
+}
+
+static void open_reader(reader_t *reader, network_simulator_t *sim,
+                        const uint8_t *body, size_t length, double sourceRate,
+                        size_t burst) {
+  memset(reader, 0, sizeof(*reader));
+  reader->sim = sim;
+  reader->body = body;
+  reader->length = length;
+  reader->reading = true;
+  reader->matches = true;
+  reader->endTime = -1;
+  reader->errorTime = -1;
+  sim_response_t response = {
+    .body = body,
+    .length = length,
+    .status = 200,
+    .sourceRate = sourceRate,
+    .burst = burst,
+  };
+  reader->transport = ASNetworkSimulatorOpen(sim, &response, on_event, reader);
+  CHECK(reader->transport != NULL);
+  if (reader->transport == NULL) exit(1);
+}
+
+static void run_until(network_simulator_t *sim, double time) {
+  while (ASNetworkSimulatorTime(sim) < time - kStep / 2) {
+    ASNetworkSimulatorAdvance(sim, kStep);
+  }
+}
+
+static void test_delivery(void) {
+  sim_link_t link = {.bandwidth = 100000, .latency = 0.1};
+  network_simulator_t *sim = ASNetworkSimulatorCreate(&link, 1);
+  uint8_t *body = make_body(100000, 1);
+  reader_t reader;
+  open_reader(&reader, sim, body, 100000, 0, 0);
+
+  /* Nothing before the latency */
+  run_until(sim, 0.1);
+  CHECK(reader.read == 0);
+
+  /* A second's worth of bytes takes a second, after the latency */
+  run_until(sim, 0.6);
+  CHECK(reader.read > 45000 && reader.read < 52000);
+  run_until(sim, 2);
+  CHECK(reader.matches && reader.read == 100000);
+  CHECK(fabs(reader.endTime - 1.1) < 2 * kStep);
+  CHECK(reader.errorTime < 0);
+  CHECK(ASTransportAtEnd(reader.transport));
+  CHECK(ASTransportStatusCode(reader.transport) == 200);
+  ASTransportClose(reader.transport);
+
+  /* An empty body ends once the response arrives */
+  open_reader(&reader, sim, body, 0, 0, 0);
+  run_until(sim, 3);
+  CHECK(fabs(reader.endTime - 2.1) < 2 * kStep);
+  ASTransportClose(reader.transport);
+  ASNetworkSimulatorDestroy(sim);
+  free(body);
+}
+
+static void test_sharing(void) {
+  sim_link_t link = {.bandwidth = 100000, .latency = 0.1};
+  network_simulator_t *sim = ASNetworkSimulatorCreate(&link, 1);
+  uint8_t *body = make_body(50000, 2);
+  reader_t a, b;
+  open_reader(&a, sim, body, 50000, 0, 0);
+  open_reader(&b, sim, body, 50000, 0, 0);
+
+  /* Each gets half the link, so both take as long as one twice the size */
+  run_until(sim, 2);
+  CHECK(a.matches && a.read == 50000 && b.matches && b.read == 50000);
+  CHECK(fabs(a.endTime - 1.1) < 3 * kStep && fabs(b.endTime - 1.1) < 3 * kStep);
+
+  /* Closing one gives the other the whole link */
+  ASTransportClose(a.transport);
+  ASTransportClose(b.transport);
+  open_reader(&a, sim, body, 50000, 0, 0);
+  open_reader(&b, sim, body, 50000, 0, 0);
+  run_until(sim, 2.3);
+  ASTransportClose(a.transport);
+  run_until(sim, 3);
+  CHECK(b.matches && b.read == 50000);
+  CHECK(fabs(b.endTime - 2.75) < 3 * kStep);
+  ASTransportClose(b.transport);
+  ASNetworkSimulatorDestroy(sim);
+  free(body);
+}
+
+static void test_window(void) {
+  sim_link_t link = {.bandwidth = 1e6, .latency = 0.05};
+  network_simulator_t *sim = ASNetworkSimulatorCreate(&link, 1);
+  uint8_t *body = make_body(1000000, 3);
+  reader_t reader;
+  open_reader(&reader, sim, body, 1000000, 0, 0);
+
+  /* A reader which doesn't read holds the sender back at the window */
+  reader.reading = false;
+  run_until(sim, 3);
+  CHECK(reader.events > 0);
+  read_available(&reader);
+  CHECK(reader.read >= kReceiveWindow - kPacketSize &&
+        reader.read <= kReceiveWindow + kPacketSize);
+
+  /* and the rest comes once it does */
+  reader.reading = true;
+  run_until(sim, 5);
+  CHECK(reader.matches && reader.read == 1000000);
+  CHECK(reader.endTime > 3);
+  ASTransportClose(reader.transport);
+  ASNetworkSimulatorDestroy(sim);
+  free(body);
+}
+
+static void test_script(void) {
+  sim_link_t link = {.bandwidth = 100000, .latency = 0.1};
+  network_simulator_t *sim = ASNetworkSimulatorCreate(&link, 1);
+  uint8_t *body = make_body(100000, 4);
+  reader_t reader;
+
+  /* An outage of a second puts the end back a second, with what was sent
+     before it still arriving */
+  CHECK(ASNetworkSimulatorScheduleBandwidth(sim, 0.3, 0));
+  CHECK(ASNetworkSimulatorScheduleBandwidth(sim, 1.3, 100000));
+  open_reader(&reader, sim, body, 100000, 0, 0);
+  run_until(sim, 1.3);
+  size_t during = reader.read;
+  CHECK(during > 28000 && during < 31000);
+  run_until(sim, 3);
+  CHECK(reader.matches && reader.read == 100000);
+  CHECK(fabs(reader.endTime - 2.1) < 3 * kStep);
+  ASTransportClose(reader.transport);
+
+  /* A disconnect fails the body part way, leaving what came before it */
+  CHECK(ASNetworkSimulatorScheduleDisconnect(sim, 3.5));
+  open_reader(&reader, sim, body, 100000, 0, 0);
+  run_until(sim, 5);
+  CHECK(fabs(reader.errorTime - 3.5) < 2 * kStep);
+  CHECK(reader.endTime < 0);
+  CHECK(reader.matches && reader.read > 35000 && reader.read < 45000);
+  CHECK(ASTransportError(reader.transport) != NULL);
+  uint8_t byte;
+  CHECK(ASTransportRead(reader.transport, &byte, 1) == -1);
+  CHECK(!ASTransportAtEnd(reader.transport));
+  ASTransportClose(reader.transport);
+
+  /* but not a body which had all arrived */
+  CHECK(ASNetworkSimulatorScheduleDisconnect(sim, 7));
+  open_reader(&reader, sim, body, 50000, 0, 0);
+  run_until(sim, 8);
+  CHECK(reader.errorTime < 0 && reader.read == 50000 && reader.endTime > 0);
+  ASTransportClose(reader.transport);
+  ASNetworkSimulatorDestroy(sim);
+  free(body);
+}
+
+static void test_live(void) {
+  sim_link_t link = {.bandwidth = 1e6, .latency = 0.1};
+  network_simulator_t *sim = ASNetworkSimulatorCreate(&link, 1);
+  uint8_t *body = make_body(200000, 5);
+  reader_t reader;
+
+  /* The burst comes at once, then the source's rate however fast the link */
+  open_reader(&reader, sim, body, 200000, 8000, 16000);
+  run_until(sim, 0.2);
+  CHECK(reader.read >= 16000 - kPacketSize && reader.read <= 16000 + kPacketSize);
+  for (double t = 1; t <= 5; t++) {
+    run_until(sim, t);
+    double made = 16000 + 8000 * (t - 0.1);
+    CHECK(reader.read >= made - 2 * kPacketSize && reader.read <= made + kPacketSize);
+  }
+  CHECK(reader.matches && reader.endTime < 0);
+
+  /* A reader which falls behind gets what was made meanwhile at the link's
+     rate */
+  reader.reading = false;
+  run_until(sim, 10);
+  reader.reading = true;
+  read_available(&reader);
+  run_until(sim, 10.2);
+  double made = 16000 + 8000 * 10;
+  CHECK(reader.read >= made - 2 * kPacketSize && reader.read <= made + kPacketSize);
+  run_until(sim, 30);
+  CHECK(reader.matches && reader.read == 200000);
+  CHECK(fabs(reader.endTime - (0.1 + (200000 - 16000) / 8000.0)) < 3 * kStep);
+  ASTransportClose(reader.transport);
+  ASNetworkSimulatorDestroy(sim);
+  free(body);
+}
+
+static void test_paused(void) {
+  sim_link_t link = {.bandwidth = 100000, .latency = 0.1};
+  network_simulator_t *sim = ASNetworkSimulatorCreate(&link, 1);
+  uint8_t *body = make_body(20000, 6);
+  reader_t reader;
+  open_reader(&reader, sim, body, 20000, 0, 0);
+
+  ASTransportSetPaused(reader.transport, true);
+  run_until(sim, 1);
+  CHECK(reader.events == 0 && ASTransportHasBytesAvailable(reader.transport));
+
+  /* What came in meanwhile is sent on the next advance */
+  ASTransportSetPaused(reader.transport, false);
+  CHECK(reader.events == 0);
+  ASNetworkSimulatorAdvance(sim, 0);
+  CHECK(reader.matches && reader.read == 20000 &&
+        fabs(reader.endTime - 1) < 1e-6);
+  ASTransportClose(reader.transport);
+  ASNetworkSimulatorDestroy(sim);
+  free(body);
+}
+
+/* Reads a body over a jittery link, into reader */
+static void jittery_run(uint32_t seed, const uint8_t *body, size_t length,
+                        reader_t *reader) {
+  sim_link_t link = {.bandwidth = 200000, .latency = 0.05, .jitter = 0.05};
+  network_simulator_t *sim = ASNetworkSimulatorCreate(&link, seed);
+  CHECK(ASNetworkSimulatorScheduleBandwidth(sim, 0.5, 50000));
+  open_reader(reader, sim, body, length, 0, 0);
+  run_until(sim, 5);
+  ASTransportClose(reader->transport);
+  ASNetworkSimulatorDestroy(sim);
+}
+
+static bool same_trace(const reader_t *a, const reader_t *b) {
+  if (a->traceCount != b->traceCount) return false;
+  for (size_t i = 0; i < a->traceCount; i++) {
+    if (a->traceTimes[i] != b->traceTimes[i] ||
+        a->traceBytes[i] != b->traceBytes[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void test_deterministic(void) {
+  uint8_t *body = make_body(150000, 7);
+  static reader_t a, b, c;
+  jittery_run(7, body, 150000, &a);
+  jittery_run(7, body, 150000, &b);
+  jittery_run(8, body, 150000, &c);
+  /* Jitter holds packets up without reordering them */
+  CHECK(a.matches && a.read == 150000 && c.matches && c.read == 150000);
+  CHECK(same_trace(&a, &b));
+  CHECK(!same_trace(&a, &c));
+  free(body);
+}
+
+int main(void) {
+  test_delivery();
+  test_sharing();
+  test_window();
+  test_script();
+  test_live();
+  test_paused();
+  test_deterministic();
+  return TEST_RESULT();
+}
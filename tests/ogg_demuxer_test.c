@@ -0,0 +1,295 @@
+//
+//  ogg_demuxer_test.c
+//  AudioStreamer
+//
+//  Muxes a chained Ogg stream of two logical streams, with packets spanning
+//  pages and pages of varying lengths, and feeds it to ASOggDemuxer in chunks
+//  of any size. Every packet has to come back whole, with the right granule
+//  position and stream flags. A page with a bad CRC has to cost only the
+//  packet it held. The Opus helpers are checked on hand-built headers.
+//
+
+#include "ASOggDemuxer.h"
+#include "test.h"
+#include "test_streams.h"
+
+#include <stdlib.h>
+
+#define kMaxStream  (2 << 20)
+#define kMaxPackets 1024
+#define kBigPacket  70000
+
+typedef struct expected_packet {
+  size_t   offset;     /* in 'packetData' */
+  size_t   length;
+  uint32_t serial;
+  int64_t  granule;
+  bool     bos;
+  bool     eos;
+} expected_packet_t;
+
+static uint8_t stream[kMaxStream];
+static size_t streamLength;
+static uint8_t packetData[kMaxStream];
+static size_t packetDataLength;
+static expected_packet_t expected[kMaxPackets];
+static size_t expectedCount;
+static size_t bigPacket;      /* index of the packet spanning pages */
+static size_t bigPageOffset;  /* where the first page of it starts */
+
+/* CRC-32 with polynomial 0x04C11DB7, bit by bit */
+static uint32_t ogg_crc(const uint8_t *p, size_t length) {
+  uint32_t crc = 0;
+  for (size_t i = 0; i < length; i++) {
+    crc ^= (uint32_t)p[i] << 24;
+    for (int b = 0; b < 8; b++) {
+      crc = (crc & 0x80000000u) ? (crc << 1) ^ 0x04C11DB7u : crc << 1;
+    }
+  }
+  return crc;
+}
+
+static void put_le(uint8_t *p, uint64_t value, int bytes) {
+  for (int i = 0; i < bytes; i++) p[i] = (uint8_t)(value >> (8 * i));
+}
+
+typedef struct muxer {
+  uint32_t serial;
+  uint32_t sequence;
+  bool     bos;
+  bool     continued;   /* the page starts in the middle of a packet */
+  int      limit;       /* segments per page */
+  uint8_t  lacing[255];
+  int      segments;
+  uint8_t  body[255 * 255];
+  size_t   bodyLength;
+  int64_t  granule;     /* of the last packet ending on the page, or -1 */
+  long     lastEnding;  /* that packet's index, or -1 */
+  uint32_t seed;
+} muxer_t;
+
+static void flush_page(muxer_t *m, bool eos) {
+  if (m->segments == 0) return;
+  uint8_t *p = stream + streamLength;
+  memcpy(p, "OggS", 4);
+  p[4] = 0;
+  p[5] = (uint8_t)((m->continued ? 1 : 0) | (m->bos ? 2 : 0) | (eos ? 4 : 0));
+  put_le(p + 6, (uint64_t)m->granule, 8);
+  put_le(p + 14, m->serial, 4);
+  put_le(p + 18, m->sequence++, 4);
+  put_le(p + 22, 0, 4);
+  p[26] = (uint8_t)m->segments;
+  memcpy(p + 27, m->lacing, (size_t)m->segments);
+  memcpy(p + 27 + m->segments, m->body, m->bodyLength);
+  size_t length = 27 + (size_t)m->segments + m->bodyLength;
+  put_le(p + 22, ogg_crc(p, length), 4);
+  streamLength += length;
+
+  if (m->lastEnding >= 0) {
+    expected[m->lastEnding].granule = m->granule;
+    expected[m->lastEnding].eos = eos;
+  }
+  m->continued = m->lacing[m->segments - 1] == 255;
+  m->bos = false;
+  m->segments = 0;
+  m->bodyLength = 0;
+  m->granule = -1;
+  m->lastEnding = -1;
+  m->limit = 8 + (int)test_random_below(&m->seed, 248);
+}
+
+static void add_packet(muxer_t *m, const uint8_t *data, size_t length,
+                       int64_t granule) {
+  expected_packet_t *e = &expected[expectedCount];
+  e->offset = packetDataLength;
+  e->length = length;
+  e->serial = m->serial;
+  e->granule = -1;
+  e->bos = m->bos && m->segments == 0;
+  e->eos = false;
+  memcpy(packetData + packetDataLength, data, length);
+  packetDataLength += length;
+
+  size_t left = length;
+  for (;;) {
+    if (m->segments == m->limit) flush_page(m, false);
+    uint8_t segment = left < 255 ? (uint8_t)left : 255;
+    m->lacing[m->segments++] = segment;
+    memcpy(m->body + m->bodyLength, data, segment);
+    m->bodyLength += segment;
+    data += segment;
+    left -= segment;
+    if (segment < 255) break;
+  }
+  m->granule = granule;
+  m->lastEnding = (long)expectedCount;
+  expectedCount++;
+}
+
+static size_t opus_head(uint8_t *p, uint8_t channels, uint16_t preSkip) {
+  memcpy(p, "OpusHead", 8);
+  p[8] = 1;
+  p[9] = channels;
+  put_le(p + 10, preSkip, 2);
+  put_le(p + 12, 44100, 4);
+  put_le(p + 16, 0, 2);
+  p[18] = 0;
+  return 19;
+}
+
+static size_t opus_tags(uint8_t *p, const char *title) {
+  memcpy(p, "OpusTags", 8);
+  put_le(p + 8, 4, 4);
+  memcpy(p + 12, "test", 4);
+  put_le(p + 16, 2, 4);
+  size_t at = 20;
+  const char *comments[2] = {"ARTIST=Someone", title};
+  for (int i = 0; i < 2; i++) {
+    size_t length = strlen(comments[i]);
+    put_le(p + at, length, 4);
+    memcpy(p + at + 4, comments[i], length);
+    at += 4 + length;
+  }
+  return at;
+}
+
+static void mux_link(uint32_t serial, int packets, bool withBig, uint32_t seed) {
+  muxer_t *m = calloc(1, sizeof(muxer_t));
+  m->serial = serial;
+  m->bos = true;
+  m->granule = -1;
+  m->lastEnding = -1;
+  m->seed = seed;
+  m->limit = 255;
+
+  static uint8_t packet[kBigPacket];
+  add_packet(m, packet, opus_head(packet, 2, 312), 0);
+  flush_page(m, false);
+  add_packet(m, packet, opus_tags(packet, "TITLE=Link"), 0);
+  flush_page(m, false);
+
+  int64_t granule = 0;
+  for (int i = 0; i < packets; i++) {
+    size_t length = 1 + test_random_below(&m->seed, 1200);
+    if (i % 50 == 49) length = 255 * (1 + test_random_below(&m->seed, 3));
+    if (withBig && i == packets / 2) {
+      /* Starts a page of its own and fills it, then runs onto the next */
+      flush_page(m, false);
+      m->limit = 255;
+      bigPacket = expectedCount;
+      bigPageOffset = streamLength;
+      length = kBigPacket;
+    }
+    for (size_t b = 0; b < length; b++) packet[b] = (uint8_t)test_random(&m->seed);
+    packet[0] = 0xFC;  /* CELT, 20 ms, one frame */
+    granule += 960;
+    add_packet(m, packet, length, granule);
+  }
+  flush_page(m, true);
+  free(m);
+}
+
+/* What came back */
+static size_t gotCount;
+static size_t filterCalls;
+
+static bool on_stream(void *context, uint32_t serial, const uint8_t *data,
+                      size_t length) {
+  (void)context;
+  (void)serial;
+  filterCalls++;
+  return ASOggIdentifyCodec(data, length) == OGG_CODEC_OPUS;
+}
+
+/* Packets have to come back in order, except 'skipPacket', which is
+   expected to be lost */
+static size_t skipPacket = SIZE_MAX;
+
+static void on_packet(void *context, const ogg_packet_t *packet) {
+  (void)context;
+  if (gotCount == skipPacket) gotCount++;
+  if (gotCount >= expectedCount) {
+    CHECK(gotCount < expectedCount);
+    return;
+  }
+  const expected_packet_t *e = &expected[gotCount++];
+  CHECK(packet->length == e->length);
+  CHECK(packet->length == e->length &&
+        memcmp(packet->data, packetData + e->offset, e->length) == 0);
+  CHECK(packet->serial == e->serial);
+  CHECK(packet->granule == e->granule);
+  CHECK(packet->bos == e->bos);
+  CHECK(packet->eos == e->eos);
+}
+
+static void feed(ogg_demuxer_t *demuxer, const uint8_t *bytes, size_t length,
+                 size_t chunk) {
+  gotCount = 0;
+  filterCalls = 0;
+  ASOggDemuxerReset(demuxer);
+  for (size_t offset = 0; offset < length; offset += chunk) {
+    size_t n = length - offset < chunk ? length - offset : chunk;
+    ASOggDemuxerParse(demuxer, bytes + offset, n);
+  }
+  if (gotCount == skipPacket) gotCount++;
+  CHECK(gotCount == expectedCount);
+  CHECK(filterCalls == 2);
+}
+
+static void test_opus_helpers(void) {
+  uint8_t p[64];
+  opus_head_t head;
+  size_t length = opus_head(p, 2, 312);
+  CHECK(ASOggIdentifyCodec(p, length) == OGG_CODEC_OPUS);
+  CHECK(ASOggParseOpusHead(p, length, &head));
+  CHECK(head.channels == 2 && head.preSkip == 312 && head.inputSampleRate == 44100);
+  CHECK(!ASOggParseOpusHead(p, 10, &head));
+
+  /* TOC config 31 is 20 ms: one frame, then code 3 with three frames */
+  const uint8_t one[] = {0xF8, 0x00};
+  CHECK(ASOggOpusPacketSamples(one, sizeof(one)) == 960);
+  const uint8_t three[] = {0xFB, 0x03, 0x00, 0x00, 0x00};
+  CHECK(ASOggOpusPacketSamples(three, sizeof(three)) == 2880);
+
+  uint8_t tags[128];
+  length = opus_tags(tags, "title=Song");
+  const uint8_t *value;
+  size_t valueLength;
+  CHECK(ASOggFindComment(tags, length, "TITLE", &value, &valueLength));
+  CHECK(valueLength == 4 && memcmp(value, "Song", 4) == 0);
+  CHECK(!ASOggFindComment(tags, length, "ALBUM", &value, &valueLength));
+}
+
+int main(void) {
+  mux_link(0x1111, 300, true, 11);
+  mux_link(0x2222, 120, false, 22);
+  test_opus_helpers();
+
+  ogg_demuxer_t *demuxer = ASOggDemuxerCreate(on_stream, on_packet, NULL);
+  CHECK(demuxer != NULL);
+  for (size_t chunk = 1; chunk <= 40; chunk++) {
+    feed(demuxer, stream, streamLength, chunk);
+  }
+  for (size_t chunk = 41; chunk < streamLength; chunk = chunk * 2 + 3) {
+    feed(demuxer, stream, streamLength, chunk);
+  }
+  feed(demuxer, stream, streamLength, streamLength);
+  ogg_stats_t stats;
+  ASOggDemuxerGetStats(demuxer, &stats);
+  CHECK(stats.crcErrors == 0 && stats.skippedBytes == 0 && stats.lostPackets == 0);
+
+  /* Spoil the page holding the start of the big packet. The rest of it is
+     skipped on the next page and nothing else is lost */
+  static uint8_t spoilt[kMaxStream];
+  memcpy(spoilt, stream, streamLength);
+  spoilt[bigPageOffset + 27 + 255 + 1000] ^= 0x55;
+  skipPacket = bigPacket;
+  ogg_demuxer_t *other = ASOggDemuxerCreate(on_stream, on_packet, NULL);
+  feed(other, spoilt, streamLength, 4096);
+  ASOggDemuxerGetStats(other, &stats);
+  CHECK(stats.crcErrors == 1);
+  ASOggDemuxerDestroy(other);
+
+  ASOggDemuxerDestroy(demuxer);
+  return TEST_RESULT();
+}
@@ -0,0 +1,202 @@
+//
+//  output_sink_test.c
+//  AudioStreamer
+//
+//  Where rendered audio goes: a WAV file whose header, filled in on close,
+//  describes exactly the float samples written after it, a callback which
+//  sees every run of frames, a null sink which only counts them, and a tee
+//  which passes them to two others. Sinks must be started once, before
+//  anything is written, and report failures when closed.
+//
+
+#include "ASOutputSink.h"
+#include "ASWAVWriter.h"
+#include "test.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define kChannels 2
+#define kFrames 10000
+
+static char path[] = "/tmp/output_sink_test.XXXXXX";
+static float samples[kFrames * kChannels];
+
+static uint32_t get16(const uint8_t *p) {
+  return p[0] | (uint32_t)p[1] << 8;
+}
+
+static uint32_t get32(const uint8_t *p) {
+  return get16(p) | get16(p + 2) << 16;
+}
+
+/* Reads the file back and checks it holds the first frames of samples */
+static void check_wav(uint32_t sampleRate, uint16_t channels, size_t frames) {
+  FILE *file = fopen(path, "rb");
+  CHECK(file != NULL);
+  if (file == NULL) return;
+  static uint8_t contents[58 + sizeof(samples) + 1];
+  size_t length = fread(contents, 1, sizeof(contents), file);
+  fclose(file);
+  size_t dataSize = frames * channels * sizeof(float);
+  CHECK(length == 58 + dataSize);
+  if (length < 58) return;
+
+  const uint8_t *h = contents;
+  CHECK(memcmp(h, "RIFF", 4) == 0 && get32(h + 4) == length - 8);
+  CHECK(memcmp(h + 8, "WAVE", 4) == 0);
+  CHECK(memcmp(h + 12, "fmt ", 4) == 0 && get32(h + 16) == 18);
+  CHECK(get16(h + 20) == 3);          /* IEEE float */
+  CHECK(get16(h + 22) == channels && get32(h + 24) == sampleRate);
+  CHECK(get32(h + 28) == sampleRate * channels * 4);
+  CHECK(get16(h + 32) == channels * 4 && get16(h + 34) == 32);
+  CHECK(get16(h + 36) == 0);
+  CHECK(memcmp(h + 38, "fact", 4) == 0 && get32(h + 42) == 4);
+  CHECK(get32(h + 46) == frames);
+  CHECK(memcmp(h + 50, "data", 4) == 0 && get32(h + 54) == dataSize);
+
+  /* Samples are little endian floats */
+  for (size_t i = 0; i < frames * channels && 58 + 4 * i + 4 <= length; i++) {
+    uint32_t bits;
+    memcpy(&bits, &samples[i], sizeof(bits));
+    if (get32(contents + 58 + 4 * i) != bits) {
+      CHECK(get32(contents + 58 + 4 * i) == bits);
+      break;
+    }
+  }
+}
+
+static void test_wav_writer(void) {
+  CHECK(ASWAVWriterCreate(path, 44100, 0) == NULL);
+  CHECK(ASWAVWriterCreate("/nonexistent/directory/file.wav", 44100, 2) == NULL);
+
+  /* An empty file is still a whole one */
+  wav_writer_t *writer = ASWAVWriterCreate(path, 22050, 1);
+  CHECK(writer != NULL);
+  if (writer == NULL) return;
+  CHECK(ASWAVWriterClose(writer));
+  check_wav(22050, 1, 0);
+
+  /* Written in runs of every length */
+  writer = ASWAVWriterCreate(path, 48000, kChannels);
+  CHECK(writer != NULL);
+  if (writer == NULL) return;
+  size_t frames = 0;
+  for (size_t run = 0; frames + run <= kFrames; run++) {
+    CHECK(ASWAVWriterWrite(writer, samples + frames * kChannels, run));
+    frames += run;
+  }
+  CHECK(ASWAVWriterFrameCount(writer) == frames);
+  CHECK(ASWAVWriterClose(writer));
+  check_wav(48000, kChannels, frames);
+
+  /* A write which fails is reported, and so is the file when closed */
+  writer = ASWAVWriterCreate("/dev/full", 44100, kChannels);
+  if (writer != NULL) {
+    bool ok = true;
+    for (int i = 0; i < 100 && ok; i++) {
+      ok = ASWAVWriterWrite(writer, samples, kFrames);
+    }
+    CHECK(!ok);
+    CHECK(!ASWAVWriterWrite(writer, samples, 1));
+    CHECK(!ASWAVWriterClose(writer));
+  }
+}
+
+typedef struct heard {
+  size_t calls;
+  size_t frames;
+  bool   matched;
+} heard_t;
+
+static void hear(void *context, const float *heardSamples, size_t frames) {
+  heard_t *heard = context;
+  if (memcmp(heardSamples, samples + heard->frames * kChannels,
+             frames * kChannels * sizeof(float)) != 0) {
+    heard->matched = false;
+  }
+  heard->calls++;
+  heard->frames += frames;
+}
+
+static void test_sinks(void) {
+  /* Nothing can be written before the sink starts, or started twice */
+  heard_t heard = {.matched = true};
+  output_sink_t *callback = ASOutputSinkCreateCallback(hear, &heard);
+  CHECK(callback != NULL);
+  if (callback == NULL) return;
+  CHECK(!ASOutputSinkWrite(callback, samples, 10));
+  CHECK(!ASOutputSinkStart(callback, 0, kChannels));
+  CHECK(!ASOutputSinkStart(callback, 44100, 0));
+  CHECK(ASOutputSinkStart(callback, 44100, kChannels));
+  CHECK(!ASOutputSinkStart(callback, 44100, kChannels));
+  CHECK(ASOutputSinkWrite(callback, samples, 0));
+  CHECK(heard.calls == 0);
+
+  output_sink_t *wav = ASOutputSinkCreateWAV(path);
+  output_sink_t *null = ASOutputSinkCreateNull();
+  CHECK(wav != NULL && null != NULL);
+  if (wav == NULL || null == NULL) return;
+  output_sink_t *tee = ASOutputSinkCreateTee(wav, null);
+  CHECK(tee != NULL);
+  if (tee == NULL) return;
+  CHECK(ASOutputSinkStart(tee, 32000, kChannels));
+  CHECK(wav->sampleRate == 32000 && null->channels == kChannels);
+
+  size_t frames = 0;
+  for (size_t run = 1; frames + run <= kFrames; run += 7) {
+    CHECK(ASOutputSinkWrite(callback, samples + frames * kChannels, run));
+    CHECK(ASOutputSinkWrite(tee, samples + frames * kChannels, run));
+    frames += run;
+  }
+  CHECK(heard.matched && heard.frames == frames);
+  CHECK(ASOutputSinkFrameCount(callback) == frames);
+  CHECK(ASOutputSinkFrameCount(tee) == frames);
+  CHECK(ASOutputSinkFrameCount(wav) == frames);
+  CHECK(ASOutputSinkFrameCount(null) == frames);
+  CHECK(ASOutputSinkClose(callback));
+  CHECK(ASOutputSinkClose(tee));
+  check_wav(32000, kChannels, frames);
+
+  /* A WAV file which can't be created can't be started, but closes fine */
+  wav = ASOutputSinkCreateWAV("/nonexistent/directory/file.wav");
+  CHECK(wav != NULL);
+  if (wav == NULL) return;
+  CHECK(!ASOutputSinkStart(wav, 44100, kChannels));
+  CHECK(ASOutputSinkClose(wav));
+  CHECK(!ASOutputSinkClose(NULL));
+
+  /* One side of a tee failing fails the tee, though the other still hears
+     everything */
+  heard = (heard_t){.matched = true};
+  tee = ASOutputSinkCreateTee(ASOutputSinkCreateWAV("/dev/full"),
+                              ASOutputSinkCreateCallback(hear, &heard));
+  CHECK(tee != NULL);
+  if (tee == NULL) return;
+  CHECK(ASOutputSinkStart(tee, 44100, kChannels));
+  bool ok = true;
+  for (int i = 0; i < 10; i++) {
+    ok = ASOutputSinkWrite(tee, samples + heard.frames * kChannels, 1000) && ok;
+  }
+  CHECK(!ok && heard.matched && heard.frames == 10000);
+  CHECK(!ASOutputSinkClose(tee));
+}
+
+int main(void) {
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    perror("mkstemp");
+    return 1;
+  }
+  close(fd);
+  uint32_t seed = 1;
+  for (size_t i = 0; i < kFrames * kChannels; i++) {
+    samples[i] = (float)((int32_t)test_random(&seed)) / 2147483648.0f;
+  }
+
+  test_wav_writer();
+  test_sinks();
+  unlink(path);
+  return TEST_RESULT();
+}
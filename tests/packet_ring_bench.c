@@ -0,0 +1,274 @@
+//
+//  packet_ring_bench.c
+//  AudioStreamer
+//
+//  ASPacketRing against the linked lists AudioStreamer queued packets in
+//  before it, a malloc() and a free() per packet, on the same trace: the
+//  frames of tests/fixtures/vbr.mp3, looped, arriving in runs of 1 to 32
+//  and taken off a buffer of 8 KB at a time whenever more than 64 KB is
+//  waiting. VBR packets are queued one by one; CBR data is queued as the
+//  runs of bytes it arrives in and split wherever a buffer fills, which the
+//  old list did by keeping its place in the packet at the head.
+//
+//  Both have to hand over the same bytes in the same order.
+//
+
+#include "ASMP3Parser.h"
+#include "ASPacketRing.h"
+#include "bench.h"
+
+#include <string.h>
+
+#define kLoops 20
+#define kMaxRun 32
+#define kBufferSize 8192
+#define kMaxDescs 512
+#define kBacklog 65536
+
+typedef struct queued_vbr_packet {
+  uint32_t variableFrames;
+  uint32_t byteSize;
+  struct queued_vbr_packet *next;
+  uint8_t data[];
+} queued_vbr_packet_t;
+
+typedef struct queued_cbr_packet {
+  struct queued_cbr_packet *next;
+  uint32_t byteSize;
+  uint32_t offset;
+  uint8_t data[];
+} queued_cbr_packet_t;
+
+/* The fixture's frames, one after another */
+static uint8_t *frames;
+static uint32_t *sizes;
+static size_t frameCount, framesLength;
+
+/* The trace: a number of packets to queue, or 0 to fill a buffer */
+static uint32_t *ops;
+static size_t opCount, packetCount;
+
+typedef struct run {
+  bool     cbr;
+  uint64_t hash;              /* of what was handed over */
+  uint8_t  buffer[kBufferSize];
+} run_t;
+
+static void format(void *context, const mp3_header_t *header, uint64_t offset) {
+  (void)context;
+  (void)header;
+  (void)offset;
+}
+
+static void collect(void *context, const void *data, uint32_t byteCount,
+                    uint32_t packetCount, const as_packet_desc_t *descs) {
+  (void)context;
+  (void)byteCount;
+  for (uint32_t i = 0; i < packetCount; i++) {
+    sizes[frameCount++] = descs[i].byteSize;
+    memcpy(frames + framesLength, (const uint8_t *)data + descs[i].startOffset,
+           descs[i].byteSize);
+    framesLength += descs[i].byteSize;
+  }
+}
+
+static void make_trace(const uint8_t *file, size_t length) {
+  frames = malloc(length);
+  sizes = malloc(length / 24 * sizeof(*sizes));
+  mp3_parser_t *parser = ASMP3ParserCreate(format, collect, NULL);
+  ASMP3ParserParse(parser, file, length);
+  ASMP3ParserDestroy(parser);
+
+  /* Whenever the runs queued add up to more than the backlog, a buffer is
+     filled */
+  size_t total = frameCount * kLoops;
+  ops = malloc(2 * total * sizeof(*ops));
+  uint32_t seed = 1;
+  size_t queued = 0, next = 0;
+  while (packetCount < total) {
+    uint32_t n = 1 + test_random_below(&seed, kMaxRun);
+    if (n > total - packetCount) n = (uint32_t)(total - packetCount);
+    ops[opCount++] = n;
+    for (uint32_t i = 0; i < n; i++) {
+      queued += sizes[next];
+      next = (next + 1) % frameCount;
+    }
+    packetCount += n;
+    if (queued > kBacklog) {
+      ops[opCount++] = 0;
+      queued -= queued > kBufferSize ? kBufferSize : queued;
+    }
+  }
+}
+
+static inline void hand_over(run_t *run, const uint8_t *data, uint32_t size) {
+  memcpy(run->buffer, data, size);
+  run->hash = run->hash * 31 + size + run->buffer[0] + run->buffer[size - 1];
+}
+
+static void run_ring(void *context) {
+  run_t *run = context;
+  run->hash = 0;
+  packet_ring_t *ring = ASPacketRingCreate(0, 0);
+  size_t next = 0, offset = 0;
+  for (size_t o = 0; o <= opCount; o++) {
+    if (o < opCount && ops[o] > 0) {
+      if (run->cbr) {
+        size_t start = offset;
+        uint32_t bytes = 0;
+        for (uint32_t i = 0; i < ops[o]; i++) {
+          /* Runs don't straddle the end of the loop */
+          if (next == 0 && bytes > 0) break;
+          bytes += sizes[next];
+          offset += sizes[next];
+          next = (next + 1) % frameCount;
+          if (next == 0) offset = 0;
+        }
+        ASPacketRingPush(ring, frames + start, bytes, 0);
+      } else {
+        for (uint32_t i = 0; i < ops[o]; i++) {
+          ASPacketRingPush(ring, frames + offset, sizes[next], 1152);
+          offset += sizes[next];
+          next = (next + 1) % frameCount;
+          if (next == 0) offset = 0;
+        }
+      }
+      continue;
+    }
+
+    /* Fill a buffer, or at the end keep filling them until it's empty */
+    do {
+      uint32_t filled = 0, descs = 0;
+      packet_ring_entry_t entry;
+      while (ASPacketRingPeek(ring, &entry)) {
+        uint32_t space = kBufferSize - filled;
+        if (run->cbr) {
+          uint32_t size = entry.byteSize < space ? entry.byteSize : space;
+          hand_over(run, entry.data, size);
+          ASPacketRingConsume(ring, size);
+          filled += size;
+        } else {
+          if (entry.byteSize > space || descs == kMaxDescs) break;
+          hand_over(run, entry.data, entry.byteSize);
+          ASPacketRingPop(ring);
+          filled += entry.byteSize;
+          descs++;
+        }
+        if (filled == kBufferSize) break;
+      }
+    } while (o == opCount && !ASPacketRingIsEmpty(ring));
+  }
+  ASPacketRingDestroy(ring);
+}
+
+static void run_list(void *context) {
+  run_t *run = context;
+  run->hash = 0;
+  queued_vbr_packet_t *vbrHead = NULL, *vbrTail = NULL;
+  queued_cbr_packet_t *cbrHead = NULL, *cbrTail = NULL;
+  size_t next = 0, offset = 0;
+  for (size_t o = 0; o <= opCount; o++) {
+    if (o < opCount && ops[o] > 0) {
+      if (run->cbr) {
+        size_t start = offset;
+        uint32_t bytes = 0;
+        for (uint32_t i = 0; i < ops[o]; i++) {
+          if (next == 0 && bytes > 0) break;
+          bytes += sizes[next];
+          offset += sizes[next];
+          next = (next + 1) % frameCount;
+          if (next == 0) offset = 0;
+        }
+        queued_cbr_packet_t *packet = malloc(sizeof(*packet) + bytes);
+        packet->next = NULL;
+        packet->byteSize = bytes;
+        packet->offset = 0;
+        memcpy(packet->data, frames + start, bytes);
+        if (cbrHead == NULL) {
+          cbrHead = cbrTail = packet;
+        } else {
+          cbrTail->next = packet;
+          cbrTail = packet;
+        }
+      } else {
+        for (uint32_t i = 0; i < ops[o]; i++) {
+          uint32_t size = sizes[next];
+          queued_vbr_packet_t *packet = malloc(sizeof(*packet) + size);
+          packet->next = NULL;
+          packet->variableFrames = 1152;
+          packet->byteSize = size;
+          memcpy(packet->data, frames + offset, size);
+          if (vbrHead == NULL) {
+            vbrHead = vbrTail = packet;
+          } else {
+            vbrTail->next = packet;
+            vbrTail = packet;
+          }
+          offset += size;
+          next = (next + 1) % frameCount;
+          if (next == 0) offset = 0;
+        }
+      }
+      continue;
+    }
+
+    do {
+      uint32_t filled = 0, descs = 0;
+      if (run->cbr) {
+        while (cbrHead != NULL && filled < kBufferSize) {
+          uint32_t left = cbrHead->byteSize - cbrHead->offset;
+          uint32_t space = kBufferSize - filled;
+          uint32_t size = left < space ? left : space;
+          hand_over(run, cbrHead->data + cbrHead->offset, size);
+          filled += size;
+          cbrHead->offset += size;
+          if (cbrHead->offset == cbrHead->byteSize) {
+            queued_cbr_packet_t *tmp = cbrHead->next;
+            free(cbrHead);
+            cbrHead = tmp;
+          }
+        }
+      } else {
+        while (vbrHead != NULL && vbrHead->byteSize <= kBufferSize - filled &&
+               descs < kMaxDescs) {
+          hand_over(run, vbrHead->data, vbrHead->byteSize);
+          filled += vbrHead->byteSize;
+          descs++;
+          queued_vbr_packet_t *tmp = vbrHead->next;
+          free(vbrHead);
+          vbrHead = tmp;
+        }
+      }
+    } while (o == opCount && (vbrHead != NULL || cbrHead != NULL));
+  }
+}
+
+int main(void) {
+  size_t length;
+  uint8_t *file = bench_read_fixture("vbr.mp3", &length);
+  if (file == NULL) return TEST_RESULT();
+  make_trace(file, length);
+  free(file);
+  size_t bytes = framesLength * kLoops;
+  printf("%zu packets, %zu bytes, in %zu runs\n", packetCount, bytes,
+         opCount);
+
+  static run_t ring, list;
+  for (int cbr = 0; cbr < 2; cbr++) {
+    ring.cbr = list.cbr = cbr;
+    double ringTime = bench_best(run_ring, &ring);
+    double listTime = bench_best(run_list, &list);
+    CHECK(ring.hash == list.hash);
+    printf("%s packet ring %8.1f ns/packet, linked list %8.1f ns/packet\n",
+           cbr ? "CBR" : "VBR", ringTime / packetCount * 1e9,
+           listTime / packetCount * 1e9);
+    bench_report(cbr ? "  CBR packet ring" : "  VBR packet ring", bytes,
+                 ringTime);
+    bench_report(cbr ? "  CBR linked list" : "  VBR linked list", bytes,
+                 listTime);
+  }
+  free(frames);
+  free(sizes);
+  free(ops);
+  return TEST_RESULT();
+}
@@ -0,0 +1,138 @@
+//
+//  packet_ring_test.c
+//  AudioStreamer
+//
+//  Runs ASPacketRing through random pushes, pops, partial consumes and clears
+//  next to a plain array of packets, and checks after every step that both
+//  hold the same packets in the same order.
+//
+
+#include "ASPacketRing.h"
+#include "test.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define kSteps      200000
+#define kMaxModel   4096
+#define kMaxPacket  3000
+
+typedef struct model_packet {
+  uint8_t *data;
+  uint32_t byteSize;
+  uint32_t variableFrames;
+} model_packet_t;
+
+/* Packets in order, oldest at 'first' */
+static model_packet_t model[kMaxModel];
+static size_t first, count;
+static size_t modelBytes;
+
+static void model_pop(void) {
+  free(model[first].data);
+  first = (first + 1) % kMaxModel;
+  count--;
+}
+
+static void check_front(packet_ring_t *ring) {
+  CHECK(ASPacketRingCount(ring) == count);
+  CHECK(ASPacketRingByteCount(ring) == modelBytes);
+  packet_ring_entry_t entry;
+  bool any = ASPacketRingPeek(ring, &entry);
+  CHECK(any == (count > 0));
+  if (!any || count == 0) return;
+  const model_packet_t *m = &model[first];
+  CHECK(entry.byteSize == m->byteSize);
+  CHECK(entry.variableFrames == m->variableFrames);
+  CHECK(memcmp(entry.data, m->data, m->byteSize) == 0);
+}
+
+/* Pushes and pops at random, with the balance between them drifting so the
+   ring both fills up (and grows) and runs empty */
+static void test_against_model(size_t byteCapacity, size_t packetCapacity) {
+  uint32_t seed = 0x9E3779B9u ^ (uint32_t)byteCapacity;
+  packet_ring_t *ring = ASPacketRingCreate(byteCapacity, packetCapacity);
+  CHECK(ring != NULL);
+  if (ring == NULL) return;
+
+  uint8_t packet[kMaxPacket];
+  for (int step = 0; step < kSteps; step++) {
+    uint32_t pushBias = (step / 5000) % 2 == 0 ? 60 : 35;
+    uint32_t op = test_random_below(&seed, 100);
+    if (op < pushBias && count < kMaxModel) {
+      uint32_t size = 1 + test_random_below(&seed, op < 5 ? kMaxPacket : 600);
+      for (uint32_t i = 0; i < size; i++) packet[i] = (uint8_t)test_random(&seed);
+      uint32_t frames = test_random_below(&seed, 2) ? 1152 : 0;
+      CHECK(ASPacketRingPush(ring, packet, size, frames));
+      model_packet_t *m = &model[(first + count) % kMaxModel];
+      m->data = malloc(size);
+      memcpy(m->data, packet, size);
+      m->byteSize = size;
+      m->variableFrames = frames;
+      count++;
+      modelBytes += size;
+    } else if (op < 90 && count > 0) {
+      modelBytes -= model[first].byteSize;
+      model_pop();
+      ASPacketRingPop(ring);
+    } else if (op < 99 && count > 0) {
+      /* CBR data is taken a piece at a time */
+      model_packet_t *m = &model[first];
+      uint32_t take = 1 + test_random_below(&seed, m->byteSize + 8);
+      ASPacketRingConsume(ring, take);
+      if (take >= m->byteSize) {
+        modelBytes -= m->byteSize;
+        model_pop();
+      } else {
+        memmove(m->data, m->data + take, m->byteSize - take);
+        m->byteSize -= take;
+        modelBytes -= take;
+      }
+    } else if (op == 99) {
+      ASPacketRingClear(ring);
+      while (count > 0) model_pop();
+      modelBytes = 0;
+    }
+    check_front(ring);
+  }
+
+  /* Everything left comes out in order */
+  while (count > 0) {
+    check_front(ring);
+    modelBytes -= model[first].byteSize;
+    model_pop();
+    ASPacketRingPop(ring);
+  }
+  CHECK(ASPacketRingIsEmpty(ring));
+  ASPacketRingDestroy(ring);
+}
+
+/* A packet which doesn't fit at the end of the buffer goes to the front */
+static void test_wraps_instead_of_growing(void) {
+  packet_ring_t *ring = ASPacketRingCreate(100, 8);
+  uint8_t a[40], b[40], c[30];
+  memset(a, 'a', sizeof(a));
+  memset(b, 'b', sizeof(b));
+  memset(c, 'c', sizeof(c));
+  CHECK(ASPacketRingPush(ring, a, sizeof(a), 0));
+  CHECK(ASPacketRingPush(ring, b, sizeof(b), 0));
+  packet_ring_entry_t entry;
+  ASPacketRingPeek(ring, &entry);
+  const uint8_t *start = entry.data;
+  ASPacketRingPop(ring);
+  /* 20 bytes are left at the end, but the first 40 are free */
+  CHECK(ASPacketRingPush(ring, c, sizeof(c), 0));
+  ASPacketRingPop(ring);
+  CHECK(ASPacketRingPeek(ring, &entry));
+  CHECK(entry.data == start);
+  CHECK(entry.byteSize == sizeof(c) && memcmp(entry.data, c, sizeof(c)) == 0);
+  ASPacketRingDestroy(ring);
+}
+
+int main(void) {
+  test_against_model(0, 0);
+  test_against_model(512, 2);
+  test_against_model(4096, 16);
+  test_wraps_instead_of_growing();
+  return TEST_RESULT();
+}
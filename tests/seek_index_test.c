@@ -0,0 +1,262 @@
+//
+//  seek_index_test.c
+//  AudioStreamer
+//
+//  Where ASSeekIndex says to start reading for a packet: exactly on a
+//  recorded packet within what has been received, counting the header frame
+//  or not, and beyond that from a VBRI table or a Xing table of contents,
+//  read from the first frame whatever pieces it arrives in.
+//
+
+#include "ASSeekIndex.h"
+#include "test.h"
+#include "test_streams.h"
+
+#include <stdlib.h>
+
+#define kPackets 1000
+
+/* A Layer III frame at 44.1 kHz and 320 kbps, 1044 bytes: room for a table */
+static const test_mp3_frame_t kFrame = {.mpeg1 = true, .bitrateIndex = 14};
+
+static void put_be16(uint8_t *b, uint32_t value) {
+  b[0] = (uint8_t)(value >> 8);
+  b[1] = (uint8_t)value;
+}
+
+static void put_be32(uint8_t *b, uint32_t value) {
+  b[0] = (uint8_t)(value >> 24);
+  b[1] = (uint8_t)(value >> 16);
+  b[2] = (uint8_t)(value >> 8);
+  b[3] = (uint8_t)value;
+}
+
+/* Feeds a file to the index in chunks, the data offset known from the
+   start. Returns whether the index stopped asking for bytes */
+static bool scan(seek_index_t *index, const uint8_t *file, size_t length,
+                 size_t dataOffset, size_t chunk) {
+  ASSeekIndexReset(index);
+  ASSeekIndexSetDataOffset(index, dataOffset);
+  for (size_t offset = 0; offset < length; offset += chunk) {
+    size_t n = length - offset < chunk ? length - offset : chunk;
+    if (ASSeekIndexScanHeader(index, offset, file + offset, n)) return true;
+  }
+  return false;
+}
+
+static void test_received(void) {
+  seek_index_t *index = ASSeekIndexCreate();
+  CHECK(index != NULL);
+  if (index == NULL) return;
+  static uint8_t xing[2048];
+  uint32_t seed = 1;
+  size_t xingLength = test_write_xing_frame(xing, &kFrame, &seed);
+  put_be32(xing + 4 + 32 + 4, 0);   /* no fields */
+  CHECK(scan(index, xing, xingLength, 0, xingLength));
+
+  static uint64_t offsets[kPackets + 1];
+  for (int counted = 0; counted < 2; counted++) {
+    ASSeekIndexReset(index);
+    CHECK(scan(index, xing, xingLength, 0, xingLength));
+    /* Whether the parser handed over the header frame as packet 0 */
+    uint8_t audio[2048];
+    test_write_mp3_frame(audio, &kFrame, false, &seed);
+    ASSeekIndexSetFirstPacket(index, counted ? xing : audio, 64);
+    CHECK(ASSeekIndexFirstPacketIsHeader(index) == (counted != 0));
+
+    uint64_t start = counted ? 0 : xingLength;
+    offsets[0] = start;
+    for (uint64_t p = 0; p < kPackets; p++) {
+      uint32_t size = 200 + test_random_below(&seed, 1200);
+      ASSeekIndexAddPacket(index, p, size);
+      offsets[p + 1] = offsets[p] + size;
+    }
+    /* Packets which don't follow on are ignored */
+    ASSeekIndexAddPacket(index, kPackets + 3, 500);
+    ASSeekIndexAddPacket(index, 5, 500);
+
+    for (uint64_t p = 0; p < kPackets; p++) {
+      seek_point_t point;
+      bool exact = false;
+      CHECK(ASSeekIndexLookup(index, p, &point, &exact));
+      CHECK(exact && point.packet <= p && p - point.packet < kSeekPointInterval);
+      CHECK(point.byteOffset == offsets[point.packet]);
+    }
+
+    /* Nothing is known beyond, without a table */
+    seek_point_t point;
+    bool exact;
+    CHECK(!ASSeekIndexLookup(index, kPackets, &point, &exact));
+  }
+
+  ASSeekIndexReset(index);
+  seek_point_t point;
+  bool exact;
+  CHECK(!ASSeekIndexLookup(index, 0, &point, &exact));
+  ASSeekIndexDestroy(index);
+}
+
+/* A tag, then a frame holding a VBRI table of 100 entries of 10 frames, then
+   audio */
+static size_t build_vbri(uint8_t *file, size_t *dataOffset, uint32_t *sizes) {
+  uint32_t seed = 2;
+  size_t length = test_write_id3(file, 300);
+  *dataOffset = length;
+  uint8_t *frame = file + length;
+  length += test_write_mp3_frame(frame, &kFrame, false, &seed);
+  uint8_t *v = frame + 4 + 32;
+  memset(frame + 4, 0, 32);
+  memcpy(v, "VBRI", 4);
+  put_be16(v + 4, 1);
+  put_be16(v + 6, 0);
+  put_be16(v + 8, 75);
+  uint64_t total = 0;
+  for (int i = 0; i < 100; i++) {
+    sizes[i] = 2000 + test_random_below(&seed, 2000);
+    total += sizes[i] * 2;
+    put_be16(v + 26 + 2 * i, sizes[i]);
+  }
+  put_be32(v + 10, (uint32_t)total);
+  put_be32(v + 14, 1000);
+  put_be16(v + 18, 100);      /* entries */
+  put_be16(v + 20, 2);        /* scale */
+  put_be16(v + 22, 2);        /* bytes per entry */
+  put_be16(v + 24, 10);       /* frames per entry */
+  for (int i = 0; i < 20; i++) {
+    length += test_write_mp3_frame(file + length, &kFrame, false, &seed);
+  }
+  return length;
+}
+
+static void test_vbri(void) {
+  seek_index_t *index = ASSeekIndexCreate();
+  CHECK(index != NULL);
+  if (index == NULL) return;
+  static uint8_t file[32 * 1024];
+  uint32_t sizes[100];
+  size_t dataOffset;
+  size_t length = build_vbri(file, &dataOffset, sizes);
+
+  for (size_t chunk = 1; chunk <= 1500; chunk += chunk < 64 ? 1 : 61) {
+    CHECK(scan(index, file, length, dataOffset, chunk));
+    CHECK(ASSeekIndexPacketCount(index) == 1000);
+    uint64_t offset = 0;
+    for (uint64_t p = 0; p < 1000; p++) {
+      if (p % 10 == 0 && p > 0) offset += sizes[p / 10 - 1] * 2;
+      seek_point_t point;
+      bool exact = true;
+      CHECK(ASSeekIndexLookup(index, p, &point, &exact));
+      CHECK(!exact && point.packet == p / 10 * 10 && point.byteOffset == offset);
+    }
+    if (testFailures > 0) {
+      fprintf(stderr, "VBRI fed %zu bytes at a time\n", chunk);
+      break;
+    }
+  }
+
+  /* Received packets are still preferred where there are any */
+  ASSeekIndexSetFirstPacket(index, file + dataOffset, 64);
+  for (uint64_t p = 0; p < 100; p++) ASSeekIndexAddPacket(index, p, 1044);
+  seek_point_t point;
+  bool exact;
+  CHECK(ASSeekIndexLookup(index, 50, &point, &exact));
+  CHECK(exact && point.packet == 48 && point.byteOffset == 48 * 1044);
+  CHECK(ASSeekIndexLookup(index, 100, &point, &exact));
+  CHECK(!exact && point.packet == 100);
+  ASSeekIndexDestroy(index);
+}
+
+/* A Xing frame with a table of contents, and a byte count if asked for */
+static size_t build_xing(uint8_t *file, bool withBytes, const uint8_t *toc) {
+  uint32_t seed = 3;
+  size_t length = test_write_xing_frame(file, &kFrame, &seed);
+  uint8_t *x = file + 4 + 32;
+  put_be32(x + 4, withBytes ? 0x7 : 0x5);
+  uint8_t *p = x + 8;
+  put_be32(p, kPackets);
+  p += 4;
+  if (withBytes) {
+    put_be32(p, 1000000);
+    p += 4;
+  }
+  memcpy(p, toc, 100);
+  return length;
+}
+
+static void test_toc(void) {
+  seek_index_t *index = ASSeekIndexCreate();
+  CHECK(index != NULL);
+  if (index == NULL) return;
+  uint8_t toc[100];
+  /* The first half of the stream takes a quarter of the bytes */
+  for (int i = 0; i < 50; i++) toc[i] = (uint8_t)(i * 64 / 50);
+  for (int i = 50; i < 100; i++) toc[i] = (uint8_t)(64 + (i - 50) * 192 / 50);
+  static uint8_t file[2048];
+  size_t length = build_xing(file, true, toc);
+
+  for (size_t chunk = 1; chunk <= length; chunk += chunk < 64 ? 1 : 97) {
+    CHECK(scan(index, file, length, 0, chunk));
+    CHECK(ASSeekIndexPacketCount(index) == kPackets);
+    CHECK(ASSeekIndexByteCount(index) == 1000000);
+  }
+  seek_point_t point;
+  bool exact = true;
+  CHECK(ASSeekIndexLookup(index, 250, &point, &exact));
+  CHECK(!exact && point.packet == 250);
+  CHECK(llabs((long long)point.byteOffset - 125000) <= 1);
+  CHECK(ASSeekIndexLookup(index, 755, &point, &exact));
+  double fraction = (toc[75] + (toc[76] - toc[75]) * 0.5) / 256.0;
+  CHECK(llabs((long long)point.byteOffset - (long long)(fraction * 1e6)) <= 1);
+  /* The end of the table runs to the end of the stream */
+  CHECK(ASSeekIndexLookup(index, kPackets - 1, &point, &exact));
+  CHECK(point.byteOffset < 1000000 && point.byteOffset > 990000);
+
+  /* Without a byte count, the size of the audio is used */
+  length = build_xing(file, false, toc);
+  CHECK(scan(index, file, length, 0, length));
+  CHECK(!ASSeekIndexLookup(index, 250, &point, &exact));
+  ASSeekIndexSetAudioByteCount(index, 2000000);
+  CHECK(ASSeekIndexLookup(index, 250, &point, &exact));
+  CHECK(llabs((long long)point.byteOffset - 250000) <= 1);
+
+  /* A table out of order is ignored */
+  toc[40] = 200;
+  length = build_xing(file, true, toc);
+  CHECK(scan(index, file, length, 0, length));
+  CHECK(ASSeekIndexPacketCount(index) == kPackets);
+  CHECK(!ASSeekIndexLookup(index, 250, &point, &exact));
+  ASSeekIndexDestroy(index);
+}
+
+static void test_no_header(void) {
+  seek_index_t *index = ASSeekIndexCreate();
+  CHECK(index != NULL);
+  if (index == NULL) return;
+  static uint8_t file[8192];
+  uint32_t seed = 4;
+  size_t length = 0;
+  for (int i = 0; i < 5; i++) {
+    length += test_write_mp3_frame(file + length, &kFrame, false, &seed);
+  }
+  CHECK(scan(index, file, length, 0, 100));
+  CHECK(ASSeekIndexPacketCount(index) == 0 && ASSeekIndexByteCount(index) == 0);
+  ASSeekIndexSetFirstPacket(index, file, 64);
+  CHECK(!ASSeekIndexFirstPacketIsHeader(index));
+
+  /* A start of the audio which went by unseen ends the search */
+  ASSeekIndexReset(index);
+  CHECK(!ASSeekIndexScanHeader(index, 0, file, sizeof(file)));
+  CHECK(!ASSeekIndexScanHeader(index, sizeof(file), file, sizeof(file)));
+  ASSeekIndexSetDataOffset(index, 10);
+  CHECK(ASSeekIndexScanHeader(index, 2 * sizeof(file), file, 0));
+  CHECK(ASSeekIndexPacketCount(index) == 0);
+  ASSeekIndexDestroy(index);
+}
+
+int main(void) {
+  test_received();
+  test_vbri();
+  test_toc();
+  test_no_header();
+  return TEST_RESULT();
+}
@@ -0,0 +1,108 @@
+//
+//  segmented_transport_bench.c
+//  AudioStreamer
+//
+//  How much sooner ASSegmentedTransport gets a file from a server whose
+//  connections are each slow: an 8 MB file from a loopback server which
+//  caps every response at 1 MB/s, fetched in 256 KB segments over one
+//  connection and over up to eight, and then over up to eight with the
+//  server's whole link capped at 2.5 MB/s as well. Prints how long the first
+//  megabyte and the whole file took, and how many connections the download
+//  settled on. Every byte has to arrive, in order.
+//
+
+#include "ASSegmentedTransport.h"
+#include "bench.h"
+#include "test_server.h"
+
+#include <string.h>
+
+#define kFileSize (8 << 20)
+#define kSegmentSize (256 * 1024)
+
+static uint8_t file[kFileSize];
+static test_rate_cap_t cap = TEST_RATE_CAP_INIT(1024 * 1024, 0);
+
+static bool handle(void *context, int fd, const test_request_t *request) {
+  (void)context;
+  uint64_t start = request->hasRange ? request->rangeStart : 0;
+  uint64_t end = request->hasRange && request->rangeEnd < kFileSize
+                   ? request->rangeEnd : kFileSize - 1;
+  return test_sendf(fd, "HTTP/1.1 206 Partial Content\r\n"
+                        "Content-Range: bytes %llu-%llu/%d\r\n"
+                        "Content-Length: %llu\r\n\r\n",
+                    (unsigned long long)start, (unsigned long long)end, kFileSize,
+                    (unsigned long long)(end - start + 1)) &&
+         test_send_capped(fd, file + start, (size_t)(end - start + 1), &cap);
+}
+
+typedef struct download {
+  uint8_t *body;
+  size_t   length;
+  bool     end;
+  bool     error;
+} download_t;
+
+static void on_event(void *context, transport_t *transport, transport_event_t event) {
+  download_t *download = context;
+  switch (event) {
+    case TRANSPORT_EVENT_READABLE:
+      for (;;) {
+        ssize_t got = ASTransportRead(transport, download->body + download->length,
+                                      kFileSize - download->length);
+        if (got <= 0) break;
+        download->length += (size_t)got;
+      }
+      break;
+    case TRANSPORT_EVENT_END:
+      download->end = true;
+      break;
+    case TRANSPORT_EVENT_ERROR:
+      download->error = true;
+      break;
+  }
+}
+
+static void run(test_server_t *server, const char *name, unsigned connections,
+                double total) {
+  static uint8_t body[kFileSize];
+  pthread_mutex_lock(&cap.lock);
+  cap.total = total;
+  pthread_mutex_unlock(&cap.lock);
+
+  http_client_t *client = ASHTTPClientCreate();
+  download_t d = {.body = body};
+  segmented_info_t info = {
+    .request = {.url = test_server_url(server, "/file")},
+    .segmentSize = kSegmentSize,
+    .maxConnections = connections,
+  };
+  double start = bench_now(), firstMB = 0;
+  transport_t *transport = ASSegmentedTransportCreate(client, &info, on_event, &d);
+  CHECK(transport != NULL);
+  if (transport == NULL) return;
+  while (!d.end && !d.error && bench_now() - start < 60) {
+    ASHTTPClientProcess(client, 100);
+    if (firstMB == 0 && d.length >= 1 << 20) firstMB = bench_now() - start;
+  }
+  double whole = bench_now() - start;
+  CHECK(d.end && d.length == kFileSize && memcmp(body, file, kFileSize) == 0);
+  printf("%-32s first 1 MB in %.2f s, all in %.2f s, %u connections\n", name,
+         firstMB, whole, ASSegmentedTransportConnections(transport));
+  ASTransportClose(transport);
+  ASHTTPClientDestroy(client);
+}
+
+int main(void) {
+  uint32_t seed = 15;
+  for (size_t i = 0; i < kFileSize; i++) file[i] = (uint8_t)test_random(&seed);
+  test_server_t *server = test_server_start(handle, NULL);
+  CHECK(server != NULL);
+  if (server == NULL) return TEST_RESULT();
+
+  run(server, "1 connection", 1, 0);
+  run(server, "up to 8", 8, 0);
+  run(server, "up to 8, link at 2.5 MB/s", 8, 2.5 * 1024 * 1024);
+  test_server_stop(server);
+  return TEST_RESULT();
+}
@@ -0,0 +1,271 @@
+//
+//  segmented_transport_test.c
+//  AudioStreamer
+//
+//  Downloads ranges of a file through ASSegmentedTransport from a loopback
+//  server which paces each response, so that more connections go faster.
+//  The bytes have to come back whole and in order as one 206 response, over
+//  several connections at once with If-Range on all but the first; a server
+//  which doesn't do ranges has its response passed through; and a file
+//  which changes part way through fails the download.
+//
+//  Then the number of connections is watched as it adapts, with each
+//  response capped at 256 KB/s: it has to grow to the most allowed when
+//  nothing else holds it back, and when the server's link is capped at
+//  640 KB/s too, grow only while another connection helps (2 give 512 KB/s
+//  and 3 give 640) and drop back to 3 after trying a fourth, and stay there.
+//
+
+#include "ASSegmentedTransport.h"
+#include "test.h"
+#include "test_server.h"
+
+#include <time.h>
+
+#define kFileSize    (2 << 20)
+#define kSegmentSize 65536
+#define kETag        "\"v1\""
+
+static uint8_t file[kFileSize];
+static test_server_t *server;
+
+/* Responses being sent right now, and the most there have been at once */
+static atomic_int inFlight;
+static atomic_int maxInFlight;
+/* Requests after the first of a download, and how many had the validator */
+static atomic_int laterRequests;
+static atomic_int laterWithIfRange;
+
+/* For /capped */
+static test_rate_cap_t cap = TEST_RATE_CAP_INIT(256 * 1024, 0);
+
+/* Sends the body 16 KB at a time with a pause in between, about 8 MB/s */
+static bool send_paced(int fd, const uint8_t *data, size_t length) {
+  const struct timespec pause = {0, 2000000};
+  while (length > 0) {
+    size_t n = length < 16384 ? length : 16384;
+    if (!test_send(fd, data, n)) return false;
+    data += n;
+    length -= n;
+    nanosleep(&pause, NULL);
+  }
+  return true;
+}
+
+static bool handle(void *context, int fd, const test_request_t *request) {
+  (void)context;
+  bool ranges = strcmp(request->path, "/plain") != 0;
+  bool changed = strcmp(request->path, "/changing") == 0 &&
+                 request->hasRange && request->rangeStart > 0;
+  if (request->hasRange && request->rangeStart > 0) {
+    atomic_fetch_add(&laterRequests, 1);
+    if (strcmp(request->ifRange, kETag) == 0) atomic_fetch_add(&laterWithIfRange, 1);
+  }
+
+  int now = atomic_fetch_add(&inFlight, 1) + 1;
+  int most = atomic_load(&maxInFlight);
+  while (now > most && !atomic_compare_exchange_weak(&maxInFlight, &most, now)) {}
+
+  bool capped = strcmp(request->path, "/capped") == 0;
+  bool ok;
+  if (!request->hasRange || !ranges || changed) {
+    /* The whole file, and a new one if it has changed */
+    ok = test_sendf(fd, "HTTP/1.1 200 OK\r\nETag: %s\r\nContent-Length: %d\r\n\r\n",
+                    changed ? "\"v2\"" : kETag, kFileSize) &&
+         send_paced(fd, file, kFileSize);
+  } else {
+    uint64_t start = request->rangeStart;
+    uint64_t end = request->rangeEnd < kFileSize ? request->rangeEnd : kFileSize - 1;
+    ok = test_sendf(fd, "HTTP/1.1 206 Partial Content\r\nETag: " kETag "\r\n"
+                        "Content-Range: bytes %llu-%llu/%d\r\n"
+                        "Content-Length: %llu\r\n\r\n",
+                    (unsigned long long)start, (unsigned long long)end, kFileSize,
+                    (unsigned long long)(end - start + 1)) &&
+         (capped ? test_send_capped(fd, file + start, (size_t)(end - start + 1), &cap)
+                 : send_paced(fd, file + start, (size_t)(end - start + 1)));
+  }
+  atomic_fetch_sub(&inFlight, 1);
+  return ok;
+}
+
+/* The connections aimed for during the last download, each change of them */
+static unsigned targets[32];
+static int targetCount;
+
+typedef struct download {
+  uint8_t *body;
+  size_t   length;
+  bool     end;
+  bool     error;
+} download_t;
+
+static void on_event(void *context, transport_t *transport, transport_event_t event) {
+  download_t *download = context;
+  switch (event) {
+    case TRANSPORT_EVENT_READABLE:
+      for (;;) {
+        ssize_t got = ASTransportRead(transport, download->body + download->length,
+                                      kFileSize - download->length);
+        if (got <= 0) break;
+        download->length += (size_t)got;
+      }
+      break;
+    case TRANSPORT_EVENT_END:
+      download->end = true;
+      break;
+    case TRANSPORT_EVENT_ERROR:
+      download->error = true;
+      break;
+  }
+}
+
+/* Downloads [start, end) of the path until it ends or fails, returning the
+   transport, still open */
+static transport_t *download(http_client_t *client, download_t *d, const char *path,
+                             uint64_t start, uint64_t end, unsigned connections) {
+  static uint8_t body[kFileSize];
+  memset(d, 0, sizeof(*d));
+  d->body = body;
+  atomic_store(&maxInFlight, 0);
+  atomic_store(&laterRequests, 0);
+  atomic_store(&laterWithIfRange, 0);
+  segmented_info_t info = {
+    .request = {.url = test_server_url(server, path)},
+    .start = start,
+    .end = end,
+    .segmentSize = kSegmentSize,
+    .maxConnections = connections,
+  };
+  transport_t *transport = ASSegmentedTransportCreate(client, &info, on_event, d);
+  CHECK(transport != NULL);
+  if (transport == NULL) return NULL;
+  time_t deadline = time(NULL) + 20;
+  /* One, until the first response says whether there can be more */
+  targets[0] = ASSegmentedTransportConnections(transport);
+  targetCount = 1;
+  while (!d->end && !d->error && time(NULL) < deadline) {
+    ASHTTPClientProcess(client, 100);
+    unsigned target = ASSegmentedTransportConnections(transport);
+    if ((targetCount == 0 || targets[targetCount - 1] != target) &&
+        targetCount < 32) {
+      targets[targetCount++] = target;
+    }
+  }
+  CHECK(d->end || d->error);
+  return transport;
+}
+
+static void test_ranges(http_client_t *client) {
+  const struct { uint64_t start, end; unsigned connections; } cases[] = {
+    {0, 0, 6},
+    {300001, 1500000, 4},
+    {kFileSize - 1000, 0, 4},     /* less than a segment */
+    {12345, 0, 1},
+  };
+  for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    download_t d;
+    uint64_t start = cases[i].start;
+    uint64_t end = cases[i].end != 0 ? cases[i].end : kFileSize;
+    transport_t *transport = download(client, &d, "/file", start, cases[i].end,
+                                      cases[i].connections);
+    if (transport == NULL) continue;
+    CHECK(d.end && !d.error);
+    CHECK(d.length == end - start && memcmp(d.body, file + start, d.length) == 0);
+    CHECK(ASTransportStatusCode(transport) == 206);
+    char range[96], length[32];
+    snprintf(range, sizeof(range), "bytes %llu-%llu/%d", (unsigned long long)start,
+             (unsigned long long)end - 1, kFileSize);
+    snprintf(length, sizeof(length), "%llu", (unsigned long long)(end - start));
+    const char *value = ASTransportHeaderValue(transport, "Content-Range");
+    CHECK(value != NULL && strcmp(value, range) == 0);
+    value = ASTransportHeaderValue(transport, "Content-Length");
+    CHECK(value != NULL && strcmp(value, length) == 0);
+    value = ASTransportHeaderValue(transport, "ETag");
+    CHECK(value != NULL && strcmp(value, kETag) == 0);
+
+    /* Every segment after the first carries the validator */
+    int later = atomic_load(&laterRequests) - (start > 0 ? 1 : 0);
+    CHECK(later == (int)((end - start + kSegmentSize - 1) / kSegmentSize) - 1);
+    CHECK(atomic_load(&laterWithIfRange) == later);
+    if (end - start > 4 * kSegmentSize) {
+      CHECK(cases[i].connections == 1 ? atomic_load(&maxInFlight) == 1
+                                      : atomic_load(&maxInFlight) >= 2);
+    }
+    CHECK(atomic_load(&maxInFlight) <= (int)cases[i].connections);
+    ASTransportClose(transport);
+  }
+}
+
+static void test_passthrough(http_client_t *client) {
+  download_t d;
+  transport_t *transport = download(client, &d, "/plain", 0, 0, 4);
+  if (transport == NULL) return;
+  CHECK(d.end && ASTransportStatusCode(transport) == 200);
+  CHECK(d.length == kFileSize && memcmp(d.body, file, kFileSize) == 0);
+  CHECK(atomic_load(&maxInFlight) == 1);
+  ASTransportClose(transport);
+}
+
+static void test_changed_file(http_client_t *client) {
+  download_t d;
+  transport_t *transport = download(client, &d, "/changing", 0, 0, 4);
+  if (transport == NULL) return;
+  CHECK(d.error && !d.end);
+  CHECK(ASTransportError(transport) != NULL);
+  /* What did arrive was the old file */
+  CHECK(d.length < kFileSize && memcmp(d.body, file, d.length) == 0);
+  ASTransportClose(transport);
+}
+
+/* Downloads all of /capped and checks the connections aimed for went
+   through just the counts given */
+static void check_adapts(http_client_t *client, unsigned connections,
+                         double total, const unsigned *expected, int count) {
+  int failures = testFailures;
+  pthread_mutex_lock(&cap.lock);
+  cap.total = total;
+  pthread_mutex_unlock(&cap.lock);
+  download_t d;
+  transport_t *transport = download(client, &d, "/capped", 0, 0, connections);
+  if (transport == NULL) return;
+  CHECK(d.end && d.length == kFileSize && memcmp(d.body, file, kFileSize) == 0);
+  CHECK(targetCount == count);
+  for (int i = 0; i < count && i < targetCount; i++) {
+    CHECK(targets[i] == expected[i]);
+  }
+  CHECK(atomic_load(&maxInFlight) <= (int)connections);
+  if (testFailures > failures) {
+    fprintf(stderr, "connections aimed for:");
+    for (int i = 0; i < targetCount; i++) fprintf(stderr, " %u", targets[i]);
+    fprintf(stderr, "\n");
+  }
+  ASTransportClose(transport);
+}
+
+static void test_adapting(http_client_t *client) {
+  /* Each connection adds as much as the last */
+  static const unsigned toTheMost[] = {1, 2, 3, 4};
+  check_adapts(client, 4, 0, toTheMost, 4);
+
+  /* The fourth adds nothing */
+  static const unsigned toTheBest[] = {1, 2, 3, 4, 3};
+  check_adapts(client, 8, 640 * 1024, toTheBest, 5);
+}
+
+int main(void) {
+  uint32_t seed = 15;
+  for (size_t i = 0; i < kFileSize; i++) file[i] = (uint8_t)test_random(&seed);
+  server = test_server_start(handle, NULL);
+  CHECK(server != NULL);
+  if (server == NULL) return TEST_RESULT();
+  http_client_t *client = ASHTTPClientCreate();
+
+  test_ranges(client);
+  test_passthrough(client);
+  test_changed_file(client);
+  test_adapting(client);
+
+  ASHTTPClientDestroy(client);
+  test_server_stop(server);
+  return TEST_RESULT();
+}
@@ -0,0 +1,139 @@
+//
+//  spsc_queue_test.c
+//  AudioStreamer
+//
+//  Passes buffers round between two threads through a pair of ASSPSCQueues,
+//  the way the audio queue's thread and the stream thread do: one queue
+//  carries filled buffers, the other hands them back. Every buffer has to
+//  arrive in the order sent with what was written into it, and none may be
+//  lost or turn up twice. Build with -DAS_SANITIZE=thread to have
+//  ThreadSanitizer watch the hand-offs too.
+//
+
+#include "ASSPSCQueue.h"
+#include "test.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#define kRounds 400000
+
+typedef struct buffer {
+  uint64_t sequence;   /* written by the filler */
+  uint64_t check;      /* a function of it, to catch torn reads */
+} buffer_t;
+
+typedef struct loop {
+  spsc_queue_t *filled;   /* filler -> player */
+  spsc_queue_t *empty;    /* player -> filler */
+  uint64_t      played;
+  bool          ordered;
+  bool          intact;
+} loop_t;
+
+static uint64_t check_of(uint64_t sequence) {
+  return sequence * 0x9E3779B97F4A7C15ull;
+}
+
+/* The player: takes filled buffers, checks them and hands them back */
+static void *player(void *context) {
+  loop_t *loop = context;
+  uint64_t expected = 0;
+  while (expected < kRounds) {
+    void *item;
+    if (!ASSPSCQueuePop(loop->filled, &item)) {
+      sched_yield();
+      continue;
+    }
+    buffer_t *buffer = item;
+    if (buffer->sequence != expected) loop->ordered = false;
+    if (buffer->check != check_of(buffer->sequence)) loop->intact = false;
+    expected++;
+    while (!ASSPSCQueuePush(loop->empty, buffer)) sched_yield();
+  }
+  loop->played = expected;
+  return NULL;
+}
+
+static void run(size_t capacity) {
+  loop_t loop = {
+    .filled = ASSPSCQueueCreate(capacity),
+    .empty = ASSPSCQueueCreate(capacity),
+    .ordered = true,
+    .intact = true,
+  };
+  CHECK(loop.filled != NULL && loop.empty != NULL);
+
+  /* As many buffers as the queues hold, so that either can fill up */
+  buffer_t *buffers = calloc(capacity, sizeof(buffer_t));
+  for (size_t i = 0; i < capacity; i++) {
+    CHECK(ASSPSCQueuePush(loop.empty, &buffers[i]));
+  }
+  CHECK(!ASSPSCQueuePush(loop.empty, &buffers[0]));
+
+  pthread_t thread;
+  CHECK(pthread_create(&thread, NULL, player, &loop) == 0);
+
+  /* The filler, on this thread */
+  uint32_t seed = (uint32_t)capacity * 2654435761u | 1;
+  for (uint64_t sequence = 0; sequence < kRounds; sequence++) {
+    void *item;
+    while (!ASSPSCQueuePop(loop.empty, &item)) sched_yield();
+    buffer_t *buffer = item;
+    buffer->sequence = sequence;
+    buffer->check = check_of(sequence);
+    while (!ASSPSCQueuePush(loop.filled, buffer)) sched_yield();
+    /* Now and then let the player catch up, so the queue also runs empty */
+    if (test_random_below(&seed, 1000) == 0) sched_yield();
+  }
+  pthread_join(thread, NULL);
+
+  CHECK(loop.played == kRounds);
+  CHECK(loop.ordered);
+  CHECK(loop.intact);
+  CHECK(ASSPSCQueueCount(loop.filled) == 0);
+
+  /* Every buffer is back in 'empty' exactly once */
+  size_t returned = 0;
+  void *item;
+  bool unique = true;
+  while (ASSPSCQueuePop(loop.empty, &item)) {
+    buffer_t *buffer = item;
+    unique = unique && buffer->check != 0;
+    buffer->check = 0;
+    returned++;
+  }
+  CHECK(unique);
+  CHECK(returned == capacity);
+
+  ASSPSCQueueDestroy(loop.filled);
+  ASSPSCQueueDestroy(loop.empty);
+  free(buffers);
+}
+
+static void test_single_thread(void) {
+  spsc_queue_t *queue = ASSPSCQueueCreate(3);
+  int values[5];
+  void *item;
+  CHECK(!ASSPSCQueuePop(queue, &item));
+  /* Rounded up to 4 */
+  for (int i = 0; i < 4; i++) CHECK(ASSPSCQueuePush(queue, &values[i]));
+  CHECK(!ASSPSCQueuePush(queue, &values[4]));
+  CHECK(ASSPSCQueueCount(queue) == 4);
+  for (int i = 0; i < 4; i++) {
+    CHECK(ASSPSCQueuePop(queue, &item) && item == &values[i]);
+  }
+  CHECK(!ASSPSCQueuePop(queue, &item));
+  CHECK(ASSPSCQueueCount(queue) == 0);
+  ASSPSCQueueDestroy(queue);
+}
+
+int main(void) {
+  test_single_thread();
+  run(2);
+  run(8);
+  run(64);
+  return TEST_RESULT();
+}
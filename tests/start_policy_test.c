@@ -0,0 +1,127 @@
+//
+//  start_policy_test.c
+//  AudioStreamer
+//
+//  When a stream starts: on a count of full buffers, on seconds of audio
+//  whatever the bitrate, on as little as will last with an adaptive start,
+//  and on the low watermark after running dry.
+//
+
+#include "ASStartPolicy.h"
+#include "test.h"
+
+#include <math.h>
+
+/* A 128 kbps stream of five minutes, 2 of 8 buffers queued with 1.5 seconds
+   of audio in them, the download rate not known yet */
+static start_state_t state_with(double queued) {
+  return (start_state_t){
+    .buffersUsed = 2,
+    .buffersActive = 8,
+    .queued = queued,
+    .buffered = queued,
+    .lowWatermark = 1.5,
+    .bitrate = 128000,
+    .remaining = 300,
+  };
+}
+
+static void test_buffer_count(void) {
+  start_policy_t policy = {.fillCountToStart = 4};
+  start_state_t state = state_with(1.5);
+  CHECK(!ASStartPolicyReady(&policy, &state));
+  state.buffersUsed = 4;
+  CHECK(ASStartPolicyReady(&policy, &state));
+
+  /* Fewer buffers than the count start once they're all full */
+  state.buffersActive = 3;
+  state.buffersUsed = 2;
+  CHECK(!ASStartPolicyReady(&policy, &state));
+  state.buffersUsed = 3;
+  CHECK(ASStartPolicyReady(&policy, &state));
+}
+
+static void test_duration(void) {
+  start_policy_t policy = {.fillCountToStart = 32, .duration = 2};
+  start_state_t state = state_with(1.9);
+  CHECK(ASStartPolicyTarget(&policy, &state) == 2);
+  CHECK(!ASStartPolicyReady(&policy, &state));
+  state.queued = 2;
+  CHECK(ASStartPolicyReady(&policy, &state));
+
+  /* However few buffers it takes, and as many as there are if that's all */
+  state.buffersUsed = 1;
+  CHECK(ASStartPolicyReady(&policy, &state));
+  state.queued = 1;
+  state.buffersUsed = state.buffersActive;
+  CHECK(ASStartPolicyReady(&policy, &state));
+
+  /* Without a sample rate, buffers are counted */
+  state.queued = -1;
+  state.buffersUsed = 8;
+  state.buffersActive = 64;
+  CHECK(!ASStartPolicyReady(&policy, &state));
+  state.buffersUsed = 32;
+  CHECK(ASStartPolicyReady(&policy, &state));
+}
+
+static void test_adaptive(void) {
+  start_policy_t policy = {.duration = 4, .adaptive = true};
+  start_state_t state = state_with(0);
+
+  /* Without a download rate, the duration */
+  CHECK(ASStartPolicyTarget(&policy, &state) == 4);
+
+  /* Faster than the stream, as little as there can be */
+  state.throughput = 400000;
+  state.deviation = 100000;
+  CHECK(fabs(ASStartPolicyTarget(&policy, &state) - 0.2) < 1e-9);
+  state.queued = 0.2;
+  CHECK(ASStartPolicyReady(&policy, &state));
+
+  /* The deviation is taken off: 128 - 8 kbps leaves 1/16 of the remaining
+     minute to make up */
+  state.throughput = 128000;
+  state.deviation = 8000;
+  state.remaining = 60;
+  CHECK(fabs(ASStartPolicyTarget(&policy, &state) - 3.75) < 1e-9);
+
+  /* No more than the duration or the low watermark, whichever is more */
+  state.remaining = 300;
+  CHECK(ASStartPolicyTarget(&policy, &state) == 4);
+  state.lowWatermark = 9;
+  CHECK(ASStartPolicyTarget(&policy, &state) == 9);
+
+  /* Live streams and unknown bitrates wait for the duration */
+  state.remaining = -1;
+  CHECK(ASStartPolicyTarget(&policy, &state) == 4);
+  state.remaining = 60;
+  state.bitrate = 0;
+  CHECK(ASStartPolicyTarget(&policy, &state) == 4);
+  policy.adaptive = false;
+  state.bitrate = 128000;
+  CHECK(ASStartPolicyTarget(&policy, &state) == 4);
+}
+
+static void test_stalled(void) {
+  start_policy_t policy = {.fillCountToStart = 2, .duration = 1};
+  start_state_t state = state_with(3);
+  state.stalled = true;
+  state.lowWatermark = 5;
+  state.buffered = 4.9;
+  CHECK(!ASStartPolicyReady(&policy, &state));
+  state.buffered = 5;
+  CHECK(ASStartPolicyReady(&policy, &state));
+
+  /* Until the bitrate is known, as for the first start */
+  state.buffered = -1;
+  CHECK(ASStartPolicyReady(&policy, &state));
+}
+
+int main(void) {
+  test_buffer_count();
+  test_duration();
+  test_adaptive();
+  test_stalled();
+  return TEST_RESULT();
+}
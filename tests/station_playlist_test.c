@@ -0,0 +1,135 @@
+//
+//  station_playlist_test.c
+//  AudioStreamer
+//
+//  Which mirrors ASStationPlaylist reads from a station's PLS or M3U file,
+//  and in what order: PLS entries by their numbers, M3U lines as listed,
+//  made absolute against the playlist's URL, with comments, other keys,
+//  repeats and URLs which aren't http or https left out, whatever the line
+//  endings. HLS playlists, which are M3U too, are told apart by their tags.
+//
+
+#include "ASStationPlaylist.h"
+#include "test.h"
+
+#include <stdarg.h>
+#include <string.h>
+
+#define kBase "http://radio.example.com/listen/station.pls"
+
+/* Parses the text and checks it lists exactly the URLs given, in order and
+   ending with NULL, or that it doesn't parse if none are given */
+static void check(const char *text, ...) {
+  int failures = testFailures;
+  station_playlist_t *playlist = ASStationPlaylistParse(text, strlen(text),
+                                                        kBase);
+  va_list args;
+  va_start(args, text);
+  size_t count = 0;
+  const char *url;
+  while ((url = va_arg(args, const char *)) != NULL) {
+    CHECK(playlist != NULL && count < playlist->count &&
+          strcmp(playlist->urls[count], url) == 0);
+    count++;
+  }
+  va_end(args);
+  CHECK(count == 0 ? playlist == NULL
+                   : playlist != NULL && playlist->count == count);
+  if (testFailures > failures) fprintf(stderr, "parsing:\n%s\n", text);
+  ASStationPlaylistFree(playlist);
+}
+
+static void test_pls(void) {
+  check("[playlist]\n"
+        "NumberOfEntries=3\n"
+        "File3=http://c.example.com:8000/stream\n"
+        "Title3=Mirror C\n"
+        "File1=http://a.example.com/stream\n"
+        "Length1=-1\n"
+        "File2=http://b.example.com/stream\n"
+        "Version=2\n",
+        "http://a.example.com/stream", "http://b.example.com/stream",
+        "http://c.example.com:8000/stream", NULL);
+
+  /* Numbers sort as numbers, and ties keep the order listed */
+  check("[playlist]\nFile10=http://j/\nFile9=http://i/\nfile2=http://b/\n"
+        "FILE2=http://b2/\nFile02=http://b3/\n",
+        "http://b/", "http://b2/", "http://b3/", "http://i/", "http://j/",
+        NULL);
+
+  /* CRLF, a byte order mark, spaces, a lower case header and keys which
+     only look like entries */
+  check("\xEF\xBB\xBF  [Playlist]  \r\n\r\n"
+        "File1= http://a/ \r\n"
+        "File=http://no-number/\r\n"
+        "FileX=http://not-a-number/\r\n"
+        "File3 =http://space-before-equals/\r\n"
+        "File4=\r\n"
+        "File5\r\n"
+        "File2=http://b/",
+        "http://a/", "http://b/", NULL);
+
+  /* Relative entries, repeats and other schemes */
+  check("[playlist]\nFile1=mirror1\nFile2=/root\nFile3=http://a/\n"
+        "File4=mms://a/\nFile5=http://a/\nFile6=https://s/\n",
+        "http://radio.example.com/listen/mirror1",
+        "http://radio.example.com/root", "http://a/", "https://s/", NULL);
+
+  /* The header is looked for on the first line which isn't blank; anywhere
+     else it is just another line */
+  check("\n\n[playlist]\nFile1=http://a/\n", "http://a/", NULL);
+  check("#EXTM3U\n[playlist]\nFile1=http://b/\n",
+        "http://radio.example.com/listen/[playlist]",
+        "http://radio.example.com/listen/File1=http://b/", NULL);
+  check("[playlist]\nNumberOfEntries=0\n", NULL);
+}
+
+static void test_m3u(void) {
+  check("#EXTM3U\n"
+        "#EXTINF:-1,Station\n"
+        "http://a.example.com/stream\n"
+        "# another comment\n"
+        "http://b.example.com/stream\n",
+        "http://a.example.com/stream", "http://b.example.com/stream", NULL);
+
+  /* A bare list, CRLF, blank lines, no newline at the end, repeats,
+     relative and unusable URLs */
+  check("\r\n  http://b/  \r\n\r\nhttp://a/\r\nhttp://b/\r\nftp://c/\r\n"
+        "../up\r\nfile:///etc/passwd\r\nhttps://d/",
+        "http://b/", "http://a/", "http://radio.example.com/up", "https://d/",
+        NULL);
+
+  check("", NULL);
+  check("#EXTM3U\n#EXTINF:-1,Nothing\n", NULL);
+  check("ftp://a/\nrtsp://b/\n", NULL);
+}
+
+static void test_hls(void) {
+  static const struct {
+    const char *text;
+    bool        hls;
+  } cases[] = {
+    {"#EXTM3U\n#EXT-X-TARGETDURATION:10\n#EXTINF:10,\nseg0.ts\n", true},
+    {"#EXTM3U\r\n#EXT-X-STREAM-INF:BANDWIDTH=128000\r\nlow.m3u8\r\n", true},
+    {"\xEF\xBB\xBF#EXTM3U\n  #EXT-X-VERSION:3\n", true},
+    {"#EXTM3U\n#EXTINF:-1,Station\nhttp://a/\n", false},
+    {"http://a/#EXT-X-\n", false},
+    {"[playlist]\nFile1=http://a/\n", false},
+    {"", false},
+  };
+  for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    CHECK(ASStationPlaylistIsHLS(cases[i].text, strlen(cases[i].text)) ==
+          cases[i].hls);
+  }
+
+  /* Only the length given is looked at */
+  const char *text = "#EXTM3U\n#EXT-X-VERSION:3\n";
+  CHECK(!ASStationPlaylistIsHLS(text, 12));
+}
+
+int main(void) {
+  test_pls();
+  test_m3u();
+  test_hls();
+  return TEST_RESULT();
+}
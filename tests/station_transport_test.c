@@ -0,0 +1,364 @@
+//
+//  station_transport_test.c
+//  AudioStreamer
+//
+//  Races the mirrors of station playlists through ASStationTransport on a
+//  loopback server whose mirrors answer after different delays. A slow
+//  first mirror holds up the first audio when it's the only one raced, and
+//  doesn't when a faster one races it. Runners-up are held open: when the
+//  winner's connection is lost they take over in turn, their bytes following
+//  on with no error in between and no new request, and the transport only
+//  fails when the last of them goes, leaving the mirror it never tried to
+//  fall back on. Error statuses and pages are passed over, and an HLS
+//  playlist is recognised.
+//
+
+#include "ASStationTransport.h"
+#include "test.h"
+#include "test_server.h"
+
+#include <time.h>
+
+#define kMaxBody   65536
+#define kLostLength 1000000       /* claimed by responses which don't end */
+#define kMaxChunks 256
+
+typedef enum {
+  BODY_ENDS,                      /* sends all of it and closes */
+  BODY_LOST,                      /* closes before its Content-Length */
+  BODY_HELD,                      /* stays open until the client closes */
+} body_t;
+
+typedef struct mirror {
+  const char *path;
+  int         delay;              /* ms before the response */
+  int         bodyDelay;          /* ms between the head and the body */
+  size_t      length;
+  body_t      body;
+  const char *type;
+} mirror_t;
+
+enum { SLOW, FAST, DYING, SECOND, THIRD, FOURTH, EAGER, PAGE, kMirrorCount };
+
+static const mirror_t mirrors[kMirrorCount] = {
+  [SLOW]   = {"/slow", 600, 0, 4096, BODY_ENDS, "audio/mpeg"},
+  [FAST]   = {"/fast", 50, 0, 4096, BODY_ENDS, "audio/mpeg"},
+  [DYING]  = {"/dying", 20, 0, 20000, BODY_LOST, "audio/mpeg"},
+  [SECOND] = {"/second", 100, 0, 30000, BODY_LOST, "audio/mpeg"},
+  [THIRD]  = {"/third", 150, 0, 40000, BODY_HELD, "audio/mpeg"},
+  [FOURTH] = {"/fourth", 0, 0, 1000, BODY_ENDS, "audio/mpeg"},
+  /* Answers at once, but has no audio until well after the race */
+  [EAGER]  = {"/eager", 0, 200, 25000, BODY_LOST, "audio/aacp"},
+  /* An error page which says it's fine, too late to lose the race */
+  [PAGE]   = {"/page", 100, 0, 500, BODY_ENDS, "text/html"},
+};
+
+static const struct {
+  const char *path;
+  const char *text;
+} playlists[] = {
+  {"/race.m3u", "#EXTM3U\n/slow\n/fast\n"},
+  {"/failover.m3u", "#EXTM3U\n/dying\n/second\n/third\n/fourth\n"},
+  {"/ranked.pls", "[playlist]\nFile2=/eager\nFile1=/second\nFile3=/third\n"
+                  "File4=/dying\nFile5=/fourth\n"},
+  {"/rejected.m3u", "/dying\n/page\n/second\n"},
+  {"/bad.m3u", "/missing\n/html\n/fast\n"},
+  {"/allbad.m3u", "https://127.0.0.1:1/secure\n/missing\n/html\n"},
+  {"/hls.m3u", "#EXTM3U\n#EXT-X-TARGETDURATION:10\n#EXTINF:10,\nseg0.ts\n"},
+};
+
+static uint8_t bodies[kMirrorCount][kMaxBody];
+static atomic_int requested[kMirrorCount];
+static test_server_t *server;
+
+static void sleep_ms(int ms) {
+  struct timespec pause = {ms / 1000, (ms % 1000) * 1000000L};
+  nanosleep(&pause, NULL);
+}
+
+static bool send_mirror(int fd, int index) {
+  const mirror_t *m = &mirrors[index];
+  atomic_fetch_add(&requested[index], 1);
+  sleep_ms(m->delay);
+  if (!test_sendf(fd, "HTTP/1.1 200 OK\r\nContent-Type: %s\r\n"
+                      "Content-Length: %zu\r\n\r\n", m->type,
+                  m->body != BODY_ENDS ? (size_t)kLostLength : m->length)) {
+    return false;
+  }
+  sleep_ms(m->bodyDelay);
+  if (!test_send(fd, bodies[index], m->length)) return false;
+  if (m->body == BODY_HELD) {
+    uint8_t b;
+    while (recv(fd, &b, 1, 0) > 0) {}
+  }
+  return false;
+}
+
+static bool handle(void *context, int fd, const test_request_t *request) {
+  (void)context;
+  for (int i = 0; i < kMirrorCount; i++) {
+    if (strcmp(request->path, mirrors[i].path) == 0) return send_mirror(fd, i);
+  }
+  for (size_t i = 0; i < sizeof(playlists) / sizeof(playlists[0]); i++) {
+    if (strcmp(request->path, playlists[i].path) == 0) {
+      size_t length = strlen(playlists[i].text);
+      return test_sendf(fd, "HTTP/1.1 200 OK\r\nContent-Type: audio/x-mpegurl\r\n"
+                            "Content-Length: %zu\r\n\r\n", length) &&
+             test_send(fd, playlists[i].text, length);
+    }
+  }
+  if (strcmp(request->path, "/html") == 0) {
+    /* An error page which says it's fine */
+    return test_sendf(fd, "HTTP/1.1 200 OK\r\nContent-Type: text/html\r\n"
+                          "Content-Length: 13\r\n\r\n<html></html>");
+  }
+  return test_sendf(fd, "HTTP/1.1 404 Not Found\r\nContent-Type: text/plain\r\n"
+                        "Content-Length: 9\r\n\r\nnot found");
+}
+
+/* Which mirror a URL is of, or -1 */
+static int mirror_of(const char *url) {
+  const char *path = url != NULL ? strstr(url + 7, "/") : NULL;
+  for (int i = 0; path != NULL && i < kMirrorCount; i++) {
+    if (strcmp(path, mirrors[i].path) == 0) return i;
+  }
+  return -1;
+}
+
+typedef struct playback {
+  uint8_t  data[3 * kMaxBody];
+  size_t   length;
+  /* The mirror each read came from, and where it started */
+  int      chunkMirrors[kMaxChunks];
+  size_t   chunkStarts[kMaxChunks];
+  size_t   chunkCount;
+  bool     seen[kMirrorCount];    /* said to be read from between events */
+  double   firstAudio;            /* seconds after the start */
+  struct timespec start;
+  bool     end;
+  bool     error;
+} playback_t;
+
+static double since(const struct timespec *start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double)(now.tv_sec - start->tv_sec) +
+         (double)(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void on_event(void *context, transport_t *transport, transport_event_t event) {
+  playback_t *p = context;
+  switch (event) {
+    case TRANSPORT_EVENT_READABLE:
+      for (;;) {
+        size_t start = p->length;
+        ssize_t got = ASTransportRead(transport, p->data + p->length,
+                                      sizeof(p->data) - p->length);
+        if (got <= 0) break;
+        if (start == 0) p->firstAudio = since(&p->start);
+        p->length += (size_t)got;
+        if (p->chunkCount < kMaxChunks) {
+          p->chunkMirrors[p->chunkCount] = mirror_of(ASStationTransportURL(transport));
+          p->chunkStarts[p->chunkCount++] = start;
+        }
+      }
+      break;
+    case TRANSPORT_EVENT_END:
+      p->end = true;
+      break;
+    case TRANSPORT_EVENT_ERROR:
+      p->error = true;
+      break;
+  }
+}
+
+/* Plays the playlist until it ends, fails, or has sent the given number of
+   bytes, returning the transport, still open */
+static transport_t *play(http_client_t *client, playback_t *p, const char *path,
+                         unsigned racers, size_t until) {
+  memset(p, 0, sizeof(*p));
+  for (int i = 0; i < kMirrorCount; i++) atomic_store(&requested[i], 0);
+  station_info_t info = {
+    .request = {.url = test_server_url(server, path)},
+    .racers = racers,
+  };
+  clock_gettime(CLOCK_MONOTONIC, &p->start);
+  transport_t *transport = ASStationTransportCreate(client, &info, on_event, p);
+  CHECK(transport != NULL);
+  if (transport == NULL) return NULL;
+  time_t deadline = time(NULL) + 20;
+  while (!p->end && !p->error && (until == 0 || p->length < until) &&
+         time(NULL) < deadline) {
+    ASHTTPClientProcess(client, 50);
+    int mirror = mirror_of(ASStationTransportURL(transport));
+    if (mirror >= 0) p->seen[mirror] = true;
+  }
+  CHECK(p->end || p->error || p->length >= until);
+  return transport;
+}
+
+/* The bytes are the mirrors' bodies one after another, each read while the
+   transport said it was of that mirror */
+static void check_bytes(const playback_t *p, const int *order, size_t count) {
+  size_t offset = 0;
+  for (size_t i = 0; i < count; i++) {
+    size_t length = mirrors[order[i]].length;
+    CHECK(offset + length <= p->length &&
+          memcmp(p->data + offset, bodies[order[i]], length) == 0);
+    for (size_t c = 0; c < p->chunkCount; c++) {
+      if (p->chunkStarts[c] >= offset && p->chunkStarts[c] < offset + length) {
+        CHECK(p->chunkMirrors[c] == order[i]);
+      }
+    }
+    offset += length;
+  }
+  CHECK(p->length == offset);
+}
+
+static void check_fallbacks(transport_t *transport, const int *expected, size_t count) {
+  CHECK(ASStationTransportFallbackCount(transport) == count);
+  for (size_t i = 0; i < count; i++) {
+    CHECK(mirror_of(ASStationTransportFallback(transport, i)) == expected[i]);
+  }
+}
+
+/* One racer waits for the slow first mirror; two have the fast one's audio
+   first, and keep the slow one as a runner-up */
+static void test_race(http_client_t *client) {
+  playback_t p;
+  transport_t *transport = play(client, &p, "/race.m3u", 1, 0);
+  if (transport != NULL) {
+    CHECK(p.end && !p.error);
+    CHECK(p.firstAudio >= mirrors[SLOW].delay / 1000.0);
+    check_bytes(&p, (const int[]){SLOW}, 1);
+    check_fallbacks(transport, (const int[]){FAST}, 1);
+    CHECK(atomic_load(&requested[FAST]) == 0);
+    ASTransportClose(transport);
+  }
+
+  transport = play(client, &p, "/race.m3u", 2, 0);
+  if (transport != NULL) {
+    CHECK(p.end && !p.error);
+    if (p.firstAudio >= 0.45) fprintf(stderr, "first audio after %.3f s\n", p.firstAudio);
+    CHECK(p.firstAudio < 0.45);
+    CHECK(mirror_of(ASStationTransportURL(transport)) == FAST);
+    check_bytes(&p, (const int[]){FAST}, 1);
+    check_fallbacks(transport, (const int[]){SLOW}, 1);
+    CHECK(atomic_load(&requested[SLOW]) == 1);
+    /* The runner-up sends nothing while it's held */
+    time_t wait = time(NULL) + 1;
+    while (time(NULL) <= wait) ASHTTPClientProcess(client, 50);
+    check_bytes(&p, (const int[]){FAST}, 1);
+    CHECK(mirror_of(ASStationTransportURL(transport)) == FAST);
+    ASTransportClose(transport);
+  }
+}
+
+/* The winner and then the first runner-up are lost part way through. The
+   second runner-up, held open since the race, carries on, and the mirror
+   which was never raced is left to fall back on */
+static void test_failover(http_client_t *client) {
+  const int order[] = {DYING, SECOND, THIRD};
+  size_t total = 0;
+  for (size_t i = 0; i < 3; i++) total += mirrors[order[i]].length;
+  playback_t *p = malloc(sizeof(playback_t));
+  transport_t *transport = play(client, p, "/failover.m3u", 3, total);
+  if (transport != NULL) {
+    CHECK(!p->error && !p->end);
+    check_bytes(p, order, 3);
+    CHECK(mirror_of(ASStationTransportURL(transport)) == THIRD);
+    check_fallbacks(transport, (const int[]){FOURTH}, 1);
+    for (size_t i = 0; i < 3; i++) CHECK(atomic_load(&requested[order[i]]) == 1);
+    CHECK(atomic_load(&requested[FOURTH]) == 0);
+    ASTransportClose(transport);
+  }
+
+  /* Of four racers, the two runners-up kept are the first in the playlist,
+     and the second waits for its audio. The transport fails once they're
+     gone too, and the one not kept goes back among the fallbacks */
+  const int ranked[] = {DYING, SECOND, EAGER};
+  transport = play(client, p, "/ranked.pls", 4, 0);
+  if (transport != NULL) {
+    CHECK(p->error && !p->end);
+    check_bytes(p, ranked, 3);
+    check_fallbacks(transport, (const int[]){THIRD, FOURTH}, 2);
+    for (size_t i = 0; i < 3; i++) CHECK(atomic_load(&requested[ranked[i]]) == 1);
+    CHECK(atomic_load(&requested[FOURTH]) == 0);
+    const char *error = ASTransportError(transport);
+    CHECK(error != NULL && strstr(error, "lost") != NULL);
+    ASTransportClose(transport);
+  }
+
+  /* A runner-up's response is checked when it takes over, before anything
+     is read from it, and an error page makes way for the next */
+  const int rejected[] = {DYING, SECOND};
+  transport = play(client, p, "/rejected.m3u", 3, 0);
+  if (transport != NULL) {
+    CHECK(p->error && !p->end);
+    check_bytes(p, rejected, 2);
+    CHECK(atomic_load(&requested[PAGE]) == 1 && !p->seen[PAGE]);
+    CHECK(ASStationTransportFallbackCount(transport) == 0);
+    ASTransportClose(transport);
+  }
+  free(p);
+}
+
+static void test_bad_mirrors(http_client_t *client) {
+  /* A 404 and an error page lose to the mirror after them */
+  playback_t p;
+  transport_t *transport = play(client, &p, "/bad.m3u", 2, 0);
+  if (transport != NULL) {
+    CHECK(p.end && !p.error);
+    CHECK(mirror_of(ASStationTransportURL(transport)) == FAST);
+    check_bytes(&p, (const int[]){FAST}, 1);
+    CHECK(ASStationTransportFallbackCount(transport) == 0);
+    ASTransportClose(transport);
+  }
+
+  /* Nothing which can be played, and an https mirror which couldn't be
+     raced to fall back on */
+  transport = play(client, &p, "/allbad.m3u", 2, 0);
+  if (transport != NULL) {
+    CHECK(p.error && p.length == 0);
+    const char *error = ASTransportError(transport);
+    CHECK(error != NULL && strstr(error, "no mirror") != NULL);
+    CHECK(ASTransportStatusCode(transport) == 0);
+    CHECK(ASStationTransportURL(transport) == NULL);
+    CHECK(ASStationTransportFallbackCount(transport) == 1 &&
+          strcmp(ASStationTransportFallback(transport, 0), "https://127.0.0.1:1/secure") == 0);
+    CHECK(!ASStationTransportIsHLS(transport));
+    ASTransportClose(transport);
+  }
+
+  transport = play(client, &p, "/hls.m3u", 2, 0);
+  if (transport != NULL) {
+    CHECK(p.error && ASStationTransportIsHLS(transport));
+    ASTransportClose(transport);
+  }
+  transport = play(client, &p, "/nothing.pls", 2, 0);
+  if (transport != NULL) {
+    CHECK(p.error && !ASStationTransportIsHLS(transport));
+    ASTransportClose(transport);
+  }
+}
+
+int main(void) {
+  uint32_t seed = 24;
+  for (int i = 0; i < kMirrorCount; i++) {
+    for (size_t j = 0; j < mirrors[i].length; j++) {
+      bodies[i][j] = (uint8_t)test_random(&seed);
+    }
+  }
+  server = test_server_start(handle, NULL);
+  CHECK(server != NULL);
+  if (server == NULL) return TEST_RESULT();
+  http_client_t *client = ASHTTPClientCreate();
+
+  test_race(client);
+  test_failover(client);
+  test_bad_mirrors(client);
+
+  ASHTTPClientDestroy(client);
+  test_server_stop(server);
+  return TEST_RESULT();
+}
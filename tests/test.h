@@ -0,0 +1,45 @@
+//
+//  test.h
+//  AudioStreamer
+//
+
+#ifndef AS_TEST_H
+#define AS_TEST_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * What the tests share: a check which reports and counts failures without
+ * stopping, and a seeded random number generator so every run sees the same
+ * data whatever the C library.
+ */
+
+static int testFailures;
+
+#define CHECK(cond)                                                           \
+  do {                                                                        \
+    if (!(cond)) {                                                            \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+      testFailures++;                                                         \
+    }                                                                         \
+  } while (0)
+
+/* Returns from main: 0 if every check passed */
+#define TEST_RESULT() (testFailures == 0 ? 0 : 1)
+
+/* xorshift32. The state must not be 0 */
+static inline uint32_t test_random(uint32_t *state) {
+  uint32_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return *state = x;
+}
+
+/* A random number in [0, n) */
+static inline uint32_t test_random_below(uint32_t *state, uint32_t n) {
+  return test_random(state) % n;
+}
+
+#endif
@@ -0,0 +1,319 @@
+//
+//  test_server.h
+//  AudioStreamer
+//
+
+#ifndef AS_TEST_SERVER_H
+#define AS_TEST_SERVER_H
+
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * A small HTTP/1.1 server on the loopback interface, for testing the
+ * transports against. Each connection gets a thread of its own which reads
+ * requests and hands them to the test's handler, which writes whatever it
+ * likes back and says whether to keep the connection open. The handler runs
+ * on those threads, so several can be in it at once. Connections and
+ * requests are counted, so a test can tell whether the client reused a
+ * connection. A connection which starts with a SOCKS5
+ * greeting gets the SOCKS5 handshake first, as if the server were a proxy
+ * connecting to itself. Handlers can send their bodies under a bandwidth cap
+ * for each response and one shared by all of them, like a server whose
+ * connections are each slow and whose link is slow too.
+ */
+
+#define kTestServerMaxConns 128
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+typedef struct test_request {
+  char     target[1024];    /* as sent, which is a full URL through a proxy */
+  char     path[1024];      /* the path part of it */
+  bool     hasRange;
+  uint64_t rangeStart;
+  uint64_t rangeEnd;        /* inclusive, or UINT64_MAX if open ended */
+  char     ifRange[128];    /* the If-Range header, or empty */
+  unsigned index;           /* of the request on its connection, from 0 */
+  bool     socks;           /* the connection came through a SOCKS5 greeting */
+} test_request_t;
+
+/* Writes the response to fd. Returns whether to read another request from
+   the connection */
+typedef bool (*test_handler)(void *context, int fd, const test_request_t *request);
+
+typedef struct test_server {
+  int          fd;
+  uint16_t     port;
+  test_handler handler;
+  void        *context;
+  pthread_t    listener;
+
+  pthread_mutex_t lock;
+  int          conns[kTestServerMaxConns];
+  pthread_t    threads[kTestServerMaxConns];
+  int          connCount;
+
+  atomic_uint  connections;   /* accepted */
+  atomic_uint  requests;      /* read */
+} test_server_t;
+
+typedef struct test_conn {
+  test_server_t *server;
+  int fd;
+} test_conn_t;
+
+/* Sends all of it, returning false if the other end has gone */
+static inline bool test_send(int fd, const void *data, size_t length) {
+  const uint8_t *p = data;
+  while (length > 0) {
+    ssize_t sent = send(fd, p, length, MSG_NOSIGNAL);
+    if (sent <= 0) return false;
+    p += sent;
+    length -= (size_t)sent;
+  }
+  return true;
+}
+
+static inline bool test_sendf(int fd, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+static inline bool test_sendf(int fd, const char *format, ...) {
+  char text[2048];
+  va_list args;
+  va_start(args, format);
+  int length = vsnprintf(text, sizeof(text), format, args);
+  va_end(args);
+  return length > 0 && test_send(fd, text, (size_t)length);
+}
+
+/* Bandwidth limits for responses sent with test_send_capped: bytes a second
+   for each response, and for all of them together. 0 is no limit */
+typedef struct test_rate_cap {
+  double          perConnection;
+  double          total;
+  pthread_mutex_t lock;
+  double          totalNext;      /* when the shared link is next free */
+} test_rate_cap_t;
+
+#define TEST_RATE_CAP_INIT(perConnection, total) \
+  {(perConnection), (total), PTHREAD_MUTEX_INITIALIZER, 0}
+
+static inline double test_now(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double)now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* Sends all of it 8 KB at a time, each piece waiting for its turn on the
+   response's own link and then on the shared one */
+static inline bool test_send_capped(int fd, const void *data, size_t length,
+                                    test_rate_cap_t *cap) {
+  const uint8_t *p = data;
+  double next = test_now();
+  while (length > 0) {
+    size_t n = length < 8192 ? length : 8192;
+    double start = next;
+    pthread_mutex_lock(&cap->lock);
+    if (cap->total > 0) {
+      if (cap->totalNext > start) start = cap->totalNext;
+      cap->totalNext = start + n / cap->total;
+    }
+    pthread_mutex_unlock(&cap->lock);
+    double wait = start - test_now();
+    if (wait > 0) {
+      struct timespec pause = {(time_t)wait, (long)((wait - (time_t)wait) * 1e9)};
+      nanosleep(&pause, NULL);
+    }
+    if (!test_send(fd, p, n)) return false;
+    next = start + (cap->perConnection > 0 ? n / cap->perConnection : 0);
+    p += n;
+    length -= n;
+  }
+  return true;
+}
+
+static inline bool test_recv_exact(int fd, uint8_t *p, size_t length) {
+  while (length > 0) {
+    ssize_t got = recv(fd, p, length, 0);
+    if (got <= 0) return false;
+    p += got;
+    length -= (size_t)got;
+  }
+  return true;
+}
+
+/* Answers a SOCKS5 greeting (whose first byte has been read) and connect
+   request, without checking where to */
+static inline bool test_socks_handshake(int fd) {
+  uint8_t b[300];
+  if (!test_recv_exact(fd, b, 1) || !test_recv_exact(fd, b + 1, b[0])) return false;
+  if (!test_send(fd, "\x05\x00", 2)) return false;
+  if (!test_recv_exact(fd, b, 4)) return false;
+  size_t address = b[3] == 1 ? 4 : b[3] == 4 ? 16 : 0;
+  if (b[3] == 3) {
+    if (!test_recv_exact(fd, b + 4, 1)) return false;
+    address = b[4];
+  }
+  if (!test_recv_exact(fd, b + 5, address + 2)) return false;
+  return test_send(fd, "\x05\x00\x00\x01\x7F\x00\x00\x01\x00\x50", 10);
+}
+
+static inline void test_parse_request(const char *head, test_request_t *request) {
+  sscanf(head, "GET %1023s", request->target);
+  const char *path = request->target;
+  if (strncmp(path, "http://", 7) == 0) {
+    path = strchr(path + 7, '/');
+    if (path == NULL) path = "/";
+  }
+  snprintf(request->path, sizeof(request->path), "%s", path);
+  request->hasRange = false;
+  request->ifRange[0] = '\0';
+  for (const char *line = strchr(head, '\n'); line != NULL;
+       line = strchr(line + 1, '\n')) {
+    if (strncasecmp(line + 1, "Range: bytes=", 13) == 0) {
+      unsigned long long start, end;
+      int fields = sscanf(line + 14, "%llu-%llu", &start, &end);
+      if (fields >= 1) {
+        request->hasRange = true;
+        request->rangeStart = start;
+        request->rangeEnd = fields == 2 ? end : UINT64_MAX;
+      }
+    } else if (strncasecmp(line + 1, "If-Range: ", 10) == 0) {
+      sscanf(line + 11, "%127[^\r\n]", request->ifRange);
+    }
+  }
+}
+
+/* Where the blank line ending a request's head is, or NULL */
+static inline char *test_find_head_end(char *p, size_t length) {
+  for (size_t i = 0; i + 4 <= length; i++) {
+    if (memcmp(p + i, "\r\n\r\n", 4) == 0) return p + i;
+  }
+  return NULL;
+}
+
+static void *test_conn_thread(void *arg) {
+  test_conn_t *conn = arg;
+  test_server_t *server = conn->server;
+  int fd = conn->fd;
+  free(conn);
+
+  char head[8192];
+  size_t length = 0;
+  test_request_t request = {0};
+  uint8_t first;
+  if (recv(fd, &first, 1, MSG_PEEK) == 1 && first == 0x05) {
+    recv(fd, &first, 1, 0);
+    if (!test_socks_handshake(fd)) return NULL;
+    request.socks = true;
+  }
+  for (;;) {
+    char *end;
+    while ((end = test_find_head_end(head, length)) == NULL) {
+      if (length == sizeof(head) - 1) return NULL;
+      ssize_t got = recv(fd, head + length, sizeof(head) - 1 - length, 0);
+      if (got <= 0) return NULL;
+      length += (size_t)got;
+    }
+    size_t headLength = (size_t)(end - head) + 4;
+    char saved = head[headLength];
+    head[headLength] = '\0';
+    test_parse_request(head, &request);
+    head[headLength] = saved;
+    memmove(head, head + headLength, length - headLength);
+    length -= headLength;
+
+    atomic_fetch_add(&server->requests, 1);
+    if (!server->handler(server->context, fd, &request)) break;
+    request.index++;
+  }
+  shutdown(fd, SHUT_RDWR);
+  return NULL;
+}
+
+static void *test_listener_thread(void *arg) {
+  test_server_t *server = arg;
+  for (;;) {
+    int fd = accept(server->fd, NULL, NULL);
+    if (fd < 0) return NULL;
+    pthread_mutex_lock(&server->lock);
+    test_conn_t *conn = malloc(sizeof(test_conn_t));
+    if (server->connCount == kTestServerMaxConns || conn == NULL) {
+      pthread_mutex_unlock(&server->lock);
+      free(conn);
+      close(fd);
+      continue;
+    }
+    atomic_fetch_add(&server->connections, 1);
+    conn->server = server;
+    conn->fd = fd;
+    server->conns[server->connCount] = fd;
+    pthread_create(&server->threads[server->connCount], NULL, test_conn_thread, conn);
+    server->connCount++;
+    pthread_mutex_unlock(&server->lock);
+  }
+}
+
+/* Starts listening on a free loopback port. Returns NULL on failure */
+static inline test_server_t *test_server_start(test_handler handler, void *context) {
+  signal(SIGPIPE, SIG_IGN);
+  test_server_t *server = calloc(1, sizeof(test_server_t));
+  server->handler = handler;
+  server->context = context;
+  pthread_mutex_init(&server->lock, NULL);
+  server->fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in address = {
+    .sin_family = AF_INET,
+    .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+  };
+  socklen_t size = sizeof(address);
+  if (server->fd < 0 ||
+      bind(server->fd, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+      listen(server->fd, 64) != 0 ||
+      getsockname(server->fd, (struct sockaddr *)&address, &size) != 0) {
+    if (server->fd >= 0) close(server->fd);
+    free(server);
+    return NULL;
+  }
+  server->port = ntohs(address.sin_port);
+  pthread_create(&server->listener, NULL, test_listener_thread, server);
+  return server;
+}
+
+/* Makes the URL of a path on the server */
+static inline const char *test_server_url(const test_server_t *server,
+                                          const char *path) {
+  static char url[1100];
+  snprintf(url, sizeof(url), "http://127.0.0.1:%u%s", server->port, path);
+  return url;
+}
+
+/* Closes every connection and waits for their threads */
+static inline void test_server_stop(test_server_t *server) {
+  shutdown(server->fd, SHUT_RDWR);
+  pthread_join(server->listener, NULL);
+  close(server->fd);
+  for (int i = 0; i < server->connCount; i++) {
+    shutdown(server->conns[i], SHUT_RDWR);
+    pthread_join(server->threads[i], NULL);
+    close(server->conns[i]);
+  }
+  pthread_mutex_destroy(&server->lock);
+  free(server);
+}
+
+#endif
@@ -0,0 +1,426 @@
+//
+//  test_streams.h
+//  AudioStreamer
+//
+
+#ifndef AS_TEST_STREAMS_H
+#define AS_TEST_STREAMS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "test.h"
+
+/*
+ * Writers for streams the parsers can be tested on: MP3 frames, ADTS frames,
+ * ID3v2 tags, MP4 boxes and MPEG-2 transport streams. Frame payloads are
+ * random but never hold 0xFF, so they can't contain a false sync word and the
+ * frames the parsers ought to find are known exactly.
+ */
+
+static inline void test_fill_payload(uint8_t *p, size_t length, uint32_t *seed) {
+  for (size_t i = 0; i < length; i++) {
+    p[i] = (uint8_t)test_random_below(seed, 0xFF);
+  }
+}
+
+/* CRC-16 with polynomial 0x8005, bit by bit, as MPEG audio uses it */
+static inline uint16_t test_crc16(uint16_t crc, const uint8_t *data, size_t length) {
+  for (size_t i = 0; i < length; i++) {
+    crc ^= (uint16_t)(data[i] << 8);
+    for (int b = 0; b < 8; b++) {
+      crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x8005) : (uint16_t)(crc << 1);
+    }
+  }
+  return crc;
+}
+
+typedef struct test_mp3_frame {
+  bool     mpeg1;        /* MPEG 1, otherwise MPEG 2 */
+  uint8_t  rateIndex;    /* 0: 44.1/22.05 kHz, 1: 48/24, 2: 32/16 */
+  uint8_t  bitrateIndex; /* 0 for free format */
+  bool     padding;
+  bool     crc;
+  bool     mono;
+  uint32_t freeLength;   /* frame length without padding, if free format */
+} test_mp3_frame_t;
+
+static inline size_t test_mp3_frame_length(const test_mp3_frame_t *f) {
+  static const uint16_t bitrates[2][15] = {
+    {0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320},
+    {0,  8, 16, 24, 32, 40, 48, 56,  64,  80,  96, 112, 128, 144, 160}
+  };
+  static const uint32_t rates[2][3] = {{22050, 24000, 16000}, {44100, 48000, 32000}};
+  if (f->bitrateIndex == 0) return f->freeLength + f->padding;
+  uint32_t bitrate = bitrates[f->mpeg1 ? 0 : 1][f->bitrateIndex] * 1000u;
+  return (f->mpeg1 ? 144 : 72) * bitrate / rates[f->mpeg1][f->rateIndex] + f->padding;
+}
+
+/* Writes one Layer III frame at p and returns its length. With a CRC, the
+   CRC is right unless badCRC is set */
+static inline size_t test_write_mp3_frame(uint8_t *p, const test_mp3_frame_t *f,
+                                          bool badCRC, uint32_t *seed) {
+  size_t length = test_mp3_frame_length(f);
+  p[0] = 0xFF;
+  p[1] = (uint8_t)(0xE0 | (f->mpeg1 ? 0x18 : 0x10) | 0x02 | (f->crc ? 0 : 1));
+  p[2] = (uint8_t)((f->bitrateIndex << 4) | (f->rateIndex << 2) | (f->padding << 1));
+  p[3] = f->mono ? 0xC4 : 0x44;
+  test_fill_payload(p + 4, length - 4, seed);
+  if (f->crc) {
+    size_t side = f->mpeg1 ? (f->mono ? 17 : 32) : (f->mono ? 9 : 17);
+    uint16_t crc = test_crc16(0xFFFF, p + 2, 2);
+    crc = test_crc16(crc, p + 6, side);
+    if (badCRC) crc ^= 0x1234;
+    p[4] = (uint8_t)(crc >> 8);
+    p[5] = (uint8_t)crc;
+  }
+  return length;
+}
+
+/* Writes a frame holding a Xing header instead of audio */
+static inline size_t test_write_xing_frame(uint8_t *p, const test_mp3_frame_t *f,
+                                           uint32_t *seed) {
+  size_t length = test_write_mp3_frame(p, f, false, seed);
+  size_t side = f->mpeg1 ? (f->mono ? 17 : 32) : (f->mono ? 9 : 17);
+  memset(p + 4, 0, side);
+  memcpy(p + 4 + (f->crc ? 2 : 0) + side, "Xing", 4);
+  return length;
+}
+
+/* Writes one ADTS frame with a single raw data block and no CRC. Returns its
+   length, which is headerless payload + 7 */
+static inline size_t test_write_adts_frame(uint8_t *p, size_t payload,
+                                           uint8_t rateIndex, uint8_t channels,
+                                           uint32_t *seed) {
+  size_t length = payload + 7;
+  p[0] = 0xFF;
+  p[1] = 0xF1;                                      /* MPEG-4, no CRC */
+  p[2] = (uint8_t)(0x40 | (rateIndex << 2) | (channels >> 2));  /* AAC LC */
+  p[3] = (uint8_t)(((channels & 0x3) << 6) | ((length >> 11) & 0x3));
+  p[4] = (uint8_t)(length >> 3);
+  p[5] = (uint8_t)(((length & 0x7) << 5) | 0x1F);
+  p[6] = 0xFC;
+  test_fill_payload(p + 7, payload, seed);
+  return length;
+}
+
+/* Writes an ID3v2.3 tag with a body of the given size. Returns its length */
+static inline size_t test_write_id3(uint8_t *p, uint32_t bodySize) {
+  memcpy(p, "ID3\x03\x00\x00", 6);
+  p[6] = (uint8_t)((bodySize >> 21) & 0x7F);
+  p[7] = (uint8_t)((bodySize >> 14) & 0x7F);
+  p[8] = (uint8_t)((bodySize >> 7) & 0x7F);
+  p[9] = (uint8_t)(bodySize & 0x7F);
+  /* Padding, with a false sync word in it for good measure */
+  memset(p + 10, 0, bodySize);
+  if (bodySize >= 4) memcpy(p + 10, "\xFF\xFB\x90\x44", 4);
+  return 10 + bodySize;
+}
+
+/* MP4 boxes, written into a buffer the caller owns, with each box's size
+   filled in when it's ended */
+typedef struct test_boxes {
+  uint8_t *data;
+  size_t   length;
+  size_t   open[8];      /* where the boxes being written start */
+  int      depth;
+} test_boxes_t;
+
+static inline void test_put32(test_boxes_t *w, uint32_t value) {
+  for (int i = 3; i >= 0; i--) w->data[w->length++] = (uint8_t)(value >> (8 * i));
+}
+
+static inline void test_put64(test_boxes_t *w, uint64_t value) {
+  test_put32(w, (uint32_t)(value >> 32));
+  test_put32(w, (uint32_t)value);
+}
+
+static inline void test_put_bytes(test_boxes_t *w, const void *bytes, size_t length) {
+  memcpy(w->data + w->length, bytes, length);
+  w->length += length;
+}
+
+static inline void test_box_begin(test_boxes_t *w, const char *type) {
+  w->open[w->depth++] = w->length;
+  test_put32(w, 0);
+  test_put_bytes(w, type, 4);
+}
+
+static inline void test_box_end(test_boxes_t *w) {
+  size_t start = w->open[--w->depth];
+  size_t size = w->length - start;
+  for (int i = 0; i < 4; i++) w->data[start + i] = (uint8_t)(size >> (24 - 8 * i));
+}
+
+/* A box of the given type with a payload that means nothing */
+static inline void test_box_filler(test_boxes_t *w, const char *type, size_t length) {
+  test_box_begin(w, type);
+  memset(w->data + w->length, 0xAB, length);
+  w->length += length;
+  test_box_end(w);
+}
+
+/* A box with only a version and flags, and whatever's put in it after */
+static inline void test_full_box_begin(test_boxes_t *w, const char *type,
+                                       uint8_t version, uint32_t flags) {
+  test_box_begin(w, type);
+  test_put32(w, ((uint32_t)version << 24) | flags);
+}
+
+/* Transport stream PIDs the writer below uses */
+#define kTestPMTPID   0x1000
+#define kTestVideoPID 0x100
+#define kTestAudioPID 0x101
+#define kTestID3PID   0x102
+
+/* Writes a transport stream packet with up to 184 bytes of payload,
+   stuffing the adaptation field to fill it. Returns how much payload fit */
+static inline size_t test_write_ts_packet(uint8_t *p, unsigned pid, bool unitStart,
+                                          unsigned *counter, const uint8_t *payload,
+                                          size_t length) {
+  size_t n = length < 184 ? length : 184;
+  p[0] = 0x47;
+  p[1] = (uint8_t)((unitStart ? 0x40 : 0) | (pid >> 8));
+  p[2] = (uint8_t)pid;
+  size_t start = 4;
+  if (n < 184) {
+    p[3] = (uint8_t)(0x30 | (*counter & 0x0F));
+    p[4] = (uint8_t)(183 - n);
+    if (n < 183) {
+      p[5] = 0;
+      memset(p + 6, 0xFF, 183 - n - 1);
+    }
+    start = 188 - n;
+  } else {
+    p[3] = (uint8_t)(0x10 | (*counter & 0x0F));
+  }
+  (*counter)++;
+  memcpy(p + start, payload, n);
+  return n;
+}
+
+/* Writes a table section, with its CRC left as zero, in a packet of its own */
+static inline size_t test_write_ts_table(uint8_t *p, unsigned pid, uint8_t tableID,
+                                         const uint8_t *body, size_t length) {
+  uint8_t section[184] = {0, tableID};
+  size_t sectionLength = 5 + length + 4;
+  section[2] = (uint8_t)(0xB0 | (sectionLength >> 8));
+  section[3] = (uint8_t)sectionLength;
+  section[4] = 0x00;
+  section[5] = 0x01;
+  section[6] = 0xC1;
+  memcpy(section + 9, body, length);
+  unsigned counter = 0;
+  test_write_ts_packet(p, pid, true, &counter, section, 1 + 3 + sectionLength);
+  return 188;
+}
+
+/* Writes a PES packet as transport stream packets. Returns their length */
+static inline size_t test_write_pes(uint8_t *p, unsigned pid, unsigned *counter,
+                                    const uint8_t *data, size_t length) {
+  uint8_t pes[14 + 65536];
+  size_t pesLength = 14 + length;
+  memcpy(pes, "\x00\x00\x01\xC0", 4);
+  pes[4] = (uint8_t)((pesLength - 6) >> 8);
+  pes[5] = (uint8_t)(pesLength - 6);
+  pes[6] = 0x80;
+  pes[7] = 0x80;                                  /* a PTS */
+  pes[8] = 5;
+  memcpy(pes + 9, "\x21\x00\x01\x00\x01", 5);
+  memcpy(pes + 14, data, length);
+  size_t written = 0, sent = 0;
+  while (sent < pesLength) {
+    sent += test_write_ts_packet(p + written, pid, sent == 0, counter, pes + sent,
+                                 pesLength - sent);
+    written += 188;
+  }
+  return written;
+}
+
+/* Writes a transport stream segment holding the audio in PES packets of at
+   most pesSize bytes, as a stream of the given type (0x0F for ADTS, 0x03 or
+   0x04 for MPEG audio). The map lists a video stream and timed ID3 metadata
+   ahead of the audio, and their packets, and ones with only an adaptation
+   field, come after every fourth of the audio's. Returns the segment's
+   length */
+static inline size_t test_write_ts(uint8_t *p, uint8_t streamType, const uint8_t *audio,
+                                   size_t length, size_t pesSize, uint32_t *seed) {
+  static const uint8_t pat[] = {0x00, 0x00, 0xE0, 0x10,     /* network */
+                                0x00, 0x01, 0xF0, 0x00};    /* program 1 */
+  uint8_t pmt[] = {
+    0xE1, 0x00, 0xF0, 0x00,                       /* PCR PID, no program info */
+    0x1B, 0xE1, 0x00, 0xF0, 0x00,                 /* H.264 */
+    0x15, 0xE1, 0x02, 0xF0, 0x03, 0x0A, 0x01, 0x00,  /* ID3, with a descriptor */
+    streamType, 0xE1, 0x01, 0xF0, 0x00,
+  };
+  size_t written = test_write_ts_table(p, 0, 0x00, pat, sizeof(pat));
+  written += test_write_ts_table(p + written, kTestPMTPID, 0x02, pmt, sizeof(pmt));
+  unsigned audioCounter = 0, videoCounter = 0, id3Counter = 0;
+  uint8_t other[400];
+  size_t sent = 0;
+  for (unsigned pes = 0; sent < length; pes++) {
+    size_t n = length - sent < pesSize ? length - sent : pesSize;
+    written += test_write_pes(p + written, kTestAudioPID, &audioCounter, audio + sent, n);
+    sent += n;
+    if (pes % 4 != 0) continue;
+    test_fill_payload(other, sizeof(other), seed);
+    written += test_write_pes(p + written, kTestVideoPID, &videoCounter, other,
+                              test_random_below(seed, sizeof(other)));
+    written += test_write_pes(p + written, kTestID3PID, &id3Counter, other, 30);
+    /* A packet with nothing but a PCR */
+    p[written] = 0x47;
+    p[written + 1] = kTestAudioPID >> 8;
+    p[written + 2] = kTestAudioPID & 0xFF;
+    p[written + 3] = (uint8_t)(0x20 | (audioCounter & 0x0F));
+    p[written + 4] = 183;
+    p[written + 5] = 0x10;
+    memset(p + written + 6, 0xFF, 182);
+    written += 188;
+  }
+  return written;
+}
+
+/* The codecs a fragmented MP4 writer's track can have */
+typedef enum test_fmp4_codec {
+  TEST_FMP4_AAC,          /* AAC LC, 44.1 kHz stereo */
+  TEST_FMP4_MP3,
+} test_fmp4_codec_t;
+
+/* Writes the moov of a fragmented MP4 file: a video track, then the sound
+   track with the given ID, and a trex giving its samples a default size */
+static inline void test_write_fmp4_moov(test_boxes_t *w, test_fmp4_codec_t codec,
+                                        uint32_t trackID, uint32_t defaultSize) {
+  test_box_begin(w, "moov");
+  test_box_filler(w, "mvhd", 100);
+  for (int sound = 0; sound < 2; sound++) {
+    test_box_begin(w, "trak");
+    /* The sound track's tkhd is version 1, with 64-bit times */
+    test_full_box_begin(w, "tkhd", (uint8_t)sound, 3);
+    if (sound) {
+      test_put64(w, 0);
+      test_put64(w, 0);
+    } else {
+      test_put32(w, 0);
+      test_put32(w, 0);
+    }
+    test_put32(w, sound ? trackID : trackID + 1);
+    memset(w->data + w->length, 0, 64);
+    w->length += 64;
+    test_box_end(w);
+    test_box_begin(w, "mdia");
+    test_box_filler(w, "mdhd", 24);
+    test_full_box_begin(w, "hdlr", 0, 0);
+    test_put32(w, 0);
+    test_put_bytes(w, sound ? "soun" : "vide", 4);
+    test_put32(w, 0);
+    test_put32(w, 0);
+    test_put32(w, 0);
+    test_put_bytes(w, "", 1);
+    test_box_end(w);
+    test_box_begin(w, "minf");
+    test_box_begin(w, "stbl");
+    test_full_box_begin(w, "stsd", 0, 0);
+    test_put32(w, 1);
+    if (!sound) {
+      test_box_filler(w, "avc1", 90);
+    } else {
+      test_box_begin(w, "mp4a");
+      static const uint8_t entry[28] = {
+        0, 0, 0, 0, 0, 0, 0, 1,                   /* data reference 1 */
+        0, 0, 0, 0, 0, 0, 0, 0,
+        0, 2, 0, 16, 0, 0, 0, 0,                  /* stereo, 16 bits */
+        0xAC, 0x44, 0, 0,                         /* 44100 Hz */
+      };
+      test_put_bytes(w, entry, sizeof(entry));
+      test_full_box_begin(w, "esds", 0, 0);
+      bool aac = codec == TEST_FMP4_AAC;
+      /* The ES descriptor's length as four bytes, as some muxers write it */
+      size_t decoderLength = 13 + (aac ? 4 : 0);
+      size_t esLength = 3 + 2 + decoderLength + 3;
+      const uint8_t es[] = {0x03, 0x80, 0x80, 0x80, (uint8_t)esLength, 0x00, 0x01, 0x00,
+                            0x04, (uint8_t)decoderLength, aac ? 0x40 : 0x6B, 0x15,
+                            0, 0, 0, 0, 0x01, 0xF4, 0, 0, 0x01, 0xF4, 0};
+      test_put_bytes(w, es, sizeof(es));
+      /* AudioSpecificConfig: object type 2, 44.1 kHz, two channels */
+      if (aac) test_put_bytes(w, "\x05\x02\x12\x10", 4);
+      test_put_bytes(w, "\x06\x01\x02", 3);
+      test_box_end(w);
+      test_box_end(w);
+    }
+    test_box_end(w);
+    test_box_end(w);
+    test_box_end(w);
+    test_box_end(w);
+    test_box_end(w);
+  }
+  test_box_begin(w, "mvex");
+  for (int sound = 0; sound < 2; sound++) {
+    test_full_box_begin(w, "trex", 0, 0);
+    test_put32(w, sound ? trackID : trackID + 1);
+    test_put32(w, 1);
+    test_put32(w, 1024);
+    test_put32(w, sound ? defaultSize : 999);
+    test_put32(w, 0);
+    test_box_end(w);
+  }
+  test_box_end(w);
+  test_box_end(w);
+}
+
+/* Writes a moof and its mdat holding the samples. A traf for the video
+   track comes first. Unless fileOffset (where the writer's data starts in
+   the file) is UINT64_MAX, the tfhd gives the moof's place in the file as
+   the base the trun's data offset counts from; otherwise it's the moof by
+   default. With defaultSizes, the trun leaves out the sizes, which must all
+   be the trex's default */
+static inline void test_write_fmp4_fragment(test_boxes_t *w, uint32_t trackID,
+                                            const uint8_t *const *samples,
+                                            const size_t *sizes, size_t count,
+                                            bool defaultSizes, uint64_t fileOffset) {
+  size_t moofStart = w->length;
+  test_box_begin(w, "moof");
+  test_full_box_begin(w, "mfhd", 0, 0);
+  test_put32(w, 1);
+  test_box_end(w);
+
+  test_box_begin(w, "traf");
+  test_full_box_begin(w, "tfhd", 0, 0x020000);  /* default base is moof */
+  test_put32(w, trackID + 1);
+  test_box_end(w);
+  test_full_box_begin(w, "trun", 0, 0x000201);
+  test_put32(w, 1);
+  test_put32(w, 0);                               /* points at nothing useful */
+  test_put32(w, 100);
+  test_box_end(w);
+  test_box_end(w);
+
+  test_box_begin(w, "traf");
+  bool based = fileOffset != UINT64_MAX;
+  test_full_box_begin(w, "tfhd", 0, based ? 0x000001 : 0x020000);
+  test_put32(w, trackID);
+  if (based) test_put64(w, fileOffset + moofStart);
+  test_box_end(w);
+  test_full_box_begin(w, "trun", 0, 0x000101 | (defaultSizes ? 0 : 0x000200));
+  test_put32(w, (uint32_t)count);
+  size_t offsetAt = w->length;
+  test_put32(w, 0);
+  for (size_t i = 0; i < count; i++) {
+    test_put32(w, 1024);
+    if (!defaultSizes) test_put32(w, (uint32_t)sizes[i]);
+  }
+  test_box_end(w);
+  test_box_end(w);
+  test_box_end(w);
+
+  size_t dataOffset = w->length - moofStart + 8;
+  for (int i = 0; i < 4; i++) {
+    w->data[offsetAt + i] = (uint8_t)(dataOffset >> (24 - 8 * i));
+  }
+  test_box_begin(w, "mdat");
+  for (size_t i = 0; i < count; i++) test_put_bytes(w, samples[i], sizes[i]);
+  test_box_end(w);
+}
+
+#endif
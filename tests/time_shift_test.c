@@ -0,0 +1,156 @@
+//
+//  time_shift_test.c
+//  AudioStreamer
+//
+//  What ASTimeShift keeps of a live stream: every packet appended, each in
+//  one piece, until going round the file's byte ring or running out of
+//  descriptors overwrites the oldest, and no more of them dropped than that.
+//  Sample times add up from packet 0, and the packet playing at any time is
+//  found within what's held. The file itself is gone from the directory as
+//  soon as it's made.
+//
+
+#include "ASTimeShift.h"
+#include "test.h"
+
+#include <dirent.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define kPackets 40000
+#define kMaxPacket 3000
+
+/* Descriptors the recording has for a capacity; see ASTimeShift.c */
+static uint64_t descriptors_for(size_t capacity) {
+  return capacity / 128 > 1024 ? capacity / 128 : 1024;
+}
+
+static uint8_t packet_byte(uint64_t number, uint32_t i) {
+  return (uint8_t)(number * 31 + i * 7 + (i >> 8));
+}
+
+/* What was appended, and where it should have gone in the byte ring,
+   counting from its start */
+static uint64_t positions[kPackets + 1];
+static uint64_t sampleTimes[kPackets + 1];
+static uint32_t sizes[kPackets];
+
+static bool packet_intact(const time_shift_t *ts, uint64_t n) {
+  time_shift_packet_t packet;
+  if (!ASTimeShiftPacket(ts, n, &packet) || packet.byteSize != sizes[n] ||
+      packet.sampleTime != sampleTimes[n]) {
+    return false;
+  }
+  const uint8_t *data = packet.data;
+  for (uint32_t i = 0; i < sizes[n]; i++) {
+    if (data[i] != packet_byte(n, i)) return false;
+  }
+  return true;
+}
+
+/* Appends packets of sizes drawn from the range, checking after each that
+   exactly the packets which fit are held */
+static void record(size_t capacity, uint32_t minSize, uint32_t maxSize,
+                   uint32_t framesPerPacket, uint32_t seed) {
+  char directory[] = "/tmp/time_shift_test.XXXXXX";
+  if (mkdtemp(directory) == NULL) {
+    perror("mkdtemp");
+    testFailures++;
+    return;
+  }
+  time_shift_t *ts = ASTimeShiftCreate(directory, capacity, framesPerPacket);
+  CHECK(ts != NULL);
+  /* Nothing is left behind, even while it's open */
+  CHECK(rmdir(directory) == 0);
+  if (ts == NULL) return;
+
+  uint64_t found;
+  CHECK(!ASTimeShiftFind(ts, 0, &found));
+  CHECK(ASTimeShiftBytesFrom(ts, 0) == 0);
+  CHECK(!ASTimeShiftAppend(ts, NULL, (uint32_t)capacity + 1, 0));
+  CHECK(ASTimeShiftEnd(ts) == 0);
+
+  uint64_t descriptorCount = descriptors_for(capacity);
+  static uint8_t data[kMaxPacket];
+  uint64_t first = 0;
+  bool wrapped = false, ranOut = false;
+  for (uint64_t n = 0; n < kPackets; n++) {
+    uint32_t size = minSize + test_random_below(&seed, maxSize - minSize + 1);
+    uint32_t frames = framesPerPacket == 0 ? 1 + test_random_below(&seed, 2000)
+                                           : 0;
+    for (uint32_t i = 0; i < size; i++) data[i] = packet_byte(n, i);
+    CHECK(ASTimeShiftAppend(ts, data, size, frames));
+
+    /* Packets don't straddle the end of the ring */
+    uint64_t position = positions[n];
+    if (position % capacity + size > capacity) {
+      position += capacity - position % capacity;
+      wrapped = true;
+    }
+    positions[n] = position;
+    positions[n + 1] = position + size;
+    sizes[n] = size;
+    sampleTimes[n + 1] = sampleTimes[n] + (frames > 0 ? frames : framesPerPacket);
+
+    /* The oldest held is the oldest which still fits */
+    while (positions[n + 1] - positions[first] > capacity ||
+           n + 1 - first > descriptorCount) {
+      if (n + 1 - first > descriptorCount) ranOut = true;
+      first++;
+    }
+    CHECK(ASTimeShiftEnd(ts) == n + 1);
+    CHECK(ASTimeShiftFirst(ts) == first);
+    CHECK(packet_intact(ts, n));
+    CHECK(ASTimeShiftBytesFrom(ts, first) == positions[n + 1] - positions[first]);
+    if (testFailures > 0) {
+      fprintf(stderr, "capacity %zu, packet %llu\n", capacity,
+              (unsigned long long)n);
+      break;
+    }
+
+    /* Now and then, all of it */
+    if (n % 4999 == 0 || n == kPackets - 1) {
+      for (uint64_t p = first; p <= n; p++) CHECK(packet_intact(ts, p));
+      time_shift_packet_t packet;
+      CHECK(first == 0 || !ASTimeShiftPacket(ts, first - 1, &packet));
+      CHECK(!ASTimeShiftPacket(ts, n + 1, &packet));
+      CHECK(ASTimeShiftBytesFrom(ts, 0) == ASTimeShiftBytesFrom(ts, first));
+      CHECK(ASTimeShiftBytesFrom(ts, n + 1) == 0);
+      CHECK(ASTimeShiftBytesFrom(ts, n) == sizes[n]);
+    }
+  }
+  CHECK(wrapped && ASTimeShiftFirst(ts) > 0);
+
+  /* Every time finds the packet playing then, or the oldest or newest */
+  uint64_t end = ASTimeShiftEnd(ts);
+  for (int i = 0; i < 10000; i++) {
+    uint64_t p = first + test_random_below(&seed, (uint32_t)(end - first));
+    uint64_t length = sampleTimes[p + 1] - sampleTimes[p];
+    uint64_t time = sampleTimes[p] + test_random_below(&seed, (uint32_t)length);
+    CHECK(ASTimeShiftFind(ts, time, &found) && found == p);
+  }
+  CHECK(ASTimeShiftFind(ts, 0, &found) && found == first);
+  CHECK(ASTimeShiftFind(ts, sampleTimes[first] - 1, &found) && found == first);
+  CHECK(ASTimeShiftFind(ts, UINT64_MAX, &found) && found == end - 1);
+  if (testFailures > 0) {
+    fprintf(stderr, "capacity %zu, %s\n", capacity,
+            ranOut ? "out of descriptors" : "out of bytes");
+  }
+  ASTimeShiftDestroy(ts);
+}
+
+int main(void) {
+  CHECK(ASTimeShiftCreate("/tmp", 0, 1152) == NULL);
+  CHECK(ASTimeShiftCreate("/nonexistent/directory", 1 << 20, 1152) == NULL);
+
+  /* Held back by the byte ring, with fixed and variable frames */
+  record(1 << 20, 200, kMaxPacket, 1152, 1);
+  record(100000, 1, kMaxPacket, 0, 2);
+  /* and by the descriptors, with packets smaller than they're made for */
+  record(1 << 20, 1, 64, 1024, 3);
+  record(50000, 1, 20, 0, 4);
+  /* Packets the size of the whole ring */
+  record(kMaxPacket, kMaxPacket - 10, kMaxPacket, 1152, 5);
+  return TEST_RESULT();
+}